@@ -21,6 +21,16 @@
  */
 #define RR_MAGIC_SAVE_DATA_FD 999
 
+/**
+ * rr tracees can write a name to this special fd, in a single write(), to
+ * mark the current point in the recording, e.g. the start of a test case.
+ * rr keeps an index of the markers, so replay can seek straight to one
+ * with `rr replay --goto-marker=NAME' or gdb's `seek-marker NAME'.
+ *
+ * Like RR_MAGIC_SAVE_DATA_FD, this is a valid fd opened to /dev/null.
+ */
+#define RR_MAGIC_MARKER_FD 998
+
 /**
  * rr uses this fd to ensure the tracee has access to the original root
  * directory after a chroot(). Tracee close()es of this fd will be silently
@@ -4,9 +4,11 @@
 
 #include <limits.h>
 #include <linux/kdev_t.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
 
 #include "rr/rr.h"
@@ -14,6 +16,8 @@
 #include "preload/preload_interface.h"
 
 #include "AutoRemoteSyscalls.h"
+#include "Flags.h"
+#include "kernel_metadata.h"
 #include "log.h"
 #include "RecordSession.h"
 #include "RecordTask.h"
@@ -65,8 +69,15 @@ public:
   }
   bool at_end() { return !maps_file; }
   void operator++();
+  /**
+   * Advance to the first mapping that ends after |addr|. Lines before it
+   * only have their end address parsed.
+   */
+  void skip_to(remote_ptr<void> addr);
 
 private:
+  void parse_line(char* line);
+
   Task* t;
   FILE* maps_file;
   string raw_line;
@@ -80,7 +91,28 @@ void KernelMapIterator::operator++() {
     maps_file = nullptr;
     return;
   }
+  parse_line(line);
+}
+
+void KernelMapIterator::skip_to(remote_ptr<void> addr) {
+  if (at_end() || km.end() > addr) {
+    return;
+  }
+  char line[PATH_MAX * 2];
+  while (fgets(line, sizeof(line), maps_file)) {
+    char* dash;
+    strtoull(line, &dash, 16);
+    ASSERT(t, *dash == '-');
+    if (strtoull(dash + 1, nullptr, 16) > addr.as_int()) {
+      parse_line(line);
+      return;
+    }
+  }
+  fclose(maps_file);
+  maps_file = nullptr;
+}
 
+void KernelMapIterator::parse_line(char* line) {
   uint64_t start, end, offset, inode;
   int dev_major, dev_minor;
   char flags[32];
@@ -126,14 +158,65 @@ void KernelMapIterator::operator++() {
                      f, offset);
 }
 
+/**
+ * Ask the kernel for just the mapping containing |addr|, with the
+ * PROCMAP_QUERY ioctl. Returns false if the kernel doesn't support that, in
+ * which case we have to parse /proc/<pid>/maps.
+ */
+static bool query_kernel_mapping(Task* t, remote_ptr<void> addr,
+                                 KernelMapping* km) {
+  static bool procmap_query_unsupported = false;
+  if (procmap_query_unsupported) {
+    return false;
+  }
+  char maps_path[PATH_MAX];
+  sprintf(maps_path, "/proc/%d/maps", t->tid);
+  ScopedFd fd(maps_path, O_RDONLY);
+  ASSERT(t, fd.is_open()) << "Failed to open " << maps_path;
+
+  char name[PATH_MAX];
+  rr_procmap_query q;
+  memset(&q, 0, sizeof(q));
+  q.size = sizeof(q);
+  q.query_addr = addr.as_int();
+  q.vma_name_addr = reinterpret_cast<uintptr_t>(name);
+  q.vma_name_size = sizeof(name);
+  if (ioctl(fd, RR_PROCMAP_QUERY, &q) < 0) {
+    if (errno == ENOENT) {
+      *km = KernelMapping();
+      return true;
+    }
+    ASSERT(t, errno == ENOTTY || errno == EINVAL)
+        << "PROCMAP_QUERY failed with errno " << errno_name(errno);
+    procmap_query_unsupported = true;
+    return false;
+  }
+  if (!q.vma_name_size) {
+    name[0] = 0;
+  }
+  int prot = (q.vma_flags & RR_PROCMAP_QUERY_VMA_READABLE ? PROT_READ : 0) |
+             (q.vma_flags & RR_PROCMAP_QUERY_VMA_WRITABLE ? PROT_WRITE : 0) |
+             (q.vma_flags & RR_PROCMAP_QUERY_VMA_EXECUTABLE ? PROT_EXEC : 0);
+  int flags =
+      q.vma_flags & RR_PROCMAP_QUERY_VMA_SHARED ? MAP_SHARED : MAP_PRIVATE;
+  *km = KernelMapping(q.vma_start, q.vma_end, name,
+                      MKDEV(q.dev_major, q.dev_minor), q.inode, prot, flags,
+                      q.vma_offset);
+  return true;
+}
+
 KernelMapping AddressSpace::read_kernel_mapping(Task* t,
                                                 remote_ptr<void> addr) {
-  MemoryRange range(addr, 1);
-  for (KernelMapIterator it(t); !it.at_end(); ++it) {
-    const KernelMapping& km = it.current();
-    if (km.contains(range)) {
-      return km;
-    }
+  KernelMapping km;
+  if (query_kernel_mapping(t, addr, &km)) {
+    return km;
+  }
+  // Only parse the line that can contain |addr|. /proc/<pid>/maps can be
+  // many MB.
+  KernelMapIterator it(t);
+  it.skip_to(addr);
+  if (!it.at_end() && it.current().contains(MemoryRange(addr, 1))) {
+    return it.current();
   }
   return KernelMapping();
 }
@@ -149,10 +232,55 @@ static void print_process_mmap(Task* t) {
   }
 }
 
-AddressSpace::~AddressSpace() { session_->on_destroy(this); }
+AddressSpace::~AddressSpace() {
+  for (auto& m : *mem) {
+    session_->on_file_mapping_removed(m.second.recorded_map);
+  }
+  for (auto& seg : syscallbuf_pool) {
+    munmap(seg.local, seg.size);
+  }
+  session_->on_destroy(this);
+}
 
 void AddressSpace::after_clone() { allocate_watchpoints(); }
 
+bool AddressSpace::recycle_syscallbuf(const SyscallbufSegment& seg) {
+  if (syscallbuf_pool.size() >= MAX_POOLED_SYSCALLBUFS) {
+    return false;
+  }
+  syscallbuf_pool.push_back(seg);
+  return true;
+}
+
+bool AddressSpace::take_syscallbuf(remote_ptr<void> child,
+                                   SyscallbufSegment* seg) {
+  while (!syscallbuf_pool.empty()) {
+    auto it = syscallbuf_pool.end() - 1;
+    if (!child.is_null()) {
+      it = find_if(
+          syscallbuf_pool.begin(), syscallbuf_pool.end(),
+          [&](const SyscallbufSegment& s) { return s.child == child; });
+      if (it == syscallbuf_pool.end()) {
+        return false;
+      }
+    }
+    SyscallbufSegment s = *it;
+    syscallbuf_pool.erase(it);
+    // The tracee may have unmapped or replaced the segment since its
+    // thread exited.
+    if (has_mapping(s.child)) {
+      const KernelMapping& km = mapping_of(s.child).map;
+      if (km.start() == s.child && km.size() == s.size &&
+          km.inode() == s.inode) {
+        *seg = s;
+        return true;
+      }
+    }
+    munmap(s.local, s.size);
+  }
+  return false;
+}
+
 static remote_ptr<void> find_rr_vdso(Task* t, size_t* len) {
   for (KernelMapIterator it(t); !it.at_end(); ++it) {
     auto& km = it.current();
@@ -233,8 +361,18 @@ void AddressSpace::map_rr_page(Task* t) {
     remote.infallible_mmap_syscall(rr_page_start(), rr_page_size(), prot, flags,
                                    child_fd, 0);
 
-    fstat = t->stat_fd(child_fd);
-    file_name = t->file_name_of_fd(child_fd);
+    // Every exec maps the same few rr page files, so only ask /proc about
+    // each of them once.
+    static std::map<string, pair<struct stat, string>> rr_page_files;
+    auto it = rr_page_files.find(path);
+    if (it == rr_page_files.end()) {
+      it = rr_page_files
+               .insert(make_pair(path, make_pair(t->stat_fd(child_fd),
+                                                 t->file_name_of_fd(child_fd))))
+               .first;
+    }
+    fstat = it->second.first;
+    file_name = it->second.second;
 
     remote.infallible_syscall(syscall_number_for_close(arch), child_fd);
 
@@ -319,7 +457,7 @@ void AddressSpace::brk(remote_ptr<void> addr, int prot) {
 void AddressSpace::dump() const {
   fprintf(stderr, "  (heap: %p-%p)\n", (void*)brk_start.as_int(),
           (void*)brk_end.as_int());
-  for (auto it = mem.begin(); it != mem.end(); ++it) {
+  for (auto it = mem->begin(); it != mem->end(); ++it) {
     const KernelMapping& m = it->second.map;
     fprintf(stderr, "%s\n", m.str().c_str());
   }
@@ -368,6 +506,71 @@ void AddressSpace::replace_breakpoints_with_original_values(
   }
 }
 
+size_t AddressSpace::read_code(Task* t, remote_code_ptr addr, uint8_t* buf,
+                               size_t size) {
+  remote_ptr<uint8_t> p = addr.to_data_ptr<uint8_t>();
+  size_t done = 0;
+  while (done < size) {
+    remote_ptr<uint8_t> line = (p + done).as_int() & ~(CODE_CACHE_LINE - 1);
+    const uint8_t* bytes = cached_code_line(t, line);
+    if (!bytes) {
+      ssize_t nread = t->read_bytes_fallible(p + done, size - done, buf + done);
+      if (nread <= 0) {
+        break;
+      }
+      replace_breakpoints_with_original_values(buf + done, nread, p + done);
+      done += nread;
+      break;
+    }
+    size_t offset = (p + done) - line;
+    size_t n = min(CODE_CACHE_LINE - offset, size - done);
+    memcpy(buf + done, bytes + offset, n);
+    done += n;
+  }
+  return done;
+}
+
+const uint8_t* AddressSpace::cached_code_line(Task* t,
+                                              remote_ptr<void> line) {
+  auto it = code_cache.find(line);
+  if (it != code_cache.end()) {
+    return it->second.data();
+  }
+  if (!has_mapping(line)) {
+    return nullptr;
+  }
+  // The tracee can write to writable or shared memory behind our back.
+  // A line never crosses a page, so it's all in this mapping.
+  const KernelMapping& m = mapping_of(line).map;
+  if ((m.prot() & PROT_WRITE) || !(m.flags() & MAP_PRIVATE)) {
+    return nullptr;
+  }
+  static const size_t MAX_CODE_CACHE_LINES = 4096;
+  if (code_cache.size() >= MAX_CODE_CACHE_LINES) {
+    code_cache.clear();
+  }
+  auto& bytes = code_cache[line];
+  if (t->read_bytes_fallible(line, CODE_CACHE_LINE, bytes.data()) !=
+      (ssize_t)CODE_CACHE_LINE) {
+    code_cache.erase(line);
+    return nullptr;
+  }
+  replace_breakpoints_with_original_values(bytes.data(), CODE_CACHE_LINE,
+                                           remote_ptr<uint8_t>(line.as_int()));
+  return bytes.data();
+}
+
+void AddressSpace::invalidate_code_cache(const MemoryRange& range) {
+  if (code_cache.empty()) {
+    return;
+  }
+  auto it = code_cache.lower_bound(
+      range.start().as_int() & ~(CODE_CACHE_LINE - 1));
+  while (it != code_cache.end() && it->first < range.end()) {
+    it = code_cache.erase(it);
+  }
+}
+
 bool AddressSpace::is_breakpoint_instruction(Task* t, remote_code_ptr ip) {
   bool ok = true;
   return t->read_mem(ip.to_data_ptr<uint8_t>(), &ok) == breakpoint_insn && ok;
@@ -473,8 +676,8 @@ void AddressSpace::at_preload_init(RecordTask* t) {
 const AddressSpace::Mapping& AddressSpace::mapping_of(
     remote_ptr<void> addr) const {
   MemoryRange range(floor_page_size(addr), page_size());
-  auto it = mem.find(range);
-  assert(it != mem.end());
+  auto it = mem->find(range);
+  assert(it != mem->end());
   assert(it->second.map.contains(range));
   return it->second;
 }
@@ -485,13 +688,16 @@ bool AddressSpace::has_mapping(remote_ptr<void> addr) const {
     return false;
   }
   MemoryRange m(floor_page_size(addr), page_size());
-  auto it = mem.find(m);
-  return it != mem.end() && it->first.contains(m);
+  auto it = mem->find(m);
+  return it != mem->end() && it->first.contains(m);
 }
 
 void AddressSpace::protect(remote_ptr<void> addr, size_t num_bytes, int prot) {
   LOG(debug) << "mprotect(" << addr << ", " << num_bytes << ", " << HEX(prot)
              << ")";
+  unshare_mem();
+  note_unverified(MemoryRange(addr, ceil_page_size(num_bytes)));
+  invalidate_code_cache(MemoryRange(addr, ceil_page_size(num_bytes)));
 
   MemoryRange last_overlap;
   auto protector = [this, prot, &last_overlap](const Mapping& mm,
@@ -499,7 +705,7 @@ void AddressSpace::protect(remote_ptr<void> addr, size_t num_bytes, int prot) {
     LOG(debug) << "  protecting (" << rem << ") ...";
 
     Mapping m = move(mm);
-    mem.erase(m.map);
+    remove_from_mem(mem->find(m.map));
 
     // PROT_GROWSDOWN means that if this is a grows-down segment
     // (which for us means "stack") then the change should be
@@ -523,7 +729,7 @@ void AddressSpace::protect(remote_ptr<void> addr, size_t num_bytes, int prot) {
       Mapping underflow(
           m.map.subrange(m.map.start(), rem.start()),
           m.recorded_map.subrange(m.recorded_map.start(), rem.start()));
-      mem[underflow.map] = underflow;
+      add_to_mem(underflow);
     }
     // Remap the overlapping region with the new prot.
     remote_ptr<void> new_end = min(rem.end(), m.map.end());
@@ -532,7 +738,7 @@ void AddressSpace::protect(remote_ptr<void> addr, size_t num_bytes, int prot) {
     Mapping overlap(
         m.map.subrange(new_start, new_end).set_prot(new_prot),
         m.recorded_map.subrange(new_start, new_end).set_prot(new_prot));
-    mem[overlap.map] = overlap;
+    add_to_mem(overlap);
     last_overlap = overlap.map;
 
     // If the last segment we protect overflows the
@@ -541,14 +747,14 @@ void AddressSpace::protect(remote_ptr<void> addr, size_t num_bytes, int prot) {
     if (rem.end() < m.map.end()) {
       Mapping overflow(m.map.subrange(rem.end(), m.map.end()),
                        m.recorded_map.subrange(rem.end(), m.map.end()));
-      mem[overflow.map] = overflow;
+      add_to_mem(overflow);
     }
   };
   for_each_in_range(addr, num_bytes, protector, ITERATE_CONTIGUOUS);
   if (last_overlap.size()) {
     // All mappings that we altered which might need coalescing
     // are adjacent to |last_overlap|.
-    coalesce_around(mem.find(last_overlap));
+    coalesce_around(mem->find(last_overlap));
   }
 }
 
@@ -631,10 +837,90 @@ bool AddressSpace::add_breakpoint(remote_code_ptr addr, BreakpointType type) {
   return true;
 }
 
+/**
+ * Return the end of the run of |addrs| starting at |begin| that lie on the
+ * same page as |*begin|.
+ */
+template <typename Iterator, typename GetAddr>
+static Iterator end_of_page_run(Iterator begin, Iterator end,
+                                GetAddr get_addr) {
+  remote_ptr<void> page_end =
+      floor_page_size(get_addr(*begin).template to_data_ptr<void>()) +
+      page_size();
+  Iterator it = begin;
+  while (it != end && get_addr(*it).template to_data_ptr<void>() < page_end) {
+    ++it;
+  }
+  return it;
+}
+
+bool AddressSpace::add_breakpoints(const vector<remote_code_ptr>& addrs,
+                                   BreakpointType type) {
+  set<remote_code_ptr> new_addrs;
+  for (auto addr : addrs) {
+    if (breakpoints.find(addr) == breakpoints.end()) {
+      new_addrs.insert(addr);
+    }
+  }
+
+  Task* t = new_addrs.empty() ? nullptr : *task_set().begin();
+  auto get_addr = [](remote_code_ptr addr) { return addr; };
+  vector<uint8_t> data;
+  for (auto it = new_addrs.begin(); it != new_addrs.end();) {
+    auto run_end = end_of_page_run(it, new_addrs.end(), get_addr);
+    remote_ptr<uint8_t> start = it->to_data_ptr<uint8_t>();
+    remote_ptr<uint8_t> last = prev(run_end)->to_data_ptr<uint8_t>();
+    size_t len = last - start + 1;
+    data.resize(len);
+    // If the page can't be read, skip the run; add_breakpoint below will
+    // retry each of them and report the failure.
+    if (t->read_bytes_fallible(start, len, data.data()) == ssize_t(len)) {
+      for (; it != run_end; ++it) {
+        size_t offset = it->to_data_ptr<uint8_t>() - start;
+        breakpoints[*it].overwritten_data = data[offset];
+        data[offset] = breakpoint_insn;
+      }
+      t->write_bytes_helper(start, len, data.data());
+    }
+    it = run_end;
+  }
+
+  bool ok = true;
+  for (auto addr : addrs) {
+    // This just takes a reference for breakpoints inserted above.
+    ok = add_breakpoint(addr, type) && ok;
+  }
+  return ok;
+}
+
 void AddressSpace::remove_all_breakpoints() {
-  while (!breakpoints.empty()) {
-    destroy_breakpoint(breakpoints.begin());
+  if (breakpoints.empty()) {
+    return;
+  }
+  // Restore the original bytes with one read and one write per page.
+  Task* t = *task_set().begin();
+  auto get_addr = [](const BreakpointMap::value_type& bp) { return bp.first; };
+  vector<uint8_t> data;
+  for (auto it = breakpoints.begin(); it != breakpoints.end();) {
+    auto run_end = end_of_page_run(it, breakpoints.end(), get_addr);
+    remote_ptr<uint8_t> start = it->first.to_data_ptr<uint8_t>();
+    remote_ptr<uint8_t> last = prev(run_end)->first.to_data_ptr<uint8_t>();
+    size_t len = last - start + 1;
+    data.resize(len);
+    if (t->read_bytes_fallible(start, len, data.data()) == ssize_t(len)) {
+      for (; it != run_end; ++it) {
+        data[it->first.to_data_ptr<uint8_t>() - start] =
+            it->second.overwritten_data;
+      }
+      t->write_bytes_helper(start, len, data.data());
+    } else {
+      for (; it != run_end; ++it) {
+        t->write_mem(it->first.to_data_ptr<uint8_t>(),
+                     it->second.overwritten_data);
+      }
+    }
   }
+  breakpoints.clear();
 }
 
 int AddressSpace::access_bits_of(WatchType type) {
@@ -670,7 +956,7 @@ bool AddressSpace::add_watchpoint(remote_ptr<void> addr, size_t num_bytes,
         watchpoints.insert(make_pair(key, Watchpoint(num_bytes)));
     assert(it_and_is_new.second);
     it = it_and_is_new.first;
-    update_watchpoint_value(it->first, it->second);
+    read_watchpoint_values(vector<WatchpointEntry*>(1, &*it));
   }
   it->second.watch(access_bits_of(type));
   return allocate_watchpoints();
@@ -687,45 +973,83 @@ bool AddressSpace::restore_watchpoints() {
   return allocate_watchpoints();
 }
 
-bool AddressSpace::update_watchpoint_value(const MemoryRange& range,
-                                           Watchpoint& watchpoint) {
+vector<bool> AddressSpace::read_watchpoint_values(
+    const vector<WatchpointEntry*>& batch) {
+  vector<bool> changed(batch.size());
+  if (batch.empty()) {
+    return changed;
+  }
   Task* t = *task_set().begin();
-  bool valid = true;
-  vector<uint8_t> value_bytes = watchpoint.value_bytes;
-  for (size_t i = 0; i < value_bytes.size(); ++i) {
-    value_bytes[i] = 0xFF;
-  }
-  remote_ptr<void> addr = range.start();
-  size_t num_bytes = range.size();
-  while (num_bytes > 0) {
-    ssize_t bytes_read = t->read_bytes_fallible(
-        addr, num_bytes, value_bytes.data() + (addr - range.start()));
-    if (bytes_read <= 0) {
-      valid = false;
-      // advance to next page and try to read more. We want to know
-      // when the valid part of a partially invalid watchpoint changes.
-      bytes_read =
-          min<size_t>(num_bytes, (floor_page_size(addr) + page_size()) - addr);
-    }
-    addr += bytes_read;
-    num_bytes -= bytes_read;
-  }
-
-  bool changed = valid != watchpoint.valid ||
-                 memcmp(value_bytes.data(), watchpoint.value_bytes.data(),
-                        value_bytes.size()) != 0;
-  watchpoint.valid = valid;
-  watchpoint.value_bytes = value_bytes;
+  vector<uint8_t> snapshot;
+  vector<MemoryRange> unreadable;
+  size_t first = 0;
+  while (first < batch.size()) {
+    // Coalesce the following watchpoints that start within a page of the
+    // end of this stretch; reading the gap is cheaper than another syscall.
+    remote_ptr<void> start = batch[first]->first.start();
+    remote_ptr<void> end = batch[first]->first.end();
+    size_t last = first + 1;
+    while (last < batch.size() &&
+           batch[last]->first.start() < end + page_size()) {
+      end = max(end, batch[last]->first.end());
+      ++last;
+    }
+
+    // Read the stretch. Unreadable pages read as 0xFF; keep going past
+    // them, since we want to know when the readable part of a partially
+    // unreadable watchpoint changes.
+    snapshot.assign(end - start, 0xFF);
+    unreadable.clear();
+    remote_ptr<void> addr = start;
+    while (addr < end) {
+      ssize_t bytes_read = t->read_bytes_fallible(
+          addr, end - addr, snapshot.data() + (addr - start));
+      if (bytes_read <= 0) {
+        bytes_read = min<size_t>(end - addr,
+                                 (floor_page_size(addr) + page_size()) - addr);
+        unreadable.push_back(MemoryRange(addr, bytes_read));
+      }
+      addr += bytes_read;
+    }
+
+    for (size_t i = first; i < last; ++i) {
+      const MemoryRange& range = batch[i]->first;
+      Watchpoint& watchpoint = batch[i]->second;
+      bool valid = true;
+      for (auto& u : unreadable) {
+        if (u.intersects(range)) {
+          valid = false;
+          break;
+        }
+      }
+      // memcmp compares a vector at a time, so this is cheap even for
+      // large watched ranges.
+      const uint8_t* value = snapshot.data() + (range.start() - start);
+      if (valid != watchpoint.valid ||
+          memcmp(value, watchpoint.value_bytes.data(), range.size())) {
+        memcpy(watchpoint.value_bytes.data(), value, range.size());
+        watchpoint.valid = valid;
+        changed[i] = true;
+      }
+    }
+    first = last;
+  }
   return changed;
 }
 
 void AddressSpace::update_watchpoint_values(remote_ptr<void> start,
                                             remote_ptr<void> end) {
   MemoryRange r(start, end);
+  vector<WatchpointEntry*> batch;
   for (auto& it : watchpoints) {
-    if (it.first.intersects(r) &&
-        update_watchpoint_value(it.first, it.second)) {
-      it.second.changed = true;
+    if (it.first.intersects(r)) {
+      batch.push_back(&it);
+    }
+  }
+  vector<bool> changed = read_watchpoint_values(batch);
+  for (size_t i = 0; i < batch.size(); ++i) {
+    if (changed[i]) {
+      batch[i]->second.changed = true;
       // We do nothing to track kernel reads of read-write watchpoints...
     }
   }
@@ -745,12 +1069,23 @@ static bool watchpoint_triggered(uintptr_t debug_status,
 
 bool AddressSpace::notify_watchpoint_fired(uintptr_t debug_status) {
   bool triggered = false;
+  vector<WatchpointEntry*> write_watchpoints;
+  for (auto& it : watchpoints) {
+    if (it.second.watched_bits() & WRITE_BIT) {
+      write_watchpoints.push_back(&it);
+    }
+  }
+  vector<bool> changed = read_watchpoint_values(write_watchpoints);
+  for (size_t i = 0; i < write_watchpoints.size(); ++i) {
+    if (changed[i]) {
+      write_watchpoints[i]->second.changed = true;
+      triggered = true;
+    }
+  }
   for (auto& it : watchpoints) {
-    if (((it.second.watched_bits() & WRITE_BIT) &&
-         update_watchpoint_value(it.first, it.second)) ||
-        ((it.second.watched_bits() & (READ_BIT | EXEC_BIT)) &&
-         watchpoint_triggered(debug_status,
-                              it.second.debug_regs_for_exec_read))) {
+    if ((it.second.watched_bits() & (READ_BIT | EXEC_BIT)) &&
+        watchpoint_triggered(debug_status,
+                             it.second.debug_regs_for_exec_read)) {
       it.second.changed = true;
       triggered = true;
     }
@@ -760,6 +1095,7 @@ bool AddressSpace::notify_watchpoint_fired(uintptr_t debug_status) {
 
 void AddressSpace::notify_written(remote_ptr<void> addr, size_t num_bytes) {
   update_watchpoint_values(addr, addr + num_bytes);
+  invalidate_code_cache(MemoryRange(addr, num_bytes));
   session()->accumulate_bytes_written(num_bytes);
 }
 
@@ -782,12 +1118,15 @@ void AddressSpace::unmap(remote_ptr<void> addr, ssize_t num_bytes) {
 
 void AddressSpace::unmap_internal(remote_ptr<void> addr, ssize_t num_bytes) {
   LOG(debug) << "munmap(" << addr << ", " << num_bytes << ")";
+  unshare_mem();
+  note_unverified(MemoryRange(addr, ceil_page_size(num_bytes)));
+  invalidate_code_cache(MemoryRange(addr, ceil_page_size(num_bytes)));
 
   auto unmapper = [this](const Mapping& mm, const MemoryRange& rem) {
     LOG(debug) << "  unmapping (" << rem << ") ...";
 
     Mapping m = move(mm);
-    mem.erase(m.map);
+    remove_from_mem(mem->find(m.map));
     LOG(debug) << "  erased (" << m.map << ") ...";
 
     // If the first segment we unmap underflows the unmap
@@ -795,14 +1134,14 @@ void AddressSpace::unmap_internal(remote_ptr<void> addr, ssize_t num_bytes) {
     if (m.map.start() < rem.start()) {
       Mapping underflow(m.map.subrange(m.map.start(), rem.start()),
                         m.recorded_map.subrange(m.map.start(), rem.start()));
-      mem[underflow.map] = underflow;
+      add_to_mem(underflow);
     }
     // If the last segment we unmap overflows the unmap
     // region, remap the overflow region.
     if (rem.end() < m.map.end()) {
       Mapping overflow(m.map.subrange(rem.end(), m.map.end()),
                        m.recorded_map.subrange(rem.end(), m.map.end()));
-      mem[overflow.map] = overflow;
+      add_to_mem(overflow);
     }
   };
   for_each_in_range(addr, num_bytes, unmapper);
@@ -981,7 +1320,10 @@ static void assert_segments_match(Task* t, const KernelMapping& input_m,
 
 KernelMapping AddressSpace::fix_stack_segment_start(
     const MemoryRange& mapping, remote_ptr<void> new_start) {
-  auto it = mem.find(mapping);
+  auto it = mem->find(mapping);
+  note_unverified(MemoryRange(min(new_start, mapping.start()), mapping.end()));
+  invalidate_code_cache(
+      MemoryRange(min(new_start, mapping.start()), mapping.end()));
   it->first.update_start(new_start);
   it->second.map.update_start(new_start);
   it->second.recorded_map.update_start(new_start);
@@ -993,17 +1335,104 @@ KernelMapping AddressSpace::vdso() const {
   return mapping_of(vdso_start_addr).map;
 }
 
+void AddressSpace::verify(Task* t) {
+  ASSERT(t, task_set().end() != task_set().find(t));
+
+  if (!Flags::get().check_cached_mmaps_incrementally || need_full_verify) {
+    verify_all(t);
+  } else if (!unverified_ranges.empty()) {
+    sort(unverified_ranges.begin(), unverified_ranges.end());
+    vector<MemoryRange> ranges;
+    for (auto& r : unverified_ranges) {
+      if (!ranges.empty() && ranges.back().end() >= r.start()) {
+        ranges.back() =
+            MemoryRange(ranges.back().start(), max(ranges.back().end(), r.end()));
+      } else {
+        ranges.push_back(r);
+      }
+    }
+    verify_ranges(t, ranges);
+  }
+  unverified_ranges.clear();
+  need_full_verify = false;
+}
+
+void AddressSpace::note_unverified(const MemoryRange& range) {
+  if (need_full_verify || !Flags::get().check_cached_mmaps_incrementally) {
+    return;
+  }
+  // Don't let a long run of changes between verifies grow without bound;
+  // past this point a full check is cheaper than merging ranges.
+  static const size_t MAX_UNVERIFIED_RANGES = 4096;
+  if (unverified_ranges.size() >= MAX_UNVERIFIED_RANGES) {
+    unverified_ranges.clear();
+    need_full_verify = true;
+    return;
+  }
+  unverified_ranges.push_back(range);
+}
+
+/**
+ * Append |m|, clipped to |range|, to |segments|, merging it with the last
+ * segment if they're adjacent.
+ */
+static void add_clipped_segment(vector<KernelMapping>& segments,
+                                const KernelMapping& m,
+                                const MemoryRange& range) {
+  MemoryRange clipped = m.intersect(range);
+  KernelMapping km = m.subrange(clipped.start(), clipped.end());
+  if (segments.empty() || !try_merge_adjacent(&segments.back(), km)) {
+    segments.push_back(km);
+  }
+}
+
+/**
+ * Verify only the parts of the address space within |ranges|, which must
+ * be sorted and disjoint. Mappings straddling a range boundary are
+ * clipped to it on both sides, so a mapping that's changed outside
+ * |ranges| is not detected.
+ */
+void AddressSpace::verify_ranges(Task* t,
+                                 const vector<MemoryRange>& ranges) const {
+  KernelMapIterator kernel_it(t);
+  vector<KernelMapping> vms;
+  vector<KernelMapping> kms;
+  for (auto& range : ranges) {
+    vms.clear();
+    kms.clear();
+    for (auto it = mem->lower_bound(range);
+         it != mem->end() && it->second.map.start() < range.end(); ++it) {
+      add_clipped_segment(vms, it->second.map, range);
+    }
+    kernel_it.skip_to(range.start());
+    while (!kernel_it.at_end() && kernel_it.current().start() < range.end()) {
+      const KernelMapping& km = kernel_it.current();
+      add_clipped_segment(kms, km, range);
+      if (km.end() > range.end()) {
+        // This may overlap the next range too, so don't step past it.
+        break;
+      }
+      ++kernel_it;
+    }
+
+    for (size_t i = 0; i < vms.size() && i < kms.size(); ++i) {
+      assert_segments_match(t, vms[i], kms[i]);
+    }
+    ASSERT(t, vms.size() == kms.size())
+        << "Cached and kernel mappings differ within " << range << ": "
+        << vms.size() << " vs " << kms.size() << " segments";
+  }
+}
+
 /**
  * Iterate over /proc/maps segments for a task and verify that the
  * task's cached mapping matches the kernel's (given a lenient fuzz
  * factor).
  */
-void AddressSpace::verify(Task* t) const {
-  ASSERT(t, task_set().end() != task_set().find(t));
-
-  MemoryMap::const_iterator mem_it = mem.begin();
+void AddressSpace::verify_all(Task* t) const {
+  MemoryMap::const_iterator mem_it = mem->begin();
   KernelMapIterator kernel_it(t);
-  while (!kernel_it.at_end() && mem_it != mem.end()) {
+  while (!kernel_it.at_end() && mem_it != mem->end()) {
     KernelMapping km = kernel_it.current();
     ++kernel_it;
     while (!kernel_it.at_end()) {
@@ -1016,14 +1445,14 @@ void AddressSpace::verify(Task* t) const {
 
     KernelMapping vm = mem_it->second.map;
     ++mem_it;
-    while (mem_it != mem.end() && try_merge_adjacent(&vm, mem_it->second.map)) {
+    while (mem_it != mem->end() && try_merge_adjacent(&vm, mem_it->second.map)) {
       ++mem_it;
     }
 
     assert_segments_match(t, vm, km);
   }
 
-  ASSERT(t, kernel_it.at_end() && mem_it == mem.end());
+  ASSERT(t, kernel_it.at_end() && mem_it == mem->end());
 }
 
 AddressSpace::AddressSpace(Task* t, const string& exe, uint32_t exec_count)
@@ -1032,11 +1461,13 @@ AddressSpace::AddressSpace(Task* t, const string& exe, uint32_t exec_count)
       leader_serial(t->tuid().serial()),
       exec_count(exec_count),
       is_clone(false),
+      mem(make_shared<MemoryMap>()),
       session_(&t->session()),
       monkeypatch_state(t->session().is_recording() ? new Monkeypatcher()
                                                     : nullptr),
       child_mem_fd(-1),
-      first_run_event_(0) {
+      first_run_event_(0),
+      need_full_verify(true) {
   // TODO: this is a workaround of
   // https://github.com/mozilla/rr/issues/1113 .
   if (session_->done_initial_exec()) {
@@ -1081,7 +1512,11 @@ AddressSpace::AddressSpace(Session* session, const AddressSpace& o,
       syscallbuf_lib_start_(o.syscallbuf_lib_start_),
       syscallbuf_lib_end_(o.syscallbuf_lib_end_),
       saved_auxv_(o.saved_auxv_),
-      first_run_event_(0) {
+      first_run_event_(0),
+      need_full_verify(true) {
+  for (auto& m : *mem) {
+    session_->on_file_mapping_added(m.second.recorded_map);
+  }
   for (auto& it : o.breakpoints) {
     breakpoints.insert(make_pair(it.first, it.second));
   }
@@ -1258,7 +1693,7 @@ bool AddressSpace::allocate_watchpoints() {
 
 void AddressSpace::coalesce_around(MemoryMap::iterator it) {
   auto first_kv = it;
-  while (mem.begin() != first_kv) {
+  while (mem->begin() != first_kv) {
     auto next = first_kv;
     --first_kv;
     if (!is_adjacent_mapping(first_kv->second.map, next->second.map,
@@ -1271,14 +1706,14 @@ void AddressSpace::coalesce_around(MemoryMap::iterator it) {
   while (true) {
     auto prev = last_kv;
     ++last_kv;
-    if (mem.end() == last_kv ||
+    if (mem->end() == last_kv ||
         !is_adjacent_mapping(prev->second.map, last_kv->second.map,
                              RESPECT_HEAP)) {
       last_kv = prev;
       break;
     }
   }
-  assert(last_kv != mem.end());
+  assert(last_kv != mem->end());
   if (first_kv == last_kv) {
     LOG(debug) << "  no mappings to coalesce";
     return;
@@ -1288,10 +1723,31 @@ void AddressSpace::coalesce_around(MemoryMap::iterator it) {
                 first_kv->second.recorded_map.extend(last_kv->first.end()));
   LOG(debug) << "  coalescing " << new_m.map;
 
-  mem.erase(first_kv, ++last_kv);
+  for (++last_kv; first_kv != last_kv;) {
+    remove_from_mem(first_kv++);
+  }
+
+  add_to_mem(new_m);
+}
 
-  auto ins = mem.insert(MemoryMap::value_type(new_m.map, new_m));
+AddressSpace::MemoryMap::iterator AddressSpace::add_to_mem(const Mapping& m) {
+  assert(mem.use_count() == 1);
+  auto ins = mem->insert(MemoryMap::value_type(m.map, m));
   assert(ins.second); // key didn't already exist
+  session_->on_file_mapping_added(m.recorded_map);
+  return ins.first;
+}
+
+void AddressSpace::remove_from_mem(MemoryMap::iterator it) {
+  assert(mem.use_count() == 1);
+  session_->on_file_mapping_removed(it->second.recorded_map);
+  mem->erase(it);
+}
+
+void AddressSpace::unshare_mem() {
+  if (mem.use_count() > 1) {
+    mem = make_shared<MemoryMap>(*mem);
+  }
 }
 
 void AddressSpace::destroy_breakpoint(BreakpointMap::const_iterator it) {
@@ -1314,8 +1770,8 @@ void AddressSpace::for_each_in_range(
 
     // The next page to iterate may not be contiguous with
     // the last one seen.
-    auto it = mem.lower_bound(rem);
-    if (mem.end() == it) {
+    auto it = mem->lower_bound(rem);
+    if (mem->end() == it) {
       LOG(debug) << "  not found, done.";
       return;
     }
@@ -1343,8 +1799,10 @@ void AddressSpace::map_and_coalesce(const KernelMapping& m,
                                     const KernelMapping& recorded_map) {
   LOG(debug) << "  mapping " << m;
 
-  auto ins = mem.insert(MemoryMap::value_type(m, Mapping(m, recorded_map)));
-  coalesce_around(ins.first);
+  unshare_mem();
+  note_unverified(m);
+  invalidate_code_cache(m);
+  coalesce_around(add_to_mem(Mapping(m, recorded_map)));
 
   update_watchpoint_values(m.start(), m.end());
 }
@@ -1439,8 +1897,8 @@ remote_ptr<void> AddressSpace::chaos_mode_find_free_memory(Task* t,
     uint64_t r = ((uint64_t)(uint32_t)random() << 32) | (uint32_t)random();
     addr = floor_page_size(remote_ptr<void>(r & ((uint64_t(1) << bits) - 1)));
   } else {
-    ASSERT(t, !mem.empty());
-    int map_index = random() % mem.size();
+    ASSERT(t, !mem->empty());
+    int map_index = random() % mem->size();
     int map_count = 0;
     for (const auto& m : maps()) {
       if (map_count == map_index) {
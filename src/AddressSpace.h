@@ -9,6 +9,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 
+#include <array>
 #include <map>
 #include <memory>
 #include <set>
@@ -343,6 +344,15 @@ public:
   void replace_breakpoints_with_original_values(uint8_t* dest, size_t length,
                                                 remote_ptr<uint8_t> addr);
 
+  /**
+   * Read up to |size| bytes of code at |addr| into |buf|, with breakpoints
+   * replaced by the original data, and return how many bytes were read.
+   * Code in private read-only mappings is cached, since the tracee can't
+   * change it without a mapping change or a write by rr, both of which we
+   * see.
+   */
+  size_t read_code(Task* t, remote_code_ptr addr, uint8_t* buf, size_t size);
+
   /**
    * Map |num_bytes| into this address space at |addr|, with
    * |prot| protection and |flags|.  The pages are (possibly
@@ -398,13 +408,17 @@ public:
 
     private:
       friend class Maps;
-      iterator(const MemoryMap& outer, remote_ptr<void> ptr)
+      // Refer to the address space's pointer rather than the map, so we see
+      // the current map if it's unshared while we iterate.
+      iterator(const std::shared_ptr<MemoryMap>& outer, remote_ptr<void> ptr)
           : outer(outer), ptr(ptr), at_end(false) {}
-      iterator(const MemoryMap& outer) : outer(outer), at_end(true) {}
+      iterator(const std::shared_ptr<MemoryMap>& outer)
+          : outer(outer), at_end(true) {}
       MemoryMap::const_iterator to_it() const {
-        return at_end ? outer.end() : outer.lower_bound(MemoryRange(ptr, ptr));
+        return at_end ? outer->end()
+                      : outer->lower_bound(MemoryRange(ptr, ptr));
       }
-      const MemoryMap& outer;
+      const std::shared_ptr<MemoryMap>& outer;
       remote_ptr<void> ptr;
       bool at_end;
     };
@@ -452,6 +466,13 @@ public:
 
   /** Ensure a breakpoint of |type| is set at |addr|. */
   bool add_breakpoint(remote_code_ptr addr, BreakpointType type);
+  /**
+   * Like add_breakpoint() for each of |addrs|, but the new breakpoints on
+   * each page are inserted with one read and one write of tracee memory.
+   * Returns false if any of them couldn't be set.
+   */
+  bool add_breakpoints(const std::vector<remote_code_ptr>& addrs,
+                       BreakpointType type);
   /**
    * Remove a |type| reference to the breakpoint at |addr|.  If
    * the removed reference was the last, the breakpoint is
@@ -527,9 +548,12 @@ public:
 
   /**
    * Verify that this cached address space matches what the
-   * kernel thinks it should be.
+   * kernel thinks it should be. With
+   * |Flags::check_cached_mmaps_incrementally|, only the ranges changed
+   * by map/unmap/protect/remap since the previous verify are checked
+   * (after an initial full check).
    */
-  void verify(Task* t) const;
+  void verify(Task* t);
 
   bool has_breakpoints() { return !breakpoints.empty(); }
   bool has_watchpoints() { return !watchpoints.empty(); }
@@ -568,6 +592,29 @@ public:
 
   bool syscallbuf_enabled() const { return syscallbuf_lib_start_ != nullptr; }
 
+  /**
+   * A syscallbuf segment left behind by an exited thread. It stays mapped
+   * in the tracee and in rr, so a new thread can take it over without any
+   * remote syscalls.
+   */
+  struct SyscallbufSegment {
+    remote_ptr<void> child;
+    void* local;
+    size_t size;
+    ino_t inode;
+  };
+  /**
+   * Keep |seg| for the next thread that initializes its buffers. Returns
+   * false if the pool is full, in which case the caller must unmap it.
+   */
+  bool recycle_syscallbuf(const SyscallbufSegment& seg);
+  /**
+   * Take a pooled segment, if there is one. A non-null |child| only
+   * accepts the segment mapped there; replay passes the address recording
+   * used, so both take the same segment.
+   */
+  bool take_syscallbuf(remote_ptr<void> child, SyscallbufSegment* seg);
+
   /**
    * We'll map a page of memory here into every exec'ed process for our own
    * use.
@@ -670,6 +717,8 @@ public:
 
   /**
    * Reads the /proc/<pid>/maps entry for a specific address. Does no caching.
+   * Uses the PROCMAP_QUERY ioctl when the kernel has it, so the cost doesn't
+   * grow with the number of mappings.
    * If performed on a file in a btrfs file system, this may return the
    * wrong device number! If you stick to anonymous or special file
    * mappings, this should be OK.
@@ -699,8 +748,16 @@ private:
   // Also sets brk_ptr.
   void map_rr_page(Task* t);
 
-  bool update_watchpoint_value(const MemoryRange& range,
-                               Watchpoint& watchpoint);
+  typedef std::pair<const MemoryRange, Watchpoint> WatchpointEntry;
+  /**
+   * Reread the values of the watchpoints in |batch|, which must be in
+   * address order, as they are in |watchpoints|. Watchpoints less than a
+   * page apart are coalesced, so each stretch of watched memory is read
+   * with one syscall however many watchpoints it holds. Returns, for each
+   * watchpoint, whether its value or validity changed.
+   */
+  std::vector<bool> read_watchpoint_values(
+      const std::vector<WatchpointEntry*>& batch);
   void update_watchpoint_values(remote_ptr<void> start, remote_ptr<void> end);
   enum WatchpointFilter { ALL_WATCHPOINTS, CHANGED_WATCHPOINTS };
   std::vector<WatchConfig> get_watchpoints_internal(WatchpointFilter filter);
@@ -724,6 +781,34 @@ private:
    */
   void coalesce_around(MemoryMap::iterator it);
 
+  /**
+   * Add |m| to |mem|, or remove |it| from it, keeping the session's count
+   * of mappings of each file up to date. All changes to |mem| go through
+   * these.
+   */
+  MemoryMap::iterator add_to_mem(const Mapping& m);
+  /**
+   * Give this address space its own copy of |mem| if it's shared. Must be
+   * called before taking iterators that will be passed to add_to_mem,
+   * remove_from_mem or coalesce_around.
+   */
+  void unshare_mem();
+  void remove_from_mem(MemoryMap::iterator it);
+
+  /**
+   * Remember that |range| must be checked by the next incremental verify.
+   */
+  void note_unverified(const MemoryRange& range);
+
+  /**
+   * Return the cached contents of the code cache line starting at |line|,
+   * filling it in first if necessary, or null if it can't be cached.
+   */
+  const uint8_t* cached_code_line(Task* t, remote_ptr<void> line);
+  void invalidate_code_cache(const MemoryRange& range);
+  void verify_all(Task* t) const;
+  void verify_ranges(Task* t, const std::vector<MemoryRange>& ranges) const;
+
   /**
    * Erase |it| from |breakpoints| and restore any memory in
    * this it may have overwritten.
@@ -901,8 +986,12 @@ private:
   remote_ptr<void> brk_end;
   /* Were we cloned from another address space? */
   bool is_clone;
-  /* All segments mapped into this address space. */
-  MemoryMap mem;
+  /* All segments mapped into this address space. Shared with the address
+   * space we were cloned from (or that was cloned from us) until either
+   * changes it; see unshare_mem(). Forks are often followed straight away by
+   * exec, and copying thousands of mappings only to drop them was most of
+   * the cost of a fork. */
+  std::shared_ptr<MemoryMap> mem;
   /* madvise DONTFORK regions */
   std::set<MemoryRange> dont_fork;
   // The session that created this.  We save a ref to it so that
@@ -934,12 +1023,35 @@ private:
 
   std::vector<uint8_t> saved_auxv_;
 
+  /**
+   * Syscallbuf segments of exited threads, most recently recycled last.
+   * Clones start with an empty pool: the segments' rr-side mappings
+   * belong to this address space.
+   */
+  std::vector<SyscallbufSegment> syscallbuf_pool;
+  static const size_t MAX_POOLED_SYSCALLBUFS = 8;
+
   /**
    * The time of the first event that ran code for a task in this address space.
    * 0 if no such event has occurred.
    */
   TraceFrame::Time first_run_event_;
 
+  /**
+   * Ranges whose mappings changed since the last verify(), and whether
+   * the next verify() must check everything anyway.
+   */
+  std::vector<MemoryRange> unverified_ranges;
+  bool need_full_verify;
+
+  /**
+   * Code read by read_code(), in aligned lines of CODE_CACHE_LINE bytes
+   * keyed by their start address.
+   */
+  static const size_t CODE_CACHE_LINE = 64;
+  std::map<remote_ptr<void>, std::array<uint8_t, CODE_CACHE_LINE> >
+      code_cache;
+
   /**
    * For each architecture, the offset of a syscall instruction with that
    * architecture's VDSO, or 0 if not known.
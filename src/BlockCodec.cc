@@ -0,0 +1,360 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "BlockCodec.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef RR_HAVE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#endif
+#ifdef RR_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+using namespace std;
+
+namespace rr {
+
+class ZlibCodec : public BlockCodec {
+public:
+  virtual Type type() const { return ZLIB; }
+  virtual const char* name() const { return "zlib"; }
+  virtual size_t max_compressed_size(size_t length) const {
+    return compressBound(length);
+  }
+
+  virtual size_t compress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_length, int level) const {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int result = deflateInit(&stream, level ? level : Z_DEFAULT_COMPRESSION);
+    if (result != Z_OK) {
+      assert(0 && "deflateInit failed!");
+      return 0;
+    }
+
+    stream.next_in = const_cast<uint8_t*>(data);
+    stream.avail_in = length;
+    stream.next_out = out;
+    stream.avail_out = out_length;
+    result = deflate(&stream, Z_FINISH);
+    if (result != Z_STREAM_END) {
+      assert(0 && "deflate failed!");
+      deflateEnd(&stream);
+      return 0;
+    }
+
+    result = deflateEnd(&stream);
+    if (result != Z_OK) {
+      assert(0 && "deflateEnd failed!");
+      return 0;
+    }
+
+    return stream.total_out;
+  }
+
+  virtual bool decompress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_length) const {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    int result = inflateInit(&stream);
+    if (result != Z_OK) {
+      assert(0 && "inflateInit failed!");
+      return false;
+    }
+
+    stream.next_in = const_cast<uint8_t*>(data);
+    stream.avail_in = length;
+    stream.next_out = out;
+    stream.avail_out = out_length;
+    result = inflate(&stream, Z_FINISH);
+    if (result != Z_STREAM_END) {
+      assert(0 && "inflate failed!");
+      inflateEnd(&stream);
+      return false;
+    }
+
+    result = inflateEnd(&stream);
+    if (result != Z_OK) {
+      assert(0 && "inflateEnd failed!");
+      return false;
+    }
+
+    return true;
+  }
+};
+
+/**
+ * Stores blocks as-is. CompressedReader serves these blocks straight from a
+ * mapping of the file.
+ */
+class NoneCodec : public BlockCodec {
+public:
+  virtual Type type() const { return NONE; }
+  virtual const char* name() const { return "none"; }
+  virtual size_t max_compressed_size(size_t length) const { return length; }
+
+  virtual size_t compress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_length, int) const {
+    if (length > out_length) {
+      return 0;
+    }
+    memcpy(out, data, length);
+    return length;
+  }
+
+  virtual bool decompress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_length) const {
+    if (length != out_length) {
+      return false;
+    }
+    memcpy(out, data, length);
+    return true;
+  }
+};
+
+#ifdef RR_HAVE_ZSTD
+class ZstdCodec : public BlockCodec {
+public:
+  virtual Type type() const { return ZSTD; }
+  virtual const char* name() const { return "zstd"; }
+  virtual size_t max_compressed_size(size_t length) const {
+    return ZSTD_compressBound(length);
+  }
+
+  virtual size_t compress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_length, int level) const {
+    // Level 0 makes zstd use its own default.
+    size_t result = ZSTD_compress(out, out_length, data, length, level);
+    if (ZSTD_isError(result)) {
+      assert(0 && "ZSTD_compress failed!");
+      return 0;
+    }
+    return result;
+  }
+
+  virtual bool decompress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_length) const {
+    size_t result = ZSTD_decompress(out, out_length, data, length);
+    if (ZSTD_isError(result) || result != out_length) {
+      assert(0 && "ZSTD_decompress failed!");
+      return false;
+    }
+    return true;
+  }
+};
+#endif
+
+#ifdef RR_HAVE_LZ4
+class Lz4Codec : public BlockCodec {
+public:
+  virtual Type type() const { return LZ4; }
+  virtual const char* name() const { return "lz4"; }
+  virtual size_t max_compressed_size(size_t length) const {
+    assert(length <= INT_MAX);
+    return LZ4_compressBound((int)length);
+  }
+
+  virtual size_t compress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_length, int level) const {
+    // For lz4 the level is the "acceleration" factor: higher values
+    // compress faster and worse.
+    int result = LZ4_compress_fast(reinterpret_cast<const char*>(data),
+                                   reinterpret_cast<char*>(out), (int)length,
+                                   (int)min<size_t>(out_length, INT_MAX),
+                                   level ? level : 1);
+    if (result <= 0) {
+      assert(0 && "LZ4_compress_fast failed!");
+      return 0;
+    }
+    return result;
+  }
+
+  virtual bool decompress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_length) const {
+    int result = LZ4_decompress_safe(reinterpret_cast<const char*>(data),
+                                     reinterpret_cast<char*>(out), (int)length,
+                                     (int)out_length);
+    if (result < 0 || (size_t)result != out_length) {
+      assert(0 && "LZ4_decompress_safe failed!");
+      return false;
+    }
+    return true;
+  }
+};
+#endif
+
+/*static*/ const BlockCodec* BlockCodec::get(Type type) {
+  static const ZlibCodec zlib_codec;
+  static const NoneCodec none_codec;
+#ifdef RR_HAVE_ZSTD
+  static const ZstdCodec zstd_codec;
+#endif
+#ifdef RR_HAVE_LZ4
+  static const Lz4Codec lz4_codec;
+#endif
+
+  switch (type) {
+    case ZLIB:
+      return &zlib_codec;
+    case NONE:
+      return &none_codec;
+#ifdef RR_HAVE_ZSTD
+    case ZSTD:
+      return &zstd_codec;
+#endif
+#ifdef RR_HAVE_LZ4
+    case LZ4:
+      return &lz4_codec;
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+const uint32_t BlockDictionary::CODEC_ID;
+
+#ifdef RR_HAVE_ZSTD
+BlockDictionary::BlockDictionary(vector<uint8_t>&& data, int level)
+    : data_(move(data)), cdict(nullptr), ddict(nullptr) {
+  // Loaded dictionaries are only used for decompression.
+  if (level >= 0) {
+    cdict = ZSTD_createCDict(data_.data(), data_.size(), level);
+  }
+  ddict = ZSTD_createDDict(data_.data(), data_.size());
+}
+
+BlockDictionary::~BlockDictionary() {
+  ZSTD_freeCDict(static_cast<ZSTD_CDict*>(cdict));
+  ZSTD_freeDDict(static_cast<ZSTD_DDict*>(ddict));
+}
+
+/*static*/ unique_ptr<BlockDictionary> BlockDictionary::train(
+    const vector<uint8_t>& samples, size_t sample_size, size_t max_size,
+    int level) {
+  vector<size_t> sample_sizes;
+  for (size_t offset = 0; offset < samples.size(); offset += sample_size) {
+    sample_sizes.push_back(min(sample_size, samples.size() - offset));
+  }
+  vector<uint8_t> data(max_size);
+  size_t size =
+      ZDICT_trainFromBuffer(data.data(), data.size(), samples.data(),
+                            sample_sizes.data(), (unsigned)sample_sizes.size());
+  if (ZDICT_isError(size)) {
+    return nullptr;
+  }
+  data.resize(size);
+  unique_ptr<BlockDictionary> dictionary(
+      new BlockDictionary(move(data), max(level, 0)));
+  if (!dictionary->cdict || !dictionary->ddict) {
+    return nullptr;
+  }
+  return dictionary;
+}
+
+/*static*/ unique_ptr<BlockDictionary> BlockDictionary::load(
+    const string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  struct stat st;
+  vector<uint8_t> data;
+  if (!fstat(fd, &st)) {
+    data.resize(st.st_size);
+  }
+  bool ok = !data.empty() &&
+            read(fd, data.data(), data.size()) == (ssize_t)data.size();
+  close(fd);
+  if (!ok) {
+    return nullptr;
+  }
+  unique_ptr<BlockDictionary> dictionary(new BlockDictionary(move(data), -1));
+  if (!dictionary->ddict) {
+    return nullptr;
+  }
+  return dictionary;
+}
+
+size_t BlockDictionary::max_compressed_size(size_t length) const {
+  return ZSTD_compressBound(length);
+}
+
+size_t BlockDictionary::compress(const uint8_t* data, size_t length,
+                                 uint8_t* out, size_t out_length) const {
+  assert(cdict);
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  size_t result =
+      ZSTD_compress_usingCDict(cctx, out, out_length, data, length,
+                               static_cast<const ZSTD_CDict*>(cdict));
+  ZSTD_freeCCtx(cctx);
+  if (ZSTD_isError(result)) {
+    assert(0 && "ZSTD_compress_usingCDict failed!");
+    return 0;
+  }
+  return result;
+}
+
+bool BlockDictionary::decompress(const uint8_t* data, size_t length,
+                                 uint8_t* out, size_t out_length) const {
+  ZSTD_DCtx* dctx = ZSTD_createDCtx();
+  size_t result =
+      ZSTD_decompress_usingDDict(dctx, out, out_length, data, length,
+                                 static_cast<const ZSTD_DDict*>(ddict));
+  ZSTD_freeDCtx(dctx);
+  if (ZSTD_isError(result) || result != out_length) {
+    assert(0 && "ZSTD_decompress_usingDDict failed!");
+    return false;
+  }
+  return true;
+}
+#else
+BlockDictionary::BlockDictionary(vector<uint8_t>&& data, int)
+    : data_(move(data)), cdict(nullptr), ddict(nullptr) {}
+
+BlockDictionary::~BlockDictionary() {}
+
+/*static*/ unique_ptr<BlockDictionary> BlockDictionary::train(
+    const vector<uint8_t>&, size_t, size_t, int) {
+  return nullptr;
+}
+
+/*static*/ unique_ptr<BlockDictionary> BlockDictionary::load(const string&) {
+  return nullptr;
+}
+
+size_t BlockDictionary::max_compressed_size(size_t length) const {
+  return length;
+}
+
+size_t BlockDictionary::compress(const uint8_t*, size_t, uint8_t*,
+                                 size_t) const {
+  return 0;
+}
+
+bool BlockDictionary::decompress(const uint8_t*, size_t, uint8_t*,
+                                 size_t) const {
+  return false;
+}
+#endif
+
+/*static*/ bool BlockCodec::parse_name(const string& name, Type* type) {
+  static const char* const names[CODEC_COUNT] = { "zlib", "zstd", "lz4",
+                                                  "none" };
+  for (int i = 0; i < CODEC_COUNT; ++i) {
+    if (name == names[i]) {
+      *type = (Type)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+} // namespace rr
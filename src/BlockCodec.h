@@ -0,0 +1,173 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_BLOCK_CODEC_H_
+#define RR_BLOCK_CODEC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace rr {
+
+/**
+ * A BlockCodec compresses and decompresses the independent blocks that
+ * CompressedWriter writes. Every block header records the codec that produced
+ * the block, so CompressedReader can decode a trace without being told
+ * which codec was selected at record time.
+ *
+ * zlib and NONE (blocks stored uncompressed) are always available. zstd and
+ * lz4 are available when rr was built against those libraries.
+ */
+class BlockCodec {
+public:
+  /**
+   * These values are stored in trace files. Don't renumber them.
+   */
+  enum Type { ZLIB = 0, ZSTD = 1, LZ4 = 2, NONE = 3, CODEC_COUNT };
+
+  /**
+   * Return the codec for 'type', or null if support for it was not
+   * compiled into this rr.
+   */
+  static const BlockCodec* get(Type type);
+  /**
+   * Parse a codec name ("zlib", "zstd", "lz4" or "none"). Returns false if
+   * the name is not recognized.
+   */
+  static bool parse_name(const std::string& name, Type* type);
+
+  virtual ~BlockCodec() {}
+
+  virtual Type type() const = 0;
+  virtual const char* name() const = 0;
+  /**
+   * Upper bound on the compressed size of 'length' bytes of input.
+   */
+  virtual size_t max_compressed_size(size_t length) const = 0;
+  /**
+   * Compress 'length' bytes at 'data' into 'out'. 'level' is codec-specific;
+   * 0 selects the codec's default. Returns the compressed size, or 0 on
+   * failure.
+   */
+  virtual size_t compress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_length, int level) const = 0;
+  /**
+   * Decompress exactly 'out_length' bytes. Returns false on failure.
+   */
+  virtual bool decompress(const uint8_t* data, size_t length, uint8_t* out,
+                          size_t out_length) const = 0;
+};
+
+/**
+ * A zstd dictionary trained on the first data written to a stream. Small,
+ * repetitive blocks (metadata records with the same register patterns and
+ * paths over and over) compress much better with one, since otherwise each
+ * block starts from nothing. The dictionary is stored next to the stream in
+ * the file named by path_for(), and blocks compressed with it are marked
+ * with CODEC_ID instead of a BlockCodec::Type.
+ */
+class BlockDictionary {
+public:
+  /**
+   * Block header codec value for blocks compressed with the stream's
+   * dictionary. Stored in trace files.
+   */
+  static const uint32_t CODEC_ID = 100;
+
+  static std::string path_for(const std::string& stream_path) {
+    return stream_path + ".dict";
+  }
+
+  /**
+   * Train a dictionary of at most 'max_size' bytes from 'samples', taken as
+   * pieces of 'sample_size' bytes. Returns null if training fails or rr was
+   * built without zstd.
+   */
+  static std::unique_ptr<BlockDictionary> train(
+      const std::vector<uint8_t>& samples, size_t sample_size,
+      size_t max_size, int level);
+  /**
+   * Load the dictionary at 'path'. Returns null if there isn't one or rr was
+   * built without zstd.
+   */
+  static std::unique_ptr<BlockDictionary> load(const std::string& path);
+
+  ~BlockDictionary();
+
+  const std::vector<uint8_t>& data() const { return data_; }
+
+  size_t max_compressed_size(size_t length) const;
+  /**
+   * Like BlockCodec::compress(), at the level the dictionary was trained
+   * for. Only for dictionaries returned by train().
+   */
+  size_t compress(const uint8_t* data, size_t length, uint8_t* out,
+                  size_t out_length) const;
+  bool decompress(const uint8_t* data, size_t length, uint8_t* out,
+                  size_t out_length) const;
+
+private:
+  BlockDictionary(std::vector<uint8_t>&& data, int level);
+
+  std::vector<uint8_t> data_;
+  // ZSTD_CDict and ZSTD_DDict, respectively
+  void* cdict;
+  void* ddict;
+};
+
+/**
+ * Overrides of the defaults for one trace substream. Zero means the
+ * default: the substream's own block size and thread count, and
+ * CompressionOptions' codec and level.
+ */
+struct SubstreamCompression {
+  size_t block_size;
+  uint32_t threads;
+  bool set_codec;
+  BlockCodec::Type codec;
+  int level;
+
+  SubstreamCompression()
+      : block_size(0),
+        threads(0),
+        set_codec(false),
+        codec(BlockCodec::ZLIB),
+        level(0) {}
+};
+
+/**
+ * Record-time choice of how trace blocks are buffered and compressed.
+ */
+struct CompressionOptions {
+  BlockCodec::Type codec;
+  // Codec-specific level; 0 means the codec's default.
+  int level;
+  // Bytes of uncompressed data that may be queued for compression; 0 means
+  // the default. TraceWriter divides this among its substreams, so for a
+  // CompressedWriter it's that writer's share.
+  size_t memory_budget;
+  // When the queue is full, store blocks uncompressed instead of making
+  // the producer wait for the codec.
+  bool spill_uncompressed;
+  // Train a BlockDictionary on the first data written and compress later
+  // blocks with it. Only has an effect with the zstd codec.
+  bool train_dictionary;
+  // Overrides for individual trace substreams, by substream name. Only
+  // TraceWriter and TraceReader::pack look at these.
+  std::map<std::string, SubstreamCompression> substreams;
+
+  CompressionOptions()
+      : codec(BlockCodec::ZLIB),
+        level(0),
+        memory_budget(0),
+        spill_uncompressed(false),
+        train_dictionary(false) {}
+};
+
+} // namespace rr
+
+#endif /* RR_BLOCK_CODEC_H_ */
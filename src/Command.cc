@@ -9,6 +9,7 @@
 
 #include <algorithm>
 
+#include "BlockCodec.h"
 #include "main.h"
 #include "TraceStream.h"
 
@@ -23,6 +24,86 @@ bool ParsedOption::verify_valid_int(int64_t min, int64_t max) const {
   return true;
 }
 
+/**
+ * Parse <CODEC>[:<LEVEL>] from |value|.
+ */
+static bool parse_codec(const string& value, BlockCodec::Type* codec,
+                        int* level) {
+  size_t colon = value.find(':');
+  string name = value.substr(0, colon);
+  if (!BlockCodec::parse_name(name, codec)) {
+    fprintf(stderr, "Unknown compression codec `%s'\n", name.c_str());
+    return false;
+  }
+  if (!BlockCodec::get(*codec)) {
+    fprintf(stderr, "This rr was built without %s support\n", name.c_str());
+    return false;
+  }
+  *level = 0;
+  if (colon != string::npos) {
+    char* end;
+    const char* level_str = value.c_str() + colon + 1;
+    *level = strtol(level_str, &end, 10);
+    if (!*level_str || *end) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ParsedOption::verify_valid_compression(
+    CompressionOptions* options) const {
+  return parse_codec(value, &options->codec, &options->level);
+}
+
+bool ParsedOption::verify_valid_substream_compression(
+    CompressionOptions* options) const {
+  size_t colon = value.find(':');
+  string name = value.substr(0, colon);
+  TraceStream::Substream s;
+  if (colon == string::npos || !TraceStream::parse_substream_name(name, &s)) {
+    fprintf(stderr, "Unknown trace substream `%s'\n", name.c_str());
+    return false;
+  }
+  SubstreamCompression& c = options->substreams[name];
+  size_t pos = colon + 1;
+  while (pos <= value.size()) {
+    size_t comma = value.find(',', pos);
+    if (comma == string::npos) {
+      comma = value.size();
+    }
+    string setting = value.substr(pos, comma - pos);
+    pos = comma + 1;
+    size_t eq = setting.find('=');
+    string key = setting.substr(0, eq);
+    string v = eq == string::npos ? string() : setting.substr(eq + 1);
+    char* end;
+    if (key == "codec") {
+      if (!parse_codec(v, &c.codec, &c.level)) {
+        return false;
+      }
+      c.set_codec = true;
+      continue;
+    }
+    long n = strtol(v.c_str(), &end, 10);
+    if (v.empty() || *end || n <= 0) {
+      fprintf(stderr, "Bad setting `%s' for substream %s\n", setting.c_str(),
+              name.c_str());
+      return false;
+    }
+    if (key == "block" && n <= 256 * 1024) {
+      c.block_size = (size_t)n * 1024;
+    } else if (key == "threads" && n <= 64) {
+      c.threads = (uint32_t)n;
+    } else {
+      fprintf(stderr, "Bad setting `%s' for substream %s\n", setting.c_str(),
+              name.c_str());
+      return false;
+    }
+  }
+  return true;
+}
+
 static vector<Command*>* command_list;
 
 Command::Command(const char* name, const char* help) : name(name), help(help) {
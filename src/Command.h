@@ -17,6 +17,7 @@
 namespace rr {
 
 class TraceReader;
+struct CompressionOptions;
 
 enum OptionParameters { NO_PARAMETER, HAS_PARAMETER };
 struct OptionSpec {
@@ -30,6 +31,18 @@ struct ParsedOption {
   int64_t int_value;
   bool verify_valid_int(int64_t min = INT64_MIN + 1,
                         int64_t max = INT64_MAX) const;
+  /**
+   * Parse a <CODEC>[:<LEVEL>] value into |options|, reporting problems on
+   * stderr.
+   */
+  bool verify_valid_compression(CompressionOptions* options) const;
+  /**
+   * Parse a <SUBSTREAM>:<KEY>=<VALUE>[,<KEY>=<VALUE>]... value, where the
+   * keys are `block' (in KB), `threads' and `codec' (<CODEC>[:<LEVEL>]),
+   * into |options|' overrides for that substream, reporting problems on
+   * stderr.
+   */
+  bool verify_valid_substream_compression(CompressionOptions* options) const;
 };
 
 /**
@@ -8,39 +8,116 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
-#include <zlib.h>
 
-#include "CompressedWriter.h"
+#include <algorithm>
+#include <deque>
+
+#include "BlockCodec.h"
+#include "log.h"
+#include "Timeline.h"
 
 using namespace std;
 
 namespace rr {
 
+/**
+ * A read-only mapping of the whole file, shared by copies of a reader.
+ */
+class CompressedReader::Mapping {
+public:
+  Mapping(const ScopedFd& fd) : data(nullptr), size(0) {
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size == 0) {
+      return;
+    }
+    void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p != MAP_FAILED) {
+      data = static_cast<const uint8_t*>(p);
+      size = st.st_size;
+    }
+  }
+  ~Mapping() {
+    if (data) {
+      munmap(const_cast<uint8_t*>(data), size);
+    }
+  }
+
+  const uint8_t* data;
+  size_t size;
+};
+
+CompressedReader::BlockData::BlockData(const BlockData& other)
+    : storage(other.storage),
+      mapping(other.mapping),
+      size(other.size) {
+  data = other.data == other.storage.data() ? storage.data() : other.data;
+}
+
+void CompressedReader::BlockData::swap(BlockData& other) {
+  // Swapping vectors doesn't move their elements, so 'data' stays valid.
+  storage.swap(other.storage);
+  mapping.swap(other.mapping);
+  std::swap(data, other.data);
+  std::swap(size, other.size);
+}
+
+void CompressedReader::BlockData::clear() {
+  storage.clear();
+  mapping = nullptr;
+  data = nullptr;
+  size = 0;
+}
+
 CompressedReader::CompressedReader(const string& filename)
-    : fd(new ScopedFd(filename.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE)) {
+    : fd(new ScopedFd(filename.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE)),
+      dictionary(BlockDictionary::load(BlockDictionary::path_for(filename))),
+      dictionary_path(BlockDictionary::path_for(filename)) {
   fd_offset = 0;
   error = !fd->is_open();
-  eof = false;
+  // An empty file is at its end right away, so at_end() works before
+  // anything has been read.
+  struct stat st;
+  eof = !error && !fstat(*fd, &st) && st.st_size == 0;
   buffer_read_pos = 0;
   have_saved_state = false;
+  read_ahead_blocks = 0;
+  indexed_file_offset = indexed_uncompressed_offset = 0;
+  follow_wait_at_end = false;
+  prefetch_start = prefetch_end = prefetch_window = 0;
+  cached_block_offset = UINT64_MAX;
+  block_wait_seconds_ = 0;
 }
 
-CompressedReader::CompressedReader(const CompressedReader& other) {
+CompressedReader::CompressedReader(const CompressedReader& other)
+    : buffer(other.buffer) {
   fd = other.fd;
+  dictionary = other.dictionary;
+  dictionary_path = other.dictionary_path;
   fd_offset = other.fd_offset;
   error = other.error;
   eof = other.eof;
   buffer_read_pos = other.buffer_read_pos;
-  buffer = other.buffer;
+  block_index = other.block_index;
+  indexed_file_offset = other.indexed_file_offset;
+  indexed_uncompressed_offset = other.indexed_uncompressed_offset;
+  mapping = other.mapping;
+  follow = other.follow;
+  follow_wait_at_end = other.follow_wait_at_end;
+  read_ahead_blocks = other.read_ahead_blocks;
+  prefetch_start = prefetch_end = prefetch_window = 0;
+  block_cache_dir = other.block_cache_dir;
+  block_cache_prefix = other.block_cache_prefix;
+  cached_block_offset = UINT64_MAX;
   have_saved_state = false;
   assert(!other.have_saved_state);
+  block_wait_seconds_ = other.block_wait_seconds_;
 }
 
-CompressedReader::~CompressedReader() { close(); }
-
 static bool read_all(const ScopedFd& fd, size_t size, void* data,
                      uint64_t* offset) {
   while (size > 0) {
@@ -55,80 +132,508 @@ static bool read_all(const ScopedFd& fd, size_t size, void* data,
   return true;
 }
 
-static bool do_decompress(std::vector<uint8_t>& compressed,
+static bool do_decompress(const CompressedWriter::BlockHeader& header,
+                          const BlockDictionary* dictionary,
+                          std::vector<uint8_t>& compressed,
                           std::vector<uint8_t>& uncompressed) {
-  z_stream stream;
-  memset(&stream, 0, sizeof(stream));
-  int result = inflateInit(&stream);
-  if (result != Z_OK) {
-    assert(0 && "inflateInit failed!");
+  if (header.codec == BlockDictionary::CODEC_ID) {
+    if (!dictionary) {
+      FATAL() << "Trace block needs a compression dictionary, which is "
+                 "missing or not supported by this build of rr";
+    }
+    return dictionary->decompress(compressed.data(), compressed.size(),
+                                  uncompressed.data(), uncompressed.size());
+  }
+  const BlockCodec* codec =
+      header.codec < BlockCodec::CODEC_COUNT
+          ? BlockCodec::get((BlockCodec::Type)header.codec)
+          : nullptr;
+  if (!codec) {
+    FATAL() << "Trace block uses compression codec " << header.codec
+            << ", which this build of rr does not support";
+  }
+  return codec->decompress(compressed.data(), compressed.size(),
+                           uncompressed.data(), uncompressed.size());
+}
+
+/**
+ * Read and decompress the block at 'offset'. Sets '*next_offset' to the
+ * offset of the following block and '*eof' if there isn't one.
+ */
+static bool read_block(const ScopedFd& fd, const BlockDictionary* dictionary,
+                       uint64_t offset, std::vector<uint8_t>& uncompressed,
+                       uint64_t* next_offset, bool* eof) {
+  CompressedWriter::BlockHeader header;
+  if (!read_all(fd, sizeof(header), &header, &offset)) {
     return false;
   }
 
-  stream.next_in = &compressed[0];
-  stream.avail_in = compressed.size();
-  stream.next_out = &uncompressed[0];
-  stream.avail_out = uncompressed.size();
-  result = inflate(&stream, Z_FINISH);
-  if (result != Z_STREAM_END) {
-    assert(0 && "inflate failed!");
+  std::vector<uint8_t> compressed_buf;
+  compressed_buf.resize(header.compressed_length);
+  uint64_t block_offset = offset - sizeof(header);
+  if (!read_all(fd, compressed_buf.size(), &compressed_buf[0], &offset)) {
+    return false;
+  }
+  if (header.compute_checksum(compressed_buf.data()) != header.checksum) {
+    LOG(error) << "Trace block at offset " << block_offset
+               << " fails its checksum; the trace is corrupt";
     return false;
   }
 
-  result = inflateEnd(&stream);
-  if (result != Z_OK) {
-    assert(0 && "inflateEnd failed!");
+  char ch;
+  *eof = pread(fd, &ch, 1, offset) == 0;
+  *next_offset = offset;
+
+  uncompressed.resize(header.uncompressed_length);
+  TimelineScope timeline(Timeline::RR_THREAD, Timeline::current_thread(),
+                         "compression", "decompress block");
+  return do_decompress(header, dictionary, compressed_buf, uncompressed);
+}
+
+/**
+ * A pool of threads decompressing the blocks following the reader's current
+ * position into a queue. Blocks are handed out in file order; asking for any
+ * block other than the next queued one restarts the pipeline there.
+ */
+class CompressedReader::ReadAhead {
+public:
+  ReadAhead(shared_ptr<ScopedFd> fd,
+            shared_ptr<const BlockDictionary> dictionary, uint32_t depth);
+  ~ReadAhead();
+
+  bool get_block(uint64_t offset, std::vector<uint8_t>& data,
+                 uint64_t* next_offset, bool* eof);
+
+private:
+  struct Block {
+    uint64_t offset;
+    uint64_t next_offset;
+    std::vector<uint8_t> data;
+    bool done;
+    bool ok;
+    bool eof;
+  };
+
+  static void* worker_thread_callback(void* p);
+  void worker_thread();
+
+  shared_ptr<ScopedFd> fd;
+  shared_ptr<const BlockDictionary> dictionary;
+  uint32_t depth;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::vector<pthread_t> threads;
+
+  // BEGIN protected by 'mutex'
+  std::deque<shared_ptr<Block> > blocks;
+  /* file offset of the next block to hand to a worker */
+  uint64_t schedule_offset;
+  /* true if there's no block at schedule_offset */
+  bool schedule_end;
+  bool closing;
+  // END protected by 'mutex'
+};
+
+CompressedReader::ReadAhead::ReadAhead(
+    shared_ptr<ScopedFd> fd, shared_ptr<const BlockDictionary> dictionary,
+    uint32_t depth)
+    : fd(fd),
+      dictionary(dictionary),
+      depth(depth),
+      schedule_offset(0),
+      schedule_end(true),
+      closing(false) {
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+  threads.resize(depth);
+  for (auto& t : threads) {
+    pthread_create(&t, nullptr, worker_thread_callback, this);
+    pthread_setname_np(t, "decompress");
+  }
+}
+
+CompressedReader::ReadAhead::~ReadAhead() {
+  pthread_mutex_lock(&mutex);
+  closing = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  for (auto& t : threads) {
+    pthread_join(t, nullptr);
+  }
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
+}
+
+void* CompressedReader::ReadAhead::worker_thread_callback(void* p) {
+  static_cast<ReadAhead*>(p)->worker_thread();
+  return nullptr;
+}
+
+void CompressedReader::ReadAhead::worker_thread() {
+  pthread_mutex_lock(&mutex);
+  while (!closing) {
+    if (schedule_end || blocks.size() >= depth) {
+      pthread_cond_wait(&cond, &mutex);
+      continue;
+    }
+
+    // Reading the header is cheap, so do it under the lock to find where
+    // the block after this one starts.
+    CompressedWriter::BlockHeader header;
+    uint64_t header_offset = schedule_offset;
+    if (!read_all(*fd, sizeof(header), &header, &header_offset)) {
+      schedule_end = true;
+      pthread_cond_broadcast(&cond);
+      continue;
+    }
+    shared_ptr<Block> block = make_shared<Block>();
+    block->offset = schedule_offset;
+    block->done = false;
+    blocks.push_back(block);
+    schedule_offset = header_offset + header.compressed_length;
+
+    pthread_mutex_unlock(&mutex);
+    block->ok = read_block(*fd, dictionary.get(), block->offset, block->data,
+                           &block->next_offset, &block->eof);
+    pthread_mutex_lock(&mutex);
+
+    // If the pipeline was restarted meanwhile, nobody will look at this
+    // block again.
+    block->done = true;
+    pthread_cond_broadcast(&cond);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+bool CompressedReader::ReadAhead::get_block(uint64_t offset,
+                                            std::vector<uint8_t>& data,
+                                            uint64_t* next_offset, bool* eof) {
+  pthread_mutex_lock(&mutex);
+  if (blocks.empty() ? schedule_end || schedule_offset != offset
+                     : blocks.front()->offset != offset) {
+    blocks.clear();
+    schedule_offset = offset;
+    schedule_end = false;
+    pthread_cond_broadcast(&cond);
+  }
+  while (blocks.empty() ? !schedule_end : !blocks.front()->done) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  if (blocks.empty()) {
+    // There's no block at 'offset'.
+    pthread_mutex_unlock(&mutex);
     return false;
   }
+  shared_ptr<Block> block = blocks.front();
+  blocks.pop_front();
+  // A queue slot opened up.
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
 
+  if (!block->ok) {
+    return false;
+  }
+  data.swap(block->data);
+  *next_offset = block->next_offset;
+  *eof = block->eof;
   return true;
 }
 
+CompressedReader::~CompressedReader() { close(); }
+
 bool CompressedReader::read(void* data, size_t size) {
   while (size > 0) {
     if (error) {
       return false;
     }
 
-    if (buffer_read_pos < buffer.size()) {
-      size_t amount = std::min(size, buffer.size() - buffer_read_pos);
-      memcpy(data, &buffer[buffer_read_pos], amount);
+    if (buffer_read_pos < buffer.size) {
+      size_t amount = std::min(size, buffer.size - buffer_read_pos);
+      memcpy(data, buffer.data + buffer_read_pos, amount);
       size -= amount;
       data = static_cast<char*>(data) + amount;
       buffer_read_pos += amount;
       continue;
     }
 
-    if (have_saved_state && !have_saved_buffer) {
-      std::swap(buffer, saved_buffer);
+    if (!next_block()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool CompressedReader::read_view(size_t size, const uint8_t** data,
+                                 std::vector<uint8_t>& storage) {
+  if (size > 0 && buffer_read_pos == buffer.size && !error && !next_block()) {
+    return false;
+  }
+  if (error) {
+    return false;
+  }
+  if (buffer.size - buffer_read_pos >= size) {
+    *data = buffer.data + buffer_read_pos;
+    buffer_read_pos += size;
+    return true;
+  }
+  storage.resize(size);
+  if (!read(storage.data(), size)) {
+    return false;
+  }
+  *data = storage.data();
+  return true;
+}
+
+bool CompressedReader::next_block() {
+  if (have_saved_state) {
+    if (have_saved_buffer) {
+      saved_state_read_blocks = true;
+    } else {
+      buffer.swap(saved_buffer);
       have_saved_buffer = true;
     }
+  }
+  return refill_buffer();
+}
 
-    CompressedWriter::BlockHeader header;
-    if (!read_all(*fd, sizeof(header), &header, &fd_offset)) {
-      error = true;
+bool CompressedReader::map_stored_block(
+    uint64_t offset, const CompressedWriter::BlockHeader& header) {
+  uint64_t data_offset = offset + sizeof(header);
+  uint64_t end_offset = data_offset + header.compressed_length;
+  if (header.compressed_length != header.uncompressed_length) {
+    return false;
+  }
+  if (!mapping || end_offset > mapping->size) {
+    // Map (or remap, if the file has grown) the whole file.
+    mapping = make_shared<Mapping>(*fd);
+    if (!mapping->data || end_offset > mapping->size) {
       return false;
     }
+  }
+  if (header.compute_checksum(mapping->data + data_offset) !=
+      header.checksum) {
+    LOG(error) << "Trace block at offset " << offset
+               << " fails its checksum; the trace is corrupt";
+    return false;
+  }
+  buffer.storage.clear();
+  buffer.mapping = mapping;
+  buffer.data = mapping->data + data_offset;
+  buffer.size = header.uncompressed_length;
+  fd_offset = end_offset;
+  eof = end_offset == mapping->size;
+  return true;
+}
 
-    std::vector<uint8_t> compressed_buf;
-    compressed_buf.resize(header.compressed_length);
-    if (!read_all(*fd, compressed_buf.size(), &compressed_buf[0], &fd_offset)) {
-      error = true;
-      return false;
+string CompressedReader::block_cache_path(uint64_t offset) {
+  if (block_cache_prefix.empty()) {
+    // Traces are never modified once written, so a file's identity and
+    // final size and mtime identify its contents. A trace still being
+    // written just misses until it's finished.
+    struct stat st;
+    if (fstat(*fd, &st)) {
+      return string();
     }
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%llx_%llx_%llx_%llx.%09ld",
+             (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+             (unsigned long long)st.st_size,
+             (unsigned long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    block_cache_prefix = block_cache_dir + "/" + buf;
+  }
+  char buf[32];
+  snprintf(buf, sizeof(buf), "_%llx", (unsigned long long)offset);
+  return block_cache_prefix + buf;
+}
+
+bool CompressedReader::map_cached_block(
+    uint64_t offset, const CompressedWriter::BlockHeader& header) {
+  string path = block_cache_path(offset);
+  if (path.empty()) {
+    return false;
+  }
+  ScopedFd cache_fd(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (!cache_fd.is_open()) {
+    return false;
+  }
+  auto cache_mapping = make_shared<Mapping>(cache_fd);
+  if (!cache_mapping->data ||
+      cache_mapping->size != header.uncompressed_length) {
+    return false;
+  }
+  buffer.storage.clear();
+  buffer.mapping = cache_mapping;
+  buffer.data = cache_mapping->data;
+  buffer.size = cache_mapping->size;
+  fd_offset = offset + sizeof(header) + header.compressed_length;
+  char ch;
+  eof = pread(*fd, &ch, 1, fd_offset) == 0;
+  return true;
+}
+
+void CompressedReader::store_cached_block(uint64_t offset) {
+  string path = block_cache_path(offset);
+  if (path.empty() || buffer.size == 0) {
+    return;
+  }
+  mkdir(block_cache_dir.c_str(), 0755);
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".tmp%d", getpid());
+  string tmp_path = path + suffix;
+  ScopedFd cache_fd(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0644);
+  if (!cache_fd.is_open()) {
+    return;
+  }
+  // Readers only ever see complete blocks, since they're renamed into place.
+  if (write(cache_fd, buffer.data, buffer.size) != (ssize_t)buffer.size ||
+      rename(tmp_path.c_str(), path.c_str())) {
+    LOG(debug) << "Can't add block to cache " << path;
+    unlink(tmp_path.c_str());
+  }
+}
+
+// prefetch() first asks for this much of the file, then for twice as much
+// each time the reader gets halfway through the last range, up to
+// PREFETCH_MAX_BYTES at a time.
+static const uint64_t PREFETCH_MIN_BYTES = 256 * 1024;
+static const uint64_t PREFETCH_MAX_BYTES = 16 * 1024 * 1024;
+
+void CompressedReader::prefetch() {
+  if (!fd || !fd->is_open() || eof) {
+    return;
+  }
+  if (!prefetch_window || fd_offset < prefetch_start ||
+      fd_offset > prefetch_end) {
+    // First read, or we seeked away from the prefetched range.
+    prefetch_window = PREFETCH_MIN_BYTES;
+    prefetch_end = fd_offset;
+  } else if (prefetch_end - fd_offset > prefetch_window / 2) {
+    return;
+  } else {
+    prefetch_window = min(prefetch_window * 2, PREFETCH_MAX_BYTES);
+  }
+  // This only starts the reads; it doesn't wait for them.
+  posix_fadvise(*fd, prefetch_end, prefetch_window, POSIX_FADV_WILLNEED);
+  prefetch_start = fd_offset;
+  prefetch_end += prefetch_window;
+}
 
-    char ch;
-    if (pread(*fd, &ch, 1, fd_offset) == 0) {
-      eof = true;
+bool CompressedReader::at_end() const {
+  if (buffer_read_pos < buffer.size) {
+    return false;
+  }
+  if (!follow || !fd || error) {
+    return eof;
+  }
+  // 'eof' only says whether the writer had written more when we read the
+  // last block.
+  return follow_wait_at_end ? !wait_for_block(fd_offset)
+                            : !has_complete_block(fd_offset);
+}
+
+/**
+ * True if the file has a whole block at 'offset', not just the part of one
+ * that the writer has written so far.
+ */
+bool CompressedReader::has_complete_block(uint64_t offset) const {
+  CompressedWriter::BlockHeader header;
+  uint64_t data_offset = offset;
+  struct stat st;
+  return read_all(*fd, sizeof(header), &header, &data_offset) &&
+         !fstat(*fd, &st) &&
+         (uint64_t)st.st_size >= data_offset + header.compressed_length;
+}
+
+/**
+ * Wait until there's a whole block at 'offset'. Returns false if the writer
+ * finished without writing one.
+ */
+bool CompressedReader::wait_for_block(uint64_t offset) const {
+  useconds_t delay = 1000;
+  while (!has_complete_block(offset)) {
+    if (!follow()) {
+      // The writer may have completed the block just before it finished.
+      return has_complete_block(offset);
     }
+    usleep(delay);
+    delay = min<useconds_t>(delay * 2, 100000);
+  }
+  return true;
+}
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+bool CompressedReader::refill_buffer() {
+  double start = now_sec();
+  bool ok = refill_buffer_internal();
+  block_wait_seconds_ += now_sec() - start;
+  return ok;
+}
 
-    buffer.resize(header.uncompressed_length);
+bool CompressedReader::refill_buffer_internal() {
+  if (fd_offset == cached_block_offset) {
+    buffer.swap(cached_block);
+    fd_offset = cached_block_next_offset;
+    eof = cached_block_eof;
+    cached_block_offset = UINT64_MAX;
     buffer_read_pos = 0;
-    if (!do_decompress(compressed_buf, buffer)) {
-      error = true;
-      return false;
+    return true;
+  }
+
+  if (follow && !wait_for_block(fd_offset)) {
+    error = true;
+    return false;
+  }
+
+  prefetch();
+
+  CompressedWriter::BlockHeader header;
+  uint64_t header_offset = fd_offset;
+  if (!read_all(*fd, sizeof(header), &header, &header_offset)) {
+    error = true;
+    return false;
+  }
+  if (follow && header.codec == BlockDictionary::CODEC_ID && !dictionary) {
+    // The writer trained its dictionary after we opened the file.
+    dictionary = BlockDictionary::load(dictionary_path);
+  }
+
+  bool ok;
+  uint64_t block_offset = fd_offset;
+  if (header.codec == BlockCodec::NONE) {
+    ok = map_stored_block(fd_offset, header);
+  } else if (!block_cache_dir.empty()) {
+    ok = map_cached_block(block_offset, header);
+    if (!ok) {
+      ok = read_block(*fd, dictionary.get(), fd_offset, buffer.storage,
+                      &fd_offset, &eof);
+      buffer.use_storage();
+      if (ok) {
+        store_cached_block(block_offset);
+      }
     }
+  } else if (read_ahead_blocks > 0) {
+    if (!read_ahead) {
+      read_ahead = unique_ptr<ReadAhead>(
+          new ReadAhead(fd, dictionary, read_ahead_blocks));
+    }
+    ok = read_ahead->get_block(fd_offset, buffer.storage, &fd_offset, &eof);
+    buffer.use_storage();
+  } else {
+    ok = read_block(*fd, dictionary.get(), fd_offset, buffer.storage,
+                    &fd_offset, &eof);
+    buffer.use_storage();
+  }
+  if (!ok) {
+    error = true;
+    return false;
   }
+  buffer_read_pos = 0;
   return true;
 }
 
@@ -140,12 +645,84 @@ void CompressedReader::rewind() {
   eof = false;
 }
 
-void CompressedReader::close() { fd = nullptr; }
+void CompressedReader::close() {
+  // Stop the workers before they lose the fd.
+  read_ahead = nullptr;
+  mapping = nullptr;
+  fd = nullptr;
+}
+
+void CompressedReader::build_block_index() {
+  // Carry on from where we got to last time, if the file has grown.
+  auto index = block_index ? make_shared<BlockIndex>(*block_index)
+                           : make_shared<BlockIndex>();
+  uint64_t offset = indexed_file_offset;
+  uint64_t uncompressed_offset = indexed_uncompressed_offset;
+  CompressedWriter::BlockHeader header;
+  while (true) {
+    uint64_t block_offset = offset;
+    if ((follow && !has_complete_block(offset)) ||
+        !read_all(*fd, sizeof(header), &header, &offset)) {
+      offset = block_offset;
+      break;
+    }
+    CompressedWriter::BlockIndexEntry entry = { uncompressed_offset,
+                                                block_offset };
+    index->push_back(entry);
+    uncompressed_offset += header.uncompressed_length;
+    offset += header.compressed_length;
+  }
+  indexed_file_offset = offset;
+  indexed_uncompressed_offset = uncompressed_offset;
+  block_index = index;
+}
+
+static bool entry_less_than(uint64_t offset,
+                            const CompressedWriter::BlockIndexEntry& entry) {
+  return offset < entry.uncompressed_offset;
+}
+
+bool CompressedReader::seek(uint64_t uncompressed_offset) {
+  assert(!have_saved_state);
+  if (error) {
+    return false;
+  }
+  if (!block_index) {
+    build_block_index();
+  }
+  if (follow && indexed_file_offset != UINT64_MAX) {
+    // The writer may have written the block we want since we indexed.
+    while (uncompressed_offset >= indexed_uncompressed_offset &&
+           wait_for_block(indexed_file_offset)) {
+      build_block_index();
+    }
+  }
+  // Find the last block starting at or before the requested offset.
+  auto it = upper_bound(block_index->begin(), block_index->end(),
+                        uncompressed_offset, entry_less_than);
+  if (it == block_index->begin()) {
+    // An empty stream can only be "seeked" to its start.
+    return block_index->empty() && uncompressed_offset == 0;
+  }
+  --it;
+  fd_offset = it->file_offset;
+  eof = false;
+  if (!refill_buffer()) {
+    return false;
+  }
+  size_t offset_in_block = uncompressed_offset - it->uncompressed_offset;
+  if (offset_in_block > buffer.size) {
+    return false;
+  }
+  buffer_read_pos = offset_in_block;
+  return true;
+}
 
 void CompressedReader::save_state() {
   assert(!have_saved_state);
   have_saved_state = true;
   have_saved_buffer = false;
+  saved_state_read_blocks = false;
   saved_fd_offset = fd_offset;
   saved_buffer_read_pos = buffer_read_pos;
 }
@@ -153,14 +730,22 @@ void CompressedReader::save_state() {
 void CompressedReader::restore_state() {
   assert(have_saved_state);
   have_saved_state = false;
+  if (have_saved_buffer) {
+    buffer.swap(saved_buffer);
+    if (!saved_state_read_blocks) {
+      // We read exactly one block since save_state(), the one at
+      // saved_fd_offset. Keep it since we'll probably read it again next.
+      cached_block_offset = saved_fd_offset;
+      cached_block_next_offset = fd_offset;
+      cached_block_eof = eof;
+      saved_buffer.swap(cached_block);
+    }
+    saved_buffer.clear();
+  }
   if (saved_fd_offset < fd_offset) {
     eof = false;
   }
   fd_offset = saved_fd_offset;
-  if (have_saved_buffer) {
-    std::swap(buffer, saved_buffer);
-    saved_buffer.clear();
-  }
   buffer_read_pos = saved_buffer_read_pos;
 }
 
@@ -179,4 +764,82 @@ uint64_t CompressedReader::compressed_bytes() const {
   return lseek(*fd, 0, SEEK_END);
 }
 
+namespace {
+
+struct VerifyState {
+  const ScopedFd* fd;
+  const std::vector<uint64_t>* offsets;
+  pthread_mutex_t mutex;
+  // BEGIN protected by 'mutex'
+  size_t next;
+  std::vector<uint64_t> bad_blocks;
+  // END protected by 'mutex'
+};
+
+} // anonymous namespace
+
+static void* verify_thread(void* p) {
+  VerifyState* state = static_cast<VerifyState*>(p);
+  std::vector<uint8_t> compressed;
+  while (true) {
+    pthread_mutex_lock(&state->mutex);
+    size_t i = state->next++;
+    pthread_mutex_unlock(&state->mutex);
+    if (i >= state->offsets->size()) {
+      return nullptr;
+    }
+    uint64_t offset = (*state->offsets)[i];
+    CompressedWriter::BlockHeader header;
+    bool ok = read_all(*state->fd, sizeof(header), &header, &offset);
+    if (ok) {
+      compressed.resize(header.compressed_length);
+      ok = read_all(*state->fd, compressed.size(), compressed.data(),
+                    &offset) &&
+           header.compute_checksum(compressed.data()) == header.checksum;
+    }
+    if (!ok) {
+      pthread_mutex_lock(&state->mutex);
+      state->bad_blocks.push_back((*state->offsets)[i]);
+      pthread_mutex_unlock(&state->mutex);
+    }
+  }
+}
+
+uint64_t CompressedReader::verify_checksums(
+    uint32_t threads, std::vector<uint64_t>* bad_blocks) const {
+  // Walking the headers is cheap; checksumming the blocks is the work we
+  // spread over threads.
+  std::vector<uint64_t> offsets;
+  uint64_t offset = 0;
+  uint64_t size = compressed_bytes();
+  CompressedWriter::BlockHeader header;
+  while (offset < size) {
+    offsets.push_back(offset);
+    if (!read_all(*fd, sizeof(header), &header, &offset)) {
+      break;
+    }
+    offset += header.compressed_length;
+  }
+
+  VerifyState state;
+  state.fd = fd.get();
+  state.offsets = &offsets;
+  state.next = 0;
+  pthread_mutex_init(&state.mutex, nullptr);
+  std::vector<pthread_t> workers(
+      std::max<size_t>(1, std::min<size_t>(threads, offsets.size())));
+  for (auto& t : workers) {
+    pthread_create(&t, nullptr, verify_thread, &state);
+  }
+  for (auto& t : workers) {
+    pthread_join(t, nullptr);
+  }
+  pthread_mutex_destroy(&state.mutex);
+
+  std::sort(state.bad_blocks.begin(), state.bad_blocks.end());
+  bad_blocks->insert(bad_blocks->end(), state.bad_blocks.begin(),
+                     state.bad_blocks.end());
+  return offsets.size();
+}
+
 } // namespace rr
@@ -6,18 +6,23 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#include <functional>
 #include <memory>
 #include <vector>
 #include <string>
 
+#include "CompressedWriter.h"
 #include "ScopedFd.h"
 
 namespace rr {
 
 /**
  * CompressedReader opens an input file written by CompressedWriter
- * and reads data from it. Currently data is decompressed by the thread that
- * calls read().
+ * and reads data from it. By default data is decompressed by the thread that
+ * calls read(). With set_read_ahead(), worker threads decompress the blocks
+ * following the current one so read() rarely has to wait for decompression.
+ * Blocks stored with BlockCodec::NONE aren't copied at all; they're served
+ * from a read-only mapping of the file.
  */
 class CompressedReader {
 public:
@@ -25,13 +30,79 @@ public:
   CompressedReader(const CompressedReader& aOther);
   ~CompressedReader();
   bool good() const { return !error; }
-  bool at_end() const { return eof && buffer_read_pos == buffer.size(); }
+  bool at_end() const;
   // Returns true if successful. Otherwise there's an error and good()
   // will be false.
   bool read(void* data, size_t size);
+  /**
+   * Like read(), but avoids copying when the data lies within one block:
+   * '*data' is set to point into the reader's block buffer (or the file
+   * mapping), and is only valid until the next call on this reader. Data
+   * that spans blocks is copied into 'storage'.
+   */
+  bool read_view(size_t size, const uint8_t** data,
+                 std::vector<uint8_t>& storage);
   void rewind();
   void close();
 
+  typedef std::vector<CompressedWriter::BlockIndexEntry> BlockIndex;
+  /**
+   * Use 'index' (as produced by CompressedWriter::block_index()) for seeks.
+   * Without one, the first seek builds the index by scanning block headers.
+   */
+  void set_block_index(std::shared_ptr<const BlockIndex> index) {
+    block_index = index;
+    // It covers the whole file, so it never needs extending.
+    indexed_file_offset = UINT64_MAX;
+  }
+  /**
+   * Position the stream so that the next read returns the data at
+   * 'uncompressed_offset'. Only the block containing that offset is
+   * decompressed. Returns false if the offset is out of range or the
+   * block can't be read.
+   */
+  bool seek(uint64_t uncompressed_offset);
+
+  /**
+   * Decompress up to 'blocks' blocks ahead of the current position on
+   * worker threads. 0 (the default) disables read-ahead. Copies of this
+   * reader inherit the setting but start their own pipeline.
+   */
+  void set_read_ahead(uint32_t blocks) { read_ahead_blocks = blocks; }
+
+  /**
+   * Share decompressed blocks with other readers of the same file, in this
+   * or other processes, through files in 'dir'. A block found there is
+   * mapped instead of decompressed; a block that isn't is added after
+   * decompressing it. The directory may be deleted at any time. While a
+   * cache is set, read-ahead is disabled, since its workers would
+   * decompress blocks we may find in the cache.
+   */
+  void set_block_cache_dir(const std::string& dir) { block_cache_dir = dir; }
+
+  /**
+   * Ask the kernel to start reading the file from the current position,
+   * so the first read() doesn't wait for cold storage. Readers also keep
+   * asking for the part of the file ahead of them as they read it.
+   */
+  void prefetch();
+
+  /**
+   * Read the file while it's still being written, by a CompressedWriter
+   * that flush()es it from time to time, for as long as 'writer_running'
+   * returns true. Reads that get to the end of what has been written wait
+   * for the writer to append more. If 'wait_at_end' is set, at_end() waits
+   * too, until there's more to read or the writer has finished; otherwise
+   * it reports whether there's more to read right now. Read-ahead is
+   * disabled, since its workers would take a block that's still being
+   * written for a truncated one.
+   */
+  void set_follow(std::function<bool()> writer_running, bool wait_at_end) {
+    follow = writer_running;
+    follow_wait_at_end = wait_at_end;
+    read_ahead_blocks = 0;
+  }
+
   /**
    * Save the current position. Nested saves are not allowed.
    */
@@ -48,7 +119,24 @@ public:
   uint64_t uncompressed_bytes() const;
   uint64_t compressed_bytes() const;
 
+  /**
+   * Check every block's checksum, using up to 'threads' threads, without
+   * decompressing anything. Returns the number of blocks checked and
+   * appends the file offsets of corrupt blocks (including a truncated last
+   * block) to 'bad_blocks'. Independent of what's actually been read.
+   */
+  uint64_t verify_checksums(uint32_t threads,
+                            std::vector<uint64_t>* bad_blocks) const;
+
+  /**
+   * Wall-clock time read() has spent getting new blocks: reading and
+   * decompressing them, or waiting for read-ahead workers to.
+   */
+  double block_wait_seconds() const { return block_wait_seconds_; }
+
   template <typename T> CompressedReader& operator>>(T& value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only plain data can be read as bytes");
     read(&value, sizeof(value));
     return *this;
   }
@@ -69,31 +157,136 @@ public:
   template <typename T> CompressedReader& operator>>(std::vector<T>& value) {
     size_t len;
     *this >> len;
+    read_elements(value, len, IsBulkSerializable<T>());
+    return *this;
+  }
+
+  template <typename T, size_t N>
+  CompressedReader& operator>>(std::array<T, N>& value) {
+    if (IsBulkSerializable<T>::value) {
+      read(value.data(), N * sizeof(T));
+    } else {
+      for (auto& v : value) {
+        *this >> v;
+      }
+    }
+    return *this;
+  }
+
+protected:
+  // Vectors of plain data are read in one go, straight into the vector.
+  template <typename T>
+  void read_elements(std::vector<T>& value, size_t len, std::true_type) {
+    value.resize(len);
+    if (!read(value.data(), len * sizeof(T))) {
+      value.clear();
+    }
+  }
+  template <typename T>
+  void read_elements(std::vector<T>& value, size_t len, std::false_type) {
     value.resize(0);
     for (size_t i = 0; i < len; ++i) {
       T v;
       *this >> v;
       value.push_back(v);
     }
-    return *this;
   }
 
-protected:
+  class ReadAhead;
+  class Mapping;
+
+  /**
+   * The contents of a block. 'data' points into 'storage', or into
+   * 'mapping' for blocks stored uncompressed (a mapping of the file) and
+   * blocks found in the block cache (a mapping of the cache file). Holding
+   * the mapping keeps 'data' valid when the reader remaps a growing file.
+   */
+  struct BlockData {
+    std::vector<uint8_t> storage;
+    std::shared_ptr<Mapping> mapping;
+    const uint8_t* data;
+    size_t size;
+
+    BlockData() : data(nullptr), size(0) {}
+    BlockData(const BlockData& other);
+    void swap(BlockData& other);
+    void clear();
+    void use_storage() {
+      mapping = nullptr;
+      data = storage.data();
+      size = storage.size();
+    }
+
+  private:
+    BlockData& operator=(const BlockData& other);
+  };
+
+  bool next_block();
+  bool refill_buffer();
+  bool refill_buffer_internal();
+  bool map_stored_block(uint64_t offset,
+                        const CompressedWriter::BlockHeader& header);
+  std::string block_cache_path(uint64_t offset);
+  bool map_cached_block(uint64_t offset,
+                        const CompressedWriter::BlockHeader& header);
+  void store_cached_block(uint64_t offset);
+  void build_block_index();
+  bool has_complete_block(uint64_t offset) const;
+  bool wait_for_block(uint64_t offset) const;
+
   /* Our fd might be the dup of another fd, so we can't rely on its current file
      position.
      Instead track the current position in fd_offset and use pread. */
   uint64_t fd_offset;
   std::shared_ptr<ScopedFd> fd;
+  /* The file's BlockDictionary, if it has one */
+  std::shared_ptr<const BlockDictionary> dictionary;
+  std::string dictionary_path;
   bool error;
   bool eof;
-  std::vector<uint8_t> buffer;
+  BlockData buffer;
   size_t buffer_read_pos;
+  std::shared_ptr<const BlockIndex> block_index;
+  /* How far build_block_index() got: the file offset it stopped at, and
+     the uncompressed offset there. */
+  uint64_t indexed_file_offset;
+  uint64_t indexed_uncompressed_offset;
+  std::shared_ptr<Mapping> mapping;
+
+  /* Set while following a file that's being written; see set_follow() */
+  std::function<bool()> follow;
+  bool follow_wait_at_end;
+
+  uint32_t read_ahead_blocks;
+  std::unique_ptr<ReadAhead> read_ahead;
+
+  /* The file range prefetch() last asked the kernel to read, and the
+     size of the range it will ask for next. The window grows while the
+     reader keeps up with it, so faster readers prefetch more. */
+  uint64_t prefetch_start;
+  uint64_t prefetch_end;
+  uint64_t prefetch_window;
+
+  std::string block_cache_dir;
+  /* Identifies our file in block cache file names; computed on first use */
+  std::string block_cache_prefix;
+
+  /* The block most recently discarded by restore_state(), kept so that
+     peeking across a block boundary doesn't decompress it twice. */
+  uint64_t cached_block_offset;
+  uint64_t cached_block_next_offset;
+  bool cached_block_eof;
+  BlockData cached_block;
 
   bool have_saved_state;
   bool have_saved_buffer;
+  /* true if more than one block was read since save_state() */
+  bool saved_state_read_blocks;
   uint64_t saved_fd_offset;
-  std::vector<uint8_t> saved_buffer;
+  BlockData saved_buffer;
   size_t saved_buffer_read_pos;
+
+  double block_wait_seconds_;
 };
 
 } // namespace rr
@@ -6,30 +6,60 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
-#include <zlib.h>
+
+#include "Timeline.h"
+#include "TraceSink.h"
+#include "util.h"
 
 using namespace std;
 
 namespace rr {
 
+// Compressed blocks waiting for the output thread, beyond which compression
+// threads wait for it to catch up.
+static const size_t MAX_QUEUED_BLOCKS = 8;
+
+// Dictionaries are trained on the first DICTIONARY_TRAINING_BYTES written,
+// cut into samples about the size of a batch of metadata records.
+static const size_t DICTIONARY_TRAINING_BYTES = 512 * 1024;
+static const size_t DICTIONARY_SAMPLE_SIZE = 4096;
+static const size_t MAX_DICTIONARY_SIZE = 16 * 1024;
+
 void* CompressedWriter::compression_thread_callback(void* p) {
   static_cast<CompressedWriter*>(p)->compression_thread();
   return nullptr;
 }
 
+void* CompressedWriter::output_thread_callback(void* p) {
+  static_cast<CompressedWriter*>(p)->output_thread();
+  return nullptr;
+}
+
 CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
-                                   uint32_t num_threads)
-    : fd(filename.c_str(),
-         O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0400) {
+                                   uint32_t num_threads,
+                                   const CompressionOptions& options,
+                                   TraceSink* sink)
+    : sink(sink),
+      codec(BlockCodec::get(options.codec)),
+      codec_level(options.level),
+      spill_uncompressed(options.spill_uncompressed) {
+  assert(codec && "Codec not supported by this build");
   this->block_size = block_size;
   threads.resize(num_threads);
   thread_pos.resize(num_threads);
-  buffer.resize(block_size * (num_threads + 2));
+  // Every thread can be busy with a block while the producer fills another.
+  size_t buffer_blocks = num_threads + 2;
+  if (options.memory_budget) {
+    buffer_blocks =
+        max<size_t>(num_threads + 1, options.memory_budget / block_size);
+  }
+  buffer.resize(block_size * buffer_blocks);
   pthread_mutex_init(&mutex, nullptr);
   pthread_cond_init(&cond, nullptr);
 
@@ -38,16 +68,41 @@ CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
   }
   next_thread_pos = 0;
   next_thread_end_pos = 0;
+  completed_pos = 0;
+  idle_threads = 0;
   closing = false;
+  flush_pos = 0;
+  written_pos = 0;
   write_error = false;
+  next_file_offset = 0;
+  producer_waiting = false;
+  compression_done = false;
+  collecting_dictionary_samples =
+      options.train_dictionary && codec->type() == BlockCodec::ZSTD;
+  memset(&stats_, 0, sizeof(stats_));
+  stats_.cpu_migrations = num_threads ? 0 : -1;
 
   producer_reserved_pos = 0;
   producer_reserved_write_pos = 0;
   producer_reserved_upto_pos = 0;
   error = false;
-  if (fd < 0) {
-    error = true;
-    return;
+  closed = false;
+  size_t last_slash = filename.rfind('/');
+  sink_name =
+      last_slash == string::npos ? filename : filename.substr(last_slash + 1);
+  dictionary_path = BlockDictionary::path_for(filename);
+  if (sink) {
+    // Create the file at the other end even if no blocks follow.
+    sink->write_data(sink_name, 0, nullptr, 0);
+  }
+  if (!sink || sink->keep_local_files()) {
+    fd = ScopedFd(filename.c_str(),
+                  O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0400);
+    if (fd < 0) {
+      error = true;
+      closed = true;
+      return;
+    }
   }
 
   // Hold the lock so threads don't inspect the 'threads' array
@@ -55,13 +110,12 @@ CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
   pthread_mutex_lock(&mutex);
   for (uint32_t i = 0; i < num_threads; ++i) {
     pthread_create(&threads[i], nullptr, compression_thread_callback, this);
-    size_t last_slash = filename.rfind('/');
-    string thread_name =
-        string("compress ") + (last_slash == string::npos
-                                   ? filename
-                                   : filename.substr(last_slash + 1));
+    string thread_name = string("compress ") + sink_name;
     pthread_setname_np(threads[i], thread_name.substr(0, 15).c_str());
   }
+  pthread_create(&output_thread_id, nullptr, output_thread_callback, this);
+  string thread_name = string("write ") + sink_name;
+  pthread_setname_np(output_thread_id, thread_name.substr(0, 15).c_str());
   pthread_mutex_unlock(&mutex);
 }
 
@@ -72,7 +126,21 @@ CompressedWriter::~CompressedWriter() {
 }
 
 void CompressedWriter::write(const void* data, size_t size) {
-  while (!error && size > 0) {
+  while (size > 0) {
+    size_t amount;
+    uint8_t* buf = reserve(size, &amount);
+    if (!buf) {
+      return;
+    }
+    memcpy(buf, data, amount);
+    commit(amount);
+    data = static_cast<const char*>(data) + amount;
+    size -= amount;
+  }
+}
+
+uint8_t* CompressedWriter::reserve(size_t max_size, size_t* size) {
+  while (!error) {
     uint64_t reservation_size =
         producer_reserved_upto_pos - producer_reserved_write_pos;
     if (reservation_size == 0) {
@@ -80,50 +148,93 @@ void CompressedWriter::write(const void* data, size_t size) {
       continue;
     }
     size_t buf_offset = (size_t)(producer_reserved_write_pos % buffer.size());
-    size_t amount = min(buffer.size() - buf_offset,
-                        (size_t)min<uint64_t>(reservation_size, size));
-    memcpy(&buffer[buf_offset], data, amount);
-    producer_reserved_write_pos += amount;
-    data = static_cast<const char*>(data) + amount;
-    size -= amount;
+    *size = min(buffer.size() - buf_offset,
+                (size_t)min<uint64_t>(reservation_size, max_size));
+    return &buffer[buf_offset];
   }
+  *size = 0;
+  return nullptr;
+}
 
+void CompressedWriter::commit(size_t size) {
+  producer_reserved_write_pos += size;
+  // Publishing is cheap, so hand over every block as soon as it's full.
   if (!error &&
       producer_reserved_write_pos - producer_reserved_pos >=
-          buffer.size() / 2) {
+          (uint64_t)block_size) {
     update_reservation(NOWAIT);
   }
 }
 
 void CompressedWriter::update_reservation(WaitFlag wait_flag) {
-  pthread_mutex_lock(&mutex);
-
-  next_thread_end_pos = producer_reserved_write_pos;
   producer_reserved_pos = producer_reserved_write_pos;
+  // Publishing the data and then checking idle_threads pairs with
+  // compression_thread() counting itself idle and then checking for data
+  // (both sequentially consistent): either it sees the data or we see that
+  // it needs waking.
+  next_thread_end_pos = producer_reserved_pos;
+  uint64_t completed = completed_pos;
+  stats_.max_queued_bytes =
+      max(stats_.max_queued_bytes, producer_reserved_pos - completed);
+  producer_reserved_upto_pos = completed + buffer.size();
+  bool have_space = producer_reserved_pos < producer_reserved_upto_pos;
+  if (idle_threads == 0 && (have_space || wait_flag == NOWAIT)) {
+    return;
+  }
+
+  pthread_mutex_lock(&mutex);
 
   // Wake up threads that might be waiting to consume data.
   pthread_cond_broadcast(&cond);
 
+  double wait_start = 0;
   while (!error) {
     if (write_error) {
       error = true;
       break;
     }
 
-    uint64_t completed_pos = next_thread_pos;
-    for (uint32_t i = 0; i < thread_pos.size(); ++i) {
-      completed_pos = min(completed_pos, thread_pos[i]);
-    }
-    producer_reserved_upto_pos = completed_pos + buffer.size();
+    completed = completed_pos;
+    stats_.max_queued_bytes =
+        max(stats_.max_queued_bytes, producer_reserved_pos - completed);
+    producer_reserved_upto_pos = completed + buffer.size();
     if (producer_reserved_pos < producer_reserved_upto_pos ||
         wait_flag == NOWAIT) {
       break;
     }
 
+    if (!producer_waiting) {
+      producer_waiting = true;
+      wait_start = monotonic_now_sec();
+      ++stats_.blocked_count;
+    }
     pthread_cond_wait(&cond, &mutex);
   }
+  if (producer_waiting) {
+    producer_waiting = false;
+    stats_.blocked_seconds += monotonic_now_sec() - wait_start;
+  }
+
+  pthread_mutex_unlock(&mutex);
+}
+
+void CompressedWriter::update_completed_pos() {
+  uint64_t pos = next_thread_pos;
+  for (uint32_t i = 0; i < thread_pos.size(); ++i) {
+    pos = min(pos, thread_pos[i]);
+  }
+  completed_pos = pos;
+}
 
+CompressedWriter::Progress CompressedWriter::progress() {
+  pthread_mutex_lock(&mutex);
+  Progress result;
+  result.bytes = producer_reserved_write_pos;
+  result.compressed_bytes = next_file_offset;
+  result.queued_bytes = producer_reserved_write_pos - completed_pos;
+  result.blocked_seconds = stats_.blocked_seconds;
   pthread_mutex_unlock(&mutex);
+  return result;
 }
 
 void CompressedWriter::compression_thread() {
@@ -134,31 +245,54 @@ void CompressedWriter::compression_thread() {
   for (thread_index = 0; threads[thread_index] != self; ++thread_index) {
   }
 
-  // Add slop for incompressible data
-  vector<uint8_t> outputbuf;
-  outputbuf.resize((size_t)(block_size * 1.1) + sizeof(BlockHeader));
-  BlockHeader* header = reinterpret_cast<BlockHeader*>(&outputbuf[0]);
+  // Leave room for incompressible data
+  size_t outputbuf_size =
+      codec->max_compressed_size(block_size) + sizeof(BlockHeader);
+  vector<uint8_t> outputbuf(outputbuf_size);
+  const BlockCodec* none_codec = BlockCodec::get(BlockCodec::NONE);
 
   while (true) {
-    if (!write_error && next_thread_pos < next_thread_end_pos &&
-        (closing || next_thread_pos + block_size <= next_thread_end_pos)) {
+    uint64_t end_pos = next_thread_end_pos;
+    if (!write_error && can_dispatch_block(end_pos)) {
+      BlockHeader* header = reinterpret_cast<BlockHeader*>(&outputbuf[0]);
       thread_pos[thread_index] = next_thread_pos;
-      next_thread_pos = min(next_thread_end_pos, next_thread_pos + block_size);
+      next_thread_pos = min(end_pos, block_end(next_thread_pos));
       // header->uncompressed_length must be <= block_size,
       // therefore fits in a size_t.
       header->uncompressed_length =
           (size_t)(next_thread_pos - thread_pos[thread_index]);
+      // Storing a block is much faster than compressing it, so this frees
+      // buffer space for the waiting producer sooner.
+      const BlockCodec* block_codec =
+          spill_uncompressed && producer_waiting ? none_codec : codec;
+      const BlockDictionary* block_dictionary =
+          block_codec == codec ? dictionary.get() : nullptr;
+      header->codec = block_dictionary ? BlockDictionary::CODEC_ID
+                                       : (uint32_t)block_codec->type();
+      bool sample = collecting_dictionary_samples;
+      ++stats_.blocks;
+      if (block_codec != codec) {
+        ++stats_.spilled_blocks;
+      }
 
       pthread_mutex_unlock(&mutex);
-      header->compressed_length =
-          do_compress(thread_pos[thread_index], header->uncompressed_length,
-                      &outputbuf[sizeof(BlockHeader)],
-                      outputbuf.size() - sizeof(BlockHeader));
+      double compress_start = monotonic_now_sec();
+      header->compressed_length = do_compress(
+          block_codec, block_dictionary, thread_pos[thread_index],
+          header->uncompressed_length, &outputbuf[sizeof(BlockHeader)],
+          outputbuf.size() - sizeof(BlockHeader));
+      header->checksum =
+          header->compute_checksum(&outputbuf[sizeof(BlockHeader)]);
+      double compress_end = monotonic_now_sec();
       pthread_mutex_lock(&mutex);
+      stats_.compress_seconds += compress_end - compress_start;
 
       if (header->compressed_length == 0) {
         write_error = true;
       }
+      bool train = sample && !write_error &&
+                   add_dictionary_samples(thread_pos[thread_index],
+                                          header->uncompressed_length);
 
       // wait until we're the next thread that needs to write
       while (!write_error) {
@@ -168,96 +302,244 @@ void CompressedWriter::compression_thread() {
             other_thread_write_first = true;
           }
         }
-        if (!other_thread_write_first) {
+        if (!other_thread_write_first &&
+            queued_blocks.size() < MAX_QUEUED_BLOCKS) {
           break;
         }
         pthread_cond_wait(&cond, &mutex);
       }
 
       if (!write_error) {
-        pthread_mutex_unlock(&mutex);
-        ::write(fd, &outputbuf[0],
-                sizeof(BlockHeader) + header->compressed_length);
-        pthread_mutex_lock(&mutex);
+        // Other threads can't write until we reset our thread_pos, so the
+        // index stays in stream order.
+        BlockIndexEntry entry = { thread_pos[thread_index], next_file_offset };
+        block_index_.push_back(entry);
+        QueuedBlock block = { next_file_offset,
+                              sizeof(BlockHeader) + header->compressed_length,
+                              vector<uint8_t>(),
+                              thread_pos[thread_index] +
+                                  header->uncompressed_length };
+        next_file_offset += block.length;
+        block.data.swap(outputbuf);
+        queued_blocks.push_back(move(block));
+        if (!spare_outputbufs.empty()) {
+          outputbuf.swap(spare_outputbufs.back());
+          spare_outputbufs.pop_back();
+        } else {
+          outputbuf.resize(outputbuf_size);
+        }
       }
 
       thread_pos[thread_index] = UINT64_MAX;
+      update_completed_pos();
       // do a broadcast because we might need to unblock
       // the producer thread or a compressor thread waiting
       // for us to write.
       pthread_cond_broadcast(&cond);
+      if (train) {
+        train_dictionary();
+      }
       continue;
     }
 
-    if (closing && (write_error || next_thread_pos == next_thread_end_pos)) {
+    if (closing && (write_error || next_thread_pos == end_pos)) {
       break;
     }
 
-    pthread_cond_wait(&cond, &mutex);
+    // The producer only wakes us if it sees we're idle, so check again for
+    // data it published before it could see that.
+    ++idle_threads;
+    if (write_error || !can_dispatch_block(next_thread_end_pos)) {
+      pthread_cond_wait(&cond, &mutex);
+    }
+    --idle_threads;
   }
 
+  int64_t migrations = read_own_cpu_migrations();
+  if (migrations < 0 || stats_.cpu_migrations < 0) {
+    stats_.cpu_migrations = -1;
+  } else {
+    stats_.cpu_migrations += migrations;
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+void CompressedWriter::output_thread() {
+  pthread_mutex_lock(&mutex);
+  while (true) {
+    if (!queued_blocks.empty()) {
+      QueuedBlock block = move(queued_blocks.front());
+      queued_blocks.pop_front();
+      pthread_mutex_unlock(&mutex);
+      if (fd.is_open()) {
+        ::write(fd, block.data.data(), block.length);
+      }
+      bool streamed =
+          !sink || sink->write_data(sink_name, block.file_offset,
+                                    block.data.data(), block.length);
+      pthread_mutex_lock(&mutex);
+      if (!streamed && !fd.is_open()) {
+        // The stream was the only copy of this data.
+        write_error = true;
+      }
+      written_pos = block.end_pos;
+      spare_outputbufs.push_back(move(block.data));
+      // Compression threads may be waiting for queue space.
+      pthread_cond_broadcast(&cond);
+      continue;
+    }
+
+    if (compression_done) {
+      break;
+    }
+
+    pthread_cond_wait(&cond, &mutex);
+  }
   pthread_mutex_unlock(&mutex);
 }
 
 void CompressedWriter::close() {
-  if (!fd.is_open()) {
+  if (closed) {
     return;
   }
+  closed = true;
 
   update_reservation(NOWAIT);
 
   pthread_mutex_lock(&mutex);
   closing = true;
+  stats_.bytes = producer_reserved_write_pos;
   pthread_cond_broadcast(&cond);
   pthread_mutex_unlock(&mutex);
 
   for (auto i = threads.begin(); i != threads.end(); ++i) {
     pthread_join(*i, nullptr);
   }
+  stats_.compressed_bytes = next_file_offset;
+
+  pthread_mutex_lock(&mutex);
+  compression_done = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(output_thread_id, nullptr);
 
   fd.close();
 }
 
-size_t CompressedWriter::do_compress(uint64_t offset, size_t length,
-                                     uint8_t* outputbuf, size_t outputbuf_len) {
-  z_stream stream;
-  memset(&stream, 0, sizeof(stream));
-  int result = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
-  if (result != Z_OK) {
-    assert(0 && "deflateInit failed!");
-    return 0;
+void CompressedWriter::flush() {
+  if (closed || error) {
+    return;
   }
+  update_reservation(NOWAIT);
 
-  stream.next_out = outputbuf;
-  stream.avail_out = outputbuf_len;
-
-  while (length > 0 || stream.avail_in > 0) {
-    if (stream.avail_in == 0) {
-      size_t buf_offset = (size_t)(offset % buffer.size());
-      size_t amount = min(length, buffer.size() - buf_offset);
-      stream.next_in = &buffer[buf_offset];
-      stream.avail_in = amount;
-      length -= amount;
-      offset += amount;
-    }
-    if (stream.avail_out == 0) {
-      assert(0 && "outputbuf exhausted!");
-      return 0;
-    }
-    result = deflate(&stream, length == 0 ? Z_FINISH : Z_NO_FLUSH);
-    if (result != (length == 0 ? Z_STREAM_END : Z_OK)) {
-      assert(0 && "deflate failed!");
-      return 0;
+  pthread_mutex_lock(&mutex);
+  flush_pos = producer_reserved_pos;
+  pthread_cond_broadcast(&cond);
+  while (!write_error && written_pos < flush_pos) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Add the block at 'offset' to the dictionary samples. Returns true if that
+ * completed them, in which case the caller should train_dictionary().
+ * Call with 'mutex' held.
+ */
+bool CompressedWriter::add_dictionary_samples(uint64_t offset,
+                                              size_t length) {
+  if (!collecting_dictionary_samples) {
+    return false;
+  }
+  size_t buf_offset = (size_t)(offset % buffer.size());
+  size_t amount =
+      min(length, DICTIONARY_TRAINING_BYTES - dictionary_samples.size());
+  dictionary_samples.insert(dictionary_samples.end(), &buffer[buf_offset],
+                            &buffer[buf_offset] + amount);
+  if (dictionary_samples.size() < DICTIONARY_TRAINING_BYTES) {
+    return false;
+  }
+  collecting_dictionary_samples = false;
+  return true;
+}
+
+static bool dictionary_helps(const BlockCodec* codec, int level,
+                             const BlockDictionary& dictionary,
+                             const vector<uint8_t>& data) {
+  vector<uint8_t> out(codec->max_compressed_size(data.size()));
+  size_t plain = codec->compress(data.data(), data.size(), out.data(),
+                                 out.size(), level);
+  size_t with_dictionary =
+      dictionary.compress(data.data(), data.size(), out.data(), out.size());
+  return with_dictionary > 0 && with_dictionary < plain;
+}
+
+/**
+ * Train the dictionary and save it, then start using it for new blocks.
+ * Call with 'mutex' held; it's released while training.
+ */
+void CompressedWriter::train_dictionary() {
+  vector<uint8_t> samples;
+  samples.swap(dictionary_samples);
+  pthread_mutex_unlock(&mutex);
+
+  // Hold back the last samples to check that the dictionary actually
+  // helps. Data whose blocks are already big enough to provide their own
+  // context can come out worse.
+  size_t check_size = DICTIONARY_TRAINING_BYTES / 4;
+  vector<uint8_t> check(samples.end() - check_size, samples.end());
+  samples.resize(samples.size() - check_size);
+  unique_ptr<BlockDictionary> trained = BlockDictionary::train(
+      samples, DICTIONARY_SAMPLE_SIZE, MAX_DICTIONARY_SIZE, codec_level);
+  if (trained && !dictionary_helps(codec, codec_level, *trained, check)) {
+    trained = nullptr;
+  }
+  bool saved = trained != nullptr;
+  if (saved && fd.is_open()) {
+    const vector<uint8_t>& data = trained->data();
+    ScopedFd dictionary_fd(dictionary_path.c_str(),
+                           O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL, 0400);
+    saved = dictionary_fd.is_open() &&
+            ::write(dictionary_fd, data.data(), data.size()) ==
+                (ssize_t)data.size();
+    if (!saved) {
+      unlink(dictionary_path.c_str());
     }
   }
+  if (saved && sink) {
+    const vector<uint8_t>& data = trained->data();
+    saved = sink->write_data(BlockDictionary::path_for(sink_name), 0,
+                             data.data(), data.size()) ||
+            fd.is_open();
+  }
 
-  result = deflateEnd(&stream);
-  if (result != Z_OK) {
-    assert(0 && "deflateEnd failed!");
-    return 0;
+  pthread_mutex_lock(&mutex);
+  if (saved) {
+    dictionary = move(trained);
   }
+}
+
+uint32_t CompressedWriter::BlockHeader::compute_checksum(
+    const uint8_t* compressed_data) const {
+  return crc32c(crc32c(0, this, offsetof(BlockHeader, checksum)),
+                compressed_data, compressed_length);
+}
 
-  return stream.total_out;
+size_t CompressedWriter::do_compress(const BlockCodec* block_codec,
+                                     const BlockDictionary* dictionary,
+                                     uint64_t offset, size_t length,
+                                     uint8_t* outputbuf, size_t outputbuf_len) {
+  // See block_end(): a block never wraps around the end of the buffer.
+  size_t buf_offset = (size_t)(offset % buffer.size());
+  assert(buf_offset + length <= buffer.size());
+  TimelineScope timeline(Timeline::RR_THREAD, Timeline::current_thread(),
+                         "compression", "compress block");
+  if (dictionary) {
+    return dictionary->compress(&buffer[buf_offset], length, outputbuf,
+                                outputbuf_len);
+  }
+  return block_codec->compress(&buffer[buf_offset], length, outputbuf,
+                               outputbuf_len, codec_level);
 }
 
 } // namespace rr
@@ -6,47 +6,171 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#include <array>
+#include <atomic>
+#include <deque>
 #include <memory>
+#include <type_traits>
 #include <vector>
 #include <string>
 
+#include "BlockCodec.h"
 #include "ScopedFd.h"
 
 namespace rr {
 
+class TraceSink;
+
+/**
+ * True if a T is serialized as its bytes, so an array of them can be
+ * written or read with one call. (std::vector<bool> doesn't store bools.)
+ */
+template <typename T>
+struct IsBulkSerializable
+    : std::integral_constant<bool, std::is_trivially_copyable<T>::value &&
+                                       !std::is_same<T, bool>::value> {};
+
 /**
  * CompressedWriter opens an output file and writes compressed blocks to it.
  * Blocks of a fixed but unspecified size (currently 1MB) are compressed.
- * Each block of compressed data is written to the file preceded by two
- * 32-bit words: the size of the compressed data (excluding block header)
- * and the size of the uncompressed data, in that order. See BlockHeader below.
+ * Each block of compressed data is written to the file preceded by three
+ * 32-bit words: the size of the compressed data (excluding block header),
+ * the size of the uncompressed data and the BlockCodec::Type used to
+ * compress the block, in that order. See BlockHeader below.
  *
- * We use multiple threads to perform compression. The threads are
- * responsible for the actual data writes. The thread that creates the
- * CompressedWriter is the "producer" thread and must also be the caller of
- * 'write'. The producer thread may block in 'write' if 'buffer_size' bytes are
- * being compressed.
+ * We use multiple threads to perform compression. They hand compressed
+ * blocks, in stream order, to an output thread that does the actual data
+ * writes, so slow storage or a slow sink only holds up compression once a
+ * bounded number of blocks are queued for writing. The thread that creates
+ * the CompressedWriter is the "producer" thread and must also be the caller of
+ * 'write'. The producer thread may block in 'write' if the buffer is full
+ * of data being compressed. The buffer holds 'num_threads' + 2 blocks, or as
+ * many as fit in 'options.memory_budget'.
  *
- * Each data block is compressed independently using zlib.
+ * The producer hands each block to the compression threads as soon as it's
+ * full, without taking 'mutex' unless a compression thread is idle and
+ * needs waking, or the buffer is full and the producer has to wait. The
+ * compression threads publish how far they've got through the buffer in
+ * 'completed_pos' for the producer to read.
+ *
+ * Each data block is compressed independently using the BlockCodec selected
+ * by 'options' (zlib by default). With 'options.spill_uncompressed', blocks
+ * picked up while the producer is waiting are stored uncompressed, so a
+ * codec that can't keep up slows the producer down to disk speed rather
+ * than compression speed.
+ *
+ * With 'options.train_dictionary', the first data written is used to train
+ * a BlockDictionary, which is saved next to the file and used to compress
+ * the blocks that follow.
+ *
+ * With a TraceSink, each block is also streamed to the sink as soon as it
+ * is written. If the sink doesn't keep local files, blocks are only
+ * streamed and 'filename' is never created.
  */
 class CompressedWriter {
 public:
-  CompressedWriter(const std::string& filename, size_t buffer_size,
-                   uint32_t num_threads);
+  CompressedWriter(const std::string& filename, size_t block_size,
+                   uint32_t num_threads,
+                   const CompressionOptions& options = CompressionOptions(),
+                   TraceSink* sink = nullptr);
   ~CompressedWriter();
   // Call only on producer thread
   bool good() const { return !error; }
   // Call only on producer thread.
   void write(const void* data, size_t size);
+  /**
+   * Reserve buffer space for the caller to fill in place, saving the copy
+   * write() makes. Returns space for up to 'max_size' bytes and sets
+   * '*size' to how much it is; that's less than 'max_size' when the space
+   * would wrap around the end of the buffer. Follow with commit() before
+   * any other write. Returns null on error. Call only on producer thread.
+   */
+  uint8_t* reserve(size_t max_size, size_t* size);
+  /**
+   * Add the first 'size' bytes of the last reservation to the stream.
+   * Call only on producer thread.
+   */
+  void commit(size_t size);
   // Call only on producer thread
   void close();
+  /**
+   * Compress everything written so far, even if it doesn't fill a block,
+   * and wait until it's in the file (and handed to the sink), so readers
+   * of the file as it's being written see it. Call only on producer
+   * thread.
+   */
+  void flush();
+  /**
+   * Number of uncompressed bytes written so far. Call only on producer
+   * thread.
+   */
+  uint64_t bytes_written() const { return producer_reserved_write_pos; }
 
   struct BlockHeader {
     uint32_t compressed_length;
     uint32_t uncompressed_length;
+    uint32_t codec;
+    // CRC32C of the fields above and the compressed data, so readers can
+    // tell a corrupt trace from a replay bug.
+    uint32_t checksum;
+
+    uint32_t compute_checksum(const uint8_t* compressed_data) const;
+  };
+
+  /**
+   * Where a block starts, both in the uncompressed stream and in the file.
+   */
+  struct BlockIndexEntry {
+    uint64_t uncompressed_offset;
+    uint64_t file_offset;
+  };
+  /**
+   * One entry per block written, in stream order. Only valid after close().
+   */
+  const std::vector<BlockIndexEntry>& block_index() const {
+    return block_index_;
+  }
+
+  /**
+   * How much the producer had to wait for compression threads. Only valid
+   * after close().
+   */
+  struct Stats {
+    uint64_t bytes;
+    uint64_t compressed_bytes;
+    uint64_t blocks;
+    // Blocks stored uncompressed because the producer was waiting
+    uint64_t spilled_blocks;
+    // High-water mark of data written but not yet compressed
+    uint64_t max_queued_bytes;
+    uint64_t blocked_count;
+    double blocked_seconds;
+    // Time compression threads spent compressing (or storing) blocks,
+    // summed over the threads
+    double compress_seconds;
+    // Times the compression threads moved between CPUs, or -1 if unknown
+    int64_t cpu_migrations;
+  };
+  const Stats& stats() const { return stats_; }
+
+  /**
+   * How far the stream has got, for monitoring while it's being written.
+   * Call from the producer thread.
+   */
+  struct Progress {
+    // Uncompressed bytes written so far
+    uint64_t bytes;
+    // Compressed bytes produced so far
+    uint64_t compressed_bytes;
+    // Bytes written but not yet compressed
+    uint64_t queued_bytes;
+    double blocked_seconds;
   };
+  Progress progress();
 
   template <typename T> CompressedWriter& operator<<(const T& value) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Only plain data can be written as bytes");
     write(&value, sizeof(value));
     return *this;
   }
@@ -59,27 +183,77 @@ public:
   template <typename T>
   CompressedWriter& operator<<(const std::vector<T>& value) {
     *this << value.size();
-    for (auto& i : value) {
-      *this << i;
-    }
+    write_elements(value, IsBulkSerializable<T>());
+    return *this;
+  }
+
+  template <typename T, size_t N>
+  CompressedWriter& operator<<(const std::array<T, N>& value) {
+    write_elements(value, IsBulkSerializable<T>());
     return *this;
   }
 
 protected:
+  // Arrays of plain data are written in one go; the bytes are the same as
+  // writing the elements one at a time.
+  template <typename C>
+  void write_elements(const C& value, std::true_type) {
+    write(value.data(), value.size() * sizeof(value[0]));
+  }
+  template <typename C>
+  void write_elements(const C& value, std::false_type) {
+    for (const auto& i : value) {
+      *this << i;
+    }
+  }
+
   enum WaitFlag { WAIT, NOWAIT };
   void update_reservation(WaitFlag wait_flag);
+  /**
+   * Compute 'completed_pos' from the threads' positions. Call with 'mutex'
+   * held.
+   */
+  void update_completed_pos();
+  /**
+   * The end of the block starting at 'pos': the next multiple of
+   * block_size. Blocks start at multiples of block_size until flush() ends
+   * one early; the block after that is short so that blocks are aligned
+   * again. The buffer size is a multiple of block_size, so no block wraps
+   * around the end of the buffer.
+   */
+  uint64_t block_end(uint64_t pos) const {
+    return (pos / block_size + 1) * block_size;
+  }
+  bool can_dispatch_block(uint64_t end_pos) const {
+    return next_thread_pos < end_pos &&
+           (closing || next_thread_pos < flush_pos ||
+            block_end(next_thread_pos) <= end_pos);
+  }
 
   static void* compression_thread_callback(void* p);
   void compression_thread();
-  size_t do_compress(uint64_t offset, size_t length, uint8_t* outputbuf,
-                     size_t outputbuf_len);
+  static void* output_thread_callback(void* p);
+  void output_thread();
+  size_t do_compress(const BlockCodec* block_codec,
+                     const BlockDictionary* dictionary, uint64_t offset,
+                     size_t length, uint8_t* outputbuf, size_t outputbuf_len);
+  bool add_dictionary_samples(uint64_t offset, size_t length);
+  void train_dictionary();
 
   // Immutable while threads are running
   ScopedFd fd;
+  TraceSink* sink;
+  // Name of the file within the trace directory, for 'sink'
+  std::string sink_name;
+  std::string dictionary_path;
   int block_size;
+  const BlockCodec* codec;
+  int codec_level;
+  bool spill_uncompressed;
   pthread_mutex_t mutex;
   pthread_cond_t cond;
   std::vector<pthread_t> threads;
+  pthread_t output_thread_id;
 
   // Carefully shared...
   std::vector<uint8_t> buffer;
@@ -90,18 +264,54 @@ protected:
   std::vector<uint64_t> thread_pos;
   /* position in output stream of data to dispatch to next thread */
   uint64_t next_thread_pos;
-  /* position in output stream of end of data ready to dispatch */
-  uint64_t next_thread_end_pos;
   bool closing;
+  /* data before this position goes into blocks even if they aren't full */
+  uint64_t flush_pos;
+  /* end of the data the output thread has written out */
+  uint64_t written_pos;
   bool write_error;
+  /* file offset at which the next compressed block will be written */
+  uint64_t next_file_offset;
+  std::vector<BlockIndexEntry> block_index_;
+  /* true while the producer waits for buffer space */
+  bool producer_waiting;
+  /* compressed blocks (header included) waiting for the output thread */
+  struct QueuedBlock {
+    uint64_t file_offset;
+    size_t length;
+    std::vector<uint8_t> data;
+    /* stream position of the end of the block's data */
+    uint64_t end_pos;
+  };
+  std::deque<QueuedBlock> queued_blocks;
+  /* written-out block buffers, for compression threads to reuse */
+  std::vector<std::vector<uint8_t>> spare_outputbufs;
+  /* set once the compression threads have exited */
+  bool compression_done;
+  /* data to train a dictionary on; cleared once training starts */
+  std::vector<uint8_t> dictionary_samples;
+  bool collecting_dictionary_samples;
+  std::unique_ptr<BlockDictionary> dictionary;
+  Stats stats_;
   // END protected by 'mutex'
 
+  /* Written by the producer, read by compression threads: position in
+   * output stream of end of data ready to dispatch */
+  std::atomic<uint64_t> next_thread_end_pos;
+  /* Written with 'mutex' held, read by the producer: position in output
+   * stream before which all data has been compressed */
+  std::atomic<uint64_t> completed_pos;
+  /* Compression threads waiting for data. The producer only takes 'mutex'
+   * to wake them when this is nonzero. */
+  std::atomic<uint32_t> idle_threads;
+
   /* producer thread only */
   /* Areas in the buffer that have been reserved for write() */
   uint64_t producer_reserved_pos;
   uint64_t producer_reserved_write_pos;
   uint64_t producer_reserved_upto_pos;
   bool error;
+  bool closed;
 };
 
 } // namespace rr
@@ -41,6 +41,13 @@ static void execute_syscall(Task* t) {
   t->finish_emulated_syscall();
 
   AutoRemoteSyscalls remote(t);
+  // The replay seccomp filter lets syscalls from the privileged callsite
+  // through without a PTRACE_EVENT_SECCOMP stop, so gdb calls that make
+  // many syscalls (e.g. allocating memory) run faster.
+  remote_code_ptr privileged_ip = t->vm()->privileged_traced_syscall_ip();
+  if (privileged_ip != remote_code_ptr()) {
+    remote.regs().set_ip(privileged_ip);
+  }
   remote.syscall(remote.regs().original_syscallno(), remote.regs().arg1(),
                  remote.regs().arg2(), remote.regs().arg3(),
                  remote.regs().arg4(), remote.regs().arg5(),
@@ -62,6 +69,15 @@ static void process_syscall_arch(Task* t, int syscallno) {
   }
 
   switch (syscallno) {
+    // These just report ids we already know, so don't make the tracee run
+    // them. That also gives the recorded ids instead of the replay's.
+    case Arch::getpid:
+      finish_emulated_syscall_with_ret(t, t->tgid());
+      return;
+    case Arch::gettid:
+      finish_emulated_syscall_with_ret(t, t->rec_tid);
+      return;
+
     // We blacklist these syscalls because the params include
     // namespaced identifiers that are different in replay than
     // recording, and during replay they may refer to different,
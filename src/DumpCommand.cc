@@ -2,8 +2,14 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
 
+#include <algorithm>
 #include <limits>
+#include <map>
+#include <memory>
 
 #include "preload/preload_interface.h"
 
@@ -33,27 +39,43 @@ DumpCommand DumpCommand::singleton(
     " rr dump [OPTIONS] [<trace_dir>] [<event-spec>...]\n"
     "  Event specs can be either an event number like `127', or a range\n"
     "  like `1000-5000'.  By default, all events are dumped.\n"
+    "  -a, --aggregate            instead of dumping events, print event\n"
+    "                             counts per syscall and per task, recorded\n"
+    "                             data sizes and per-substream compression\n"
+    "                             ratios. Only reads trace metadata, so it's\n"
+    "                             fast.\n"
     "  -b, --syscallbuf           dump syscallbuf contents\n"
+    "  -j, --jobs=<N>             decode ranges spanning several trace blocks\n"
+    "                             with <N> threads. Output is unchanged.\n"
     "  -m, --recorded-metadata    dump recorded data metadata\n"
     "  -p, --mmaps                dump mmap data\n"
     "  -r, --raw                  dump trace frames in a more easily\n"
     "                             machine-parseable format instead of the\n"
     "                             default human-readable format\n"
-    "  -s, --statistics           dump statistics about the trace\n");
+    "  -s, --statistics           dump statistics about the trace\n"
+    "  -t, --tid=<TID>            only dump events of task <TID>\n"
+    "  -y, --syscall=<NAME>       only dump events of syscall <NAME>\n");
 
 struct DumpFlags {
+  bool dump_aggregate;
   bool dump_syscallbuf;
   bool dump_recorded_data_metadata;
   bool dump_mmaps;
   bool raw_dump;
   bool dump_statistics;
+  pid_t only_tid;
+  string only_syscall;
+  int jobs;
 
   DumpFlags()
-      : dump_syscallbuf(false),
+      : dump_aggregate(false),
+        dump_syscallbuf(false),
         dump_recorded_data_metadata(false),
         dump_mmaps(false),
         raw_dump(false),
-        dump_statistics(false) {}
+        dump_statistics(false),
+        only_tid(0),
+        jobs(1) {}
 };
 
 static bool parse_dump_arg(std::vector<std::string>& args, DumpFlags& flags) {
@@ -61,21 +83,34 @@ static bool parse_dump_arg(std::vector<std::string>& args, DumpFlags& flags) {
     return true;
   }
 
-  static const OptionSpec options[] = { { 'b', "syscallbuf", NO_PARAMETER },
+  static const OptionSpec options[] = { { 'a', "aggregate", NO_PARAMETER },
+                                        { 'b', "syscallbuf", NO_PARAMETER },
+                                        { 'j', "jobs", HAS_PARAMETER },
                                         { 'm', "recorded-metadata",
                                           NO_PARAMETER },
                                         { 'p', "mmaps", NO_PARAMETER },
                                         { 'r', "raw", NO_PARAMETER },
-                                        { 's', "statistics", NO_PARAMETER } };
+                                        { 's', "statistics", NO_PARAMETER },
+                                        { 't', "tid", HAS_PARAMETER },
+                                        { 'y', "syscall", HAS_PARAMETER } };
   ParsedOption opt;
   if (!Command::parse_option(args, options, &opt)) {
     return false;
   }
 
   switch (opt.short_name) {
+    case 'a':
+      flags.dump_aggregate = true;
+      break;
     case 'b':
       flags.dump_syscallbuf = true;
       break;
+    case 'j':
+      if (!opt.verify_valid_int(1, 256)) {
+        return false;
+      }
+      flags.jobs = opt.int_value;
+      break;
     case 'm':
       flags.dump_recorded_data_metadata = true;
       break;
@@ -88,6 +123,15 @@ static bool parse_dump_arg(std::vector<std::string>& args, DumpFlags& flags) {
     case 's':
       flags.dump_statistics = true;
       break;
+    case 't':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.only_tid = opt.int_value;
+      break;
+    case 'y':
+      flags.only_syscall = opt.value;
+      break;
     default:
       assert(0 && "Unknown option");
   }
@@ -123,6 +167,186 @@ static void dump_syscallbuf_data(TraceReader& trace, FILE* out,
   }
 }
 
+static void parse_event_spec(const string* spec, uint32_t* start,
+                             uint32_t* end) {
+  *start = 0;
+  *end = numeric_limits<uint32_t>::max();
+
+  // Try to parse the "range" syntax '[start]-[end]'.
+  if (spec && 2 > sscanf(spec->c_str(), "%u-%u", start, end)) {
+    // Fall back on assuming the spec is a single event
+    // number, however it parses out with atoi().
+    *start = *end = atoi(spec->c_str());
+  }
+}
+
+static bool frame_selected(const DumpFlags& flags, const TraceFrame& frame) {
+  if (flags.only_tid && frame.tid() != flags.only_tid) {
+    return false;
+  }
+  if (!flags.only_syscall.empty()) {
+    const Event& ev = frame.event();
+    if (!ev.is_syscall_event() ||
+        syscall_name(ev.Syscall().number, ev.arch()) != flags.only_syscall) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Dump |frame|, which has just been read from |trace|, and the data
+ * recorded with it. The data is consumed even if the frame is filtered
+ * out, so the trace stays in step.
+ */
+static void dump_frame(TraceReader& trace, const DumpFlags& flags, FILE* out,
+                       const TraceFrame& frame) {
+  bool selected = frame_selected(flags, frame);
+  if (selected) {
+    if (flags.raw_dump) {
+      frame.dump_raw(out);
+    } else {
+      frame.dump(out);
+    }
+    if (flags.dump_syscallbuf) {
+      dump_syscallbuf_data(trace, out, frame);
+    }
+  }
+
+  while (true) {
+    TraceReader::MappedData data;
+    bool found;
+    KernelMapping km = trace.read_mapped_region(&data, &found);
+    if (!found) {
+      break;
+    }
+    if (selected && flags.dump_mmaps) {
+      char prot_flags[] = "rwxp";
+      if (!(km.prot() & PROT_READ)) {
+        prot_flags[0] = '-';
+      }
+      if (!(km.prot() & PROT_WRITE)) {
+        prot_flags[1] = '-';
+      }
+      if (!(km.prot() & PROT_EXEC)) {
+        prot_flags[2] = '-';
+      }
+      if (km.flags() & MAP_SHARED) {
+        prot_flags[3] = 's';
+      }
+      fprintf(out, "  { map_file:\"%s\", addr:%p, length:%p, "
+                   "prot_flags:\"%s\", file_offset:0x%llx }\n",
+              km.fsname().c_str(), (void*)km.start().as_int(),
+              (void*)km.size(), prot_flags,
+              (long long)km.file_offset_bytes());
+    }
+  }
+
+  bool process_raw_data =
+      flags.dump_syscallbuf || flags.dump_recorded_data_metadata;
+  TraceReader::RawData data;
+  while (process_raw_data && trace.read_raw_data_for_frame(frame, data)) {
+    if (selected && flags.dump_recorded_data_metadata) {
+      fprintf(out, "  { addr:%p, length:%p }\n", (void*)data.addr.as_int(),
+              (void*)data.data.size());
+    }
+  }
+  if (selected && !flags.raw_dump) {
+    fprintf(out, "}\n");
+  }
+}
+
+/**
+ * Dump the frames of |trace| with times in [start, end].
+ */
+static void dump_events_in_range(TraceReader& trace, const DumpFlags& flags,
+                                 FILE* out, TraceFrame::Time start,
+                                 TraceFrame::Time end) {
+  trace.seek_to_time(start);
+  while (!trace.at_end()) {
+    auto frame = trace.read_frame();
+    if (end < frame.time()) {
+      return;
+    }
+    dump_frame(trace, flags, out, frame);
+  }
+}
+
+/**
+ * A piece of a parallel dump: a worker dumps the frames in [start, end]
+ * with its own copy of the trace reader into |output|.
+ */
+struct DumpChunk {
+  TraceReader trace;
+  const DumpFlags* flags;
+  TraceFrame::Time start;
+  TraceFrame::Time end;
+  char* output;
+  size_t output_size;
+  pthread_t thread;
+
+  DumpChunk(const TraceReader& trace, const DumpFlags& flags,
+            TraceFrame::Time start, TraceFrame::Time end)
+      : trace(trace),
+        flags(&flags),
+        start(start),
+        end(end),
+        output(nullptr),
+        output_size(0) {}
+};
+
+static void* dump_chunk_thread(void* p) {
+  auto chunk = static_cast<DumpChunk*>(p);
+  FILE* out = open_memstream(&chunk->output, &chunk->output_size);
+  dump_events_in_range(chunk->trace, *chunk->flags, out, chunk->start,
+                       chunk->end);
+  fclose(out);
+  return nullptr;
+}
+
+/**
+ * Dump the frames in [start, end] using up to |flags.jobs| threads. The
+ * range is split at frames the trace index can seek to directly, since
+ * decoding can only start there. Output is printed in order, one batch
+ * of chunks at a time to bound memory use. Returns false if the range
+ * can't be split, in which case nothing was dumped.
+ */
+static bool dump_events_in_parallel(TraceReader& trace, const DumpFlags& flags,
+                                    FILE* out, TraceFrame::Time start,
+                                    TraceFrame::Time end) {
+  vector<TraceFrame::Time> chunk_starts = { start };
+  for (auto t : trace.indexed_frame_times()) {
+    if (start < t && t <= end) {
+      chunk_starts.push_back(t);
+    }
+  }
+  if (chunk_starts.size() < 2) {
+    return false;
+  }
+
+  for (size_t i = 0; i < chunk_starts.size(); i += flags.jobs) {
+    vector<unique_ptr<DumpChunk> > chunks;
+    for (size_t j = i; j < chunk_starts.size() && j < i + flags.jobs; ++j) {
+      TraceFrame::Time chunk_end =
+          j + 1 < chunk_starts.size() ? chunk_starts[j + 1] - 1 : end;
+      chunks.push_back(unique_ptr<DumpChunk>(
+          new DumpChunk(trace, flags, chunk_starts[j], chunk_end)));
+    }
+    for (auto& c : chunks) {
+      pthread_create(&c->thread, nullptr, dump_chunk_thread, c.get());
+    }
+    for (auto& c : chunks) {
+      pthread_join(c->thread, nullptr);
+      fwrite(c->output, 1, c->output_size, out);
+      free(c->output);
+    }
+  }
+  // Leave |trace| just past the range, like a serial dump.
+  trace.seek_to_time(end < numeric_limits<TraceFrame::Time>::max() ? end + 1
+                                                                   : end);
+  return true;
+}
+
 /**
  * Dump all events from the current to trace that match |spec| to
  * |out|.  |spec| has the following syntax: /\d+(-\d+)?/, expressing
@@ -137,84 +361,132 @@ static void dump_syscallbuf_data(TraceReader& trace, FILE* out,
  */
 static void dump_events_matching(TraceReader& trace, const DumpFlags& flags,
                                  FILE* out, const string* spec) {
+  uint32_t start, end;
+  parse_event_spec(spec, &start, &end);
 
-  uint32_t start = 0, end = numeric_limits<uint32_t>::max();
+  if (flags.jobs > 1 &&
+      dump_events_in_parallel(trace, flags, out, start, end)) {
+    return;
+  }
+  dump_events_in_range(trace, flags, out, start, end);
+}
 
-  // Try to parse the "range" syntax '[start]-[end]'.
-  if (spec && 2 > sscanf(spec->c_str(), "%u-%u", &start, &end)) {
-    // Fall back on assuming the spec is a single event
-    // number, however it parses out with atoi().
-    start = end = atoi(spec->c_str());
+struct EventTotals {
+  uint64_t count;
+  uint64_t raw_data_records;
+  uint64_t raw_data_bytes;
+  EventTotals() : count(0), raw_data_records(0), raw_data_bytes(0) {}
+};
+
+struct TraceAggregate {
+  // Keyed by syscall name for syscalls, otherwise by event type name
+  map<string, EventTotals> events;
+  map<pid_t, uint64_t> task_events;
+  uint64_t frames;
+  uint64_t flushes;
+  uint64_t flush_bytes;
+  uint64_t max_flush_bytes;
+  TraceAggregate()
+      : frames(0), flushes(0), flush_bytes(0), max_flush_bytes(0) {}
+};
+
+static string aggregate_key(const TraceFrame& frame) {
+  const Event& ev = frame.event();
+  if (ev.is_syscall_event()) {
+    return syscall_name(ev.Syscall().number, ev.arch());
   }
+  return ev.type_name();
+}
 
-  bool process_raw_data =
-      flags.dump_syscallbuf || flags.dump_recorded_data_metadata;
+/**
+ * Read the frames selected by |spec| (see dump_events_matching()) and the
+ * filters in |flags|, and their raw data metadata, into |agg|. Raw data
+ * contents and mapped regions are never read.
+ */
+static void aggregate_events_matching(TraceReader& trace,
+                                      const DumpFlags& flags,
+                                      TraceAggregate& agg, const string* spec) {
+  uint32_t start, end;
+  parse_event_spec(spec, &start, &end);
+
+  TraceReader::RawDataMetadata data;
   while (!trace.at_end()) {
     auto frame = trace.read_frame();
+    bool selected = start <= frame.time() && frame.time() <= end &&
+                    frame_selected(flags, frame);
+    EventTotals* totals = nullptr;
+    if (selected) {
+      ++agg.frames;
+      ++agg.task_events[frame.tid()];
+      totals = &agg.events[aggregate_key(frame)];
+      // Count syscalls once, not once per entry and exit.
+      if (!frame.event().is_syscall_event() ||
+          frame.event().Syscall().state == ENTERING_SYSCALL) {
+        ++totals->count;
+      }
+    }
+    // Consume the metadata even for a frame past |end|, so the next spec
+    // starts in step.
+    uint64_t frame_raw_bytes = 0;
+    while (trace.read_raw_data_metadata_for_frame(frame, data)) {
+      frame_raw_bytes += data.size;
+      if (totals) {
+        ++totals->raw_data_records;
+        totals->raw_data_bytes += data.size;
+      }
+    }
     if (end < frame.time()) {
       return;
     }
-    if (start <= frame.time() && frame.time() <= end) {
-      if (flags.raw_dump) {
-        frame.dump_raw(out);
-      } else {
-        frame.dump(out);
-      }
-      if (flags.dump_syscallbuf) {
-        dump_syscallbuf_data(trace, out, frame);
-      }
+    if (selected && frame.event().type() == EV_SYSCALLBUF_FLUSH) {
+      ++agg.flushes;
+      agg.flush_bytes += frame_raw_bytes;
+      agg.max_flush_bytes = max(agg.max_flush_bytes, frame_raw_bytes);
+    }
+  }
+}
 
-      while (true) {
-        TraceReader::MappedData data;
-        bool found;
-        KernelMapping km = trace.read_mapped_region(&data, &found);
-        if (!found) {
-          break;
-        }
-        if (flags.dump_mmaps) {
-          char prot_flags[] = "rwxp";
-          if (!(km.prot() & PROT_READ)) {
-            prot_flags[0] = '-';
-          }
-          if (!(km.prot() & PROT_WRITE)) {
-            prot_flags[1] = '-';
-          }
-          if (!(km.prot() & PROT_EXEC)) {
-            prot_flags[2] = '-';
-          }
-          if (km.flags() & MAP_SHARED) {
-            prot_flags[3] = 's';
-          }
-          fprintf(out, "  { map_file:\"%s\", addr:%p, length:%p, "
-                       "prot_flags:\"%s\", file_offset:0x%llx }\n",
-                  km.fsname().c_str(), (void*)km.start().as_int(),
-                  (void*)km.size(), prot_flags,
-                  (long long)km.file_offset_bytes());
-        }
-      }
+static void dump_aggregate(const TraceReader& trace, const TraceAggregate& agg,
+                           FILE* out) {
+  fprintf(out, "// %" PRIu64 " events\n", agg.frames);
+
+  vector<pair<string, EventTotals> > events(agg.events.begin(),
+                                            agg.events.end());
+  // Biggest contributors to the trace first.
+  stable_sort(events.begin(), events.end(),
+              [](const pair<string, EventTotals>& a,
+                 const pair<string, EventTotals>& b) {
+    return a.second.raw_data_bytes > b.second.raw_data_bytes;
+  });
+  fprintf(out, "// %-28s %12s %12s %16s\n", "event", "count", "data records",
+          "data bytes");
+  for (auto& e : events) {
+    fprintf(out, "// %-28s %12" PRIu64 " %12" PRIu64 " %16" PRIu64 "\n",
+            e.first.c_str(), e.second.count, e.second.raw_data_records,
+            e.second.raw_data_bytes);
+  }
 
-      TraceReader::RawData data;
-      while (process_raw_data && trace.read_raw_data_for_frame(frame, data)) {
-        if (flags.dump_recorded_data_metadata) {
-          fprintf(out, "  { addr:%p, length:%p }\n", (void*)data.addr.as_int(),
-                  (void*)data.data.size());
-        }
-      }
-      if (!flags.raw_dump) {
-        fprintf(out, "}\n");
-      }
-    } else {
-      TraceReader::RawData data;
-      while (process_raw_data && trace.read_raw_data_for_frame(frame, data)) {
-      }
-      while (true) {
-        TraceReader::MappedData data;
-        KernelMapping km = trace.read_mapped_region(&data);
-        if (km.size() == 0) {
-          break;
-        }
-      }
-    }
+  fprintf(out, "// %-28s %12s\n", "tid", "events");
+  for (auto& t : agg.task_events) {
+    fprintf(out, "// %-28d %12" PRIu64 "\n", t.first, t.second);
+  }
+
+  fprintf(out, "// Syscallbuf flushes %" PRIu64 ", recorded bytes %" PRIu64
+               ", mean %.1f, max %" PRIu64 "\n",
+          agg.flushes, agg.flush_bytes,
+          agg.flushes ? double(agg.flush_bytes) / agg.flushes : 0.0,
+          agg.max_flush_bytes);
+
+  fprintf(out, "// %-28s %16s %16s %8s\n", "substream", "uncompressed",
+          "compressed", "ratio");
+  for (int i = TraceStream::SUBSTREAM_FIRST; i < TraceStream::SUBSTREAM_COUNT;
+       ++i) {
+    auto s = (TraceStream::Substream)i;
+    uint64_t uncompressed = trace.uncompressed_bytes(s);
+    uint64_t compressed = trace.compressed_bytes(s);
+    fprintf(out, "// %-28s %16" PRIu64 " %16" PRIu64 " %7.2fx\n",
+            TraceStream::substream_name(s), uncompressed, compressed,
+            compressed ? double(uncompressed) / compressed : 0.0);
   }
 }
 
@@ -224,6 +496,10 @@ static void dump_statistics(const TraceReader& trace, FILE* out) {
   fprintf(out, "// Uncompressed bytes %" PRIu64 ", compressed bytes %" PRIu64
                ", ratio %.2fx\n",
           uncompressed, compressed, double(uncompressed) / compressed);
+  if (trace.pretend_num_cores()) {
+    fprintf(out, "// Tracees were told they had %d cores\n",
+            trace.pretend_num_cores());
+  }
 }
 
 static void dump(const string& trace_dir, const DumpFlags& flags,
@@ -236,7 +512,17 @@ static void dump(const string& trace_dir, const DumpFlags& flags,
                  "eax ebx ecx edx esi edi ebp orig_eax esp eip eflags\n");
   }
 
-  if (specs.size() > 0) {
+  if (flags.dump_aggregate) {
+    TraceAggregate agg;
+    if (specs.size() > 0) {
+      for (size_t i = 0; i < specs.size(); ++i) {
+        aggregate_events_matching(trace, flags, agg, &specs[i]);
+      }
+    } else {
+      aggregate_events_matching(trace, flags, agg, nullptr /*all events*/);
+    }
+    dump_aggregate(trace, agg, stdout);
+  } else if (specs.size() > 0) {
     for (size_t i = 0; i < specs.size(); ++i) {
       dump_events_matching(trace, flags, stdout, &specs[i]);
     }
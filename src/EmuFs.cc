@@ -3,8 +3,9 @@
 #include "EmuFs.h"
 
 #include <syscall.h>
+#include <unistd.h>
 
-#include <fstream>
+#include <algorithm>
 #include <sstream>
 #include <string>
 
@@ -12,6 +13,7 @@
 #include "kernel_metadata.h"
 #include "log.h"
 #include "ReplaySession.h"
+#include "util.h"
 
 using namespace std;
 
@@ -30,11 +32,30 @@ EmuFile::~EmuFile() {
 
 EmuFile::shr_ptr EmuFile::clone() {
   auto f = EmuFile::create(orig_path.c_str(), device(), inode(), size_);
-  // NB: this isn't the most efficient possible file copy, but
-  // it's simple and not too slow.
-  ifstream src(proc_path(), ifstream::binary);
-  ofstream dst(f->proc_path(), ofstream::binary);
-  dst << src.rdbuf();
+  // Shared mappings are often large and mostly untouched, so only copy the
+  // extents that hold data and leave holes in the new file where this one
+  // has them. The data is copied in the kernel where possible.
+  off64_t offset = 0;
+  while ((uint64_t)offset < size_) {
+    off64_t data = lseek64(file, offset, SEEK_DATA);
+    if (data < 0) {
+      if (errno == ENXIO) {
+        // No data beyond |offset|.
+        break;
+      }
+      // SEEK_DATA unsupported; copy everything that's left.
+      data = offset;
+    }
+    off64_t hole = lseek64(file, data, SEEK_HOLE);
+    if (hole < 0) {
+      hole = size_;
+    }
+    hole = min<off64_t>(hole, size_);
+    if (!copy_file_range_in_place(file, f->file, data, hole - data)) {
+      FATAL() << "Failed to clone emulated file " << orig_path;
+    }
+    offset = hole;
+  }
   return f;
 }
 
@@ -91,8 +112,7 @@ EmuFile::EmuFile(ScopedFd&& fd, const string& orig_path,
       file(std::move(fd)),
       size_(orig_file_size),
       device_(orig_device),
-      inode_(orig_inode),
-      is_marked(false) {}
+      inode_(orig_inode) {}
 
 EmuFile::shr_ptr EmuFs::at(const KernelMapping& recorded_map) const {
   return files.at(FileId(recorded_map));
@@ -111,60 +131,22 @@ EmuFs::shr_ptr EmuFs::clone() {
   return fs;
 }
 
-void EmuFs::gc(const Session& session) {
-  // XXX this implementation is unnecessarily slow.  But before
-  // throwing it away for something different, give it another
-  // shot once rr is caching local mmaps for all address spaces,
-  // which obviates the need for the yuck slow maps parsing
-  // here.
-  LOG(debug) << "Beginning emufs gc of " << files.size() << " files";
-
-  // Mark in-use files by iterating through the mmaps of all
-  // tracee address spaces.
-  //
-  // We inject these maps into the tracee and are careful to
-  // close the injected fd after we finish the mmap.  That means
-  // that the only way tracees can hold a reference to the
-  // underlying inode is through a memory mapping.  So to
-  // determine if a file is in use, we only have to find a
-  // recognizable filename in some tracee's memory map.
-  //
-  // We check *all* tracee file tables because tracees can share
-  // fds with each other in many ways, and we don't attempt to
-  // track any of that.
-  //
-  // TODO: assuming AddressSpace == FileTable, but technically
-  // they're different things: two tracees could share an
-  // address space but have different file tables.
-  size_t nr_marked_files = 0;
-  for (auto& as : session.vms()) {
-    Task* t = *as->task_set().begin();
-    LOG(debug) << "  iterating /proc/" << t->tid << "/maps ...";
-
-    mark_used_vfiles(*as, &nr_marked_files);
-    if (files.size() == nr_marked_files) {
-      break;
-    }
-  }
-
-  // Sweep all the virtual files that weren't marked.  It might
-  // be possible that a later task will mmap the same underlying
-  // file that we're about to destroy.  That's perfectly fine;
-  // we'll just create it anew, and restore its addressible
-  // contents from the snapshot saved to the trace.  Since there
-  // are no live references to the file in the interim, tracees
-  // can't observe the destroy/recreate operation.
-  vector<FileId> garbage;
-  for (auto it = files.begin(); it != files.end(); ++it) {
-    if (!it->second->marked()) {
-      garbage.push_back(it->first);
+void EmuFs::gc(Session& session) {
+  // Sweep the files that aren't mapped anymore.  It might be possible
+  // that a later task will mmap the same underlying file that we're
+  // about to destroy.  That's perfectly fine; we'll just create it anew,
+  // and restore its addressible contents from the snapshot saved to the
+  // trace.  Since there are no live references to the file in the
+  // interim, tracees can't observe the destroy/recreate operation.
+  for (auto& id : session.take_unmapped_files()) {
+    auto it = files.find(FileId(id.first, id.second));
+    if (it == files.end() || session.is_file_mapped(id.first, id.second)) {
+      // Not an emulated file, or it's been mapped again.
+      continue;
     }
-    it->second->unmark();
-  }
-  for (auto it = garbage.begin(); it != garbage.end(); ++it) {
-    LOG(debug) << "  emufs gc reclaiming einode:" << it->inode << "; fs name `"
-               << files[*it]->emu_path() << "'";
-    files.erase(*it);
+    LOG(debug) << "  emufs gc reclaiming einode:" << id.second
+               << "; fs name `" << it->second->emu_path() << "'";
+    files.erase(it);
   }
 }
 
@@ -194,28 +176,4 @@ void EmuFs::log() const {
 
 EmuFs::EmuFs() {}
 
-void EmuFs::mark_used_vfiles(const AddressSpace& as, size_t* nr_marked_files) {
-  for (auto m : as.maps()) {
-    LOG(debug) << "  examining " << m.map.fsname().c_str() << " ...";
-
-    FileId id(m.recorded_map);
-    auto id_ef = files.find(id);
-    if (id_ef == files.end()) {
-      // Mapping isn't relevant. Not all shared mappings get EmuFs entries
-      // (e.g. readonly shared mappings of certain system files, like fonts).
-      continue;
-    }
-    auto ef = id_ef->second;
-    if (!ef->marked()) {
-      ef->mark();
-      LOG(debug) << "    marked einode:" << id.inode;
-      ++*nr_marked_files;
-      if (files.size() == *nr_marked_files) {
-        LOG(debug) << "  (marked all files, bailing)";
-        return;
-      }
-    }
-  }
-}
-
 } // namespace rr
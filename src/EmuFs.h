@@ -40,9 +40,9 @@ class Task;
  * ID was recycled in [t_0, t_1), then all references to F_0 must have
  * been dropped in that inverval.  A corollary of that is that all
  * memory mappings of F_0 must have been fully unmapped in the
- * interval.  As per the first long comment in |gc()| below, an
- * emulated file can only be "live" during replay if some tracee still
- * has a mapping of it.  Tracees' mappings of emulated files is a
+ * interval.  As per the comment on |gc()| below, an emulated file
+ * can only be "live" during replay if some tracee still has a mapping
+ * of it.  Tracees' mappings of emulated files is a
  * subset of the ways they can create references to real files during
  * recording.  Therefore the event during replay that drops the last
  * reference to the emulated F_0 must be a tracee unmapping of F_0.
@@ -98,13 +98,6 @@ private:
    */
   shr_ptr clone();
 
-  /**
-   * Mark/unmark/check to see if this file is marked.
-   */
-  void mark() { is_marked = true; }
-  bool marked() const { return is_marked; }
-  void unmark() { is_marked = false; }
-
   /**
    * Ensure that the emulated file is sized to match a later
    * stat() of it.
@@ -126,7 +119,6 @@ private:
   uint64_t size_;
   dev_t device_;
   ino_t inode_;
-  bool is_marked;
 
   EmuFile(const EmuFile&) = delete;
   EmuFile operator=(const EmuFile&) = delete;
@@ -170,25 +162,24 @@ public:
 
   /**
    * Collect emulated files that aren't referenced by tracees.
-   * Call this only when a tracee's (possibly shared) file table
-   * has been destroyed.  All other gc triggers are handled
-   * internally.
+   *
+   * We inject shared mappings into the tracee and are careful to close
+   * the injected fd after we finish the mmap.  That means that the only
+   * way tracees can hold a reference to the underlying inode is through a
+   * memory mapping.  |session| counts the mappings of each file as its
+   * address spaces change, so we only need to look at the files whose
+   * last mapping went away since the previous gc. That makes a gc cost
+   * nothing when no emulated file was unmapped.
    */
-  void gc(const Session& session);
+  void gc(Session& session);
 
 private:
   EmuFs();
 
-  /**
-   * Mark all the files being used by the tasks in |as|, and
-   * increment |nt_marked_files| by the number of files that
-   * were marked.
-   */
-  void mark_used_vfiles(const AddressSpace& as, size_t* nr_marked_files);
-
   struct FileId {
     FileId(const KernelMapping& recorded_map)
         : device(recorded_map.device()), inode(recorded_map.inode()) {}
+    FileId(dev_t device, ino_t inode) : device(device), inode(inode) {}
     bool operator<(const FileId& other) const {
       return device < other.device ||
              (device == other.device && inode < other.inode);
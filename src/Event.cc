@@ -21,6 +21,7 @@ namespace rr {
 Event::Event(EncodedEvent e) {
   switch (event_type = e.type) {
     case EV_SEGV_RDTSC:
+    case EV_SEGV_CPUID:
     case EV_EXIT:
     case EV_SCHED:
     case EV_SYSCALLBUF_FLUSH:
@@ -140,6 +141,7 @@ EncodedEvent Event::encode() const {
 
   switch (event_type) {
     case EV_SEGV_RDTSC:
+    case EV_SEGV_CPUID:
     case EV_EXIT:
     case EV_SCHED:
     case EV_SYSCALLBUF_FLUSH:
@@ -277,6 +279,7 @@ std::string Event::type_name() const {
       CASE(NOOP);
       CASE(SCHED);
       CASE(SEGV_RDTSC);
+      CASE(SEGV_CPUID);
       CASE(SYSCALLBUF_FLUSH);
       CASE(SYSCALLBUF_ABORT_COMMIT);
       CASE(SYSCALLBUF_RESET);
@@ -5,9 +5,11 @@
 
 #include <assert.h>
 
+#include <memory>
 #include <ostream>
 #include <stack>
 #include <string>
+#include <vector>
 
 #include "kernel_abi.h"
 #include "Registers.h"
@@ -47,6 +49,9 @@ enum EventType {
   // Scheduling signal interrupted the trace.
   EV_SCHED,
   EV_SEGV_RDTSC,
+  // A cpuid instruction trapped because CPUID faulting is enabled. The
+  // recorded registers hold its results.
+  EV_SEGV_CPUID,
   // Recorded syscallbuf data for one or more buffered syscalls.
   EV_SYSCALLBUF_FLUSH,
   EV_SYSCALLBUF_ABORT_COMMIT,
@@ -387,6 +392,41 @@ private:
   };
 };
 
+/**
+ * A stack of Events that keeps the storage of popped events for reuse.
+ * Once the stack has been N events deep, pushing and popping up to N events
+ * doesn't allocate, so recording a syscall or signal doesn't either. Events
+ * don't move once pushed, so references to them stay valid while other
+ * events are pushed.
+ */
+class EventStack {
+public:
+  EventStack() : depth(0) {}
+
+  void push(const Event& ev) {
+    if (depth == events.size()) {
+      events.push_back(std::unique_ptr<Event>(new Event(ev)));
+    } else {
+      *events[depth] = ev;
+    }
+    ++depth;
+  }
+  void pop() {
+    assert(depth > 0);
+    --depth;
+  }
+
+  size_t size() const { return depth; }
+  Event& back() { return *events[depth - 1]; }
+  const Event& back() const { return *events[depth - 1]; }
+  /** Index 0 is the bottom of the stack. */
+  const Event& operator[](size_t i) const { return *events[i]; }
+
+private:
+  std::vector<std::unique_ptr<Event> > events;
+  size_t depth;
+};
+
 inline static std::ostream& operator<<(std::ostream& o, const Event& ev) {
   return o << ev.str();
 }
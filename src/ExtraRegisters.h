@@ -55,6 +55,15 @@ public:
     format_ = format;
     std::swap(data_, consume_data);
   }
+  /**
+   * Set the format and size, keeping the existing buffer when it's big
+   * enough, and return the data for the caller to fill in.
+   */
+  uint8_t* resize_raw_data(Format format, size_t size) {
+    format_ = format;
+    data_.resize(size);
+    return data_.data();
+  }
   void set_arch(SupportedArch a) { arch_ = a; }
 
   Format format() const { return format_; }
@@ -4,6 +4,7 @@
 
 #include <limits.h>
 
+#include <algorithm>
 #include <unordered_set>
 
 #include "rr/rr.h"
@@ -51,30 +52,28 @@ void FdTable::did_write(Task* t, int fd,
 void FdTable::did_dup(int from, int to) {
   if (fds.count(from)) {
     fds[to] = fds[from];
-  } else {
-    fds.erase(to);
+  } else if (!fds.erase(to)) {
+    // Neither fd is monitored, so tracees' bitmaps don't change. This is
+    // the common case, and updating them means visiting every task.
+    return;
   }
   update_syscallbuf_fds_disabled(to);
 }
 
 void FdTable::did_close(int fd) {
-  fds.erase(fd);
-  update_syscallbuf_fds_disabled(fd);
-}
-
-static bool is_fd_monitored_in_any_task(AddressSpace* vm, int fd) {
-  for (Task* t : vm->task_set()) {
-    if (t->fd_table()->is_monitoring(fd)) {
-      return true;
-    }
+  if (fds.erase(fd)) {
+    update_syscallbuf_fds_disabled(fd);
   }
-  return false;
 }
 
 void FdTable::update_syscallbuf_fds_disabled(int fd) {
   assert(fd >= 0);
   assert(task_set().size() > 0);
 
+  if (fd >= SYSCALLBUF_FDS_DISABLED_SIZE) {
+    return;
+  }
+
   unordered_set<AddressSpace*> vms_updated;
   // It's possible for tasks with different VMs to share this fd table.
   // But tasks with the same VM might have different fd tables...
@@ -85,10 +84,28 @@ void FdTable::update_syscallbuf_fds_disabled(int fd) {
     }
     vms_updated.insert(vm);
 
-    if (!t->syscallbuf_fds_disabled_child.is_null() &&
-        fd < SYSCALLBUF_FDS_DISABLED_SIZE) {
-      bool disable = is_fd_monitored_in_any_task(vm, fd);
-      t->write_mem(t->syscallbuf_fds_disabled_child + fd, (char)disable);
+    if (!t->syscallbuf_fds_disabled_child.is_null()) {
+      // There are usually far fewer fd tables in an address space than
+      // tasks, so find those first.
+      unordered_set<FdTable*> tables;
+      for (Task* vm_t : vm->task_set()) {
+        tables.insert(vm_t->fd_table().get());
+      }
+      // Rebuild the whole byte holding |fd|'s bit from our own state, so
+      // we don't need to read it back from the tracee.
+      int first_fd = fd & ~7;
+      char byte = 0;
+      for (int i = first_fd; i < first_fd + 8; ++i) {
+        for (FdTable* table : tables) {
+          if (table->is_monitoring(i)) {
+            byte |= SYSCALLBUF_FDS_DISABLED_BIT(i);
+            break;
+          }
+        }
+      }
+      t->write_mem(t->syscallbuf_fds_disabled_child +
+                       SYSCALLBUF_FDS_DISABLED_BYTE(fd),
+                   byte);
     }
   }
 }
@@ -100,8 +117,8 @@ void FdTable::init_syscallbuf_fds_disabled(Task* t) {
     return;
   }
 
-  char disabled[SYSCALLBUF_FDS_DISABLED_SIZE];
-  memset(disabled, 0, sizeof(disabled));
+  vector<char> disabled(SYSCALLBUF_FDS_DISABLED_SIZE / 8);
+  size_t size = 0;
 
   // It's possible that some tasks in this address space have a different
   // FdTable. We need to disable syscallbuf for an fd if any tasks for this
@@ -111,13 +128,18 @@ void FdTable::init_syscallbuf_fds_disabled(Task* t) {
       int fd = it.first;
       assert(fd >= 0);
       if (fd < SYSCALLBUF_FDS_DISABLED_SIZE) {
-        disabled[fd] = 1;
+        size_t byte = SYSCALLBUF_FDS_DISABLED_BYTE(fd);
+        disabled[byte] |= SYSCALLBUF_FDS_DISABLED_BIT(fd);
+        size = max(size, byte + 1);
       }
     }
   }
 
-  t->write_mem(t->syscallbuf_fds_disabled_child, disabled,
-               SYSCALLBUF_FDS_DISABLED_SIZE);
+  // The preload library has only just been initialized, so its bitmap is
+  // still all zeroes and we only need to write up to the last disabled fd.
+  if (size) {
+    t->write_mem(t->syscallbuf_fds_disabled_child, disabled.data(), size);
+  }
 }
 
 static bool is_fd_open(Task* t, int fd) {
@@ -43,6 +43,9 @@ struct Flags {
 
   // Check that cached mmaps match /proc/maps after each event.
   bool check_cached_mmaps;
+  // When checking cached mmaps, only check the ranges rr changed since
+  // the previous check.
+  bool check_cached_mmaps_incrementally;
 
   // Suppress warnings related to environmental features outside rr's
   // control.
@@ -55,6 +58,18 @@ struct Flags {
   // under valgrind.
   std::string forced_uarch;
 
+  // Number of trace blocks to decompress ahead of the reader in the
+  // substreams that benefit from it. 0 disables read-ahead.
+  int read_ahead_blocks;
+
+  // Directory for sharing decompressed trace data blocks between
+  // concurrent readers of the same trace. Empty for none.
+  std::string block_cache_dir;
+
+  // Read traces that are still being recorded, waiting for the recorder
+  // at the end of what it has written so far.
+  bool follow_trace;
+
   Flags()
       : checksum(CHECKSUM_NONE),
         dump_on(DUMP_ON_NONE),
@@ -62,7 +77,10 @@ struct Flags {
         force_things(false),
         mark_stdio(false),
         check_cached_mmaps(false),
-        suppress_environment_warnings(false) {}
+        check_cached_mmaps_incrementally(false),
+        suppress_environment_warnings(false),
+        read_ahead_blocks(2),
+        follow_trace(false) {}
 
   static const Flags& get() { return singleton; }
 
@@ -77,6 +77,36 @@ string invoke_info_checkpoints(GdbServer& gdb_server, Task*,
 static SimpleGdbCommand info_checkpoints("info checkpoints",
                                          invoke_info_checkpoints);
 
+string invoke_set_reverse_step_latency(GdbServer& gdb_server, Task*,
+                                       const vector<string>& args) {
+  double ms = args.size() > 1 ? atof(args[1].c_str()) : 0;
+  if (ms <= 0) {
+    return "Usage: set rr-reverse-step-latency <milliseconds>";
+  }
+  gdb_server.timeline.set_reverse_step_latency_target(ms / 1000);
+  return string("Reverse step latency target set to ") + to_string(ms) +
+         "ms.";
+}
+static SimpleGdbCommand set_reverse_step_latency(
+    "set rr-reverse-step-latency", invoke_set_reverse_step_latency);
+
+string invoke_show_reverse_step_latency(GdbServer& gdb_server, Task*,
+                                        const vector<string>&) {
+  return string("Reverse step latency target is ") +
+         to_string(gdb_server.timeline.reverse_step_latency_target() * 1000) +
+         "ms; checkpoints currently take " +
+         to_string(gdb_server.timeline.clone_cost() * 1000) + "ms.";
+}
+static SimpleGdbCommand show_reverse_step_latency(
+    "show rr-reverse-step-latency", invoke_show_reverse_step_latency);
+
+string invoke_checkpoint_stats(GdbServer& gdb_server, Task*,
+                               const vector<string>&) {
+  return gdb_server.timeline.checkpoint_stats_json();
+}
+static SimpleGdbCommand checkpoint_stats("rr-checkpoint-stats",
+                                         invoke_checkpoint_stats);
+
 /*static*/ void GdbCommand::init_auto_args() {
   checkpoint.add_auto_arg("rr-where");
 }
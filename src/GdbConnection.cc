@@ -16,6 +16,7 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -60,7 +61,12 @@ static bool request_needs_immediate_response(const GdbRequest* req) {
 }
 
 GdbConnection::GdbConnection(pid_t tgid, const Features& features)
-    : tgid(tgid), no_ack(false), features_(features) {
+    : tgid(tgid),
+      no_ack(false),
+      catch_syscalls(false),
+      catch_syscalls_generation_(0),
+      inbuf_start(0),
+      features_(features) {
 #ifndef REVERSE_EXECUTION
   features_.reverse_execution = false;
 #endif
@@ -112,6 +118,16 @@ void GdbConnection::await_debugger(ScopedFd& listen_fd) {
   sock_fd = ScopedFd(accept(listen_fd, (struct sockaddr*)&client_addr, &len));
   // We might restart this debugging session, so don't set the
   // socket fd CLOEXEC.
+
+  // Every exchange with gdb is a request followed by a reply. Don't let
+  // Nagle's algorithm hold back the tail of a reply until the previous
+  // segment is acked; over a real network that costs a delayed-ACK timeout
+  // per round trip.
+  int nodelay = 1;
+  if (setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                 sizeof(nodelay))) {
+    LOG(warn) << "Couldn't set TCP_NODELAY on debugger socket";
+  }
 }
 
 static const char connection_addr[] = "127.0.0.1";
@@ -260,8 +276,19 @@ void GdbConnection::read_data_once() {
   /* Wait until there's data, instead of busy-looping on
    * EAGAIN. */
   poll_incoming(sock_fd, -1 /* wait forever */);
-  uint8_t buf[4096];
-  nread = read(sock_fd, buf, sizeof(buf));
+  // Once consumed input makes up most of the buffer, move the rest to the
+  // front. Each byte is moved at most once on average.
+  if (inbuf_start > 0 && inbuf_start >= inbuf_size()) {
+    inbuf.erase(inbuf.begin(), inbuf.begin() + inbuf_start);
+    inbuf_start = 0;
+  }
+  // Large enough for gdb's biggest packets to arrive in one read. Read
+  // straight into the buffer.
+  static const size_t read_size = 65536;
+  size_t old_size = inbuf.size();
+  inbuf.resize(old_size + read_size);
+  nread = read(sock_fd, inbuf.data() + old_size, read_size);
+  inbuf.resize(old_size + max<ssize_t>(nread, 0));
   if (0 == nread) {
     LOG(info) << "(gdb closed debugging socket, exiting)";
     exit(0);
@@ -269,7 +296,14 @@ void GdbConnection::read_data_once() {
   if (nread <= 0) {
     FATAL() << "Error reading from gdb";
   }
-  inbuf.insert(inbuf.end(), buf, buf + nread);
+}
+
+void GdbConnection::consume_input(size_t len) {
+  inbuf_start += len;
+  if (inbuf_start == inbuf.size()) {
+    inbuf.clear();
+    inbuf_start = 0;
+  }
 }
 
 void GdbConnection::write_flush() {
@@ -298,25 +332,27 @@ void GdbConnection::write_data_raw(const uint8_t* data, ssize_t len) {
   outbuf.insert(outbuf.end(), data, data + len);
 }
 
-void GdbConnection::write_hex(unsigned long hex) {
-  char buf[32];
-  size_t len;
+size_t GdbConnection::begin_packet() {
+  outbuf.push_back('$');
+  return outbuf.size();
+}
 
-  len = snprintf(buf, sizeof(buf) - 1, "%02lx", hex);
-  write_data_raw((uint8_t*)buf, len);
+void GdbConnection::end_packet(size_t payload_start) {
+  static const char hex_digits[] = "0123456789abcdef";
+  uint8_t checksum = 0;
+  for (size_t i = payload_start; i < outbuf.size(); ++i) {
+    checksum += outbuf[i];
+  }
+  outbuf.push_back('#');
+  outbuf.push_back(hex_digits[checksum >> 4]);
+  outbuf.push_back(hex_digits[checksum & 0xf]);
 }
 
 void GdbConnection::write_packet_bytes(const uint8_t* data, size_t num_bytes) {
-  uint8_t checksum;
-  size_t i;
-
-  write_data_raw((uint8_t*)"$", 1);
-  for (i = 0, checksum = 0; i < num_bytes; ++i) {
-    checksum += data[i];
-  }
-  write_data_raw((uint8_t*)data, num_bytes);
-  write_data_raw((uint8_t*)"#", 1);
-  write_hex(checksum);
+  outbuf.reserve(outbuf.size() + num_bytes + 4);
+  size_t payload_start = begin_packet();
+  outbuf.insert(outbuf.end(), data, data + num_bytes);
+  end_packet(payload_start);
 }
 
 void GdbConnection::write_packet(const char* data) {
@@ -326,50 +362,42 @@ void GdbConnection::write_packet(const char* data) {
 void GdbConnection::write_binary_packet(const char* pfx, const uint8_t* data,
                                         ssize_t num_bytes) {
   ssize_t pfx_num_chars = strlen(pfx);
-  uint8_t buf[2 * num_bytes + pfx_num_chars];
-  ssize_t buf_num_bytes = 0;
-  int i;
-
-  strncpy((char*)buf, pfx, sizeof(buf) - 1);
-  buf_num_bytes += pfx_num_chars;
+  // Escape the data straight into the output buffer.
+  outbuf.reserve(outbuf.size() + pfx_num_chars + 2 * num_bytes + 4);
+  size_t payload_start = begin_packet();
+  outbuf.insert(outbuf.end(), pfx, pfx + pfx_num_chars);
 
-  for (i = 0; i < num_bytes; ++i) {
+  for (ssize_t i = 0; i < num_bytes; ++i) {
     uint8_t b = data[i];
 
-    if (buf_num_bytes + 2 > ssize_t(sizeof(buf))) {
-      break;
-    }
     switch (b) {
       case '#':
       case '$':
       case '}':
       case '*':
-        buf[buf_num_bytes++] = '}';
-        buf[buf_num_bytes++] = b ^ 0x20;
+        outbuf.push_back('}');
+        outbuf.push_back(b ^ 0x20);
         break;
       default:
-        buf[buf_num_bytes++] = b;
+        outbuf.push_back(b);
         break;
     }
   }
 
   LOG(debug) << " ***** NOTE: writing binary data, upcoming debug output may "
                 "be truncated";
-  return write_packet_bytes(buf, buf_num_bytes);
+  end_packet(payload_start);
 }
 
 void GdbConnection::write_hex_bytes_packet(const uint8_t* bytes, size_t len) {
-  if (0 == len) {
-    write_packet("");
-    return;
-  }
-
-  char buf[2 * len + 1];
+  static const char hex_digits[] = "0123456789abcdef";
+  outbuf.reserve(outbuf.size() + 2 * len + 4);
+  size_t payload_start = begin_packet();
   for (size_t i = 0; i < len; ++i) {
-    unsigned long b = bytes[i];
-    snprintf(&buf[2 * i], 3, "%02lx", b);
+    outbuf.push_back(hex_digits[bytes[i] >> 4]);
+    outbuf.push_back(hex_digits[bytes[i] & 0xf]);
   }
-  write_packet(buf);
+  end_packet(payload_start);
 }
 
 static void parser_assert(bool cond) {
@@ -397,8 +425,9 @@ static string decode_ascii_encoded_hex_str(const char* encoded) {
 bool GdbConnection::skip_to_packet_start() {
   ssize_t end = -1;
   /* XXX we want memcspn() here ... */
-  for (size_t i = 0; i < inbuf.size(); ++i) {
-    if (inbuf[i] == '$' || inbuf[i] == INTERRUPT_CHAR) {
+  uint8_t* data = inbuf_data();
+  for (size_t i = 0; i < inbuf_size(); ++i) {
+    if (data[i] == '$' || data[i] == INTERRUPT_CHAR) {
       end = i;
       break;
     }
@@ -407,14 +436,14 @@ bool GdbConnection::skip_to_packet_start() {
   if (end < 0) {
     /* Discard all read bytes, which we don't care
      * about. */
-    inbuf.clear();
+    consume_input(inbuf_size());
     return false;
   }
   /* Discard bytes up to start-of-packet. */
-  inbuf.erase(inbuf.begin(), inbuf.begin() + end);
+  consume_input(end);
 
-  parser_assert(1 <= inbuf.size());
-  parser_assert('$' == inbuf[0] || INTERRUPT_CHAR == inbuf[0]);
+  parser_assert(1 <= inbuf_size());
+  parser_assert('$' == inbuf_data()[0] || INTERRUPT_CHAR == inbuf_data()[0]);
   return true;
 }
 
@@ -423,7 +452,7 @@ bool GdbConnection::sniff_packet() {
     /* We've already seen a (possibly partial) packet. */
     return true;
   }
-  parser_assert(inbuf.empty());
+  parser_assert(inbuf_size() == 0);
   return poll_incoming(sock_fd, 0 /*don't wait*/);
 }
 
@@ -441,7 +470,7 @@ void GdbConnection::read_packet() {
     read_data_once();
   }
 
-  if (inbuf[0] == INTERRUPT_CHAR) {
+  if (inbuf_data()[0] == INTERRUPT_CHAR) {
     /* Interrupts are kind of an ugly duckling in the gdb
      * protocol ... */
     packetend = 1;
@@ -451,13 +480,13 @@ void GdbConnection::read_packet() {
   /* Read until we see end-of-packet. */
   size_t checkedlen = 0;
   while (true) {
-    uint8_t* p = (uint8_t*)memchr(inbuf.data() + checkedlen, '#',
-                                  inbuf.size() - checkedlen);
+    uint8_t* p = (uint8_t*)memchr(inbuf_data() + checkedlen, '#',
+                                  inbuf_size() - checkedlen);
     if (p) {
-      packetend = p - inbuf.data();
+      packetend = p - inbuf_data();
       break;
     }
-    checkedlen = inbuf.size();
+    checkedlen = inbuf_size();
     read_data_once();
   }
 
@@ -465,7 +494,7 @@ void GdbConnection::read_packet() {
    * gdb is corrupted enough to garble a checksum over TCP, it's
    * not really clear why asking for the packet again might make
    * the bug go away. */
-  parser_assert('$' == inbuf[0] && packetend < inbuf.size());
+  parser_assert('$' == inbuf_data()[0] && packetend < inbuf_size());
 
   /* Acknowledge receipt of the packet. */
   if (!no_ack) {
@@ -550,6 +579,36 @@ bool GdbConnection::xfer(const char* name, char* args) {
     return false;
   }
 
+  if (!strcmp(name, "threads") || !strcmp(name, "libraries-svr4")) {
+    parser_assert(!strncmp(args, "read::", sizeof("read::") - 1));
+    args += sizeof("read::") - 1;
+
+    req = GdbRequest(!strcmp(name, "threads") ? DREQ_READ_THREADS
+                                              : DREQ_READ_LIBRARIES_SVR4);
+    req.target = query_thread;
+    req.mem().addr = strtoul(args, &args, 16);
+    parser_assert(',' == *args++);
+    req.mem().len = strtoul(args, &args, 16);
+    parser_assert('\0' == *args);
+    return true;
+  }
+
+  if (!strcmp(name, "exec-file")) {
+    // The annex is the pid, in hex; we only debug one process.
+    parser_assert(!strncmp(args, "read:", sizeof("read:") - 1));
+    args = strchr(args + sizeof("read:") - 1, ':');
+    parser_assert(args);
+    ++args;
+
+    req = GdbRequest(DREQ_READ_EXEC_FILE);
+    req.target = query_thread;
+    req.mem().addr = strtoul(args, &args, 16);
+    parser_assert(',' == *args++);
+    req.mem().len = strtoul(args, &args, 16);
+    parser_assert('\0' == *args);
+    return true;
+  }
+
   UNHANDLED_REQ() << "Unhandled gdb xfer request: " << name << "(" << args
                   << ")";
   return false;
@@ -668,10 +727,15 @@ bool GdbConnection::query(char* payload) {
     // Encourage gdb to use very large packets since we support any packet size
     supported << "PacketSize=1048576"
                  ";QStartNoAckMode+"
+                 ";QCatchSyscalls+"
                  ";qXfer:auxv:read+"
                  ";qXfer:siginfo:read+"
                  ";qXfer:siginfo:write+"
+                 ";qXfer:threads:read+"
+                 ";qXfer:libraries-svr4:read+"
+                 ";qXfer:exec-file:read+"
                  ";multiprocess+"
+                 ";binary-upload+"
                  ";ConditionalBreakpoints+";
     if (features().reverse_execution) {
       supported << ";ReverseContinue+"
@@ -727,7 +791,7 @@ bool GdbConnection::query(char* payload) {
       parser_assert(';' == *args++);
       req.mem().len = strtoul(args, &args, 16);
       parser_assert(';' == *args++);
-      read_binary_data((const uint8_t*)args, inbuf.data() + packetend,
+      read_binary_data((const uint8_t*)args, inbuf_data() + packetend,
                        req.mem().data);
 
       LOG(debug) << "gdb searching memory (addr=" << HEX(req.mem().addr)
@@ -757,6 +821,24 @@ bool GdbConnection::set_var(char* payload) {
     no_ack = true;
     return false;
   }
+  if (!strcmp(name, "CatchSyscalls")) {
+    // "0" turns catching off, "1" catches all syscalls and
+    // "1;<sysno>;<sysno>..." catches the listed ones (in hex).
+    parser_assert(args);
+    catch_syscalls = *args == '1';
+    caught_syscalls.clear();
+    char* p = strchr(args, ';');
+    while (p) {
+      caught_syscalls.insert(strtol(p + 1, &p, 16));
+      parser_assert(!*p || *p == ';');
+      p = *p ? p : nullptr;
+    }
+    ++catch_syscalls_generation_;
+    LOG(debug) << "gdb " << (catch_syscalls ? "catches" : "doesn't catch")
+               << " syscalls (" << caught_syscalls.size() << " listed)";
+    write_packet("OK");
+    return false;
+  }
 
   UNHANDLED_REQ() << "Unhandled gdb set: Q" << name;
   return false;
@@ -920,6 +1002,29 @@ bool GdbConnection::process_vpacket(char* payload) {
       req.restart().param = param;
       LOG(debug) << "next replayer restarting from checkpoint "
                  << req.restart().param;
+    } else if (event_str[0] == 't') {
+      req.restart().type = RESTART_FROM_TIME;
+      req.restart().seconds = strtod(event_str.c_str() + 1, &endp);
+      LOG(debug) << "next replayer advancing to " << req.restart().seconds
+                 << "s";
+    } else if (event_str[0] == 'm') {
+      // m<N>,<NAME>: the name goes last since it may contain anything.
+      req.restart().type = RESTART_FROM_MARKER;
+      req.restart().param = strtol(event_str.c_str() + 1, &endp, 0);
+      if (*endp == ',') {
+        req.restart().param_str = endp + 1;
+        endp += strlen(endp);
+      }
+      LOG(debug) << "next replayer advancing to marker "
+                 << req.restart().param_str << " #" << req.restart().param;
+    } else if (event_str.find(':') != string::npos) {
+      req.restart().type = RESTART_FROM_TICKS;
+      req.restart().param = strtol(event_str.c_str(), &endp, 0);
+      if (*endp == ':') {
+        req.restart().ticks = strtoull(endp + 1, &endp, 0);
+      }
+      LOG(debug) << "next replayer advancing to ticks " << req.restart().ticks
+                 << " of event " << req.restart().param;
     } else {
       req.restart().type = RESTART_FROM_EVENT;
       req.restart().param = strtol(event_str.c_str(), &endp, 0);
@@ -958,21 +1063,22 @@ static string to_string(const vector<uint8_t>& bytes, size_t max_len) {
 }
 
 bool GdbConnection::process_packet() {
-  parser_assert(INTERRUPT_CHAR == inbuf[0] ||
-                ('$' == inbuf[0] &&
-                 (uint8_t*)memchr(inbuf.data(), '#', inbuf.size()) ==
-                     inbuf.data() + packetend));
+  uint8_t* packet = inbuf_data();
+  parser_assert(INTERRUPT_CHAR == packet[0] ||
+                ('$' == packet[0] &&
+                 (uint8_t*)memchr(packet, '#', inbuf_size()) ==
+                     packet + packetend));
 
-  if (INTERRUPT_CHAR == inbuf[0]) {
+  if (INTERRUPT_CHAR == packet[0]) {
     LOG(debug) << "gdb requests interrupt";
     req = GdbRequest(DREQ_INTERRUPT);
-    inbuf.erase(inbuf.begin());
+    consume_input(1);
     return true;
   }
 
-  char request = inbuf[1];
-  char* payload = (char*)&inbuf[2];
-  inbuf[packetend] = '\0';
+  char request = packet[1];
+  char* payload = (char*)&packet[2];
+  packet[packetend] = '\0';
   LOG(debug) << "raw request " << request << payload;
 
   bool ret;
@@ -1017,14 +1123,17 @@ bool GdbConnection::process_packet() {
       write_packet("OK");
       exit(0);
     case 'm':
+    case 'x':
       req = GdbRequest(DREQ_GET_MEM);
       req.target = query_thread;
+      req.mem().binary = request == 'x';
       req.mem().addr = strtoul(payload, &payload, 16);
       parser_assert(',' == *payload++);
       req.mem().len = strtoul(payload, &payload, 16);
       parser_assert('\0' == *payload);
 
-      LOG(debug) << "gdb requests memory (addr=" << HEX(req.mem().addr)
+      LOG(debug) << "gdb requests " << (req.mem().binary ? "binary " : "")
+                 << "memory (addr=" << HEX(req.mem().addr)
                  << ", len=" << req.mem().len << ")";
 
       ret = true;
@@ -1080,7 +1189,7 @@ bool GdbConnection::process_packet() {
       parser_assert(',' == *payload++);
       req.mem().len = strtoul(payload, &payload, 16);
       parser_assert(':' == *payload++);
-      read_binary_data((const uint8_t*)payload, inbuf.data() + packetend,
+      read_binary_data((const uint8_t*)payload, packet + packetend,
                        req.mem().data);
       parser_assert(req.mem().len == req.mem().data.size());
 
@@ -1147,13 +1256,13 @@ bool GdbConnection::process_packet() {
       ret = true;
       break;
     default:
-      UNHANDLED_REQ() << "Unhandled gdb request '" << inbuf[1] << "'";
+      UNHANDLED_REQ() << "Unhandled gdb request '" << packet[1] << "'";
       ret = false;
   }
   /* Erase the newly processed packet from the input buffer. The checksum
    * after the '#' will be skipped later as we look for the next packet start.
    */
-  inbuf.erase(inbuf.begin(), inbuf.begin() + packetend + 1);
+  consume_input(packetend + 1);
 
   /* If we processed the request internally, consume it. */
   if (!ret) {
@@ -1342,26 +1451,49 @@ static int to_gdb_signum(int sig) {
   }
 }
 
-void GdbConnection::send_stop_reply_packet(GdbThreadId thread, int sig,
-                                           uintptr_t watch_addr) {
+void GdbConnection::send_stop_reply_packet(
+    GdbThreadId thread, int sig, const char* reason,
+    const vector<GdbRegisterValue>& expedited_regs) {
   if (sig < 0) {
     write_packet("E01");
     return;
   }
+  char buf[PATH_MAX];
+  int len = snprintf(buf, sizeof(buf) - 1, "T%02xthread:p%02x.%02x;%s",
+                     to_gdb_signum(sig), thread.pid, thread.tid, reason);
+  for (auto& reg : expedited_regs) {
+    char value[2 * GdbRegisterValue::MAX_SIZE + 1];
+    print_reg_value(reg, value);
+    len += snprintf(buf + len, sizeof(buf) - 1 - len, "%02x:%s;", reg.name,
+                    value);
+  }
+  write_packet(buf);
+}
+
+void GdbConnection::notify_stop(GdbThreadId thread, int sig,
+                                uintptr_t watch_addr,
+                                const vector<GdbRegisterValue>& expedited_regs) {
   char watch[1024];
   if (watch_addr) {
     snprintf(watch, sizeof(watch) - 1, "watch:%" PRIxPTR ";", watch_addr);
   } else {
     watch[0] = '\0';
   }
-  char buf[PATH_MAX];
-  snprintf(buf, sizeof(buf) - 1, "T%02xthread:p%02x.%02x;%s",
-           to_gdb_signum(sig), thread.pid, thread.tid, watch);
-  write_packet(buf);
+  notify_stop_internal(thread, sig, watch, expedited_regs);
 }
 
-void GdbConnection::notify_stop(GdbThreadId thread, int sig,
-                                uintptr_t watch_addr) {
+void GdbConnection::notify_syscall_stop(
+    GdbThreadId thread, int syscallno, bool entry,
+    const vector<GdbRegisterValue>& expedited_regs) {
+  char reason[100];
+  snprintf(reason, sizeof(reason) - 1, "%s:%x;",
+           entry ? "syscall_entry" : "syscall_return", syscallno);
+  notify_stop_internal(thread, SIGTRAP, reason, expedited_regs);
+}
+
+void GdbConnection::notify_stop_internal(
+    GdbThreadId thread, int sig, const char* reason,
+    const vector<GdbRegisterValue>& expedited_regs) {
   assert(req.is_resume_request() || req.type == DREQ_INTERRUPT);
 
   if (tgid != thread.pid) {
@@ -1371,7 +1503,7 @@ void GdbConnection::notify_stop(GdbThreadId thread, int sig,
     // the next stop we're willing to tell gdb about.
     return;
   }
-  send_stop_reply_packet(thread, sig, watch_addr);
+  send_stop_reply_packet(thread, sig, reason, expedited_regs);
 
   // This isn't documented in the gdb remote protocol, but if we
   // don't do this, gdb will sometimes continue to send requests
@@ -1454,6 +1586,8 @@ void GdbConnection::reply_get_mem(const vector<uint8_t>& mem) {
 
   if (req.mem().len > 0 && mem.size() == 0) {
     write_packet("E01");
+  } else if (req.mem().binary) {
+    write_binary_packet("b", mem.data(), mem.size());
   } else {
     write_hex_bytes_packet(mem.data(), mem.size());
   }
@@ -1590,6 +1724,93 @@ void GdbConnection::reply_detach() {
   consume_request();
 }
 
+static string xml_escape(const string& s) {
+  string result;
+  for (char c : s) {
+    switch (c) {
+      case '&':
+        result += "&amp;";
+        break;
+      case '<':
+        result += "&lt;";
+        break;
+      case '>':
+        result += "&gt;";
+        break;
+      case '"':
+        result += "&quot;";
+        break;
+      default:
+        result += c;
+        break;
+    }
+  }
+  return result;
+}
+
+void GdbConnection::reply_read_threads(const vector<GdbThreadInfo>& threads) {
+  assert(DREQ_READ_THREADS == req.type);
+
+  stringstream xml;
+  xml << "<?xml version=\"1.0\"?>\n<threads>\n";
+  for (auto& t : threads) {
+    if (tgid != t.id.pid) {
+      continue;
+    }
+    char id[64];
+    snprintf(id, sizeof(id), "p%02x.%02x", t.id.pid, t.id.tid);
+    xml << "<thread id=\"" << id << "\" name=\"" << xml_escape(t.name)
+        << "\"/>\n";
+  }
+  xml << "</threads>\n";
+  write_xfer_reply(xml.str());
+
+  consume_request();
+}
+
+void GdbConnection::reply_read_libraries_svr4(
+    const vector<GdbLibraryInfo>& libraries, uintptr_t main_lm) {
+  assert(DREQ_READ_LIBRARIES_SVR4 == req.type);
+
+  if (!main_lm) {
+    write_packet("E01");
+    consume_request();
+    return;
+  }
+
+  stringstream xml;
+  xml << hex << "<library-list-svr4 version=\"1.0\" main-lm=\"0x" << main_lm
+      << "\">\n";
+  for (auto& l : libraries) {
+    xml << "<library name=\"" << xml_escape(l.name) << "\" lm=\"0x" << l.lm
+        << "\" l_addr=\"0x" << l.l_addr << "\" l_ld=\"0x" << l.l_ld
+        << "\"/>\n";
+  }
+  xml << "</library-list-svr4>\n";
+  write_xfer_reply(xml.str());
+
+  consume_request();
+}
+
+void GdbConnection::reply_read_exec_file(const string& exe_file) {
+  assert(DREQ_READ_EXEC_FILE == req.type);
+
+  if (exe_file.empty()) {
+    write_packet("E01");
+  } else {
+    write_xfer_reply(exe_file);
+  }
+
+  consume_request();
+}
+
+void GdbConnection::write_xfer_reply(const string& doc) {
+  size_t offset = min<size_t>(req.mem().addr, doc.size());
+  size_t len = min<size_t>(req.mem().len, doc.size() - offset);
+  write_binary_packet(offset + len < doc.size() ? "m" : "l",
+                      (const uint8_t*)doc.data() + offset, len);
+}
+
 void GdbConnection::reply_read_siginfo(const vector<uint8_t>& si_bytes) {
   assert(DREQ_READ_SIGINFO == req.type);
 
@@ -8,6 +8,7 @@
 
 #include <memory>
 #include <ostream>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -42,6 +43,26 @@ inline std::ostream& operator<<(std::ostream& o, const GdbThreadId& t) {
   return o;
 }
 
+/**
+ * What we tell gdb about a thread in the qXfer:threads:read document.
+ */
+struct GdbThreadInfo {
+  GdbThreadId id;
+  std::string name;
+};
+
+/**
+ * A loaded shared library, from the dynamic linker's link_map list.
+ */
+struct GdbLibraryInfo {
+  std::string name;
+  // Address of the library's link_map entry
+  uintptr_t lm;
+  // Load bias and address of the dynamic section
+  uintptr_t l_addr;
+  uintptr_t l_ld;
+};
+
 /**
  * Represents a possibly-undefined register |name|.  |size| indicates how
  * many bytes of |value| are valid, if any.
@@ -106,6 +127,19 @@ enum GdbRequestType {
   //
   // Uses .mem for offset/len.
   DREQ_READ_SIGINFO,
+  // gdb wants the list of threads, with their names, as XML.
+  //
+  // Uses .mem for offset/len.
+  DREQ_READ_THREADS,
+  // gdb wants the list of shared libraries as SVR4 XML, instead of
+  // walking the dynamic linker's link_map list with memory reads.
+  //
+  // Uses .mem for offset/len.
+  DREQ_READ_LIBRARIES_SVR4,
+  // gdb wants the path of the executable.
+  //
+  // Uses .mem for offset/len.
+  DREQ_READ_EXEC_FILE,
   DREQ_SEARCH_MEM,
   DREQ_MEM_FIRST = DREQ_GET_MEM,
   DREQ_MEM_LAST = DREQ_SEARCH_MEM,
@@ -145,6 +179,12 @@ enum GdbRestartType {
   RESTART_FROM_PREVIOUS,
   RESTART_FROM_EVENT,
   RESTART_FROM_CHECKPOINT,
+  // Uses param as the event and ticks as the current task's ticks within it
+  RESTART_FROM_TICKS,
+  // Uses seconds, the time since the start of the recording
+  RESTART_FROM_TIME,
+  // Uses param_str as the marker name and param as which occurrence of it
+  RESTART_FROM_MARKER,
 };
 
 enum GdbActionType { ACTION_CONTINUE, ACTION_STEP };
@@ -189,6 +229,9 @@ struct GdbRequest {
   struct Mem {
     uintptr_t addr;
     size_t len;
+    // For GET_MEM requests, whether gdb asked for binary data ('x') rather
+    // than hex ('m').
+    bool binary;
     // For SET_MEM requests, the |len| raw bytes that are to be written.
     // For SEARCH_MEM requests, the bytes to search for.
     std::vector<uint8_t> data;
@@ -202,6 +245,8 @@ struct GdbRequest {
   struct Restart {
     int param;
     std::string param_str;
+    Ticks ticks;
+    double seconds;
     GdbRestartType type;
   } restart_;
   struct Cont {
@@ -347,8 +392,34 @@ public:
    * Notify the host that a resume request has "finished", i.e., the
    * target has stopped executing for some reason.  |sig| is the signal
    * that stopped execution, or 0 if execution stopped otherwise.
+   * |expedited_regs| are sent along with the stop so gdb doesn't have to
+   * ask for them.
+   */
+  void notify_stop(GdbThreadId which, int sig, uintptr_t watch_addr = 0,
+                   const std::vector<GdbRegisterValue>& expedited_regs =
+                       std::vector<GdbRegisterValue>());
+  /**
+   * Like notify_stop(), but report that |which| stopped for a syscall
+   * catchpoint, entering (or, if !|entry|, leaving) syscall |syscallno|.
+   */
+  void notify_syscall_stop(GdbThreadId which, int syscallno, bool entry,
+                           const std::vector<GdbRegisterValue>& expedited_regs);
+
+  /**
+   * True if gdb has syscall catchpoints (sent with QCatchSyscalls) and
+   * wants stops for |syscallno|.
+   */
+  bool catching_syscalls() const { return catch_syscalls; }
+  bool catches_syscall(int syscallno) const {
+    return catch_syscalls &&
+           (caught_syscalls.empty() || caught_syscalls.count(syscallno));
+  }
+  /**
+   * Changes whenever gdb changes its syscall catchpoints.
    */
-  void notify_stop(GdbThreadId which, int sig, uintptr_t watch_addr = 0);
+  uint32_t catch_syscalls_generation() const {
+    return catch_syscalls_generation_;
+  }
 
   /** Notify the debugger that a restart request failed. */
   void notify_restart_failed();
@@ -432,6 +503,28 @@ public:
    */
   void reply_get_thread_list(const std::vector<GdbThreadId>& threads);
 
+  /**
+   * Send the part of the XML thread list for |threads| that was asked for
+   * by a READ_THREADS request.
+   */
+  void reply_read_threads(const std::vector<GdbThreadInfo>& threads);
+
+  /**
+   * Send the part of the SVR4 library list XML that was asked for by a
+   * READ_LIBRARIES_SVR4 request. |main_lm| is the address of the
+   * executable's link_map entry, which isn't in |libraries|. If it's 0, the
+   * list couldn't be found and gdb is told to walk the link_map list
+   * itself.
+   */
+  void reply_read_libraries_svr4(const std::vector<GdbLibraryInfo>& libraries,
+                                 uintptr_t main_lm);
+
+  /**
+   * Send the part of |exe_file|, the executable's path, that was asked for
+   * by a READ_EXEC_FILE request.
+   */
+  void reply_read_exec_file(const std::string& exe_file);
+
   /**
    * |ok| is true if the request was successfully applied, false if
    * not.
@@ -508,12 +601,30 @@ private:
    */
   void write_flush();
   void write_data_raw(const uint8_t* data, ssize_t len);
-  void write_hex(unsigned long hex);
+  /**
+   * Start a packet in the output buffer. Append its payload to |outbuf|,
+   * then call end_packet() with the value returned here.
+   */
+  size_t begin_packet();
+  void end_packet(size_t payload_start);
   void write_packet_bytes(const uint8_t* data, size_t num_bytes);
   void write_packet(const char* data);
   void write_binary_packet(const char* pfx, const uint8_t* data,
                            ssize_t num_bytes);
   void write_hex_bytes_packet(const uint8_t* bytes, size_t len);
+  /**
+   * Reply to a qXfer read with the part of |doc| that req.mem() asks for.
+   */
+  void write_xfer_reply(const std::string& doc);
+  /**
+   * The unconsumed input from gdb.
+   */
+  uint8_t* inbuf_data() { return inbuf.data() + inbuf_start; }
+  size_t inbuf_size() const { return inbuf.size() - inbuf_start; }
+  /**
+   * Drop the first |len| bytes of unconsumed input.
+   */
+  void consume_input(size_t len);
   /**
    * Consume bytes in the input buffer until start-of-packet ('$') or
    * the interrupt character is seen.  Does not block.  Return true if
@@ -560,8 +671,16 @@ private:
    */
   bool process_packet();
   void consume_request();
+  /**
+   * |reason| is added to the stop reply as is, e.g. "watch:1234;".
+   */
   void send_stop_reply_packet(GdbThreadId thread, int sig,
-                              uintptr_t watch_addr = 0);
+                              const char* reason = "",
+                              const std::vector<GdbRegisterValue>&
+                                  expedited_regs =
+                                      std::vector<GdbRegisterValue>());
+  void notify_stop_internal(GdbThreadId thread, int sig, const char* reason,
+                            const std::vector<GdbRegisterValue>& expedited_regs);
 
   // Current request to be processed.
   GdbRequest req;
@@ -576,9 +695,18 @@ private:
   // true when "no-ack mode" enabled, in which we don't have
   // to send ack packets back to gdb.  This is a huge perf win.
   bool no_ack;
+  // Syscall catchpoints from QCatchSyscalls. An empty set catches all
+  // syscalls.
+  bool catch_syscalls;
+  std::set<int> caught_syscalls;
+  uint32_t catch_syscalls_generation_;
   ScopedFd sock_fd;
-  std::vector<uint8_t> inbuf;  /* buffered input from gdb */
-  size_t packetend;            /* index of '#' character */
+  /* buffered input from gdb. Consumed input isn't erased until the rest
+   * has to move to make room, so parsing a stream of packets is linear
+   * in its size; unconsumed input starts at |inbuf_start|. */
+  std::vector<uint8_t> inbuf;
+  size_t inbuf_start;
+  size_t packetend;            /* index of '#' character after inbuf_start */
   std::vector<uint8_t> outbuf; /* buffered output for gdb */
   Features features_;
 };
@@ -14,6 +14,9 @@ namespace rr {
 // Extracted from
 // https://sourceware.org/gdb/current/onlinedocs/gdb/Bytecode-Descriptions.html
 enum Opcode {
+  // Not a gdb opcode. Compiled programs use it for code that can only be
+  // reached by evaluating malformed bytecode.
+  OP_invalid = 0x00,
   OP_float = 0x01,
   OP_add = 0x02,
   OP_sub = 0x03,
@@ -67,11 +70,46 @@ enum Opcode {
   OP_printf = 0x34,
 };
 
+/**
+ * Values loaded from tracee memory during one evaluation. All the variants
+ * of an expression load the same locations, so each is read only once.
+ */
+class MemoryCache {
+public:
+  MemoryCache(Task* t) : t(t) {}
+
+  template <typename T> bool load(uint64_t addr, int64_t* value) {
+    for (auto& e : entries) {
+      if (e.addr == addr && e.size == sizeof(T)) {
+        *value = e.value;
+        return true;
+      }
+    }
+    bool ok = true;
+    T v = t->read_mem(remote_ptr<T>(addr), &ok);
+    if (!ok) {
+      return false;
+    }
+    *value = v;
+    entries.push_back({ addr, sizeof(T), *value });
+    return true;
+  }
+
+private:
+  struct Entry {
+    uint64_t addr;
+    size_t size;
+    int64_t value;
+  };
+  Task* t;
+  vector<Entry> entries;
+};
+
 struct ExpressionState {
   typedef GdbExpression::Value Value;
 
-  ExpressionState(const vector<uint8_t>& bytecode)
-      : bytecode(bytecode), pc(0), error(false), end(false) {}
+  ExpressionState(Task* t, MemoryCache& memory)
+      : t(t), memory(memory), pc(0), error(false), end(false) {}
 
   void set_error() { error = true; }
 
@@ -104,27 +142,14 @@ struct ExpressionState {
   }
   int64_t pop_a() { return pop().i; }
   void push(int64_t i) { stack.push_back(Value(i)); }
-  template <typename T> T fetch() {
-    if (pc + sizeof(T) > bytecode.size()) {
-      set_error();
-      return T(-1);
-    }
-    T v = 0;
-    for (size_t i = 0; i < sizeof(T); ++i) {
-      v = (v << 8) | bytecode[pc + i];
-    }
-    pc += sizeof(T);
-    return v;
-  }
-  template <typename T> void load(Task* t) {
+  template <typename T> void load() {
     uint64_t addr = pop().i;
     if (error) {
       // Don't do unnecessary syscalls if we're already in an error state.
       return;
     }
-    bool ok = true;
-    T v = t->read_mem(remote_ptr<T>(addr), &ok);
-    if (!ok) {
+    int64_t v;
+    if (!memory.load<T>(addr, &v)) {
       set_error();
       return;
     }
@@ -137,11 +162,36 @@ struct ExpressionState {
     }
     push(stack[stack.size() - 1 - offset].i);
   }
+  void push_reg(GdbRegister name) {
+    GdbRegisterValue v;
+    // Only fetch the extra registers, which costs a ptrace call, if the
+    // register isn't a general-purpose one.
+    v.size = t->regs().read_register(&v.value[0], name, &v.defined);
+    if (!v.defined) {
+      v.size = t->extra_regs().read_register(&v.value[0], name, &v.defined);
+    }
+    if (!v.defined) {
+      set_error();
+      return;
+    }
+    switch (v.size) {
+      case 1:
+        return push(v.value1);
+      case 2:
+        return push(v.value2);
+      case 4:
+        return push(v.value4);
+      case 8:
+        return push(v.value8);
+    }
+    set_error();
+  }
 
-  void step(Task* t) {
+  void step(const GdbExpression::Instruction& insn) {
     assert(!error);
     BinaryOperands operands;
-    switch (fetch<uint8_t>()) {
+    ++pc;
+    switch (insn.opcode) {
       case OP_add:
         operands = pop_a_b();
         return push(operands.a + operands.b);
@@ -195,7 +245,7 @@ struct ExpressionState {
         operands = pop_a_b();
         return push(uint64_t(operands.a) < uint64_t(operands.b));
       case OP_ext: {
-        int64_t n = nonzero(fetch<uint8_t>());
+        int64_t n = nonzero(insn.operand);
         if (n >= 64) {
           return;
         }
@@ -205,7 +255,7 @@ struct ExpressionState {
         return push((sign_bit * ~n_mask) | (a & n_mask));
       }
       case OP_zero_ext: {
-        int64_t n = fetch<uint8_t>();
+        int64_t n = insn.operand;
         if (n >= 64) {
           return;
         }
@@ -214,13 +264,13 @@ struct ExpressionState {
         return push(a & n_mask);
       }
       case OP_ref8:
-        return load<uint8_t>(t);
+        return load<uint8_t>();
       case OP_ref16:
-        return load<uint16_t>(t);
+        return load<uint16_t>();
       case OP_ref32:
-        return load<uint32_t>(t);
+        return load<uint32_t>();
       case OP_ref64:
-        return load<uint64_t>(t);
+        return load<uint64_t>();
       case OP_dup:
         return pick(0);
       case OP_swap:
@@ -231,7 +281,7 @@ struct ExpressionState {
         pop_a();
         return;
       case OP_pick:
-        return pick(fetch<uint8_t>());
+        return pick(insn.operand);
       case OP_rot: {
         int64_t c = pop_a();
         int64_t b = pop_a();
@@ -240,44 +290,21 @@ struct ExpressionState {
         push(b);
         return push(a);
       }
-      case OP_if_goto: {
-        uint16_t offset = fetch<uint16_t>();
+      case OP_if_goto:
         if (pop_a()) {
-          pc = offset;
+          pc = insn.operand;
         }
         return;
-      }
       case OP_goto:
-        pc = fetch<uint16_t>();
+        pc = insn.operand;
         return;
       case OP_const8:
-        return push(fetch<uint8_t>());
       case OP_const16:
-        return push(fetch<uint16_t>());
       case OP_const32:
-        return push(fetch<uint32_t>());
       case OP_const64:
-        return push(fetch<uint64_t>());
-      case OP_reg: {
-        GdbRegisterValue v = GdbServer::get_reg(t->regs(), t->extra_regs(),
-                                                GdbRegister(fetch<uint16_t>()));
-        if (!v.defined) {
-          set_error();
-          return;
-        }
-        switch (v.size) {
-          case 1:
-            return push(v.value1);
-          case 2:
-            return push(v.value2);
-          case 4:
-            return push(v.value4);
-          case 8:
-            return push(v.value8);
-        }
-        set_error();
-        return;
-      }
+        return push(insn.operand);
+      case OP_reg:
+        return push_reg(GdbRegister(insn.operand));
       case OP_end:
         end = true;
         return;
@@ -287,7 +314,8 @@ struct ExpressionState {
     }
   }
 
-  const vector<uint8_t>& bytecode;
+  Task* t;
+  MemoryCache& memory;
   vector<Value> stack;
   size_t pc;
   bool error;
@@ -329,6 +357,7 @@ static T fetch(const uint8_t* data, size_t size, size_t pc) {
 }
 
 GdbExpression::GdbExpression(const uint8_t* data, size_t size) {
+  vector<vector<uint8_t> > bytecode_variants;
   vector<bool> instruction_starts;
   instruction_starts.resize(size);
   fill(instruction_starts.begin(), instruction_starts.end(), false);
@@ -416,27 +445,92 @@ GdbExpression::GdbExpression(const uint8_t* data, size_t size) {
       bytecode_variants = move(variants);
     }
   }
+
+  for (auto& b : bytecode_variants) {
+    programs.push_back(compile(b));
+  }
 }
 #else
 GdbExpression::GdbExpression(const uint8_t* data, size_t size) {
-  bytecode_variants.push_back(vector<uint8_t>(data, data + size));
+  programs.push_back(compile(vector<uint8_t>(data, data + size)));
 }
 #endif
 
+static size_t operand_size(uint8_t opcode) {
+  switch (opcode) {
+    case OP_ext:
+    case OP_zero_ext:
+    case OP_pick:
+    case OP_const8:
+      return 1;
+    case OP_if_goto:
+    case OP_goto:
+    case OP_const16:
+    case OP_reg:
+      return 2;
+    case OP_const32:
+      return 4;
+    case OP_const64:
+      return 8;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * Decode |bytecode| into instructions, starting at offset 0. Code that
+ * evaluation could never reach without failing (an unknown opcode, a
+ * truncated operand, running off the end, or jumping somewhere other than
+ * the start of an instruction) becomes an OP_invalid instruction.
+ */
+GdbExpression::Program GdbExpression::compile(const vector<uint8_t>& bytecode) {
+  Program program;
+  // Index of the instruction starting at each bytecode offset, or -1.
+  vector<int64_t> index(bytecode.size(), -1);
+  size_t pc = 0;
+  while (pc < bytecode.size()) {
+    uint8_t opcode = bytecode[pc];
+    size_t len = operand_size(opcode);
+    if (pc + 1 + len > bytecode.size()) {
+      break;
+    }
+    index[pc] = program.size();
+    uint64_t operand = 0;
+    for (size_t i = 0; i < len; ++i) {
+      operand = (operand << 8) | bytecode[pc + 1 + i];
+    }
+    program.push_back({ opcode, int64_t(operand) });
+    pc += 1 + len;
+  }
+  int64_t invalid = program.size();
+  program.push_back({ OP_invalid, 0 });
+
+  for (auto& insn : program) {
+    if (insn.opcode == OP_if_goto || insn.opcode == OP_goto) {
+      size_t target = insn.operand;
+      insn.operand = (target < index.size() && index[target] >= 0)
+                         ? index[target]
+                         : invalid;
+    }
+  }
+  return program;
+}
+
 bool GdbExpression::evaluate(Task* t, Value* result) const {
-  if (bytecode_variants.empty()) {
+  if (programs.empty()) {
     return false;
   }
 
   bool first = true;
+  MemoryCache memory(t);
 
-  for (auto& b : bytecode_variants) {
-    ExpressionState state(b);
+  for (auto& program : programs) {
+    ExpressionState state(t, memory);
     for (int steps = 0; !state.end; ++steps) {
       if (steps >= 10000 || state.error) {
         return false;
       }
-      state.step(t);
+      state.step(program[state.pc]);
     }
     Value v = state.pop();
     if (state.error) {
@@ -16,6 +16,10 @@ class Task;
  * gdb has a simple bytecode language for writing expressions to be evaluated
  * in a remote target. This class implements evaluation of such expressions.
  * See https://sourceware.org/gdb/current/onlinedocs/gdb/Agent-Expressions.html
+ *
+ * Conditional breakpoints in hot loops evaluate the same expression a very
+ * large number of times, so the bytecode is decoded once, at construction,
+ * into a Program whose immediates and jump targets are already resolved.
  */
 class GdbExpression {
 public:
@@ -34,11 +38,23 @@ public:
   bool evaluate(Task* t, Value* result) const;
 
 private:
+  friend struct ExpressionState;
+
+  struct Instruction {
+    uint8_t opcode;
+    // The immediate operand, register number, or, for jumps, the index of
+    // the target instruction.
+    int64_t operand;
+  };
+  typedef std::vector<Instruction> Program;
+
+  static Program compile(const std::vector<uint8_t>& bytecode);
+
   /**
    * To work around gdb bugs, we may generate and evaluate multiple versions of
    * the same expression program.
    */
-  std::vector<std::vector<uint8_t> > bytecode_variants;
+  std::vector<Program> programs;
 };
 
 } // namespace rr
@@ -8,6 +8,7 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
 #include <map>
 #include <string>
@@ -19,8 +20,10 @@
 #include "GdbExpression.h"
 #include "kernel_metadata.h"
 #include "log.h"
+#include "preload/preload_interface.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
+#include "StdioMonitor.h"
 #include "Task.h"
 #include "TaskGroup.h"
 #include "util.h"
@@ -38,7 +41,13 @@ GdbServer::GdbServer(std::unique_ptr<GdbConnection>& dbg, Task* t)
       stop_reason(0),
       stop_replaying_to_target(false),
       interrupt_pending(false),
-      emergency_debug_session(&t->session()) {}
+      emergency_debug_session(&t->session()),
+      want_spare_diversion(false),
+      spare_diversion_breakpoints_generation(0),
+      syscall_catch_points_indexed(false),
+      syscall_catch_next(nullptr),
+      syscall_catch_from(0),
+      syscall_catch_generation(0) {}
 
 // Special-sauce macros defined by rr when launching the gdb client,
 // which implement functionality outside of the gdb remote protocol.
@@ -51,6 +60,23 @@ static const string& gdb_rr_macros() {
     ss << "define restart\n"
        << "  run c$arg0\n"
        << "end\n"
+       // Seek to the point "when" and "when-ticks" would report as
+       // <event> and <ticks>, or to <seconds> into the recording.
+       << "define seek-ticks\n"
+       << "  run $arg0:$arg1\n"
+       << "end\n"
+       << "define seek-time\n"
+       << "  run t$arg0\n"
+       << "end\n"
+       // Seek to the <n>th (default first) marker written to
+       // RR_MAGIC_MARKER_FD with the name <name>.
+       << "define seek-marker\n"
+       << "  if $argc == 1\n"
+       << "    run m1,$arg0\n"
+       << "  else\n"
+       << "    run m$arg1,$arg0\n"
+       << "  end\n"
+       << "end\n"
        // In gdb version "Fedora 7.8.1-30.fc21", a raw "run" command
        // issued before any user-generated resume-execution command
        // results in gdb hanging just after the inferior hits an internal
@@ -146,6 +172,23 @@ GdbRegisterValue GdbServer::get_reg(const Registers& regs,
   return reg;
 }
 
+/**
+ * Like GdbServer::get_reg, but only fetches |t|'s extra registers if |which|
+ * isn't a general-purpose register. Fetching them costs a ptrace call
+ * at each stop.
+ */
+static GdbRegisterValue get_reg(Task* t, GdbRegister which) {
+  GdbRegisterValue reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.name = which;
+  reg.size = t->regs().read_register(&reg.value[0], which, &reg.defined);
+  if (!reg.defined) {
+    reg.size =
+        t->extra_regs().read_register(&reg.value[0], which, &reg.defined);
+  }
+  return reg;
+}
+
 static GdbThreadId get_threadid(const Session& session, const TaskUid& tuid) {
   Task* t = session.find_task(tuid);
   pid_t pid = t ? t->tgid() : GdbThreadId::ANY.pid;
@@ -246,17 +289,19 @@ static unique_ptr<BreakpointCondition> breakpoint_condition(
 static bool search_memory(Task* t, const MemoryRange& where,
                           const vector<uint8_t>& find,
                           remote_ptr<void>* result) {
+  if (find.empty()) {
+    return false;
+  }
+  // Read in large chunks, overlapping by find.size() - 1 bytes so we find
+  // strings that cross chunk boundaries. This approach isn't great for
+  // handling long search strings but gdb's find command isn't really suited
+  // to that.
+  static const size_t chunk_size = 1024 * 1024;
   vector<uint8_t> buf;
-  buf.resize(page_size() + find.size() - 1);
+  buf.resize(chunk_size + find.size() - 1);
   for (const auto& m : t->vm()->maps()) {
     MemoryRange r = MemoryRange(m.map.start(), m.map.end() + find.size() - 1)
                         .intersect(where);
-    // We basically read page by page here, but we read past the end of the
-    // page to handle the case where a found string crosses page boundaries.
-    // This approach isn't great for handling long search strings but gdb's find
-    // command isn't really suited to that.
-    // Reading page by page lets us avoid problems where some pages in a
-    // mapping aren't readable (e.g. reading beyond end of file).
     while (r.size() >= find.size()) {
       ssize_t nread = t->read_bytes_fallible(
           r.start(), std::min(buf.size(), r.size()), buf.data());
@@ -267,13 +312,159 @@ static bool search_memory(Task* t, const MemoryRange& where,
           return true;
         }
       }
-      r = MemoryRange(
-          std::min(r.end(), floor_page_size(r.start()) + page_size()), r.end());
+      // Some pages in a mapping may not be readable (e.g. beyond the end of
+      // a file). A short read stops at the first of them; skip that page
+      // and carry on after it.
+      remote_ptr<void> next;
+      if (nread <= ssize_t(find.size() - 1)) {
+        next = floor_page_size(r.start() + std::max(ssize_t(0), nread)) +
+               page_size();
+      } else {
+        next = r.start() + (nread - (find.size() - 1));
+      }
+      r = MemoryRange(std::min(r.end(), next), r.end());
     }
   }
   return false;
 }
 
+/**
+ * Like Task::read_c_str, but returns false instead of asserting if the
+ * string can't be read.
+ */
+static bool read_c_str_fallible(Task* t, remote_ptr<char> child_addr,
+                                string* str) {
+  remote_ptr<void> p = child_addr;
+  str->clear();
+  while (true) {
+    remote_ptr<void> end_of_page = ceil_page_size(p + 1);
+    ssize_t nbytes = end_of_page - p;
+    char buf[nbytes];
+    bool ok = true;
+    t->read_bytes_helper(p, nbytes, buf, &ok);
+    if (!ok) {
+      return false;
+    }
+    for (int i = 0; i < nbytes; ++i) {
+      if ('\0' == buf[i]) {
+        return true;
+      }
+      *str += buf[i];
+    }
+    p = end_of_page;
+  }
+}
+
+/**
+ * Walk the dynamic linker's link_map list, the way gdb would with a lot of
+ * small memory reads: find the executable's program headers through the
+ * auxv, its dynamic section through those, r_debug through DT_DEBUG and
+ * the list through r_debug.r_map. Returns false if the list can't be
+ * found, e.g. because the executable is static or ld.so hasn't set up
+ * r_debug yet.
+ */
+template <typename Arch>
+static bool read_libraries_svr4_arch(Task* t,
+                                     vector<GdbLibraryInfo>* libraries,
+                                     uintptr_t* main_lm) {
+  typedef typename Arch::unsigned_word Word;
+  typedef typename Arch::ElfPhdr ElfPhdr;
+  typedef typename Arch::ElfDyn ElfDyn;
+
+  const vector<uint8_t>& auxv = t->vm()->saved_auxv();
+  const Word* words = reinterpret_cast<const Word*>(auxv.data());
+  size_t nwords = auxv.size() / sizeof(Word);
+  Word phdr_addr = 0;
+  Word phnum = 0;
+  for (size_t i = 0; i + 1 < nwords && words[i] != AT_NULL; i += 2) {
+    if (words[i] == AT_PHDR) {
+      phdr_addr = words[i + 1];
+    } else if (words[i] == AT_PHNUM) {
+      phnum = words[i + 1];
+    }
+  }
+  if (!phdr_addr || !phnum) {
+    return false;
+  }
+
+  bool ok = true;
+  vector<ElfPhdr> phdrs =
+      t->read_mem(remote_ptr<ElfPhdr>(phdr_addr), phnum, &ok);
+  if (!ok) {
+    return false;
+  }
+  // The executable's load bias is where its program headers actually are,
+  // minus where PT_PHDR says they are.
+  Word bias = 0;
+  for (auto& ph : phdrs) {
+    if (ph.p_type == PT_PHDR) {
+      bias = phdr_addr - ph.p_vaddr;
+    }
+  }
+  remote_ptr<ElfDyn> dyn;
+  for (auto& ph : phdrs) {
+    if (ph.p_type == PT_DYNAMIC) {
+      dyn = remote_ptr<ElfDyn>(bias + ph.p_vaddr);
+    }
+  }
+  if (dyn.is_null()) {
+    return false;
+  }
+
+  Word r_debug = 0;
+  while (true) {
+    ElfDyn d = t->read_mem(dyn, &ok);
+    if (!ok || d.d_tag == DT_NULL) {
+      break;
+    }
+    if (d.d_tag == DT_DEBUG) {
+      r_debug = d.d_un.d_ptr;
+      break;
+    }
+    ++dyn;
+  }
+  if (!r_debug) {
+    return false;
+  }
+
+  // struct r_debug { int r_version; struct link_map* r_map; ... }
+  remote_ptr<Word> r_map_ptr(r_debug + sizeof(Word));
+  Word lm = t->read_mem(r_map_ptr, &ok);
+  if (!ok) {
+    return false;
+  }
+  // struct link_map { l_addr, l_name, l_ld, l_next, l_prev }
+  // Bound the walk in case the list is corrupt.
+  for (int i = 0; lm && i < 10000; ++i) {
+    vector<Word> fields = t->read_mem(remote_ptr<Word>(lm), 4, &ok);
+    if (!ok) {
+      return false;
+    }
+    if (i == 0) {
+      // The first entry is the executable itself.
+      *main_lm = lm;
+    } else {
+      GdbLibraryInfo info;
+      if (!fields[1] ||
+          !read_c_str_fallible(t, remote_ptr<char>(fields[1]), &info.name)) {
+        return false;
+      }
+      info.lm = lm;
+      info.l_addr = fields[0];
+      info.l_ld = fields[2];
+      libraries->push_back(info);
+    }
+    lm = fields[3];
+  }
+  return true;
+}
+
+static bool read_libraries_svr4(Task* t, vector<GdbLibraryInfo>* libraries,
+                                uintptr_t* main_lm) {
+  RR_ARCH_FUNCTION(read_libraries_svr4_arch, t->arch(), t, libraries,
+                   main_lm);
+}
+
 void GdbServer::dispatch_debugger_request(Session& session,
                                           const GdbRequest& req,
                                           ReportState state) {
@@ -301,6 +492,17 @@ void GdbServer::dispatch_debugger_request(Session& session,
       dbg->reply_get_thread_list(tids);
       return;
     }
+    case DREQ_READ_THREADS: {
+      vector<GdbThreadInfo> threads;
+      if (state != REPORT_THREADS_DEAD) {
+        for (auto& kv : session.tasks()) {
+          threads.push_back(
+              { get_threadid(session, kv.second->tuid()), kv.second->name() });
+        }
+      }
+      dbg->reply_read_threads(threads);
+      return;
+    }
     case DREQ_INTERRUPT: {
       Task* t = session.find_task(last_continue_tuid);
       ASSERT(t, session.is_diversion())
@@ -362,12 +564,22 @@ void GdbServer::dispatch_debugger_request(Session& session,
       dbg->reply_get_auxv(target->vm()->saved_auxv());
       return;
     }
+    case DREQ_READ_LIBRARIES_SVR4: {
+      vector<GdbLibraryInfo> libraries;
+      uintptr_t main_lm = 0;
+      if (!read_libraries_svr4(target, &libraries, &main_lm)) {
+        libraries.clear();
+        main_lm = 0;
+      }
+      dbg->reply_read_libraries_svr4(libraries, main_lm);
+      return;
+    }
+    case DREQ_READ_EXEC_FILE:
+      dbg->reply_read_exec_file(target->vm()->exe_image());
+      return;
     case DREQ_GET_MEM: {
-      vector<uint8_t> mem;
-      mem.resize(req.mem().len);
-      ssize_t nread = target->read_bytes_fallible(req.mem().addr, req.mem().len,
-                                                  mem.data());
-      mem.resize(max(ssize_t(0), nread));
+      vector<uint8_t> mem =
+          read_memory_cached(target, req.mem().addr, req.mem().len);
       target->vm()->replace_breakpoints_with_original_values(
           mem.data(), mem.size(), req.mem().addr);
       dbg->reply_get_mem(mem);
@@ -407,8 +619,7 @@ void GdbServer::dispatch_debugger_request(Session& session,
       return;
     }
     case DREQ_GET_REG: {
-      GdbRegisterValue reg =
-          get_reg(target->regs(), target->extra_regs(), req.reg().name);
+      GdbRegisterValue reg = rr::get_reg(target, req.reg().name);
       dbg->reply_get_reg(reg);
       return;
     }
@@ -591,8 +802,37 @@ static Task* is_in_exec(ReplayTimeline& timeline) {
              : nullptr;
 }
 
+/**
+ * The registers gdb needs first at every stop, to find the current frame.
+ * Sending them with the stop saves gdb asking for the whole register file.
+ */
+static vector<GdbRegisterValue> expedited_regs(const Registers& regs) {
+  GdbRegister names[3];
+  if (regs.arch() == x86) {
+    names[0] = DREG_EIP;
+    names[1] = DREG_ESP;
+    names[2] = DREG_EBP;
+  } else {
+    names[0] = DREG_RIP;
+    names[1] = DREG_RSP;
+    names[2] = DREG_RBP;
+  }
+  vector<GdbRegisterValue> result;
+  for (GdbRegister name : names) {
+    GdbRegisterValue reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.name = name;
+    reg.size = regs.read_register(&reg.value[0], name, &reg.defined);
+    if (reg.defined) {
+      result.push_back(reg);
+    }
+  }
+  return result;
+}
+
 void GdbServer::maybe_notify_stop(const GdbRequest& req,
-                                  const BreakStatus& break_status) {
+                                  const BreakStatus& break_status,
+                                  const Registers* regs) {
   int sig = -1;
   remote_ptr<void> watch_addr;
   if (!break_status.watchpoints_hit.empty()) {
@@ -625,12 +865,132 @@ void GdbServer::maybe_notify_stop(const GdbRequest& req,
   if (sig >= 0 && t->task_group()->tguid() == debuggee_tguid) {
     /* Notify the debugger and process any new requests
      * that might have triggered before resuming. */
-    dbg->notify_stop(get_threadid(t), sig, watch_addr.as_int());
+    dbg->notify_stop(get_threadid(t), sig, watch_addr.as_int(),
+                     expedited_regs(regs && t == break_status.task
+                                        ? *regs
+                                        : t->regs()));
     stop_reason = sig;
     last_query_tuid = last_continue_tuid = t->tuid();
   }
 }
 
+static void index_buffered_syscalls(
+    const TraceFrame& frame, const TraceReader::RawDataRef& data,
+    vector<GdbServer::SyscallCatchPoint>& points) {
+  if (data.size < sizeof(struct syscallbuf_hdr)) {
+    return;
+  }
+  auto flush_hdr = reinterpret_cast<const syscallbuf_hdr*>(data.data);
+  auto record_ptr = reinterpret_cast<const uint8_t*>(flush_hdr + 1);
+  auto end_ptr = record_ptr + min<size_t>(flush_hdr->num_rec_bytes,
+                                          data.size - sizeof(*flush_hdr));
+  while (record_ptr + sizeof(struct syscallbuf_record) <= end_ptr) {
+    auto record = reinterpret_cast<const struct syscallbuf_record*>(record_ptr);
+    if (record->size < sizeof(*record)) {
+      return;
+    }
+    GdbServer::SyscallCatchPoint p = { frame.time(), frame.tid(),
+                                         record->syscallno, false };
+    points.push_back(p);
+    record_ptr += stored_record_size(record->size);
+  }
+}
+
+static void index_syscall_catch_points(
+    const string& trace_dir, vector<GdbServer::SyscallCatchPoint>& points) {
+  TraceReader trace(trace_dir);
+  TraceFrame frame;
+  while (!trace.at_end()) {
+    trace.read_frame(frame);
+    const Event& ev = frame.event();
+    // The raw data has to be consumed for every frame to stay in step.
+    TraceReader::RawDataRef data;
+    bool first = true;
+    while (trace.read_raw_data_ref_for_frame(frame, data)) {
+      if (first && ev.type() == EV_SYSCALLBUF_FLUSH) {
+        index_buffered_syscalls(frame, data, points);
+      }
+      first = false;
+    }
+    if (ev.is_syscall_event() && ev.Syscall().state == ENTERING_SYSCALL) {
+      GdbServer::SyscallCatchPoint p = { frame.time(), frame.tid(),
+                                         ev.Syscall().number, true };
+      points.push_back(p);
+    }
+  }
+}
+
+const GdbServer::SyscallCatchPoint* GdbServer::find_syscall_catch_point(
+    bool forward) {
+  if (!syscall_catch_points_indexed) {
+    index_syscall_catch_points(
+        timeline.current_session().trace_reader().dir(), syscall_catch_points);
+    syscall_catch_points_indexed = true;
+    LOG(debug) << "Indexed " << syscall_catch_points.size()
+               << " syscall catch points";
+  }
+  ReplaySession& session = timeline.current_session();
+  TraceFrame::Time now = session.current_trace_frame().time();
+  bool in_event = session.current_step_key().in_execution();
+  auto first_after = lower_bound(
+      syscall_catch_points.begin(), syscall_catch_points.end(), now,
+      [](const SyscallCatchPoint& p, TraceFrame::Time t) {
+        return p.time < t;
+      });
+  if (forward) {
+    if (syscall_catch_from && syscall_catch_from <= now &&
+        syscall_catch_generation == dbg->catch_syscalls_generation() &&
+        (!syscall_catch_next || syscall_catch_next->time >= now)) {
+      return syscall_catch_next;
+    }
+    syscall_catch_from = now;
+    syscall_catch_generation = dbg->catch_syscalls_generation();
+    syscall_catch_next = nullptr;
+    // The stop for a point at |now - 1| is behind us, even if we haven't
+    // started replaying |now| yet.
+    for (auto it = first_after; it != syscall_catch_points.end(); ++it) {
+      if (dbg->catches_syscall(it->syscallno)) {
+        syscall_catch_next = &*it;
+        break;
+      }
+    }
+    return syscall_catch_next;
+  }
+  auto it = first_after;
+  while (it != syscall_catch_points.begin()) {
+    --it;
+    if (it->time + 1 < timeline.reverse_execution_barrier()) {
+      return nullptr;
+    }
+    // The stop for a point at |now - 1| is where we are unless we've
+    // started replaying |now|.
+    if (it->time + 1 == now && !in_event) {
+      continue;
+    }
+    if (dbg->catches_syscall(it->syscallno)) {
+      return &*it;
+    }
+  }
+  return nullptr;
+}
+
+bool GdbServer::maybe_notify_syscall_stop(const SyscallCatchPoint& p) {
+  ReplaySession& session = timeline.current_session();
+  if (session.current_trace_frame().time() != p.time + 1 ||
+      session.current_step_key().in_execution()) {
+    return false;
+  }
+  Task* t = session.find_task(p.tid);
+  if (!t || t->task_group()->tguid() != debuggee_tguid) {
+    return false;
+  }
+  dbg->notify_syscall_stop(get_threadid(t), p.syscallno, p.entry,
+                           expedited_regs(t->regs()));
+  stop_reason = SIGTRAP;
+  last_query_tuid = last_continue_tuid = t->tuid();
+  return true;
+}
+
 static RunCommand compute_run_command_from_actions(Task* t,
                                                    const GdbRequest& req,
                                                    int* signal_to_deliver) {
@@ -691,17 +1051,143 @@ static RunCommand compute_run_command_for_reverse_exec(
  * is, the first request that should be handled by |replay| upon
  * resuming execution in that session.
  */
+DiversionSession::shr_ptr GdbServer::take_spare_diversion(
+    ReplaySession& replay) {
+  DiversionSession::shr_ptr result;
+  swap(result, spare_diversion);
+  if (result &&
+      (!timeline.is_running() || &replay != &timeline.current_session() ||
+       spare_diversion_mark != timeline.mark() ||
+       spare_diversion_breakpoints_generation !=
+           timeline.breakpoints_generation())) {
+    LOG(debug) << "Discarding stale spare diversion " << result.get();
+    result = nullptr;
+  }
+  spare_diversion_mark = ReplayTimeline::Mark();
+  return result;
+}
+
+vector<uint8_t> GdbServer::read_memory_cached(Task* t, remote_ptr<void> addr,
+                                              size_t len) {
+  if (&t->session() != memory_cache_session) {
+    clear_memory_cache();
+    memory_cache_session = &t->session();
+  }
+  auto& pages_cache = memory_cache[t->vm().get()];
+
+  vector<uint8_t> result;
+  remote_ptr<void> end = addr + len;
+  remote_ptr<void> p = addr;
+  while (p < end) {
+    remote_ptr<void> page = floor_page_size(p);
+    auto it = pages_cache.find(page);
+    if (it == pages_cache.end()) {
+      // Read this and all following uncached pages of the request at once.
+      remote_ptr<void> read_end = page;
+      while (read_end < end && !pages_cache.count(read_end)) {
+        read_end += page_size();
+      }
+      vector<uint8_t> buf(read_end - page);
+      ssize_t nread = t->read_bytes_fallible(page, buf.size(), buf.data());
+      size_t pages = max(ssize_t(0), nread) / page_size();
+      for (size_t i = 0; i < pages; ++i) {
+        auto start = buf.begin() + i * page_size();
+        pages_cache[page + i * page_size()] =
+            vector<uint8_t>(start, start + page_size());
+      }
+      if (!pages) {
+        // |page| isn't mapped, so the read stops somewhere in it.
+        vector<uint8_t> rest(end - p);
+        nread = t->read_bytes_fallible(p, rest.size(), rest.data());
+        result.insert(result.end(), rest.begin(),
+                      rest.begin() + max(ssize_t(0), nread));
+        break;
+      }
+      continue;
+    }
+    size_t offset = p - page;
+    size_t n = min<size_t>(end - p, page_size() - offset);
+    result.insert(result.end(), it->second.begin() + offset,
+                  it->second.begin() + offset + n);
+    p += n;
+  }
+  return result;
+}
+
+void GdbServer::clear_memory_cache() {
+  memory_cache.clear();
+  memory_cache_session = nullptr;
+}
+
+/**
+ * Requests that don't change the state of the tracees, so memory cached
+ * while processing them stays valid.
+ */
+static bool preserves_memory_cache(const GdbRequest& req) {
+  switch (req.type) {
+    case DREQ_GET_CURRENT_THREAD:
+    case DREQ_GET_OFFSETS:
+    case DREQ_GET_REGS:
+    case DREQ_GET_STOP_REASON:
+    case DREQ_GET_THREAD_LIST:
+    case DREQ_READ_THREADS:
+    case DREQ_READ_LIBRARIES_SVR4:
+    case DREQ_READ_EXEC_FILE:
+    case DREQ_GET_AUXV:
+    case DREQ_GET_IS_THREAD_ALIVE:
+    case DREQ_GET_THREAD_EXTRA_INFO:
+    case DREQ_SET_CONTINUE_THREAD:
+    case DREQ_SET_QUERY_THREAD:
+    case DREQ_GET_MEM:
+    case DREQ_SEARCH_MEM:
+    case DREQ_GET_REG:
+      return true;
+    default:
+      // Breakpoints are removed from memory read for the debugger after it
+      // comes out of the cache, so changing them doesn't invalidate it.
+      return DREQ_WATCH_FIRST <= req.type && req.type <= DREQ_WATCH_LAST;
+  }
+}
+
+void GdbServer::maybe_create_spare_diversion() {
+  if (!want_spare_diversion || !timeline.is_running() || dbg->sniff_packet()) {
+    return;
+  }
+  if (spare_diversion && spare_diversion_mark == timeline.mark() &&
+      spare_diversion_breakpoints_generation ==
+          timeline.breakpoints_generation()) {
+    return;
+  }
+  // mark() may unapply breakpoints, so get it first. See divert().
+  spare_diversion_mark = timeline.mark();
+  timeline.apply_breakpoints_and_watchpoints();
+  spare_diversion = timeline.current_session().clone_diversion();
+  spare_diversion_breakpoints_generation = timeline.breakpoints_generation();
+  LOG(debug) << "Created spare diversion " << spare_diversion.get();
+}
+
+void GdbServer::maybe_replay_ahead() {
+  if (!timeline.is_running() || !timeline.replay_ahead_enabled()) {
+    return;
+  }
+  timeline.replay_ahead(target.event, [&]() { return dbg->sniff_packet(); });
+}
+
 GdbRequest GdbServer::divert(ReplaySession& replay) {
   GdbRequest req;
   LOG(debug) << "Starting debugging diversion for " << &replay;
 
-  if (timeline.is_running()) {
-    // Ensure breakpoints and watchpoints are applied before we fork the
-    // diversion, to ensure the diversion is consistent with the timeline
-    // breakpoint/watchpoint state.
-    timeline.apply_breakpoints_and_watchpoints();
+  want_spare_diversion = true;
+  DiversionSession::shr_ptr diversion_session = take_spare_diversion(replay);
+  if (!diversion_session) {
+    if (timeline.is_running()) {
+      // Ensure breakpoints and watchpoints are applied before we fork the
+      // diversion, to ensure the diversion is consistent with the timeline
+      // breakpoint/watchpoint state.
+      timeline.apply_breakpoints_and_watchpoints();
+    }
+    diversion_session = replay.clone_diversion();
   }
-  DiversionSession::shr_ptr diversion_session = replay.clone_diversion();
   uint32_t diversion_refcount = 1;
   TaskUid saved_query_tuid = last_query_tuid;
 
@@ -756,10 +1242,18 @@ GdbRequest GdbServer::divert(ReplaySession& replay) {
  * execution, detach, restart, or interrupt.
  */
 GdbRequest GdbServer::process_debugger_requests(ReportState state) {
+  // We get here after the tracees have run.
+  clear_memory_cache();
+  StdioMonitor::flush_replayed_output();
   while (true) {
+    maybe_create_spare_diversion();
+    maybe_replay_ahead();
     GdbRequest req = dbg->get_request();
     req.suppress_debugger_stop = false;
     try_lazy_reverse_singlesteps(req);
+    if (!preserves_memory_cache(req)) {
+      clear_memory_cache();
+    }
 
     if (req.type == DREQ_READ_SIGINFO) {
       // TODO: we send back a dummy siginfo_t to gdb
@@ -775,6 +1269,7 @@ GdbRequest GdbServer::process_debugger_requests(ReportState state) {
       dbg->reply_read_siginfo(si_bytes);
 
       req = divert(timeline.current_session());
+      clear_memory_cache();
       if (req.type == DREQ_NONE) {
         continue;
       }
@@ -811,6 +1306,22 @@ GdbRequest GdbServer::process_debugger_requests(ReportState state) {
   }
 }
 
+/**
+ * Lazy reverse-singlesteps only move between marks with the same event and
+ * tick count, so no syscall or branch executes between the point gdb thinks
+ * we're at and the point we're really at. Memory that isn't writable can't
+ * differ between them, so gdb's reads of code can be served without seeking.
+ */
+static bool is_unchanged_by_lazy_singlesteps(Task* t,
+                                             const GdbRequest::Mem& mem) {
+  if (!t->vm()->has_mapping(mem.addr)) {
+    return false;
+  }
+  const KernelMapping& m = t->vm()->mapping_of(mem.addr).map;
+  return !(m.prot() & PROT_WRITE) && mem.addr + mem.len <= m.end().as_int() &&
+         mem.addr + mem.len >= mem.addr;
+}
+
 void GdbServer::try_lazy_reverse_singlesteps(GdbRequest& req) {
   if (!timeline.is_running()) {
     return;
@@ -840,20 +1351,31 @@ void GdbServer::try_lazy_reverse_singlesteps(GdbRequest& req) {
     break_status.task = t;
     break_status.singlestep_complete = true;
     LOG(debug) << "  using lazy reverse-singlestep";
-    maybe_notify_stop(req, break_status);
+    maybe_notify_stop(req, break_status, &now.regs());
 
     while (true) {
       req = dbg->get_request();
       req.suppress_debugger_stop = false;
-      if (req.type != DREQ_GET_REGS) {
+      if (req.type == DREQ_GET_REGS) {
+        LOG(debug) << "  using lazy reverse-singlestep registers";
+        dispatch_regs_request(now.regs(), now.extra_regs());
+      } else if (req.type == DREQ_GET_REG && matches_threadid(t, req.target)) {
+        LOG(debug) << "  using lazy reverse-singlestep register";
+        dbg->reply_get_reg(
+            get_reg(now.regs(), now.extra_regs(), req.reg().name));
+      } else if (req.type == DREQ_GET_MEM && matches_threadid(t, req.target) &&
+                 is_unchanged_by_lazy_singlesteps(t, req.mem())) {
+        LOG(debug) << "  using lazy reverse-singlestep memory";
+        dispatch_debugger_request(timeline.current_session(), req,
+                                  REPORT_NORMAL);
+      } else {
         break;
       }
-      LOG(debug) << "  using lazy reverse-singlestep registers";
-      dispatch_regs_request(now.regs(), now.extra_regs());
     }
   }
 
   if (need_seek) {
+    clear_memory_cache();
     timeline.seek_to_mark(now);
   }
 }
@@ -932,7 +1454,8 @@ GdbServer::ContinueOrStop GdbServer::debug_one_step(
     Task* t = timeline.current_session().current_task();
     if (t->task_group()->tguid() == debuggee_tguid) {
       interrupt_pending = false;
-      dbg->notify_stop(get_threadid(t), in_debuggee_end_state ? SIGKILL : 0);
+      dbg->notify_stop(get_threadid(t), in_debuggee_end_state ? SIGKILL : 0, 0,
+                       expedited_regs(t->regs()));
       stop_reason = 0;
       return CONTINUE_DEBUGGING;
     }
@@ -949,8 +1472,25 @@ GdbServer::ContinueOrStop GdbServer::debug_one_step(
       int signal_to_deliver;
       RunCommand command = compute_run_command_from_actions(
           timeline.current_session().current_task(), req, &signal_to_deliver);
+      const SyscallCatchPoint* catch_point =
+          command == RUN_CONTINUE && dbg->catching_syscalls()
+              ? find_syscall_catch_point(true)
+              : nullptr;
       // Ignore gdb's |signal_to_deliver|; we just have to follow the replay.
-      result = timeline.replay_step_forward(command, target.event);
+      if (catch_point) {
+        // Replay-ahead would run straight past the catch point.
+        result = timeline.replay_step_forward(command, catch_point->time + 1);
+      } else if (command == RUN_CONTINUE &&
+                 timeline.take_replay_ahead(target.event, &result)) {
+        LOG(debug) << "  continuing from replay-ahead";
+      } else {
+        result = timeline.replay_step_forward(command, target.event);
+      }
+      if (catch_point && result.status != REPLAY_EXITED &&
+          !result.break_status.any_break() && !result.break_status.task_exit &&
+          !is_in_exec(timeline) && maybe_notify_syscall_stop(*catch_point)) {
+        return CONTINUE_DEBUGGING;
+      }
     }
     if (result.status == REPLAY_EXITED) {
       return handle_exited_state(last_resume_request);
@@ -978,9 +1518,36 @@ GdbServer::ContinueOrStop GdbServer::debug_one_step(
 
     auto interrupt_check = [&]() { return dbg->sniff_packet(); };
     switch (command) {
-      case RUN_CONTINUE:
-        result = timeline.reverse_continue(stop_filter, interrupt_check);
+      case RUN_CONTINUE: {
+        const SyscallCatchPoint* catch_point =
+            dbg->catching_syscalls() ? find_syscall_catch_point(false)
+                                     : nullptr;
+        if (!catch_point) {
+          result = timeline.reverse_continue(stop_filter, interrupt_check);
+          break;
+        }
+        if (timeline.has_breakpoints_or_watchpoints()) {
+          // A breakpoint or watchpoint hit after the catch point wins.
+          result = timeline.reverse_continue(stop_filter, interrupt_check);
+          ReplaySession& session = timeline.current_session();
+          TraceFrame::Time now = session.current_trace_frame().time();
+          if (result.status == REPLAY_EXITED || now > catch_point->time + 1 ||
+              (now == catch_point->time + 1 &&
+               session.current_step_key().in_execution())) {
+            break;
+          }
+        }
+        // The catch point is the start of event |time + 1|, so we can go
+        // straight there.
+        timeline.seek_to_ticks(catch_point->time + 1, 0);
+        result = ReplayResult();
+        if (maybe_notify_syscall_stop(*catch_point)) {
+          return CONTINUE_DEBUGGING;
+        }
+        // Not a stop gdb can see (e.g. another process's syscall); gdb's
+        // reverse-continue will carry on from here.
         break;
+      }
       case RUN_SINGLESTEP: {
         Task* t = timeline.current_session().find_task(last_continue_tuid);
         assert(t);
@@ -1130,6 +1697,36 @@ void GdbServer::restart_session(const GdbRequest& req) {
 
   stop_replaying_to_target = false;
 
+  if (req.restart().type == RESTART_FROM_TIME) {
+    TraceFrame::Time time =
+        timeline.current_session().trace_reader().time_at_seconds(
+            req.restart().seconds);
+    if (!time) {
+      cout << "No event at " << req.restart().seconds << "s.\n";
+      dbg->notify_restart_failed();
+      return;
+    }
+    seek_to_ticks(time, 0);
+    return;
+  }
+  if (req.restart().type == RESTART_FROM_MARKER) {
+    TraceFrame::Time time =
+        timeline.current_session().trace_reader().find_marker(
+            req.restart().param_str, req.restart().param);
+    if (!time) {
+      cout << "No marker " << req.restart().param_str << " #"
+           << req.restart().param << ".\n";
+      dbg->notify_restart_failed();
+      return;
+    }
+    seek_to_ticks(time, 0);
+    return;
+  }
+  if (req.restart().type == RESTART_FROM_TICKS) {
+    seek_to_ticks(req.restart().param, req.restart().ticks);
+    return;
+  }
+
   assert(req.restart().type == RESTART_FROM_EVENT);
   // Note that we don't reset the target pid; we intentionally keep targeting
   // the same process no matter what is running when we hit the event.
@@ -1152,15 +1749,28 @@ void GdbServer::restart_session(const GdbRequest& req) {
   activate_debugger();
 }
 
+void GdbServer::seek_to_ticks(TraceFrame::Time time, Ticks ticks) {
+  target.event = min(final_event - 1, time);
+  timeline.seek_to_ticks(target.event, ticks);
+  activate_debugger();
+}
+
 void GdbServer::serve_replay(const ConnectionFlags& flags) {
-  do {
-    ReplayResult result =
-        timeline.replay_step_forward(RUN_CONTINUE, target.event);
-    if (result.status == REPLAY_EXITED) {
+  if (target.seek_ticks) {
+    if (!timeline.seek_to_ticks(target.event, target.ticks)) {
       LOG(info) << "Debugger was not launched before end of trace";
       return;
     }
-  } while (!at_target());
+  } else {
+    do {
+      ReplayResult result =
+          timeline.replay_step_forward(RUN_CONTINUE, target.event);
+      if (result.status == REPLAY_EXITED) {
+        LOG(info) << "Debugger was not launched before end of trace";
+        return;
+      }
+    } while (!at_target());
+  }
 
   unsigned short port = flags.dbg_port > 0 ? flags.dbg_port : getpid();
   // Don't probe if the user specified a port.  Explicitly
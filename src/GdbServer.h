@@ -6,6 +6,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "DiversionSession.h"
 #include "GdbConnection.h"
@@ -24,16 +25,27 @@ class GdbServer {
                                               const std::vector<std::string>&);
   friend std::string invoke_info_checkpoints(GdbServer&, Task*,
                                              const std::vector<std::string>&);
+  friend std::string invoke_set_reverse_step_latency(
+      GdbServer&, Task*, const std::vector<std::string>&);
+  friend std::string invoke_show_reverse_step_latency(
+      GdbServer&, Task*, const std::vector<std::string>&);
+  friend std::string invoke_checkpoint_stats(GdbServer&, Task*,
+                                             const std::vector<std::string>&);
 
 public:
   struct Target {
-    Target() : pid(0), require_exec(false), event(0) {}
+    Target() : pid(0), require_exec(false), event(0), seek_ticks(false),
+               ticks(0) {}
     // Target process to debug, or 0 to just debug the first process
     pid_t pid;
     // If true, wait for the target process to exec() before attaching debugger
     bool require_exec;
     // Wait until at least 'event' has elapsed before attaching
     TraceFrame::Time event;
+    // If true, attach during 'event' instead, once the task replaying it
+    // has executed 'ticks' ticks. 'pid' and 'require_exec' are ignored.
+    bool seek_ticks;
+    Ticks ticks;
   };
 
   struct ConnectionFlags {
@@ -48,6 +60,20 @@ public:
     ConnectionFlags() : dbg_port(-1), debugger_params_write_pipe(nullptr) {}
   };
 
+  /**
+   * A point in the trace where gdb's syscall catchpoints can fire: the
+   * entry to a traced syscall (the EV_SYSCALL frame at |time|), or a
+   * buffered syscall, which we can only report once it has returned, at
+   * the EV_SYSCALLBUF_FLUSH frame at |time|. Either way the stop is at the
+   * start of event |time + 1|.
+   */
+  struct SyscallCatchPoint {
+    TraceFrame::Time time;
+    pid_t tid;
+    int syscallno;
+    bool entry;
+  };
+
   /**
    * Create a gdbserver serving the replay of 'session'.
    */
@@ -60,7 +86,14 @@ public:
         stop_replaying_to_target(false),
         interrupt_pending(false),
         timeline(std::move(session), flags),
-        emergency_debug_session(nullptr) {}
+        emergency_debug_session(nullptr),
+        want_spare_diversion(false),
+        spare_diversion_breakpoints_generation(0),
+        memory_cache_session(nullptr),
+        syscall_catch_points_indexed(false),
+        syscall_catch_next(nullptr),
+        syscall_catch_from(0),
+        syscall_catch_generation(0) {}
 
   /**
    * Actually run the server. Returns only when the debugger disconnects.
@@ -128,6 +161,10 @@ private:
   bool at_target();
   void activate_debugger();
   void restart_session(const GdbRequest& req);
+  /**
+   * Move to ticks |ticks| of event |time| and attach there.
+   */
+  void seek_to_ticks(TraceFrame::Time time, Ticks ticks);
   GdbRequest process_debugger_requests(ReportState state = REPORT_NORMAL);
   enum ContinueOrStop { CONTINUE_DEBUGGING, STOP_DEBUGGING };
   bool detach_or_restart(const GdbRequest& req, ContinueOrStop* s);
@@ -167,13 +204,52 @@ private:
    * resuming execution in that session.
    */
   GdbRequest divert(ReplaySession& replay);
+  /**
+   * Return |spare_diversion| if it was cloned from the current state of
+   * |replay|, or null. Either way, |spare_diversion| is cleared.
+   */
+  DiversionSession::shr_ptr take_spare_diversion(ReplaySession& replay);
+  /**
+   * If the debugger has been starting diversions and has nothing for us to
+   * do right now, clone a diversion session from the current replay state
+   * in advance.
+   */
+  void maybe_create_spare_diversion();
+  /**
+   * If replay-ahead is enabled and the debugger has nothing for us to do
+   * right now, replay forward speculatively until it does.
+   */
+  void maybe_replay_ahead();
+
+  /**
+   * Read up to |len| bytes at |addr| in |t| through |memory_cache|.
+   * Returns the bytes that could be read.
+   */
+  std::vector<uint8_t> read_memory_cached(Task* t, remote_ptr<void> addr,
+                                          size_t len);
+  void clear_memory_cache();
 
   /**
    * If |break_status| indicates a stop that we should report to gdb,
    * report it. |req| is the resume request that generated the stop.
+   * |regs|, if non-null, are the registers of |break_status.task| to report,
+   * when they aren't its current ones.
    */
   void maybe_notify_stop(const GdbRequest& req,
-                         const BreakStatus& break_status);
+                         const BreakStatus& break_status,
+                         const Registers* regs = nullptr);
+  /**
+   * Find the first catch point gdb wants after the current position
+   * (|forward|), or the last one before it. Returns null if there's none.
+   * The catch points are indexed from the trace on first use, so no
+   * replaying is needed to find them.
+   */
+  const SyscallCatchPoint* find_syscall_catch_point(bool forward);
+  /**
+   * If we're at the stop for |p| and its task belongs to the debuggee,
+   * report the syscall stop to gdb and return true.
+   */
+  bool maybe_notify_syscall_stop(const SyscallCatchPoint& p);
 
   /**
    * Return the checkpoint stored as |checkpoint_id| or nullptr if there
@@ -211,6 +287,27 @@ private:
   ReplayTimeline timeline;
   Session* emergency_debug_session;
 
+  // A diversion session cloned ahead of time, while the debugger was idle,
+  // so the next diversion can start without waiting for a clone. This
+  // matters for debugger frontends that evaluate expressions with function
+  // calls at every stop. It's only usable while the timeline is still at
+  // |spare_diversion_mark| with the same breakpoints and watchpoints.
+  DiversionSession::shr_ptr spare_diversion;
+  ReplayTimeline::Mark spare_diversion_mark;
+  // True once the debugger has started a diversion, so that we only keep
+  // spare diversions for debuggers that use them.
+  bool want_spare_diversion;
+  uint64_t spare_diversion_breakpoints_generation;
+
+  // Whole pages of tracee memory read for the debugger since the tracees last
+  // ran, per address space. gdb reads large objects in many small adjacent
+  // pieces, and frontends re-read the same stack pages for every thread's
+  // backtrace; this lets us read each page from the tracee only once per
+  // stop. Only valid for |memory_cache_session|.
+  std::map<AddressSpace*, std::map<remote_ptr<void>, std::vector<uint8_t> > >
+      memory_cache;
+  Session* memory_cache_session;
+
   struct Checkpoint {
     enum Explicit { EXPLICIT, NOT_EXPLICIT };
     Checkpoint(ReplayTimeline& timeline, TaskUid last_continue_tuid, Explicit e,
@@ -232,6 +329,19 @@ private:
   // a no-op debugger "run" command.
   Checkpoint debugger_restart_checkpoint;
 
+  // Every syscall catch point in the trace, in trace order. Built on first
+  // use by find_syscall_catch_point().
+  std::vector<SyscallCatchPoint> syscall_catch_points;
+  bool syscall_catch_points_indexed;
+  // The last forward lookup: nothing gdb catches lies between
+  // |syscall_catch_from| and |syscall_catch_next| (null for the end of the
+  // trace), while gdb's catchpoints are at |syscall_catch_generation|.
+  // Continuing forward looks the next point up after every event, so this
+  // saves rescanning the points in between each time.
+  const SyscallCatchPoint* syscall_catch_next;
+  TraceFrame::Time syscall_catch_from;
+  uint32_t syscall_catch_generation;
+
   // gdb checkpoints, indexed by ID
   std::map<int, Checkpoint> checkpoints;
 };
@@ -3,7 +3,7 @@
 #ifndef RR_HASTASKSET_H_
 #define RR_HASTASKSET_H_
 
-#include <set>
+#include <unordered_set>
 
 namespace rr {
 
@@ -14,7 +14,7 @@ class Task;
  */
 class HasTaskSet {
 public:
-  typedef std::set<Task*> TaskSet;
+  typedef std::unordered_set<Task*> TaskSet;
 
   const TaskSet& task_set() const { return tasks; }
 
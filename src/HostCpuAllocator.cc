@@ -0,0 +1,186 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "HostCpuAllocator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include "log.h"
+
+using namespace std;
+
+namespace rr {
+
+/*static*/ HostCpuAllocator& HostCpuAllocator::get() {
+  const char* dir = getenv("RR_CPU_LOCK_DIR");
+  static HostCpuAllocator allocator(dir && *dir ? dir : "/tmp/rr-cpus");
+  return allocator;
+}
+
+HostCpuAllocator::HostCpuAllocator(const string& dir)
+    : dir(dir), dir_ok(false), dir_checked(false) {}
+
+string HostCpuAllocator::lock_path(int cpu) const {
+  stringstream ss;
+  ss << dir << "/cpu" << cpu;
+  return ss.str();
+}
+
+/**
+ * The directory is shared by all users, so anyone may have created it, and
+ * anyone may have created the files in it. It must be a real directory, and
+ * if someone else owns it, it must be sticky so that at least the other
+ * users can't swap our lock files for something else. Its owner still can,
+ * so lock files are checked again before we write to them.
+ */
+static bool dir_is_usable(const string& dir) {
+  struct stat st;
+  if (lstat(dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+    return false;
+  }
+  return st.st_uid == geteuid() || st.st_uid == 0 ||
+         (st.st_mode & S_ISVTX);
+}
+
+/**
+ * Write our pid into the lock file we've just locked, if it's ours to
+ * write: a regular file we own with no other links. A lock file someone
+ * else created keeps its contents; it's only used for flock.
+ */
+static void write_owner(const string& path, int fd, bool created) {
+  struct stat st;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1 ||
+      st.st_uid != geteuid()) {
+    return;
+  }
+  ScopedFd wfd;
+  if (!created) {
+    // We opened it read-only. Reopen it for writing, making sure it's still
+    // the same file.
+    wfd = ScopedFd(path.c_str(),
+                   O_WRONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    struct stat wst;
+    if (!wfd.is_open() || fstat(wfd, &wst) < 0 || wst.st_dev != st.st_dev ||
+        wst.st_ino != st.st_ino) {
+      return;
+    }
+    fd = wfd.get();
+  }
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "%d\n", getpid());
+  if (ftruncate(fd, 0) < 0 || pwrite(fd, buf, len, 0) != len) {
+    LOG(debug) << "Can't write owner to " << path;
+  }
+}
+
+bool HostCpuAllocator::try_claim(int cpu) {
+  if (claimed.count(cpu)) {
+    return true;
+  }
+  if (!dir_checked) {
+    dir_checked = true;
+    // Every user's rr processes share the directory, like /tmp itself.
+    if (mkdir(dir.c_str(), 01777) == 0) {
+      chmod(dir.c_str(), 01777);
+    } else if (errno != EEXIST) {
+      LOG(debug) << "Can't create " << dir << "; not coordinating CPUs";
+      return false;
+    }
+    if (!dir_is_usable(dir)) {
+      LOG(warn) << dir << " isn't a sticky directory; not coordinating CPUs";
+      return false;
+    }
+    dir_ok = true;
+  }
+  if (!dir_ok) {
+    return false;
+  }
+
+  // Never follow symlinks or write to files we didn't create here: another
+  // user could have planted a link to one of our files.
+  string path = lock_path(cpu);
+  ScopedFd fd(path.c_str(),
+              O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+  bool created = fd.is_open();
+  if (created) {
+    // Let other users' rr processes open it too, whatever our umask.
+    fchmod(fd, 0644);
+  } else {
+    // flock works on read-only fds. O_NONBLOCK so a planted FIFO can't
+    // hang us.
+    fd = ScopedFd(path.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    struct stat st;
+    if (!fd.is_open() || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+      LOG(debug) << "Can't use " << path << " as a lock file";
+      return false;
+    }
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    return false;
+  }
+  write_owner(path, fd, created);
+  claimed.insert(make_pair(cpu, std::move(fd)));
+  return true;
+}
+
+int HostCpuAllocator::claim_first_free(const vector<int>& cpus) {
+  for (int cpu : cpus) {
+    if (try_claim(cpu)) {
+      return cpu;
+    }
+  }
+  return -1;
+}
+
+vector<int> HostCpuAllocator::claim_all_free(const vector<int>& cpus) {
+  vector<int> result;
+  for (int cpu : cpus) {
+    if (try_claim(cpu)) {
+      result.push_back(cpu);
+    }
+  }
+  return result;
+}
+
+void HostCpuAllocator::release_all_except(int keep) {
+  for (auto it = claimed.begin(); it != claimed.end();) {
+    if (it->first == keep) {
+      ++it;
+    } else {
+      it = claimed.erase(it);
+    }
+  }
+}
+
+void HostCpuAllocator::report_contention(int cpu, const vector<int>& cpus) {
+  if (!dir_ok) {
+    return;
+  }
+  string owner;
+  ScopedFd fd(lock_path(cpu).c_str(),
+              O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+  struct stat st;
+  if (fd.is_open() && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    char buf[32];
+    ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+    if (len > 0) {
+      buf[len] = 0;
+      owner = buf;
+      if (!owner.empty() && owner.back() == '\n') {
+        owner.pop_back();
+      }
+    }
+  }
+  LOG(warn) << "All " << cpus.size()
+            << " candidate CPUs are in use by other rr processes; sharing CPU "
+            << cpu << (owner.empty() ? string() : " with process " + owner);
+}
+
+} // namespace rr
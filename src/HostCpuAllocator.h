@@ -0,0 +1,74 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_HOST_CPU_ALLOCATOR_H_
+#define RR_HOST_CPU_ALLOCATOR_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ScopedFd.h"
+
+namespace rr {
+
+/**
+ * Hands out CPUs to concurrent rr processes on this host, so that recordings
+ * and replays that each bind to one CPU spread over the cores instead of
+ * piling onto the same ones.
+ *
+ * Each CPU has a lock file, cpu<N>, in a directory shared by all rr
+ * processes: $RR_CPU_LOCK_DIR if set, otherwise /tmp/rr-cpus. A process
+ * owns a CPU while it holds an flock on its file; the kernel drops the lock
+ * when the process goes away, however it goes away. When the file is ours
+ * to write, the owner's pid is written into it so contention can be
+ * reported usefully.
+ *
+ * Any user can create the directory and the files in it, so symlinks are
+ * never followed and only files we created are written to. If the
+ * directory can't be used, every claim fails and rr binds as if no other
+ * rr process were running.
+ */
+class HostCpuAllocator {
+public:
+  /**
+   * The allocator for this process.
+   */
+  static HostCpuAllocator& get();
+
+  /**
+   * Claim the first CPU in |cpus| that no other rr process owns and return
+   * it, or return -1 if they're all owned.
+   */
+  int claim_first_free(const std::vector<int>& cpus);
+  /**
+   * Claim every CPU in |cpus| that no other rr process owns and return
+   * them.
+   */
+  std::vector<int> claim_all_free(const std::vector<int>& cpus);
+  /**
+   * Give up the claims on all CPUs except |keep|.
+   */
+  void release_all_except(int keep);
+
+  /**
+   * Warn that we're binding to |cpu| although other rr processes own it
+   * (or all of |cpus|).
+   */
+  void report_contention(int cpu, const std::vector<int>& cpus);
+
+private:
+  HostCpuAllocator(const std::string& dir);
+
+  bool try_claim(int cpu);
+  std::string lock_path(int cpu) const;
+
+  std::string dir;
+  // Open lock files of the CPUs we own.
+  std::map<int, ScopedFd> claimed;
+  bool dir_ok;
+  bool dir_checked;
+};
+
+} // namespace rr
+
+#endif /* RR_HOST_CPU_ALLOCATOR_H_ */
@@ -0,0 +1,152 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "HostProbeCache.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include "log.h"
+#include "TraceStream.h"
+#include "util.h"
+
+using namespace std;
+
+namespace rr {
+
+static string read_first_line(const char* path) {
+  string line;
+  FILE* f = fopen(path, "r");
+  if (f) {
+    char buf[256];
+    if (fgets(buf, sizeof(buf), f)) {
+      line = buf;
+      if (!line.empty() && line.back() == '\n') {
+        line.pop_back();
+      }
+    }
+    fclose(f);
+  }
+  return line;
+}
+
+/**
+ * Everything the probe results could depend on, as one line.
+ */
+static string compute_host_key() {
+  stringstream ss;
+  struct utsname uts;
+  if (uname(&uts) == 0) {
+    ss << "kernel " << uts.release << " " << uts.version;
+  }
+  unsigned int eax, ecx, edx;
+  cpuid(CPUID_GETFEATURES, 0, &eax, &ecx, &edx);
+  ss << " cpu " << HEX(eax) << " microcode "
+     << read_first_line("/sys/devices/system/cpu/cpu0/microcode/version");
+  struct stat st;
+  if (stat("/proc/self/exe", &st) == 0) {
+    ss << " rr " << st.st_dev << ":" << st.st_ino << ":" << st.st_size << ":"
+       << st.st_mtime;
+  }
+  string key = ss.str();
+  // Keep the key on one line whatever uname returned.
+  for (auto& c : key) {
+    if (c == '\n') {
+      c = ' ';
+    }
+  }
+  return key;
+}
+
+/*static*/ HostProbeCache& HostProbeCache::get() {
+  static HostProbeCache cache(TraceStream::save_dir() + "/host-probes");
+  return cache;
+}
+
+HostProbeCache::HostProbeCache(const string& path)
+    : path(path), loaded(false) {}
+
+void HostProbeCache::load() {
+  if (loaded) {
+    return;
+  }
+  loaded = true;
+  host_key = compute_host_key();
+
+  FILE* f = fopen(path.c_str(), "r");
+  if (!f) {
+    return;
+  }
+  char* line = nullptr;
+  size_t line_size = 0;
+  ssize_t len;
+  bool same_host = false;
+  bool first = true;
+  while ((len = getline(&line, &line_size, f)) > 0) {
+    if (line[len - 1] == '\n') {
+      line[len - 1] = 0;
+    }
+    if (first) {
+      first = false;
+      same_host = host_key == line;
+      if (!same_host) {
+        LOG(debug) << "Host changed since " << path << " was written";
+        break;
+      }
+      continue;
+    }
+    char name[128];
+    int64_t value;
+    if (sscanf(line, "%127s %" SCNd64, name, &value) == 2) {
+      values[name] = value;
+    }
+  }
+  free(line);
+  fclose(f);
+}
+
+bool HostProbeCache::lookup(const string& name, int64_t* value) {
+  load();
+  auto it = values.find(name);
+  if (it == values.end()) {
+    return false;
+  }
+  LOG(debug) << "Using cached " << name << "=" << it->second;
+  *value = it->second;
+  return true;
+}
+
+void HostProbeCache::store(const string& name, int64_t value) {
+  load();
+  values[name] = value;
+  save();
+}
+
+void HostProbeCache::save() {
+  // Write a new file and rename it over the old one, so concurrent rr
+  // processes never see a partial file.
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".tmp%d", getpid());
+  string tmp_path = path + suffix;
+  FILE* f = fopen(tmp_path.c_str(), "w");
+  if (!f) {
+    LOG(debug) << "Can't write " << tmp_path;
+    return;
+  }
+  fprintf(f, "%s\n", host_key.c_str());
+  for (auto& v : values) {
+    fprintf(f, "%s %" PRId64 "\n", v.first.c_str(), v.second);
+  }
+  if (fclose(f) || rename(tmp_path.c_str(), path.c_str())) {
+    LOG(debug) << "Can't update " << path;
+    unlink(tmp_path.c_str());
+  }
+}
+
+} // namespace rr
@@ -0,0 +1,55 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_HOST_PROBE_CACHE_H_
+#define RR_HOST_PROBE_CACHE_H_
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+
+namespace rr {
+
+/**
+ * Remembers the results of probing the host that are too slow to repeat
+ * every time rr starts, such as the PMU self-tests. Test suites that run
+ * rr once per test case would otherwise pay for them every time.
+ *
+ * Results are kept in <save-dir>/host-probes. The first line identifies
+ * the host: kernel release and version, CPU signature and microcode
+ * version, and the rr binary. If any of those differ, the whole file is
+ * ignored and rewritten. Every other line is
+ *   <name> <value>
+ * Deleting the file forces the probes to run again.
+ */
+class HostProbeCache {
+public:
+  /**
+   * The cache for this host.
+   */
+  static HostProbeCache& get();
+
+  /**
+   * If a result for |name| is cached, store it in |value| and return true.
+   */
+  bool lookup(const std::string& name, int64_t* value);
+  /**
+   * Cache |value| as the result for |name|.
+   */
+  void store(const std::string& name, int64_t value);
+
+private:
+  HostProbeCache(const std::string& path);
+
+  void load();
+  void save();
+
+  std::string path;
+  std::string host_key;
+  std::map<std::string, int64_t> values;
+  bool loaded;
+};
+
+} // namespace rr
+
+#endif /* RR_HOST_PROBE_CACHE_H_ */
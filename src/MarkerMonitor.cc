@@ -0,0 +1,40 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "MarkerMonitor.h"
+
+#include <algorithm>
+#include <string>
+
+#include "Session.h"
+#include "Task.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+namespace rr {
+
+// Longer names are truncated.
+static const size_t MAX_MARKER_NAME_LENGTH = 4096;
+
+void MarkerMonitor::did_write(Task* t, const std::vector<Range>& ranges) {
+  if (!t->session().is_recording()) {
+    return;
+  }
+  // A marker is a single write, even if it's a writev of several pieces.
+  string name;
+  for (auto& r : ranges) {
+    size_t len = min(r.length, MAX_MARKER_NAME_LENGTH - name.size());
+    vector<uint8_t> bytes(len);
+    if (t->read_bytes_fallible(r.data, len, bytes.data()) != (ssize_t)len) {
+      return;
+    }
+    name.append(bytes.begin(), bytes.end());
+  }
+  // Allow a trailing newline, e.g. from `echo name >&998`.
+  if (!name.empty() && name.back() == '\n') {
+    name.pop_back();
+  }
+  t->trace_writer().write_marker(name, t->rec_tid);
+}
+
+} // namespace rr
@@ -0,0 +1,26 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_MARKER_MONITOR_H_
+#define RR_MARKER_MONITOR_H_
+
+#include "FileMonitor.h"
+
+namespace rr {
+
+/**
+ * A FileMonitor to track writes to RR_MAGIC_MARKER_FD.
+ */
+class MarkerMonitor : public FileMonitor {
+public:
+  MarkerMonitor() {}
+
+  /**
+   * During recording, add the written name to the trace's marker index.
+   * Nothing needs to be done during replay.
+   */
+  virtual void did_write(Task* t, const std::vector<Range>& ranges);
+};
+
+} // namespace rr
+
+#endif /* RR_MARKER_MONITOR_H_ */
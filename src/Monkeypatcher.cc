@@ -8,6 +8,7 @@
 #include "kernel_abi.h"
 #include "kernel_metadata.h"
 #include "log.h"
+#include "RecordSession.h"
 #include "RecordTask.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
@@ -105,20 +106,39 @@ template <typename Arch> static void setup_preload_library_path(RecordTask* t) {
 void Monkeypatcher::init_dynamic_syscall_patching(
     RecordTask* t, int syscall_patch_hook_count,
     remote_ptr<struct syscall_patch_hook> syscall_patch_hooks,
+    int rdtsc_patch_hook_count,
+    remote_ptr<struct syscall_patch_hook> rdtsc_patch_hooks,
     remote_ptr<void> stub_buffer, remote_ptr<void> stub_buffer_end,
     remote_ptr<void> syscall_hook_trampoline) {
   if (syscall_patch_hook_count) {
     syscall_hooks = t->read_mem(syscall_patch_hooks, syscall_patch_hook_count);
   }
+  if (rdtsc_patch_hook_count) {
+    rdtsc_hooks = t->read_mem(rdtsc_patch_hooks, rdtsc_patch_hook_count);
+  }
   this->stub_buffer = stub_buffer;
   this->stub_buffer_end = stub_buffer_end;
   this->syscall_hook_trampoline = syscall_hook_trampoline;
   ASSERT(t, syscall_hook_trampoline < stub_buffer_end);
+
+  if (t->session().patch_site_cache().enabled() ||
+      t->session().eager_syscall_patching()) {
+    // Collect the mappings first, since patching can add mappings.
+    vector<KernelMapping> maps;
+    for (auto m : t->vm()->maps()) {
+      maps.push_back(m.map);
+    }
+    for (auto& m : maps) {
+      ScopedFd fd;
+      patch_mapped_file(t, m, fd);
+    }
+  }
 }
 
 template <typename Arch>
 static bool patch_syscall_with_hook_arch(Monkeypatcher& patcher, RecordTask* t,
-                                         const syscall_patch_hook& hook);
+                                         const syscall_patch_hook& hook,
+                                         remote_ptr<uint8_t> patch_start);
 
 remote_ptr<uint8_t> Monkeypatcher::allocate_stub(RecordTask* t, size_t bytes) {
   if (!stub_buffer) {
@@ -281,13 +301,15 @@ static remote_ptr<uint8_t> allocate_extended_jump(
  * too for consistency.
  *
  * trampoline_call_end is the offset within the StubPatch where the call to
- * the trampoline ends.
+ * the trampoline ends. patch_start is the address of the instruction being
+ * replaced.
  */
 template <typename JumpPatch, typename ExtendedJumpPatch, typename StubPatch,
           uint32_t trampoline_call_end>
 static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher,
                                            RecordTask* t,
-                                           const syscall_patch_hook& hook) {
+                                           const syscall_patch_hook& hook,
+                                           remote_ptr<uint8_t> patch_start) {
   uint8_t stub_patch[StubPatch::size];
   auto stub_patch_start = patcher.allocate_stub(t, sizeof(stub_patch));
   if (!stub_patch_start) {
@@ -300,7 +322,7 @@ static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher,
   uint8_t jump_patch[JumpPatch::size];
   // We're patching in a relative jump, so we need to compute the offset from
   // the end of the jump to our actual destination.
-  auto jump_patch_start = t->regs().ip().to_data_ptr<uint8_t>();
+  auto jump_patch_start = patch_start;
   auto jump_patch_end = jump_patch_start + sizeof(jump_patch);
 
   remote_ptr<uint8_t> extended_jump_start =
@@ -343,26 +365,30 @@ static bool patch_syscall_with_hook_x86ish(Monkeypatcher& patcher,
 template <>
 bool patch_syscall_with_hook_arch<X86Arch>(Monkeypatcher& patcher,
                                            RecordTask* t,
-                                           const syscall_patch_hook& hook) {
+                                           const syscall_patch_hook& hook,
+                                           remote_ptr<uint8_t> patch_start) {
   return patch_syscall_with_hook_x86ish<X86SysenterVsyscallSyscallHook,
                                         X86SyscallStubExtendedJump,
-                                        X86SyscallStubMonkeypatch, 30>(patcher,
-                                                                       t, hook);
+                                        X86SyscallStubMonkeypatch, 30>(
+      patcher, t, hook, patch_start);
 }
 
 template <>
 bool patch_syscall_with_hook_arch<X64Arch>(Monkeypatcher& patcher,
                                            RecordTask* t,
-                                           const syscall_patch_hook& hook) {
+                                           const syscall_patch_hook& hook,
+                                           remote_ptr<uint8_t> patch_start) {
   return patch_syscall_with_hook_x86ish<X64JumpMonkeypatch,
                                         X64SyscallStubExtendedJump,
-                                        X64SyscallStubMonkeypatch, 43>(patcher,
-                                                                       t, hook);
+                                        X64SyscallStubMonkeypatch, 43>(
+      patcher, t, hook, patch_start);
 }
 
 static bool patch_syscall_with_hook(Monkeypatcher& patcher, RecordTask* t,
-                                    const syscall_patch_hook& hook) {
-  RR_ARCH_FUNCTION(patch_syscall_with_hook_arch, t->arch(), patcher, t, hook);
+                                    const syscall_patch_hook& hook,
+                                    remote_ptr<uint8_t> patch_start) {
+  RR_ARCH_FUNCTION(patch_syscall_with_hook_arch, t->arch(), patcher, t, hook,
+                   patch_start);
 }
 
 bool Monkeypatcher::try_patch_syscall(RecordTask* t) {
@@ -403,7 +429,10 @@ bool Monkeypatcher::try_patch_syscall(RecordTask* t) {
       // Get out of executing the current syscall before we patch it.
       t->exit_syscall_and_prepare_restart();
 
-      patch_syscall_with_hook(*this, t, hook);
+      if (patch_syscall_with_hook(*this, t, hook,
+                                  t->regs().ip().to_data_ptr<uint8_t>())) {
+        remember_patched_syscall(t, r.ip());
+      }
 
       LOG(debug) << "Patched syscall at " << r.ip() << " syscall "
                  << syscall_name(syscallno, t->arch()) << " tid " << t->tid
@@ -418,6 +447,53 @@ bool Monkeypatcher::try_patch_syscall(RecordTask* t) {
   return false;
 }
 
+bool Monkeypatcher::try_patch_rdtsc(RecordTask* t) {
+  Registers r = t->regs();
+  if (rdtsc_hooks.empty() || tried_to_patch_rdtsc_addresses.count(r.ip())) {
+    return false;
+  }
+  remote_ptr<void> p = r.ip().to_data_ptr<void>();
+  if (t->vm()->syscallbuf_lib_start() <= p &&
+      p < t->vm()->syscallbuf_lib_end()) {
+    // This is the rdtsc hook's own fallback rdtsc.
+    return false;
+  }
+
+  if (trapped_rdtsc_addresses.insert(r.ip()).second) {
+    // Each patch uses up a stub, so only patch sites that trap repeatedly.
+    return false;
+  }
+  tried_to_patch_rdtsc_addresses.insert(r.ip());
+
+  // rdtsc is the same length as a syscall instruction, so the syscall
+  // patching code works unchanged.
+  static const uint8_t rdtsc_insn[] = { 0x0f, 0x31 };
+  ASSERT(t,
+         sizeof(rdtsc_insn) == (size_t)syscall_instruction_length(t->arch()));
+  syscall_patch_hook dummy;
+  auto next_instruction =
+      t->read_mem(r.ip().to_data_ptr<uint8_t>() + sizeof(rdtsc_insn),
+                  sizeof(dummy.next_instruction_bytes));
+  for (auto& hook : rdtsc_hooks) {
+    if (memcmp(next_instruction.data(), hook.next_instruction_bytes,
+               hook.next_instruction_length) == 0) {
+      // The patch is recorded as data for the EV_SEGV_RDTSC frame, so it
+      // mustn't be mixed up with a pending flush's data.
+      t->maybe_flush_syscallbuf();
+      if (!patch_syscall_with_hook(*this, t, hook,
+                                   r.ip().to_data_ptr<uint8_t>())) {
+        return false;
+      }
+      LOG(debug) << "Patched rdtsc at " << r.ip() << " tid " << t->tid
+                 << " bytes " << next_instruction;
+      return true;
+    }
+  }
+  LOG(debug) << "Failed to patch rdtsc at " << r.ip() << " tid " << t->tid
+             << " bytes " << next_instruction;
+  return false;
+}
+
 class SymbolTable {
 public:
   bool is_name(size_t i, const char* name) const {
@@ -457,6 +533,12 @@ public:
   SymbolTable read_symbols_arch(const char* symtab, const char* strtab);
   SymbolTable read_symbols(SupportedArch arch, const char* symtab,
                            const char* strtab);
+  template <typename Arch> string read_build_id_arch();
+  /**
+   * Returns the GNU build-id as a hex string, or the empty string if
+   * there isn't one.
+   */
+  string read_build_id(SupportedArch arch);
 };
 
 template <typename Arch>
@@ -562,19 +644,85 @@ SymbolTable ElfReader::read_symbols(SupportedArch arch, const char* symtab,
   RR_ARCH_FUNCTION(read_symbols_arch, arch, symtab, strtab);
 }
 
-class VdsoReader : public ElfReader {
+template <typename Arch> string ElfReader::read_build_id_arch() {
+  typename Arch::ElfEhdr elfheader;
+  if (!read(0, elfheader) || memcmp(&elfheader, ELFMAG, SELFMAG) != 0 ||
+      elfheader.e_ident[EI_CLASS] != Arch::elfclass ||
+      elfheader.e_shentsize != sizeof(typename Arch::ElfShdr)) {
+    LOG(debug) << "Invalid ELF file: invalid header";
+    return string();
+  }
+
+  auto sections =
+      read<typename Arch::ElfShdr>(elfheader.e_shoff, elfheader.e_shnum);
+  for (auto& s : sections) {
+    if (s.sh_type != SHT_NOTE) {
+      continue;
+    }
+    auto notes = read<uint8_t>(s.sh_offset, s.sh_size);
+    // Each note is a header followed by its name and descriptor, both
+    // padded to 4 bytes. The header is the same for 32- and 64-bit ELF.
+    size_t pos = 0;
+    while (pos + sizeof(Elf32_Nhdr) <= notes.size()) {
+      Elf32_Nhdr note;
+      memcpy(&note, notes.data() + pos, sizeof(note));
+      size_t name_pos = pos + sizeof(note);
+      size_t desc_pos = name_pos + ((note.n_namesz + 3) & ~3);
+      size_t next = desc_pos + ((note.n_descsz + 3) & ~3);
+      if (next > notes.size()) {
+        break;
+      }
+      if (note.n_type == NT_GNU_BUILD_ID && note.n_namesz == 4 &&
+          memcmp(notes.data() + name_pos, "GNU", 4) == 0) {
+        string result;
+        for (size_t i = 0; i < note.n_descsz; ++i) {
+          char buf[3];
+          sprintf(buf, "%02x", notes[desc_pos + i]);
+          result += buf;
+        }
+        return result;
+      }
+      pos = next;
+    }
+  }
+  return string();
+}
+
+string ElfReader::read_build_id(SupportedArch arch) {
+  RR_ARCH_FUNCTION(read_build_id_arch, arch);
+}
+
+class BufferReader : public ElfReader {
 public:
-  VdsoReader(RecordTask* t) : t(t) {}
+  BufferReader(const vector<uint8_t>& data) : data(data) {}
   virtual bool read(size_t offset, size_t size, void* buf) {
-    bool ok = true;
-    t->read_bytes_helper(t->vm()->vdso().start() + offset, size, buf, &ok);
-    return ok;
+    if (offset > data.size() || size > data.size() - offset) {
+      return false;
+    }
+    memcpy(buf, data.data() + offset, size);
+    return true;
   }
-  RecordTask* t;
+  const vector<uint8_t>& data;
 };
 
-static SymbolTable read_vdso_symbols(RecordTask* t) {
-  return VdsoReader(t).read_symbols(t->arch(), ".dynsym", ".dynstr");
+/**
+ * Every exec gets the same vdso image from the kernel, so remember the
+ * symbols of the last image we parsed for each architecture. Reading the
+ * whole image in one go and comparing it is much cheaper than parsing it
+ * with a tracee memory read for each part.
+ */
+static const SymbolTable& read_vdso_symbols(RecordTask* t) {
+  static map<SupportedArch, pair<vector<uint8_t>, SymbolTable> > cache;
+  auto vdso = t->vm()->vdso();
+  vector<uint8_t> image =
+      t->read_mem(vdso.start().cast<uint8_t>(), vdso.size());
+  auto& cached = cache[t->arch()];
+  if (cached.first != image) {
+    cached.second = BufferReader(image).read_symbols(t->arch(), ".dynsym",
+                                                     ".dynstr");
+    cached.first = move(image);
+  }
+  return cached.second;
 }
 
 /**
@@ -658,7 +806,7 @@ template <>
 void patch_after_exec_arch<X86Arch>(RecordTask* t, Monkeypatcher& patcher) {
   setup_preload_library_path<X86Arch>(t);
 
-  auto syms = read_vdso_symbols(t);
+  auto& syms = read_vdso_symbols(t);
   patcher.x86_sysenter_vsyscall = locate_and_verify_kernel_vsyscall(t, syms);
   if (!patcher.x86_sysenter_vsyscall) {
     FATAL() << "Failed to monkeypatch vdso: your __kernel_vsyscall() wasn't "
@@ -748,6 +896,7 @@ void patch_at_preload_init_arch<X86Arch>(RecordTask* t,
 
   patcher.init_dynamic_syscall_patching(
       t, params.syscall_patch_hook_count, params.syscall_patch_hooks,
+      params.rdtsc_patch_hook_count, params.rdtsc_patch_hooks,
       params.syscall_hook_stub_buffer, params.syscall_hook_stub_buffer_end,
       params.syscall_hook_trampoline);
 }
@@ -762,7 +911,7 @@ template <> void patch_after_exec_arch<X64Arch>(RecordTask* t, Monkeypatcher&) {
 
   auto vdso_start = t->vm()->vdso().start();
 
-  auto syms = read_vdso_symbols(t);
+  auto& syms = read_vdso_symbols(t);
 
   static const named_syscall syscalls_to_monkeypatch[] = {
 #define S(n)                                                                   \
@@ -819,6 +968,7 @@ void patch_at_preload_init_arch<X64Arch>(RecordTask* t,
 
   patcher.init_dynamic_syscall_patching(
       t, params.syscall_patch_hook_count, params.syscall_patch_hooks,
+      params.rdtsc_patch_hook_count, params.rdtsc_patch_hooks,
       params.syscall_hook_stub_buffer, params.syscall_hook_stub_buffer_end,
       params.syscall_hook_trampoline);
 }
@@ -870,6 +1020,183 @@ static void set_and_record_bytes(RecordTask* t, uint64_t file_offset,
   }
 }
 
+/**
+ * Make sure |fd| is open on the file mapped by |map|, opening it by name
+ * if necessary. Returns false if the file at that name isn't the one that's
+ * mapped. Stores the file's size in |size| if it's not null.
+ */
+static bool open_mapped_file(const KernelMapping& map, ScopedFd& fd,
+                             uint64_t* size = nullptr) {
+  if (!fd.is_open()) {
+    fd = ScopedFd(map.fsname().c_str(), O_RDONLY);
+  }
+  struct stat st;
+  if (!fd.is_open() || fstat(fd, &st) < 0 || st.st_dev != map.device() ||
+      st.st_ino != map.inode()) {
+    return false;
+  }
+  if (size) {
+    *size = st.st_size;
+  }
+  return true;
+}
+
+string Monkeypatcher::build_id_of(RecordTask* t, const KernelMapping& map,
+                                  ScopedFd& fd) {
+  PatchSiteCache& cache = t->session().patch_site_cache();
+  const string* cached = cache.find_build_id(map.device(), map.inode());
+  if (cached) {
+    return *cached;
+  }
+  if (!open_mapped_file(map, fd)) {
+    return string();
+  }
+  string build_id = FileReader(fd).read_build_id(t->arch());
+  cache.set_build_id(map.device(), map.inode(), build_id);
+  return build_id;
+}
+
+void Monkeypatcher::remember_patched_syscall(RecordTask* t,
+                                             remote_code_ptr ip) {
+  PatchSiteCache& cache = t->session().patch_site_cache();
+  if (!cache.enabled()) {
+    return;
+  }
+  KernelMapping map = t->vm()->mapping_of(ip.to_data_ptr<void>()).map;
+  if (!map.is_real_device() || map.inode() == KernelMapping::NO_INODE) {
+    return;
+  }
+  ScopedFd fd;
+  string build_id = build_id_of(t, map, fd);
+  if (!build_id.empty()) {
+    cache.add_site(build_id, ip.register_value() - map.start().as_int() +
+                                 map.file_offset_bytes());
+  }
+}
+
+void Monkeypatcher::patch_cached_syscalls(RecordTask* t,
+                                          const KernelMapping& map,
+                                          ScopedFd& fd) {
+  string build_id = build_id_of(t, map, fd);
+  if (build_id.empty()) {
+    return;
+  }
+
+  const set<uint64_t>& sites = t->session().patch_site_cache().sites(build_id);
+  uint64_t map_offset = map.file_offset_bytes();
+  size_t syscall_length = syscall_instruction_length(t->arch());
+  syscall_patch_hook dummy;
+  int patched = 0;
+  for (auto it = sites.lower_bound(map_offset + syscall_length);
+       it != sites.end() && *it < map_offset + map.size(); ++it) {
+    remote_code_ptr ip = (map.start() + (*it - map_offset)).as_int();
+    if (tried_to_patch_syscall_addresses.count(ip)) {
+      continue;
+    }
+    bool ok = true;
+    auto next_instruction = t->read_mem(ip.to_data_ptr<uint8_t>(),
+                                        sizeof(dummy.next_instruction_bytes),
+                                        &ok);
+    if (!ok || !is_at_syscall_instruction(
+                   t, ip.decrement_by_syscall_insn_length(t->arch()))) {
+      continue;
+    }
+    for (auto& hook : syscall_hooks) {
+      if (memcmp(next_instruction.data(), hook.next_instruction_bytes,
+                 hook.next_instruction_length) == 0) {
+        tried_to_patch_syscall_addresses.insert(ip);
+        if (patch_syscall_with_hook(
+                *this, t, hook,
+                ip.decrement_by_syscall_insn_length(t->arch())
+                    .to_data_ptr<uint8_t>())) {
+          ++patched;
+        }
+        break;
+      }
+    }
+  }
+  if (patched) {
+    LOG(debug) << "Patched " << patched << " cached syscall sites in "
+               << map.fsname();
+  }
+}
+
+/**
+ * Returns true if |fsname| is one of the system libraries whose syscall
+ * wrappers account for almost all the syscalls programs make.
+ */
+static bool is_eagerly_patched_library(const string& fsname) {
+  string name = fsname.substr(fsname.rfind('/') + 1);
+  static const char* const prefixes[] = { "libc.so", "libc-", "libpthread",
+                                          "ld-linux", "ld-2." };
+  for (auto prefix : prefixes) {
+    if (name.find(prefix) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Monkeypatcher::patch_all_syscalls(RecordTask* t, const KernelMapping& map,
+                                       ScopedFd& fd) {
+  uint64_t file_size;
+  if (!open_mapped_file(map, fd, &file_size) ||
+      file_size <= map.file_offset_bytes()) {
+    return;
+  }
+  // Read the code from the file rather than the tracee. It's what was just
+  // mapped, and it's much cheaper to read.
+  size_t size = min<uint64_t>(map.size(), file_size - map.file_offset_bytes());
+  FileReader file_reader(fd);
+  ElfReader& reader = file_reader;
+  auto code = reader.read<uint8_t>(map.file_offset_bytes(), size);
+  if (code.empty()) {
+    return;
+  }
+
+  vector<uint8_t> syscall = syscall_instruction(t->arch());
+  int patched = 0;
+  for (size_t i = 0; i + syscall.size() <= code.size(); ++i) {
+    if (memcmp(&code[i], syscall.data(), syscall.size()) != 0) {
+      continue;
+    }
+    size_t next = i + syscall.size();
+    for (auto& hook : syscall_hooks) {
+      if (next + hook.next_instruction_length > code.size() ||
+          memcmp(&code[next], hook.next_instruction_bytes,
+                 hook.next_instruction_length) != 0) {
+        continue;
+      }
+      remote_code_ptr ip = (map.start() + next).as_int();
+      if (tried_to_patch_syscall_addresses.insert(ip).second &&
+          patch_syscall_with_hook(*this, t, hook,
+                                  map.start().cast<uint8_t>() + i)) {
+        ++patched;
+      }
+      // Skip over the bytes we just matched.
+      i = next + hook.next_instruction_length - 1;
+      break;
+    }
+  }
+  LOG(debug) << "Eagerly patched " << patched << " syscall sites in "
+             << map.fsname();
+}
+
+void Monkeypatcher::patch_mapped_file(RecordTask* t, const KernelMapping& map,
+                                      ScopedFd& fd) {
+  if (syscall_hooks.empty() || !(map.prot() & PROT_EXEC) ||
+      !map.is_real_device() || map.inode() == KernelMapping::NO_INODE) {
+    return;
+  }
+  if (t->session().eager_syscall_patching() &&
+      is_eagerly_patched_library(map.fsname())) {
+    patch_all_syscalls(t, map, fd);
+  }
+  if (t->session().patch_site_cache().enabled()) {
+    patch_cached_syscalls(t, map, fd);
+  }
+}
+
 void Monkeypatcher::patch_after_mmap(RecordTask* t, remote_ptr<void> start,
                                      size_t size, size_t offset_pages,
                                      int child_fd) {
@@ -900,6 +1227,15 @@ void Monkeypatcher::patch_after_mmap(RecordTask* t, remote_ptr<void> start,
       }
     }
   }
+
+  // Copy the mapping, since patching can add mappings.
+  KernelMapping km = t->vm()->mapping_of(start).map;
+  if ((t->session().patch_site_cache().enabled() ||
+       t->session().eager_syscall_patching()) &&
+      (km.prot() & PROT_EXEC)) {
+    ScopedFd open_fd = t->open_fd(child_fd, O_RDONLY);
+    patch_mapped_file(t, km, open_fd);
+  }
 }
 
 } // namespace rr
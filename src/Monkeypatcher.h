@@ -3,6 +3,7 @@
 #ifndef RR_MONKEYPATCHER_H_
 #define RR_MONKEYPATCHER_H_
 
+#include <string>
 #include <unordered_set>
 #include <vector>
 
@@ -13,6 +14,7 @@
 
 namespace rr {
 
+class KernelMapping;
 class RecordTask;
 class ScopedFd;
 class Task;
@@ -32,6 +34,15 @@ class Task;
  * 3) Patch syscall instructions whose following instructions match a known
  * pattern to call the syscall hook.
  *
+ * 4) Patch rdtsc instructions the same way, to call the rdtsc hook, which
+ * records the TSC value in the syscallbuf without trapping.
+ *
+ * 5) If the session has a PatchSiteCache, patch syscall sites that were
+ * patched in earlier recordings as soon as their file is mapped.
+ *
+ * 6) Optionally, scan libc and friends for patchable syscall sites as soon
+ * as they're mapped, and patch them all.
+ *
  * Monkeypatcher only runs during recording, never replay.
  */
 class Monkeypatcher {
@@ -63,9 +74,20 @@ public:
    */
   bool try_patch_syscall(RecordTask* t);
 
+  /**
+   * Try to patch the rdtsc instruction that |t| just trapped on. We only
+   * patch an rdtsc the second time it traps. If this returns true, patching
+   * succeeded and execution should resume at the unchanged ip() to run the
+   * patched code instead of the rdtsc. The syscallbuf is flushed first, and
+   * the patch is recorded to the trace and must be replayed.
+   */
+  bool try_patch_rdtsc(RecordTask* t);
+
   void init_dynamic_syscall_patching(
       RecordTask* t, int syscall_patch_hook_count,
       remote_ptr<syscall_patch_hook> syscall_patch_hooks,
+      int rdtsc_patch_hook_count,
+      remote_ptr<syscall_patch_hook> rdtsc_patch_hooks,
       remote_ptr<void> stub_buffer, remote_ptr<void> stub_buffer_end,
       remote_ptr<void> syscall_hook_trampoline);
 
@@ -77,7 +99,7 @@ public:
 
   /**
    * Apply any necessary patching immediately after an mmap. We use this to
-   * patch libpthread.so.
+   * patch libpthread.so, and to patch cached syscall sites.
    */
   void patch_after_mmap(RecordTask* t, remote_ptr<void> start, size_t size,
                         size_t offset_pages, int child_fd);
@@ -103,6 +125,34 @@ public:
   }
 
 private:
+  /**
+   * Return the build-id of the file mapped by |map|, using |fd| to read it
+   * if necessary. If |fd| isn't open, the file is opened by name.
+   */
+  std::string build_id_of(RecordTask* t, const KernelMapping& map,
+                          ScopedFd& fd);
+  /**
+   * Add the syscall we just patched, ending at |ip|, to the PatchSiteCache.
+   */
+  void remember_patched_syscall(RecordTask* t, remote_code_ptr ip);
+  /**
+   * Patch the sites the PatchSiteCache knows about in |map|.
+   */
+  void patch_cached_syscalls(RecordTask* t, const KernelMapping& map,
+                             ScopedFd& fd);
+  /**
+   * Patch every syscall instruction in |map| that's followed by bytes that
+   * match a hook.
+   */
+  void patch_all_syscalls(RecordTask* t, const KernelMapping& map,
+                          ScopedFd& fd);
+  /**
+   * Do whichever of the above the session asks for, if |map| is an
+   * executable file mapping.
+   */
+  void patch_mapped_file(RecordTask* t, const KernelMapping& map,
+                         ScopedFd& fd);
+
   /**
    * The list of supported syscall patches obtained from the preload
    * library. Each one matches a specific byte signature for the instruction(s)
@@ -114,6 +164,16 @@ private:
    * (or are currently trying) to patch.
    */
   std::unordered_set<remote_code_ptr> tried_to_patch_syscall_addresses;
+  /**
+   * Like syscall_hooks, but for the instruction(s) after an rdtsc.
+   */
+  std::vector<syscall_patch_hook> rdtsc_hooks;
+  /**
+   * The addresses of the rdtsc instructions that have trapped at least once,
+   * and of those we've tried to patch.
+   */
+  std::unordered_set<remote_code_ptr> trapped_rdtsc_addresses;
+  std::unordered_set<remote_code_ptr> tried_to_patch_rdtsc_addresses;
   /**
    * Writable executable memory where we can generate stubs.
    */
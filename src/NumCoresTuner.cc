@@ -0,0 +1,96 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "NumCoresTuner.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+
+#include "log.h"
+#include "ScopedFd.h"
+
+using namespace std;
+
+namespace rr {
+
+NumCoresTuner::NumCoresTuner(const string& history_path, const string& exe)
+    : history_path(history_path), exe(exe) {
+  char buf[PATH_MAX];
+  if (realpath(exe.c_str(), buf)) {
+    this->exe = buf;
+  }
+}
+
+int NumCoresTuner::choose() const {
+  struct Times {
+    Times() : recordings(0), seconds(0) {}
+    int recordings;
+    double seconds;
+  };
+  map<int, Times> times;
+  FILE* f = fopen(history_path.c_str(), "r");
+  if (f) {
+    char* line = nullptr;
+    size_t line_size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_size, f)) > 0) {
+      if (line[len - 1] == '\n') {
+        line[len - 1] = 0;
+      }
+      int cores;
+      double seconds;
+      int exe_offset;
+      if (sscanf(line, "%d %lf %n", &cores, &seconds, &exe_offset) == 2 &&
+          cores > 0 && exe == line + exe_offset) {
+        ++times[cores].recordings;
+        times[cores].seconds += seconds;
+      }
+    }
+    free(line);
+    fclose(f);
+  }
+
+  int real_cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  for (int cores = 1; cores <= max(1, real_cores); cores *= 2) {
+    if (!times.count(cores)) {
+      LOG(debug) << "Trying " << cores << " cores for " << exe;
+      return cores;
+    }
+  }
+  int best = 1;
+  double best_seconds = 0;
+  for (auto& t : times) {
+    double mean = t.second.seconds / t.second.recordings;
+    if (best_seconds == 0 || mean < best_seconds) {
+      best = t.first;
+      best_seconds = mean;
+    }
+  }
+  LOG(debug) << "Using " << best << " cores for " << exe << " (mean "
+             << best_seconds << "s)";
+  return best;
+}
+
+void NumCoresTuner::add_recording(int cores, double seconds) const {
+  // Append rather than rewrite, so concurrent recordings sharing the file
+  // only ever add lines.
+  ScopedFd fd(history_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+  if (!fd.is_open()) {
+    LOG(warn) << "Can't write core count history " << history_path;
+    return;
+  }
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%d %.3f ", cores, seconds);
+  string line = buf + exe + "\n";
+  if (write(fd, line.c_str(), line.size()) != (ssize_t)line.size()) {
+    LOG(warn) << "Can't write core count history " << history_path;
+  }
+}
+
+} // namespace rr
@@ -0,0 +1,46 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_NUM_CORES_TUNER_H_
+#define RR_NUM_CORES_TUNER_H_
+
+#include <string>
+
+namespace rr {
+
+/**
+ * Chooses, per executable, how many cores to tell a recorded program it
+ * has. Programs commonly size thread pools by the core count; rr runs one
+ * tracee thread at a time, so a big pool mostly adds context switches,
+ * while a pool that's too small can serialize work that would otherwise
+ * overlap with blocking syscalls. Which is faster depends on the program.
+ *
+ * Programs ask once, at startup, so the choice can't be tuned during a
+ * recording. Instead each recording's wall time is appended to a history
+ * file, one line per recording:
+ *   <cores> <seconds> <executable path>
+ * Powers of two up to the real core count are each tried once, then the one
+ * with the lowest mean recording time is used. Adding lines by hand pins a
+ * program to a core count.
+ */
+class NumCoresTuner {
+public:
+  NumCoresTuner(const std::string& history_path, const std::string& exe);
+
+  /**
+   * Return the core count to use for the next recording.
+   */
+  int choose() const;
+
+  /**
+   * Add a recording of |seconds| with |cores| cores to the history.
+   */
+  void add_recording(int cores, double seconds) const;
+
+private:
+  std::string history_path;
+  std::string exe;
+};
+
+} // namespace rr
+
+#endif /* RR_NUM_CORES_TUNER_H_ */
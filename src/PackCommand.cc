@@ -0,0 +1,311 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include "BlockCodec.h"
+#include "Command.h"
+#include "main.h"
+#include "ScopedFd.h"
+#include "TraceStream.h"
+#include "util.h"
+
+using namespace std;
+
+namespace rr {
+
+class PackCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  PackCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static PackCommand singleton;
+};
+
+PackCommand PackCommand::singleton(
+    "pack",
+    " rr pack [OPTION]... [<trace_dir>]\n"
+    "  Make a trace self-contained and smaller. Files the trace maps from\n"
+    "  outside the trace directory are copied into it, identical files are\n"
+    "  stored once, and all trace data is recompressed.\n"
+    "  -j, --threads=<NUM>        number of compression threads; defaults\n"
+    "                             to the number of online CPUs\n"
+    "  -z, --compression=<CODEC>[:<LEVEL>]\n"
+    "                             codec to recompress with: zlib, zstd, lz4\n"
+    "                             or none. Defaults to zstd:19 when rr was\n"
+    "                             built with zstd, otherwise zlib:9\n");
+
+struct PackFlags {
+  CompressionOptions compression;
+  int threads;
+
+  PackFlags() : threads((int)sysconf(_SC_NPROCESSORS_ONLN)) {
+    if (BlockCodec::get(BlockCodec::ZSTD)) {
+      compression.codec = BlockCodec::ZSTD;
+      compression.level = 19;
+    } else {
+      compression.codec = BlockCodec::ZLIB;
+      compression.level = 9;
+    }
+  }
+};
+
+static bool parse_pack_arg(std::vector<std::string>& args, PackFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'j', "threads", HAS_PARAMETER },
+                                        { 'z', "compression", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'j':
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.threads = opt.int_value;
+      break;
+    case 'z':
+      if (!opt.verify_valid_compression(&flags.compression)) {
+        return false;
+      }
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+static string dir_name(const string& path) {
+  size_t slash = path.rfind('/');
+  return slash == string::npos ? string(".") : path.substr(0, slash);
+}
+
+static string base_name(const string& path) {
+  size_t slash = path.rfind('/');
+  return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+/**
+ * Read until |buf| is full or we hit end of file.
+ */
+static ssize_t read_block(int fd, char* buf, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t ret = read(fd, buf + done, size - done);
+    if (ret < 0) {
+      return ret;
+    }
+    if (ret == 0) {
+      break;
+    }
+    done += ret;
+  }
+  return done;
+}
+
+static bool same_contents(const string& path1, const string& path2) {
+  ScopedFd fd1(path1.c_str(), O_RDONLY);
+  ScopedFd fd2(path2.c_str(), O_RDONLY);
+  if (!fd1.is_open() || !fd2.is_open()) {
+    return false;
+  }
+  char buf1[65536];
+  char buf2[sizeof(buf1)];
+  while (true) {
+    ssize_t len1 = read_block(fd1, buf1, sizeof(buf1));
+    ssize_t len2 = read_block(fd2, buf2, sizeof(buf2));
+    if (len1 != len2 || len1 < 0) {
+      return false;
+    }
+    if (len1 == 0) {
+      return true;
+    }
+    if (memcmp(buf1, buf2, len1)) {
+      return false;
+    }
+  }
+}
+
+/**
+ * Copy |from| to the new file |to|, keeping the mode and timestamps.
+ */
+static bool copy_file(const string& from, const string& to,
+                      const struct stat& st) {
+  ScopedFd in(from.c_str(), O_RDONLY);
+  ScopedFd out(to.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (!in.is_open() || !out.is_open()) {
+    return false;
+  }
+  char buf[65536];
+  while (true) {
+    ssize_t len = read_block(in, buf, sizeof(buf));
+    if (len < 0) {
+      unlink(to.c_str());
+      return false;
+    }
+    if (len == 0) {
+      break;
+    }
+    if (write(out, buf, len) != len) {
+      unlink(to.c_str());
+      return false;
+    }
+  }
+  struct timespec times[2] = { st.st_atim, st.st_mtim };
+  fchmod(out, st.st_mode & 07777);
+  futimens(out, times);
+  return true;
+}
+
+struct PackedFile {
+  // Name relative to the trace directory
+  string name;
+  string path;
+  dev_t device;
+  ino_t inode;
+  off_t size;
+};
+
+static int pack(const string& trace_dir, const PackFlags& flags, FILE* out) {
+  string dir;
+  uint64_t bytes_before;
+  {
+    // Make sure this is a trace we can read before touching it.
+    TraceReader trace(trace_dir);
+    dir = trace.dir();
+    bytes_before = trace.compressed_bytes();
+  }
+  string real_dir = real_path(dir);
+
+  TracePacker packer(dir);
+  vector<PackedFile> packed;
+  map<string, string> renamed;
+  vector<string> copies;
+  vector<string> redundant;
+  int copied_count = 0;
+  int deduplicated_count = 0;
+  // Visit files already in the trace directory first so identical files
+  // outside it can share them instead of being copied.
+  set<string> changed;
+  vector<string> files = packer.backing_files(&changed);
+  auto outside = stable_partition(files.begin(), files.end(),
+                                  [&real_dir](const string& file) {
+    return real_path(dir_name(file)) == real_dir;
+  });
+  for (auto it = files.begin(); it != files.end(); ++it) {
+    const string& file = *it;
+    bool in_trace = it < outside;
+    struct stat st;
+    if (stat(file.c_str(), &st)) {
+      fprintf(stderr, "Can't pack %s: %s\n", file.c_str(), strerror(errno));
+      continue;
+    }
+
+    if (changed.count(file)) {
+      // Keep referring to it by its absolute name, so replay still warns
+      // that it changed.
+      fprintf(stderr, "Not packing %s: it changed since it was recorded\n",
+              file.c_str());
+      continue;
+    }
+
+    const PackedFile* same = nullptr;
+    for (auto& p : packed) {
+      if ((p.device == st.st_dev && p.inode == st.st_ino) ||
+          (p.size == st.st_size && same_contents(p.path, file))) {
+        same = &p;
+        break;
+      }
+    }
+    if (same) {
+      renamed[file] = same->name;
+      ++deduplicated_count;
+      if (in_trace &&
+          (same->device != st.st_dev || same->inode != st.st_ino)) {
+        redundant.push_back(file);
+      }
+      continue;
+    }
+
+    PackedFile p;
+    p.device = st.st_dev;
+    p.inode = st.st_ino;
+    p.size = st.st_size;
+    if (in_trace) {
+      p.name = base_name(file);
+      p.path = file;
+    } else {
+      for (int i = 0;; ++i) {
+        char prefix[64];
+        sprintf(prefix, "mmap_pack_%d_", i);
+        p.name = prefix + base_name(file);
+        p.path = dir + "/" + p.name;
+        if (access(p.path.c_str(), F_OK)) {
+          break;
+        }
+      }
+      if (!copy_file(file, p.path, st)) {
+        fprintf(stderr, "Can't copy %s into the trace: %s\n", file.c_str(),
+                strerror(errno));
+        continue;
+      }
+      copies.push_back(p.path);
+      ++copied_count;
+    }
+    renamed[file] = p.name;
+    packed.push_back(p);
+  }
+
+  if (!packer.pack(flags.compression, flags.threads, renamed)) {
+    fprintf(stderr, "Failed to rewrite trace %s\n", dir.c_str());
+    for (auto& c : copies) {
+      unlink(c.c_str());
+    }
+    return 1;
+  }
+  for (auto& r : redundant) {
+    unlink(r.c_str());
+  }
+
+  uint64_t bytes_after = TraceReader(dir).compressed_bytes();
+  fprintf(out, "Packed %s with %s: trace data %" PRIu64 " -> %" PRIu64
+               " bytes\n",
+          dir.c_str(), BlockCodec::get(flags.compression.codec)->name(),
+          bytes_before, bytes_after);
+  fprintf(out, "%d mapped files copied into the trace, %d deduplicated\n",
+          copied_count, deduplicated_count);
+  return 0;
+}
+
+int PackCommand::run(std::vector<std::string>& args) {
+  PackFlags flags;
+
+  while (parse_pack_arg(args, flags)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return pack(trace_dir, flags, stdout);
+}
+
+} // namespace rr
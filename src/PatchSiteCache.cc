@@ -0,0 +1,79 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "PatchSiteCache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "ScopedFd.h"
+
+using namespace std;
+
+namespace rr {
+
+void PatchSiteCache::set_dir(const string& dir) {
+  if (mkdir(dir.c_str(), S_IRWXU | S_IRWXG) < 0 && errno != EEXIST) {
+    FATAL() << "Can't create patch cache directory " << dir;
+  }
+  this->dir = dir;
+}
+
+const string* PatchSiteCache::find_build_id(dev_t dev, ino_t ino) const {
+  auto it = build_ids.find(make_pair(dev, ino));
+  return it == build_ids.end() ? nullptr : &it->second;
+}
+
+void PatchSiteCache::set_build_id(dev_t dev, ino_t ino,
+                                  const string& build_id) {
+  build_ids[make_pair(dev, ino)] = build_id;
+}
+
+string PatchSiteCache::path_for(const string& build_id) const {
+  return dir + "/" + build_id;
+}
+
+const set<uint64_t>& PatchSiteCache::sites(const string& build_id) {
+  auto it = sites_by_build_id.find(build_id);
+  if (it != sites_by_build_id.end()) {
+    return it->second;
+  }
+  set<uint64_t>& result = sites_by_build_id[build_id];
+  FILE* f = fopen(path_for(build_id).c_str(), "r");
+  if (!f) {
+    return result;
+  }
+  uint64_t offset;
+  while (fscanf(f, "%" SCNx64 "\n", &offset) == 1) {
+    result.insert(offset);
+  }
+  fclose(f);
+  LOG(debug) << "Loaded " << result.size() << " patch sites for " << build_id;
+  return result;
+}
+
+void PatchSiteCache::add_site(const string& build_id, uint64_t file_offset) {
+  sites(build_id);
+  if (!sites_by_build_id[build_id].insert(file_offset).second) {
+    return;
+  }
+  // Append rather than rewrite, so concurrent recordings sharing the
+  // directory only ever add lines. Duplicates are harmless.
+  ScopedFd fd(path_for(build_id).c_str(), O_WRONLY | O_APPEND | O_CREAT,
+              0600);
+  if (!fd.is_open()) {
+    LOG(warn) << "Can't write patch cache file " << path_for(build_id);
+    return;
+  }
+  char line[32];
+  int len = snprintf(line, sizeof(line), "%" PRIx64 "\n", file_offset);
+  if (write(fd, line, len) != len) {
+    LOG(warn) << "Can't write patch cache file " << path_for(build_id);
+  }
+}
+
+} // namespace rr
@@ -0,0 +1,64 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_PATCH_SITE_CACHE_H_
+#define RR_PATCH_SITE_CACHE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+namespace rr {
+
+/**
+ * Remembers, across recordings, which syscall sites Monkeypatcher has
+ * patched in each ELF file. Sites are keyed by the file's build-id and
+ * stored as file offsets of the instruction following the syscall, one
+ * file per build-id in the cache directory. When a file is mapped again,
+ * Monkeypatcher patches its known sites immediately instead of waiting for
+ * each of them to be hit by a traced syscall first.
+ *
+ * The cache is only a hint. Monkeypatcher checks the instruction bytes at
+ * each cached site before patching it.
+ */
+class PatchSiteCache {
+public:
+  /**
+   * Enable the cache, storing it in |dir|, which is created if necessary.
+   */
+  void set_dir(const std::string& dir);
+  bool enabled() const { return !dir.empty(); }
+
+  /**
+   * Return the build-id previously set for the file with device |dev| and
+   * inode |ino|, or null if there is none. An empty build-id means the file
+   * doesn't have one.
+   */
+  const std::string* find_build_id(dev_t dev, ino_t ino) const;
+  void set_build_id(dev_t dev, ino_t ino, const std::string& build_id);
+
+  /**
+   * Return the known sites for |build_id|, loading them on first use.
+   */
+  const std::set<uint64_t>& sites(const std::string& build_id);
+
+  /**
+   * Remember that the site at |file_offset| in the file with |build_id|
+   * has been patched.
+   */
+  void add_site(const std::string& build_id, uint64_t file_offset);
+
+private:
+  std::string path_for(const std::string& build_id) const;
+
+  std::string dir;
+  std::map<std::pair<dev_t, ino_t>, std::string> build_ids;
+  std::map<std::string, std::set<uint64_t> > sites_by_build_id;
+};
+
+} // namespace rr
+
+#endif /* RR_PATCH_SITE_CACHE_H_ */
@@ -6,10 +6,13 @@
 #include <err.h>
 #include <fcntl.h>
 #include <linux/perf_event.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/poll.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
@@ -17,6 +20,7 @@
 #include <string>
 
 #include "Flags.h"
+#include "HostProbeCache.h"
 #include "kernel_metadata.h"
 #include "log.h"
 #include "util.h"
@@ -30,6 +34,13 @@ static struct perf_event_attr ticks_attr;
 static struct perf_event_attr page_faults_attr;
 static struct perf_event_attr hw_interrupts_attr;
 static struct perf_event_attr instructions_retired_attr;
+static Ticks pmu_skid_size;
+static bool has_ioc_period_bug;
+static double pmu_probe_seconds;
+// Number of counter fds currently held open by all PerfCounters, and how
+// many we're willing to keep open between timeslices.
+static size_t open_counter_fds;
+static size_t max_idle_counter_fds;
 
 /*
  * Find out the cpu model using the cpuid instruction.
@@ -47,7 +58,10 @@ enum CpuMicroarch {
   IntelIvyBridge,
   IntelHaswell,
   IntelBroadwell,
-  IntelSkylake
+  IntelSkylake,
+  IntelKabylake,
+  IntelIcelake,
+  AMDZen
 };
 
 struct PmuConfig {
@@ -56,21 +70,29 @@ struct PmuConfig {
   unsigned rcb_cntr_event;
   unsigned rinsn_cntr_event;
   unsigned hw_intr_cntr_event;
+  // See PerfCounters::skid_size().
+  Ticks skid_size;
   bool supported;
 };
 
 // XXX please only edit this if you really know what you're doing.
 static const PmuConfig pmu_configs[] = {
-  { IntelSkylake, "Intel Skylake", 0x5101c4, 0x5100c0, 0x5301cb, true },
-  { IntelBroadwell, "Intel Broadwell", 0x5101c4, 0x5100c0, 0x5301cb, true },
-  { IntelHaswell, "Intel Haswell", 0x5101c4, 0x5100c0, 0x5301cb, true },
-  { IntelIvyBridge, "Intel Ivy Bridge", 0x5101c4, 0x5100c0, 0x5301cb, true },
-  { IntelSandyBridge, "Intel Sandy Bridge", 0x5101c4, 0x5100c0, 0x5301cb,
+  { AMDZen, "AMD Zen", 0x5100d1, 0x5100c0, 0x5100cf, 10000, true },
+  { IntelIcelake, "Intel Ice Lake", 0x5111c4, 0x5100c0, 0x5301cb, 70, true },
+  { IntelKabylake, "Intel Kaby Lake", 0x5101c4, 0x5100c0, 0x5301cb, 70,
     true },
-  { IntelNehalem, "Intel Nehalem", 0x5101c4, 0x5100c0, 0x50011d, true },
-  { IntelWestmere, "Intel Westmere", 0x5101c4, 0x5100c0, 0x50011d, true },
-  { IntelPenryn, "Intel Penryn", 0, 0, 0, false },
-  { IntelMerom, "Intel Merom", 0, 0, 0, false },
+  { IntelSkylake, "Intel Skylake", 0x5101c4, 0x5100c0, 0x5301cb, 70, true },
+  { IntelBroadwell, "Intel Broadwell", 0x5101c4, 0x5100c0, 0x5301cb, 70,
+    true },
+  { IntelHaswell, "Intel Haswell", 0x5101c4, 0x5100c0, 0x5301cb, 70, true },
+  { IntelIvyBridge, "Intel Ivy Bridge", 0x5101c4, 0x5100c0, 0x5301cb, 70,
+    true },
+  { IntelSandyBridge, "Intel Sandy Bridge", 0x5101c4, 0x5100c0, 0x5301cb, 70,
+    true },
+  { IntelNehalem, "Intel Nehalem", 0x5101c4, 0x5100c0, 0x50011d, 70, true },
+  { IntelWestmere, "Intel Westmere", 0x5101c4, 0x5100c0, 0x50011d, 70, true },
+  { IntelPenryn, "Intel Penryn", 0, 0, 0, 0, false },
+  { IntelMerom, "Intel Merom", 0, 0, 0, 0, false },
 };
 
 static string lowercase(const string& s) {
@@ -99,6 +121,13 @@ static CpuMicroarch get_cpu_microarch() {
 
   unsigned int cpu_type, eax, ecx, edx;
   cpuid(CPUID_GETFEATURES, 0, &eax, &ecx, &edx);
+  unsigned int family = (eax >> 8) & 0xF;
+  if (family == 0xF) {
+    family += (eax >> 20) & 0xFF;
+  }
+  if (family == 0x17 || family == 0x19) {
+    return AMDZen;
+  }
   cpu_type = (eax & 0xF0FF0);
   switch (cpu_type) {
     case 0x006F0:
@@ -131,8 +160,20 @@ static CpuMicroarch get_cpu_microarch() {
     case 0x50660:
       return IntelBroadwell;
     case 0x406e0:
+    case 0x50650:
     case 0x506e0:
       return IntelSkylake;
+    case 0x806e0:
+    case 0x906e0:
+    case 0xa0650:
+    case 0xa0660:
+      return IntelKabylake;
+    case 0x606a0:
+    case 0x606c0:
+    case 0x706e0:
+    case 0x806c0:
+    case 0x806d0:
+      return IntelIcelake;
     default:
       FATAL() << "CPU " << HEX(cpu_type) << " unknown.";
       return UnknownCpu; // not reached
@@ -151,6 +192,185 @@ static void init_perf_event_attr(struct perf_event_attr* attr,
   attr->exclude_guest = 1;
 }
 
+static ScopedFd start_counter(pid_t tid, int group_fd,
+                              struct perf_event_attr* attr);
+
+static volatile int self_test_sink;
+
+/**
+ * Run a loop with a fixed number of conditional branches, and some locked
+ * instructions (which have been seen to perturb the count on some AMD
+ * CPUs), counting ticks with |fd|.
+ */
+static Ticks count_self_test_loop(ScopedFd& fd) {
+  ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+  ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+  for (int i = 0; i < 100000; ++i) {
+    if (i % 3) {
+      __sync_fetch_and_add(&self_test_sink, 1);
+    }
+  }
+  ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+  Ticks ticks;
+  if (read(fd, &ticks, sizeof(ticks)) != sizeof(ticks)) {
+    FATAL() << "Failed to read ticks counter";
+  }
+  return ticks;
+}
+
+/**
+ * Check that the ticks counter counts our own test loop the same way
+ * every time. Replay depends on that. Returns false if it doesn't but
+ * we've been told to carry on anyway.
+ */
+static bool check_ticks_deterministic(const PmuConfig& pmu) {
+  struct perf_event_attr attr = ticks_attr;
+  attr.disabled = 1;
+  ScopedFd fd = start_counter(0, -1, &attr);
+  Ticks first = count_self_test_loop(fd);
+  for (int i = 0; i < 3; ++i) {
+    Ticks again = count_self_test_loop(fd);
+    if (again != first) {
+      if (Flags::get().force_things) {
+        LOG(warn) << "Ticks counter for " << pmu.name
+                  << " isn't deterministic (" << first << " vs " << again
+                  << "); replay will probably fail";
+        return false;
+      }
+      FATAL() << "Ticks counter for " << pmu.name << " isn't deterministic ("
+              << first << " vs " << again << " conditional branches in the "
+              << "same code). Replay would fail. Use -F to record anyway.";
+    }
+  }
+  LOG(debug) << "Ticks counter self-test counted " << first << " ticks";
+  return true;
+}
+
+/**
+ * Some kernels don't apply a new period set with PERF_EVENT_IOC_PERIOD
+ * until the old one has expired. On those we have to reopen the ticks
+ * counter to change its period.
+ */
+static void check_for_ioc_period_bug() {
+  struct perf_event_attr attr = ticks_attr;
+  attr.sample_period = 0xffffffff;
+  ScopedFd fd = start_counter(0, -1, &attr);
+  uint64_t new_period = 1;
+  if (ioctl(fd, PERF_EVENT_IOC_PERIOD, &new_period)) {
+    has_ioc_period_bug = true;
+    return;
+  }
+  struct pollfd poll_fd = { fd, POLLIN, 0 };
+  poll(&poll_fd, 1, 0);
+  has_ioc_period_bug = poll_fd.revents == 0;
+  LOG(debug) << "PERF_EVENT_IOC_PERIOD bug: " << has_ioc_period_bug;
+}
+
+/**
+ * CPUID reports whether we're running under a hypervisor in bit 31 of
+ * ECX for CPUID_GETFEATURES.
+ */
+static bool running_under_hypervisor() {
+  unsigned int eax, ecx, edx;
+  cpuid(CPUID_GETFEATURES, 0, &eax, &ecx, &edx);
+  return (ecx >> 31) & 1;
+}
+
+static volatile int skid_test_fd = -1;
+static volatile bool skid_test_fired;
+static volatile Ticks skid_test_ticks;
+
+static void handle_skid_test_signal(int) {
+  Ticks ticks;
+  if (read(skid_test_fd, &ticks, sizeof(ticks)) == sizeof(ticks)) {
+    skid_test_ticks = ticks;
+  }
+  ioctl(skid_test_fd, PERF_EVENT_IOC_DISABLE, 0);
+  skid_test_fired = true;
+}
+
+/**
+ * Measure how many ticks past its period the ticks interrupt fires, by
+ * programming it on ourselves while we spin. Returns the largest
+ * overshoot seen, or -1 if the interrupt never arrived.
+ */
+static Ticks measure_interrupt_skid() {
+  static const Ticks PERIOD = 100000;
+  static const int TRIALS = 16;
+
+  struct sigaction sa, old_sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_skid_test_signal;
+  sigaction(PerfCounters::TIME_SLICE_SIGNAL, &sa, &old_sa);
+  sigset_t unblock, old_mask;
+  sigemptyset(&unblock);
+  sigaddset(&unblock, PerfCounters::TIME_SLICE_SIGNAL);
+  sigprocmask(SIG_UNBLOCK, &unblock, &old_mask);
+
+  Ticks max_skid = -1;
+  for (int i = 0; i < TRIALS; ++i) {
+    struct perf_event_attr attr = ticks_attr;
+    attr.sample_period = PERIOD;
+    attr.disabled = 1;
+    ScopedFd fd = start_counter(0, -1, &attr);
+    struct f_owner_ex own;
+    own.type = F_OWNER_TID;
+    own.pid = syscall(SYS_gettid);
+    if (fcntl(fd, F_SETOWN_EX, &own) || fcntl(fd, F_SETFL, O_ASYNC) ||
+        fcntl(fd, F_SETSIG, PerfCounters::TIME_SLICE_SIGNAL)) {
+      break;
+    }
+    skid_test_fd = fd;
+    skid_test_fired = false;
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    for (Ticks spins = 0; !skid_test_fired && spins < PERIOD * 100; ++spins) {
+    }
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (!skid_test_fired) {
+      break;
+    }
+    max_skid = max(max_skid, skid_test_ticks - PERIOD);
+  }
+  skid_test_fd = -1;
+
+  sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+  sigaction(PerfCounters::TIME_SLICE_SIGNAL, &old_sa, nullptr);
+  return max_skid;
+}
+
+/**
+ * Under a hypervisor the ticks interrupt is delivered by the virtual PMU,
+ * and can arrive much later than on bare metal. Measure it, and widen the
+ * skid margin if necessary so replay doesn't overshoot its targets.
+ */
+static void adjust_skid_for_hypervisor(const string& cache_prefix) {
+  if (!running_under_hypervisor()) {
+    return;
+  }
+  HostProbeCache& cache = HostProbeCache::get();
+  int64_t measured;
+  if (!cache.lookup(cache_prefix + "hypervisor_skid", &measured)) {
+    measured = measure_interrupt_skid();
+    if (measured >= 0) {
+      cache.store(cache_prefix + "hypervisor_skid", measured);
+    }
+  }
+  if (measured < 0) {
+    LOG(warn) << "Running under a hypervisor, but couldn't measure ticks "
+                 "interrupt skid";
+    return;
+  }
+  // Leave plenty of headroom over what a short test saw.
+  Ticks margin = measured * 2 + 100;
+  LOG(info) << "Running under a hypervisor; measured ticks interrupt skid "
+            << measured;
+  if (margin > pmu_skid_size) {
+    LOG(info) << "Raising skid margin from " << pmu_skid_size << " to "
+              << margin;
+    pmu_skid_size = margin;
+  }
+}
+
 static void init_attributes() {
   if (attributes_initialized) {
     return;
@@ -181,12 +401,65 @@ static void init_attributes() {
   hw_interrupts_attr.exclude_hv = 1;
   init_perf_event_attr(&page_faults_attr, PERF_TYPE_SOFTWARE,
                        PERF_COUNT_SW_PAGE_FAULTS);
+  pmu_skid_size = pmu->skid_size;
+
+  // The self-tests take a while, and their results only change when the
+  // kernel, the CPU or rr do, so they're cached.
+  double start = monotonic_now_sec();
+  HostProbeCache& cache = HostProbeCache::get();
+  string cache_prefix = string(pmu->name) + ".";
+  for (auto& c : cache_prefix) {
+    if (c == ' ') {
+      c = '_';
+    }
+  }
+  int64_t value;
+  if (!cache.lookup(cache_prefix + "ticks_deterministic", &value) &&
+      check_ticks_deterministic(*pmu)) {
+    cache.store(cache_prefix + "ticks_deterministic", 1);
+  }
+  if (cache.lookup(cache_prefix + "ioc_period_bug", &value)) {
+    has_ioc_period_bug = value;
+  } else {
+    check_for_ioc_period_bug();
+    cache.store(cache_prefix + "ioc_period_bug", has_ioc_period_bug);
+  }
+  adjust_skid_for_hypervisor(cache_prefix);
+  pmu_probe_seconds = monotonic_now_sec() - start;
+  if (PerfCounters::extra_perf_counters_enabled()) {
+    ticks_attr.read_format = PERF_FORMAT_GROUP;
+  }
+
+  // Keeping a task's counters open while it's stopped saves reopening them
+  // for every timeslice, but costs fds. Use at most half of our fd limit
+  // for that.
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+    max_idle_counter_fds = limit.rlim_cur / 2;
+  } else {
+    max_idle_counter_fds = 512;
+  }
+}
+
+double PerfCounters::probe_seconds() {
+  init_attributes();
+  return pmu_probe_seconds;
+}
+
+Ticks PerfCounters::skid_size() {
+  init_attributes();
+  return pmu_skid_size;
 }
 
 PerfCounters::PerfCounters(pid_t tid) : tid(tid), started(false) {
   init_attributes();
 }
 
+PerfCounters::~PerfCounters() {
+  stop();
+  close();
+}
+
 static ScopedFd start_counter(pid_t tid, int group_fd,
                               struct perf_event_attr* attr) {
   int fd = syscall(__NR_perf_event_open, attr, tid, -1, group_fd, 0);
@@ -201,17 +474,17 @@ static ScopedFd start_counter(pid_t tid, int group_fd,
     }
     FATAL() << "Failed to initialize counter";
   }
-  if (ioctl(fd, PERF_EVENT_IOC_ENABLE, 0)) {
+  if (!attr->disabled && ioctl(fd, PERF_EVENT_IOC_ENABLE, 0)) {
     FATAL() << "Failed to start counter";
   }
   return fd;
 }
 
-void PerfCounters::reset(Ticks ticks_period) {
-  assert(ticks_period >= 0);
-
-  stop();
+size_t PerfCounters::fds_per_task() {
+  return extra_perf_counters_enabled() ? 4 : 1;
+}
 
+void PerfCounters::open(Ticks ticks_period) {
   struct perf_event_attr attr = ticks_attr;
   attr.sample_period = ticks_period;
   fd_ticks = start_counter(tid, -1, &attr);
@@ -229,12 +502,45 @@ void PerfCounters::reset(Ticks ticks_period) {
   }
 
   if (extra_perf_counters_enabled()) {
+    // The order here is the order read_extra() sees the values in.
     int group_leader = fd_ticks;
     fd_hw_interrupts = start_counter(tid, group_leader, &hw_interrupts_attr);
     fd_instructions_retired =
         start_counter(tid, group_leader, &instructions_retired_attr);
     fd_page_faults = start_counter(tid, group_leader, &page_faults_attr);
   }
+  open_counter_fds += fds_per_task();
+}
+
+void PerfCounters::close() {
+  if (!fd_ticks.is_open()) {
+    return;
+  }
+  fd_ticks.close();
+  fd_page_faults.close();
+  fd_hw_interrupts.close();
+  fd_instructions_retired.close();
+  open_counter_fds -= fds_per_task();
+}
+
+void PerfCounters::reset(Ticks ticks_period) {
+  assert(ticks_period >= 0);
+
+  stop();
+
+  if (fd_ticks.is_open() && !has_ioc_period_bug) {
+    // Reuse the counters we already have. Resetting the leader with
+    // PERF_IOC_FLAG_GROUP resets the extra counters too.
+    uint64_t period = ticks_period;
+    if (ioctl(fd_ticks, PERF_EVENT_IOC_PERIOD, &period) ||
+        ioctl(fd_ticks, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP) ||
+        ioctl(fd_ticks, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP)) {
+      FATAL() << "Failed to restart counters";
+    }
+  } else {
+    close();
+    open(ticks_period);
+  }
 
   started = true;
 }
@@ -245,10 +551,11 @@ void PerfCounters::stop() {
   }
   started = false;
 
-  fd_ticks.close();
-  fd_page_faults.close();
-  fd_hw_interrupts.close();
-  fd_instructions_retired.close();
+  if (has_ioc_period_bug || open_counter_fds > max_idle_counter_fds) {
+    close();
+  } else if (ioctl(fd_ticks, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP)) {
+    FATAL() << "Failed to stop counters";
+  }
 }
 
 static int64_t read_counter(ScopedFd& fd) {
@@ -258,8 +565,30 @@ static int64_t read_counter(ScopedFd& fd) {
   return val;
 }
 
+/**
+ * With extra counters enabled, the ticks counter leads a group that
+ * is read all at once: the number of counters, then their values.
+ */
+struct GroupValues {
+  uint64_t nr;
+  int64_t values[4];
+};
+
+static void read_group(ScopedFd& fd, GroupValues* group) {
+  ssize_t nread = read(fd, group, sizeof(*group));
+  assert(nread == sizeof(*group) && group->nr == 4);
+}
+
 Ticks PerfCounters::read_ticks() {
-  return started ? read_counter(fd_ticks) : 0;
+  if (!started) {
+    return 0;
+  }
+  if (extra_perf_counters_enabled()) {
+    GroupValues group;
+    read_group(fd_ticks, &group);
+    return group.values[0];
+  }
+  return read_counter(fd_ticks);
 }
 
 PerfCounters::Extra PerfCounters::read_extra() {
@@ -267,11 +596,11 @@ PerfCounters::Extra PerfCounters::read_extra() {
 
   Extra extra;
   if (started) {
-    extra.page_faults = read_counter(fd_page_faults);
-    extra.hw_interrupts = read_counter(fd_hw_interrupts);
-    extra.instructions_retired = read_counter(fd_instructions_retired);
-  } else {
-    memset(&extra, 0, sizeof(extra));
+    GroupValues group;
+    read_group(fd_ticks, &group);
+    extra.hw_interrupts = group.values[1];
+    extra.instructions_retired = group.values[2];
+    extra.page_faults = group.values[3];
   }
   return extra;
 }
@@ -34,7 +34,7 @@ public:
    * Create performance counters monitoring the given task.
    */
   PerfCounters(pid_t tid);
-  ~PerfCounters() { stop(); }
+  ~PerfCounters();
 
   // Change this to 'true' to enable perf counters that may be interesting
   // for experimentation, but aren't necessary for core functionality.
@@ -50,8 +50,22 @@ public:
   void reset(Ticks ticks_period);
 
   /**
-   * Close the perfcounter fds. They will be automatically reopened if/when
-   * reset is called again.
+   * Return how far past the programmed period, at most, the ticks interrupt
+   * has been observed to fire on this microarchitecture. Callers that need
+   * to stop at an exact tick count program the interrupt this many ticks
+   * early and then advance more slowly.
+   */
+  static Ticks skid_size();
+  /**
+   * Return how long the PMU self-tests took when they were first needed;
+   * close to zero when their results were cached.
+   */
+  static double probe_seconds();
+
+  /**
+   * Stop counting. The perfcounter fds are kept open, disabled, so the next
+   * reset() can reuse them, unless too many counter fds are already open
+   * across all tasks; then they're closed and reset() reopens them.
    */
   void stop();
 
@@ -79,6 +93,10 @@ public:
   Extra read_extra();
 
 private:
+  void open(Ticks ticks_period);
+  void close();
+  static size_t fds_per_task();
+
   pid_t tid;
   ScopedFd fd_ticks;
   ScopedFd fd_page_faults;
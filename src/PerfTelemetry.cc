@@ -0,0 +1,141 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "PerfTelemetry.h"
+
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "RecordTask.h"
+
+using namespace std;
+
+namespace rr {
+
+static ScopedFd open_counter(pid_t tid, int group_fd, uint32_t type,
+                             uint64_t config, bool count_kernel) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.type = type;
+  attr.size = sizeof(attr);
+  attr.config = config;
+  attr.exclude_kernel = !count_kernel;
+  attr.exclude_guest = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(__NR_perf_event_open, &attr, tid, -1, group_fd, 0);
+}
+
+void PerfTelemetry::start(RecordTask* t) {
+  if (running.find(t->tid) != running.end()) {
+    return;
+  }
+  Counters& c = running[t->tid];
+  c.name = t->name();
+  c.user_cycles = open_counter(t->tid, -1, PERF_TYPE_HARDWARE,
+                               PERF_COUNT_HW_CPU_CYCLES, false);
+  if (!c.user_cycles.is_open()) {
+    LOG(warn) << "Can't count cycles for " << t->tid;
+    return;
+  }
+  c.user_instructions =
+      open_counter(t->tid, c.user_cycles, PERF_TYPE_HARDWARE,
+                   PERF_COUNT_HW_INSTRUCTIONS, false);
+  c.all_cycles = open_counter(t->tid, -1, PERF_TYPE_HARDWARE,
+                              PERF_COUNT_HW_CPU_CYCLES, true);
+  if (c.all_cycles.is_open()) {
+    // Context switches happen in the kernel, so they're only counted
+    // alongside kernel cycles.
+    c.context_switches =
+        open_counter(t->tid, c.all_cycles, PERF_TYPE_SOFTWARE,
+                     PERF_COUNT_SW_CONTEXT_SWITCHES, true);
+  } else if (!warned_no_kernel_counts) {
+    LOG(warn) << "Can't count kernel events (perf_event_paranoid too high?); "
+                 "only reporting user-mode IPC";
+    warned_no_kernel_counts = true;
+  }
+}
+
+/**
+ * Read a group leader with |n| members, storing UINT64_MAX for each
+ * value we can't read.
+ */
+static void read_group(ScopedFd& leader, size_t n, uint64_t* values) {
+  uint64_t buf[3];
+  ssize_t size = (n + 1) * sizeof(uint64_t);
+  if (!leader.is_open() || read(leader, buf, size) != size || buf[0] != n) {
+    for (size_t i = 0; i < n; ++i) {
+      values[i] = UINT64_MAX;
+    }
+    return;
+  }
+  memcpy(values, buf + 1, n * sizeof(uint64_t));
+}
+
+void PerfTelemetry::finish(pid_t tid, Counters& c) {
+  Counts counts;
+  counts.tid = tid;
+  counts.name = c.name;
+  uint64_t values[2];
+  read_group(c.user_cycles, c.user_instructions.is_open() ? 2 : 1, values);
+  counts.user_cycles = values[0];
+  counts.user_instructions =
+      c.user_instructions.is_open() ? values[1] : UINT64_MAX;
+  read_group(c.all_cycles, c.context_switches.is_open() ? 2 : 1, values);
+  counts.all_cycles = values[0];
+  counts.context_switches =
+      c.context_switches.is_open() ? values[1] : UINT64_MAX;
+  finished.push_back(counts);
+}
+
+void PerfTelemetry::stop(RecordTask* t) {
+  auto it = running.find(t->tid);
+  if (it == running.end()) {
+    return;
+  }
+  // The task may have exec'd since we started counting.
+  it->second.name = t->name();
+  finish(t->tid, it->second);
+  running.erase(it);
+}
+
+static void print_count(FILE* out, uint64_t value) {
+  if (value == UINT64_MAX) {
+    fprintf(out, " %14s", "-");
+  } else {
+    fprintf(out, " %14" PRIu64, value);
+  }
+}
+
+static void print_ipc(FILE* out, uint64_t instructions, uint64_t cycles) {
+  if (instructions == UINT64_MAX || cycles == UINT64_MAX || !cycles) {
+    fprintf(out, " %8s", "-");
+  } else {
+    fprintf(out, " %8.3f", (double)instructions / cycles);
+  }
+}
+
+void PerfTelemetry::dump(FILE* out) {
+  for (auto& r : running) {
+    finish(r.first, r.second);
+  }
+  running.clear();
+
+  fprintf(out, "rr: tracee hardware counters while recording:\n");
+  fprintf(out, "  %-8s %-16s %14s %14s %14s %8s %8s %14s\n", "tid", "name",
+          "instructions", "user cycles", "all cycles", "user IPC", "obs IPC",
+          "ctx switches");
+  for (auto& c : finished) {
+    fprintf(out, "  %-8d %-16s", c.tid, c.name.c_str());
+    print_count(out, c.user_instructions);
+    print_count(out, c.user_cycles);
+    print_count(out, c.all_cycles);
+    print_ipc(out, c.user_instructions, c.user_cycles);
+    print_ipc(out, c.user_instructions, c.all_cycles);
+    print_count(out, c.context_switches);
+    fprintf(out, "\n");
+  }
+}
+
+} // namespace rr
@@ -0,0 +1,82 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_PERF_TELEMETRY_H_
+#define RR_PERF_TELEMETRY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ScopedFd.h"
+
+namespace rr {
+
+class RecordTask;
+
+/**
+ * Counts, per tracee task, the cycles, instructions and context switches
+ * it incurs while being recorded, independently of the ticks counter, so
+ * we can see how much recording perturbs it.
+ *
+ * User-mode IPC approximates how the tracee's own code runs. "Observed"
+ * IPC also charges the task with the cycles it spends in the kernel,
+ * which includes entering and leaving ptrace stops; the difference
+ * between the two is the cost rr imposes on the task itself. Counting
+ * kernel cycles needs perf_event_paranoid <= 1; without that only the
+ * user-mode numbers are reported.
+ */
+class PerfTelemetry {
+public:
+  PerfTelemetry() : enabled_(false), warned_no_kernel_counts(false) {}
+
+  void set_enabled(bool enabled) { enabled_ = enabled; }
+  bool enabled() const { return enabled_; }
+
+  /**
+   * Start counting for |t| if we aren't already.
+   */
+  void start(RecordTask* t);
+  /**
+   * |t| is going away; collect its final counts.
+   */
+  void stop(RecordTask* t);
+
+  /**
+   * Print a table of all tasks seen, in order of when they stopped.
+   */
+  void dump(FILE* out);
+
+private:
+  struct Counts {
+    pid_t tid;
+    std::string name;
+    uint64_t user_cycles;
+    uint64_t user_instructions;
+    // These two are UINT64_MAX if kernel events couldn't be counted.
+    uint64_t all_cycles;
+    uint64_t context_switches;
+  };
+  struct Counters {
+    std::string name;
+    // Each leader reads the counts of its whole group.
+    ScopedFd user_cycles;
+    ScopedFd user_instructions;
+    ScopedFd all_cycles;
+    ScopedFd context_switches;
+  };
+
+  void finish(pid_t tid, Counters& counters);
+
+  std::map<pid_t, Counters> running;
+  std::vector<Counts> finished;
+  bool enabled_;
+  bool warned_no_kernel_counts;
+};
+
+} // namespace rr
+
+#endif /* RR_PERF_TELEMETRY_H_ */
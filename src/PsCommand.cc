@@ -23,9 +23,9 @@ protected:
 
 PsCommand PsCommand::singleton("ps", " rr ps [<trace_dir>]\n");
 
-static void print_exec_cmd_line(const TraceTaskEvent& event, FILE* out) {
+static void print_cmd_line(const vector<string>& cmd_line, FILE* out) {
   bool first = true;
-  for (auto& word : event.cmd_line()) {
+  for (auto& word : cmd_line) {
     fprintf(out, "%s%s", first ? "" : " ", word.c_str());
     first = false;
   }
@@ -43,11 +43,37 @@ static void update_tid_to_pid_map(std::map<pid_t, pid_t>& tid_to_pid,
   }
 }
 
+static int ps_from_index(const vector<TraceReader::ProcessRecord>& processes,
+                         FILE* out) {
+  if (processes.empty() || processes[0].execs.empty()) {
+    fprintf(stderr, "Invalid trace\n");
+    return 1;
+  }
+  for (auto& p : processes) {
+    if (p.ppid) {
+      fprintf(out, "%d\t%d\t", p.pid, p.ppid);
+    } else {
+      fprintf(out, "%d\t--\t", p.pid);
+    }
+    if (p.execs.empty()) {
+      fprintf(out, "(forked without exec)\n");
+    } else {
+      print_cmd_line(p.execs[0].cmd_line, out);
+    }
+  }
+  return 0;
+}
+
 static int ps(const string& trace_dir, FILE* out) {
   TraceReader trace(trace_dir);
 
   fprintf(out, "PID\tPPID\tCMD\n");
 
+  vector<TraceReader::ProcessRecord> processes;
+  if (trace.read_process_index(processes)) {
+    return ps_from_index(processes, out);
+  }
+
   vector<TraceTaskEvent> events;
   while (trace.good()) {
     events.push_back(trace.read_task_event());
@@ -61,7 +87,7 @@ static int ps(const string& trace_dir, FILE* out) {
   std::map<pid_t, pid_t> tid_to_pid;
 
   fprintf(out, "%d\t--\t", events[0].tid());
-  print_exec_cmd_line(events[0], out);
+  print_cmd_line(events[0].cmd_line(), out);
   tid_to_pid[events[0].tid()] = events[0].tid();
 
   for (size_t i = 1; i < events.size(); ++i) {
@@ -79,7 +105,7 @@ static int ps(const string& trace_dir, FILE* out) {
 
         if (tmp_tid_to_pid[ej.tid()] == tmp_tid_to_pid[e.tid()] &&
             ej.type() == TraceTaskEvent::EXEC) {
-          print_exec_cmd_line(events[j], out);
+          print_cmd_line(events[j].cmd_line(), out);
           found_exec = true;
           break;
         }
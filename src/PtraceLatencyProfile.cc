@@ -0,0 +1,192 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "PtraceLatencyProfile.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <sys/ptrace.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include "ftrace.h"
+#include "kernel_supplement.h"
+#include "PerfCounters.h"
+#include "preload/preload_interface.h"
+#include "Task.h"
+#include "util.h"
+
+using namespace std;
+
+namespace rr {
+
+static const char* stop_kind(Task* t) {
+  switch (t->ptrace_event()) {
+    case 0:
+      break;
+    case PTRACE_EVENT_SECCOMP:
+    case PTRACE_EVENT_SECCOMP_OBSOLETE:
+      return "seccomp";
+    case PTRACE_EVENT_CLONE:
+    case PTRACE_EVENT_FORK:
+    case PTRACE_EVENT_VFORK:
+      return "clone";
+    case PTRACE_EVENT_VFORK_DONE:
+      return "vfork done";
+    case PTRACE_EVENT_EXEC:
+      return "exec";
+    case PTRACE_EVENT_EXIT:
+      return "exit";
+    default:
+      return "other ptrace event";
+  }
+  switch (t->pending_sig()) {
+    case 0:
+      break;
+    case PerfCounters::TIME_SLICE_SIGNAL:
+      return "time slice";
+    case SYSCALLBUF_DESCHED_SIGNAL:
+      return "desched";
+    default:
+      return "signal";
+  }
+  if (t->stop_sig() == (SIGTRAP | 0x80)) {
+    return "syscall";
+  }
+  return "other";
+}
+
+void PtraceLatencyProfile::Histogram::add(double seconds) {
+  seconds = max(0.0, seconds);
+  int bucket = 0;
+  for (double us = seconds * 1e6; us >= 1 && bucket < BUCKETS - 1;
+       us /= 2) {
+    ++bucket;
+  }
+  ++buckets[bucket];
+  ++count;
+  total_seconds += seconds;
+  max_seconds = max(max_seconds, seconds);
+}
+
+double PtraceLatencyProfile::Histogram::quantile(double fraction) const {
+  uint64_t target = (uint64_t)ceil(count * fraction);
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; ++i) {
+    seen += buckets[i];
+    if (seen >= target) {
+      return min(max_seconds, ldexp(1.0, i) / 1e6);
+    }
+  }
+  return max_seconds;
+}
+
+void PtraceLatencyProfile::Histogram::dump(FILE* out, const char* what) const {
+  if (!count) {
+    return;
+  }
+  fprintf(out, "    %-16s mean %9.1fus  p50 <%9.1fus  p90 <%9.1fus  p99 "
+               "<%9.1fus  max %9.1fus\n",
+          what, total_seconds / count * 1e6, quantile(0.5) * 1e6,
+          quantile(0.9) * 1e6, quantile(0.99) * 1e6, max_seconds * 1e6);
+  fprintf(out, "    %-16s", "");
+  for (int i = 0; i < BUCKETS; ++i) {
+    if (buckets[i]) {
+      fprintf(out, " <%.0fus:%" PRIu64, ldexp(1.0, i), buckets[i]);
+    }
+  }
+  fputc('\n', out);
+}
+
+bool PtraceLatencyProfile::read_schedstat(TaskState& state, SchedStat* stat) {
+  char buf[256];
+  ssize_t len = pread(state.schedstat_fd, buf, sizeof(buf) - 1, 0);
+  if (len <= 0) {
+    return false;
+  }
+  buf[len] = 0;
+  unsigned long long cpu_ns, run_delay_ns;
+  if (sscanf(buf, "%llu %llu", &cpu_ns, &run_delay_ns) != 2) {
+    return false;
+  }
+  stat->cpu_ns = cpu_ns;
+  stat->run_delay_ns = run_delay_ns;
+  return true;
+}
+
+void PtraceLatencyProfile::resumed(Task* t) {
+  double now = monotonic_now_sec();
+  if (processing_kind) {
+    by_kind[processing_kind].processing.add(now - processing_start);
+    processing_kind = nullptr;
+  }
+
+  auto it = tasks.find(t->tid);
+  if (it == tasks.end()) {
+    it = tasks.insert(make_pair(t->tid, TaskState())).first;
+    char path[PATH_MAX];
+    sprintf(path, "/proc/%d/schedstat", t->tid);
+    it->second.schedstat_fd = ScopedFd(path, O_RDONLY | O_CLOEXEC);
+  }
+  TaskState& state = it->second;
+  // Read schedstat before taking the time, so reading it isn't charged to
+  // the tracee.
+  state.have_schedstat = state.schedstat_fd.is_open() &&
+                         read_schedstat(state, &state.at_resume);
+  state.resumed = true;
+  state.resume_time = monotonic_now_sec();
+
+  if (ftrace::is_tracing()) {
+    stringstream ss;
+    ss << "rr: resumed " << t->tid << "\n";
+    ftrace::write(ss.str());
+  }
+}
+
+void PtraceLatencyProfile::stopped(Task* t) {
+  double now = monotonic_now_sec();
+  const char* kind = stop_kind(t);
+  if (ftrace::is_tracing()) {
+    stringstream ss;
+    ss << "rr: " << kind << " stop of " << t->tid << "\n";
+    ftrace::write(ss.str());
+  }
+  // rr is processing this stop until it next resumes a task.
+  processing_kind = kind;
+  processing_start = now;
+
+  auto it = tasks.find(t->tid);
+  if (it == tasks.end() || !it->second.resumed) {
+    // We didn't resume this task ourselves (e.g. a new clone child).
+    return;
+  }
+  TaskState& state = it->second;
+  state.resumed = false;
+  SchedStat at_stop;
+  if (!state.have_schedstat || !read_schedstat(state, &at_stop)) {
+    return;
+  }
+  double round_trip = now - state.resume_time;
+  double run_delay =
+      (at_stop.run_delay_ns - state.at_resume.run_delay_ns) / 1e9;
+  double cpu = (at_stop.cpu_ns - state.at_resume.cpu_ns) / 1e9;
+  Latencies& l = by_kind[kind];
+  l.resume_to_run.add(run_delay);
+  l.stop_to_wakeup.add(round_trip - run_delay - cpu);
+}
+
+void PtraceLatencyProfile::forget(Task* t) { tasks.erase(t->tid); }
+
+void PtraceLatencyProfile::dump(FILE* out) const {
+  fprintf(out, "rr: ptrace stop latency by kind of stop:\n");
+  for (auto& k : by_kind) {
+    fprintf(out, "  %s (%" PRIu64 " stops):\n", k.first.c_str(),
+            k.second.processing.count);
+    k.second.resume_to_run.dump(out, "resume-to-run");
+    k.second.stop_to_wakeup.dump(out, "stop-to-wakeup");
+    k.second.processing.dump(out, "rr processing");
+  }
+}
+
+} // namespace rr
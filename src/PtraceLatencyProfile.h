@@ -0,0 +1,112 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_PTRACE_LATENCY_PROFILE_H_
+#define RR_PTRACE_LATENCY_PROFILE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+
+#include "ScopedFd.h"
+
+namespace rr {
+
+class Task;
+
+/**
+ * Splits the time around every tracee ptrace stop into kernel latency and
+ * rr's own work, per kind of stop (syscall, seccomp, time slice, desched,
+ * signal, clone, exec, ...), and collects histograms of
+ * - resume-to-run latency: how long the tracee waited for a CPU after rr
+ *   resumed it, from the run delay in /proc/<tid>/schedstat,
+ * - stop-to-wakeup latency: the rest of the time from the resume to rr
+ *   picking up the stop, minus the time the tracee spent on a CPU. This is
+ *   the kernel waking rr for the ptrace stop, plus rr waiting for a CPU,
+ * - rr processing time: from rr picking up the stop to rr resuming a task.
+ * Without schedstat (CONFIG_SCHED_INFO), the two latencies can't be told
+ * apart from the tracee's run time and only processing time is reported.
+ *
+ * While ftrace is tracing (see ftrace.h), each stop and resume is also
+ * marked in the ftrace buffer, to line up with the kernel's sched_switch
+ * and sched_wakeup timestamps.
+ */
+class PtraceLatencyProfile {
+public:
+  PtraceLatencyProfile()
+      : enabled_(false), processing_kind(nullptr), processing_start(0) {}
+
+  void set_enabled(bool enabled) { enabled_ = enabled; }
+  bool enabled() const { return enabled_; }
+
+  /**
+   * rr has just resumed |t|.
+   */
+  void resumed(Task* t);
+  /**
+   * rr has just picked up a ptrace stop of |t|.
+   */
+  void stopped(Task* t);
+  /**
+   * |t| is going away.
+   */
+  void forget(Task* t);
+
+  /**
+   * Print the histograms for each kind of stop.
+   */
+  void dump(FILE* out) const;
+
+private:
+  // Bucket i counts samples in [2^(i-1), 2^i) microseconds; bucket 0 counts
+  // samples under 1us.
+  enum { BUCKETS = 32 };
+  struct Histogram {
+    Histogram() : count(0), total_seconds(0), max_seconds(0) {
+      for (auto& b : buckets) {
+        b = 0;
+      }
+    }
+    void add(double seconds);
+    // Upper bound of the bucket containing the |fraction| quantile.
+    double quantile(double fraction) const;
+    void dump(FILE* out, const char* what) const;
+
+    uint64_t buckets[BUCKETS];
+    uint64_t count;
+    double total_seconds;
+    double max_seconds;
+  };
+  struct Latencies {
+    Histogram stop_to_wakeup;
+    Histogram processing;
+    Histogram resume_to_run;
+  };
+  struct SchedStat {
+    uint64_t cpu_ns;
+    uint64_t run_delay_ns;
+  };
+  struct TaskState {
+    TaskState() : resumed(false), have_schedstat(false), resume_time(0) {}
+    ScopedFd schedstat_fd;
+    bool resumed;
+    bool have_schedstat;
+    double resume_time;
+    SchedStat at_resume;
+  };
+
+  bool read_schedstat(TaskState& state, SchedStat* stat);
+
+  std::map<std::string, Latencies> by_kind;
+  std::map<pid_t, TaskState> tasks;
+  bool enabled_;
+  // The stop rr is processing, until it resumes a task.
+  const char* processing_kind;
+  double processing_start;
+};
+
+} // namespace rr
+
+#endif /* RR_PTRACE_LATENCY_PROFILE_H_ */
@@ -0,0 +1,162 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <map>
+
+#include "Command.h"
+#include "main.h"
+#include "ScopedFd.h"
+#include "TraceSink.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+namespace rr {
+
+class ReceiveCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  ReceiveCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static ReceiveCommand singleton;
+};
+
+ReceiveCommand ReceiveCommand::singleton(
+    "receive",
+    " rr receive [<trace_dir>]\n"
+    "  Read a trace streamed by `rr record --stream' from stdin and save it\n"
+    "  in <trace_dir>. By default a new directory is created where rr\n"
+    "  record would have saved the trace.\n");
+
+/**
+ * Read exactly |size| bytes unless we hit end of file first. Returns the
+ * number of bytes read, or -1 on error.
+ */
+static ssize_t read_fully(int fd, void* buf, size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    ssize_t ret = read(fd, static_cast<char*>(buf) + done, size - done);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret < 0) {
+      return -1;
+    }
+    if (ret == 0) {
+      break;
+    }
+    done += ret;
+  }
+  return done;
+}
+
+static bool read_record(int fd, TraceSink::RecordHeader* header,
+                        string* name) {
+  if (read_fully(fd, header, sizeof(*header)) != sizeof(*header) ||
+      header->name_length > PATH_MAX) {
+    return false;
+  }
+  name->resize(header->name_length);
+  return read_fully(fd, &(*name)[0], name->size()) == (ssize_t)name->size();
+}
+
+/**
+ * Trace files are named relative to the trace directory; don't let a
+ * stream write anywhere else.
+ */
+static bool valid_file_name(const string& name) {
+  return !name.empty() && name.find('/') == string::npos && name != "." &&
+         name != "..";
+}
+
+static int receive(const string& trace_dir, FILE* out) {
+  int in = STDIN_FILENO;
+  TraceSink::RecordHeader header;
+  string name;
+  if (!read_record(in, &header, &name) ||
+      header.type != TraceSink::TRACE_BEGIN) {
+    fprintf(stderr, "Input is not an rr trace stream\n");
+    return 1;
+  }
+  if (header.offset != TraceSink::STREAM_VERSION) {
+    fprintf(stderr, "Unsupported trace stream version %llu\n",
+            (unsigned long long)header.offset);
+    return 1;
+  }
+
+  string dir = trace_dir;
+  if (dir.empty()) {
+    // Strip the sender's "-<nonce>" and pick our own.
+    dir = TraceStream::make_trace_dir(name.substr(0, name.rfind('-')));
+  } else if (mkdir(dir.c_str(), S_IRWXU | S_IRWXG)) {
+    fprintf(stderr, "Can't create trace directory `%s': %s\n", dir.c_str(),
+            strerror(errno));
+    return 1;
+  }
+
+  map<string, ScopedFd> files;
+  vector<char> buf(1024 * 1024);
+  while (read_record(in, &header, &name)) {
+    if (header.type == TraceSink::TRACE_END) {
+      fprintf(out, "rr: Received trace `%s'.\n", dir.c_str());
+      return 0;
+    }
+    if (header.type != TraceSink::FILE_DATA || !valid_file_name(name)) {
+      break;
+    }
+    auto it = files.find(name);
+    if (it == files.end()) {
+      string path = dir + "/" + name;
+      ScopedFd fd(path.c_str(), O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL, 0400);
+      if (!fd.is_open()) {
+        fprintf(stderr, "Can't create `%s': %s\n", path.c_str(),
+                strerror(errno));
+        return 1;
+      }
+      it = files.insert(make_pair(name, move(fd))).first;
+    }
+    uint64_t offset = header.offset;
+    uint64_t remaining = header.length;
+    while (remaining > 0) {
+      size_t amount = (size_t)min<uint64_t>(remaining, buf.size());
+      if (read_fully(in, buf.data(), amount) != (ssize_t)amount) {
+        break;
+      }
+      if (pwrite(it->second, buf.data(), amount, offset) != (ssize_t)amount) {
+        fprintf(stderr, "Can't write to `%s/%s': %s\n", dir.c_str(),
+                name.c_str(), strerror(errno));
+        return 1;
+      }
+      offset += amount;
+      remaining -= amount;
+    }
+    if (remaining > 0) {
+      break;
+    }
+  }
+
+  fprintf(stderr, "Trace stream ended early; `%s' is incomplete\n",
+          dir.c_str());
+  return 1;
+}
+
+int ReceiveCommand::run(std::vector<std::string>& args) {
+  while (parse_global_option(args)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return receive(trace_dir, stdout);
+}
+
+} // namespace rr
@@ -3,14 +3,18 @@
 #include "RecordCommand.h"
 
 #include <assert.h>
+#include <sched.h>
 #include <sysexits.h>
 
 #include "preload/preload_interface.h"
 
+#include "BlockCodec.h"
 #include "Flags.h"
 #include "kernel_metadata.h"
 #include "log.h"
 #include "main.h"
+#include "NumCoresTuner.h"
+#include "PerfCounters.h"
 #include "RecordSession.h"
 #include "util.h"
 
@@ -21,19 +25,90 @@ namespace rr {
 RecordCommand RecordCommand::singleton(
     "record",
     " rr record [OPTION]... <exe> [exe-args]...\n"
+    "  -a, --adaptive-timeslices  tune each task's timeslice, within a factor\n"
+    "                             of 8 of --num-cpu-ticks, from how often it\n"
+    "                             makes syscalls and whether it uses up its\n"
+    "                             timeslices. Reduces context switches for\n"
+    "                             CPU-bound tasks. Ignored with --chaos.\n"
     "  -b, --force-syscall-buffer force the syscall buffer preload library\n"
     "                             to be used, even if that's probably a bad\n"
     "                             idea\n"
     "  -c, --num-cpu-ticks=<NUM>  maximum number of 'CPU ticks' (currently \n"
     "                             retired conditional branches) to allow a \n"
     "                             task to run before interrupting it\n"
+    "  -d, --dedup-raw-data       store repeated 4KB chunks of recorded data\n"
+    "                             only once. Shrinks traces of programs that\n"
+    "                             read the same data repeatedly.\n"
+    "  -e, --eager-patching       when libc, libpthread or the dynamic\n"
+    "                             loader is mapped, patch all its syscall\n"
+    "                             sites that match a syscall hook, instead\n"
+    "                             of waiting for each to be hit first\n"
+    "  -f, --chaos-budget=<N>     chaos mode, but aim for at most N\n"
+    "                             randomized context switches per second,\n"
+    "                             spent mostly at futex and sched_yield\n"
+    "                             calls. Records faster than --chaos, so\n"
+    "                             more runs fit in a bug hunt.\n"
+    "  -g, --syscallbuf-budget=<MB>\n"
+    "                             limit the total memory tracees' syscall\n"
+    "                             buffers may grow to. Each buffer starts at\n"
+    "                             64KB and grows when it keeps filling up.\n"
     "  -h, --chaos                randomize scheduling decisions to try to \n"
     "                             reproduce bugs\n"
+    "  -H, --hw-telemetry         count each tracee task's cycles,\n"
+    "                             instructions and context switches while\n"
+    "                             recording and print their IPC when done\n"
     "  -i, --ignore-signal=<SIG>  block <SIG> from being delivered to \n"
     "                             tracees. Probably only useful for unit \n"
     "                             tests.\n"
+    "  -j, --metrics-file=<FILE>  every second, replace <FILE> with\n"
+    "                             recording throughput metrics (events,\n"
+    "                             traced and buffered syscalls, trace bytes\n"
+    "                             and compression backlog, ...) in\n"
+    "                             Prometheus text format\n"
+    "  -k, --patch-cache=<DIR>    remember in DIR which syscall sites were\n"
+    "                             patched in each library and executable,\n"
+    "                             and patch them up front the next time\n"
+    "                             they're loaded. Speeds up recording\n"
+    "                             short-lived processes.\n"
+    "  -l, --lazy-mappings=<MB>   instead of copying read-only private file\n"
+    "                             mappings of at least <MB> into the trace,\n"
+    "                             record a hash of their contents. Replay\n"
+    "                             then maps the original files, and fails if\n"
+    "                             they have changed.\n"
+    "  -m, --write-buffer=<MB>    memory to use for trace data waiting to be\n"
+    "                             compressed. Larger values absorb bursts\n"
+    "                             without stalling tracees.\n"
     "  -n, --no-syscall-buffer    disable the syscall buffer preload \n"
     "                             library even if it would otherwise be used\n"
+    "  -o, --stream=<DEST>        also stream the trace to DEST while\n"
+    "                             recording: `fd:<N>' for an inherited pipe\n"
+    "                             or socket, `unix:<PATH>' for a Unix socket,\n"
+    "                             otherwise a shell command that reads the\n"
+    "                             stream on stdin, e.g. `ssh host rr receive'\n"
+    "  -O, --stream-only=<DEST>   like --stream, but don't keep a local copy\n"
+    "                             of the trace\n"
+    "  -p, --spill-uncompressed   when compression can't keep up, write trace\n"
+    "                             blocks uncompressed instead of stalling\n"
+    "                             tracees\n"
+    "  -P, --syscall-profile      print how much time rr spent recording each\n"
+    "                             syscall, traced and buffered, when done\n"
+    "  -q, --num-cores=<N>|auto   tell tracees they have N cores (default 1)\n"
+    "                             so they size thread pools for it. With\n"
+    "                             `auto', try powers of two up to the real\n"
+    "                             core count over successive recordings of\n"
+    "                             the same executable, then keep using the\n"
+    "                             one that recorded fastest. Recording times\n"
+    "                             are kept in `num-cores-history' in the\n"
+    "                             trace save directory.\n"
+    "  -Q, --ptrace-latency       print histograms of how long tracees\n"
+    "                             waited for a CPU after rr resumed them,\n"
+    "                             how long ptrace stops took to wake rr up\n"
+    "                             and how long rr took to handle them, per\n"
+    "                             kind of stop, when done\n"
+    "  -r, --cpus=<LIST>          bind tracees to the least loaded of these\n"
+    "                             CPUs, e.g. `2,3,8-11', instead of a random\n"
+    "                             one. Compression threads are always kept\n"
+    "                             off the CPU tracees are bound to.\n"
     "  -s, --always-switch        tryto context switch at every rr event\n"
     "  -t, --continue-through-signal=<SIG>\n"
     "                             Unhandled <SIG> signals will be ignored\n"
@@ -47,7 +122,45 @@ RecordCommand RecordCommand::singleton(
     "  -v, --env=NAME=VALUE       value to add to the environment of the\n"
     "                             tracee. There can be any number of these.\n"
     "  -w, --wait                 Wait for all child processes to exit, not\n"
-    "                             just the initial process\n");
+    "                             just the initial process\n"
+    "  -W, --object-store=<DIR>   keep mapped files that would be copied\n"
+    "                             into the trace, or can't be hardlinked\n"
+    "                             into it, in the content-addressed store\n"
+    "                             DIR and hardlink them from there, so\n"
+    "                             traces on DIR's filesystem share one copy\n"
+    "                             of each. Objects no trace refers to any\n"
+    "                             more are deleted after an hour.\n"
+    "  -x, --write-stats          print how long trace writing held up\n"
+    "                             recording, per substream, and how long\n"
+    "                             startup took, when done\n"
+    "  -X, --disable-cpuid-faulting\n"
+    "                             let tracees execute cpuid directly even\n"
+    "                             when the CPU can trap it. The trace then\n"
+    "                             only replays on CPUs with the same cpuid\n"
+    "                             results, but doesn't need CPUID faulting.\n"
+    "  -y, --reference-file-reads record large reads from regular files as\n"
+    "                             references into reflinked snapshots of\n"
+    "                             the files in the trace directory, instead\n"
+    "                             of copying the data. Needs a filesystem\n"
+    "                             with reflinks (btrfs, XFS).\n"
+    "  -z, --compression=<CODEC>[:<LEVEL>]\n"
+    "                             compress the trace with CODEC, one of\n"
+    "                             `zlib' (the default), `zstd' or `lz4'\n"
+    "                             (if supported by this build), or `none'\n"
+    "                             to store it uncompressed for the fastest\n"
+    "                             replay. LEVEL is passed to the codec; for\n"
+    "                             lz4 it is the acceleration factor. Replay\n"
+    "                             detects the codec automatically.\n"
+    "  -Z, --substream-compression=<SUBSTREAM>:<KEY>=<VALUE>[,...]\n"
+    "                             override how one trace substream (events,\n"
+    "                             data_header, data, mmaps, tasks or\n"
+    "                             strings) is compressed: `block=<KB>' sets\n"
+    "                             its block size, `threads=<N>' its number\n"
+    "                             of compression threads and\n"
+    "                             `codec=<CODEC>[:<LEVEL>]' its codec, e.g.\n"
+    "                             `-Z data:threads=8,codec=lz4'. Can be\n"
+    "                             given once per substream. -x reports how\n"
+    "                             fast each substream compressed.\n");
 
 struct RecordFlags {
   vector<string> extra_env;
@@ -75,10 +188,70 @@ struct RecordFlags {
   /* Whether to enable chaos mode in the scheduler */
   RecordSession::Chaos chaos;
 
+  /* Chaos-induced context switches per second to aim for, or 0 for no
+   * limit. */
+  int chaos_switch_budget;
+
+  /* Whether the scheduler tunes timeslices per task */
+  bool adaptive_timeslices;
+
   /* True if we should wait for all processes to exit before finishing
    * recording. */
   bool wait_for_all;
 
+  /* How trace data is compressed. */
+  CompressionOptions compression;
+
+  /* Whether to store repeated chunks of raw data only once. */
+  bool dedup_raw_data;
+
+  /* Total syscallbuf memory tracees may grow to, or 0 for no limit. */
+  size_t syscallbuf_budget;
+
+  /* Minimum size of file mappings to record lazily, or 0. */
+  uint64_t lazy_mapping_threshold;
+
+  /* Whether to record file reads as references to file snapshots. */
+  bool reference_file_reads;
+
+  /* Whether to patch system libraries' syscalls as soon as they're mapped. */
+  bool eager_patching;
+
+  /* Where to persist patched syscall sites, if anywhere. */
+  string patch_cache_dir;
+
+  /* Where to share mapped files between traces, if anywhere. */
+  string object_store_dir;
+
+  /* Whether to print trace writer statistics at the end. */
+  bool write_stats;
+
+  /* Whether to trap and record tracees' cpuid when the CPU supports it. */
+  RecordSession::CpuidFaulting cpuid_faulting;
+
+  /* Whether to print per-syscall recording overhead at the end. */
+  bool syscall_profile;
+
+  /* Whether to count and print tracees' cycles and instructions. */
+  bool hw_telemetry;
+
+  /* Whether to print ptrace stop latency histograms at the end. */
+  bool ptrace_latency;
+
+  /* Where to keep writing recording metrics, if anywhere. */
+  string metrics_file;
+
+  /* Number of cores to report to tracees; 0 for the scheduler's default,
+   * -1 to choose it with NumCoresTuner. */
+  int num_cores;
+
+  /* CPUs to choose the one to bind to from. Empty means all. */
+  vector<int> cpus;
+
+  /* Where to stream the trace while recording, if anywhere. */
+  string stream_destination;
+  bool stream_only;
+
   RecordFlags()
       : max_ticks(Scheduler::DEFAULT_MAX_TICKS),
         ignore_sig(0),
@@ -87,7 +260,21 @@ struct RecordFlags {
         bind_cpu(RecordSession::BIND_CPU),
         always_switch(false),
         chaos(RecordSession::DISABLE_CHAOS),
-        wait_for_all(false) {}
+        chaos_switch_budget(0),
+        adaptive_timeslices(false),
+        wait_for_all(false),
+        dedup_raw_data(false),
+        syscallbuf_budget(0),
+        lazy_mapping_threshold(0),
+        reference_file_reads(false),
+        eager_patching(false),
+        write_stats(false),
+        cpuid_faulting(RecordSession::ENABLE_CPUID_FAULTING),
+        syscall_profile(false),
+        hw_telemetry(false),
+        ptrace_latency(false),
+        num_cores(0),
+        stream_only(false) {}
 };
 
 static bool parse_record_arg(std::vector<std::string>& args,
@@ -97,16 +284,39 @@ static bool parse_record_arg(std::vector<std::string>& args,
   }
 
   static const OptionSpec options[] = {
+    { 'a', "adaptive-timeslices", NO_PARAMETER },
     { 'b', "force-syscall-buffer", NO_PARAMETER },
     { 'c', "num-cpu-ticks", HAS_PARAMETER },
+    { 'd', "dedup-raw-data", NO_PARAMETER },
+    { 'e', "eager-patching", NO_PARAMETER },
+    { 'f', "chaos-budget", HAS_PARAMETER },
+    { 'g', "syscallbuf-budget", HAS_PARAMETER },
     { 'h', "chaos", NO_PARAMETER },
+    { 'H', "hw-telemetry", NO_PARAMETER },
     { 'i', "ignore-signal", HAS_PARAMETER },
+    { 'j', "metrics-file", HAS_PARAMETER },
+    { 'k', "patch-cache", HAS_PARAMETER },
+    { 'l', "lazy-mappings", HAS_PARAMETER },
+    { 'm', "write-buffer", HAS_PARAMETER },
     { 'n', "no-syscall-buffer", NO_PARAMETER },
+    { 'o', "stream", HAS_PARAMETER },
+    { 'O', "stream-only", HAS_PARAMETER },
+    { 'p', "spill-uncompressed", NO_PARAMETER },
+    { 'P', "syscall-profile", NO_PARAMETER },
+    { 'q', "num-cores", HAS_PARAMETER },
+    { 'Q', "ptrace-latency", NO_PARAMETER },
+    { 'r', "cpus", HAS_PARAMETER },
     { 's', "always-switch", NO_PARAMETER },
     { 't', "continue-through-signal", HAS_PARAMETER },
     { 'u', "cpu-unbound", NO_PARAMETER },
     { 'v', "env", HAS_PARAMETER },
-    { 'w', "wait", NO_PARAMETER }
+    { 'w', "wait", NO_PARAMETER },
+    { 'W', "object-store", HAS_PARAMETER },
+    { 'x', "write-stats", NO_PARAMETER },
+    { 'X', "disable-cpuid-faulting", NO_PARAMETER },
+    { 'y', "reference-file-reads", NO_PARAMETER },
+    { 'z', "compression", HAS_PARAMETER },
+    { 'Z', "substream-compression", HAS_PARAMETER }
   };
   ParsedOption opt;
   auto args_copy = args;
@@ -115,6 +325,9 @@ static bool parse_record_arg(std::vector<std::string>& args,
   }
 
   switch (opt.short_name) {
+    case 'a':
+      flags.adaptive_timeslices = true;
+      break;
     case 'b':
       flags.use_syscall_buffer = RecordSession::ENABLE_SYSCALL_BUF;
       break;
@@ -124,19 +337,92 @@ static bool parse_record_arg(std::vector<std::string>& args,
       }
       flags.max_ticks = opt.int_value;
       break;
+    case 'd':
+      flags.dedup_raw_data = true;
+      break;
+    case 'e':
+      flags.eager_patching = true;
+      break;
+    case 'f':
+      if (!opt.verify_valid_int(1, 1000000)) {
+        return false;
+      }
+      LOG(info) << "Enabled chaos mode with a budget of " << opt.int_value
+                << " switches/s";
+      flags.chaos = RecordSession::ENABLE_CHAOS;
+      flags.chaos_switch_budget = (int)opt.int_value;
+      break;
+    case 'g':
+      if (!opt.verify_valid_int(1, 1024 * 1024)) {
+        return false;
+      }
+      flags.syscallbuf_budget = (size_t)opt.int_value * 1024 * 1024;
+      break;
     case 'h':
       LOG(info) << "Enabled chaos mode";
       flags.chaos = RecordSession::ENABLE_CHAOS;
       break;
+    case 'H':
+      flags.hw_telemetry = true;
+      break;
+    case 'Q':
+      flags.ptrace_latency = true;
+      break;
     case 'i':
       if (!opt.verify_valid_int(1, _NSIG - 1)) {
         return false;
       }
       flags.ignore_sig = opt.int_value;
       break;
+    case 'j':
+      flags.metrics_file = opt.value;
+      break;
+    case 'k':
+      flags.patch_cache_dir = opt.value;
+      break;
+    case 'l':
+      if (!opt.verify_valid_int(1, 1024 * 1024 * 1024)) {
+        return false;
+      }
+      flags.lazy_mapping_threshold = (uint64_t)opt.int_value * 1024 * 1024;
+      break;
+    case 'm':
+      if (!opt.verify_valid_int(1, 1024 * 1024)) {
+        return false;
+      }
+      flags.compression.memory_budget = (size_t)opt.int_value * 1024 * 1024;
+      break;
     case 'n':
       flags.use_syscall_buffer = RecordSession::DISABLE_SYSCALL_BUF;
       break;
+    case 'o':
+    case 'O':
+      flags.stream_destination = opt.value;
+      flags.stream_only = opt.short_name == 'O';
+      break;
+    case 'p':
+      flags.compression.spill_uncompressed = true;
+      break;
+    case 'P':
+      flags.syscall_profile = true;
+      break;
+    case 'q':
+      if (opt.value == "auto") {
+        flags.num_cores = -1;
+        break;
+      }
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.num_cores = (int)opt.int_value;
+      break;
+    case 'r':
+      flags.cpus.clear();
+      if (!parse_cpu_list(opt.value, &flags.cpus)) {
+        fprintf(stderr, "Invalid CPU list `%s'\n", opt.value.c_str());
+        return false;
+      }
+      break;
     case 's':
       flags.always_switch = true;
       break;
@@ -155,6 +441,28 @@ static bool parse_record_arg(std::vector<std::string>& args,
     case 'w':
       flags.wait_for_all = true;
       break;
+    case 'W':
+      flags.object_store_dir = opt.value;
+      break;
+    case 'x':
+      flags.write_stats = true;
+      break;
+    case 'X':
+      flags.cpuid_faulting = RecordSession::DISABLE_CPUID_FAULTING;
+      break;
+    case 'y':
+      flags.reference_file_reads = true;
+      break;
+    case 'z':
+      if (!opt.verify_valid_compression(&flags.compression)) {
+        return false;
+      }
+      break;
+    case 'Z':
+      if (!opt.verify_valid_substream_compression(&flags.compression)) {
+        return false;
+      }
+      break;
     default:
       assert(0 && "Unknown option");
   }
@@ -196,18 +504,58 @@ static void setup_session_from_flags(RecordSession& session,
                                      const RecordFlags& flags) {
   session.scheduler().set_max_ticks(flags.max_ticks);
   session.scheduler().set_always_switch(flags.always_switch);
+  session.scheduler().set_adaptive_timeslices(flags.adaptive_timeslices);
+  session.scheduler().set_chaos_switch_budget(flags.chaos_switch_budget);
   session.set_ignore_sig(flags.ignore_sig);
   session.set_continue_through_sig(flags.continue_through_sig);
   session.set_wait_for_all(flags.wait_for_all);
+  session.trace_writer().set_dedup_raw_data(flags.dedup_raw_data);
+  session.trace_writer().set_lazy_mapping_threshold(
+      flags.lazy_mapping_threshold);
+  session.trace_writer().set_file_reads_by_reference(
+      flags.reference_file_reads);
+  session.syscall_profile().set_enabled(flags.syscall_profile);
+  session.perf_telemetry().set_enabled(flags.hw_telemetry);
+  session.ptrace_latency().set_enabled(flags.ptrace_latency);
+  session.record_metrics().set_path(flags.metrics_file);
+  session.set_syscallbuf_budget(flags.syscallbuf_budget);
+  session.set_eager_syscall_patching(flags.eager_patching);
+  if (!flags.patch_cache_dir.empty()) {
+    session.patch_site_cache().set_dir(flags.patch_cache_dir);
+  }
+  if (!flags.object_store_dir.empty()) {
+    session.trace_writer().set_object_store(flags.object_store_dir);
+  }
 }
 
 static int record(const vector<string>& args, const RecordFlags& flags) {
   LOG(info) << "Start recording...";
+  double startup_time = monotonic_now_sec();
 
-  auto session =
-      RecordSession::create(args, flags.extra_env, flags.use_syscall_buffer,
-                            flags.bind_cpu, flags.chaos);
+  shared_ptr<TraceSink> sink;
+  if (!flags.stream_destination.empty()) {
+    sink = TraceSink::open(flags.stream_destination, !flags.stream_only);
+    if (!sink) {
+      return 1;
+    }
+  }
+
+  auto session = RecordSession::create(
+      args, flags.extra_env, flags.use_syscall_buffer, flags.bind_cpu,
+      flags.chaos, flags.compression, sink, flags.cpus, flags.cpuid_faulting);
   setup_session_from_flags(*session, flags);
+  double session_seconds = monotonic_now_sec() - startup_time;
+  double first_exec_seconds = 0;
+
+  unique_ptr<NumCoresTuner> num_cores_tuner;
+  if (flags.num_cores < 0) {
+    num_cores_tuner = unique_ptr<NumCoresTuner>(new NumCoresTuner(
+        TraceStream::save_dir() + "/num-cores-history", args[0]));
+    session->scheduler().set_pretend_num_cores(num_cores_tuner->choose());
+  } else if (flags.num_cores > 0) {
+    session->scheduler().set_pretend_num_cores(flags.num_cores);
+  }
+  double start_time = monotonic_now_sec();
 
   // Install signal handlers after creating the session, to ensure they're not
   // inherited by the tracee.
@@ -217,12 +565,38 @@ static int record(const vector<string>& args, const RecordFlags& flags) {
   do {
     bool done_initial_exec = session->done_initial_exec();
     step_result = session->record_step();
+    session->record_metrics().maybe_write(*session);
+    session->trace_writer().maybe_flush_for_followers();
     if (!done_initial_exec && session->done_initial_exec()) {
       session->trace_writer().make_latest_trace();
+      first_exec_seconds = monotonic_now_sec() - startup_time;
     }
   } while (step_result.status == RecordSession::STEP_CONTINUE && !term_request);
 
   session->terminate_recording();
+  session->record_metrics().write(*session);
+  if (num_cores_tuner && step_result.status == RecordSession::STEP_EXITED) {
+    num_cores_tuner->add_recording(session->scheduler().pretend_num_cores(),
+                                   monotonic_now_sec() - start_time);
+  }
+  if (flags.write_stats) {
+    session->trace_writer().dump_write_stats(stderr);
+    fprintf(stderr, "  peak tracee syscallbuf memory: %zu KB\n",
+            session->peak_syscallbuf_bytes() / 1024);
+    fprintf(stderr, "Startup: %.1fms to create the session (%.1fms of PMU "
+                    "self-tests), %.1fms to the tracee's first exec\n",
+            session_seconds * 1000, PerfCounters::probe_seconds() * 1000,
+            first_exec_seconds * 1000);
+  }
+  if (flags.syscall_profile) {
+    session->syscall_profile().dump(stderr);
+  }
+  if (flags.hw_telemetry) {
+    session->perf_telemetry().dump(stderr);
+  }
+  if (flags.ptrace_latency) {
+    session->ptrace_latency().dump(stderr);
+  }
 
   switch (step_result.status) {
     case RecordSession::STEP_CONTINUE:
@@ -0,0 +1,149 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "RecordMetrics.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "RecordSession.h"
+#include "log.h"
+#include "util.h"
+
+using namespace std;
+
+namespace rr {
+
+typedef TraceStream::Substream Substream;
+
+static Substream operator++(Substream& s) {
+  s = (Substream)(s + 1);
+  return s;
+}
+
+// How often maybe_write() rewrites the file.
+static const double WRITE_INTERVAL_SECONDS = 1.0;
+
+static void write_header(FILE* out, const char* name, const char* type,
+                         const char* help) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void write_value(FILE* out, const char* name, const char* type,
+                        const char* help, uint64_t value) {
+  write_header(out, name, type, help);
+  fprintf(out, "%s %" PRIu64 "\n", name, value);
+}
+
+void RecordMetrics::write_metrics(RecordSession& session, FILE* out,
+                                  double now) {
+  TraceWriter& trace = session.trace_writer();
+  TraceFrame::Time events = trace.time();
+  double interval = now - last_write_seconds;
+
+  write_value(out, "rr_record_events_total", "counter",
+              "Events recorded in the trace.", events);
+  write_header(out, "rr_record_events_per_second", "gauge",
+               "Events recorded per second since the last update.");
+  fprintf(out, "rr_record_events_per_second %.1f\n",
+          interval > 0 ? (events - last_write_events) / interval : 0.0);
+  write_header(out, "rr_record_seconds", "gauge",
+               "Seconds since recording started.");
+  fprintf(out, "rr_record_seconds %.3f\n", now - start_seconds);
+  write_value(out, "rr_record_traced_syscalls_total", "counter",
+              "Syscalls recorded through ptrace stops.", traced_syscalls);
+  write_value(out, "rr_record_buffered_syscalls_total", "counter",
+              "Syscalls recorded through the syscall buffer.",
+              buffered_syscalls);
+  write_value(out, "rr_record_syscallbuf_flushes_total", "counter",
+              "Syscall buffer flushes recorded.", syscallbuf_flushes);
+  write_value(out, "rr_record_task_switches_total", "counter",
+              "Times the scheduler switched to a different tracee task.",
+              task_switches);
+  write_value(out, "rr_record_ptrace_stops_total", "counter",
+              "Tracee stops reported by waitpid and handled.", ptrace_stops);
+  write_value(out, "rr_record_ptrace_calls_total", "counter",
+              "ptrace calls made by the recorder.",
+              session.statistics().ptrace_calls);
+
+  CompressedWriter::Progress progress[TraceStream::SUBSTREAM_COUNT];
+  for (Substream s = TraceStream::SUBSTREAM_FIRST;
+       s < TraceStream::SUBSTREAM_COUNT; ++s) {
+    progress[s] = trace.progress(s);
+  }
+  struct {
+    const char* name;
+    const char* type;
+    const char* help;
+    uint64_t CompressedWriter::Progress::*field;
+  } per_substream[] = {
+    { "rr_record_substream_bytes_total", "counter",
+      "Uncompressed bytes written to each trace substream.",
+      &CompressedWriter::Progress::bytes },
+    { "rr_record_substream_compressed_bytes_total", "counter",
+      "Compressed bytes produced for each trace substream.",
+      &CompressedWriter::Progress::compressed_bytes },
+    { "rr_record_compression_backlog_bytes", "gauge",
+      "Bytes written to each trace substream but not yet compressed.",
+      &CompressedWriter::Progress::queued_bytes },
+  };
+  for (auto& m : per_substream) {
+    write_header(out, m.name, m.type, m.help);
+    for (Substream s = TraceStream::SUBSTREAM_FIRST;
+         s < TraceStream::SUBSTREAM_COUNT; ++s) {
+      fprintf(out, "%s{substream=\"%s\"} %" PRIu64 "\n", m.name,
+              TraceStream::substream_name(s), progress[s].*m.field);
+    }
+  }
+  write_header(out, "rr_record_compression_blocked_seconds_total", "counter",
+               "Seconds the recorder waited for compression of each trace "
+               "substream.");
+  for (Substream s = TraceStream::SUBSTREAM_FIRST;
+       s < TraceStream::SUBSTREAM_COUNT; ++s) {
+    fprintf(out, "rr_record_compression_blocked_seconds_total{substream=\"%s\"}"
+                 " %.3f\n",
+            TraceStream::substream_name(s), progress[s].blocked_seconds);
+  }
+
+  last_write_seconds = now;
+  last_write_events = events;
+}
+
+void RecordMetrics::maybe_write(RecordSession& session) {
+  if (!enabled()) {
+    return;
+  }
+  double now = monotonic_now_sec();
+  if (!start_seconds) {
+    start_seconds = last_write_seconds = now;
+  }
+  if (now - last_write_seconds >= WRITE_INTERVAL_SECONDS) {
+    write(session);
+  }
+}
+
+void RecordMetrics::write(RecordSession& session) {
+  if (!enabled()) {
+    return;
+  }
+  double now = monotonic_now_sec();
+  if (!start_seconds) {
+    start_seconds = last_write_seconds = now;
+  }
+  // Write a new file and rename it over the old one, so readers always see
+  // a complete set of metrics.
+  string tmp_path = path_ + ".tmp";
+  FILE* out = fopen(tmp_path.c_str(), "w");
+  if (!out) {
+    LOG(warn) << "Can't write metrics to " << tmp_path
+              << "; no longer writing metrics";
+    path_.clear();
+    return;
+  }
+  write_metrics(session, out, now);
+  if (fclose(out) || rename(tmp_path.c_str(), path_.c_str())) {
+    LOG(warn) << "Can't update " << path_ << "; no longer writing metrics";
+    path_.clear();
+  }
+}
+
+} // namespace rr
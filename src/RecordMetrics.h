@@ -0,0 +1,78 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_RECORD_METRICS_H_
+#define RR_RECORD_METRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+#include "TraceFrame.h"
+
+namespace rr {
+
+class RecordSession;
+
+/**
+ * Counts what the recorder is doing and, if given a file, periodically
+ * rewrites it with the counts in Prometheus' text exposition format, so
+ * a long recording can be watched (e.g. through node_exporter's textfile
+ * collector) while it runs. The file is replaced atomically, so readers
+ * never see a partial update.
+ */
+class RecordMetrics {
+public:
+  RecordMetrics()
+      : traced_syscalls(0),
+        buffered_syscalls(0),
+        syscallbuf_flushes(0),
+        task_switches(0),
+        ptrace_stops(0),
+        start_seconds(0),
+        last_write_seconds(0),
+        last_write_events(0) {}
+
+  /**
+   * Write the metrics to |path|. Nothing is written if it's empty.
+   */
+  void set_path(const std::string& path) { path_ = path; }
+  bool enabled() const { return !path_.empty(); }
+
+  void traced_syscall() { ++traced_syscalls; }
+  /**
+   * A syscallbuf flush recorded |syscalls| buffered syscalls.
+   */
+  void syscallbuf_flush(uint32_t syscalls) {
+    ++syscallbuf_flushes;
+    buffered_syscalls += syscalls;
+  }
+  void task_switch() { ++task_switches; }
+  void ptrace_stop() { ++ptrace_stops; }
+
+  /**
+   * Rewrite the metrics file if it hasn't been for a second.
+   */
+  void maybe_write(RecordSession& session);
+  /**
+   * Rewrite the metrics file now.
+   */
+  void write(RecordSession& session);
+
+private:
+  void write_metrics(RecordSession& session, FILE* out, double now);
+
+  std::string path_;
+  uint64_t traced_syscalls;
+  uint64_t buffered_syscalls;
+  uint64_t syscallbuf_flushes;
+  uint64_t task_switches;
+  uint64_t ptrace_stops;
+  double start_seconds;
+  double last_write_seconds;
+  TraceFrame::Time last_write_events;
+};
+
+} // namespace rr
+
+#endif /* RR_RECORD_METRICS_H_ */
@@ -3,6 +3,7 @@
 #include "RecordSession.h"
 
 #include <limits.h>
+#include <sched.h>
 
 #include <algorithm>
 #include <sstream>
@@ -10,12 +11,14 @@
 #include "AutoRemoteSyscalls.h"
 #include "Flags.h"
 #include "ftrace.h"
+#include "HostCpuAllocator.h"
 #include "kernel_metadata.h"
 #include "log.h"
 #include "record_signal.h"
 #include "record_syscall.h"
 #include "RecordTask.h"
 #include "seccomp-bpf.h"
+#include "Timeline.h"
 
 namespace rr {
 
@@ -89,10 +92,79 @@ static int get_num_cpus() {
 }
 
 /**
- * Pick a CPU at random to bind to, unless --cpu-unbound has been given,
- * in which case we return -1.
+ * Read the busy time of every CPU from /proc/stat, in clock ticks.
  */
-static int choose_cpu(RecordSession::BindCPU bind_cpu) {
+static vector<uint64_t> read_cpu_busy_ticks() {
+  vector<uint64_t> busy;
+  FILE* f = fopen("/proc/stat", "r");
+  if (!f) {
+    return busy;
+  }
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    unsigned int cpu;
+    unsigned long long user, nice, system, idle, iowait, irq, softirq;
+    if (sscanf(line, "cpu%u %llu %llu %llu %llu %llu %llu %llu", &cpu, &user,
+               &nice, &system, &idle, &iowait, &irq, &softirq) != 8) {
+      continue;
+    }
+    if (cpu >= busy.size()) {
+      busy.resize(cpu + 1);
+    }
+    busy[cpu] = user + nice + system + irq + softirq;
+  }
+  fclose(f);
+  return busy;
+}
+
+/**
+ * Return the CPU in |cpus| that was least busy over a short sampling
+ * interval, picking at random among equally idle ones. CPUs we aren't
+ * allowed to run on are ignored.
+ */
+static int choose_least_loaded_cpu(const vector<int>& cpus) {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+    CPU_ZERO(&allowed);
+  }
+  vector<uint64_t> before = read_cpu_busy_ticks();
+  usleep(100000);
+  vector<uint64_t> after = read_cpu_busy_ticks();
+
+  vector<int> best;
+  uint64_t best_busy = UINT64_MAX;
+  for (int cpu : cpus) {
+    if (!CPU_ISSET(cpu, &allowed)) {
+      continue;
+    }
+    uint64_t busy = (size_t)cpu < before.size() && (size_t)cpu < after.size()
+                        ? after[cpu] - before[cpu]
+                        : 0;
+    if (busy < best_busy) {
+      best.clear();
+      best_busy = busy;
+    }
+    if (busy == best_busy) {
+      best.push_back(cpu);
+    }
+  }
+  if (best.empty()) {
+    FATAL() << "None of the CPUs given to --cpus are available";
+  }
+  int cpu = best[random() % best.size()];
+  LOG(info) << "Binding to CPU " << cpu << ", busy for " << best_busy
+            << " ticks in the last 100ms";
+  return cpu;
+}
+
+/**
+ * Pick a CPU to bind to, unless --cpu-unbound has been given, in which
+ * case we return -1. If |cpus| is non-empty, choose the least loaded of
+ * those, otherwise any CPU at random. Either way, prefer CPUs no other rr
+ * process on this host is bound to (see HostCpuAllocator).
+ */
+static int choose_cpu(RecordSession::BindCPU bind_cpu,
+                      const vector<int>& cpus) {
   if (bind_cpu == RecordSession::UNBOUND_CPU) {
     return -1;
   }
@@ -111,7 +183,32 @@ static int choose_cpu(RecordSession::BindCPU bind_cpu) {
   // performance win in certain circumstances,
   // presumably due to cheaper context switching and/or
   // better interaction with CPU frequency scaling.
-  return random() % get_num_cpus();
+  HostCpuAllocator& allocator = HostCpuAllocator::get();
+  if (!cpus.empty()) {
+    vector<int> free_cpus = allocator.claim_all_free(cpus);
+    if (!free_cpus.empty()) {
+      int cpu = choose_least_loaded_cpu(free_cpus);
+      allocator.release_all_except(cpu);
+      return cpu;
+    }
+    int cpu = choose_least_loaded_cpu(cpus);
+    allocator.report_contention(cpu, cpus);
+    return cpu;
+  }
+
+  // Try every CPU, starting from a random one.
+  int num_cpus = get_num_cpus();
+  int start = random() % num_cpus;
+  vector<int> all_cpus;
+  for (int i = 0; i < num_cpus; ++i) {
+    all_cpus.push_back((start + i) % num_cpus);
+  }
+  int cpu = allocator.claim_first_free(all_cpus);
+  if (cpu < 0) {
+    cpu = start;
+    allocator.report_contention(cpu, all_cpus);
+  }
+  return cpu;
 }
 
 template <typename T> static remote_ptr<T> mask_low_bit(remote_ptr<T> p) {
@@ -199,7 +296,9 @@ static bool handle_ptrace_exit_event(RecordTask* t) {
 
   record_robust_futex_changes(t);
 
-  t->session().trace_writer().write_task_event(TraceTaskEvent(t->tid));
+  TraceTaskEvent exit_event(t->tid);
+  exit_event.set_exit_code(t->task_group()->exit_code);
+  t->session().trace_writer().write_task_event(exit_event);
 
   // Delete t. t's destructor writes the final EV_(UNSTABLE_)EXIT.
   t->destroy();
@@ -422,6 +521,25 @@ bool RecordSession::handle_ptrace_event(RecordTask* t, StepState* step_state) {
   return true;
 }
 
+/**
+ * Threads tend to exit in bursts, e.g. when a thread pool shuts down. Rather
+ * than pick the exited tasks one reschedule at a time, with every
+ * reschedule scanning all tasks, handle the exit stops that are already
+ * waiting for us in one go.
+ */
+void RecordSession::handle_collected_exit_events() {
+  for (pid_t tid : scheduler().tasks_with_collected_exit()) {
+    RecordTask* t = find_task(tid);
+    if (!t) {
+      continue;
+    }
+    bool ok = t->try_wait();
+    ASSERT(t, ok && t->ptrace_event() == PTRACE_EVENT_EXIT);
+    record_metrics_.ptrace_stop();
+    handle_ptrace_exit_event(t);
+  }
+}
+
 static void debug_exec_state(const char* msg, RecordTask* t) {
   LOG(debug) << msg << ": status=" << HEX(t->status())
              << " pevent=" << t->ptrace_event();
@@ -637,9 +755,17 @@ void RecordSession::syscall_state_changed(RecordTask* t,
          * (if it's not a SYS_restart_syscall restart)
          * will use the original registers. */
         t->ev().Syscall().regs = t->regs();
+        scheduler().on_syscall(t);
       }
 
+      double start = Timeline::enabled() ? Timeline::now_us() : 0;
       last_task_switchable = rec_prepare_syscall(t);
+      if (Timeline::enabled()) {
+        Timeline::complete(Timeline::TRACEE, t->tid, "syscall",
+                           syscall_name(t->ev().Syscall().number, t->arch()) +
+                               " entry",
+                           start);
+      }
 
       debug_exec_state("after cont", t);
       t->ev().Syscall().state = PROCESSING_SYSCALL;
@@ -742,7 +868,13 @@ void RecordSession::syscall_state_changed(RecordTask* t,
        * restarted this will be done in the exit from the
        * restart_syscall */
       if (!may_restart) {
+        double start = Timeline::enabled() ? Timeline::now_us() : 0;
         rec_process_syscall(t);
+        if (Timeline::enabled()) {
+          Timeline::complete(Timeline::TRACEE, t->tid, "syscall",
+                             syscall_name(syscallno, t->arch()) + " exit",
+                             start);
+        }
         if (t->session().done_initial_exec() &&
             Flags::get().check_cached_mmaps) {
           t->vm()->verify(t);
@@ -828,18 +960,37 @@ static void assign_sigval(typename Arch::sigval_t& to,
   to.sival_int = from.sival_int;
 }
 
+/**
+ * If |sigframe| holds the |size| bytes at |addr| in t's memory, copy them
+ * from there into |out| instead of reading them from the tracee.
+ */
+static void read_via_sigframe(RecordTask* t, const vector<uint8_t>& sigframe,
+                              remote_ptr<void> addr, void* out, size_t size) {
+  remote_ptr<void> sp = t->regs().sp();
+  if (addr >= sp && addr + size <= sp + sigframe.size()) {
+    memcpy(out, sigframe.data() + (addr - sp), size);
+  } else {
+    t->read_bytes_helper(addr, size, out);
+  }
+}
+
 /**
  * Take a NativeArch::siginfo_t& here instead of siginfo_t because different
  * versions of system headers have inconsistent field naming.
+ * |sigframe| holds the tracee's memory starting at its stack pointer. We
+ * read siginfo from it when we can, and keep it in sync with what we write.
  */
 template <typename Arch>
 static void setup_sigframe_siginfo_arch(RecordTask* t,
-                                        const NativeArch::siginfo_t& siginfo) {
+                                        const NativeArch::siginfo_t& siginfo,
+                                        vector<uint8_t>* sigframe) {
   remote_ptr<typename Arch::siginfo_t> dest;
   switch (Arch::arch()) {
     case x86: {
       auto p = t->regs().sp().cast<typename Arch::unsigned_word>() + 2;
-      dest = t->read_mem(p);
+      typename Arch::unsigned_word addr;
+      read_via_sigframe(t, *sigframe, p, &addr, sizeof(addr));
+      dest = addr;
       break;
     }
     case x86_64:
@@ -849,7 +1000,8 @@ static void setup_sigframe_siginfo_arch(RecordTask* t,
       assert(0 && "Unknown architecture");
       break;
   }
-  typename Arch::siginfo_t si = t->read_mem(dest);
+  typename Arch::siginfo_t si;
+  read_via_sigframe(t, *sigframe, dest, &si, sizeof(si));
   // Copying this structure field-by-field instead of just memcpy'ing
   // siginfo into si serves two purposes: performs 64->32 conversion if
   // necessary, and ensures garbage in any holes in signfo isn't copied to the
@@ -907,11 +1059,22 @@ static void setup_sigframe_siginfo_arch(RecordTask* t,
       break;
   }
   t->write_mem(dest, si);
+
+  uintptr_t sp = t->regs().sp().as_int();
+  uintptr_t start = max(sp, dest.as_int());
+  uintptr_t end = min(sp + sigframe->size(), (dest + 1).as_int());
+  if (start < end) {
+    memcpy(sigframe->data() + (start - sp),
+           reinterpret_cast<uint8_t*>(&si) + (start - dest.as_int()),
+           end - start);
+  }
 }
 
-static void setup_sigframe_siginfo(RecordTask* t, const siginfo_t& siginfo) {
+static void setup_sigframe_siginfo(RecordTask* t, const siginfo_t& siginfo,
+                                   vector<uint8_t>* sigframe) {
   RR_ARCH_FUNCTION(setup_sigframe_siginfo_arch, t->arch(), t,
-                   *reinterpret_cast<const NativeArch::siginfo_t*>(&siginfo));
+                   *reinterpret_cast<const NativeArch::siginfo_t*>(&siginfo),
+                   sigframe);
 }
 
 /**
@@ -985,8 +1148,11 @@ static void preinject_signal(RecordTask* t) {
  * Returns true if the signal should be delivered.
  * Returns false if this signal should not be delivered because another signal
  * occurred during delivery.
+ * On success, |sigframe| is set to the |sigframe_size| bytes starting at the
+ * handler's stack pointer, or as many of them as are mapped.
  */
-static bool inject_handled_signal(RecordTask* t) {
+static bool inject_handled_signal(RecordTask* t, size_t sigframe_size,
+                                  vector<uint8_t>* sigframe) {
   preinject_signal(t);
 
   int sig = t->ev().Signal().siginfo.si_signo;
@@ -1015,13 +1181,19 @@ static bool inject_handled_signal(RecordTask* t) {
   ASSERT(t, t->pending_sig() == SIGTRAP);
   ASSERT(t, t->get_signal_user_handler(sig) == t->ip());
 
+  // Read the sigframe once, both to record it and to find the siginfo in.
+  sigframe->resize(sigframe_size);
+  ssize_t nread =
+      t->read_bytes_fallible(t->regs().sp(), sigframe_size, sigframe->data());
+  sigframe->resize(max<ssize_t>(0, nread));
+
   if (t->signal_handler_takes_siginfo(sig)) {
     // The kernel copied siginfo into userspace so it can pass a pointer to
     // the signal handler. Replace the contents of that siginfo with
     // the exact data we want to deliver. (We called Task::set_siginfo
     // above to set that data, but the kernel sanitizes the passed-in data
     // which wipes out certain fields; e.g. we can't set SI_KERNEL in si_code.)
-    setup_sigframe_siginfo(t, t->ev().Signal().siginfo);
+    setup_sigframe_siginfo(t, t->ev().Signal().siginfo, sigframe);
   }
   return true;
 }
@@ -1062,7 +1234,7 @@ void RecordSession::signal_state_changed(RecordTask* t, StepState* step_state) {
       // the point of signal delivery.
       t->record_current_event();
       t->ev().transform(EV_SIGNAL_DELIVERY);
-      ssize_t sigframe_size = 0;
+      vector<uint8_t> sigframe;
 
       bool blocked = t->is_sig_blocked(sig);
       // If this is the signal delivered by a sigsuspend, then clear
@@ -1076,16 +1248,6 @@ void RecordSession::signal_state_changed(RecordTask* t, StepState* step_state) {
         LOG(debug) << "  " << t->tid << ": " << signal_name(sig)
                    << " has user handler";
 
-        if (!inject_handled_signal(t)) {
-          // Signal delivery isn't happening. Prepare to process the new
-          // signal that aborted signal delivery.
-          t->signal_delivered(sig);
-          t->pop_event(EV_SIGNAL_DELIVERY);
-          step_state->continue_type = DONT_CONTINUE;
-          last_task_switchable = PREVENT_SWITCH;
-          break;
-        }
-
         // It's somewhat difficult engineering-wise to
         // compute the sigframe size at compile time,
         // and it can vary across kernel versions.  So
@@ -1104,7 +1266,17 @@ void RecordSession::signal_state_changed(RecordTask* t, StepState* step_state) {
         // future, and unit tests that use sighandlers
         // are run with checksumming enabled, then
         // they can catch errors here.
-        sigframe_size = 2048;
+        static const size_t sigframe_size = 2048;
+
+        if (!inject_handled_signal(t, sigframe_size, &sigframe)) {
+          // Signal delivery isn't happening. Prepare to process the new
+          // signal that aborted signal delivery.
+          t->signal_delivered(sig);
+          t->pop_event(EV_SIGNAL_DELIVERY);
+          step_state->continue_type = DONT_CONTINUE;
+          last_task_switchable = PREVENT_SWITCH;
+          break;
+        }
 
         t->ev().transform(EV_SIGNAL_HANDLER);
         t->signal_delivered(sig);
@@ -1129,8 +1301,13 @@ void RecordSession::signal_state_changed(RecordTask* t, StepState* step_state) {
       }
 
       // We record this data regardless to simplify replay. If the addresses
-      // are unmapped, write 0 bytes.
-      t->record_remote_fallible(t->regs().sp(), sigframe_size);
+      // are unmapped, write 0 bytes. inject_handled_signal already read
+      // the sigframe, so don't read it again.
+      if (sigframe.empty()) {
+        t->record_remote_fallible(t->regs().sp(), 0);
+      } else {
+        t->record_local(t->regs().sp(), sigframe.size(), sigframe.data());
+      }
 
       // This event is used by the replayer to set up the
       // signal handler frame, or to record the resulting
@@ -1248,6 +1425,7 @@ void RecordSession::runnable_state_changed(RecordTask* t,
       t->pop_noop();
       break;
     case EV_SEGV_RDTSC:
+    case EV_SEGV_CPUID:
       t->record_current_event();
       t->pop_event(t->ev().type());
       break;
@@ -1354,7 +1532,9 @@ static string find_syscall_buffer_library() {
 
 /*static*/ RecordSession::shr_ptr RecordSession::create(
     const vector<string>& argv, const vector<string>& extra_env,
-    SyscallBuffering syscallbuf, BindCPU bind_cpu, Chaos chaos) {
+    SyscallBuffering syscallbuf, BindCPU bind_cpu, Chaos chaos,
+    const CompressionOptions& compression, shared_ptr<TraceSink> sink,
+    const vector<int>& cpus, CpuidFaulting cpuid_faulting) {
   // The syscallbuf library interposes some critical
   // external symbols like XShmQueryExtension(), so we
   // preload it whether or not syscallbuf is enabled. Indicate here whether
@@ -1429,22 +1609,34 @@ static string find_syscall_buffer_library() {
   env.push_back("MOZ_GDB_SLEEP=0");
 
   shr_ptr session(
-      new RecordSession(argv, env, cwd, syscallbuf, bind_cpu, chaos));
+      new RecordSession(argv, env, cwd, syscallbuf, bind_cpu, chaos,
+                        compression, sink, cpus, cpuid_faulting));
   return session;
 }
 
 RecordSession::RecordSession(const std::vector<std::string>& argv,
                              const std::vector<std::string>& envp,
                              const string& cwd, SyscallBuffering syscallbuf,
-                             BindCPU bind_cpu, Chaos chaos)
-    : trace_out(argv, envp, cwd, choose_cpu(bind_cpu)),
+                             BindCPU bind_cpu, Chaos chaos,
+                             const CompressionOptions& compression,
+                             shared_ptr<TraceSink> sink,
+                             const vector<int>& cpus,
+                             CpuidFaulting cpuid_faulting)
+    : trace_out(argv, envp, cwd, choose_cpu(bind_cpu, cpus),
+                cpuid_faulting == ENABLE_CPUID_FAULTING &&
+                    cpuid_faulting_works(),
+                compression, sink),
       scheduler_(*this),
+      syscallbuf_budget(0),
+      syscallbuf_bytes_in_use(0),
+      syscallbuf_bytes_peak(0),
       ignore_sig(0),
       continue_through_sig(0),
       last_task_switchable(PREVENT_SWITCH),
       use_syscall_buffer_(syscallbuf == ENABLE_SYSCALL_BUF),
       enable_chaos_(false),
-      wait_for_all_(false) {
+      wait_for_all_(false),
+      eager_syscall_patching_(false) {
   scheduler().set_enable_chaos(chaos == ENABLE_CHAOS);
   set_enable_chaos(chaos == ENABLE_CHAOS);
   RecordTask* t = static_cast<RecordTask*>(Task::spawn(*this, trace_out));
@@ -1471,7 +1663,16 @@ RecordSession::RecordResult RecordSession::record_step() {
   result.status = STEP_CONTINUE;
 
   RecordTask* prev_task = scheduler().current();
+  double reschedule_start = Timeline::enabled() ? Timeline::now_us() : 0;
   auto rescheduled = scheduler().reschedule(last_task_switchable);
+  if (Timeline::enabled()) {
+    Timeline::complete(Timeline::RR_THREAD, Timeline::current_thread(),
+                       "sched", "reschedule", reschedule_start);
+    if (scheduler().current() && scheduler().current() != prev_task) {
+      Timeline::instant(Timeline::TRACEE, scheduler().current()->tid, "sched",
+                        "switched in");
+    }
+  }
   if (rescheduled.interrupted_by_signal) {
     // The scheduler was waiting for some task to become active, but was
     // interrupted by a signal. Yield to our caller now to give the caller
@@ -1480,6 +1681,15 @@ RecordSession::RecordResult RecordSession::record_step() {
     return result;
   }
   RecordTask* t = scheduler().current();
+  if (rescheduled.by_waitpid) {
+    record_metrics_.ptrace_stop();
+  }
+  if (t != prev_task) {
+    record_metrics_.task_switch();
+  }
+  if (perf_telemetry_.enabled()) {
+    perf_telemetry_.start(t);
+  }
   if (prev_task && prev_task->ev().type() == EV_SCHED) {
     if (prev_task != t) {
       // We did do a context switch, so record the SCHED event. Otherwise
@@ -1504,6 +1714,7 @@ RecordSession::RecordResult RecordSession::record_step() {
 #endif
   if (handle_ptrace_exit_event(t)) {
     // t is dead and has been deleted.
+    handle_collected_exit_events();
     return result;
   }
 
@@ -1533,9 +1744,24 @@ RecordSession::RecordResult RecordSession::record_step() {
       case EV_DESCHED:
         desched_state_changed(t);
         break;
-      case EV_SYSCALL:
-        syscall_state_changed(t, &step_state);
+      case EV_SYSCALL: {
+        bool entry = t->ev().Syscall().state == ENTERING_SYSCALL &&
+                     !t->ev().Syscall().is_restart;
+        if (entry) {
+          record_metrics_.traced_syscall();
+        }
+        if (syscall_profile_.enabled()) {
+          SupportedArch arch = t->ev().Syscall().arch();
+          int syscallno = t->ev().Syscall().number;
+          double start = monotonic_now_sec();
+          syscall_state_changed(t, &step_state);
+          syscall_profile_.traced_stop(arch, syscallno, entry,
+                                       monotonic_now_sec() - start);
+        } else {
+          syscall_state_changed(t, &step_state);
+        }
         break;
+      }
       case EV_SIGNAL:
       case EV_SIGNAL_DELIVERY:
         signal_state_changed(t, &step_state);
@@ -1580,6 +1806,7 @@ void RecordSession::terminate_recording() {
                    Event(EV_TRACE_TERMINATION, NO_EXEC_INFO, RR_NATIVE_ARCH),
                    t ? t->tick_count() : 0);
   trace_out.write_frame(frame);
+  trace_out.set_pretend_num_cores(scheduler().pretend_num_cores());
   trace_out.close();
 }
 
@@ -1593,7 +1820,23 @@ void RecordSession::on_create(Task* t) {
   scheduler().on_create(static_cast<RecordTask*>(t));
 }
 
+bool RecordSession::reserve_syscallbuf_bytes(size_t bytes, bool force) {
+  if (!force && syscallbuf_budget &&
+      syscallbuf_bytes_in_use + bytes > syscallbuf_budget) {
+    return false;
+  }
+  syscallbuf_bytes_in_use += bytes;
+  syscallbuf_bytes_peak = max(syscallbuf_bytes_peak, syscallbuf_bytes_in_use);
+  return true;
+}
+
 void RecordSession::on_destroy(Task* t) {
+  if (perf_telemetry_.enabled()) {
+    perf_telemetry_.stop(static_cast<RecordTask*>(t));
+  }
+  if (ptrace_latency_.enabled()) {
+    ptrace_latency_.forget(t);
+  }
   scheduler().on_destroy(static_cast<RecordTask*>(t));
   Session::on_destroy(t);
 }
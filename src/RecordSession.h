@@ -6,9 +6,15 @@
 #include <string>
 #include <vector>
 
+#include "BlockCodec.h"
+#include "PatchSiteCache.h"
+#include "RecordMetrics.h"
 #include "Scheduler.h"
 #include "SeccompFilterRewriter.h"
 #include "Session.h"
+#include "PerfTelemetry.h"
+#include "PtraceLatencyProfile.h"
+#include "SyscallProfile.h"
 #include "TaskGroup.h"
 #include "TraceFrame.h"
 
@@ -23,17 +29,29 @@ public:
 
   /**
    * Create a recording session for the initial command line |argv|.
+   * Unless |bind_cpu| is UNBOUND_CPU, tracees are bound to one CPU; if
+   * |cpus| is non-empty, the least loaded of those. Tracees' cpuid is
+   * trapped and recorded if the CPU supports it, unless |cpuid_faulting|
+   * is DISABLE_CPUID_FAULTING.
    */
   enum SyscallBuffering { ENABLE_SYSCALL_BUF, DISABLE_SYSCALL_BUF };
   enum BindCPU { BIND_CPU, UNBOUND_CPU };
   enum Chaos { ENABLE_CHAOS, DISABLE_CHAOS };
+  enum CpuidFaulting { ENABLE_CPUID_FAULTING, DISABLE_CPUID_FAULTING };
   static shr_ptr create(
       const std::vector<std::string>& argv,
       const std::vector<std::string>& extra_env = std::vector<std::string>(),
       SyscallBuffering syscallbuf = ENABLE_SYSCALL_BUF,
-      BindCPU bind_cpu = BIND_CPU, Chaos chaos = DISABLE_CHAOS);
+      BindCPU bind_cpu = BIND_CPU, Chaos chaos = DISABLE_CHAOS,
+      const CompressionOptions& compression = CompressionOptions(),
+      std::shared_ptr<TraceSink> sink = nullptr,
+      const std::vector<int>& cpus = std::vector<int>(),
+      CpuidFaulting cpuid_faulting = ENABLE_CPUID_FAULTING);
 
   bool use_syscall_buffer() const { return use_syscall_buffer_; }
+  virtual bool has_cpuid_faulting() const {
+    return trace_out.uses_cpuid_faulting();
+  }
   void set_ignore_sig(int sig) { ignore_sig = sig; }
   int get_ignore_sig() const { return ignore_sig; }
   void set_continue_through_sig(int sig) { continue_through_sig = sig; }
@@ -85,6 +103,35 @@ public:
     return seccomp_filter_rewriter_;
   }
 
+  SyscallProfile& syscall_profile() { return syscall_profile_; }
+
+  PerfTelemetry& perf_telemetry() { return perf_telemetry_; }
+
+  PtraceLatencyProfile& ptrace_latency() { return ptrace_latency_; }
+
+  PatchSiteCache& patch_site_cache() { return patch_site_cache_; }
+
+  RecordMetrics& record_metrics() { return record_metrics_; }
+
+  /**
+   * Limit the total syscallbuf memory tracees may use to |bytes|, or don't
+   * limit it if |bytes| is zero. Each task's buffer starts out small; the
+   * budget limits how far busy tasks' buffers can grow.
+   */
+  void set_syscallbuf_budget(size_t bytes) { syscallbuf_budget = bytes; }
+  /**
+   * Charge |bytes| of syscallbuf to the budget. Returns false, and charges
+   * nothing, if that would exceed the budget, unless |force| is set.
+   */
+  bool reserve_syscallbuf_bytes(size_t bytes, bool force = false);
+  void release_syscallbuf_bytes(size_t bytes) {
+    syscallbuf_bytes_in_use -= bytes;
+  }
+  /**
+   * The most syscallbuf memory tracees have been able to use at once.
+   */
+  size_t peak_syscallbuf_bytes() const { return syscallbuf_bytes_peak; }
+
   enum ContinueType { DONT_CONTINUE = 0, CONTINUE, CONTINUE_SYSCALL };
 
   struct StepState {
@@ -102,6 +149,11 @@ public:
     this->wait_for_all_ = wait_for_all;
   }
 
+  void set_eager_syscall_patching(bool eager) {
+    this->eager_syscall_patching_ = eager;
+  }
+  bool eager_syscall_patching() const { return eager_syscall_patching_; }
+
   virtual Task* new_task(pid_t tid, pid_t rec_tid, uint32_t serial,
                          SupportedArch a);
 
@@ -110,12 +162,16 @@ public:
 private:
   RecordSession(const std::vector<std::string>& argv,
                 const std::vector<std::string>& envp, const std::string& cwd,
-                SyscallBuffering syscallbuf, BindCPU bind_cpu, Chaos chaos);
+                SyscallBuffering syscallbuf, BindCPU bind_cpu, Chaos chaos,
+                const CompressionOptions& compression,
+                std::shared_ptr<TraceSink> sink, const std::vector<int>& cpus,
+                CpuidFaulting cpuid_faulting);
 
   virtual void on_create(Task* t);
 
   void check_perf_counters_working(RecordTask* t, RecordResult* step_result);
   bool handle_ptrace_event(RecordTask* t, StepState* step_state);
+  void handle_collected_exit_events();
   bool handle_signal_event(RecordTask* t, StepState* step_state);
   void runnable_state_changed(RecordTask* t, RecordResult* step_result,
                               bool can_consume_wait_status);
@@ -130,6 +186,15 @@ private:
   Scheduler scheduler_;
   TaskGroup::shr_ptr initial_task_group;
   SeccompFilterRewriter seccomp_filter_rewriter_;
+  SyscallProfile syscall_profile_;
+  PerfTelemetry perf_telemetry_;
+  PtraceLatencyProfile ptrace_latency_;
+  PatchSiteCache patch_site_cache_;
+  RecordMetrics record_metrics_;
+
+  size_t syscallbuf_budget;
+  size_t syscallbuf_bytes_in_use;
+  size_t syscallbuf_bytes_peak;
 
   int ignore_sig;
   int continue_through_sig;
@@ -144,6 +209,11 @@ private:
    * When true, wait for all tracees to exit before finishing recording.
    */
   bool wait_for_all_;
+  /**
+   * When true, Monkeypatcher scans libc and friends for patchable syscalls
+   * when they're mapped.
+   */
+  bool eager_syscall_patching_;
 };
 
 } // namespace rr
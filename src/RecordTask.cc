@@ -7,6 +7,8 @@
 #include <linux/perf_event.h>
 #include <sys/syscall.h>
 
+#include <algorithm>
+
 #include "AutoRemoteSyscalls.h"
 #include "kernel_abi.h"
 #include "kernel_metadata.h"
@@ -156,6 +158,9 @@ RecordTask::RecordTask(RecordSession& session, pid_t _tid, uint32_t serial,
       time_at_start_of_last_timeslice(0),
       priority(0),
       in_round_robin_queue(false),
+      adaptive_timeslice(0),
+      ticks_per_syscall(0),
+      ticks_at_last_syscall(0),
       emulated_ptracer(nullptr),
       emulated_ptrace_stop_code(0),
       emulated_ptrace_SIGCHLD_pending(false),
@@ -166,6 +171,9 @@ RecordTask::RecordTask(RecordSession& session, pid_t _tid, uint32_t serial,
       flushed_num_rec_bytes(0),
       flushed_syscallbuf(false),
       delay_syscallbuf_reset(false),
+      syscallbuf_flushes(0),
+      syscallbuf_overflows(0),
+      syscallbuf_reserved(0),
       seccomp_bpf_enabled(false),
       prctl_seccomp_status(0),
       robust_futex_list_len(0),
@@ -190,6 +198,13 @@ RecordTask::RecordTask(RecordSession& session, pid_t _tid, uint32_t serial,
 }
 
 RecordTask::~RecordTask() {
+  // When the session itself is being destroyed, it's no longer a
+  // RecordSession and there's no budget to give our syscallbuf back to.
+  RecordSession* record_session = Task::session().as_record();
+  if (record_session) {
+    record_session->release_syscallbuf_bytes(syscallbuf_reserved);
+  }
+
   if (emulated_ptracer) {
     emulated_ptracer->emulated_ptrace_tracees.erase(this);
   }
@@ -328,7 +343,7 @@ void RecordTask::post_exec() {
   Task::post_exec(determine_arch(this, exe_file), exe_file);
 
   ev().set_arch(arch());
-  ev().Syscall().number = registers.original_syscallno();
+  ev().Syscall().number = regs().original_syscallno();
 
   // Clear robust_list state to match kernel state. If this task is cloned
   // soon after exec, we must not do a bogus set_robust_list syscall for
@@ -358,9 +373,17 @@ void RecordTask::at_preload_init() {
 
 void RecordTask::init_buffers(remote_ptr<void> map_hint) {
   Task::init_buffers(map_hint);
+  // Any buffer we had before is gone now. Every buffer starts out at the
+  // same size whatever the budget says, since replay must match that.
+  session().release_syscallbuf_bytes(syscallbuf_reserved);
+  syscallbuf_reserved = 0;
+  syscallbuf_flushes = 0;
+  syscallbuf_overflows = 0;
   if (vm()->syscallbuf_enabled()) {
     AutoRemoteSyscalls remote(this);
     desched_fd = remote.retrieve_fd(desched_fd_child);
+    syscallbuf_reserved = syscallbuf_hdr->usable_size;
+    session().reserve_syscallbuf_bytes(syscallbuf_reserved, true);
   }
 }
 
@@ -847,7 +870,8 @@ const struct syscallbuf_record* RecordTask::desched_rec() const {
 }
 
 bool RecordTask::running_inside_desched() const {
-  for (auto& e : pending_events) {
+  for (size_t i = 0; i < pending_events.size(); ++i) {
+    const Event& e = pending_events[i];
     if (e.type() == EV_DESCHED) {
       return e.Desched().rec != desched_rec();
     }
@@ -880,8 +904,33 @@ void RecordTask::record_remote(remote_ptr<void> addr, ssize_t num_bytes) {
     return;
   }
 
-  auto buf = read_mem(addr.cast<uint8_t>(), num_bytes);
-  trace_writer().write_raw(buf.data(), num_bytes, addr);
+  record_remote_contents(addr, num_bytes);
+}
+
+void RecordTask::record_remote_file_read(remote_ptr<void> addr,
+                                         ssize_t num_bytes, int fd,
+                                         uint64_t offset) {
+  maybe_flush_syscallbuf();
+
+  ASSERT(this, num_bytes >= 0);
+
+  if (!addr) {
+    return;
+  }
+  if (trace_writer().file_reads_by_reference_enabled() &&
+      trace_writer().write_raw_file_ref(file_name_of_fd(fd), stat_fd(fd),
+                                        offset, num_bytes, addr)) {
+    return;
+  }
+  record_remote_contents(addr, num_bytes);
+}
+
+void RecordTask::record_remote_contents(remote_ptr<void> addr,
+                                        size_t num_bytes) {
+  trace_writer().write_raw_filled(
+      num_bytes, addr, [&](uint8_t* buf, size_t offset, size_t size) {
+        read_bytes_helper(addr + offset, size, buf);
+      });
 }
 
 void RecordTask::record_remote_fallible(remote_ptr<void> addr,
@@ -901,6 +950,55 @@ void RecordTask::record_remote_fallible(remote_ptr<void> addr,
   trace_writer().write_raw(buf.data(), buf.size(), addr);
 }
 
+void RecordTask::record_remote_batch(const vector<MemoryRange>& ranges) {
+  record_remote_batch_helper(ranges, false);
+}
+
+void RecordTask::record_remote_fallible_batch(
+    const vector<MemoryRange>& ranges) {
+  record_remote_batch_helper(ranges, true);
+}
+
+void RecordTask::record_remote_batch_helper(const vector<MemoryRange>& ranges,
+                                            bool fallible) {
+  maybe_flush_syscallbuf();
+
+  size_t total = 0;
+  for (auto& r : ranges) {
+    // We shouldn't be recording a scratch address.
+    ASSERT(this, r.start().is_null() || r.start() != scratch_ptr);
+    if (!r.start().is_null()) {
+      total += r.size();
+    }
+  }
+  vector<uint8_t> buf(total);
+  vector<MemoryRead> reads;
+  size_t offset = 0;
+  for (auto& r : ranges) {
+    if (!r.start().is_null()) {
+      reads.push_back({ r.start(), r.size(), buf.data() + offset });
+      offset += r.size();
+    }
+  }
+  vector<ssize_t> nread;
+  read_bytes_batch(reads, fallible ? &nread : nullptr);
+
+  size_t i = 0;
+  for (auto& r : ranges) {
+    if (r.start().is_null()) {
+      // record_remote_fallible writes an empty record for null; record_remote
+      // writes nothing.
+      if (fallible) {
+        trace_writer().write_raw(nullptr, 0, r.start());
+      }
+      continue;
+    }
+    size_t size = fallible ? nread[i] : r.size();
+    trace_writer().write_raw(reads[i].data, size, r.start());
+    ++i;
+  }
+}
+
 void RecordTask::record_remote_even_if_null(remote_ptr<void> addr,
                                             ssize_t num_bytes) {
   maybe_flush_syscallbuf();
@@ -915,13 +1013,12 @@ void RecordTask::record_remote_even_if_null(remote_ptr<void> addr,
     return;
   }
 
-  auto buf = read_mem(addr.cast<uint8_t>(), num_bytes);
-  trace_writer().write_raw(buf.data(), num_bytes, addr);
+  record_remote_contents(addr, num_bytes);
 }
 
 void RecordTask::pop_event(EventType expected_type) {
   ASSERT(this, pending_events.back().type() == expected_type);
-  pending_events.pop_back();
+  pending_events.pop();
 }
 
 void RecordTask::log_pending_events() const {
@@ -935,8 +1032,8 @@ void RecordTask::log_pending_events() const {
 
   /* The event at depth 0 is the placeholder event, which isn't
    * useful to log.  Skip it. */
-  for (auto it = pending_events.rbegin(); it != pending_events.rend(); ++it) {
-    it->log();
+  for (ssize_t i = depth - 1; i >= 0; --i) {
+    pending_events[i].log();
   }
 }
 
@@ -964,11 +1061,14 @@ void RecordTask::maybe_flush_syscallbuf() {
     return;
   }
 
+  SyscallProfile& profile = session().syscall_profile();
+  double start = profile.enabled() ? monotonic_now_sec() : 0;
+
   // Write the entire buffer in one shot without parsing it,
   // because replay will take care of that.
   push_event(Event(EV_SYSCALLBUF_FLUSH, NO_EXEC_INFO, arch()));
+  vector<uint8_t> buf;
   if (is_running()) {
-    vector<uint8_t> buf;
     buf.resize(sizeof(hdr) + hdr.num_rec_bytes);
     memcpy(buf.data(), &hdr, sizeof(hdr));
     memcpy(buf.data() + sizeof(hdr), syscallbuf_hdr + 1, hdr.num_rec_bytes);
@@ -979,8 +1079,38 @@ void RecordTask::maybe_flush_syscallbuf() {
   record_current_event();
   pop_event(EV_SYSCALLBUF_FLUSH);
 
+  RecordMetrics& metrics = session().record_metrics();
+  if (profile.enabled() || metrics.enabled()) {
+    // Only parse the records when someone wants them. Use the snapshot if
+    // we took one, since a running tracee may be appending to the buffer.
+    const uint8_t* records =
+        buf.empty() ? reinterpret_cast<const uint8_t*>(syscallbuf_hdr + 1)
+                    : buf.data() + sizeof(hdr);
+    vector<int> syscalls;
+    for (uint32_t offset = 0; offset < hdr.num_rec_bytes;) {
+      auto rec = reinterpret_cast<const syscallbuf_record*>(records + offset);
+      if (rec->size < sizeof(*rec)) {
+        break;
+      }
+      syscalls.push_back(rec->syscallno);
+      offset += stored_record_size(rec->size);
+    }
+    metrics.syscallbuf_flush(syscalls.size());
+    if (profile.enabled()) {
+      double share = (monotonic_now_sec() - start) /
+                     max<size_t>(1, syscalls.size());
+      for (int syscallno : syscalls) {
+        profile.buffered_syscall(arch(), syscallno, share);
+      }
+    }
+  }
+
   flushed_syscallbuf = true;
   flushed_num_rec_bytes = hdr.num_rec_bytes;
+  ++syscallbuf_flushes;
+  if (hdr.overflowed) {
+    ++syscallbuf_overflows;
+  }
 
   LOG(debug) << "Syscallbuf flushed with num_rec_bytes="
              << (uint32_t)hdr.num_rec_bytes;
@@ -996,10 +1126,42 @@ void RecordTask::maybe_reset_syscallbuf() {
     flushed_syscallbuf = false;
     LOG(debug) << "Syscallbuf reset";
     reset_syscallbuf();
+    if (maybe_grow_syscallbuf()) {
+      // Replay picks up the new size from the header recorded with the
+      // reset event.
+      record_local(syscallbuf_child, sizeof(*syscallbuf_hdr), syscallbuf_hdr);
+    }
     record_event(Event(EV_SYSCALLBUF_RESET, NO_EXEC_INFO, arch()));
   }
 }
 
+/* Number of flushes after which we decide whether to grow a syscallbuf. */
+static const uint32_t SYSCALLBUF_GROWTH_WINDOW = 8;
+
+bool RecordTask::maybe_grow_syscallbuf() {
+  if (syscallbuf_flushes < SYSCALLBUF_GROWTH_WINDOW) {
+    return false;
+  }
+  bool mostly_full = syscallbuf_overflows * 2 > syscallbuf_flushes;
+  syscallbuf_flushes = 0;
+  syscallbuf_overflows = 0;
+  uint32_t size = syscallbuf_hdr->usable_size;
+  if (!mostly_full || size >= num_syscallbuf_bytes) {
+    return false;
+  }
+  uint32_t new_size = min<size_t>(size * 2, num_syscallbuf_bytes);
+  if (!session().reserve_syscallbuf_bytes(new_size - size)) {
+    LOG(debug) << "Syscallbuf budget exhausted; not growing buffer of "
+               << tid;
+    return false;
+  }
+  syscallbuf_reserved += new_size - size;
+  syscallbuf_hdr->usable_size = new_size;
+  LOG(debug) << "Growing syscallbuf of " << tid << " to " << new_size
+             << " bytes";
+  return true;
+}
+
 static bool record_extra_regs(const Event& ev) {
   switch (ev.type()) {
     case EV_SYSCALL:
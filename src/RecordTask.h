@@ -249,6 +249,12 @@ public:
   }
   // Record as much as we can of the bytes in this range.
   void record_remote_fallible(remote_ptr<void> addr, ssize_t num_bytes);
+  /**
+   * Like calling |record_remote()| (or |record_remote_fallible()|) on each
+   * of |ranges| in order, but reads all the data in one batch.
+   */
+  void record_remote_batch(const std::vector<MemoryRange>& ranges);
+  void record_remote_fallible_batch(const std::vector<MemoryRange>& ranges);
   /**
    * Save tracee data to the trace.  |addr| is the address in
    * the address space of this task.
@@ -258,6 +264,13 @@ public:
   template <typename T> void record_remote_even_if_null(remote_ptr<T> addr) {
     record_remote_even_if_null(addr, sizeof(T));
   }
+  /**
+   * Like |record_remote()|, for |num_bytes| that were just read into |addr|
+   * from |offset| in the regular file open as |fd|. If the trace writer
+   * records file reads by reference, the data isn't copied into the trace.
+   */
+  void record_remote_file_read(remote_ptr<void> addr, ssize_t num_bytes,
+                               int fd, uint64_t offset);
 
   /**
    * Manage pending events.  |push_event()| pushes the given
@@ -265,7 +278,7 @@ public:
    * helpers pop the event at top of the stack, which must be of
    * the specified type.
    */
-  void push_event(const Event& ev) { pending_events.push_back(ev); }
+  void push_event(const Event& ev) { pending_events.push(ev); }
   void pop_event(EventType expected_type);
   void pop_noop() { pop_event(EV_NOOP); }
   void pop_desched() { pop_event(EV_DESCHED); }
@@ -298,6 +311,13 @@ public:
    * we run past any syscallbuf after-syscall code that uses the buffer data.
    */
   void maybe_reset_syscallbuf();
+  /**
+   * Called when the syscallbuf is being reset. If the buffer filled up in
+   * most of this task's recent flushes, let the tracee use more of it, as
+   * far as the session's syscallbuf budget allows. Returns true if the
+   * usable size changed.
+   */
+  bool maybe_grow_syscallbuf();
   /**
    * Record an event on behalf of this.  Record the registers of
    * this (and other relevant execution state) so that it can be
@@ -339,6 +359,14 @@ public:
 private:
   ~RecordTask();
 
+  void record_remote_batch_helper(const std::vector<MemoryRange>& ranges,
+                                  bool fallible);
+  /**
+   * Write the raw-data record for record_remote(), reading the tracee's
+   * memory straight into the trace writer's buffer.
+   */
+  void record_remote_contents(remote_ptr<void> addr, size_t num_bytes);
+
   /**
    * Wait for |futex| in this address space to have the value
    * |val|.
@@ -397,6 +425,16 @@ public:
    * in_round_robin_queue instead of its task_priority_set.
    */
   bool in_round_robin_queue;
+  /* Timeslice chosen for this task when the scheduler adapts timeslices,
+   * or 0 if not chosen yet. */
+  Ticks adaptive_timeslice;
+  /* Moving average of the ticks between syscalls rr handles for this task,
+   * and the tick count at the last one. */
+  double ticks_per_syscall;
+  Ticks ticks_at_last_syscall;
+  /* Where this task's last timeslice expired, if that looked like a spin
+   * loop and it hasn't made a syscall rr handles since; null otherwise. */
+  remote_code_ptr spin_ip;
 
   // ptrace emulation state
 
@@ -446,6 +484,12 @@ public:
    * record buffer from being reset when it normally would be.
    * Currently, the desched'd syscall code uses this. */
   bool delay_syscallbuf_reset;
+  /* Flushes since we last considered growing the syscallbuf, and how many
+   * of those found it full. */
+  uint32_t syscallbuf_flushes;
+  uint32_t syscallbuf_overflows;
+  /* Bytes of syscallbuf charged to the session's budget for this task. */
+  size_t syscallbuf_reserved;
   /* True when the tracee has started using the syscallbuf, and
    * the tracer will start receiving PTRACE_SECCOMP events for
    * traced syscalls.  We don't make any attempt to guess at the
@@ -459,10 +503,8 @@ public:
   // Value to return from PR_GET_SECCOMP
   uint8_t prctl_seccomp_status;
 
-  // The current stack of events being processed.  (We use a
-  // deque instead of a stack because we need to iterate the
-  // events.)
-  std::deque<Event> pending_events;
+  // The current stack of events being processed.
+  EventStack pending_events;
   // Futex list passed to |set_robust_list()|.  We could keep a
   // strong type for this list head and read it if we wanted to,
   // but for now we only need to remember its address / size at
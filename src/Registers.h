@@ -273,6 +273,17 @@ public:
     RR_SET_REG(eax, rax, value & 0xffffffff);
     RR_SET_REG(edx, rdx, value >> 32);
   }
+  /**
+   * Set the output registers of the |cpuid| instruction.
+   */
+  void set_cpuid_output(uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+    RR_SET_REG(eax, rax, a);
+    RR_SET_REG(ebx, rbx, b);
+    RR_SET_REG(ecx, rcx, c);
+    RR_SET_REG(edx, rdx, d);
+  }
+
+  uintptr_t ax() const { return RR_GET_REG(eax, rax); }
 
   uintptr_t r11() const {
     assert(arch() == x86_64);
@@ -320,10 +331,7 @@ public:
                                      const Registers& reg2,
                                      MismatchBehavior mismatch_behavior);
 
-  bool matches(const Registers& other) const {
-    return compare_register_files(nullptr, nullptr, *this, nullptr, other,
-                                  EXPECT_MISMATCHES);
-  }
+  bool matches(const Registers& other) const;
 
   /**
    * Return the total number of registers for this target.
@@ -381,6 +389,14 @@ private:
                                      const char* name2, const Registers& reg2,
                                      MismatchBehavior mismatch_behavior);
 
+  /**
+   * Equivalent to compare_registers_arch with EXPECT_MISMATCHES, but
+   * compares the fields of Arch's user_regs_struct directly and stops at
+   * the first difference.
+   */
+  template <typename Arch>
+  static bool matches_arch(const Registers& reg1, const Registers& reg2);
+
   static bool compare_register_files_internal(
       const char* name1, const Registers& reg1, const char* name2,
       const Registers& reg2, MismatchBehavior mismatch_behavior);
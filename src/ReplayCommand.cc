@@ -1,6 +1,8 @@
 /* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
 
 #include <assert.h>
+#include <inttypes.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -12,6 +14,7 @@
 #include "kernel_metadata.h"
 #include "log.h"
 #include "main.h"
+#include "ReplayProfiler.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
 
@@ -38,10 +41,36 @@ ReplayCommand ReplayCommand::singleton(
     "  -f, --onfork=<PID>         start a debug server when <PID> has been\n"
     "                             fork()d, AND the target event has been\n"
     "                             reached.\n"
+    "  -i, --sample-ip=<TICKS>    replay without a debugger, sampling each\n"
+    "                             task's stack every <TICKS> ticks, and\n"
+    "                             write a CPU profile of the recording in\n"
+    "                             folded-stacks format. Samples are taken at\n"
+    "                             exact tick counts, so the profile is the\n"
+    "                             same every time for the same <TICKS>.\n"
+    "  -l, --checkpoint-log=<FILE>\n"
+    "                             append a line of JSON to <FILE> for each\n"
+    "                             checkpoint created or discarded\n"
+    "  -m, --checkpoint-memory=<MB>\n"
+    "                             discard reverse-execution checkpoints to\n"
+    "                             keep the memory they use under <MB>\n"
+    "                             megabytes\n"
     "  -g, --goto=<EVENT-NUM>     start a debug server on reaching "
     "<EVENT-NUM>\n"
     "                             in the trace.  See -M in the general "
     "options.\n"
+    "  -g, --goto=<EVENT-NUM>:<TICKS>\n"
+    "                             start a debug server during <EVENT-NUM>,\n"
+    "                             when the task replaying it reaches\n"
+    "                             <TICKS>, as reported by the when and\n"
+    "                             when-ticks commands\n"
+    "  -w, --goto-time=<SECONDS>  start a debug server at the first event\n"
+    "                             recorded <SECONDS> after the recording\n"
+    "                             started\n"
+    "  -k, --goto-marker=<NAME>[#<N>]\n"
+    "                             start a debug server at the <N>th (by\n"
+    "                             default the first) marker called <NAME>\n"
+    "                             that the tracees wrote to\n"
+    "                             RR_MAGIC_MARKER_FD\n"
     "  -p, --onprocess=<PID>|<COMMAND>\n"
     "                             start a debug server when <PID> or "
     "<COMMAND>\n"
@@ -49,14 +78,28 @@ ReplayCommand ReplayCommand::singleton(
     "been\n"
     "                             reached.\n"
     "  -d, --debugger=<FILE>      use <FILE> as the gdb command\n"
+    "  -o, --profile-output=<FILE>\n"
+    "                             where --sample-ip writes its profile;\n"
+    "                             defaults to rr-profile.folded\n"
+    "  -P, --precision-stats      with -a, print histograms of how far past\n"
+    "                             their period ticks interrupts fired and\n"
+    "                             how many steps it took to reach each\n"
+    "                             async event's execution point\n"
     "  -q, --no-redirect-output   don't replay writes to stdout/stderr\n"
+    "  -r, --replay-ahead         while stopped in the debugger, keep\n"
+    "                             replaying forward in the background so the\n"
+    "                             next continue can start from wherever that\n"
+    "                             got to\n"
     "  -s, --dbgport=<PORT>       only start a debug server on <PORT>;\n"
     "                             don't automatically launch the debugger\n"
     "                             client too.\n"
     "  -t, --trace=<EVENT>        singlestep instructions and dump register\n"
     "                             states when replaying towards <EVENT> or\n"
     "                             later\n"
-    "  -x, --gdb-x=<FILE>         execute gdb commands from <FILE>\n");
+    "  -x, --gdb-x=<FILE>         execute gdb commands from <FILE>\n"
+    "  -y, --throughput-stats     with -a, print events and ticks replayed per\n"
+    "                             second, where the time went and peak\n"
+    "                             memory use at the end\n");
 
 struct ReplayFlags {
   // Start a debug server for the task scheduled at the first
@@ -64,6 +107,20 @@ struct ReplayFlags {
   // been "created".
   TraceFrame::Time goto_event;
 
+  // If true, start the debug server during goto_event, when the task
+  // replaying it reaches goto_ticks.
+  bool goto_ticks_set;
+  Ticks goto_ticks;
+
+  // If nonnegative, start the debug server at the first event recorded
+  // this long after the recording started.
+  double goto_seconds;
+
+  // If nonempty, start the debug server at the goto_marker_count'th
+  // marker called goto_marker.
+  string goto_marker;
+  int goto_marker_count;
+
   TraceFrame::Time singlestep_to_event;
 
   pid_t target_process;
@@ -94,15 +151,47 @@ struct ReplayFlags {
   /* When true, echo tracee stdout/stderr writes to console. */
   bool redirect;
 
+  /* Memory budget for reverse-execution checkpoints, in bytes. 0 for
+   * none. */
+  uint64_t checkpoint_memory_budget;
+
+  /* File to log checkpoint statistics to. */
+  string checkpoint_log;
+
+  /* Whether to print replay precision histograms at the end. */
+  bool precision_stats;
+
+  /* Whether to print a replay throughput summary at the end. */
+  bool throughput_stats;
+
+  /* Ticks between stack samples, or 0 to not profile. */
+  Ticks sample_period;
+
+  /* Where to write the profile. */
+  string profile_output;
+
+  /* Whether to replay ahead while the debugger is stopped. */
+  bool replay_ahead;
+
   ReplayFlags()
       : goto_event(0),
+        goto_ticks_set(false),
+        goto_ticks(0),
+        goto_seconds(-1),
+        goto_marker_count(1),
         singlestep_to_event(0),
         target_process(0),
         process_created_how(CREATED_NONE),
         dont_launch_debugger(false),
         dbg_port(-1),
         gdb_binary_file_path("gdb"),
-        redirect(true) {}
+        redirect(true),
+        checkpoint_memory_budget(0),
+        precision_stats(false),
+        throughput_stats(false),
+        sample_period(0),
+        profile_output("rr-profile.folded"),
+        replay_ahead(false) {}
 };
 
 static bool parse_replay_arg(std::vector<std::string>& args,
@@ -116,11 +205,20 @@ static bool parse_replay_arg(std::vector<std::string>& args,
     { 'd', "debugger", HAS_PARAMETER },
     { 's', "dbgport", HAS_PARAMETER },
     { 'g', "goto", HAS_PARAMETER },
+    { 'w', "goto-time", HAS_PARAMETER },
+    { 'k', "goto-marker", HAS_PARAMETER },
     { 't', "trace", HAS_PARAMETER },
+    { 'y', "throughput-stats", NO_PARAMETER },
     { 'q', "no-redirect-output", NO_PARAMETER },
+    { 'r', "replay-ahead", NO_PARAMETER },
     { 'f', "onfork", HAS_PARAMETER },
     { 'p', "onprocess", HAS_PARAMETER },
-    { 'x', "gdb-x", HAS_PARAMETER }
+    { 'P', "precision-stats", NO_PARAMETER },
+    { 'x', "gdb-x", HAS_PARAMETER },
+    { 'm', "checkpoint-memory", HAS_PARAMETER },
+    { 'l', "checkpoint-log", HAS_PARAMETER },
+    { 'o', "profile-output", HAS_PARAMETER },
+    { 'i', "sample-ip", HAS_PARAMETER }
   };
   ParsedOption opt;
   if (!Command::parse_option(args, options, &opt)) {
@@ -142,12 +240,72 @@ static bool parse_replay_arg(std::vector<std::string>& args,
       flags.target_process = opt.int_value;
       flags.process_created_how = ReplayFlags::CREATED_FORK;
       break;
-    case 'g':
+    case 'g': {
+      size_t colon = opt.value.find(':');
+      if (colon != string::npos) {
+        char* end;
+        unsigned long event = strtoul(opt.value.c_str(), &end, 10);
+        if (end != opt.value.c_str() + colon || event < 1 ||
+            event > UINT32_MAX) {
+          fprintf(stderr, "Invalid event number in `%s'\n",
+                  opt.value.c_str());
+          return false;
+        }
+        const char* ticks = opt.value.c_str() + colon + 1;
+        flags.goto_ticks = strtoull(ticks, &end, 10);
+        if (!*ticks || *end) {
+          fprintf(stderr, "Invalid ticks in `%s'\n", opt.value.c_str());
+          return false;
+        }
+        flags.goto_event = event;
+        flags.goto_ticks_set = true;
+        break;
+      }
       if (!opt.verify_valid_int(1, UINT32_MAX)) {
         return false;
       }
       flags.goto_event = opt.int_value;
       break;
+    }
+    case 'i':
+      if (!opt.verify_valid_int(1, INT64_MAX)) {
+        return false;
+      }
+      flags.sample_period = opt.int_value;
+      flags.goto_event = numeric_limits<decltype(flags.goto_event)>::max();
+      flags.dont_launch_debugger = true;
+      break;
+    case 'k': {
+      size_t hash = opt.value.rfind('#');
+      flags.goto_marker = opt.value.substr(0, hash);
+      flags.goto_marker_count = 1;
+      if (hash != string::npos) {
+        char* end;
+        flags.goto_marker_count =
+            strtol(opt.value.c_str() + hash + 1, &end, 10);
+        if (*end || flags.goto_marker_count < 1) {
+          fprintf(stderr, "Invalid marker `%s'\n", opt.value.c_str());
+          return false;
+        }
+      }
+      if (flags.goto_marker.empty()) {
+        fprintf(stderr, "Invalid marker `%s'\n", opt.value.c_str());
+        return false;
+      }
+      break;
+    }
+    case 'l':
+      flags.checkpoint_log = opt.value;
+      break;
+    case 'm':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.checkpoint_memory_budget = (uint64_t)opt.int_value * 1024 * 1024;
+      break;
+    case 'o':
+      flags.profile_output = opt.value;
+      break;
     case 'p':
       if (opt.int_value > 0) {
         if (!opt.verify_valid_int(1, INT32_MAX)) {
@@ -159,9 +317,15 @@ static bool parse_replay_arg(std::vector<std::string>& args,
       }
       flags.process_created_how = ReplayFlags::CREATED_EXEC;
       break;
+    case 'P':
+      flags.precision_stats = true;
+      break;
     case 'q':
       flags.redirect = false;
       break;
+    case 'r':
+      flags.replay_ahead = true;
+      break;
     case 's':
       if (!opt.verify_valid_int(1, INT32_MAX)) {
         return false;
@@ -175,31 +339,75 @@ static bool parse_replay_arg(std::vector<std::string>& args,
       }
       flags.singlestep_to_event = opt.int_value;
       break;
+    case 'w': {
+      char* end;
+      flags.goto_seconds = strtod(opt.value.c_str(), &end);
+      if (opt.value.empty() || *end || flags.goto_seconds < 0) {
+        fprintf(stderr, "Invalid time `%s'\n", opt.value.c_str());
+        return false;
+      }
+      break;
+    }
     case 'x':
       flags.gdb_command_file_path = opt.value;
       break;
+    case 'y':
+      flags.throughput_stats = true;
+      break;
     default:
       assert(0 && "Unknown option");
   }
   return true;
 }
 
+static bool cmd_line_matches(const vector<string>& cmd_line,
+                             const string& command) {
+  if (cmd_line.empty()) {
+    return false;
+  }
+  auto& cmd = cmd_line[0];
+  return cmd == command ||
+         (cmd.size() > command.size() &&
+          cmd.substr(cmd.size() - command.size() - 1) == ('/' + command));
+}
+
+/**
+ * Return the process index entry for |pid|, or null if there's no such
+ * process in the index.
+ */
+static const TraceReader::ProcessRecord* find_indexed_process(
+    const vector<TraceReader::ProcessRecord>& processes, pid_t pid) {
+  for (auto& p : processes) {
+    if (p.pid == pid) {
+      return &p;
+    }
+  }
+  return nullptr;
+}
+
 static int find_pid_for_command(const string& trace_dir,
                                 const string& command) {
   TraceReader trace(trace_dir);
 
+  vector<TraceReader::ProcessRecord> processes;
+  if (trace.read_process_index(processes)) {
+    // The index has every exec, so it's authoritative.
+    for (auto& p : processes) {
+      for (auto& e : p.execs) {
+        if (cmd_line_matches(e.cmd_line, command)) {
+          return p.pid;
+        }
+      }
+    }
+    return -1;
+  }
+
   while (trace.good()) {
     auto e = trace.read_task_event();
     if (e.type() != TraceTaskEvent::EXEC) {
       continue;
     }
-    if (e.cmd_line().empty()) {
-      continue;
-    }
-    auto& cmd = e.cmd_line()[0];
-    if (cmd == command ||
-        (cmd.size() > command.size() &&
-         cmd.substr(cmd.size() - command.size() - 1) == ('/' + command))) {
+    if (cmd_line_matches(e.cmd_line(), command)) {
       return e.tid();
     }
   }
@@ -209,6 +417,13 @@ static int find_pid_for_command(const string& trace_dir,
 static bool pid_exists(const string& trace_dir, pid_t pid) {
   TraceReader trace(trace_dir);
 
+  // Only processes are indexed, so a miss could still be a thread.
+  vector<TraceReader::ProcessRecord> processes;
+  if (trace.read_process_index(processes) &&
+      find_indexed_process(processes, pid)) {
+    return true;
+  }
+
   while (trace.good()) {
     auto e = trace.read_task_event();
     if (e.tid() == pid) {
@@ -221,6 +436,14 @@ static bool pid_exists(const string& trace_dir, pid_t pid) {
 static bool pid_execs(const string& trace_dir, pid_t pid) {
   TraceReader trace(trace_dir);
 
+  vector<TraceReader::ProcessRecord> processes;
+  if (trace.read_process_index(processes)) {
+    auto p = find_indexed_process(processes, pid);
+    if (p) {
+      return !p->execs.empty();
+    }
+  }
+
   while (trace.good()) {
     auto e = trace.read_task_event();
     if (e.tid() == pid && e.type() == TraceTaskEvent::EXEC) {
@@ -239,6 +462,9 @@ static pid_t waiting_for_child;
 static ReplaySession::Flags session_flags(ReplayFlags flags) {
   ReplaySession::Flags result;
   result.redirect_stdio = flags.redirect;
+  result.checkpoint_memory_budget = flags.checkpoint_memory_budget;
+  result.checkpoint_log = flags.checkpoint_log;
+  result.replay_ahead = flags.replay_ahead;
   return result;
 }
 
@@ -246,11 +472,55 @@ static uint64_t to_microseconds(const struct timeval& tv) {
   return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+static void print_seconds(FILE* out, const char* what, double seconds,
+                          double total) {
+  fprintf(out, "  %-24s %10.3fs %6.1f%%\n", what, seconds,
+          total > 0 ? 100 * seconds / total : 0.0);
+}
+
+/**
+ * Print how fast replay went and where its time was spent, to tell
+ * whether a slow replay is bound by ptrace, trace decompression or
+ * something else.
+ */
+static void dump_throughput_stats(ReplaySession& session, double seconds,
+                                  TraceFrame::Time events, FILE* out) {
+  Session::Statistics stats = session.statistics();
+  double decompress_seconds = session.trace_reader().block_wait_seconds();
+  double other_seconds = seconds - stats.wait_seconds - decompress_seconds -
+                         stats.memory_restore_seconds -
+                         stats.syscall_emulation_seconds;
+  struct rusage self_usage, children_usage;
+  getrusage(RUSAGE_SELF, &self_usage);
+  getrusage(RUSAGE_CHILDREN, &children_usage);
+
+  fprintf(out, "Replay throughput:\n");
+  fprintf(out, "  %-24s %11" PRId64 " %10.0f/s\n", "events", (int64_t)events,
+          seconds > 0 ? events / seconds : 0.0);
+  fprintf(out, "  %-24s %11" PRId64 " %10.0f/s\n", "ticks",
+          (int64_t)stats.ticks_processed,
+          seconds > 0 ? stats.ticks_processed / seconds : 0.0);
+  print_seconds(out, "total", seconds, seconds);
+  print_seconds(out, "ptrace waits", stats.wait_seconds, seconds);
+  print_seconds(out, "trace decompression", decompress_seconds, seconds);
+  print_seconds(out, "memory restore", stats.memory_restore_seconds, seconds);
+  print_seconds(out, "syscall emulation", stats.syscall_emulation_seconds,
+                seconds);
+  print_seconds(out, "other", max(other_seconds, 0.0), seconds);
+  fprintf(out, "  %-24s %10ldKB\n", "peak RSS (rr)", self_usage.ru_maxrss);
+  fprintf(out, "  %-24s %10ldKB\n", "peak RSS (tracees)",
+          children_usage.ru_maxrss);
+}
+
 static void serve_replay_no_debugger(const string& trace_dir,
                                      const ReplayFlags& flags) {
   ReplaySession::shr_ptr replay_session = ReplaySession::create(trace_dir);
   replay_session->set_flags(session_flags(flags));
+  replay_session->precision_stats().set_enabled(flags.precision_stats);
+  double start_time = monotonic_now_sec();
+  TraceFrame::Time start_event = replay_session->trace_reader().time();
   uint32_t step_count = 0;
+  uint32_t event_count = 0;
   struct timeval last_dump_time;
   Session::Statistics last_stats;
   gettimeofday(&last_dump_time, NULL);
@@ -272,19 +542,26 @@ static void serve_replay_no_debugger(const string& trace_dir,
     assert(after_time >= before_time && after_time <= before_time + 1);
 
     ++step_count;
+    event_count += after_time - before_time;
     if (DUMP_STATS_PERIOD > 0 && step_count % DUMP_STATS_PERIOD == 0) {
       struct timeval now;
       gettimeofday(&now, NULL);
       Session::Statistics stats = replay_session->statistics();
+      uint64_t ptrace_calls = stats.ptrace_calls - last_stats.ptrace_calls;
       printf(
           "[ReplayStatistics] ticks %lld syscalls %lld bytes_written %lld "
+          "ptrace_calls %lld ptrace_calls_per_event %.1f getregs_avoided %lld "
           "microseconds %lld\n",
           (long long)(stats.ticks_processed - last_stats.ticks_processed),
           (long long)(stats.syscalls_performed - last_stats.syscalls_performed),
           (long long)(stats.bytes_written - last_stats.bytes_written),
+          (long long)ptrace_calls,
+          event_count ? (double)ptrace_calls / event_count : 0.0,
+          (long long)(stats.getregs_avoided - last_stats.getregs_avoided),
           (long long)(to_microseconds(now) - to_microseconds(last_dump_time)));
       last_dump_time = now;
       last_stats = stats;
+      event_count = 0;
     }
 
     if (result.status == REPLAY_EXITED) {
@@ -296,9 +573,71 @@ static void serve_replay_no_debugger(const string& trace_dir,
     assert(cmd == RUN_SINGLESTEP || !result.break_status.singlestep_complete);
   }
 
+  if (flags.precision_stats) {
+    replay_session->precision_stats().dump(stderr);
+  }
+  if (flags.throughput_stats) {
+    dump_throughput_stats(
+        *replay_session, monotonic_now_sec() - start_time,
+        replay_session->trace_reader().time() - start_event, stderr);
+  }
   LOG(info) << ("Replayer successfully finished.");
 }
 
+/**
+ * Replay the whole trace, stopping each task at every multiple of
+ * flags.sample_period ticks to sample its stack, and write the profile.
+ */
+static int profile_replay(const string& trace_dir, const ReplayFlags& flags) {
+  ReplaySession::shr_ptr replay_session = ReplaySession::create(trace_dir);
+  replay_session->set_flags(session_flags(flags));
+  ReplayProfiler profiler(flags.sample_period);
+  ReplaySession::StepConstraints constraints(RUN_CONTINUE);
+  ReplayTask* stepping = nullptr;
+
+  while (true) {
+    ReplayTask* t = replay_session->current_task();
+    if (t != stepping) {
+      constraints = ReplaySession::StepConstraints(RUN_CONTINUE);
+      stepping = t;
+    }
+    if (t && replay_session->done_initial_exec()) {
+      Ticks target = profiler.next_sample_ticks(t);
+      if (t->tick_count() >= target) {
+        profiler.sample(t);
+        constraints = ReplaySession::StepConstraints(RUN_CONTINUE);
+        continue;
+      }
+      // Run until we're close to the sample point, then step up to it
+      // exactly, like ReplayTimeline::reverse_singlestep does.
+      if (constraints.command == RUN_CONTINUE) {
+        constraints.ticks_target = target;
+      } else {
+        constraints.fast_forward_ticks_limit = target;
+      }
+    }
+
+    auto result = replay_session->replay_step(constraints);
+    if (result.status == REPLAY_EXITED) {
+      break;
+    }
+    if (result.break_status.approaching_ticks_target) {
+      constraints = ReplaySession::StepConstraints(RUN_SINGLESTEP_FAST_FORWARD);
+    }
+  }
+
+  FILE* out = fopen(flags.profile_output.c_str(), "w");
+  if (!out) {
+    fprintf(stderr, "Can't open %s\n", flags.profile_output.c_str());
+    return 1;
+  }
+  profiler.write_folded(out);
+  fclose(out);
+  LOG(info) << "Wrote " << profiler.sample_count() << " samples to "
+            << flags.profile_output;
+  return 0;
+}
+
 /* Handling ctrl-C during replay:
  * We want the entire group of processes to remain a single process group
  * since that allows shell job control to work best.
@@ -341,10 +680,38 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
       break;
   }
   target.event = flags.goto_event;
+  target.seek_ticks = flags.goto_ticks_set;
+  target.ticks = flags.goto_ticks;
+  if (flags.goto_seconds >= 0) {
+    target.event = TraceReader(trace_dir).time_at_seconds(flags.goto_seconds);
+    if (!target.event) {
+      fprintf(stderr, "No event was recorded %gs after the recording "
+                      "started\n",
+              flags.goto_seconds);
+      return 1;
+    }
+    target.seek_ticks = true;
+    target.ticks = 0;
+  }
+  if (!flags.goto_marker.empty()) {
+    target.event = TraceReader(trace_dir).find_marker(
+        flags.goto_marker, flags.goto_marker_count);
+    if (!target.event) {
+      fprintf(stderr, "No marker `%s' #%d was recorded\n",
+              flags.goto_marker.c_str(), flags.goto_marker_count);
+      return 1;
+    }
+    target.seek_ticks = true;
+    target.ticks = 0;
+  }
 
   // If we're not going to autolaunch the debugger, don't go
   // through the rigamarole to set that up.  All it does is
   // complicate the process tree and confuse users.
+  if (flags.sample_period) {
+    return profile_replay(trace_dir, flags);
+  }
+
   if (flags.dont_launch_debugger) {
     if (target.event == numeric_limits<decltype(target.event)>::max()) {
       serve_replay_no_debugger(trace_dir, flags);
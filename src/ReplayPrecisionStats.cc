@@ -0,0 +1,62 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "ReplayPrecisionStats.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+
+using namespace std;
+
+namespace rr {
+
+void ReplayPrecisionStats::Histogram::add(uint64_t value) {
+  int bucket = 0;
+  while (bucket < NUM_BUCKETS - 1 && value >= (1ULL << bucket)) {
+    ++bucket;
+  }
+  ++buckets[bucket];
+  ++count;
+  max = std::max(max, value);
+}
+
+void ReplayPrecisionStats::Histogram::dump(FILE* out, const char* name) const {
+  if (!count) {
+    return;
+  }
+  fprintf(out, "    %s: %" PRIu64 " samples, max %" PRIu64 "\n", name, count,
+          max);
+  for (int i = 0; i < NUM_BUCKETS; ++i) {
+    if (!buckets[i]) {
+      continue;
+    }
+    uint64_t low = i ? 1ULL << (i - 1) : 0;
+    uint64_t high = i ? (1ULL << i) - 1 : 0;
+    fprintf(out, "      %10" PRIu64 "-%-10" PRIu64 " %10" PRIu64 "\n", low,
+            high, buckets[i]);
+  }
+}
+
+void ReplayPrecisionStats::interrupt_fired(const string& event_type,
+                                           Ticks overshoot) {
+  stats[event_type].overshoot.add(overshoot < 0 ? 0 : overshoot);
+}
+
+void ReplayPrecisionStats::target_reached(const string& event_type,
+                                          Ticks ticks_left, uint64_t stops) {
+  Stats& s = stats[event_type];
+  s.ticks_left.add(ticks_left < 0 ? 0 : ticks_left);
+  s.stops.add(stops);
+}
+
+void ReplayPrecisionStats::dump(FILE* out) const {
+  fprintf(out, "rr: replay precision:\n");
+  for (auto& e : stats) {
+    fprintf(out, "  %s\n", e.first.c_str());
+    e.second.overshoot.dump(out, "ticks interrupt overshoot");
+    e.second.ticks_left.dump(out, "ticks left after last interrupt");
+    e.second.stops.dump(out, "slow steps to reach target");
+  }
+}
+
+} // namespace rr
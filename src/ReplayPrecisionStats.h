@@ -0,0 +1,79 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_REPLAY_PRECISION_STATS_H_
+#define RR_REPLAY_PRECISION_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+
+#include "Ticks.h"
+
+namespace rr {
+
+/**
+ * Collects, per event type, how precisely replay reaches the execution
+ * points of events that have to be found by counting ticks (asynchronous
+ * signals and preemptions):
+ * -- how far past the programmed period each ticks interrupt fired,
+ * -- how many ticks were left to cover after the last interrupt,
+ * -- how many breakpoint continues and singlesteps covering them took.
+ * Comparing these across kernels and CPUs shows regressions in counter
+ * skid and replay speed.
+ */
+class ReplayPrecisionStats {
+public:
+  ReplayPrecisionStats() : enabled_(false) {}
+
+  void set_enabled(bool enabled) { enabled_ = enabled; }
+  bool enabled() const { return enabled_; }
+
+  /**
+   * A ticks interrupt programmed while replaying an |event_type| event
+   * fired |overshoot| ticks after its period expired.
+   */
+  void interrupt_fired(const std::string& event_type, Ticks overshoot);
+  /**
+   * An |event_type| event's execution point was reached with |ticks_left|
+   * ticks to go after the last interrupt, using |stops| slow steps.
+   */
+  void target_reached(const std::string& event_type, Ticks ticks_left,
+                      uint64_t stops);
+
+  /**
+   * Print a histogram of each quantity, per event type.
+   */
+  void dump(FILE* out) const;
+
+private:
+  /**
+   * Counts of values in buckets [0], [1], [2,3], [4,7], ...
+   */
+  struct Histogram {
+    enum { NUM_BUCKETS = 32 };
+    uint64_t buckets[NUM_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+    Histogram() : count(0), max(0) {
+      for (auto& b : buckets) {
+        b = 0;
+      }
+    }
+    void add(uint64_t value);
+    void dump(FILE* out, const char* name) const;
+  };
+  struct Stats {
+    Histogram overshoot;
+    Histogram ticks_left;
+    Histogram stops;
+  };
+
+  std::map<std::string, Stats> stats;
+  bool enabled_;
+};
+
+} // namespace rr
+
+#endif /* RR_REPLAY_PRECISION_STATS_H_ */
@@ -0,0 +1,99 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "ReplayProfiler.h"
+
+#include <inttypes.h>
+
+#include <vector>
+
+#include "AddressSpace.h"
+#include "ReplayTask.h"
+
+using namespace std;
+
+namespace rr {
+
+// Give up on stacks deeper than this; they're probably a frame pointer
+// chain gone wrong.
+static const size_t MAX_FRAMES = 128;
+
+template <typename Arch>
+static void stack_x86ish(ReplayTask* t, vector<remote_code_ptr>* frames) {
+  frames->push_back(t->ip());
+  typename Arch::size_t frame[2];
+  remote_ptr<void> bp = t->regs().bp();
+  remote_ptr<void> sp = t->regs().sp();
+  while (frames->size() < MAX_FRAMES) {
+    // Frames live above the stack pointer and each one is above the last.
+    if (bp < sp ||
+        t->read_bytes_fallible(bp, sizeof(frame), frame) != sizeof(frame) ||
+        !frame[1]) {
+      break;
+    }
+    frames->push_back(remote_code_ptr(frame[1]));
+    sp = bp + sizeof(frame);
+    bp = frame[0];
+  }
+}
+
+static string frame_name(ReplayTask* t, remote_code_ptr ip) {
+  remote_ptr<void> addr = ip.to_data_ptr<void>();
+  char buf[100];
+  if (!t->vm()->has_mapping(addr)) {
+    snprintf(buf, sizeof(buf), "0x%" PRIxPTR, addr.as_int());
+    return buf;
+  }
+  const KernelMapping& m = t->vm()->mapping_of(addr).map;
+  string name = m.fsname();
+  size_t slash = name.rfind('/');
+  if (slash != string::npos) {
+    name = name.substr(slash + 1);
+  }
+  if (name.empty()) {
+    name = "[anon]";
+  }
+  snprintf(buf, sizeof(buf), "+0x%" PRIx64,
+           (uint64_t)(addr - m.start()) + m.file_offset_bytes());
+  return name + buf;
+}
+
+Ticks ReplayProfiler::next_sample_ticks(ReplayTask* t) {
+  auto it = next_sample.find(t->tuid());
+  if (it == next_sample.end()) {
+    it = next_sample.insert(make_pair(t->tuid(), t->tick_count() + period))
+             .first;
+  }
+  return it->second;
+}
+
+void ReplayProfiler::sample(ReplayTask* t) {
+  Ticks& next = next_sample[t->tuid()];
+  uint64_t count = 0;
+  while (next <= t->tick_count()) {
+    next += period;
+    ++count;
+  }
+  if (!count) {
+    return;
+  }
+
+  vector<remote_code_ptr> frames;
+  RR_ARCH_FUNCTION(stack_x86ish, t->arch(), t, &frames);
+  string stack = t->name();
+  // Folded stacks list the outermost frame first.
+  for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+    // Return addresses point after the call; step back into it so the
+    // frame resolves to the calling line.
+    stack += ';' + frame_name(t, it + 1 == frames.rend() ? *it : *it - 1);
+  }
+  stacks[stack] += count;
+  samples += count;
+}
+
+void ReplayProfiler::write_folded(FILE* out) const {
+  for (auto& s : stacks) {
+    fprintf(out, "%s %" PRIu64 "\n", s.first.c_str(), s.second);
+  }
+}
+
+} // namespace rr
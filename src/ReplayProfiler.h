@@ -0,0 +1,64 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_REPLAY_PROFILER_H_
+#define RR_REPLAY_PROFILER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <string>
+
+#include "TaskishUid.h"
+#include "Ticks.h"
+
+namespace rr {
+
+class ReplayTask;
+
+/**
+ * Samples tracee stacks during replay every |period| ticks of each task,
+ * giving a CPU profile of the recorded run that doesn't perturb it and
+ * comes out the same every time for the same period. Samples are taken at
+ * exact tick counts, so the replay loop has to step to them precisely;
+ * see next_sample_ticks().
+ *
+ * Stacks are found by following frame pointers, so code built without them
+ * shows up with truncated stacks. Frames are written as
+ * "<file basename>+0x<file offset>", which addr2line or a symbolizing
+ * flamegraph viewer can resolve.
+ */
+class ReplayProfiler {
+public:
+  explicit ReplayProfiler(Ticks period) : period(period), samples(0) {}
+
+  /**
+   * Return the tick count at which |t| should next be sampled.
+   */
+  Ticks next_sample_ticks(ReplayTask* t);
+
+  /**
+   * Record |t|'s current stack, once for each sample period that has
+   * ended at or before its current tick count.
+   */
+  void sample(ReplayTask* t);
+
+  uint64_t sample_count() const { return samples; }
+
+  /**
+   * Write the samples in "folded stacks" format: one line per distinct
+   * stack, "<task name>;<outermost frame>;...;<innermost frame> <count>",
+   * as read by flamegraph.pl, speedscope and pprof converters.
+   */
+  void write_folded(FILE* out) const;
+
+private:
+  Ticks period;
+  std::map<TaskUid, Ticks> next_sample;
+  std::map<std::string, uint64_t> stacks;
+  uint64_t samples;
+};
+
+} // namespace rr
+
+#endif /* RR_REPLAY_PROFILER_H_ */
@@ -1,6 +1,7 @@
 /* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
 
 #define USE_BREAKPOINT_TARGET 1
+#define USE_DEBUG_REGISTER_TARGET 1
 
 #include "ReplaySession.h"
 
@@ -16,6 +17,8 @@
 #include "log.h"
 #include "replay_syscall.h"
 #include "ReplayTask.h"
+#include "StdioMonitor.h"
+#include "Timeline.h"
 #include "util.h"
 
 using namespace std;
@@ -27,37 +30,37 @@ namespace rr {
  * there's a variable slack region, which is technically unbounded.
  * This means that an interrupt programmed for retired branch k might
  * fire at |k + 50|, for example.  To counteract the slack, we program
- * interrupts just short of our target, by the |SKID_SIZE| region
- * below, and then more slowly advance to the real target.
+ * interrupts just short of our target, by the skid size of the
+ * microarchitecture (see PerfCounters::skid_size()), and then more
+ * slowly advance to the real target.
  *
- * How was this magic number determined?  Trial and error: we want it
+ * How were the skid sizes determined?  Trial and error: we want them
  * to be as small as possible for efficiency, but not so small that
  * overshoots are observed.  If all other possible causes of overshoot
  * have been ruled out, like memory divergence, then you'll know that
- * this magic number needs to be increased if the following symptom is
+ * the skid size needs to be increased if the following symptom is
  * observed during replay.  Running with DEBUGLOG enabled (see above),
  * a sequence of log messages like the following will appear
  *
- * 1. programming interrupt for [target - SKID_SIZE] ticks
+ * 1. programming interrupt for [target - skid size] ticks
  * 2. Error: Replay diverged.  Dumping register comparison.
  * 3. Error: [list of divergent registers; arbitrary]
  * 4. Error: overshot target ticks=[target] by [i]
  *
  * The key is that no other replayer log messages occur between (1)
  * and (2).  This spew means that the replayer programmed an interrupt
- * for ticks=[target-SKID_SIZE], but the tracee was actually interrupted
+ * for ticks=[target-skid size], but the tracee was actually interrupted
  * at ticks=[target+i].  And that in turn means that the kernel/HW
  * skidded too far past the programmed target for rr to handle it.
  *
- * If that occurs, the SKID_SIZE needs to be increased by at least
- * [i].
+ * If that occurs, the skid size for the CPU's microarchitecture in
+ * PerfCounters.cc needs to be increased by at least [i].
  *
  * NB: there are probably deeper reasons for the target slack that
  * could perhaps let it be deduced instead of arrived at empirically;
  * perhaps pipeline depth and things of that nature are involved.  But
  * those reasons if they exit are currently not understood.
  */
-static const int SKID_SIZE = 70;
 
 static void debug_memory(ReplayTask* t) {
   if (should_dump_memory(t->current_trace_frame())) {
@@ -80,12 +83,18 @@ ReplaySession::~ReplaySession() {
   assert(task_map.empty() && vm_map.empty());
   gc_emufs();
   assert(emufs().size() == 0);
+  StdioMonitor::flush_replayed_output();
 }
 
 ReplaySession::shr_ptr ReplaySession::clone() {
   LOG(debug) << "Deepforking ReplaySession " << this << " ...";
+  TimelineScope timeline(Timeline::RR_THREAD, Timeline::current_thread(),
+                         "checkpoint", "clone session");
 
   finish_initializing();
+  // Don't copy files that are only waiting to be collected; the clone
+  // would never find out they're garbage.
+  gc_emufs();
 
   shr_ptr session(new ReplaySession(*this));
   LOG(debug) << "  deepfork session is " << session.get();
@@ -134,6 +143,7 @@ DiversionSession::shr_ptr ReplaySession::clone_diversion() {
 
   LOG(debug) << "Deepforking ReplaySession " << this
              << " to DiversionSession...";
+  gc_emufs();
 
   DiversionSession::shr_ptr session(new DiversionSession(*this));
   LOG(debug) << "  deepfork session is " << session.get();
@@ -157,6 +167,10 @@ void ReplaySession::maybe_gc_emufs(SupportedArch arch, int syscallno) {
   }
 }
 
+bool ReplaySession::has_cpuid_faulting() const {
+  return trace_in.uses_cpuid_faulting() && cpuid_faulting_works();
+}
+
 /*static*/ ReplaySession::shr_ptr ReplaySession::create(const string& dir) {
   shr_ptr session(new ReplaySession(dir));
 
@@ -187,7 +201,7 @@ void ReplaySession::advance_to_next_trace_frame() {
     return;
   }
 
-  trace_frame = trace_in.read_frame();
+  trace_in.read_frame(trace_frame);
 }
 
 bool ReplaySession::is_ignored_signal(int sig) {
@@ -206,7 +220,8 @@ static bool compute_ticks_request(
     TicksRequest* ticks_request) {
   *ticks_request = RESUME_UNLIMITED_TICKS;
   if (constraints.ticks_target > 0) {
-    Ticks ticks_period = constraints.ticks_target - SKID_SIZE - t->tick_count();
+    Ticks ticks_period =
+        constraints.ticks_target - PerfCounters::skid_size() - t->tick_count();
     if (ticks_period <= 0) {
       // Behave as if we actually executed something. Callers assume we did.
       t->clear_wait_status();
@@ -238,7 +253,8 @@ Completion ReplaySession::cont_syscall_boundary(
     // ignore ticks_period. We can't add more than one tick during a
     // fast_forward so it doesn't matter.
     did_fast_forward |= fast_forward_through_instruction(
-        t, RESUME_SYSEMU_SINGLESTEP, constraints.stop_before_states);
+        t, RESUME_SYSEMU_SINGLESTEP, constraints.stop_before_states,
+        constraints.fast_forward_ticks_limit);
   } else {
     ResumeRequest resume_how =
         constraints.is_singlestep() ? RESUME_SYSEMU_SINGLESTEP : RESUME_SYSEMU;
@@ -375,7 +391,8 @@ void ReplaySession::continue_or_step(ReplayTask* t,
     t->resume_execution(RESUME_SINGLESTEP, RESUME_WAIT, tick_request);
   } else if (constraints.command == RUN_SINGLESTEP_FAST_FORWARD) {
     did_fast_forward |= fast_forward_through_instruction(
-        t, RESUME_SINGLESTEP, constraints.stop_before_states);
+        t, RESUME_SINGLESTEP, constraints.stop_before_states,
+        constraints.fast_forward_ticks_limit);
   } else {
     t->resume_execution(resume_how, RESUME_WAIT, tick_request);
   }
@@ -473,6 +490,7 @@ Completion ReplaySession::emulate_async_signal(
   const Registers& regs = trace_frame.regs();
   remote_code_ptr ip = regs.ip();
   bool did_set_internal_breakpoint = false;
+  bool did_set_target_debug_reg = false;
 
   /* Step 1: advance to the target ticks (minus a slack region) as
    * quickly as possible by programming the hpc. */
@@ -481,12 +499,22 @@ Completion ReplaySession::emulate_async_signal(
   LOG(debug) << "advancing " << ticks_left << " ticks to reach " << ticks << "/"
              << ip;
 
-  /* XXX should we only do this if (ticks > 10000)? */
-  while (ticks_left - SKID_SIZE > SKID_SIZE) {
-    LOG(debug) << "  programming interrupt for " << (ticks_left - SKID_SIZE)
+  /* Program an interrupt whenever we're further than the skid size from the
+   * target, however short the period. Every tick we leave for step 2 may cost
+   * a breakpoint trap or a singlestep. */
+  Ticks skid_size = PerfCounters::skid_size();
+  while (ticks_left > skid_size) {
+    LOG(debug) << "  programming interrupt for " << (ticks_left - skid_size)
                << " ticks";
 
-    continue_or_step(t, constraints, (TicksRequest)(ticks_left - SKID_SIZE));
+    Ticks ticks_before = t->tick_count();
+    continue_or_step(t, constraints, (TicksRequest)(ticks_left - skid_size));
+    if (precision_stats_.enabled() &&
+        t->pending_sig() == PerfCounters::TIME_SLICE_SIGNAL) {
+      precision_stats_.interrupt_fired(
+          trace_frame.event().type_name(),
+          t->tick_count() - ticks_before - (ticks_left - skid_size));
+    }
     guard_unexpected_signal(t);
 
     ticks_left = ticks - t->tick_count();
@@ -516,13 +544,17 @@ Completion ReplaySession::emulate_async_signal(
    * that $ip by the debugger), we check again if we're at the
    * target ticks and execution point.  If not, we temporarily
    * remove the breakpoint, single-step over the insn, and
-   * repeat.
+   * repeat. When the debug registers are free we use an
+   * execution breakpoint in one of them instead, which lets us
+   * resume straight past the target $ip.
    *
    * What we really want to do is set a (precise)
    * retired-instruction interrupt and do away with all this
    * cruft. */
   Registers mismatched_regs;
   const Registers* mismatched_regs_ptr = NULL;
+  Ticks ticks_left_after_interrupts = ticks_left;
+  uint64_t slow_steps = 0;
   while (true) {
     /* Invariants here are
      *  o ticks_left is up-to-date
@@ -556,6 +588,9 @@ Completion ReplaySession::emulate_async_signal(
         if (did_set_internal_breakpoint) {
           t->vm()->remove_breakpoint(ip, BKPT_INTERNAL);
         }
+        if (did_set_target_debug_reg) {
+          t->set_debug_regs(Task::DebugRegs());
+        }
         return INCOMPLETE;
       }
 
@@ -590,14 +625,22 @@ Completion ReplaySession::emulate_async_signal(
         continue;
       }
 
-      /* Otherwise, either we did an internal singlestep or a hardware
-       * watchpoint fired but values didn't change. */
+      /* Otherwise, either we did an internal singlestep, our debug
+       * register on the target $ip fired, or a hardware watchpoint fired
+       * but values didn't change. */
       if (trap_reasons.singlestep) {
         ASSERT(t, is_singlestep(SIGTRAP_run_command));
         LOG(debug) << "    (SIGTRAP; stepi'd target $ip)";
       } else {
         ASSERT(t, trap_reasons.watchpoint);
-        LOG(debug) << "    (SIGTRAP; HW watchpoint fired without changes)";
+        if (did_set_target_debug_reg && t->ip() == ip) {
+          /* Case (1) above, but the debug register traps before
+           * executing the instruction, so there are no tracks to
+           * cover. */
+          LOG(debug) << "    trap was for target $ip (debug register)";
+        } else {
+          LOG(debug) << "    (SIGTRAP; HW watchpoint fired without changes)";
+        }
       }
     }
 
@@ -614,9 +657,19 @@ Completion ReplaySession::emulate_async_signal(
 
     if (at_target) {
       /* Case (2) above: done. */
+      if (did_set_target_debug_reg) {
+        t->set_debug_regs(Task::DebugRegs());
+      }
+      if (precision_stats_.enabled()) {
+        precision_stats_.target_reached(trace_frame.event().type_name(),
+                                        ticks_left_after_interrupts,
+                                        slow_steps);
+      }
       return COMPLETE;
     }
 
+    ++slow_steps;
+
     /* At this point, we've proven that we're not at the
      * target execution point, and we've ensured the
      * internal breakpoint is unset. */
@@ -635,11 +688,41 @@ Completion ReplaySession::emulate_async_signal(
        * no slower than single-stepping our way to
        * the target execution point. */
       LOG(debug) << "    breaking on target $ip";
-      t->vm()->add_breakpoint(ip, BKPT_INTERNAL);
-      did_set_internal_breakpoint = true;
+      if (!did_set_target_debug_reg) {
+        /* Prefer a debug register execution breakpoint when the debugger
+         * isn't using the debug registers. It stays set while we pass the
+         * target $ip, see below, so a loop around the target $ip costs one
+         * trap per iteration rather than a trap, a singlestep and a
+         * resume. */
+        if (USE_DEBUG_REGISTER_TARGET && !constraints.is_singlestep() &&
+            !t->vm()->has_watchpoints() &&
+            t->vm()->get_breakpoint_type_at_addr(ip) != BKPT_USER &&
+            t->set_debug_regs(Task::DebugRegs(
+                1, WatchConfig(ip.to_data_ptr<void>(), 1, WATCH_EXEC)))) {
+          did_set_target_debug_reg = true;
+        } else {
+          t->vm()->add_breakpoint(ip, BKPT_INTERNAL);
+          did_set_internal_breakpoint = true;
+        }
+      }
+      continue_or_step(t, constraints, RESUME_UNLIMITED_TICKS);
+      SIGTRAP_run_command = constraints.command;
+    } else if (did_set_target_debug_reg && !constraints.is_singlestep() &&
+               (t->regs().flags() & X86_RF_FLAG) &&
+               !maybe_at_or_after_x86_string_instruction(t)) {
+      /* Case (3) above, stopped by our debug register. The kernel set RF,
+       * so resuming executes the instruction at the target $ip without
+       * trapping again, and the debug register catches the next time
+       * we get here. String instructions are left to fast-forwarding,
+       * since the target may be partway through one. */
+      LOG(debug) << "    (resuming past target $ip)";
       continue_or_step(t, constraints, RESUME_UNLIMITED_TICKS);
       SIGTRAP_run_command = constraints.command;
     } else {
+      if (did_set_target_debug_reg) {
+        t->set_debug_regs(Task::DebugRegs());
+        did_set_target_debug_reg = false;
+      }
       /* Case (3) above: we can't put a breakpoint
        * on the $ip, because resuming execution
        * would just trap and we'd be back where we
@@ -751,6 +834,19 @@ static bool treat_signal_event_as_deterministic(const SignalEvent& ev) {
   return ev.deterministic == DETERMINISTIC_SIG;
 }
 
+/**
+ * Replay the effects of Monkeypatcher patching an instruction for the
+ * current frame, if it did any.
+ */
+static void replay_patching(ReplayTask* t) {
+  // All patching effects have been recorded to the trace.
+  // First, replay any memory mapping done by Monkeypatcher.
+  process_patch_mappings(t);
+
+  // Now replay all data records.
+  t->apply_all_data_records_from_trace();
+}
+
 /**
  * Advance to the delivery of the deterministic signal |sig| and
  * update registers to what was recorded.  Return COMPLETE if successful or
@@ -761,7 +857,12 @@ Completion ReplaySession::emulate_deterministic_signal(
   if (t->regs().matches(trace_frame.regs()) &&
       t->tick_count() == trace_frame.ticks()) {
     // We're already at the target. This can happen when multiple signals
-    // are delivered with no intervening execution.
+    // are delivered with no intervening execution, or when a patched rdtsc
+    // (which doesn't change any registers) immediately follows the previous
+    // event.
+    if (EV_SEGV_RDTSC == trace_frame.event().type()) {
+      replay_patching(t);
+    }
     return COMPLETE;
   }
 
@@ -794,6 +895,10 @@ Completion ReplaySession::emulate_deterministic_signal(
 
   if (EV_SEGV_RDTSC == ev.type()) {
     t->set_regs(trace_frame.regs());
+    // Recording may have patched the rdtsc instead of emulating it.
+    replay_patching(t);
+  } else if (EV_SEGV_CPUID == ev.type()) {
+    t->set_regs(trace_frame.regs());
   }
 
   return COMPLETE;
@@ -805,19 +910,18 @@ Completion ReplaySession::emulate_deterministic_signal(
  * bytes and a pointer to the first record through outparams.
  */
 void ReplaySession::prepare_syscallbuf_records(ReplayTask* t) {
-  // Read the recorded syscall buffer back into the buffer
-  // region.
-  auto buf = t->trace_reader().read_raw_data();
-  ASSERT(t, buf.data.size() >= sizeof(struct syscallbuf_hdr));
-  ASSERT(t, buf.data.size() <= SYSCALLBUF_BUFFER_SIZE);
+  // Read the recorded syscall buffer straight into our mapping of the buffer
+  // region. The tracee is stopped, so it can't see the recorded header while
+  // it's there. Then put back t->syscallbuf_hdr, which needs to keep
+  // tracking the current syscallbuf state.
+  struct syscallbuf_hdr current_hdr = *t->syscallbuf_hdr;
+  auto buf = t->trace_reader().read_raw_data_into(t->syscallbuf_hdr,
+                                                  SYSCALLBUF_BUFFER_SIZE);
+  ASSERT(t, buf.size >= sizeof(struct syscallbuf_hdr));
   ASSERT(t, buf.addr == t->syscallbuf_child.cast<void>());
 
-  struct syscallbuf_hdr recorded_hdr;
-  memcpy(&recorded_hdr, buf.data.data(), sizeof(struct syscallbuf_hdr));
-  // Don't overwrite t->syscallbuf_hdr. That needs to keep tracking the current
-  // syscallbuf state.
-  memcpy(t->syscallbuf_hdr + 1, buf.data.data() + sizeof(struct syscallbuf_hdr),
-         buf.data.size() - sizeof(struct syscallbuf_hdr));
+  struct syscallbuf_hdr recorded_hdr = *t->syscallbuf_hdr;
+  *t->syscallbuf_hdr = current_hdr;
 
   ASSERT(t, recorded_hdr.num_rec_bytes + sizeof(struct syscallbuf_hdr) <=
                 SYSCALLBUF_BUFFER_SIZE);
@@ -896,27 +1000,7 @@ Completion ReplaySession::patch_next_syscall(
   }
 
   t->exit_syscall_and_prepare_restart();
-
-  // All patching effects have been recorded to the trace.
-  // First, replay any memory mapping done by Monkeypatcher. There should be
-  // at most one but we might as well be general.
-  while (true) {
-    TraceReader::MappedData data;
-    bool found;
-    KernelMapping km = t->trace_reader().read_mapped_region(&data, &found);
-    if (!found) {
-      break;
-    }
-    AutoRemoteSyscalls remote(t);
-    ASSERT(t, km.flags() & MAP_ANONYMOUS);
-    remote.infallible_mmap_syscall(km.start(), km.size(), km.prot(),
-                                   km.flags() | MAP_FIXED, -1, 0);
-    t->vm()->map(km.start(), km.size(), km.prot(), km.flags(), 0, string(),
-                 KernelMapping::NO_DEVICE, KernelMapping::NO_INODE, &km);
-  }
-
-  // Now replay all data records.
-  t->apply_all_data_records_from_trace();
+  replay_patching(t);
   return COMPLETE;
 }
 
@@ -942,7 +1026,7 @@ void ReplaySession::check_approaching_ticks_target(
     BreakStatus& break_status) {
   if (constraints.ticks_target > 0) {
     Ticks ticks_left = constraints.ticks_target - t->tick_count();
-    if (ticks_left <= SKID_SIZE) {
+    if (ticks_left <= PerfCounters::skid_size()) {
       break_status.approaching_ticks_target = true;
     }
   }
@@ -1057,6 +1141,35 @@ Completion ReplaySession::exit_task(ReplayTask* t) {
  * requested a restart. If this returns false, t's Session state was not
  * modified.
  */
+/**
+ * Adds the wall-clock time between its construction and destruction to
+ * a session's syscall emulation time, less the time accounted to ptrace
+ * waits, memory restores and trace reads in between.
+ */
+class AutoAccumulateSyscallEmulationTime {
+public:
+  AutoAccumulateSyscallEmulationTime(ReplaySession& session)
+      : session(session),
+        before(session.statistics()),
+        before_block_wait(session.trace_reader().block_wait_seconds()),
+        start(monotonic_now_sec()) {}
+  ~AutoAccumulateSyscallEmulationTime() {
+    Session::Statistics after = session.statistics();
+    double elapsed = monotonic_now_sec() - start;
+    elapsed -= after.wait_seconds - before.wait_seconds;
+    elapsed -= after.memory_restore_seconds - before.memory_restore_seconds;
+    elapsed -=
+        session.trace_reader().block_wait_seconds() - before_block_wait;
+    session.accumulate_syscall_emulation_seconds(max(elapsed, 0.0));
+  }
+
+private:
+  ReplaySession& session;
+  Session::Statistics before;
+  double before_block_wait;
+  double start;
+};
+
 void ReplaySession::setup_replay_one_trace_frame(ReplayTask* t) {
   const Event& ev = trace_frame.event();
 
@@ -1096,6 +1209,16 @@ void ReplaySession::setup_replay_one_trace_frame(ReplayTask* t) {
       // the recorded data area. This is important because stray reads such
       // as those performed by return_addresses should be consistent.
       t->reset_syscallbuf();
+      {
+        // If the recorder grew the buffer here, it saved the new header.
+        TraceReader::RawData data;
+        if (t->trace_reader().read_raw_data_for_frame(trace_frame, data)) {
+          ASSERT(t, data.data.size() == sizeof(struct syscallbuf_hdr));
+          auto hdr = reinterpret_cast<struct syscallbuf_hdr*>(data.data.data());
+          ASSERT(t, hdr->usable_size <= t->num_syscallbuf_bytes);
+          t->syscallbuf_hdr->usable_size = hdr->usable_size;
+        }
+      }
       current_step.action = TSTEP_RETIRE;
       break;
     case EV_PATCH_SYSCALL:
@@ -1106,6 +1229,15 @@ void ReplaySession::setup_replay_one_trace_frame(ReplayTask* t) {
       current_step.target.ticks = trace_frame.ticks();
       current_step.target.signo = 0;
       break;
+    case EV_SEGV_CPUID:
+      // Without faulting, the tracee would execute this cpuid itself and
+      // run past the event. Traces that never trapped a cpuid replay fine.
+      if (!has_cpuid_faulting()) {
+        FATAL() << "Trace has cpuid results recorded with CPUID faulting, "
+                   "but this machine doesn't support it, so they can't be "
+                   "replayed.";
+      }
+      // Fall through...
     case EV_SEGV_RDTSC:
       current_step.action = TSTEP_DETERMINISTIC_SIGNAL;
       current_step.target.ticks = -1;
@@ -1143,7 +1275,17 @@ void ReplaySession::setup_replay_one_trace_frame(ReplayTask* t) {
       if (trace_frame.event().Syscall().state == ENTERING_SYSCALL) {
         rep_prepare_run_to_syscall(t, &current_step);
       } else {
-        rep_process_syscall(t, &current_step);
+        {
+          AutoAccumulateSyscallEmulationTime timer(*this);
+          double start = Timeline::enabled() ? Timeline::now_us() : 0;
+          rep_process_syscall(t, &current_step);
+          if (Timeline::enabled()) {
+            Timeline::complete(
+                Timeline::TRACEE, t->rec_tid, "syscall",
+                syscall_name(trace_frame.event().Syscall().number, t->arch()),
+                start);
+          }
+        }
         if (current_step.action == TSTEP_RETIRE) {
           t->on_syscall_exit(current_step.syscall.number, trace_frame.regs());
           maybe_gc_emufs(t->arch(), trace_frame.regs().syscallno());
@@ -1162,7 +1304,25 @@ bool ReplaySession::next_step_is_syscall_exit(int syscallno) {
          trace_frame.event().Syscall().state == EXITING_SYSCALL;
 }
 
+/**
+ * Adds the wall-clock time between its construction and destruction to
+ * a session's statistics.
+ */
+class AutoAccumulateReplayTime {
+public:
+  AutoAccumulateReplayTime(Session& session)
+      : session(session), start(monotonic_now_sec()) {}
+  ~AutoAccumulateReplayTime() {
+    session.accumulate_replay_seconds(monotonic_now_sec() - start);
+  }
+
+private:
+  Session& session;
+  double start;
+};
+
 ReplayResult ReplaySession::replay_step(const StepConstraints& constraints) {
+  AutoAccumulateReplayTime timer(*this);
   finish_initializing();
 
   ReplayResult result(REPLAY_CONTINUE);
@@ -1225,7 +1385,8 @@ ReplayResult ReplaySession::replay_step(const StepConstraints& constraints) {
   switch (current_step.action) {
     case TSTEP_DETERMINISTIC_SIGNAL:
     case TSTEP_PROGRAM_ASYNC_SIGNAL_INTERRUPT:
-      if (trace_frame.event().type() != EV_SEGV_RDTSC) {
+      if (trace_frame.event().type() != EV_SEGV_RDTSC &&
+          trace_frame.event().type() != EV_SEGV_CPUID) {
         result.break_status.signal = current_step.target.signo;
       }
       if (constraints.is_singlestep()) {
@@ -8,6 +8,7 @@
 #include "CPUIDBugDetector.h"
 #include "DiversionSession.h"
 #include "EmuFs.h"
+#include "ReplayPrecisionStats.h"
 #include "Session.h"
 
 struct syscallbuf_hdr;
@@ -225,7 +226,10 @@ public:
 
   struct StepConstraints {
     explicit StepConstraints(RunCommand command)
-        : command(command), stop_at_time(0), ticks_target(0) {}
+        : command(command),
+          stop_at_time(0),
+          ticks_target(0),
+          fast_forward_ticks_limit(0) {}
     RunCommand command;
     TraceFrame::Time stop_at_time;
     Ticks ticks_target;
@@ -234,6 +238,10 @@ public:
     // RUN_SINGLESTEP_FAST_FORWARD will always singlestep at least once
     // regardless.
     std::vector<const Registers*> stop_before_states;
+    // When the RunCommand is RUN_SINGLESTEP_FAST_FORWARD and this is
+    // nonzero, fast-forwarding may run whole iterations of a simple loop,
+    // as long as the task's ticks stay below this.
+    Ticks fast_forward_ticks_limit;
 
     bool is_singlestep() const {
       return command == RUN_SINGLESTEP ||
@@ -273,14 +281,31 @@ public:
   static bool is_ignored_signal(int sig);
 
   struct Flags {
-    Flags() : redirect_stdio(false) {}
+    Flags()
+        : redirect_stdio(false), checkpoint_memory_budget(0),
+          replay_ahead(false) {}
     Flags(const Flags& other) = default;
     bool redirect_stdio;
+    // Upper bound on the memory used by reverse-execution checkpoints of
+    // this session, in bytes. 0 for no limit.
+    uint64_t checkpoint_memory_budget;
+    // File to append checkpoint statistics to, or empty for none.
+    std::string checkpoint_log;
+    // Replay ahead speculatively while the debugger is stopped.
+    bool replay_ahead;
   };
   bool redirect_stdio() { return flags.redirect_stdio; }
 
+  ReplayPrecisionStats& precision_stats() { return precision_stats_; }
+
   void set_flags(const Flags& flags) { this->flags = flags; }
 
+  /**
+   * Faulting is only turned on where the replay host supports it. Traces
+   * recorded with it that never trapped a cpuid still replay without it.
+   */
+  virtual bool has_cpuid_faulting() const;
+
 private:
   ReplaySession(const std::string& dir)
       : emu_fs(EmuFs::create()),
@@ -339,6 +364,7 @@ private:
   Ticks ticks_at_start_of_event;
   CPUIDBugDetector cpuid_bug_detector;
   Flags flags;
+  ReplayPrecisionStats precision_stats_;
   bool did_fast_forward;
 };
 
@@ -59,20 +59,40 @@ const TraceFrame& ReplayTask::current_trace_frame() {
 }
 
 ssize_t ReplayTask::set_data_from_trace() {
-  auto buf = trace_reader().read_raw_data();
-  if (!buf.addr.is_null() && buf.data.size() > 0) {
-    write_bytes_helper(buf.addr, buf.data.size(), buf.data.data());
+  auto buf = trace_reader().read_raw_data_ref();
+  if (!buf.addr.is_null() && buf.size > 0) {
+    double start = monotonic_now_sec();
+    write_bytes_helper(buf.addr, buf.size, buf.data);
+    session().accumulate_memory_restore_seconds(monotonic_now_sec() - start);
   }
-  return buf.data.size();
+  return buf.size;
 }
 
 void ReplayTask::apply_all_data_records_from_trace() {
-  TraceReader::RawData buf;
-  while (trace_reader().read_raw_data_for_frame(current_trace_frame(), buf)) {
-    if (!buf.addr.is_null() && buf.data.size() > 0) {
-      write_bytes_helper(buf.addr, buf.data.size(), buf.data.data());
+  // A RawDataRef is only valid until the next read, so records are copied
+  // into |storage| and written together once they've all been read.
+  vector<uint8_t> storage;
+  vector<MemoryWrite> writes;
+  TraceReader::RawDataRef buf;
+  while (trace_reader().read_raw_data_ref_for_frame(current_trace_frame(),
+                                                    buf)) {
+    if (!buf.addr.is_null() && buf.size > 0) {
+      writes.push_back({ buf.addr, buf.size, nullptr });
+      storage.insert(storage.end(), buf.data, buf.data + buf.size);
     }
   }
+  double start = monotonic_now_sec();
+  if (writes.size() == 1) {
+    write_bytes_helper(writes[0].addr, writes[0].size, storage.data());
+  } else {
+    size_t offset = 0;
+    for (auto& w : writes) {
+      w.data = storage.data() + offset;
+      offset += w.size;
+    }
+    write_bytes_batch(writes);
+  }
+  session().accumulate_memory_restore_seconds(monotonic_now_sec() - start);
 }
 
 void ReplayTask::set_return_value_from_trace() {
@@ -2,10 +2,17 @@
 
 #include "ReplayTimeline.h"
 
+#include <fcntl.h>
 #include <math.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <set>
 
 #include "fast_forward.h"
 #include "log.h"
+#include "util.h"
 
 using namespace std;
 
@@ -64,10 +71,22 @@ ReplayTimeline::ReplayTimeline(std::shared_ptr<ReplaySession> session,
                                const ReplaySession::Flags& session_flags)
     : session_flags(session_flags),
       current(std::move(session)),
+      mark_count(0),
+      prune_marks_at(min_marks_before_prune),
       breakpoints_applied(false),
-      reverse_execution_barrier_event(0) {
+      breakpoints_generation_(0),
+      reverse_execution_barrier_event(0),
+      reverse_step_latency_target_(default_reverse_step_latency_target),
+      clone_seconds(default_clone_seconds) {
   current->set_visible_execution(false);
   current->set_flags(session_flags);
+  if (!session_flags.checkpoint_log.empty()) {
+    checkpoint_log = ScopedFd(session_flags.checkpoint_log.c_str(),
+                              O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (!checkpoint_log.is_open()) {
+      FATAL() << "Can't open checkpoint log " << session_flags.checkpoint_log;
+    }
+  }
 }
 
 ReplayTimeline::~ReplayTimeline() {
@@ -120,6 +139,52 @@ shared_ptr<ReplayTimeline::InternalMark> ReplayTimeline::current_mark() {
   return shared_ptr<InternalMark>();
 }
 
+shared_ptr<const ExtraRegisters> ReplayTimeline::share_extra_regs(
+    const ExtraRegisters& regs) {
+  if (!last_extra_regs || last_extra_regs->format() != regs.format() ||
+      last_extra_regs->data_size() != regs.data_size() ||
+      memcmp(last_extra_regs->data_bytes(), regs.data_bytes(),
+             regs.data_size())) {
+    last_extra_regs = make_shared<ExtraRegisters>(regs);
+  }
+  return last_extra_regs;
+}
+
+void ReplayTimeline::maybe_prune_marks() {
+  if (mark_count < prune_marks_at) {
+    return;
+  }
+  size_t before = mark_count;
+  mark_count = 0;
+  for (auto it = marks.begin(); it != marks.end();) {
+    auto& mark_vector = it->second;
+    size_t kept = 0;
+    for (size_t i = 0; i < mark_vector.size(); ++i) {
+      if (mark_vector[i].use_count() == 1 && !mark_vector[i]->checkpoint) {
+        if (kept > 0) {
+          // Singlestepping from the previous kept mark no longer reaches
+          // the next mark in the vector.
+          mark_vector[kept - 1]->singlestep_to_next_mark_no_signal = false;
+        }
+        continue;
+      }
+      if (kept != i) {
+        mark_vector[kept] = move(mark_vector[i]);
+      }
+      ++kept;
+    }
+    mark_vector.resize(kept);
+    mark_count += kept;
+    if (mark_vector.empty()) {
+      it = marks.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  prune_marks_at = max<size_t>(min_marks_before_prune, 2 * mark_count);
+  LOG(debug) << "Pruned marks from " << before << " to " << mark_count;
+}
+
 ReplayTimeline::Mark ReplayTimeline::mark() {
   Mark result;
   auto cm = current_mark();
@@ -134,8 +199,10 @@ ReplayTimeline::Mark ReplayTimeline::mark() {
   auto& mark_vector = marks[key];
   if (mark_vector.empty()) {
     mark_vector.push_back(m);
+    ++mark_count;
   } else if (mark_vector[mark_vector.size() - 1] == current_at_or_after_mark) {
     mark_vector.push_back(m);
+    ++mark_count;
   } else {
     // Now the hard part: figuring out where to put it in the list of existing
     // marks.
@@ -201,6 +268,7 @@ ReplayTimeline::Mark ReplayTimeline::mark() {
     // mark_index is the current index of the next mark after 'current'. So
     // insert our new marks at mark_index.
     mark_vector.insert(mark_index, new_marks.begin(), new_marks.end());
+    mark_count += new_marks.size();
   }
   swap(m, result.ptr);
   current_at_or_after_mark = result.ptr;
@@ -264,7 +332,14 @@ ReplayTimeline::Mark ReplayTimeline::add_explicit_checkpoint() {
   Mark m = mark();
   if (!m.ptr->checkpoint) {
     unapply_breakpoints_and_watchpoints();
+    double start = monotonic_now_sec();
     m.ptr->checkpoint = current->clone();
+    double now = monotonic_now_sec();
+    clone_seconds = 0.75 * clone_seconds + 0.25 * (now - start);
+    m.ptr->checkpoint_created_at = now;
+    m.ptr->checkpoint_clone_seconds = now - start;
+    m.ptr->checkpoint_uses = 0;
+    log_checkpoint("create", *m.ptr);
     auto key = m.ptr->key;
     if (marks_with_checkpoints.find(key) == marks_with_checkpoints.end()) {
       marks_with_checkpoints[key] = 1;
@@ -286,11 +361,80 @@ void ReplayTimeline::remove_mark_with_checkpoint(const MarkKey& key) {
 void ReplayTimeline::remove_explicit_checkpoint(const Mark& mark) {
   assert(mark.ptr->checkpoint_refcount > 0);
   if (--mark.ptr->checkpoint_refcount == 0) {
+    log_checkpoint("discard", *mark.ptr);
     mark.ptr->checkpoint = nullptr;
     remove_mark_with_checkpoint(mark.ptr->key);
   }
 }
 
+string ReplayTimeline::checkpoint_json(const InternalMark& m) {
+  bool reverse_exec = false;
+  for (auto& c : reverse_exec_checkpoints) {
+    if (c.first.ptr.get() == &m) {
+      reverse_exec = true;
+      break;
+    }
+  }
+  uint64_t shared_bytes;
+  uint64_t private_bytes = m.checkpoint->private_memory_size(&shared_bytes);
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           "{\"event\":%lld,\"ticks\":%lld,\"reverse_exec\":%s,"
+           "\"refcount\":%u,\"age_seconds\":%.3f,\"clone_seconds\":%.6f,"
+           "\"private_bytes\":%llu,\"shared_bytes\":%llu,\"uses\":%u}",
+           (long long)m.key.trace_time, (long long)m.key.ticks,
+           reverse_exec ? "true" : "false", m.checkpoint_refcount,
+           monotonic_now_sec() - m.checkpoint_created_at,
+           m.checkpoint_clone_seconds, (unsigned long long)private_bytes,
+           (unsigned long long)shared_bytes, m.checkpoint_uses);
+  return buf;
+}
+
+string ReplayTimeline::checkpoint_stats_json() {
+  string result = "{\"checkpoints\":[";
+  for (auto& key : marks_with_checkpoints) {
+    for (auto& m : marks[key.first]) {
+      if (!m->checkpoint) {
+        continue;
+      }
+      if (result.size() > 1) {
+        result += ",\n";
+      }
+      result += checkpoint_json(*m);
+    }
+  }
+
+  // Count each shared ExtraRegisters buffer once.
+  set<const ExtraRegisters*> extra_regs;
+  uint64_t bytes = 0;
+  for (auto& key : marks) {
+    bytes += sizeof(key) + key.second.capacity() * sizeof(key.second[0]);
+    for (auto& m : key.second) {
+      bytes += sizeof(*m);
+      if (extra_regs.insert(m->extra_regs.get()).second) {
+        bytes += sizeof(ExtraRegisters) + m->extra_regs->data_size();
+      }
+    }
+  }
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "],\n\"marks\":{\"count\":%llu,\"keys\":%llu,"
+           "\"distinct_extra_regs\":%llu,\"bytes\":%llu}}",
+           (unsigned long long)mark_count, (unsigned long long)marks.size(),
+           (unsigned long long)extra_regs.size(), (unsigned long long)bytes);
+  return result + buf;
+}
+
+void ReplayTimeline::log_checkpoint(const char* what, const InternalMark& m) {
+  if (!checkpoint_log.is_open()) {
+    return;
+  }
+  string line = string("{\"") + what + "\":" + checkpoint_json(m) + "}\n";
+  if (write(checkpoint_log, line.data(), line.size()) != (ssize_t)line.size()) {
+    LOG(warn) << "Can't write checkpoint log";
+  }
+}
+
 void ReplayTimeline::seek_to_before_key(const MarkKey& key) {
   auto it = marks_with_checkpoints.lower_bound(key);
   // 'it' points to the first value equivalent to or greater than 'key'.
@@ -317,6 +461,7 @@ void ReplayTimeline::seek_to_before_key(const MarkKey& key) {
       for (auto mark_it : marks[it->first]) {
         shared_ptr<InternalMark> m(mark_it);
         if (m->checkpoint) {
+          ++m->checkpoint_uses;
           current = m->checkpoint->clone();
           // At this point, m->checkpoint is fully initialized but current
           // is not. Swap them so that m->checkpoint is not fully
@@ -332,6 +477,41 @@ void ReplayTimeline::seek_to_before_key(const MarkKey& key) {
   }
 }
 
+bool ReplayTimeline::seek_to_ticks(TraceFrame::Time time, Ticks ticks) {
+  seek_to_before_key(MarkKey(time, ticks, ReplayStepKey()));
+  unapply_breakpoints_and_watchpoints();
+
+  ReplaySession::StepConstraints constraints(RUN_CONTINUE);
+  constraints.stop_at_time = time;
+  while (current->trace_reader().time() < time) {
+    if (current->replay_step(constraints).status == REPLAY_EXITED) {
+      return false;
+    }
+  }
+
+  ReplayTask* t = current->current_task();
+  if (!t) {
+    return true;
+  }
+  Ticks target = min(ticks, current->current_trace_frame().ticks());
+  // Continue with a ticks target to get close cheaply, then singlestep
+  // the last few ticks, like replay_step_to_mark.
+  while (current->trace_reader().time() == time && t->tick_count() < target) {
+    constraints = ReplaySession::StepConstraints(RUN_CONTINUE);
+    constraints.ticks_target = target;
+    ReplayResult result = current->replay_step(constraints);
+    if (result.break_status.approaching_ticks_target) {
+      break;
+    }
+  }
+  while (current->trace_reader().time() == time && t->tick_count() < target) {
+    current->replay_step(RUN_SINGLESTEP);
+  }
+  LOG(debug) << "Seeked to ticks " << ticks << " of event " << time << ": "
+             << current_mark_key();
+  return true;
+}
+
 void ReplayTimeline::seek_up_to_mark(const Mark& mark) {
   if (current_mark_key() == mark.ptr->key) {
     Mark cm = this->mark();
@@ -351,6 +531,7 @@ void ReplayTimeline::seek_up_to_mark(const Mark& mark) {
       at_or_before_mark = true;
     }
     if (at_or_before_mark && m->checkpoint) {
+      ++m->checkpoint_uses;
       current = m->checkpoint->clone();
       // At this point, m->checkpoint is fully initialized but current
       // is not. Swap them so that m->checkpoint is not fully
@@ -600,6 +781,7 @@ bool ReplayTimeline::add_breakpoint(
     return false;
   }
   breakpoints.insert(make_tuple(t->vm()->uid(), addr, move(condition)));
+  breakpoints_changed();
   return true;
 }
 
@@ -610,6 +792,7 @@ void ReplayTimeline::remove_breakpoint(ReplayTask* t, remote_code_ptr addr) {
   ASSERT(t, has_breakpoint_at_address(t, addr));
   auto it = breakpoints.lower_bound(make_tuple(t->vm()->uid(), addr, nullptr));
   breakpoints.erase(it);
+  breakpoints_changed();
 }
 
 bool ReplayTimeline::has_breakpoint_at_address(ReplayTask* t,
@@ -635,6 +818,7 @@ bool ReplayTimeline::add_watchpoint(ReplayTask* t, remote_ptr<void> addr,
       make_tuple(t->vm()->uid(), addr, num_bytes, type, move(condition)));
   no_watchpoints_hit_interval_start = no_watchpoints_hit_interval_start =
       Mark();
+  breakpoints_changed();
   return true;
 }
 
@@ -647,6 +831,7 @@ void ReplayTimeline::remove_watchpoint(ReplayTask* t, remote_ptr<void> addr,
   auto it = watchpoints.lower_bound(
       make_tuple(t->vm()->uid(), addr, num_bytes, type, nullptr));
   watchpoints.erase(it);
+  breakpoints_changed();
 }
 
 bool ReplayTimeline::has_watchpoint_at_address(ReplayTask* t,
@@ -663,6 +848,7 @@ void ReplayTimeline::remove_breakpoints_and_watchpoints() {
   unapply_breakpoints_and_watchpoints();
   breakpoints.clear();
   watchpoints.clear();
+  breakpoints_changed();
 }
 
 void ReplayTimeline::apply_breakpoints_and_watchpoints() {
@@ -670,15 +856,7 @@ void ReplayTimeline::apply_breakpoints_and_watchpoints() {
     return;
   }
   breakpoints_applied = true;
-  for (auto& bp : breakpoints) {
-    AddressSpace* vm = current->find_address_space(get<0>(bp));
-    // XXX handle cases where we can't apply a breakpoint right now. Later
-    // during replay the address space might be created (or new mappings might
-    // be created) and we should reapply breakpoints then.
-    if (vm) {
-      vm->add_breakpoint(get<1>(bp), BKPT_USER);
-    }
-  }
+  add_user_breakpoints();
   for (auto& wp : watchpoints) {
     AddressSpace* vm = current->find_address_space(get<0>(wp));
     // XXX handle cases where we can't apply a watchpoint right now. Later
@@ -692,6 +870,23 @@ void ReplayTimeline::apply_breakpoints_and_watchpoints() {
   }
 }
 
+void ReplayTimeline::add_user_breakpoints() {
+  // Insert each address space's breakpoints in one batch.
+  map<AddressSpaceUid, vector<remote_code_ptr> > addrs_by_vm;
+  for (auto& bp : breakpoints) {
+    addrs_by_vm[get<0>(bp)].push_back(get<1>(bp));
+  }
+  for (auto& it : addrs_by_vm) {
+    AddressSpace* vm = current->find_address_space(it.first);
+    // XXX handle cases where we can't apply a breakpoint right now. Later
+    // during replay the address space might be created (or new mappings might
+    // be created) and we should reapply breakpoints then.
+    if (vm) {
+      vm->add_breakpoints(it.second, BKPT_USER);
+    }
+  }
+}
+
 void ReplayTimeline::unapply_breakpoints_and_watchpoints() {
   if (!breakpoints_applied) {
     return;
@@ -709,12 +904,7 @@ ReplayResult ReplayTimeline::singlestep_with_breakpoints_disabled() {
     vm->remove_all_breakpoints();
   }
   auto result = current->replay_step(RUN_SINGLESTEP);
-  for (auto& bp : breakpoints) {
-    AddressSpace* vm = current->find_address_space(get<0>(bp));
-    if (vm) {
-      vm->add_breakpoint(get<1>(bp), BKPT_USER);
-    }
-  }
+  add_user_breakpoints();
   return result;
 }
 
@@ -834,12 +1024,146 @@ static ReplayTask* to_replay_task(const BreakStatus& status) {
   return static_cast<ReplayTask*>(status.task);
 }
 
+// Stop replaying ahead once this much tracee output is being held back.
+static const size_t MAX_REPLAY_AHEAD_OUTPUT = 16 * 1024 * 1024;
+
+static size_t captured_size(const vector<StdioMonitor::CapturedOutput>& c) {
+  size_t size = 0;
+  for (auto& o : c) {
+    size += o.data.size();
+  }
+  return size;
+}
+
+bool ReplayTimeline::replay_ahead_is_valid(const ReplayAhead& a,
+                                           TraceFrame::Time stop_at_time) {
+  return a.breakpoints_generation == breakpoints_generation_ &&
+         a.stop_at_time == stop_at_time && at_mark(a.start);
+}
+
+void ReplayTimeline::swap_replay_ahead_session() {
+  swap(current, ahead->session);
+  swap(current_at_or_after_mark, ahead->at_or_after_mark);
+  swap(breakpoints_applied, ahead->breakpoints_applied);
+}
+
+void ReplayTimeline::replay_ahead(
+    TraceFrame::Time stop_at_time,
+    const std::function<bool()>& interrupt_check) {
+  if (ahead && !replay_ahead_is_valid(*ahead, stop_at_time)) {
+    LOG(debug) << "Discarding replay-ahead from " << ahead->start;
+    ahead = nullptr;
+  }
+  if (!ahead) {
+    if (!can_add_checkpoint()) {
+      return;
+    }
+    ahead = unique_ptr<ReplayAhead>(new ReplayAhead());
+    ahead->start = mark();
+    ahead->breakpoints_generation = breakpoints_generation_;
+    ahead->stop_at_time = stop_at_time;
+    // Breakpoints are applied to the clone as it runs.
+    unapply_breakpoints_and_watchpoints();
+    ahead->session = current->clone();
+    ahead->at_or_after_mark = current_at_or_after_mark;
+    ahead->breakpoints_applied = false;
+    ahead->steps = 0;
+    ahead->done = false;
+    LOG(debug) << "Starting replay-ahead from " << ahead->start;
+  }
+  if (ahead->done) {
+    return;
+  }
+
+  swap_replay_ahead_session();
+  StdioMonitor::capture_replayed_output(&ahead->output);
+  while (!interrupt_check()) {
+    ahead->last_result = replay_step_forward(RUN_CONTINUE, stop_at_time);
+    ++ahead->steps;
+    ReplayResult& r = ahead->last_result;
+    ReplayTask* t = current->current_task();
+    // Stop wherever the debugger might need to look at the result, or
+    // where GdbServer refuses to go further forward.
+    if (r.status != REPLAY_CONTINUE || r.break_status.any_break() ||
+        r.break_status.task_exit || !t ||
+        current->next_step_is_syscall_exit(
+            syscall_number_for_execve(t->arch())) ||
+        captured_size(ahead->output) >= MAX_REPLAY_AHEAD_OUTPUT) {
+      ahead->done = true;
+      break;
+    }
+  }
+  StdioMonitor::capture_replayed_output(nullptr);
+  swap_replay_ahead_session();
+  LOG(debug) << "Replay-ahead made " << ahead->steps << " steps"
+             << (ahead->done ? " and is done" : "");
+}
+
+bool ReplayTimeline::take_replay_ahead(TraceFrame::Time stop_at_time,
+                                       ReplayResult* result) {
+  if (!ahead) {
+    return false;
+  }
+  unique_ptr<ReplayAhead> a = move(ahead);
+  if (!a->steps || !replay_ahead_is_valid(*a, stop_at_time)) {
+    return false;
+  }
+  LOG(debug) << "Using replay-ahead from " << a->start << " after "
+             << a->steps << " steps";
+  current = a->session;
+  current_at_or_after_mark = a->at_or_after_mark;
+  breakpoints_applied = a->breakpoints_applied;
+  StdioMonitor::write_captured_output(a->output);
+  *result = a->last_result;
+  return true;
+}
+
+bool ReplayTimeline::reverse_continue_from_index(
+    Mark& end, const std::function<bool(ReplayTask* t)>& stop_filter,
+    ReplayResult& result) {
+  if (!breakpoint_hit_index_start || end < breakpoint_hit_index_start ||
+      end > breakpoint_hit_index_end) {
+    return false;
+  }
+  for (auto it = breakpoint_hit_index.rbegin();
+       it != breakpoint_hit_index.rend(); ++it) {
+    if (it->mark >= end) {
+      // gdb expects us to skip a breakpoint at the point we started from.
+      continue;
+    }
+    // The stop filter only looks at task identity, so we can ask it about
+    // the task as it is now. If the task no longer exists, we can't.
+    ReplayTask* t = current->find_task(it->tuid);
+    if (!t) {
+      return false;
+    }
+    if (stop_filter(t)) {
+      LOG(debug) << "Found breakpoint break at " << it->mark << " in index";
+      result = it->result;
+      seek_to_mark(it->mark);
+      result.break_status.task = current->find_task(it->tuid);
+      result.break_status.singlestep_complete = false;
+      return true;
+    }
+  }
+  // Nothing we want between the start of the index and |end|.
+  LOG(debug) << "No breakpoint breaks before " << end << " in index";
+  end = breakpoint_hit_index_start;
+  return false;
+}
+
 ReplayResult ReplayTimeline::reverse_continue(
     const std::function<bool(ReplayTask* t)>& stop_filter,
     const std::function<bool()>& interrupt_check) {
+  maybe_prune_marks();
   Mark end = mark();
   LOG(debug) << "ReplayTimeline::reverse_continue from " << end;
 
+  ReplayResult indexed_result;
+  if (reverse_continue_from_index(end, stop_filter, indexed_result)) {
+    return indexed_result;
+  }
+
   bool last_stop_is_watch_or_signal;
   ReplayResult final_result;
   TaskUid final_tuid;
@@ -878,6 +1202,11 @@ ReplayResult ReplayTimeline::reverse_continue(
 
     bool at_breakpoint = false;
     ReplayStepToMarkStrategy strategy;
+    // Breakpoint stops seen in this scan, for breakpoint_hit_index.
+    // Scans that see other kinds of stop, or skip part of the interval,
+    // aren't indexed.
+    vector<BreakpointHit> scan_hits;
+    bool scan_indexable = true;
     int stop_count = 0;
     bool made_progress_between_stops = false;
     remote_code_ptr avoidable_stop_ip;
@@ -908,6 +1237,13 @@ ReplayResult ReplayTimeline::reverse_continue(
       }
 
       evaluate_conditions(result);
+      if (!result.break_status.watchpoints_hit.empty() ||
+          result.break_status.signal) {
+        scan_indexable = false;
+      } else if (result.break_status.breakpoint_hit && scan_indexable) {
+        scan_hits.push_back(
+            { mark(), result.break_status.task->tuid(), result });
+      }
       if (result.break_status.any_break() &&
           !stop_filter(to_replay_task(result.break_status))) {
         result.break_status = BreakStatus();
@@ -937,6 +1273,7 @@ ReplayResult ReplayTimeline::reverse_continue(
       assert(result.status == REPLAY_CONTINUE);
 
       if (is_start_of_reverse_execution_barrier_event()) {
+        scan_indexable = false;
         dest = mark();
         final_result = result;
         final_result.break_status.task = current->current_task();
@@ -947,6 +1284,11 @@ ReplayResult ReplayTimeline::reverse_continue(
       }
 
       if (at_mark(end)) {
+        if (scan_indexable) {
+          breakpoint_hit_index = move(scan_hits);
+          breakpoint_hit_index_start = start;
+          breakpoint_hit_index_end = end;
+        }
         // In the next iteration, retry from an earlier checkpoint.
         end = start;
         break;
@@ -1090,6 +1432,9 @@ ReplayResult ReplayTimeline::reverse_singlestep(
                          << current_mark_key();
               constraints =
                   ReplaySession::StepConstraints(RUN_SINGLESTEP_FAST_FORWARD);
+              // We stop stepping at ticks_target, so whole loop iterations
+              // that stay below it can be run at once.
+              constraints.fast_forward_ticks_limit = ticks_target;
             }
           } else {
             if (seen_other_task_break) {
@@ -1284,6 +1629,7 @@ void ReplayTimeline::evaluate_conditions(ReplayResult& result) {
 ReplayResult ReplayTimeline::replay_step_forward(
     RunCommand command, TraceFrame::Time stop_at_time) {
   assert(command != RUN_SINGLESTEP_FAST_FORWARD);
+  maybe_prune_marks();
 
   ReplayResult result;
   apply_breakpoints_and_watchpoints();
@@ -1321,6 +1667,7 @@ ReplayResult ReplayTimeline::reverse_singlestep(
     const TaskUid& tuid, Ticks tuid_ticks,
     const std::function<bool(ReplayTask* t)>& stop_filter,
     const std::function<bool()>& interrupt_check) {
+  maybe_prune_marks();
   return reverse_singlestep(mark(), tuid, tuid_ticks, stop_filter,
                             interrupt_check);
 }
@@ -1364,43 +1711,69 @@ ReplayTimeline::Progress ReplayTimeline::estimate_progress() {
  * never have a large number of checkpoints.
  */
 
+const size_t ReplayTimeline::min_marks_before_prune;
+
+/**
+ * By default, aim for about 0.5s of replay between checkpoints in
+ * LOW_OVERHEAD mode, so a reverse step or continue whose destination is
+ * within 0.5s should take at most a second.
+ */
+const double ReplayTimeline::default_reverse_step_latency_target = 0.5;
+
+/**
+ * Until we've measured it, guess that a checkpoint takes about 50ms, which
+ * is roughly what Firefox needs.
+ */
+const double ReplayTimeline::default_clone_seconds = 0.05;
+
 /**
- * Try to space out our checkpoints by a minimum of this much in LOW_OVERHEAD
- * mode.
- * This is currently aiming for about 0.5s of replay time, so a reverse step or
- * continue whose destination is within 0.5 should take at most a second.
- * Also, based on a guesstimate that taking checkpoints of Firefox requires
- * about 50ms, this would make checkpointing overhead about 10% of replay time,
- * which sounds reasonable.
+ * Keep the time spent checkpointing under about this fraction of replay
+ * time.
  */
-static ReplayTimeline::Progress low_overhead_inter_checkpoint_interval = 500000;
+static const double max_checkpoint_overhead = 0.1;
 
 /**
- * Space out checkpoints linearly by this much in
- * EXPECT_SHORT_REVERSE_EXECUTION mode, until we reach
- * low_overhead_inter_checkpoint_interval.
+ * In EXPECT_SHORT_REVERSE_EXECUTION mode, space out checkpoints linearly by
+ * this fraction of the LOW_OVERHEAD interval, until we reach the
+ * LOW_OVERHEAD interval.
  */
-static ReplayTimeline::Progress
-    expecting_reverse_exec_inter_checkpoint_interval = 100000;
+static const int expecting_reverse_exec_interval_divisor = 5;
 
 /**
  * Make each interval this much bigger than the previous.
  */
 static float checkpoint_interval_exponent = 2;
 
-static ReplayTimeline::Progress inter_checkpoint_interval(
-    ReplayTimeline::CheckpointStrategy strategy) {
-  return strategy == ReplayTimeline::LOW_OVERHEAD
-             ? low_overhead_inter_checkpoint_interval
-             : expecting_reverse_exec_inter_checkpoint_interval;
+double ReplayTimeline::seconds_per_progress() {
+  // Progress estimates microseconds of replay. Use that until we've replayed
+  // for long enough to measure the real rate on this machine.
+  static const double min_measured_seconds = 1;
+  double seconds = current->statistics().replay_seconds;
+  Progress progress = estimate_progress();
+  if (seconds < min_measured_seconds || progress <= 0) {
+    return 1e-6;
+  }
+  return seconds / progress;
 }
 
-static ReplayTimeline::Progress next_interval_length(
-    ReplayTimeline::Progress len) {
-  if (len >= low_overhead_inter_checkpoint_interval) {
-    return (ReplayTimeline::Progress)ceil(checkpoint_interval_exponent * len);
+ReplayTimeline::Progress ReplayTimeline::inter_checkpoint_interval(
+    CheckpointStrategy strategy) {
+  double seconds = max(reverse_step_latency_target_,
+                       clone_seconds / max_checkpoint_overhead);
+  Progress low_overhead =
+      max<Progress>(1, Progress(seconds / seconds_per_progress()));
+  return strategy == LOW_OVERHEAD
+             ? low_overhead
+             : max<Progress>(1, low_overhead /
+                                    expecting_reverse_exec_interval_divisor);
+}
+
+ReplayTimeline::Progress ReplayTimeline::next_interval_length(Progress len) {
+  Progress low_overhead = inter_checkpoint_interval(LOW_OVERHEAD);
+  if (len >= low_overhead) {
+    return (Progress)ceil(checkpoint_interval_exponent * len);
   }
-  return len + expecting_reverse_exec_inter_checkpoint_interval;
+  return len + inter_checkpoint_interval(EXPECT_SHORT_REVERSE_EXECUTION);
 }
 
 void ReplayTimeline::maybe_add_reverse_exec_checkpoint(
@@ -1481,6 +1854,69 @@ void ReplayTimeline::discard_past_reverse_exec_checkpoints(
     remove_explicit_checkpoint(m);
     reverse_exec_checkpoints.erase(m);
   }
+
+  discard_reverse_exec_checkpoints_over_budget();
+}
+
+/*
+ * Checkpoints taken by forking share pages with the session they were
+ * cloned from, so their real cost is the pages that have since diverged,
+ * which we measure each time we're about to add a checkpoint.
+ *
+ * If a reverse-execution target is equally likely to be anywhere before the
+ * current position, the expected seek time is proportional to the sum of
+ * the squares of the gaps between checkpoints. Discarding a checkpoint that
+ * has gaps A and B on either side increases that sum by 2*A*B. So we
+ * repeatedly discard the checkpoint with the smallest A*B per byte freed.
+ */
+void ReplayTimeline::discard_reverse_exec_checkpoints_over_budget() {
+  uint64_t budget = session_flags.checkpoint_memory_budget;
+  if (!budget || reverse_exec_checkpoints.empty()) {
+    return;
+  }
+
+  map<Mark, uint64_t> sizes;
+  uint64_t total = 0;
+  for (auto& c : reverse_exec_checkpoints) {
+    uint64_t size = c.first.ptr->checkpoint->private_memory_size();
+    sizes[c.first] = size;
+    total += size;
+  }
+
+  Progress now = estimate_progress();
+  while (total > budget) {
+    Mark victim;
+    double victim_cost = 0;
+    Progress prev = 0;
+    for (auto it = reverse_exec_checkpoints.begin();
+         it != reverse_exec_checkpoints.end(); ++it) {
+      auto next = it;
+      ++next;
+      Progress next_progress =
+          next == reverse_exec_checkpoints.end() ? now : next->second;
+      uint64_t size = sizes[it->first];
+      // Discarding a checkpoint that another user still references frees
+      // nothing.
+      if (size > 0 && it->first.ptr->checkpoint_refcount == 1) {
+        double cost = (double)(it->second - prev) *
+                      (double)(next_progress - it->second) / size;
+        if (!victim || cost < victim_cost) {
+          victim = it->first;
+          victim_cost = cost;
+        }
+      }
+      prev = it->second;
+    }
+    if (!victim) {
+      break;
+    }
+    LOG(debug) << "Discarding reverse-exec checkpoint at " << victim
+               << " using " << sizes[victim] << " bytes; checkpoints use "
+               << total << " bytes, budget " << budget;
+    total -= sizes[victim];
+    remove_explicit_checkpoint(victim);
+    reverse_exec_checkpoints.erase(victim);
+  }
 }
 
 ReplayTimeline::Mark ReplayTimeline::set_short_checkpoint() {
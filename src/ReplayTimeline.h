@@ -14,6 +14,8 @@
 #include "ReplaySession.h"
 #include "ReplayTask.h"
 #include "ReturnAddressList.h"
+#include "ScopedFd.h"
+#include "StdioMonitor.h"
 #include "TraceFrame.h"
 
 namespace rr {
@@ -32,7 +34,13 @@ private:
 public:
   ReplayTimeline(std::shared_ptr<ReplaySession> session,
                  const ReplaySession::Flags& session_flags);
-  ReplayTimeline() : breakpoints_applied(false) {}
+  ReplayTimeline()
+      : mark_count(0),
+        prune_marks_at(min_marks_before_prune),
+        breakpoints_applied(false),
+        breakpoints_generation_(0),
+        reverse_step_latency_target_(default_reverse_step_latency_target),
+        clone_seconds(default_clone_seconds) {}
   ~ReplayTimeline();
 
   bool is_running() const { return current != nullptr; }
@@ -66,7 +74,7 @@ public:
      * Return the values of the general-purpose registers at this mark.
      */
     const Registers& regs() const { return ptr->regs; }
-    const ExtraRegisters& extra_regs() const { return ptr->extra_regs; }
+    const ExtraRegisters& extra_regs() const { return *ptr->extra_regs; }
 
     TraceFrame::Time time() const { return ptr->key.trace_time; }
 
@@ -107,6 +115,30 @@ public:
    */
   bool can_add_checkpoint() { return current->can_clone(); }
 
+  /**
+   * Set how long, in seconds, reverse execution to a point just before the
+   * current position should take. Automatic checkpoints are spaced to meet
+   * this target given the replay and clone speeds measured so far.
+   */
+  void set_reverse_step_latency_target(double seconds) {
+    reverse_step_latency_target_ = seconds;
+  }
+  double reverse_step_latency_target() const {
+    return reverse_step_latency_target_;
+  }
+  /**
+   * Return the current average time to clone a session, in seconds.
+   */
+  double clone_cost() const { return clone_seconds; }
+
+  /**
+   * Return a JSON object whose "checkpoints" array has an object for each
+   * checkpoint, giving its position, age, creation time, private and shared
+   * memory use and the number of seeks that started from it, and whose
+   * "marks" object gives the number of marks and the memory they use.
+   */
+  std::string checkpoint_stats_json();
+
   /**
    * Ensure that the current session is explicitly checkpointed.
    * Explicit checkpoints are reference counted.
@@ -148,6 +180,14 @@ public:
   bool has_breakpoint_at_address(ReplayTask* t, remote_code_ptr addr);
   bool has_watchpoint_at_address(ReplayTask* t, remote_ptr<void> addr,
                                  size_t num_bytes, WatchType type);
+  /**
+   * Return a number that changes whenever breakpoints or watchpoints are
+   * added or removed.
+   */
+  uint64_t breakpoints_generation() const { return breakpoints_generation_; }
+  bool has_breakpoints_or_watchpoints() const {
+    return !breakpoints.empty() || !watchpoints.empty();
+  }
 
   /**
    * Ensure that reverse execution never proceeds into an event before
@@ -156,6 +196,10 @@ public:
    */
   void set_reverse_execution_barrier_event(TraceFrame::Time event) {
     reverse_execution_barrier_event = event;
+    clear_breakpoint_hit_index();
+  }
+  TraceFrame::Time reverse_execution_barrier() const {
+    return reverse_execution_barrier_event;
   }
 
   // State-changing APIs. These may alter state associated with
@@ -182,6 +226,16 @@ public:
    */
   void seek_to_mark(const Mark& mark);
 
+  /**
+   * Sets current session to the point during event 'time' where the task
+   * replaying that event has executed 'ticks' ticks, i.e. where "when" and
+   * "when-ticks" would report 'time' and 'ticks'. If the task is already
+   * past 'ticks' at the start of the event, or 'ticks' is beyond the end
+   * of the event, stops at the start or end of the event instead. Returns
+   * false if the replay ended before reaching 'time'.
+   */
+  bool seek_to_ticks(TraceFrame::Time time, Ticks ticks);
+
   /**
    * Replay 'current'.
    * If there is a breakpoint at the current task's current ip(), then
@@ -199,6 +253,27 @@ public:
   ReplayResult replay_step_forward(RunCommand command,
                                    TraceFrame::Time stop_at_time);
 
+  bool replay_ahead_enabled() const { return session_flags.replay_ahead; }
+  /**
+   * Speculatively continue forward from the current point, in a clone of
+   * the current session, until something would stop a RUN_CONTINUE towards
+   * |stop_at_time|, or |interrupt_check| returns true. Call this repeatedly
+   * while waiting for the debugger; each call resumes where the last one
+   * left off, as long as we haven't moved and breakpoints haven't changed.
+   * The current session doesn't move. Replayed output is held back until
+   * the lookahead is used. Checkpoints made along the way are kept either
+   * way, which makes later reverse execution cheaper.
+   */
+  void replay_ahead(TraceFrame::Time stop_at_time,
+                    const std::function<bool()>& interrupt_check);
+  /**
+   * If replay_ahead() got anywhere from the current point with the current
+   * breakpoints, make its session current, set |result| to what
+   * replay_step_forward(RUN_CONTINUE, stop_at_time) would have eventually
+   * returned, and return true. The lookahead is discarded either way.
+   */
+  bool take_replay_ahead(TraceFrame::Time stop_at_time, ReplayResult* result);
+
   ReplayResult reverse_continue(
       const std::function<bool(ReplayTask* t)>& stop_filter,
       const std::function<bool()>& interrupt_check);
@@ -311,12 +386,17 @@ private:
           key(key),
           ticks_at_event_start(session.ticks_at_start_of_current_event()),
           checkpoint_refcount(0),
+          checkpoint_created_at(0),
+          checkpoint_clone_seconds(0),
+          checkpoint_uses(0),
           singlestep_to_next_mark_no_signal(false) {
       ReplayTask* t = session.current_task();
       if (t) {
         regs = t->regs();
         return_addresses = ReturnAddressList(t);
-        extra_regs = t->extra_regs();
+        extra_regs = owner->share_extra_regs(t->extra_regs());
+      } else {
+        extra_regs = owner->share_extra_regs(ExtraRegisters());
       }
     }
     ~InternalMark();
@@ -328,11 +408,19 @@ private:
     ReplayTimeline* owner;
     MarkKey key;
     Registers regs;
-    ExtraRegisters extra_regs;
+    // Shared with neighbouring marks when they're equal, since the XSAVE
+    // area is by far the largest part of a mark and most instructions
+    // don't change it.
+    std::shared_ptr<const ExtraRegisters> extra_regs;
     ReturnAddressList return_addresses;
     ReplaySession::shr_ptr checkpoint;
     Ticks ticks_at_event_start;
     uint32_t checkpoint_refcount;
+    // When |checkpoint| was created, how long that took, and how many times
+    // it has been used as the starting point of a seek.
+    double checkpoint_created_at;
+    double checkpoint_clone_seconds;
+    uint32_t checkpoint_uses;
     // The next InternalMark in the mark vector is the result of singlestepping
     // from this mark *and* no signal is reported in the break_status.
     bool singlestep_to_next_mark_no_signal;
@@ -348,6 +436,8 @@ private:
    * triggering breakpoints.
    */
   void unapply_breakpoints_and_watchpoints();
+  /** Set |breakpoints| in the current session. */
+  void add_user_breakpoints();
 
   static MarkKey session_mark_key(ReplaySession& session) {
     ReplayTask* t = session.current_task();
@@ -361,6 +451,20 @@ private:
 
   // Returns a shared pointer to the mark if there is one for the current state.
   std::shared_ptr<InternalMark> current_mark();
+  /**
+   * Return a shared copy of |regs|, reusing the last one if it's equal.
+   */
+  std::shared_ptr<const ExtraRegisters> share_extra_regs(
+      const ExtraRegisters& regs);
+  /**
+   * Once the number of marks has doubled since the last pruning, drop the
+   * marks nobody refers to and that have no checkpoint. Singlestepping
+   * creates a mark per instruction, so without this long reverse-debugging
+   * sessions accumulate millions of them. Dropped states can be found
+   * again by replaying, like any state we haven't marked. Must only be
+   * called when no references into |marks| are held.
+   */
+  void maybe_prune_marks();
   void remove_mark_with_checkpoint(const MarkKey& key);
   void seek_to_before_key(const MarkKey& key);
   enum ForceProgress { FORCE_PROGRESS, DONT_FORCE_PROGRESS };
@@ -415,6 +519,11 @@ private:
    * this to stop the number of checkpoints growing out of control.
    */
   void discard_past_reverse_exec_checkpoints(CheckpointStrategy strategy);
+  /**
+   * Discard reverse-exec checkpoints until the memory they use fits in
+   * session_flags.checkpoint_memory_budget, if there is one.
+   */
+  void discard_reverse_exec_checkpoints_over_budget();
   /**
    * Discard all reverse-exec checkpoints that are in the future (they're
    * useless).
@@ -423,6 +532,19 @@ private:
 
   Mark set_short_checkpoint();
 
+  /**
+   * The Progress distance between reverse-exec checkpoints for |strategy|.
+   */
+  Progress inter_checkpoint_interval(CheckpointStrategy strategy);
+  /**
+   * The length of the checkpoint-thinning interval after one of length |len|.
+   */
+  Progress next_interval_length(Progress len);
+  /**
+   * Measured wall-clock seconds per unit of estimate_progress().
+   */
+  double seconds_per_progress();
+
   /**
    * If result.break_status hit watchpoints or breakpoints, evaluate their
    * conditions and clear the break_status flags if the conditions don't hold.
@@ -450,6 +572,13 @@ private:
    * but that's not too bad.
    */
   std::map<MarkKey, std::vector<std::shared_ptr<InternalMark> > > marks;
+  // The number of InternalMarks in |marks|, and the count at which
+  // maybe_prune_marks() next prunes them.
+  size_t mark_count;
+  size_t prune_marks_at;
+  static const size_t min_marks_before_prune = 100000;
+  // The ExtraRegisters of the most recently created mark.
+  std::shared_ptr<const ExtraRegisters> last_extra_regs;
 
   /**
    * All mark keys with at least one checkpoint. The value is the number of
@@ -463,9 +592,30 @@ private:
   std::set<std::tuple<AddressSpaceUid, remote_ptr<void>, size_t, WatchType,
                       std::unique_ptr<BreakpointCondition> > > watchpoints;
   bool breakpoints_applied;
+  uint64_t breakpoints_generation_;
+  std::string checkpoint_json(const InternalMark& m);
+  /**
+   * If a checkpoint log was requested, append a line describing |what|
+   * happening to |m|'s checkpoint.
+   */
+  void log_checkpoint(const char* what, const InternalMark& m);
+  void breakpoints_changed() {
+    ++breakpoints_generation_;
+    clear_breakpoint_hit_index();
+  }
 
   TraceFrame::Time reverse_execution_barrier_event;
 
+  static const double default_reverse_step_latency_target;
+  static const double default_clone_seconds;
+  // How long, in seconds, a reverse step or continue should take to reach
+  // a destination just before the current position.
+  double reverse_step_latency_target_;
+  // Moving average of the time taken to clone the current session.
+  double clone_seconds;
+  // Where to write a line of JSON for each checkpoint created or discarded.
+  ScopedFd checkpoint_log;
+
   /**
    * Checkpoints used to accelerate reverse execution.
    */
@@ -479,11 +629,66 @@ private:
   Mark no_watchpoints_hit_interval_start;
   Mark no_watchpoints_hit_interval_end;
 
+  struct BreakpointHit {
+    Mark mark;
+    TaskUid tuid;
+    ReplayResult result;
+  };
+  /**
+   * Breakpoint stops found by the last complete forward scan in
+   * reverse_continue, so that repeated reverse-continues through the same
+   * interval don't have to scan it again. Every stop between
+   * |breakpoint_hit_index_start| and |breakpoint_hit_index_end| whose
+   * breakpoint condition held is in |breakpoint_hit_index|, in execution
+   * order, whether or not the stop filter accepted it. Only valid while
+   * |breakpoint_hit_index_start| is set; cleared whenever breakpoints,
+   * watchpoints or the reverse-execution barrier change.
+   */
+  std::vector<BreakpointHit> breakpoint_hit_index;
+  Mark breakpoint_hit_index_start;
+  Mark breakpoint_hit_index_end;
+  void clear_breakpoint_hit_index() {
+    breakpoint_hit_index.clear();
+    breakpoint_hit_index_start = breakpoint_hit_index_end = Mark();
+  }
+  /**
+   * Try to find the reverse_continue destination from |end| in
+   * breakpoint_hit_index. If found, seek there, set |result| and return
+   * true. Otherwise, if the index shows the interval before |end| has no
+   * stops we want, move |end| back to the start of the index.
+   */
+  bool reverse_continue_from_index(
+      Mark& end, const std::function<bool(ReplayTask* t)>& stop_filter,
+      ReplayResult& result);
+
   /**
    * A single checkpoint that's very close to the current point, used to
    * accelerate a sequence of reverse singlestep operations.
    */
   Mark reverse_exec_short_checkpoint;
+
+  /**
+   * State of replay_ahead(): a session running ahead of 'current' from
+   * |start|, valid while breakpoints are at |breakpoints_generation|.
+   */
+  struct ReplayAhead {
+    Mark start;
+    uint64_t breakpoints_generation;
+    TraceFrame::Time stop_at_time;
+    ReplaySession::shr_ptr session;
+    std::shared_ptr<InternalMark> at_or_after_mark;
+    bool breakpoints_applied;
+    // Number of replay_step_forward calls made in |session|.
+    uint64_t steps;
+    ReplayResult last_result;
+    // True when |last_result| is where a continue would stop.
+    bool done;
+    std::vector<StdioMonitor::CapturedOutput> output;
+  };
+  std::unique_ptr<ReplayAhead> ahead;
+  bool replay_ahead_is_valid(const ReplayAhead& a,
+                             TraceFrame::Time stop_at_time);
+  void swap_replay_ahead_session();
 };
 
 std::ostream& operator<<(std::ostream& s, const ReplayTimeline::Mark& o);
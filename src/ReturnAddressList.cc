@@ -6,8 +6,34 @@
 
 namespace rr {
 
+// How much of the stack above SP we read in one go. Frames in the top
+// COUNT levels of the stack are nearly always within this window, so the
+// common case is a single read.
+static const size_t STACK_WINDOW_SIZE = 4096;
+
 template <typename Arch>
 static void return_addresses_x86ish(ReturnAddressList* result, Task* t) {
+  typedef typename Arch::size_t word;
+
+  remote_ptr<void> sp = t->regs().sp();
+  word window[STACK_WINDOW_SIZE / sizeof(word)];
+  ssize_t nread = t->read_bytes_fallible(sp, sizeof(window), window);
+  remote_ptr<void> window_end = sp + (nread > 0 ? nread : 0);
+
+  // Read the two words at |addr| into |frame|, from the window if they're
+  // in it.
+  auto read_frame = [&](remote_ptr<void> addr, word* frame) -> bool {
+    if (addr >= sp && addr + 2 * sizeof(word) <= window_end &&
+        (addr - sp) % sizeof(word) == 0) {
+      size_t index = (addr - sp) / sizeof(word);
+      frame[0] = window[index];
+      frame[1] = window[index + 1];
+      return true;
+    }
+    return t->read_bytes_fallible(addr, 2 * sizeof(word), frame) ==
+           ssize_t(2 * sizeof(word));
+  };
+
   // Immediately after a function call the return address is on the stack at
   // SP. After BP is pushed, but before it's initialized for the new stack
   // frame, the return address is on the stack at SP+wordsize. Just
@@ -16,10 +42,9 @@ static void return_addresses_x86ish(ReturnAddressList* result, Task* t) {
   // or PLT stubs (which start with 'jmp'). Since it doesn't matter if we
   // capture addresses that aren't real return addresses, just capture those
   // words unconditionally.
-  typename Arch::size_t frame[2];
+  word frame[2];
   int next_address = 0;
-  if (t->read_bytes_fallible(t->regs().sp(), sizeof(frame), frame) ==
-      sizeof(frame)) {
+  if (read_frame(sp, frame)) {
     result->addresses[0] = frame[0];
     result->addresses[1] = frame[1];
     next_address = 2;
@@ -27,7 +52,7 @@ static void return_addresses_x86ish(ReturnAddressList* result, Task* t) {
 
   remote_ptr<void> bp = t->regs().bp();
   for (int i = next_address; i < ReturnAddressList::COUNT; ++i) {
-    if (t->read_bytes_fallible(bp, sizeof(frame), frame) != sizeof(frame)) {
+    if (!read_frame(bp, frame)) {
       break;
     }
     result->addresses[i] = frame[1];
@@ -41,6 +66,15 @@ static void compute_return_addresses(ReturnAddressList* result, Task* t) {
 
 ReturnAddressList::ReturnAddressList(Task* t) {
   compute_return_addresses(this, t);
+  compute_hash();
+}
+
+void ReturnAddressList::compute_hash() {
+  // FNV-1a over the addresses.
+  hash = 14695981039346656037ULL;
+  for (auto& a : addresses) {
+    hash = (hash ^ a.as_int()) * 1099511628211ULL;
+  }
 }
 
 } // namespace rr
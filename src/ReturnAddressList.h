@@ -3,6 +3,7 @@
 #ifndef RR_RETURNADDRESSLIST_H_
 #define RR_RETURNADDRESSLIST_H_
 
+#include <stdint.h>
 #include <string.h>
 
 #include "remote_ptr.h"
@@ -28,15 +29,28 @@ struct ReturnAddressList {
    * will probably not be), but they will be a function of the task's current
    * state, so may be useful for distinguishing this state from other states.
    */
-  ReturnAddressList() {}
+  ReturnAddressList() { compute_hash(); }
   explicit ReturnAddressList(Task* t);
 
+  /**
+   * Compare hashes first so that mismatches, the common case when
+   * checking marks, are cheap.
+   */
   bool operator==(const ReturnAddressList& other) const {
-    return memcmp(addresses, other.addresses, sizeof(addresses)) == 0;
+    return hash == other.hash &&
+           memcmp(addresses, other.addresses, sizeof(addresses)) == 0;
   }
   bool operator!=(const ReturnAddressList& other) const {
     return !(*this == other);
   }
+
+  /**
+   * A hash of |addresses|, computed when the list is captured.
+   */
+  uint64_t hash;
+
+private:
+  void compute_hash();
 };
 
 } // namespace rr
@@ -35,8 +35,19 @@ static double very_short_timeslice_probability = 0.1;
 static Ticks very_short_timeslice_max_duration = 100;
 static double short_timeslice_probability = 0.1;
 static Ticks short_timeslice_max_duration = 10000;
+// With a chaos switch budget, the chance of spending a switch when a task
+// calls futex or sched_yield
+static double sync_syscall_switch_probability = 0.5;
 // Time between priority refreshes is uniformly distributed from 0 to 20s
 static double priorities_refresh_max_interval = 20;
+// With adaptive timeslices, a task that makes syscalls gets a timeslice of
+// this many times its average ticks between syscalls
+static double adaptive_timeslice_syscall_factor = 4;
+// Weight of the latest sample in a task's average ticks between syscalls
+static double ticks_per_syscall_weight = 0.25;
+// A task whose timeslices keep expiring within this many bytes of a PAUSE
+// instruction, and of each other, is treated as spinning
+static const intptr_t spin_loop_bytes = 32;
 
 /*
  * High-Priority-Only Intervals
@@ -90,6 +101,10 @@ Scheduler::Scheduler(RecordSession& session)
       max_ticks_(DEFAULT_MAX_TICKS),
       always_switch(false),
       enable_chaos(false),
+      adaptive_timeslices(false),
+      chaos_switch_budget(0),
+      chaos_switch_tokens(0),
+      chaos_switch_tokens_time(0),
       last_reschedule_in_high_priority_only_interval(false),
       must_run_task(nullptr) {}
 
@@ -165,9 +180,9 @@ bool Scheduler::is_task_runnable(RecordTask* t, bool* by_waitpid) {
 
   LOG(debug) << "  " << t->tid << " is blocked on " << t->ev()
              << "; checking status ...";
-  bool did_wait_for_t;
-  did_wait_for_t = t->try_wait();
-  if (did_wait_for_t) {
+  // collect_wait_statuses() has reaped every status that was ready, so we
+  // only need to look there.
+  if (collected_statuses.count(t->tid) && t->try_wait()) {
     *by_waitpid = true;
     must_run_task = t;
     LOG(debug) << "  ready with status " << HEX(t->status());
@@ -178,6 +193,65 @@ bool Scheduler::is_task_runnable(RecordTask* t, bool* by_waitpid) {
   return false;
 }
 
+bool Scheduler::is_task_known_blocked(RecordTask* t) {
+  if (t->unstable || !t->may_be_blocked()) {
+    return false;
+  }
+  if (t->emulated_stop_type != NOT_STOPPED) {
+    return true;
+  }
+  if (EV_SYSCALL == t->ev().type() &&
+      PROCESSING_SYSCALL == t->ev().Syscall().state &&
+      is_sched_yield_syscall(t->ev().Syscall().number, t->arch())) {
+    return false;
+  }
+  return !collected_statuses.count(t->tid);
+}
+
+void Scheduler::collect_wait_statuses() {
+  while (true) {
+    int status;
+    pid_t tid = waitpid(-1, &status, WNOHANG | __WALL | WSTOPPED);
+    if (tid <= 0) {
+      return;
+    }
+    LOG(debug) << "  collected status " << HEX(status) << " for " << tid;
+    // A stopped tid we don't know yet is a new task whose clone event
+    // we haven't processed; Task::clone will wait for it. Exit statuses of
+    // unknown processes are of no interest.
+    if (session.find_task(tid) || WIFSTOPPED(status)) {
+      collected_statuses.insert(make_pair(tid, status));
+    }
+  }
+}
+
+bool Scheduler::take_collected_status(pid_t tid, int* status) {
+  auto it = collected_statuses.lower_bound(tid);
+  if (it == collected_statuses.end() || it->first != tid) {
+    return false;
+  }
+  *status = it->second;
+  collected_statuses.erase(it);
+  return true;
+}
+
+vector<pid_t> Scheduler::tasks_with_collected_exit() {
+  vector<pid_t> result;
+  for (auto it = collected_statuses.begin(); it != collected_statuses.end();
+       it = collected_statuses.upper_bound(it->first)) {
+    if (RecordTask::ptrace_event_from_status(it->second) !=
+        PTRACE_EVENT_EXIT) {
+      continue;
+    }
+    RecordTask* t = session.find_task(it->first);
+    if (t && t != current_ && !t->unstable && t->may_be_blocked() &&
+        t->emulated_stop_type == NOT_STOPPED) {
+      result.push_back(t->tid);
+    }
+  }
+  return result;
+}
+
 RecordTask* Scheduler::find_next_runnable_task(RecordTask* t, bool* by_waitpid,
                                                int priority_threshold) {
   *by_waitpid = false;
@@ -200,7 +274,8 @@ RecordTask* Scheduler::find_next_runnable_task(RecordTask* t, bool* by_waitpid,
       }
       random_shuffle(tasks.begin(), tasks.end());
       for (RecordTask* next : tasks) {
-        if (is_task_runnable(next, by_waitpid)) {
+        if (!is_task_known_blocked(next) &&
+            is_task_runnable(next, by_waitpid)) {
           return next;
         }
       }
@@ -218,7 +293,8 @@ RecordTask* Scheduler::find_next_runnable_task(RecordTask* t, bool* by_waitpid,
       do {
         RecordTask* next = task_iterator->second;
 
-        if (is_task_runnable(next, by_waitpid)) {
+        if (!is_task_known_blocked(next) &&
+            is_task_runnable(next, by_waitpid)) {
           return next;
         }
 
@@ -235,6 +311,12 @@ RecordTask* Scheduler::find_next_runnable_task(RecordTask* t, bool* by_waitpid,
   return nullptr;
 }
 
+Ticks Scheduler::clamp_adaptive_timeslice(double ticks) {
+  double min_ticks = (double)max_ticks_ / ADAPTIVE_TIMESLICE_RANGE;
+  double max_ticks = (double)max_ticks_ * ADAPTIVE_TIMESLICE_RANGE;
+  return (Ticks)max(1.0, min(max_ticks, max(min_ticks, ticks)));
+}
+
 void Scheduler::setup_new_timeslice() {
   Ticks max_timeslice_duration = max_ticks_;
   if (enable_chaos) {
@@ -243,6 +325,12 @@ void Scheduler::setup_new_timeslice() {
     // very short, 10% short-ish, and the rest uniformly distributed between 0
     // and |max_ticks_|.
     double timeslice_kind_frac = random_frac();
+    if (timeslice_kind_frac <
+            very_short_timeslice_probability + short_timeslice_probability &&
+        chaos_switch_budget && !take_chaos_switch_token()) {
+      // Over budget; short timeslices are what make chaos recordings slow.
+      timeslice_kind_frac = 1;
+    }
     if (timeslice_kind_frac < very_short_timeslice_probability) {
       max_timeslice_duration = very_short_timeslice_max_duration;
     } else if (timeslice_kind_frac <
@@ -251,9 +339,15 @@ void Scheduler::setup_new_timeslice() {
     } else {
       max_timeslice_duration = max_ticks_;
     }
+    max_timeslice_duration = min(max_ticks_, max_timeslice_duration);
+  } else if (adaptive_timeslices) {
+    if (!current_->adaptive_timeslice) {
+      current_->adaptive_timeslice = max_ticks_;
+    }
+    max_timeslice_duration = current_->adaptive_timeslice;
   }
-  current_timeslice_end_ = current_->tick_count() +
-                           (random() % min(max_ticks_, max_timeslice_duration));
+  current_timeslice_end_ =
+      current_->tick_count() + (random() % max_timeslice_duration);
 }
 
 static void sleep_time(double t) {
@@ -304,6 +398,22 @@ void Scheduler::maybe_reset_high_priority_only_intervals(double now) {
           high_priority_only_fraction;
 }
 
+bool Scheduler::take_chaos_switch_token() {
+  double now = monotonic_now_sec();
+  if (chaos_switch_tokens_time) {
+    chaos_switch_tokens =
+        min(max(1.0, chaos_switch_budget),
+            chaos_switch_tokens +
+                (now - chaos_switch_tokens_time) * chaos_switch_budget);
+  }
+  chaos_switch_tokens_time = now;
+  if (chaos_switch_tokens < 1) {
+    return false;
+  }
+  chaos_switch_tokens -= 1;
+  return true;
+}
+
 bool Scheduler::in_high_priority_only_interval(double now) {
   if (now < high_priority_only_intervals_start) {
     return false;
@@ -313,6 +423,30 @@ bool Scheduler::in_high_priority_only_interval(double now) {
   return mod < high_priority_only_intervals_duration;
 }
 
+bool Scheduler::is_spinning(RecordTask* t) {
+  remote_code_ptr ip = t->ip();
+  bool near_last_expiry =
+      t->spin_ip != nullptr && abs(ip - t->spin_ip) <= spin_loop_bytes;
+  t->spin_ip = nullptr;
+
+  // Spin-wait loops are short and, on x86, nearly always contain PAUSE
+  // (F3 90) to tell the CPU they're spinning. Stay within ip's page so
+  // the read can't fail on a neighbouring unmapped page.
+  remote_ptr<void> addr = ip.to_data_ptr<void>();
+  remote_ptr<void> page = floor_page_size(addr);
+  remote_ptr<void> start = max(page, addr - spin_loop_bytes);
+  remote_ptr<void> end = min(page + page_size(), addr + spin_loop_bytes);
+  uint8_t code[2 * spin_loop_bytes];
+  ssize_t nread = t->read_bytes_fallible(start, end - start, code);
+  for (ssize_t i = 0; i + 1 < nread; ++i) {
+    if (code[i] == 0xf3 && code[i + 1] == 0x90) {
+      t->spin_ip = ip;
+      break;
+    }
+  }
+  return near_last_expiry && t->spin_ip != nullptr;
+}
+
 bool Scheduler::treat_as_high_priority(RecordTask* t) {
   return task_priority_set.size() > 1 && t->priority == 0;
 }
@@ -354,6 +488,7 @@ Scheduler::Rescheduled Scheduler::reschedule(Switchable switchable) {
 
   RecordTask* next;
   while (true) {
+    collect_wait_statuses();
     maybe_reset_high_priority_only_intervals(now);
     last_reschedule_in_high_priority_only_interval =
         in_high_priority_only_interval(now);
@@ -366,6 +501,28 @@ Scheduler::Rescheduled Scheduler::reschedule(Switchable switchable) {
       if (next) {
         break;
       }
+      if (!enable_chaos && !current_->may_be_blocked() &&
+          current_->tick_count() >= current_timeslice_end()) {
+        if (task_round_robin_queue.empty() && task_priority_set.size() > 1 &&
+            is_spinning(current_)) {
+          // It's probably waiting for a lock held by a task we aren't
+          // running, so spinning again would just burn another timeslice.
+          // Give every other task a turn first, as for sched_yield.
+          LOG(debug) << "  " << current_->tid << " is spinning at "
+                     << current_->ip() << "; letting other tasks run";
+          if (adaptive_timeslices) {
+            current_->adaptive_timeslice = clamp_adaptive_timeslice(0);
+          }
+          schedule_one_round_robin(current_);
+        } else if (adaptive_timeslices && current_->adaptive_timeslice) {
+          // It used up its timeslice without blocking, so it's probably
+          // CPU-bound; preempt it less often.
+          current_->adaptive_timeslice =
+              clamp_adaptive_timeslice(2.0 * current_->adaptive_timeslice);
+          LOG(debug) << "  " << current_->tid << " timeslice expired; now "
+                     << current_->adaptive_timeslice;
+        }
+      }
       if (!current_->unstable && !always_switch &&
           (treat_as_high_priority(current_) ||
            !last_reschedule_in_high_priority_only_interval) &&
@@ -428,6 +585,9 @@ Scheduler::Rescheduled Scheduler::reschedule(Switchable switchable) {
 
     LOG(debug) << "  all tasks blocked or some unstable, waiting for runnable ("
                << task_priority_set.size() << " total)";
+    // The tracees may stay blocked for a long time. Let anyone following
+    // the recording see what they've done so far.
+    session.trace_writer().maybe_flush_for_followers();
     do {
       tid = waitpid(-1, &status, __WALL | WSTOPPED | WUNTRACED);
       now = -1; // invalid, don't use
@@ -451,6 +611,11 @@ Scheduler::Rescheduled Scheduler::reschedule(Switchable switchable) {
                      RecordTask::ptrace_event_from_status(status) ==
                          PTRACE_EVENT_EXIT)
         << "Scheduled task should have been blocked or unstable";
+    if (collected_statuses.count(next->tid)) {
+      // Statuses we collected earlier come first.
+      collected_statuses.insert(make_pair(next->tid, status));
+      take_collected_status(next->tid, &status);
+    }
     next->did_waitpid(status);
     result.by_waitpid = true;
     must_run_task = next;
@@ -501,6 +666,34 @@ double Scheduler::interrupt_after_elapsed_time() const {
   return max(0.001, delay);
 }
 
+void Scheduler::on_syscall(RecordTask* t) {
+  // A task making syscalls isn't stuck in a user-space spin loop.
+  t->spin_ip = nullptr;
+  if (enable_chaos && chaos_switch_budget) {
+    int syscallno = t->ev().Syscall().number;
+    if ((is_futex_syscall(syscallno, t->arch()) ||
+         is_sched_yield_syscall(syscallno, t->arch())) &&
+        random_frac() < sync_syscall_switch_probability &&
+        take_chaos_switch_token()) {
+      LOG(debug) << "  chaos: switching away from " << t->tid << " at "
+                 << t->ev();
+      expire_timeslice();
+    }
+  }
+  if (!adaptive_timeslices) {
+    return;
+  }
+  double ticks = (double)(t->tick_count() - t->ticks_at_last_syscall);
+  t->ticks_at_last_syscall = t->tick_count();
+  t->ticks_per_syscall =
+      t->ticks_per_syscall
+          ? (1 - ticks_per_syscall_weight) * t->ticks_per_syscall +
+                ticks_per_syscall_weight * ticks
+          : ticks;
+  t->adaptive_timeslice = clamp_adaptive_timeslice(
+      adaptive_timeslice_syscall_factor * t->ticks_per_syscall);
+}
+
 void Scheduler::on_create(RecordTask* t) {
   assert(!t->in_round_robin_queue);
   if (enable_chaos) {
@@ -514,6 +707,8 @@ void Scheduler::on_destroy(RecordTask* t) {
   if (t == current_) {
     current_ = nullptr;
   }
+  // Don't hand these to a future task that reuses the tid.
+  collected_statuses.erase(t->tid);
 
   if (t->in_round_robin_queue) {
     auto iter =
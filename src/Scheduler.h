@@ -4,7 +4,9 @@
 #define RR_REC_SCHED_H_
 
 #include <deque>
+#include <map>
 #include <set>
+#include <vector>
 
 #include "Ticks.h"
 #include "TraceFrame.h"
@@ -33,6 +35,12 @@ class RecordTask;
  * (e.g. trying to acquire a spinlock) if some other tasks don't get a chance
  * to run.
  *
+ * Tasks that spin in user space without calling sched_yield get the same
+ * treatment: when a task's timeslice expires twice in a row at the same
+ * PAUSE loop, with no syscalls in between, it's probably waiting for a task
+ * we aren't running, so we start a round of round-robin scheduling rather
+ * than let it spin for more timeslices.
+ *
  * The scheduler only runs during recording. During replay we're just replaying
  * the recorded scheduling decisions.
  *
@@ -79,10 +87,33 @@ public:
   Scheduler(RecordSession& session);
 
   void set_max_ticks(Ticks max_ticks) { max_ticks_ = max_ticks; }
+  /**
+   * Give each task its own timeslice, within a factor of
+   * ADAPTIVE_TIMESLICE_RANGE of max_ticks. A task that keeps running to the
+   * end of its timeslice gets a longer one, so CPU-bound tasks cause fewer
+   * EV_SCHED events; a task that makes syscalls often gets a shorter one,
+   * so it can't hold up other tasks for long. Ignored in chaos mode.
+   */
+  void set_adaptive_timeslices(bool adaptive) {
+    adaptive_timeslices = adaptive;
+  }
+  enum { ADAPTIVE_TIMESLICE_RANGE = 8 };
   void set_always_switch(bool always_switch) {
     this->always_switch = always_switch;
   }
   void set_enable_chaos(bool enable_chaos);
+  /**
+   * In chaos mode, aim for at most |switches_per_sec| context switches per
+   * second caused by chaos mode's short timeslices and forced switches, and
+   * spend most of them at futex and sched_yield calls, where interesting
+   * interleavings are likeliest, instead of at random points. Chaos
+   * recordings are then much cheaper, so more runs fit in a bug hunt.
+   * Zero (the default) means no budget.
+   */
+  void set_chaos_switch_budget(double switches_per_sec) {
+    chaos_switch_budget = switches_per_sec;
+    chaos_switch_tokens = switches_per_sec;
+  }
 
   /**
    * Schedule a new runnable task (which may be the same as current()).
@@ -114,6 +145,12 @@ public:
   void schedule_one_round_robin(RecordTask* last_task);
 
   void on_create(RecordTask* t);
+
+  /**
+   * Call when |t| enters a syscall that rr handles (i.e. not a buffered
+   * one).
+   */
+  void on_syscall(RecordTask* t);
   /**
    * De-register a thread. This function should be called when a thread exits.
    */
@@ -131,6 +168,26 @@ public:
    * Return the number of cores we should report to applications.
    */
   int pretend_num_cores() const { return pretend_num_cores_; }
+  /**
+   * Report |cores| cores to applications instead of the default (1, or a
+   * random number in chaos mode). Must be called before tracees start.
+   */
+  void set_pretend_num_cores(int cores) { pretend_num_cores_ = cores; }
+
+  /**
+   * If a wait status for |tid| was reaped by collect_wait_statuses() and
+   * not consumed yet, remove the oldest one, store it in |status| and
+   * return true. Task::wait() and Task::try_wait() call this before
+   * waiting.
+   */
+  bool take_collected_status(pid_t tid, int* status);
+  /**
+   * Return the tids of blocked tasks whose oldest status reaped by
+   * collect_wait_statuses() is a PTRACE_EVENT_EXIT stop. Any reschedule
+   * would find them runnable, and all their exits can be handled before the
+   * next one.
+   */
+  std::vector<pid_t> tasks_with_collected_exit();
 
 private:
   // Tasks sorted by priority.
@@ -158,13 +215,39 @@ private:
   void maybe_pop_round_robin_task(RecordTask* t);
   RecordTask* get_next_task_with_same_priority(RecordTask* t);
   void setup_new_timeslice();
+  Ticks clamp_adaptive_timeslice(double ticks);
   void maybe_reset_priorities(double now);
   int choose_random_priority(RecordTask* t);
   void update_task_priority_internal(RecordTask* t, int value);
   void maybe_reset_high_priority_only_intervals(double now);
   bool in_high_priority_only_interval(double now);
+  /**
+   * Return true and use up one switch if the chaos switch budget allows a
+   * switch now.
+   */
+  bool take_chaos_switch_token();
   bool treat_as_high_priority(RecordTask* t);
+  /**
+   * Call when |t| used up its timeslice without blocking. Returns true if
+   * it looks like it's spinning, waiting for another task: it's in a loop
+   * containing a PAUSE instruction, at about the same place where its
+   * previous timeslice expired, with no syscall in between.
+   */
+  bool is_spinning(RecordTask* t);
   bool is_task_runnable(RecordTask* t, bool* by_waitpid);
+  /**
+   * True if is_task_runnable() would just find |t| still blocked. This is
+   * much cheaper than asking is_task_runnable(), which matters when
+   * thousands of blocked tasks are skipped at every reschedule.
+   */
+  bool is_task_known_blocked(RecordTask* t);
+  /**
+   * Reap every wait status that's ready, with one waitpid(-1) per status,
+   * so is_task_runnable() doesn't have to make a syscall for every blocked
+   * task. The cost of a reschedule then depends on the number of tasks
+   * that changed state, not the number of tasks.
+   */
+  void collect_wait_statuses();
 
   RecordSession& session;
 
@@ -180,6 +263,13 @@ private:
   TaskPrioritySet task_priority_set;
   TaskQueue task_round_robin_queue;
 
+  /**
+   * Wait statuses reaped by collect_wait_statuses() that haven't been
+   * consumed by their task yet. multimap keeps statuses for the same tid
+   * in the order they were reaped.
+   */
+  std::multimap<pid_t, int> collected_statuses;
+
   /**
    * The currently scheduled task. This may be nullptr if the last scheduled
    * task
@@ -213,6 +303,15 @@ private:
    * probability of finding buggy schedules.
    */
   bool enable_chaos;
+  bool adaptive_timeslices;
+
+  /**
+   * Chaos switch budget as a token bucket: tokens accrue at
+   * chaos_switch_budget per second, up to one second's worth.
+   */
+  double chaos_switch_budget;
+  double chaos_switch_tokens;
+  double chaos_switch_tokens_time;
 
   bool last_reschedule_in_high_priority_only_interval;
 
@@ -2,6 +2,8 @@
 
 #include "Session.h"
 
+#include <limits.h>
+#include <stdio.h>
 #include <syscall.h>
 #include <sys/prctl.h>
 
@@ -126,6 +128,51 @@ vector<AddressSpace*> Session::vms() const {
   return result;
 }
 
+static uint64_t private_memory_size_of(pid_t tid, uint64_t* shared_bytes) {
+  char path[PATH_MAX];
+  // smaps_rollup is much cheaper to read, but only exists on newer kernels.
+  sprintf(path, "/proc/%d/smaps_rollup", tid);
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    sprintf(path, "/proc/%d/smaps", tid);
+    f = fopen(path, "r");
+    if (!f) {
+      return 0;
+    }
+  }
+  uint64_t private_kb = 0;
+  uint64_t shared_kb = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long long kb;
+    if (sscanf(line, "Private_Clean: %llu kB", &kb) == 1 ||
+        sscanf(line, "Private_Dirty: %llu kB", &kb) == 1) {
+      private_kb += kb;
+    } else if (sscanf(line, "Shared_Clean: %llu kB", &kb) == 1 ||
+               sscanf(line, "Shared_Dirty: %llu kB", &kb) == 1) {
+      shared_kb += kb;
+    }
+  }
+  fclose(f);
+  *shared_bytes += shared_kb * 1024;
+  return private_kb * 1024;
+}
+
+uint64_t Session::private_memory_size() const {
+  uint64_t shared_bytes = 0;
+  return private_memory_size(&shared_bytes);
+}
+
+uint64_t Session::private_memory_size(uint64_t* shared_bytes) const {
+  uint64_t result = 0;
+  *shared_bytes = 0;
+  for (auto& vm : vm_map) {
+    result += private_memory_size_of((*vm.second->task_set().begin())->tid,
+                                     shared_bytes);
+  }
+  return result;
+}
+
 Task* Session::clone(Task* p, int flags, remote_ptr<void> stack,
                      remote_ptr<void> tls, remote_ptr<int> cleartid_addr,
                      pid_t new_tid, pid_t new_rec_tid) {
@@ -209,6 +256,7 @@ void Session::kill_all_tasks() {
       r.set_syscallno(syscall_number_for_exit(r.arch()));
       r.set_arg1(0);
       t->set_regs(r);
+      t->flush_regs();
       long result;
       do {
         // We have observed this failing with an ESRCH when the thread clearly
@@ -252,6 +300,24 @@ void Session::on_destroy(AddressSpace* vm) {
   vm_map.erase(vm->uid());
 }
 
+void Session::on_file_mapping_added(const KernelMapping& recorded_map) {
+  ++file_mapping_counts[make_pair(recorded_map.device(),
+                                  recorded_map.inode())];
+}
+
+void Session::on_file_mapping_removed(const KernelMapping& recorded_map) {
+  auto id = make_pair(recorded_map.device(), recorded_map.inode());
+  auto it = file_mapping_counts.find(id);
+  assert(it != file_mapping_counts.end());
+  if (--it->second == 0) {
+    file_mapping_counts.erase(it);
+    // Only replay and diversion sessions have an EmuFs to collect these.
+    if (!is_recording()) {
+      unmapped_files.push_back(id);
+    }
+  }
+}
+
 void Session::on_destroy(Task* t) {
   assert(task_map.count(t->rec_tid) == 1);
   task_map.erase(t->rec_tid);
@@ -345,6 +411,10 @@ void Session::finish_initializing() const {
       Task* t_clone =
           Task::os_clone_into(tgmember, tgleader.clone_leader, remote);
       self->on_create(t_clone);
+      // Set up the syscallbuf from the leader while it's already doing
+      // remote syscalls; often that leaves copy_state() nothing to do in
+      // the new thread.
+      t_clone->copy_syscallbuf_state(tgmember, remote);
       t_clone->copy_state(tgmember);
     }
     tgleader.clone_leader->copy_state(tgleader.clone_leader_state);
@@ -359,8 +429,8 @@ static void remap_shared_mmap(AutoRemoteSyscalls& remote, EmuFs& dest_emu_fs,
 
   LOG(debug) << "    remapping shared region at " << m.map.start() << "-"
              << m.map.end();
-  remote.infallible_syscall(syscall_number_for_munmap(remote.arch()),
-                            m.map.start(), m.map.size());
+  // No need to munmap the old region first; the MAP_FIXED mmap below
+  // replaces it, and that saves a remote syscall per region.
 
   auto emufile = dest_emu_fs.at(m.recorded_map);
   // TODO: this duplicates some code in replay_syscall.cc, but
@@ -183,6 +183,31 @@ public:
   void on_create(TaskGroup* tg);
   void on_destroy(TaskGroup* tg);
 
+  /**
+   * AddressSpaces call these whenever a mapping (or a piece of one, when
+   * mappings are split or coalesced) of the recorded file |recorded_map|
+   * is added or removed, so we know which files are mapped without
+   * scanning every mapping.
+   */
+  void on_file_mapping_added(const KernelMapping& recorded_map);
+  void on_file_mapping_removed(const KernelMapping& recorded_map);
+  /**
+   * Return true if some address space in this session maps the recorded
+   * file with |device| and |inode|.
+   */
+  bool is_file_mapped(dev_t device, ino_t inode) const {
+    return file_mapping_counts.count(std::make_pair(device, inode)) > 0;
+  }
+  /**
+   * Return the (device, inode) of files whose last mapping was removed
+   * since the last call. They may have been mapped again since.
+   */
+  std::vector<std::pair<dev_t, ino_t> > take_unmapped_files() {
+    std::vector<std::pair<dev_t, ino_t> > result;
+    result.swap(unmapped_files);
+    return result;
+  }
+
   /** Return the set of Tasks being tracekd in this session. */
   const TaskMap& tasks() const {
     finish_initializing();
@@ -194,6 +219,20 @@ public:
    */
   std::vector<AddressSpace*> vms() const;
 
+  /**
+   * Return the number of bytes of memory private to this session's address
+   * spaces, i.e. roughly what would be freed by killing its tasks. For a
+   * checkpoint this starts near zero and grows as the session it was cloned
+   * from modifies the pages they share copy-on-write.
+   */
+  uint64_t private_memory_size() const;
+  /**
+   * Like |private_memory_size()|, but also return the resident memory this
+   * session shares with other processes (usually other clones) in
+   * |shared_bytes|.
+   */
+  uint64_t private_memory_size(uint64_t* shared_bytes) const;
+
   virtual RecordSession* as_record() { return nullptr; }
   virtual ReplaySession* as_replay() { return nullptr; }
   virtual DiversionSession* as_diversion() { return nullptr; }
@@ -205,17 +244,57 @@ public:
   bool visible_execution() const { return visible_execution_; }
   void set_visible_execution(bool visible) { visible_execution_ = visible; }
 
+  /**
+   * True if tracees' cpuid instructions trap, so their results are
+   * recorded and replayed. This is a property of the trace.
+   */
+  virtual bool has_cpuid_faulting() const { return false; }
+
   struct Statistics {
     Statistics()
-        : bytes_written(0), ticks_processed(0), syscalls_performed(0) {}
+        : bytes_written(0),
+          ticks_processed(0),
+          syscalls_performed(0),
+          ptrace_calls(0),
+          getregs_avoided(0),
+          replay_seconds(0),
+          wait_seconds(0),
+          memory_restore_seconds(0),
+          syscall_emulation_seconds(0) {}
     uint64_t bytes_written;
     Ticks ticks_processed;
     uint32_t syscalls_performed;
+    uint64_t ptrace_calls;
+    // Stops we resumed from without fetching registers.
+    uint64_t getregs_avoided;
+    // Wall-clock time spent in ReplaySession::replay_step().
+    double replay_seconds;
+    // Wall-clock time spent blocked in waitpid() for tracee stops.
+    double wait_seconds;
+    // Wall-clock time spent writing recorded data into tracee memory.
+    double memory_restore_seconds;
+    // Wall-clock time spent emulating syscall exits, excluding the waits,
+    // memory restores and trace reads done on the way.
+    double syscall_emulation_seconds;
   };
   void accumulate_bytes_written(uint64_t bytes_written) {
     statistics_.bytes_written += bytes_written;
   }
   void accumulate_syscall_performed() { statistics_.syscalls_performed += 1; }
+  void accumulate_ptrace_call() { statistics_.ptrace_calls += 1; }
+  void accumulate_getregs_avoided() { statistics_.getregs_avoided += 1; }
+  void accumulate_replay_seconds(double seconds) {
+    statistics_.replay_seconds += seconds;
+  }
+  void accumulate_wait_seconds(double seconds) {
+    statistics_.wait_seconds += seconds;
+  }
+  void accumulate_memory_restore_seconds(double seconds) {
+    statistics_.memory_restore_seconds += seconds;
+  }
+  void accumulate_syscall_emulation_seconds(double seconds) {
+    statistics_.syscall_emulation_seconds += seconds;
+  }
   void accumulate_ticks_processed(Ticks ticks) {
     statistics_.ticks_processed += ticks;
   }
@@ -254,6 +333,13 @@ protected:
 
   Statistics statistics_;
 
+  /**
+   * Number of mappings of each recorded (device, inode) in this session's
+   * address spaces. Files with no mappings aren't present.
+   */
+  std::map<std::pair<dev_t, ino_t>, uint32_t> file_mapping_counts;
+  std::vector<std::pair<dev_t, ino_t> > unmapped_files;
+
   uint32_t next_task_serial_;
 
   /**
@@ -7,15 +7,87 @@
 #include "ReplaySession.h"
 #include "Session.h"
 #include "ReplayTask.h"
+#include "util.h"
+
+using namespace std;
 
 namespace rr {
 
+// Replayed stdio output not yet written, all destined for |pending_fd|.
+// Output for a different fd flushes this first, so the interleaving of
+// stdout and stderr is preserved.
+static int pending_fd = -1;
+static vector<uint8_t> pending;
+static double pending_since;
+
+// Flush once this much output has built up, or once the oldest pending
+// output is this old, so a slow trickle of output still shows up promptly.
+static const size_t MAX_PENDING_BYTES = 64 * 1024;
+static const double MAX_PENDING_SECONDS = 0.1;
+
+static vector<StdioMonitor::CapturedOutput>* capture;
+
+void StdioMonitor::flush_replayed_output() {
+  size_t written = 0;
+  while (written < pending.size()) {
+    ssize_t ret =
+        write(pending_fd, pending.data() + written, pending.size() - written);
+    if (ret <= 0) {
+      FATAL() << "Couldn't write to " << pending_fd;
+    }
+    written += ret;
+  }
+  pending.clear();
+}
+
+static void append_replayed_output(int fd, const uint8_t* data, size_t len) {
+  if (capture) {
+    if (capture->empty() || capture->back().fd != fd) {
+      capture->push_back(StdioMonitor::CapturedOutput());
+      capture->back().fd = fd;
+    }
+    capture->back().data.insert(capture->back().data.end(), data, data + len);
+    return;
+  }
+  if (fd != pending_fd) {
+    StdioMonitor::flush_replayed_output();
+    pending_fd = fd;
+  }
+  double now = monotonic_now_sec();
+  if (pending.empty()) {
+    pending_since = now;
+  }
+  pending.insert(pending.end(), data, data + len);
+  if (pending.size() >= MAX_PENDING_BYTES ||
+      now - pending_since >= MAX_PENDING_SECONDS) {
+    StdioMonitor::flush_replayed_output();
+  }
+}
+
+void StdioMonitor::capture_replayed_output(vector<CapturedOutput>* c) {
+  capture = c;
+}
+
+void StdioMonitor::write_captured_output(
+    const vector<CapturedOutput>& captured) {
+  for (auto& c : captured) {
+    append_replayed_output(c.fd, c.data.data(), c.data.size());
+  }
+}
+
+static bool buffers_output(Task* t) {
+  return t->session().is_replaying() &&
+         static_cast<ReplayTask*>(t)->session().redirect_stdio();
+}
+
 Switchable StdioMonitor::will_write(Task* t) {
   if (Flags::get().mark_stdio && t->session().visible_execution()) {
     char buf[256];
     snprintf(buf, sizeof(buf) - 1, "[rr %d %d]", t->tgid(), t->trace_time());
     ssize_t len = strlen(buf);
-    if (write(original_fd, buf, len) != len) {
+    if (buffers_output(t)) {
+      append_replayed_output(original_fd, (const uint8_t*)buf, len);
+    } else if (write(original_fd, buf, len) != len) {
       ASSERT(t, false) << "Couldn't write to " << original_fd;
     }
   }
@@ -24,18 +96,12 @@ Switchable StdioMonitor::will_write(Task* t) {
 }
 
 void StdioMonitor::did_write(Task* t, const std::vector<Range>& ranges) {
-  if (!t->session().is_replaying()) {
+  if (!buffers_output(t) || !t->session().visible_execution()) {
     return;
   }
-  auto rt = static_cast<ReplayTask*>(t);
-  if (rt->session().redirect_stdio() && rt->session().visible_execution()) {
-    for (auto& r : ranges) {
-      auto bytes = t->read_mem(r.data.cast<uint8_t>(), r.length);
-      if (bytes.size() !=
-          (size_t)write(original_fd, bytes.data(), bytes.size())) {
-        ASSERT(t, false) << "Couldn't write to " << original_fd;
-      }
-    }
+  for (auto& r : ranges) {
+    auto bytes = t->read_mem(r.data.cast<uint8_t>(), r.length);
+    append_replayed_output(original_fd, bytes.data(), bytes.size());
   }
 }
 
@@ -36,10 +36,38 @@ public:
   virtual Switchable will_write(Task* t);
 
   /**
-   * During replay, echo writes to stdout/stderr.
+   * During replay, echo writes to stdout/stderr. The output (and markers)
+   * are buffered in rr and written in larger chunks; see
+   * flush_replayed_output().
    */
   virtual void did_write(Task* t, const std::vector<Range>& ranges);
 
+  /**
+   * Write out any buffered replay output. Call this before anything that
+   * the user should see in order with the tracee's output, e.g. before
+   * waiting for a debugger request.
+   */
+  static void flush_replayed_output();
+
+  /**
+   * Replayed output held back rather than written, e.g. because it was
+   * produced by speculative replay that the user may never reach.
+   */
+  struct CapturedOutput {
+    int fd;
+    std::vector<uint8_t> data;
+  };
+  /**
+   * While 'capture' is non-null, append replayed output to it instead of
+   * writing it.
+   */
+  static void capture_replayed_output(std::vector<CapturedOutput>* capture);
+  /**
+   * Write output captured earlier, as if it was being replayed now.
+   */
+  static void write_captured_output(
+      const std::vector<CapturedOutput>& captured);
+
 private:
   int original_fd;
 };
@@ -0,0 +1,220 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <map>
+#include <vector>
+
+#include "preload/preload_interface.h"
+
+#include "Command.h"
+#include "kernel_metadata.h"
+#include "main.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+namespace rr {
+
+class StraceCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  StraceCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static StraceCommand singleton;
+};
+
+StraceCommand StraceCommand::singleton(
+    "strace",
+    " rr strace [OPTION]... [<trace_dir>]\n"
+    "  Print the syscalls of the recorded run, strace-style, straight from\n"
+    "  the trace without replaying it. Buffered syscalls are included, but\n"
+    "  only their results are recorded, so their arguments show as \"...\".\n"
+    "  -p, --tid=<TID>            only show syscalls made by task <TID>\n"
+    "  -t, --timing               show how long each traced syscall took\n");
+
+struct StraceFlags {
+  pid_t only_tid;
+  bool timing;
+
+  StraceFlags() : only_tid(0), timing(false) {}
+};
+
+static bool parse_strace_arg(vector<string>& args, StraceFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'p', "tid", HAS_PARAMETER },
+                                        { 't', "timing", NO_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'p':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.only_tid = opt.int_value;
+      break;
+    case 't':
+      flags.timing = true;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+/**
+ * A traced syscall whose entry we've seen but whose exit we haven't.
+ */
+struct PendingSyscall {
+  TraceFrame::Time time;
+  double seconds;
+  SupportedArch arch;
+  int number;
+  uintptr_t args[6];
+};
+
+static string format_result(int64_t ret) {
+  char buf[100];
+  if (ret < 0 && ret >= -4095) {
+    snprintf(buf, sizeof(buf), "-1 %s", errno_name(-ret).c_str());
+  } else if (ret < 0 || ret > 0xffff) {
+    snprintf(buf, sizeof(buf), "0x%" PRIx64, (uint64_t)ret);
+  } else {
+    snprintf(buf, sizeof(buf), "%" PRId64, ret);
+  }
+  return buf;
+}
+
+static void print_pending(FILE* out, pid_t tid, const PendingSyscall& s) {
+  fprintf(out, "%-10u %-8d %s(0x%" PRIxPTR ", 0x%" PRIxPTR ", 0x%" PRIxPTR
+               ", 0x%" PRIxPTR ", 0x%" PRIxPTR ", 0x%" PRIxPTR ")",
+          s.time, tid, syscall_name(s.number, s.arch).c_str(), s.args[0],
+          s.args[1], s.args[2], s.args[3], s.args[4], s.args[5]);
+}
+
+static void print_buffered_syscalls(FILE* out, const TraceFrame& frame,
+                                    const TraceReader::RawDataRef& data) {
+  if (data.size < sizeof(struct syscallbuf_hdr)) {
+    fprintf(stderr, "Malformed trace file (bad syscallbuf size)\n");
+    abort();
+  }
+  auto flush_hdr = reinterpret_cast<const syscallbuf_hdr*>(data.data);
+  if (flush_hdr->num_rec_bytes > data.size - sizeof(struct syscallbuf_hdr)) {
+    fprintf(stderr, "Malformed trace file (bad recorded-bytes count)\n");
+    abort();
+  }
+  auto record_ptr = reinterpret_cast<const uint8_t*>(flush_hdr + 1);
+  auto end_ptr = record_ptr + flush_hdr->num_rec_bytes;
+  while (record_ptr < end_ptr) {
+    auto record = reinterpret_cast<const struct syscallbuf_record*>(record_ptr);
+    if (record->size < sizeof(*record)) {
+      fprintf(stderr, "Malformed trace file (bad record size)\n");
+      abort();
+    }
+    fprintf(out, "%-10u %-8d %s(...) = %s [buffered]\n", frame.time(),
+            frame.tid(),
+            syscall_name(record->syscallno, frame.event().arch()).c_str(),
+            format_result(record->ret).c_str());
+    record_ptr += stored_record_size(record->size);
+  }
+}
+
+static int strace(const string& trace_dir, const StraceFlags& flags,
+                  FILE* out) {
+  TraceReader trace(trace_dir);
+  map<pid_t, PendingSyscall> pending;
+
+  fprintf(out, "%-10s %-8s %s\n", "EVENT", "TID", "SYSCALL");
+  while (!trace.at_end()) {
+    TraceFrame frame = trace.read_frame();
+    bool selected = !flags.only_tid || frame.tid() == flags.only_tid;
+    const Event& ev = frame.event();
+
+    // The trace's raw data has to be consumed for every frame to stay in
+    // step, but only syscallbuf flushes have data we want.
+    TraceReader::RawDataRef data;
+    bool first = true;
+    while (trace.read_raw_data_ref_for_frame(frame, data)) {
+      if (first && selected && ev.type() == EV_SYSCALLBUF_FLUSH) {
+        print_buffered_syscalls(out, frame, data);
+      }
+      first = false;
+    }
+
+    if (!selected || !ev.is_syscall_event()) {
+      continue;
+    }
+    const Registers& regs = frame.regs();
+    if (ev.Syscall().state == ENTERING_SYSCALL) {
+      auto it = pending.find(frame.tid());
+      if (it != pending.end()) {
+        // The previous syscall never exited, e.g. because it was
+        // interrupted and restarted.
+        print_pending(out, frame.tid(), it->second);
+        fprintf(out, " = ? <unfinished>\n");
+      }
+      PendingSyscall& s = pending[frame.tid()];
+      s.time = frame.time();
+      s.seconds = frame.monotonic_time();
+      s.arch = ev.arch();
+      s.number = ev.Syscall().number;
+      s.args[0] = regs.arg1();
+      s.args[1] = regs.arg2();
+      s.args[2] = regs.arg3();
+      s.args[3] = regs.arg4();
+      s.args[4] = regs.arg5();
+      s.args[5] = regs.arg6();
+    } else if (ev.Syscall().state == EXITING_SYSCALL) {
+      auto it = pending.find(frame.tid());
+      if (it == pending.end() || it->second.number != ev.Syscall().number) {
+        // No recorded entry (or a mismatched one); the exit registers no
+        // longer hold the arguments.
+        fprintf(out, "%-10u %-8d %s(...) = %s\n", frame.time(), frame.tid(),
+                syscall_name(ev.Syscall().number, ev.arch()).c_str(),
+                format_result(regs.syscall_result_signed()).c_str());
+        continue;
+      }
+      print_pending(out, frame.tid(), it->second);
+      fprintf(out, " = %s",
+              format_result(regs.syscall_result_signed()).c_str());
+      if (flags.timing) {
+        fprintf(out, " <%.6f>", frame.monotonic_time() - it->second.seconds);
+      }
+      fputc('\n', out);
+      pending.erase(it);
+    }
+  }
+
+  for (auto& p : pending) {
+    print_pending(out, p.first, p.second);
+    fprintf(out, " = ? <unfinished>\n");
+  }
+  return 0;
+}
+
+int StraceCommand::run(std::vector<std::string>& args) {
+  StraceFlags flags;
+
+  while (parse_strace_arg(args, flags)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return strace(trace_dir, flags, stdout);
+}
+
+} // namespace rr
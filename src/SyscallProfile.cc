@@ -0,0 +1,71 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "SyscallProfile.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "kernel_metadata.h"
+
+using namespace std;
+
+namespace rr {
+
+void SyscallProfile::traced_stop(SupportedArch arch, int syscallno, bool entry,
+                                 double seconds) {
+  Stats& s = stats[make_pair(arch, syscallno)];
+  if (entry) {
+    ++s.traced_count;
+  }
+  ++s.ptrace_stops;
+  s.traced_seconds += seconds;
+}
+
+void SyscallProfile::buffered_syscall(SupportedArch arch, int syscallno,
+                                      double seconds) {
+  Stats& s = stats[make_pair(arch, syscallno)];
+  ++s.buffered_count;
+  s.buffered_seconds += seconds;
+}
+
+void SyscallProfile::dump(FILE* out) const {
+  typedef pair<pair<SupportedArch, int>, Stats> Entry;
+  vector<Entry> sorted(stats.begin(), stats.end());
+  sort(sorted.begin(), sorted.end(), [](const Entry& a, const Entry& b) {
+    return a.second.traced_seconds + a.second.buffered_seconds >
+           b.second.traced_seconds + b.second.buffered_seconds;
+  });
+
+  Stats total;
+  for (auto& e : sorted) {
+    total.traced_count += e.second.traced_count;
+    total.buffered_count += e.second.buffered_count;
+    total.ptrace_stops += e.second.ptrace_stops;
+    total.traced_seconds += e.second.traced_seconds;
+    total.buffered_seconds += e.second.buffered_seconds;
+  }
+
+  fprintf(out, "rr: syscall recording overhead:\n");
+  fprintf(out, "  %-24s %10s %10s %10s %10s %10s\n", "syscall", "traced",
+          "buffered", "stops", "traced s", "buffered s");
+  for (auto& e : sorted) {
+    const Stats& s = e.second;
+    string name = syscall_name(e.first.second, e.first.first);
+    if (e.first.first != NativeArch::arch()) {
+      // Tell compat syscalls apart from native ones with the same name.
+      name += " (32-bit)";
+    }
+    fprintf(out, "  %-24s %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+                 " %10.4f %10.4f\n",
+            name.c_str(), s.traced_count, s.buffered_count, s.ptrace_stops,
+            s.traced_seconds, s.buffered_seconds);
+  }
+  fprintf(out, "  %-24s %10" PRIu64 " %10" PRIu64 " %10" PRIu64
+               " %10.4f %10.4f\n",
+          "total", total.traced_count, total.buffered_count,
+          total.ptrace_stops, total.traced_seconds, total.buffered_seconds);
+}
+
+} // namespace rr
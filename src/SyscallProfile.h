@@ -0,0 +1,68 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_SYSCALL_PROFILE_H_
+#define RR_SYSCALL_PROFILE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <utility>
+
+#include "kernel_abi.h"
+
+namespace rr {
+
+/**
+ * Accumulates, per syscall, how much wall time rr spent recording it, so
+ * we can see which syscalls are worth adding to the syscallbuf. Traced
+ * syscalls are charged the time rr spends handling each of their ptrace
+ * stops. Buffered syscalls are charged an equal share of the syscallbuf
+ * flush that recorded them.
+ */
+class SyscallProfile {
+public:
+  SyscallProfile() : enabled_(false) {}
+
+  void set_enabled(bool enabled) { enabled_ = enabled; }
+  bool enabled() const { return enabled_; }
+
+  /**
+   * rr spent |seconds| handling a ptrace stop for traced syscall
+   * |syscallno|. |entry| is true for the stop that starts a new syscall.
+   */
+  void traced_stop(SupportedArch arch, int syscallno, bool entry,
+                   double seconds);
+  /**
+   * A syscallbuf flush recorded buffered syscall |syscallno|; |seconds| is
+   * this syscall's share of the flush.
+   */
+  void buffered_syscall(SupportedArch arch, int syscallno, double seconds);
+
+  /**
+   * Print a table of all syscalls seen, most expensive first.
+   */
+  void dump(FILE* out) const;
+
+private:
+  struct Stats {
+    uint64_t traced_count;
+    uint64_t buffered_count;
+    uint64_t ptrace_stops;
+    double traced_seconds;
+    double buffered_seconds;
+    Stats()
+        : traced_count(0),
+          buffered_count(0),
+          ptrace_stops(0),
+          traced_seconds(0),
+          buffered_seconds(0) {}
+  };
+
+  std::map<std::pair<SupportedArch, int>, Stats> stats;
+  bool enabled_;
+};
+
+} // namespace rr
+
+#endif /* RR_SYSCALL_PROFILE_H_ */
@@ -15,9 +15,11 @@
 #include <sys/personality.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/user.h>
 
+#include <algorithm>
 #include <limits>
 #include <set>
 
@@ -27,11 +29,13 @@
 
 #include "AutoRemoteSyscalls.h"
 #include "CPUIDBugDetector.h"
+#include "HostCpuAllocator.h"
 #include "kernel_abi.h"
 #include "kernel_metadata.h"
 #include "kernel_supplement.h"
 #include "log.h"
 #include "MagicSaveDataMonitor.h"
+#include "MarkerMonitor.h"
 #include "PreserveFileMonitor.h"
 #include "RecordSession.h"
 #include "record_signal.h"
@@ -41,6 +45,7 @@
 #include "seccomp-bpf.h"
 #include "StdioMonitor.h"
 #include "StringVectorToCharArray.h"
+#include "Timeline.h"
 #include "util.h"
 
 using namespace std;
@@ -63,11 +68,15 @@ Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, uint32_t serial,
       rec_tid(_rec_tid > 0 ? _rec_tid : _tid),
       syscallbuf_hdr(),
       num_syscallbuf_bytes(),
+      syscallbuf_mm_checked_bytes(0),
       stopping_breakpoint_table_entry_size(0),
       serial(serial),
       prname("???"),
       ticks(0),
       registers(a),
+      registers_known(true),
+      registers_dirty(false),
+      fixup_syscall_registers_on_fetch(false),
       is_stopped(false),
       detected_unexpected_exit(false),
       extra_registers(a),
@@ -84,6 +93,7 @@ void Task::destroy() {
   // it for futex_wait after we've detached.
   ASSERT(this, as->mem_fd().is_open());
 
+  flush_regs();
   fallible_ptrace(PTRACE_DETACH, nullptr, nullptr);
 
   // Subclasses can do something in their destructors after we've detached
@@ -250,11 +260,15 @@ void Task::init_buffers_arch(remote_ptr<void> map_hint) {
   if (as->syscallbuf_enabled()) {
     init_syscall_buffer(remote, map_hint);
     args.syscallbuf_ptr = syscallbuf_child;
+    args.scratch_ptr = scratch_ptr;
+    args.scratch_size = scratch_size;
     desched_fd_child = args.desched_counter_fd;
     // Prevent the child from closing this fd
     fds->add_monitor(desched_fd_child, new PreserveFileMonitor());
   } else {
     args.syscallbuf_ptr = remote_ptr<void>(nullptr);
+    args.scratch_ptr = remote_ptr<void>(nullptr);
+    args.scratch_size = 0;
   }
 
   // Return the mapped buffers to the child.
@@ -277,9 +291,18 @@ void Task::destroy_buffers() {
                             scratch_size);
   vm()->unmap(scratch_ptr, scratch_size);
   if (!syscallbuf_child.is_null()) {
-    remote.infallible_syscall(syscall_number_for_munmap(arch()),
-                              syscallbuf_child, num_syscallbuf_bytes);
-    vm()->unmap(syscallbuf_child, num_syscallbuf_bytes);
+    AddressSpace::SyscallbufSegment seg = {
+      syscallbuf_child, syscallbuf_hdr, num_syscallbuf_bytes,
+      vm()->mapping_of(syscallbuf_child).map.inode()
+    };
+    if (vm()->recycle_syscallbuf(seg)) {
+      // The address space owns our mapping of it now.
+      syscallbuf_hdr = nullptr;
+    } else {
+      remote.infallible_syscall(syscall_number_for_munmap(arch()),
+                                syscallbuf_child, num_syscallbuf_bytes);
+      vm()->unmap(syscallbuf_child, num_syscallbuf_bytes);
+    }
     if (desched_fd_child >= 0) {
       if (session().is_recording()) {
         remote.infallible_syscall(syscall_number_for_close(arch()),
@@ -497,6 +520,8 @@ void Task::post_exec(SupportedArch a, const string& exe_file) {
   struct user_regs_struct ptrace_regs;
   ptrace_if_alive(PTRACE_GETREGS, nullptr, &ptrace_regs);
   registers.set_from_ptrace(ptrace_regs);
+  registers_known = true;
+  registers_dirty = false;
   // Change syscall number to execve *for the new arch*. If we don't do this,
   // and the arch changes, then the syscall number for execve in the old arch/
   // is treated as the syscall we're executing in the new arch, with hilarious
@@ -506,6 +531,7 @@ void Task::post_exec(SupportedArch a, const string& exe_file) {
 
   syscallbuf_child = nullptr;
   syscallbuf_fds_disabled_child = nullptr;
+  mm_buffering_disabled_child = nullptr;
 
   thread_areas_.clear();
 
@@ -518,6 +544,14 @@ void Task::post_exec(SupportedArch a, const string& exe_file) {
 void Task::post_exec_syscall(TraceTaskEvent& event) {
   as->post_exec_syscall(this);
   fds->update_for_cloexec(this, event);
+
+  // exec turns CPUID faulting off again, so enable it for each new image.
+  // Only x86-64 tracees have arch_prctl.
+  if (session().has_cpuid_faulting() && has_arch_prctl_syscall(arch())) {
+    AutoRemoteSyscalls remote(this);
+    remote.infallible_syscall(syscall_number_for_arch_prctl(arch()),
+                              ARCH_SET_CPUID, 0);
+  }
 }
 
 void Task::flush_inconsistent_state() { ticks = 0; }
@@ -546,6 +580,9 @@ string Task::read_c_str(remote_ptr<char> child_addr) {
 
 const Registers& Task::regs() const {
   ASSERT(this, is_stopped);
+  if (!registers_known) {
+    const_cast<Task*>(this)->fetch_registers();
+  }
   return registers;
 }
 
@@ -690,8 +727,16 @@ void Task::resume_execution(ResumeRequest how, WaitRequest wait_how,
   LOG(debug) << "resuming execution of " << tid << " with "
              << ptrace_req_name(how)
              << (sig ? string(", signal ") + signal_name(sig) : string());
-  address_of_last_execution_resume = ip();
+  // did_waitpid() only needs to know where we resumed if there might be a
+  // breakpoint there, so don't fetch registers just for that.
+  if (registers_known || as->has_breakpoints()) {
+    address_of_last_execution_resume = ip();
+  } else {
+    address_of_last_execution_resume = remote_code_ptr();
+    session().accumulate_getregs_avoided();
+  }
   set_debug_status(0);
+  flush_regs();
 
   pid_t wait_ret = 0;
   if (session().is_recording()) {
@@ -706,7 +751,9 @@ void Task::resume_execution(ResumeRequest how, WaitRequest wait_how,
      * or just letting the tracee be scheduled to process its pending SIGKILL.
      */
     int status;
-    wait_ret = waitpid(tid, &status, WNOHANG | __WALL | WSTOPPED);
+    wait_ret = take_collected_status(&status)
+                   ? tid
+                   : waitpid(tid, &status, WNOHANG | __WALL | WSTOPPED);
     ASSERT(this, 0 <= wait_ret) << "waitpid(" << tid << ", NOHANG) failed with "
                                 << wait_ret;
     if (wait_ret == tid) {
@@ -722,6 +769,10 @@ void Task::resume_execution(ResumeRequest how, WaitRequest wait_how,
   } else {
     ptrace_if_alive(how, nullptr, (void*)(uintptr_t)sig);
   }
+  if (session().is_recording() &&
+      session().as_record()->ptrace_latency().enabled()) {
+    session().as_record()->ptrace_latency().resumed(this);
+  }
 
   is_stopped = false;
   extra_registers_known = false;
@@ -733,8 +784,17 @@ void Task::resume_execution(ResumeRequest how, WaitRequest wait_how,
 void Task::set_regs(const Registers& regs) {
   ASSERT(this, is_stopped);
   registers = regs;
+  registers_known = true;
+  registers_dirty = true;
+}
+
+void Task::flush_regs() {
+  if (!registers_dirty) {
+    return;
+  }
   auto ptrace_regs = registers.get_ptrace();
   ptrace_if_alive(PTRACE_SETREGS, nullptr, &ptrace_regs);
+  registers_dirty = false;
 }
 
 void Task::set_extra_regs(const ExtraRegisters& regs) {
@@ -972,7 +1032,13 @@ void Task::wait(double interrupt_after_elapsed) {
   int status;
   bool sent_wait_interrupt = false;
   pid_t ret;
+  double wait_start = monotonic_now_sec();
+  TimelineScope timeline(Timeline::TRACEE, tid, "ptrace", "wait");
   while (true) {
+    if (take_collected_status(&status)) {
+      ret = tid;
+      break;
+    }
     if (interrupt_after_elapsed) {
       struct itimerval timer = { { 0, 0 },
                                  to_timeval(interrupt_after_elapsed) };
@@ -1007,6 +1073,7 @@ void Task::wait(double interrupt_after_elapsed) {
       sent_wait_interrupt = true;
     }
   }
+  session().accumulate_wait_seconds(monotonic_now_sec() - wait_start);
 
   if (ret >= 0 && !stopped_from_status(status)) {
     // Unexpected non-stopping exit code returned in wait_status.
@@ -1134,18 +1201,14 @@ void Task::did_waitpid(int status, siginfo_t* override_siginfo) {
   ticks += more_ticks;
   session().accumulate_ticks_processed(more_ticks);
 
-  LOG(debug) << "  (refreshing register cache)";
   intptr_t original_syscallno = registers.original_syscallno();
   // Skip reading registers immediately after a PTRACE_EVENT_EXEC, since
-  // we may not know the correct architecture.
+  // we may not know the correct architecture. Otherwise they're fetched
+  // when someone first asks for them; many stops are resumed from without
+  // looking at them.
   if (ptrace_event() != PTRACE_EVENT_EXEC) {
-    struct user_regs_struct ptrace_regs;
-    if (ptrace_if_alive(PTRACE_GETREGS, nullptr, &ptrace_regs)) {
-      registers.set_from_ptrace(ptrace_regs);
-    } else {
-      LOG(debug) << "Unexpected process death for " << tid;
-      status = ptrace_exit_wait_status;
-    }
+    LOG(debug) << "  (invalidating register cache)";
+    registers_known = false;
   }
   if (pending_sig_from_status(status)) {
     if (override_siginfo) {
@@ -1164,31 +1227,70 @@ void Task::did_waitpid(int status, siginfo_t* override_siginfo) {
     seen_ptrace_exit_event = true;
   }
 
-  bool need_to_set_regs = false;
-  if (registers.singlestep_flag()) {
-    registers.clear_singlestep_flag();
-    need_to_set_regs = true;
+  // When exiting a syscall, We need to normalize nondeterministic registers.
+  // Decide that now, while the event state we depend on is current.
+  fixup_syscall_registers_on_fetch = is_in_non_sigreturn_exit_syscall(this);
+  if (registers_known && fixup_syscall_registers_on_fetch) {
+    fixup_syscall_registers(registers);
+    set_regs(registers);
   }
+  fixup_syscall_registers_on_fetch &= !registers_known;
 
   if (as->get_breakpoint_type_at_addr(address_of_last_execution_resume) !=
           BKPT_NONE &&
       pending_sig() == SIGTRAP && !ptrace_event()) {
-    ASSERT(this,
-           ip() ==
-               address_of_last_execution_resume.increment_by_bkpt_insn_length(
-                   arch()));
-    ASSERT(this, more_ticks == 0);
-    // When we resume execution and immediately hit a breakpoint, the original
-    // syscall number can be reset to -1. Undo that, so that the register
-    // state matches the state we'd be in if we hadn't resumed. ReplayTimeline
-    // depends on resume-at-a-breakpoint being a noop.
-    registers.set_original_syscallno(original_syscallno);
-    need_to_set_regs = true;
+    // Fetching the registers turns this stop into an exit if the task has
+    // died since.
+    Registers r = regs();
+    if (!ptrace_event()) {
+      ASSERT(this,
+             ip() ==
+                 address_of_last_execution_resume
+                     .increment_by_bkpt_insn_length(arch()));
+      ASSERT(this, more_ticks == 0);
+      // When we resume execution and immediately hit a breakpoint, the
+      // original syscall number can be reset to -1. Undo that, so that the
+      // register state matches the state we'd be in if we hadn't resumed.
+      // ReplayTimeline depends on resume-at-a-breakpoint being a noop.
+      r.set_original_syscallno(original_syscallno);
+      set_regs(r);
+    }
   }
 
-  // When exiting a syscall, We need to normalize nondeterministic registers.
-  if (is_in_non_sigreturn_exit_syscall(this)) {
+  if (session().is_recording() &&
+      session().as_record()->ptrace_latency().enabled()) {
+    session().as_record()->ptrace_latency().stopped(this);
+  }
+
+  apply_buffered_mm_syscalls();
+}
+
+void Task::fetch_registers() {
+  ASSERT(this, is_stopped);
+  struct user_regs_struct ptrace_regs;
+  if (!ptrace_if_alive(PTRACE_GETREGS, nullptr, &ptrace_regs)) {
+    // The task died after reporting this stop. Turn the stop into its exit,
+    // as did_waitpid() does when it can't get the siginfo, so nobody carries
+    // on as if |registers|, left over from an earlier stop, were current.
+    // They stay unknown; the task has no registers to fetch any more.
+    LOG(debug) << "Unexpected process death for " << tid;
+    wait_status = ptrace_exit_wait_status;
+    seen_ptrace_exit_event = true;
+    fixup_syscall_registers_on_fetch = false;
+    return;
+  }
+  registers_known = true;
+  registers.set_from_ptrace(ptrace_regs);
+  registers_dirty = false;
+
+  bool need_to_set_regs = false;
+  if (registers.singlestep_flag()) {
+    registers.clear_singlestep_flag();
+    need_to_set_regs = true;
+  }
+  if (fixup_syscall_registers_on_fetch) {
     fixup_syscall_registers(registers);
+    fixup_syscall_registers_on_fetch = false;
     need_to_set_regs = true;
   }
   if (need_to_set_regs) {
@@ -1196,9 +1298,17 @@ void Task::did_waitpid(int status, siginfo_t* override_siginfo) {
   }
 }
 
+bool Task::take_collected_status(int* status) {
+  return session().is_recording() &&
+         session().as_record()->scheduler().take_collected_status(tid,
+                                                                  status);
+}
+
 bool Task::try_wait() {
   int status;
-  pid_t ret = waitpid(tid, &status, WNOHANG | __WALL | WSTOPPED);
+  pid_t ret = take_collected_status(&status)
+                  ? tid
+                  : waitpid(tid, &status, WNOHANG | __WALL | WSTOPPED);
   LOG(debug) << "waitpid(" << tid << ", NOHANG) returns " << ret << ", status "
              << HEX(wait_status);
   ASSERT(this, 0 <= ret) << "waitpid(" << tid << ", NOHANG) failed with "
@@ -1241,6 +1351,9 @@ static void set_up_process(Session& session) {
   if (RR_MAGIC_SAVE_DATA_FD != dup2(fd, RR_MAGIC_SAVE_DATA_FD)) {
     spawned_child_fatal_error("error duping to RR_MAGIC_SAVE_DATA_FD");
   }
+  if (RR_MAGIC_MARKER_FD != dup2(fd, RR_MAGIC_MARKER_FD)) {
+    spawned_child_fatal_error("error duping to RR_MAGIC_MARKER_FD");
+  }
 
   /* CLOEXEC so that the original fd here will be closed by the exec that's
    * about to happen.
@@ -1322,6 +1435,22 @@ static void set_up_seccomp_filter(Session& session) {
     };
     prog.len = (unsigned short)(sizeof(filter) / sizeof(filter[0]));
     prog.filter = filter;
+  } else if (!session.is_recording()) {
+    uintptr_t privileged_in_traced_syscall_ip =
+        AddressSpace::rr_page_ip_in_privileged_traced_syscall()
+            .register_value();
+    assert(privileged_in_traced_syscall_ip ==
+           uint32_t(privileged_in_traced_syscall_ip));
+
+    // During replay, tracees only make syscalls for us, e.g. for
+    // diversions. Those made from the privileged traced callsite don't need
+    // a PTRACE_EVENT_SECCOMP stop on top of the syscall-entry stop.
+    struct sock_filter filter[] = {
+      ALLOW_SYSCALLS_FROM_CALLSITE(uint32_t(privileged_in_traced_syscall_ip)),
+      TRACE_PROCESS,
+    };
+    prog.len = (unsigned short)(sizeof(filter) / sizeof(filter[0]));
+    prog.filter = filter;
   } else {
     // Use a dummy filter that always generates ptrace traps. Supplying this
     // dummy filter makes ptrace-event behavior consistent whether or not
@@ -1415,6 +1544,15 @@ Task* Task::clone(int flags, remote_ptr<void> stack, remote_ptr<void> tls,
     t->as = sess.clone(t, as);
   }
   t->syscallbuf_fds_disabled_child = syscallbuf_fds_disabled_child;
+  t->mm_buffering_disabled_child = mm_buffering_disabled_child;
+  if ((CLONE_SHARE_VM & flags) && !other_session &&
+      !mm_buffering_disabled_child.is_null()) {
+    // Buffered mprotects and munmaps are applied to the address space
+    // when the task that made them stops, so they could reach it late or
+    // out of order once another task shares it. We're stopped at the clone,
+    // so everything we buffered so far has been applied.
+    write_mem(mm_buffering_disabled_child, (unsigned char)1);
+  }
 
   t->stopping_breakpoint_table = stopping_breakpoint_table;
   t->stopping_breakpoint_table_entry_size =
@@ -1552,6 +1690,7 @@ Task::CapturedState Task::capture_state() {
   state.prname = prname;
   state.thread_areas = thread_areas_;
   state.num_syscallbuf_bytes = num_syscallbuf_bytes;
+  state.syscallbuf_mm_checked_bytes = syscallbuf_mm_checked_bytes;
   state.desched_fd_child = desched_fd_child;
   state.syscallbuf_child = syscallbuf_child;
   if (syscallbuf_hdr) {
@@ -1567,6 +1706,7 @@ Task::CapturedState Task::capture_state() {
            state.syscallbuf_hdr.size());
   }
   state.syscallbuf_fds_disabled_child = syscallbuf_fds_disabled_child;
+  state.mm_buffering_disabled_child = mm_buffering_disabled_child;
   state.scratch_ptr = scratch_ptr;
   state.scratch_size = scratch_size;
   state.wait_status = wait_status;
@@ -1578,9 +1718,15 @@ Task::CapturedState Task::capture_state() {
 void Task::copy_state(const CapturedState& state) {
   set_regs(state.regs);
   set_extra_regs(state.extra_regs);
-  {
+  // Cloned threads already have the name of the task that cloned them,
+  // which is usually the right one, and their syscallbuf may have been set
+  // up already. Avoid entering remote-syscall mode when there's nothing to
+  // do; with many threads it adds up.
+  bool need_name = prname != state.prname;
+  bool need_syscallbuf = !state.syscallbuf_child.is_null() && !syscallbuf_child;
+  if (need_name || !state.thread_areas.empty() || need_syscallbuf) {
     AutoRemoteSyscalls remote(this);
-    {
+    if (need_name) {
       char prname[16];
       strncpy(prname, state.prname.c_str(), sizeof(prname));
       AutoRestoreMem remote_prname(remote, (const uint8_t*)prname,
@@ -1592,28 +1738,14 @@ void Task::copy_state(const CapturedState& state) {
     }
 
     copy_tls(state, remote);
-    thread_areas_ = state.thread_areas;
-
-    ASSERT(this, !syscallbuf_child)
-        << "Syscallbuf should not already be initialized in clone";
-    if (!state.syscallbuf_child.is_null()) {
-      // All these fields are preserved by the fork.
-      num_syscallbuf_bytes = state.num_syscallbuf_bytes;
-      desched_fd_child = state.desched_fd_child;
-
-      // The syscallbuf is mapped as a shared
-      // segment between rr and the tracee.  So we
-      // have to unmap it, create a copy, and then
-      // re-map the copy in rr and the tracee.
-      init_syscall_buffer(remote, state.syscallbuf_child);
-      ASSERT(this, state.syscallbuf_child == syscallbuf_child);
-      // Ensure the copied syscallbuf has the same contents
-      // as the old one, for consistency checking.
-      memcpy(syscallbuf_hdr, state.syscallbuf_hdr.data(),
-             state.syscallbuf_hdr.size());
+
+    if (need_syscallbuf) {
+      copy_syscallbuf_state(state, remote);
     }
   }
+  thread_areas_ = state.thread_areas;
   syscallbuf_fds_disabled_child = state.syscallbuf_fds_disabled_child;
+  mm_buffering_disabled_child = state.mm_buffering_disabled_child;
   // The scratch buffer (for now) is merely a private mapping in
   // the remote task.  The CoW copy made by fork()'ing the
   // address space has the semantics we want.  It's not used in
@@ -1628,11 +1760,38 @@ void Task::copy_state(const CapturedState& state) {
   ticks = state.ticks;
 }
 
+void Task::copy_syscallbuf_state(const CapturedState& state,
+                                 AutoRemoteSyscalls& remote) {
+  ASSERT(this, !syscallbuf_child)
+      << "Syscallbuf should not already be initialized in clone";
+  if (state.syscallbuf_child.is_null()) {
+    return;
+  }
+  // All these fields are preserved by the fork.
+  num_syscallbuf_bytes = state.num_syscallbuf_bytes;
+  desched_fd_child = state.desched_fd_child;
+
+  // The syscallbuf is mapped as a shared
+  // segment between rr and the tracee.  So we
+  // have to unmap it, create a copy, and then
+  // re-map the copy in rr and the tracee.
+  init_syscall_buffer(remote, state.syscallbuf_child);
+  ASSERT(this, state.syscallbuf_child == syscallbuf_child);
+  // Ensure the copied syscallbuf has the same contents
+  // as the old one, for consistency checking.
+  memcpy(syscallbuf_hdr, state.syscallbuf_hdr.data(),
+         state.syscallbuf_hdr.size());
+  syscallbuf_mm_checked_bytes = state.syscallbuf_mm_checked_bytes;
+}
+
 void Task::destroy_local_buffers() {
-  munmap(syscallbuf_hdr, num_syscallbuf_bytes);
+  if (syscallbuf_hdr) {
+    munmap(syscallbuf_hdr, num_syscallbuf_bytes);
+  }
 }
 
 long Task::fallible_ptrace(int request, remote_ptr<void> addr, void* data) {
+  session().accumulate_ptrace_call();
   return ptrace(__ptrace_request(request), tid, addr, data);
 }
 
@@ -1669,6 +1828,23 @@ void Task::open_mem_fd_if_needed() {
 
 void Task::init_syscall_buffer(AutoRemoteSyscalls& remote,
                                remote_ptr<void> map_hint) {
+  ASSERT(this, !syscallbuf_child)
+      << "Should not already have syscallbuf initialized!";
+  AddressSpace::SyscallbufSegment seg;
+  if (vm()->take_syscallbuf(map_hint, &seg)) {
+    // Reuse the buffer of a thread that exited. Thread-pool workloads
+    // start and stop threads all the time, and this saves several remote
+    // syscalls each time.
+    LOG(debug) << "reusing syscallbuf at " << seg.child;
+    num_syscallbuf_bytes = seg.size;
+    syscallbuf_child = seg.child.cast<struct syscallbuf_hdr>();
+    syscallbuf_hdr = (struct syscallbuf_hdr*)seg.local;
+    memset(syscallbuf_hdr, 0, num_syscallbuf_bytes);
+    syscallbuf_hdr->usable_size = SYSCALLBUF_INITIAL_SIZE;
+    syscallbuf_mm_checked_bytes = 0;
+    return;
+  }
+
   static int nonce = 0;
   // Create the segment we'll share with the tracee.
   char path[PATH_MAX];
@@ -1711,12 +1887,12 @@ void Task::init_syscall_buffer(AutoRemoteSyscalls& remote,
   remote_ptr<void> child_map_addr = remote.infallible_mmap_syscall(
       map_hint, num_syscallbuf_bytes, prot, flags, child_shmem_fd, 0);
 
-  ASSERT(this, !syscallbuf_child)
-      << "Should not already have syscallbuf initialized!";
   syscallbuf_child = child_map_addr.cast<struct syscallbuf_hdr>();
   syscallbuf_hdr = (struct syscallbuf_hdr*)map_addr;
   // No entries to begin with.
   memset(syscallbuf_hdr, 0, sizeof(*syscallbuf_hdr));
+  syscallbuf_hdr->usable_size = SYSCALLBUF_INITIAL_SIZE;
+  syscallbuf_mm_checked_bytes = 0;
 
   struct stat st;
   ASSERT(this, 0 == ::fstat(shmem_fd, &st));
@@ -1731,6 +1907,39 @@ void Task::reset_syscallbuf() {
   uint8_t* ptr = (uint8_t*)(syscallbuf_hdr + 1);
   memset(ptr, 0, syscallbuf_hdr->num_rec_bytes);
   syscallbuf_hdr->num_rec_bytes = 0;
+  syscallbuf_hdr->overflowed = 0;
+  syscallbuf_mm_checked_bytes = 0;
+}
+
+void Task::apply_buffered_mm_syscalls() {
+  if (!syscallbuf_hdr) {
+    return;
+  }
+  auto records = reinterpret_cast<const uint8_t*>(syscallbuf_hdr + 1);
+  uint32_t num_rec_bytes = syscallbuf_hdr->num_rec_bytes;
+  while (syscallbuf_mm_checked_bytes < num_rec_bytes) {
+    auto rec = reinterpret_cast<const struct syscallbuf_record*>(
+        records + syscallbuf_mm_checked_bytes);
+    ASSERT(this, rec->size >= sizeof(*rec)) << "Bad syscallbuf record size";
+    if (!syscall_affects_address_space(rec->syscallno, arch())) {
+      syscallbuf_mm_checked_bytes += stored_record_size(rec->size);
+      continue;
+    }
+    bool is_mprotect = is_mprotect_syscall(rec->syscallno, arch());
+    if ((is_mprotect || is_munmap_syscall(rec->syscallno, arch())) &&
+        rec->size >= sizeof(*rec) + sizeof(struct syscallbuf_mm_args)) {
+      auto args =
+          reinterpret_cast<const struct syscallbuf_mm_args*>(rec->extra_data);
+      if (is_mprotect) {
+        // Like a traced mprotect, a failed one may have changed part of
+        // the range.
+        vm()->protect(args->addr, args->length, args->prot);
+      } else if (rec->ret == 0) {
+        vm()->unmap(args->addr, args->length);
+      }
+    }
+    syscallbuf_mm_checked_bytes += stored_record_size(rec->size);
+  }
 }
 
 ssize_t Task::read_bytes_ptrace(remote_ptr<void> addr, ssize_t buf_size,
@@ -1984,6 +2193,115 @@ void Task::write_bytes_helper(remote_ptr<void> addr, ssize_t buf_size,
   }
 }
 
+void Task::write_bytes_batch(const vector<MemoryWrite>& writes) {
+  // process_vm_writev may be forbidden, e.g. by a container's seccomp
+  // policy. Don't keep trying it if so.
+  static bool process_vm_writev_works = true;
+  size_t done = 0;
+  while (process_vm_writev_works && done < writes.size()) {
+    size_t count = min<size_t>(writes.size() - done, IOV_MAX);
+    vector<struct iovec> local_iov(count);
+    vector<struct iovec> remote_iov(count);
+    for (size_t i = 0; i < count; ++i) {
+      const MemoryWrite& w = writes[done + i];
+      local_iov[i].iov_base = const_cast<void*>(w.data);
+      local_iov[i].iov_len = w.size;
+      remote_iov[i].iov_base = (void*)w.addr.as_int();
+      remote_iov[i].iov_len = w.size;
+    }
+    ssize_t nwritten = process_vm_writev(tid, local_iov.data(), count,
+                                         remote_iov.data(), count, 0);
+    if (nwritten < 0) {
+      if (errno == ENOSYS || errno == EPERM) {
+        process_vm_writev_works = false;
+        break;
+      }
+      nwritten = 0;
+    }
+    // The kernel stops at the first write it can't do. Account for the ones
+    // before it, then do that one the slow way and continue after it.
+    size_t end = done + count;
+    while (done < end && size_t(nwritten) >= writes[done].size) {
+      vm()->notify_written(writes[done].addr, writes[done].size);
+      nwritten -= writes[done].size;
+      ++done;
+    }
+    if (done < end) {
+      const MemoryWrite& w = writes[done];
+      if (nwritten > 0) {
+        vm()->notify_written(w.addr, nwritten);
+      }
+      write_bytes_helper(w.addr + nwritten, w.size - nwritten,
+                         static_cast<const uint8_t*>(w.data) + nwritten);
+      ++done;
+    }
+  }
+  for (; done < writes.size(); ++done) {
+    write_bytes_helper(writes[done].addr, writes[done].size,
+                       writes[done].data);
+  }
+}
+
+void Task::read_bytes_batch(const vector<MemoryRead>& reads,
+                            vector<ssize_t>* nread) {
+  if (nread) {
+    nread->assign(reads.size(), 0);
+  }
+  // Finish reads[i] the slow way, after its first |already| bytes.
+  auto finish_read = [&](size_t i, size_t already) {
+    const MemoryRead& r = reads[i];
+    uint8_t* data = static_cast<uint8_t*>(r.data) + already;
+    if (nread) {
+      ssize_t n = read_bytes_fallible(r.addr + already, r.size - already, data);
+      (*nread)[i] = already + max<ssize_t>(0, n);
+    } else {
+      read_bytes_helper(r.addr + already, r.size - already, data);
+    }
+  };
+
+  // See write_bytes_batch.
+  static bool process_vm_readv_works = true;
+  size_t done = 0;
+  while (process_vm_readv_works && done < reads.size()) {
+    size_t count = min<size_t>(reads.size() - done, IOV_MAX);
+    vector<struct iovec> local_iov(count);
+    vector<struct iovec> remote_iov(count);
+    for (size_t i = 0; i < count; ++i) {
+      const MemoryRead& r = reads[done + i];
+      local_iov[i].iov_base = r.data;
+      local_iov[i].iov_len = r.size;
+      remote_iov[i].iov_base = (void*)r.addr.as_int();
+      remote_iov[i].iov_len = r.size;
+    }
+    ssize_t nread_now = process_vm_readv(tid, local_iov.data(), count,
+                                         remote_iov.data(), count, 0);
+    if (nread_now < 0) {
+      if (errno == ENOSYS || errno == EPERM) {
+        process_vm_readv_works = false;
+        break;
+      }
+      nread_now = 0;
+    }
+    // The kernel stops at the first read it can't do. Account for the ones
+    // before it, then do that one the slow way and continue after it.
+    size_t end = done + count;
+    while (done < end && size_t(nread_now) >= reads[done].size) {
+      if (nread) {
+        (*nread)[done] = reads[done].size;
+      }
+      nread_now -= reads[done].size;
+      ++done;
+    }
+    if (done < end) {
+      finish_read(done, nread_now);
+      ++done;
+    }
+  }
+  for (; done < reads.size(); ++done) {
+    finish_read(done, 0);
+  }
+}
+
 const TraceStream* Task::trace_stream() const {
   if (session().as_record()) {
     return &session().as_record()->trace_writer();
@@ -2041,6 +2359,12 @@ template <typename Arch> static void do_preload_init_arch(Task* t) {
   remote_ptr<volatile char> syscallbuf_fds_disabled =
       params.syscallbuf_fds_disabled.rptr();
   t->syscallbuf_fds_disabled_child = syscallbuf_fds_disabled.cast<char>();
+  remote_ptr<volatile unsigned char> mm_buffering_disabled =
+      params.mm_buffering_disabled.rptr();
+  t->mm_buffering_disabled_child = mm_buffering_disabled.cast<unsigned char>();
+  if (t->vm()->task_set().size() > 1) {
+    t->write_mem(t->mm_buffering_disabled_child, (unsigned char)1);
+  }
 
   t->stopping_breakpoint_table = params.breakpoint_table.rptr().as_int();
   t->stopping_breakpoint_table_entry_size = params.breakpoint_table_entry_size;
@@ -2112,6 +2436,7 @@ static void setup_fd_table(FdTable& fds) {
   fds.add_monitor(STDOUT_FILENO, new StdioMonitor(STDOUT_FILENO));
   fds.add_monitor(STDERR_FILENO, new StdioMonitor(STDERR_FILENO));
   fds.add_monitor(RR_MAGIC_SAVE_DATA_FD, new MagicSaveDataMonitor());
+  fds.add_monitor(RR_MAGIC_MARKER_FD, new MarkerMonitor());
   fds.add_monitor(RR_RESERVED_ROOT_DIR_FD, new PreserveFileMonitor());
 }
 
@@ -2126,6 +2451,49 @@ static void set_cpu_affinity(int cpu) {
   }
 }
 
+/**
+ * Replay binds to the CPU the recording was bound to, since tracees can
+ * tell CPUs apart with CPUID. If the recording used CPUID faulting they
+ * only ever see the recorded CPUID results, so when another rr process
+ * owns that CPU we can move to a free one on the same NUMA node instead.
+ */
+static int choose_replay_cpu(const TraceStream& trace) {
+  HostCpuAllocator& allocator = HostCpuAllocator::get();
+  int recorded_cpu = trace.bound_to_cpu();
+  vector<int> recorded(1, recorded_cpu);
+  if (allocator.claim_first_free(recorded) >= 0) {
+    return recorded_cpu;
+  }
+  if (trace.uses_cpuid_faulting()) {
+    int node;
+    vector<int> node_cpus = numa_node_cpus(recorded_cpu, &node);
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+      CPU_ZERO(&allowed);
+    }
+    vector<int> candidates;
+    for (int cpu : node_cpus) {
+      if (CPU_ISSET(cpu, &allowed)) {
+        candidates.push_back(cpu);
+      }
+    }
+    if (!candidates.empty()) {
+      rotate(candidates.begin(),
+             candidates.begin() + random() % candidates.size(),
+             candidates.end());
+    }
+    int cpu = allocator.claim_first_free(candidates);
+    if (cpu >= 0) {
+      LOG(info) << "CPU " << recorded_cpu
+                << " is in use by another rr process; replaying on CPU "
+                << cpu;
+      return cpu;
+    }
+  }
+  allocator.report_contention(recorded_cpu, recorded);
+  return recorded_cpu;
+}
+
 /*static*/ Task* Task::spawn(Session& session, const TraceStream& trace,
                              pid_t rec_tid) {
   assert(session.tasks().size() == 0);
@@ -2136,7 +2504,8 @@ static void set_cpu_affinity(int cpu) {
     // tracees (so they are all affected).
     // Note that we're binding rr itself to the same CPU as the
     // tracees, since this seems to help performance.
-    set_cpu_affinity(trace.bound_to_cpu());
+    set_cpu_affinity(session.is_replaying() ? choose_replay_cpu(trace)
+                                            : trace.bound_to_cpu());
   }
 
   pid_t tid;
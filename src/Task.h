@@ -423,9 +423,19 @@ public:
   /** Return the session this is part of. */
   Session& session() const { return *session_; }
 
-  /** Set the tracee's registers to |regs|. */
+  /**
+   * Set the tracee's registers to |regs|. The new registers are only
+   * written to the kernel by |flush_regs()|, which happens automatically
+   * before the task is resumed or detached, so several register updates
+   * while the task is stopped cost a single PTRACE_SETREGS.
+   */
   void set_regs(const Registers& regs);
 
+  /**
+   * Write registers changed by |set_regs()| to the kernel, if any.
+   */
+  void flush_regs();
+
   /** Set the tracee's extra registers to |regs|. */
   void set_extra_regs(const ExtraRegisters& regs);
 
@@ -519,6 +529,15 @@ public:
    */
   void reset_syscallbuf();
 
+  /**
+   * Apply the mprotects and munmaps committed to the syscallbuf since the
+   * last call to our AddressSpace. This is called at every stop, so the
+   * memory map is up to date before anything looks at it. The preload
+   * library only buffers these while no other task shares the address
+   * space, so records from different tasks never need ordering.
+   */
+  void apply_buffered_mm_syscalls();
+
   /**
    * Return the virtual memory mapping (address space) of this
    * task.
@@ -577,6 +596,33 @@ public:
                        static_cast<const void*>(val));
   }
 
+  struct MemoryWrite {
+    remote_ptr<void> addr;
+    size_t size;
+    const void* data;
+  };
+  /**
+   * Perform all of |writes|, in order, or don't return. Uses as few
+   * process_vm_writev calls as possible, falling back to write_bytes_helper
+   * for writes that can't be done that way (e.g. to read-only pages).
+   */
+  void write_bytes_batch(const std::vector<MemoryWrite>& writes);
+
+  struct MemoryRead {
+    remote_ptr<void> addr;
+    size_t size;
+    void* data;
+  };
+  /**
+   * Perform all of |reads|. Uses as few process_vm_readv calls as possible,
+   * falling back to read_bytes_fallible for reads that can't be done that
+   * way (e.g. from PROT_NONE pages). If |nread| is non-null, it receives the
+   * number of bytes actually read for each entry of |reads|; otherwise we
+   * assert that all the data was read.
+   */
+  void read_bytes_batch(const std::vector<MemoryRead>& reads,
+                        std::vector<ssize_t>* nread = nullptr);
+
   /**
    * Don't use these helpers directly; use the safer and more
    * convenient variants above.
@@ -595,6 +641,12 @@ public:
   void write_bytes_helper(remote_ptr<void> addr, ssize_t buf_size,
                           const void* buf, bool* ok = nullptr);
 
+  /**
+   * Read the registers of this stopped task from the kernel, applying the
+   * normalizations did_waitpid() would have.
+   */
+  void fetch_registers();
+
   /** See |pending_sig()| above. */
   int pending_sig_from_status(int status) const;
   /** See |ptrace_event()| above. */
@@ -703,9 +755,15 @@ public:
   /* Points at rr's mapping of the (shared) syscall buffer. */
   struct syscallbuf_hdr* syscallbuf_hdr;
   size_t num_syscallbuf_bytes;
+  /* How many bytes of committed syscallbuf records have been checked for
+   * buffered mprotects and munmaps. */
+  uint32_t syscallbuf_mm_checked_bytes;
   /* Points at the tracee's mapping of the buffer. */
   remote_ptr<struct syscallbuf_hdr> syscallbuf_child;
   remote_ptr<char> syscallbuf_fds_disabled_child;
+  /* Points at the flag that stops the tracee buffering mprotect and
+   * munmap once another task shares its address space. */
+  remote_ptr<unsigned char> mm_buffering_disabled_child;
   remote_code_ptr stopping_breakpoint_table;
   int stopping_breakpoint_table_entry_size;
 
@@ -720,7 +778,9 @@ public:
     remote_ptr<struct syscallbuf_hdr> syscallbuf_child;
     std::vector<uint8_t> syscallbuf_hdr;
     size_t num_syscallbuf_bytes;
+    uint32_t syscallbuf_mm_checked_bytes;
     remote_ptr<char> syscallbuf_fds_disabled_child;
+    remote_ptr<unsigned char> mm_buffering_disabled_child;
     remote_ptr<void> scratch_ptr;
     ssize_t scratch_size;
     remote_ptr<void> top_of_stack;
@@ -751,6 +811,12 @@ protected:
   template <typename Arch>
   void on_syscall_exit_arch(int syscallno, const Registers& regs);
 
+  /**
+   * During recording the scheduler may already have reaped our next wait
+   * status. If so, return it in |status| and return true.
+   */
+  bool take_collected_status(int* status);
+
   /** Helper function for init_buffers. */
   template <typename Arch> void init_buffers_arch(remote_ptr<void> map_hint);
 
@@ -773,6 +839,16 @@ protected:
    */
   void copy_state(const CapturedState& state);
 
+  /**
+   * Set up the syscallbuf of this newly-cloned task to match |state|.
+   * |remote| can be for any task sharing this task's address space and fd
+   * table, so one task can set up the syscallbufs of all the threads of a
+   * process clone without switching tasks for each of them. If this isn't
+   * called, |copy_state()| does it.
+   */
+  void copy_syscallbuf_state(const CapturedState& state,
+                             AutoRemoteSyscalls& remote);
+
   /**
    * Destroy tracer-side state of this (as opposed to remote,
    * tracee-side state).
@@ -885,8 +961,15 @@ protected:
   // Count of all ticks seen by this task since tracees became
   // consistent and the task last wait()ed.
   Ticks ticks;
-  // When |is_stopped|, these are our child registers.
+  // When |is_stopped| and |registers_known|, these are our child registers.
+  // After a stop they're only fetched when regs() is first called.
   Registers registers;
+  bool registers_known;
+  // True when |registers| has been changed by set_regs() but not yet
+  // written to the kernel.
+  bool registers_dirty;
+  // did_waitpid() fixups to apply when |registers| are fetched.
+  bool fixup_syscall_registers_on_fetch;
   // True when there was a breakpoint set at the location where we resumed
   // execution
   remote_code_ptr address_of_last_execution_resume;
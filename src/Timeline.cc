@@ -0,0 +1,136 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "Timeline.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+using namespace std;
+
+namespace rr {
+
+bool Timeline::enabled_ = false;
+
+// Written with write() rather than stdio, so rr's forked children can't
+// flush duplicate buffered events when they exit.
+static int timeline_fd = -1;
+static pid_t timeline_owner;
+static pthread_mutex_t timeline_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool wrote_event;
+
+// Chrome traces group tracks into processes; these are the two we use.
+static const int TRACEES_PID = 1;
+static const int RR_PID = 2;
+
+static string json_escape(const string& s) {
+  string result;
+  for (char ch : s) {
+    if (ch == '"' || ch == '\\') {
+      result += '\\';
+      result += ch;
+    } else if ((unsigned char)ch < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", ch);
+      result += buf;
+    } else {
+      result += ch;
+    }
+  }
+  return result;
+}
+
+static string event_prefix(Timeline::Track track, pid_t id,
+                           const char* category, const string& name,
+                           const char* phase) {
+  char buf[128];
+  snprintf(buf, sizeof(buf), "\"ph\":\"%s\",\"pid\":%d,\"tid\":%d", phase,
+           track == Timeline::TRACEE ? TRACEES_PID : RR_PID, id);
+  return string("{\"name\":\"") + json_escape(name) + "\",\"cat\":\"" +
+         category + "\"," + buf;
+}
+
+static void write_string(const string& s) {
+  if (write(timeline_fd, s.data(), s.size()) != (ssize_t)s.size()) {
+    LOG(warn) << "Can't write timeline";
+  }
+}
+
+void Timeline::open(const string& path) {
+  timeline_fd =
+      ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (timeline_fd < 0) {
+    FATAL() << "Can't open timeline file " << path;
+  }
+  timeline_owner = getpid();
+  write_string("[\n");
+  enabled_ = true;
+  atexit(close);
+
+  char buf[256];
+  snprintf(buf, sizeof(buf), "{\"name\":\"process_name\",\"ph\":\"M\","
+                             "\"pid\":%d,\"args\":{\"name\":\"tracees\"}}",
+           TRACEES_PID);
+  write_event(buf);
+  snprintf(buf, sizeof(buf), "{\"name\":\"process_name\",\"ph\":\"M\","
+                             "\"pid\":%d,\"args\":{\"name\":\"rr %d\"}}",
+           RR_PID, getpid());
+  write_event(buf);
+}
+
+double Timeline::now_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+}
+
+pid_t Timeline::current_thread() { return syscall(SYS_gettid); }
+
+void Timeline::complete(Track track, pid_t id, const char* category,
+                        const string& name, double start_us) {
+  if (!enabled_) {
+    return;
+  }
+  char buf[128];
+  snprintf(buf, sizeof(buf), ",\"ts\":%.3f,\"dur\":%.3f}", start_us,
+           now_us() - start_us);
+  write_event(event_prefix(track, id, category, name, "X") + buf);
+}
+
+void Timeline::instant(Track track, pid_t id, const char* category,
+                       const string& name) {
+  if (!enabled_) {
+    return;
+  }
+  char buf[128];
+  snprintf(buf, sizeof(buf), ",\"ts\":%.3f,\"s\":\"t\"}", now_us());
+  write_event(event_prefix(track, id, category, name, "i") + buf);
+}
+
+void Timeline::write_event(const string& json) {
+  pthread_mutex_lock(&timeline_mutex);
+  if (timeline_fd >= 0 && getpid() == timeline_owner) {
+    write_string(wrote_event ? ",\n" + json : json);
+    wrote_event = true;
+  }
+  pthread_mutex_unlock(&timeline_mutex);
+}
+
+void Timeline::close() {
+  pthread_mutex_lock(&timeline_mutex);
+  enabled_ = false;
+  if (timeline_fd >= 0 && getpid() == timeline_owner) {
+    write_string("\n]\n");
+    ::close(timeline_fd);
+    timeline_fd = -1;
+  }
+  pthread_mutex_unlock(&timeline_mutex);
+}
+
+} // namespace rr
@@ -0,0 +1,89 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_TIMELINE_H_
+#define RR_TIMELINE_H_
+
+#include <sys/types.h>
+
+#include <string>
+
+namespace rr {
+
+/**
+ * Records what rr itself is doing as a Chrome trace, the JSON format
+ * loaded by chrome://tracing and Perfetto. Work done on behalf of a tracee
+ * (waits, syscall handling, scheduling) goes on a track for that tracee;
+ * work on rr's own threads (e.g. compression) goes on a track for the
+ * thread. Enabled with the global --timeline option.
+ *
+ * All methods are thread-safe and do nothing when the timeline is off.
+ */
+class Timeline {
+public:
+  /**
+   * Start writing the timeline to |path|. It's completed when rr exits.
+   */
+  static void open(const std::string& path);
+  static bool enabled() { return enabled_; }
+
+  enum Track {
+    // |id| is a tracee's tid
+    TRACEE,
+    // |id| is one of rr's thread ids
+    RR_THREAD
+  };
+
+  /**
+   * Record that |name| took from |start_us| (from now_us()) until now.
+   */
+  static void complete(Track track, pid_t id, const char* category,
+                       const std::string& name, double start_us);
+  /**
+   * Record that |name| happened just now.
+   */
+  static void instant(Track track, pid_t id, const char* category,
+                      const std::string& name);
+
+  static double now_us();
+  /**
+   * The id of the calling rr thread, for RR_THREAD tracks.
+   */
+  static pid_t current_thread();
+
+private:
+  static void write_event(const std::string& json);
+  static void close();
+
+  static bool enabled_;
+};
+
+/**
+ * Records the time between its construction and destruction as an event
+ * on a timeline track. Costs one branch when the timeline is off.
+ */
+class TimelineScope {
+public:
+  TimelineScope(Timeline::Track track, pid_t id, const char* category,
+                const char* name)
+      : track(track), id(id), category(category), name(name) {
+    if (Timeline::enabled()) {
+      start_us = Timeline::now_us();
+    }
+  }
+  ~TimelineScope() {
+    if (Timeline::enabled()) {
+      Timeline::complete(track, id, category, name, start_us);
+    }
+  }
+
+private:
+  Timeline::Track track;
+  pid_t id;
+  const char* category;
+  const char* name;
+  double start_us;
+};
+
+} // namespace rr
+
+#endif /* RR_TIMELINE_H_ */
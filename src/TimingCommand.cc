@@ -0,0 +1,249 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "Command.h"
+#include "kernel_metadata.h"
+#include "main.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+namespace rr {
+
+class TimingCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  TimingCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static TimingCommand singleton;
+};
+
+TimingCommand TimingCommand::singleton(
+    "timing",
+    " rr timing [OPTION]... [<trace_dir>]\n"
+    "  Report where each task's time went during recording, from the ticks\n"
+    "  and timestamps stored with each event, without replaying: time\n"
+    "  blocked in traced syscalls versus time running between events, the\n"
+    "  longest syscalls and the heaviest compute intervals. Buffered\n"
+    "  syscalls don't have events of their own, so their time counts as\n"
+    "  running time.\n"
+    "  -n, --top=<N>              list the <N> longest syscalls and compute\n"
+    "                             intervals (default 10)\n");
+
+struct TimingFlags {
+  int top;
+
+  TimingFlags() : top(10) {}
+};
+
+static bool parse_timing_arg(vector<string>& args, TimingFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'n', "top", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'n':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.top = opt.int_value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+struct TaskTiming {
+  TaskTiming()
+      : events(0),
+        syscalls(0),
+        ticks(0),
+        syscall_seconds(0),
+        run_seconds(0),
+        last_ticks(0),
+        in_syscall(false) {}
+  uint64_t events;
+  uint64_t syscalls;
+  Ticks ticks;
+  // Wall time between entering and leaving traced syscalls.
+  double syscall_seconds;
+  // Wall time between the previous event of any task and each of this
+  // task's events that isn't a syscall exit. rr runs one task at a time, so
+  // that's when this task was running.
+  double run_seconds;
+
+  Ticks last_ticks;
+  bool in_syscall;
+  TraceFrame::Time syscall_entry_time;
+  double syscall_entry_seconds;
+  int syscall_number;
+  SupportedArch syscall_arch;
+};
+
+struct Syscall {
+  pid_t tid;
+  TraceFrame::Time entry_time;
+  string name;
+  double seconds;
+};
+
+struct ComputeInterval {
+  pid_t tid;
+  TraceFrame::Time end_time;
+  string end_event;
+  Ticks ticks;
+  double seconds;
+};
+
+/**
+ * Keep the |top| largest elements of |v| by |key|, largest first.
+ */
+template <typename T, typename K>
+static void keep_top(vector<T>& v, size_t top, K key) {
+  size_t n = min(top, v.size());
+  partial_sort(v.begin(), v.begin() + n, v.end(),
+               [&](const T& a, const T& b) { return key(a) > key(b); });
+  v.resize(n);
+}
+
+static string event_name(const TraceFrame& frame) {
+  const Event& ev = frame.event();
+  if (ev.is_syscall_event()) {
+    return syscall_name(ev.Syscall().number, ev.arch());
+  }
+  return ev.type_name();
+}
+
+static int timing(const string& trace_dir, const TimingFlags& flags,
+                  FILE* out) {
+  TraceReader trace(trace_dir);
+  map<pid_t, TaskTiming> tasks;
+  vector<Syscall> syscalls;
+  vector<ComputeInterval> intervals;
+  double first_seconds = 0;
+  double last_seconds = 0;
+  bool first = true;
+
+  while (!trace.at_end()) {
+    TraceFrame frame = trace.read_frame();
+    double now = frame.monotonic_time();
+    if (first) {
+      first_seconds = last_seconds = now;
+      first = false;
+    }
+    double slice = max(0.0, now - last_seconds);
+    last_seconds = now;
+
+    TaskTiming& task = tasks[frame.tid()];
+    ++task.events;
+    if (frame.ticks() > task.last_ticks) {
+      Ticks ticks = frame.ticks() - task.last_ticks;
+      task.ticks += ticks;
+      ComputeInterval interval = { frame.tid(), frame.time(),
+                                   event_name(frame), ticks, slice };
+      intervals.push_back(interval);
+    }
+    task.last_ticks = frame.ticks();
+
+    const Event& ev = frame.event();
+    bool is_exit = ev.is_syscall_event() &&
+                   ev.Syscall().state == EXITING_SYSCALL && task.in_syscall &&
+                   ev.Syscall().number == task.syscall_number;
+    if (is_exit) {
+      double seconds = max(0.0, now - task.syscall_entry_seconds);
+      task.syscall_seconds += seconds;
+      Syscall s = { frame.tid(), task.syscall_entry_time,
+                    syscall_name(task.syscall_number, task.syscall_arch),
+                    seconds };
+      syscalls.push_back(s);
+      task.in_syscall = false;
+    } else {
+      task.run_seconds += slice;
+    }
+    if (ev.is_syscall_event() && ev.Syscall().state == ENTERING_SYSCALL) {
+      ++task.syscalls;
+      task.in_syscall = true;
+      task.syscall_entry_time = frame.time();
+      task.syscall_entry_seconds = now;
+      task.syscall_number = ev.Syscall().number;
+      task.syscall_arch = ev.arch();
+    }
+
+    // Trim occasionally so huge traces don't keep every interval.
+    size_t limit = max<size_t>(10000, 4 * (size_t)flags.top);
+    if (syscalls.size() > limit) {
+      keep_top(syscalls, flags.top,
+               [](const Syscall& s) { return s.seconds; });
+    }
+    if (intervals.size() > limit) {
+      keep_top(intervals, flags.top,
+               [](const ComputeInterval& i) { return i.ticks; });
+    }
+  }
+  keep_top(syscalls, flags.top, [](const Syscall& s) { return s.seconds; });
+  keep_top(intervals, flags.top,
+           [](const ComputeInterval& i) { return i.ticks; });
+
+  fprintf(out, "Recording took %.3fs over %" PRIu64 " events\n\n",
+          last_seconds - first_seconds, (uint64_t)trace.time());
+  fprintf(out, "%-8s %10s %10s %14s %12s %12s\n", "TID", "EVENTS", "SYSCALLS",
+          "TICKS", "SYSCALL-S", "RUNNING-S");
+  for (auto& t : tasks) {
+    fprintf(out, "%-8d %10" PRIu64 " %10" PRIu64 " %14" PRIu64
+                 " %12.6f %12.6f\n",
+            t.first, t.second.events, t.second.syscalls,
+            (uint64_t)t.second.ticks, t.second.syscall_seconds,
+            t.second.run_seconds);
+  }
+
+  fprintf(out, "\nLongest syscalls:\n");
+  fprintf(out, "%-8s %10s %-24s %12s\n", "TID", "EVENT", "SYSCALL",
+          "SECONDS");
+  for (auto& s : syscalls) {
+    fprintf(out, "%-8d %10" PRIu64 " %-24s %12.6f\n", s.tid,
+            (uint64_t)s.entry_time, s.name.c_str(), s.seconds);
+  }
+
+  fprintf(out, "\nHeaviest compute intervals (ending at EVENT):\n");
+  fprintf(out, "%-8s %10s %-24s %14s %12s\n", "TID", "EVENT", "ENDED-BY",
+          "TICKS", "SECONDS");
+  for (auto& i : intervals) {
+    fprintf(out, "%-8d %10" PRIu64 " %-24s %14" PRIu64 " %12.6f\n", i.tid,
+            (uint64_t)i.end_time, i.end_event.c_str(), (uint64_t)i.ticks,
+            i.seconds);
+  }
+  return 0;
+}
+
+int TimingCommand::run(std::vector<std::string>& args) {
+  TimingFlags flags;
+
+  while (parse_timing_arg(args, flags)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return timing(trace_dir, flags, stdout);
+}
+
+} // namespace rr
@@ -0,0 +1,191 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "TraceSink.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "log.h"
+
+using namespace std;
+
+namespace rr {
+
+/*static*/ shared_ptr<TraceSink> TraceSink::open(const string& destination,
+                                                 bool keep_local_files) {
+  if (destination.find("fd:") == 0) {
+    char* end;
+    const char* num = destination.c_str() + 3;
+    long fd = strtol(num, &end, 10);
+    if (!*num || *end || fd < 0 || fcntl(fd, F_GETFD) < 0) {
+      fprintf(stderr, "Invalid stream file descriptor `%s'\n", num);
+      return nullptr;
+    }
+    // Tracees must not inherit the stream.
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return shared_ptr<TraceSink>(
+        new TraceSink(ScopedFd((int)fd), -1, keep_local_files));
+  }
+
+  if (destination.find("unix:") == 0) {
+    string path = destination.substr(5);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path `%s' is too long\n", path.c_str());
+      return nullptr;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    ScopedFd fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+    if (!fd.is_open() ||
+        connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      fprintf(stderr, "Can't connect to `%s': %s\n", path.c_str(),
+              strerror(errno));
+      return nullptr;
+    }
+    return shared_ptr<TraceSink>(
+        new TraceSink(move(fd), -1, keep_local_files));
+  }
+
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) < 0) {
+    fprintf(stderr, "Can't create stream pipe: %s\n", strerror(errno));
+    return nullptr;
+  }
+  pid_t child = fork();
+  if (child < 0) {
+    fprintf(stderr, "Can't fork stream command: %s\n", strerror(errno));
+    ::close(fds[0]);
+    ::close(fds[1]);
+    return nullptr;
+  }
+  if (child == 0) {
+    dup2(fds[0], STDIN_FILENO);
+    execl("/bin/sh", "sh", "-c", destination.c_str(), nullptr);
+    _exit(127);
+  }
+  ::close(fds[0]);
+  return shared_ptr<TraceSink>(
+      new TraceSink(ScopedFd(fds[1]), child, keep_local_files));
+}
+
+TraceSink::TraceSink(ScopedFd&& fd, pid_t child, bool keep_local_files)
+    : fd(move(fd)),
+      child(child),
+      keep_local_files_(keep_local_files),
+      error(false) {
+  pthread_mutex_init(&mutex, nullptr);
+}
+
+TraceSink::~TraceSink() {
+  finish();
+  pthread_mutex_destroy(&mutex);
+}
+
+void TraceSink::begin(const string& trace_name) {
+  write_record(TRACE_BEGIN, trace_name, STREAM_VERSION, nullptr, 0);
+}
+
+bool TraceSink::write_data(const string& file, uint64_t offset,
+                           const void* data, size_t size) {
+  return write_record(FILE_DATA, file, offset, data, size);
+}
+
+bool TraceSink::write_file(const string& file, const string& path) {
+  ScopedFd in(path.c_str(), O_RDONLY);
+  if (!in.is_open()) {
+    return false;
+  }
+  char buf[65536];
+  uint64_t offset = 0;
+  while (true) {
+    ssize_t len = read(in, buf, sizeof(buf));
+    if (len < 0) {
+      return false;
+    }
+    if (len == 0) {
+      return true;
+    }
+    if (!write_data(file, offset, buf, len)) {
+      return false;
+    }
+    offset += len;
+  }
+}
+
+static bool write_all(int fd, const void* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = write(fd, data, size);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      return false;
+    }
+    data = static_cast<const char*>(data) + ret;
+    size -= ret;
+  }
+  return true;
+}
+
+bool TraceSink::write_record(RecordType type, const string& name,
+                             uint64_t offset, const void* data, size_t size) {
+  RecordHeader header = { type, (uint32_t)name.size(), offset, size };
+
+  pthread_mutex_lock(&mutex);
+  if (!error) {
+    // If the reader goes away we want EPIPE, not to be killed by SIGPIPE.
+    sigset_t pipe_set;
+    sigset_t old_set;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+    error = !write_all(fd, &header, sizeof(header)) ||
+            !write_all(fd, name.c_str(), name.size()) ||
+            !write_all(fd, data, size);
+    if (error) {
+      int err = errno;
+      if (err == EPIPE) {
+        struct timespec no_wait = { 0, 0 };
+        sigtimedwait(&pipe_set, nullptr, &no_wait);
+      }
+      LOG(error) << "Failed to stream trace data: " << strerror(err);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+  }
+  bool ok = !error;
+  pthread_mutex_unlock(&mutex);
+  return ok;
+}
+
+bool TraceSink::finish() {
+  if (!fd.is_open()) {
+    return good();
+  }
+  write_record(TRACE_END, string(), 0, nullptr, 0);
+  fd.close();
+  if (child > 0) {
+    int status;
+    int ret;
+    do {
+      ret = waitpid(child, &status, 0);
+    } while (ret < 0 && errno == EINTR);
+    // The recording scheduler's waitpid(-1) may have reaped the command
+    // already, in which case we can't tell how it exited.
+    if (ret == child && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+      LOG(error) << "Stream command failed with status " << HEX(status);
+      error = true;
+    }
+    child = -1;
+  }
+  return good();
+}
+
+} // namespace rr
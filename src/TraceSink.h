@@ -0,0 +1,96 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_TRACE_SINK_H_
+#define RR_TRACE_SINK_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+
+#include "ScopedFd.h"
+
+namespace rr {
+
+/**
+ * A TraceSink streams a trace to another process while it is being
+ * recorded, so copying a trace off the machine overlaps with recording.
+ * CompressedWriter hands every block to the sink as soon as it has been
+ * compressed; the small files that are only complete at the end of
+ * recording follow when the trace is closed. "rr receive" turns the stream
+ * back into a trace directory.
+ *
+ * The stream is a sequence of records, each a RecordHeader followed by
+ * 'name_length' bytes of file name (relative to the trace directory) and
+ * 'length' bytes of data:
+ *   TRACE_BEGIN: 'name' is the trace directory's name, 'offset' is
+ *                STREAM_VERSION, there is no data.
+ *   FILE_DATA:   'data' belongs at 'offset' in file 'name'. Records for a
+ *                file may arrive out of order.
+ *   TRACE_END:   the trace is complete.
+ */
+class TraceSink {
+public:
+  enum RecordType { TRACE_BEGIN = 0, FILE_DATA = 1, TRACE_END = 2 };
+
+  struct RecordHeader {
+    uint32_t type;
+    uint32_t name_length;
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  static const uint64_t STREAM_VERSION = 1;
+
+  /**
+   * Open |destination|, which is "fd:<N>" for an inherited pipe or socket,
+   * "unix:<PATH>" for a Unix domain socket to connect to, or otherwise a
+   * shell command that reads the stream from its stdin. When
+   * |keep_local_files| is false the trace is only streamed and nothing is
+   * left in the local trace directory. Returns null after printing an
+   * error if the destination can't be opened.
+   */
+  static std::shared_ptr<TraceSink> open(const std::string& destination,
+                                         bool keep_local_files);
+  ~TraceSink();
+
+  bool keep_local_files() const { return keep_local_files_; }
+  bool good() const { return !error; }
+
+  void begin(const std::string& trace_name);
+  /**
+   * Send |size| bytes that belong at |offset| in |file|. May be called from
+   * any thread. Returns false if the data could not be sent.
+   */
+  bool write_data(const std::string& file, uint64_t offset, const void* data,
+                  size_t size);
+  /**
+   * Send the whole local file |path| as |file|.
+   */
+  bool write_file(const std::string& file, const std::string& path);
+  /**
+   * Finish the stream and, for a command, wait for it to exit. Returns
+   * false if anything could not be delivered.
+   */
+  bool finish();
+
+private:
+  TraceSink(ScopedFd&& fd, pid_t child, bool keep_local_files);
+
+  bool write_record(RecordType type, const std::string& name, uint64_t offset,
+                    const void* data, size_t size);
+
+  ScopedFd fd;
+  // The command reading the stream, or -1
+  pid_t child;
+  bool keep_local_files_;
+  // Protects 'fd' and 'error'
+  pthread_mutex_t mutex;
+  bool error;
+};
+
+} // namespace rr
+
+#endif /* RR_TRACE_SINK_H_ */
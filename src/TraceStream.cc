@@ -2,15 +2,25 @@
 
 #include "TraceStream.h"
 
+#include <dirent.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <sched.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <fstream>
 #include <string>
 #include <sstream>
 
 #include "AddressSpace.h"
+#include "Flags.h"
+#include "kernel_supplement.h"
 #include "log.h"
 #include "util.h"
 
@@ -27,26 +37,93 @@ namespace rr {
 // MUST increment this version number.  Otherwise users' old traces
 // will become unreplayable and they won't know why.
 //
-#define TRACE_VERSION 41
+#define TRACE_VERSION 55
 
 struct SubstreamData {
   const char* name;
   size_t block_size;
   int threads;
+  // Whether replay reads enough of this substream to benefit from
+  // decompressing it ahead on worker threads.
+  bool read_ahead;
+  // Whether the substream is made of small, repetitive metadata records
+  // that compress better with a trained dictionary.
+  bool train_dictionary;
 };
 
 static const SubstreamData substreams[TraceStream::SUBSTREAM_COUNT] = {
-  { "events", 1024 * 1024, 1 },
-  { "data_header", 1024 * 1024, 1 },
-  { "data", 8 * 1024 * 1024, 3 },
-  { "mmaps", 64 * 1024, 1 },
-  { "tasks", 64 * 1024, 1 }
+  { "events", 1024 * 1024, 1, true, true },
+  { "data_header", 1024 * 1024, 1, false, true },
+  { "data", 8 * 1024 * 1024, 3, true, false },
+  { "mmaps", 64 * 1024, 1, false, true },
+  { "tasks", 64 * 1024, 1, false, true },
+  { "strings", 64 * 1024, 1, false, false }
 };
 
 static const SubstreamData& substream(TraceStream::Substream s) {
   return substreams[s];
 }
 
+/**
+ * How to compress |s| according to |compression|: its block size, number
+ * of compression threads (|threads| unless overridden; 0 means |s|'s
+ * default) and CompressedWriter options, except for the memory budget.
+ */
+struct SubstreamPolicy {
+  size_t block_size;
+  uint32_t threads;
+  CompressionOptions options;
+};
+static SubstreamPolicy substream_policy(TraceStream::Substream s,
+                                        const CompressionOptions& compression,
+                                        uint32_t threads = 0) {
+  SubstreamPolicy policy;
+  policy.block_size = substream(s).block_size;
+  policy.threads = threads ? threads : substream(s).threads;
+  policy.options.codec = compression.codec;
+  policy.options.level = compression.level;
+  policy.options.spill_uncompressed = compression.spill_uncompressed;
+  policy.options.train_dictionary = substream(s).train_dictionary;
+  auto it = compression.substreams.find(substream(s).name);
+  if (it != compression.substreams.end()) {
+    const SubstreamCompression& o = it->second;
+    if (o.block_size) {
+      policy.block_size = o.block_size;
+    }
+    if (o.threads) {
+      policy.threads = o.threads;
+    }
+    if (o.set_codec) {
+      policy.options.codec = o.codec;
+      policy.options.level = o.level;
+    }
+  }
+  return policy;
+}
+
+/**
+ * What CompressedWriter buffers for |policy| without a memory budget.
+ */
+static size_t default_buffer_size(const SubstreamPolicy& policy) {
+  return policy.block_size * (policy.threads + 2);
+}
+
+/*static*/ const char* TraceStream::substream_name(Substream s) {
+  return substream(s).name;
+}
+
+/*static*/ bool TraceStream::parse_substream_name(const string& name,
+                                                  Substream* s) {
+  for (Substream i = SUBSTREAM_FIRST; i < SUBSTREAM_COUNT;
+       i = (Substream)(i + 1)) {
+    if (name == substream(i).name) {
+      *s = i;
+      return true;
+    }
+  }
+  return false;
+}
+
 static TraceStream::Substream operator++(TraceStream::Substream& s) {
   s = (TraceStream::Substream)(s + 1);
   return s;
@@ -97,6 +174,8 @@ static string trace_save_dir() {
   return output_dir ? output_dir : default_rr_trace_dir();
 }
 
+string TraceStream::save_dir() { return trace_save_dir(); }
+
 static string latest_trace_symlink() {
   return trace_save_dir() + "/latest-trace";
 }
@@ -165,82 +244,272 @@ bool TraceReader::good() const {
   return true;
 }
 
-struct BasicInfo {
-  TraceFrame::Time global_time;
-  pid_t tid_;
-  EncodedEvent ev;
-  Ticks ticks_;
-  double monotonic_sec;
+/**
+ * Each EVENTS record starts with the frame's tid, encoded event, monotonic
+ * time and a byte of these flags, followed by the zigzag-encoded varint
+ * ticks. Global time isn't stored; it increases by one per frame.
+ */
+enum PackedFrameFlags {
+  // Ticks are relative to the task's previous frame.
+  TICKS_DELTA = 0x1,
+  // Registers are the same as in the task's previous exec-info frame and
+  // are omitted.
+  REGS_UNCHANGED = 0x2,
+  // Likewise for extra registers.
+  EXTRA_REGS_UNCHANGED = 0x4,
+  // Extra registers are stored as the chunks that differ from the task's
+  // previous exec-info frame; see append_extra_regs_delta.
+  EXTRA_REGS_DELTA = 0x8
 };
 
+// XSAVE areas are several KB on AVX-512 machines, but usually only a few
+// vector registers change between events. 16 bytes is one XMM register or
+// one half/quarter of a YMM/ZMM register.
+static const int extra_regs_chunk_size = 16;
+
+template <typename T> static void append(vector<uint8_t>& buf, const T& value) {
+  auto bytes = reinterpret_cast<const uint8_t*>(&value);
+  buf.insert(buf.end(), bytes, bytes + sizeof(value));
+}
+
+static void append_varint(vector<uint8_t>& buf, int64_t value) {
+  uint64_t v = (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+  while (v >= 0x80) {
+    buf.push_back(uint8_t(v) | 0x80);
+    v >>= 7;
+  }
+  buf.push_back(uint8_t(v));
+}
+
+static int64_t read_varint(CompressedReader& in) {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t byte = 0;
+    in >> byte;
+    v |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  return int64_t(v >> 1) ^ -int64_t(v & 1);
+}
+
+static bool same_extra_regs(const ExtraRegisters& a, const ExtraRegisters& b) {
+  return a.format() == b.format() && a.data_size() == b.data_size() &&
+         !memcmp(a.data_bytes(), b.data_bytes(), a.data_size());
+}
+
+/**
+ * Append the chunks of |regs| that differ from |prev| to |buf|: a varint
+ * count, then for each chunk a varint gap from the end of the previous
+ * chunk (in chunks) and the chunk's bytes. Returns false, appending nothing,
+ * if the delta wouldn't be smaller than storing |regs| in full.
+ */
+static bool append_extra_regs_delta(vector<uint8_t>& buf,
+                                    const ExtraRegisters& prev,
+                                    const ExtraRegisters& regs) {
+  if (prev.format() != regs.format() || prev.data_size() != regs.data_size()) {
+    return false;
+  }
+  int size = regs.data_size();
+  vector<int> changed;
+  for (int offset = 0; offset < size; offset += extra_regs_chunk_size) {
+    int len = min(extra_regs_chunk_size, size - offset);
+    if (memcmp(prev.data_bytes() + offset, regs.data_bytes() + offset, len)) {
+      changed.push_back(offset / extra_regs_chunk_size);
+    }
+  }
+  if (changed.size() * (extra_regs_chunk_size + 1) + 2 >= size_t(size)) {
+    return false;
+  }
+  append_varint(buf, changed.size());
+  int next = 0;
+  for (int chunk : changed) {
+    int offset = chunk * extra_regs_chunk_size;
+    int len = min(extra_regs_chunk_size, size - offset);
+    append_varint(buf, chunk - next);
+    buf.insert(buf.end(), regs.data_bytes() + offset,
+               regs.data_bytes() + offset + len);
+    next = chunk + 1;
+  }
+  return true;
+}
+
 void TraceWriter::write_frame(const TraceFrame& frame) {
   auto& events = writer(EVENTS);
+  assert(frame.time() == global_time);
 
-  BasicInfo basic_info = { frame.time(), frame.tid(), frame.event().encode(),
-                           frame.ticks(), frame.monotonic_time() };
-  events << basic_info;
-  if (!events.good()) {
-    FATAL() << "Tried to save " << sizeof(basic_info)
-            << " bytes to the trace, but failed";
+  uint8_t flags = 0;
+  auto it = frame_states.find(frame.tid());
+  if (it == frame_states.end()) {
+    it = frame_states.insert(make_pair(frame.tid(), TaskFrameState())).first;
+  } else {
+    flags |= TICKS_DELTA;
   }
+  TaskFrameState& state = it->second;
+  Ticks ticks_delta = frame.ticks() - state.ticks;
+  state.ticks = frame.ticks();
   // TODO: only store exec info for non-async-sig events when
   // debugging assertions are enabled.
-  if (frame.event().has_exec_info() == HAS_EXEC_INFO) {
-    events << frame.regs() << frame.extra_perf_values();
-    if (!events.good()) {
-      FATAL() << "Tried to save registers to the trace, but failed";
-    }
-
-    int extra_reg_bytes = frame.extra_regs().data_size();
-    char extra_reg_format = (char)frame.extra_regs().format();
-    events << extra_reg_format << extra_reg_bytes;
-    if (!events.good()) {
-      FATAL() << "Tried to save "
-              << sizeof(extra_reg_bytes) + sizeof(extra_reg_format)
-              << " bytes to the trace, but failed";
-    }
-    if (extra_reg_bytes > 0) {
-      events.write((const char*)frame.extra_regs().data_bytes(),
-                   extra_reg_bytes);
-      if (!events.good()) {
-        FATAL() << "Tried to save " << extra_reg_bytes
-                << " bytes to the trace, but failed";
+  bool has_exec_info = frame.event().has_exec_info() == HAS_EXEC_INFO;
+  if (has_exec_info) {
+    if (state.have_regs &&
+        !memcmp(&state.regs, &frame.regs(), sizeof(Registers))) {
+      flags |= REGS_UNCHANGED;
+    } else {
+      state.regs = frame.regs();
+    }
+    extra_regs_delta.clear();
+    if (state.have_regs &&
+        same_extra_regs(state.extra_regs, frame.extra_regs())) {
+      flags |= EXTRA_REGS_UNCHANGED;
+    } else {
+      if (state.have_regs &&
+          append_extra_regs_delta(extra_regs_delta, state.extra_regs,
+                                  frame.extra_regs())) {
+        flags |= EXTRA_REGS_DELTA;
       }
+      state.extra_regs = frame.extra_regs();
+    }
+    state.have_regs = true;
+  }
+
+  // Assemble the whole record and hand it to the writer in one go.
+  frame_buffer.clear();
+  append(frame_buffer, frame.tid());
+  append(frame_buffer, frame.event().encode());
+  append(frame_buffer, frame.monotonic_time());
+  append(frame_buffer, flags);
+  append_varint(frame_buffer, ticks_delta);
+  if (has_exec_info) {
+    if (!(flags & REGS_UNCHANGED)) {
+      append(frame_buffer, frame.regs());
+    }
+    append(frame_buffer, frame.extra_perf_values());
+    if (flags & EXTRA_REGS_DELTA) {
+      frame_buffer.insert(frame_buffer.end(), extra_regs_delta.begin(),
+                          extra_regs_delta.end());
+    } else if (!(flags & EXTRA_REGS_UNCHANGED)) {
+      int extra_reg_bytes = frame.extra_regs().data_size();
+      char extra_reg_format = (char)frame.extra_regs().format();
+      append(frame_buffer, extra_reg_format);
+      append(frame_buffer, extra_reg_bytes);
+      frame_buffer.insert(frame_buffer.end(), frame.extra_regs().data_bytes(),
+                          frame.extra_regs().data_bytes() + extra_reg_bytes);
     }
   }
   if (frame.event().is_signal_event()) {
-    events << frame.event().Signal().signal_data();
+    append(frame_buffer, frame.event().Signal().signal_data());
+  }
+  events.write(frame_buffer.data(), frame_buffer.size());
+  if (!events.good()) {
+    FATAL() << "Tried to save " << frame_buffer.size()
+            << " bytes to the trace, but failed";
   }
 
   tick_time();
+
+  if (events.bytes_written() >= next_frame_index_offset) {
+    // Remember where the next frame and its data start in every substream.
+    FramePosition pos;
+    pos.time = global_time;
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      pos.offsets[s] = writer(s).bytes_written();
+    }
+    frame_index.push_back(pos);
+    next_frame_index_offset =
+        events.bytes_written() + substream(EVENTS).block_size;
+    // The next frame must be decodable without the frames before it.
+    frame_states.clear();
+  }
 }
 
 TraceFrame TraceReader::read_frame() {
-  // Read the common event info first, to see if we also have
-  // exec info to read.
+  TraceFrame frame;
+  read_frame(frame, UPDATE_FRAME_STATES);
+  return frame;
+}
+
+void TraceReader::read_frame(TraceFrame& frame) {
+  read_frame(frame, UPDATE_FRAME_STATES);
+}
+
+void TraceReader::read_frame(TraceFrame& frame, FrameStatesUpdate update) {
   auto& events = reader(EVENTS);
-  BasicInfo basic_info;
-  events >> basic_info;
-  TraceFrame frame(basic_info.global_time, basic_info.tid_,
-                   Event(basic_info.ev), basic_info.ticks_,
-                   basic_info.monotonic_sec);
+  pid_t tid;
+  EncodedEvent ev;
+  double monotonic_sec;
+  uint8_t flags;
+  events >> tid >> ev >> monotonic_sec >> flags;
+  Ticks ticks = read_varint(events);
+
+  const TaskFrameState* prev = nullptr;
+  if (flags & (TICKS_DELTA | REGS_UNCHANGED | EXTRA_REGS_UNCHANGED)) {
+    auto it = frame_states.find(tid);
+    if (it == frame_states.end() ||
+        (!it->second.have_regs && (flags & ~TICKS_DELTA))) {
+      FATAL() << "Trace frame " << global_time + 1
+              << " refers to unknown state for task " << tid;
+    }
+    prev = &it->second;
+  }
+  if (flags & TICKS_DELTA) {
+    ticks += prev->ticks;
+  }
+
+  // Assign fields one by one rather than constructing a new frame, so
+  // |frame|'s register buffers are reused.
+  frame.global_time = global_time + 1;
+  frame.tid_ = tid;
+  frame.ev = Event(ev);
+  frame.ticks_ = ticks;
+  frame.monotonic_time_ = monotonic_sec;
   if (frame.event().has_exec_info() == HAS_EXEC_INFO) {
-    events >> frame.recorded_regs >> frame.extra_perf;
-
-    int extra_reg_bytes;
-    char extra_reg_format;
-    events >> extra_reg_format >> extra_reg_bytes;
-    if (extra_reg_bytes > 0) {
-      vector<uint8_t> data;
-      data.resize(extra_reg_bytes);
-      events.read((char*)data.data(), extra_reg_bytes);
+    if (flags & REGS_UNCHANGED) {
+      frame.recorded_regs = prev->regs;
+    } else {
+      events >> frame.recorded_regs;
+    }
+    events >> frame.extra_perf;
+
+    if (flags & EXTRA_REGS_UNCHANGED) {
+      frame.recorded_extra_regs = prev->extra_regs;
+    } else if (flags & EXTRA_REGS_DELTA) {
+      frame.recorded_extra_regs = prev->extra_regs;
       frame.recorded_extra_regs.set_arch(frame.event().arch());
-      frame.recorded_extra_regs.set_to_raw_data(
-          (ExtraRegisters::Format)extra_reg_format, data);
+      int size = prev->extra_regs.data_size();
+      uint8_t* data = frame.recorded_extra_regs.resize_raw_data(
+          prev->extra_regs.format(), size);
+      int64_t count = read_varint(events);
+      int next = 0;
+      for (int64_t i = 0; i < count; ++i) {
+        int chunk = next + read_varint(events);
+        int offset = chunk * extra_regs_chunk_size;
+        int len = min(extra_regs_chunk_size, size - offset);
+        events.read((char*)data + offset, len);
+        next = chunk + 1;
+      }
     } else {
-      assert(extra_reg_format == ExtraRegisters::NONE);
-      frame.recorded_extra_regs = ExtraRegisters(frame.event().arch());
+      int extra_reg_bytes;
+      char extra_reg_format;
+      events >> extra_reg_format >> extra_reg_bytes;
+      if (extra_reg_bytes > 0) {
+        frame.recorded_extra_regs.set_arch(frame.event().arch());
+        uint8_t* data = frame.recorded_extra_regs.resize_raw_data(
+            (ExtraRegisters::Format)extra_reg_format, extra_reg_bytes);
+        events.read((char*)data, extra_reg_bytes);
+      } else {
+        assert(extra_reg_format == ExtraRegisters::NONE);
+        frame.recorded_extra_regs.set_arch(frame.event().arch());
+        frame.recorded_extra_regs.resize_raw_data(ExtraRegisters::NONE, 0);
+      }
     }
+  } else {
+    frame.recorded_regs = Registers();
+    frame.extra_perf = PerfCounters::Extra();
+    // Keep the buffer for the next frame that has extra registers.
+    frame.recorded_extra_regs.set_arch(SupportedArch(-1));
+    frame.recorded_extra_regs.resize_raw_data(ExtraRegisters::NONE, 0);
   }
   if (frame.event().is_signal_event()) {
     uint64_t signal_data;
@@ -248,12 +517,69 @@ TraceFrame TraceReader::read_frame() {
     frame.ev.Signal().set_signal_data(signal_data);
   }
 
+  if (update == UPDATE_FRAME_STATES_UNDOABLE &&
+      !saved_frame_states.count(tid) &&
+      find(added_frame_states.begin(), added_frame_states.end(), tid) ==
+          added_frame_states.end()) {
+    auto it = frame_states.find(tid);
+    if (it == frame_states.end()) {
+      added_frame_states.push_back(tid);
+    } else {
+      saved_frame_states.insert(*it);
+    }
+  }
+  if (update != DONT_UPDATE_FRAME_STATES) {
+    TaskFrameState& state = frame_states[tid];
+    state.ticks = ticks;
+    if (frame.event().has_exec_info() == HAS_EXEC_INFO) {
+      state.regs = frame.recorded_regs;
+      state.extra_regs = frame.recorded_extra_regs;
+      state.have_regs = true;
+    }
+  }
+
   tick_time();
   assert(time() == frame.time());
-  return frame;
+}
+
+void TraceReader::undo_frame_states() {
+  for (pid_t tid : added_frame_states) {
+    frame_states.erase(tid);
+  }
+  for (auto& saved : saved_frame_states) {
+    swap(frame_states[saved.first], saved.second);
+  }
+  added_frame_states.clear();
+  saved_frame_states.clear();
+}
+
+uint32_t TraceWriter::intern(const string& s) {
+  auto it = string_ids.find(s);
+  if (it != string_ids.end()) {
+    return it->second;
+  }
+  uint32_t id = string_ids.size();
+  string_ids.insert(make_pair(s, id));
+  writer(STRINGS) << s;
+  return id;
+}
+
+const string& TraceReader::interned(uint32_t id) {
+  auto& in = reader(STRINGS);
+  while (strings.size() <= id) {
+    string s;
+    in >> s;
+    if (!in.good()) {
+      FATAL() << "Trace string table has no string " << id;
+    }
+    strings.push_back(s);
+  }
+  return strings[id];
 }
 
 void TraceWriter::write_task_event(const TraceTaskEvent& event) {
+  update_process_index(event);
+
   auto& tasks = writer(TASKS);
   tasks << event.type() << event.tid();
   switch (event.type()) {
@@ -263,9 +589,15 @@ void TraceWriter::write_task_event(const TraceTaskEvent& event) {
     case TraceTaskEvent::FORK:
       tasks << event.parent_tid();
       break;
-    case TraceTaskEvent::EXEC:
-      tasks << event.file_name() << event.cmd_line() << event.fds_to_close();
+    case TraceTaskEvent::EXEC: {
+      vector<uint32_t> cmd_line;
+      for (auto& arg : event.cmd_line()) {
+        cmd_line.push_back(intern(arg));
+      }
+      tasks << intern(event.file_name()) << cmd_line
+            << event.fds_to_close();
       break;
+    }
     case TraceTaskEvent::EXIT:
       break;
     case TraceTaskEvent::NONE:
@@ -274,6 +606,156 @@ void TraceWriter::write_task_event(const TraceTaskEvent& event) {
   }
 }
 
+void TraceWriter::update_process_index(const TraceTaskEvent& event) {
+  switch (event.type()) {
+    case TraceTaskEvent::CLONE:
+    case TraceTaskEvent::FORK:
+      if (event.is_fork()) {
+        ProcessRecord p;
+        p.pid = event.tid();
+        auto parent = tid_to_pid.find(event.parent_tid());
+        p.ppid = parent == tid_to_pid.end() ? 0 : parent->second;
+        p.first_time = global_time;
+        p.last_time = 0;
+        p.exit_code = -1;
+        live_processes[p.pid] = processes.size();
+        processes.push_back(p);
+        tid_to_pid[event.tid()] = event.tid();
+      } else {
+        tid_to_pid[event.tid()] = tid_to_pid[event.parent_tid()];
+      }
+      break;
+    case TraceTaskEvent::EXEC: {
+      auto it = tid_to_pid.find(event.tid());
+      if (it == tid_to_pid.end()) {
+        // The initial process, whose creation we didn't see.
+        ProcessRecord p;
+        p.pid = event.tid();
+        p.ppid = 0;
+        p.first_time = global_time;
+        p.last_time = 0;
+        p.exit_code = -1;
+        live_processes[p.pid] = processes.size();
+        processes.push_back(p);
+        it = tid_to_pid.insert(make_pair(event.tid(), event.tid())).first;
+      }
+      auto process = live_processes.find(it->second);
+      if (process != live_processes.end()) {
+        processes[process->second].execs.push_back(
+            { event.file_name(), event.cmd_line() });
+      }
+      break;
+    }
+    case TraceTaskEvent::EXIT: {
+      auto it = tid_to_pid.find(event.tid());
+      if (it == tid_to_pid.end()) {
+        break;
+      }
+      if (it->second == event.tid()) {
+        auto process = live_processes.find(event.tid());
+        if (process != live_processes.end()) {
+          processes[process->second].last_time = global_time;
+          processes[process->second].exit_code = event.exit_code();
+          live_processes.erase(process);
+        }
+      }
+      tid_to_pid.erase(it);
+      break;
+    }
+    case TraceTaskEvent::NONE:
+      break;
+  }
+}
+
+void TraceWriter::write_process_index() {
+  CompressedWriter index(process_index_path(), 64 * 1024, 1);
+  index << processes.size();
+  for (auto& p : processes) {
+    index << p.pid << p.ppid << p.first_time << p.last_time << p.exit_code
+          << p.execs.size();
+    for (auto& e : p.execs) {
+      index << e.file_name << e.cmd_line;
+    }
+  }
+  index.close();
+  if (!index.good()) {
+    // Readers fall back to scanning TASKS.
+    LOG(warn) << "Unable to write process index " << process_index_path();
+  }
+}
+
+void TraceWriter::write_markers() {
+  CompressedWriter index(markers_path(), 64 * 1024, 1);
+  index << markers.size();
+  for (auto& m : markers) {
+    index << m.name << m.time << m.tid;
+  }
+  index.close();
+  if (!index.good()) {
+    LOG(warn) << "Unable to write marker index " << markers_path();
+  }
+}
+
+bool TraceReader::read_markers(vector<MarkerRecord>& markers) const {
+  CompressedReader index(markers_path());
+  if (!index.good()) {
+    return false;
+  }
+  size_t count;
+  index >> count;
+  markers.clear();
+  for (size_t i = 0; i < count && index.good(); ++i) {
+    MarkerRecord m;
+    index >> m.name >> m.time >> m.tid;
+    markers.push_back(m);
+  }
+  if (!index.good()) {
+    LOG(warn) << "Ignoring unreadable marker index " << markers_path();
+    return false;
+  }
+  return true;
+}
+
+TraceFrame::Time TraceReader::find_marker(const string& name, int n) const {
+  vector<MarkerRecord> markers;
+  if (!read_markers(markers)) {
+    return 0;
+  }
+  for (auto& m : markers) {
+    if (m.name == name && --n == 0) {
+      return m.time;
+    }
+  }
+  return 0;
+}
+
+bool TraceReader::read_process_index(vector<ProcessRecord>& processes) const {
+  CompressedReader index(process_index_path());
+  if (!index.good()) {
+    return false;
+  }
+  size_t count;
+  index >> count;
+  processes.clear();
+  for (size_t i = 0; i < count && index.good(); ++i) {
+    ProcessRecord p;
+    size_t execs;
+    index >> p.pid >> p.ppid >> p.first_time >> p.last_time >> p.exit_code >>
+        execs;
+    for (size_t j = 0; j < execs && index.good(); ++j) {
+      ExecRecord e;
+      index >> e.file_name >> e.cmd_line;
+      p.execs.push_back(e);
+    }
+    processes.push_back(p);
+  }
+  if (!index.good()) {
+    LOG(warn) << "Ignoring unreadable process index " << process_index_path();
+    return false;
+  }
+  return true;
+}
+
 TraceTaskEvent TraceReader::read_task_event() {
   auto& tasks = reader(TASKS);
   TraceTaskEvent r;
@@ -285,9 +767,16 @@ TraceTaskEvent TraceReader::read_task_event() {
     case TraceTaskEvent::FORK:
       tasks >> r.parent_tid_;
       break;
-    case TraceTaskEvent::EXEC:
-      tasks >> r.file_name_ >> r.cmd_line_ >> r.fds_to_close_;
+    case TraceTaskEvent::EXEC: {
+      uint32_t file_name;
+      vector<uint32_t> cmd_line;
+      tasks >> file_name >> cmd_line >> r.fds_to_close_;
+      r.file_name_ = interned(file_name);
+      for (uint32_t arg : cmd_line) {
+        r.cmd_line_.push_back(interned(arg));
+      }
       break;
+    }
     case TraceTaskEvent::EXIT:
       break;
     case TraceTaskEvent::NONE:
@@ -298,6 +787,80 @@ TraceTaskEvent TraceReader::read_task_event() {
   return r;
 }
 
+/**
+ * Hash a chunk of raw data, MurmurHash3-style. Two independent 64-bit
+ * lanes make accidental collisions between distinct chunks vanishingly
+ * unlikely.
+ */
+static void hash_chunk(const uint8_t* data, size_t size, uint64_t* h) {
+  static const uint64_t c1 = 0x87c37b91114253d5ULL;
+  static const uint64_t c2 = 0x4cf5ad432745937fULL;
+  // |size| is a multiple of 16.
+  const size_t words = size / sizeof(uint64_t);
+  uint64_t h1 = 0x9e3779b97f4a7c15ULL;
+  uint64_t h2 = 0xc2b2ae3d27d4eb4fULL;
+  for (size_t i = 0; i < words; i += 2) {
+    uint64_t k1;
+    uint64_t k2;
+    memcpy(&k1, data + i * sizeof(uint64_t), sizeof(k1));
+    memcpy(&k2, data + (i + 1) * sizeof(uint64_t), sizeof(k2));
+    k1 *= c1;
+    k1 = (k1 << 31) | (k1 >> 33);
+    k1 *= c2;
+    h1 ^= k1;
+    h1 = (h1 << 27) | (h1 >> 37);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2;
+    k2 = (k2 << 33) | (k2 >> 31);
+    k2 *= c1;
+    h2 ^= k2;
+    h2 = (h2 << 31) | (h2 >> 33);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+  for (uint64_t* v : { &h1, &h2 }) {
+    *v ^= *v >> 33;
+    *v *= 0xff51afd7ed558ccdULL;
+    *v ^= *v >> 33;
+    *v *= 0xc4ceb9fe1a85ec53ULL;
+    *v ^= *v >> 33;
+  }
+  h[0] = h1;
+  h[1] = h2;
+}
+
+/**
+ * Hash |length| bytes of |fd| starting at |offset|, a megabyte at a time.
+ * Returns false if the file is shorter or can't be read.
+ */
+static bool hash_file_range(int fd, uint64_t offset, uint64_t length,
+                            uint64_t* h) {
+  static const size_t block_size = 1024 * 1024;
+  vector<uint8_t> buf(block_size);
+  // The hashes of each block, hashed again at the end.
+  vector<uint64_t> block_hashes;
+  while (length > 0) {
+    size_t amount = (size_t)min<uint64_t>(length, block_size);
+    ssize_t ret = pread(fd, buf.data(), amount, offset);
+    if (ret != (ssize_t)amount) {
+      return false;
+    }
+    // hash_chunk wants a multiple of 16 bytes.
+    size_t padded = (amount + 15) & ~(size_t)15;
+    memset(buf.data() + amount, 0, padded - amount);
+    uint64_t block_hash[2];
+    hash_chunk(buf.data(), padded, block_hash);
+    block_hashes.push_back(block_hash[0]);
+    block_hashes.push_back(block_hash[1]);
+    offset += amount;
+    length -= amount;
+  }
+  hash_chunk(reinterpret_cast<const uint8_t*>(block_hashes.data()),
+             block_hashes.size() * sizeof(uint64_t), h);
+  return true;
+}
+
 string TraceWriter::try_hardlink_file(const string& file_name) {
   char count_str[20];
   sprintf(count_str, "%d", mmap_count);
@@ -306,6 +869,10 @@ string TraceWriter::try_hardlink_file(const string& file_name) {
   string basename = (last_slash != file_name.npos)
                         ? file_name.substr(last_slash + 1)
                         : file_name;
+  if (stream_only()) {
+    // The trace directory is going away.
+    return file_name;
+  }
   string link_path = dir() + "/mmap_" + count_str + "_hardlink_" + basename;
   int ret = link(file_name.c_str(), link_path.c_str());
   if (ret < 0) {
@@ -315,11 +882,365 @@ string TraceWriter::try_hardlink_file(const string& file_name) {
   return link_path;
 }
 
+/**
+ * Snapshot |file_name| into the trace directory with a reflink, which is
+ * cheap on filesystems that support it (btrfs, XFS). |stat| is what the
+ * recorded mapping saw; if the file isn't that file any more we give up.
+ * Returns the clone's name relative to the trace directory, or an empty
+ * string if we couldn't make one.
+ */
+string TraceWriter::try_clone_file(const string& file_name,
+                                   const struct stat& stat,
+                                   const string& name_prefix) {
+  if (stream_only() ||
+      devices_without_clone.find(stat.st_dev) != devices_without_clone.end()) {
+    return string();
+  }
+  ScopedFd src(file_name.c_str(), O_RDONLY);
+  struct stat src_stat;
+  if (!src.is_open() || fstat(src, &src_stat) ||
+      src_stat.st_dev != stat.st_dev || src_stat.st_ino != stat.st_ino ||
+      src_stat.st_size != stat.st_size || !S_ISREG(src_stat.st_mode)) {
+    return string();
+  }
+
+  size_t last_slash = file_name.rfind('/');
+  string basename = (last_slash != file_name.npos)
+                        ? file_name.substr(last_slash + 1)
+                        : file_name;
+  string name = name_prefix + "_clone_" + basename;
+  string path = dir() + "/" + name;
+  ScopedFd dest(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0400);
+  if (!dest.is_open()) {
+    return string();
+  }
+  if (ioctl(dest, FICLONE, (int)src) < 0) {
+    // Not supported by this filesystem, or across filesystems. Don't keep
+    // trying for every mapping.
+    LOG(debug) << "Can't reflink " << file_name << ": " << strerror(errno);
+    devices_without_clone.insert(stat.st_dev);
+    unlink(path.c_str());
+    return string();
+  }
+  if (sink) {
+    sink->write_file(name, path);
+  }
+  return name;
+}
+
+/**
+ * The part of the file |km| maps, clipped to the file's size |file_size|.
+ */
+static uint64_t mapped_file_bytes(const KernelMapping& km, int64_t file_size) {
+  if (file_size <= (int64_t)km.file_offset_bytes()) {
+    return 0;
+  }
+  return min<uint64_t>(file_size - km.file_offset_bytes(), km.size());
+}
+
+/**
+ * Instead of copying a large read-only private mapping into the trace,
+ * record a hash of the mapped data so replay can map the file itself and
+ * check that it hasn't changed. Returns false if the mapping doesn't
+ * qualify.
+ */
+bool TraceWriter::try_hash_mapped_file(const KernelMapping& km,
+                                       const struct stat& stat,
+                                       uint64_t* content_hash) {
+  if (!lazy_mapping_threshold || km.size() < lazy_mapping_threshold ||
+      (km.prot() & PROT_WRITE) || !S_ISREG(stat.st_mode) ||
+      is_tmp_file(km.fsname())) {
+    return false;
+  }
+  ScopedFd fd(km.fsname().c_str(), O_RDONLY);
+  struct stat fd_stat;
+  if (!fd.is_open() || fstat(fd, &fd_stat) || fd_stat.st_dev != stat.st_dev ||
+      fd_stat.st_ino != stat.st_ino || fd_stat.st_size != stat.st_size) {
+    return false;
+  }
+  return hash_file_range(fd, km.file_offset_bytes(),
+                         mapped_file_bytes(km, stat.st_size), content_hash);
+}
+
+/**
+ * Private file mappings at least this big that can't be reflinked or hashed
+ * are copied into a file of their own instead of into the trace's data
+ * stream, so replay can map the copy directly.
+ */
+static const uint64_t MIN_COPIED_MAPPING_SIZE = 16 * 1024 * 1024;
+
+/**
+ * Copy the part of the file that a large private mapping |km| maps into the
+ * trace directory. The copy is sparse, with the data at its original offset
+ * and the original file size, so it can stand in for the file. Returns the
+ * copy's name relative to the trace directory, or an empty string if the
+ * mapping doesn't qualify or the copy failed.
+ */
+string TraceWriter::try_copy_mapped_file(const KernelMapping& km,
+                                         const struct stat& stat) {
+  if (stream_only() || km.size() < MIN_COPIED_MAPPING_SIZE ||
+      !S_ISREG(stat.st_mode)) {
+    return string();
+  }
+  ScopedFd src(km.fsname().c_str(), O_RDONLY);
+  struct stat src_stat;
+  if (!src.is_open() || fstat(src, &src_stat) ||
+      src_stat.st_dev != stat.st_dev || src_stat.st_ino != stat.st_ino ||
+      src_stat.st_size != stat.st_size) {
+    return string();
+  }
+
+  char count_str[20];
+  sprintf(count_str, "%d", mmap_count);
+  const string& file_name = km.fsname();
+  size_t last_slash = file_name.rfind('/');
+  string basename = (last_slash != file_name.npos)
+                        ? file_name.substr(last_slash + 1)
+                        : file_name;
+  string name = string("mmap_") + count_str + "_copy_" + basename;
+  string path = dir() + "/" + name;
+  ScopedFd dest(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0400);
+  if (!dest.is_open()) {
+    return string();
+  }
+  if (ftruncate(dest, stat.st_size) ||
+      !copy_file_range_in_place(src, dest, km.file_offset_bytes(),
+                                mapped_file_bytes(km, stat.st_size))) {
+    LOG(debug) << "Can't copy " << file_name << ": " << strerror(errno);
+    unlink(path.c_str());
+    return string();
+  }
+  if (sink) {
+    sink->write_file(name, path);
+  }
+  return name;
+}
+
+/**
+ * Objects, and object store temporary files, that nothing else has linked
+ * to for this long are deleted when the store is opened. Recorders sharing
+ * the store may be between creating an object and linking it into their
+ * trace, and that changes the object's ctime.
+ */
+static const time_t OBJECT_STORE_GRACE_SECONDS = 60 * 60;
+
+/**
+ * Delete the objects in the store |dir| that only the store links to,
+ * then the keys of objects that are gone.
+ */
+static void remove_unreferenced_objects(const string& dir) {
+  time_t now = time(nullptr);
+  string objects = dir + "/objects";
+  DIR* d = opendir(objects.c_str());
+  if (d) {
+    while (struct dirent* ent = readdir(d)) {
+      string path = objects + "/" + ent->d_name;
+      struct stat st;
+      if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..") &&
+          !lstat(path.c_str(), &st) && S_ISREG(st.st_mode) &&
+          st.st_nlink == 1 && now - st.st_ctime > OBJECT_STORE_GRACE_SECONDS) {
+        LOG(debug) << "Removing unreferenced object " << path;
+        unlink(path.c_str());
+      }
+    }
+    closedir(d);
+  }
+  string keys = dir + "/keys";
+  d = opendir(keys.c_str());
+  if (d) {
+    while (struct dirent* ent = readdir(d)) {
+      string path = keys + "/" + ent->d_name;
+      struct stat st;
+      if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..") &&
+          stat(path.c_str(), &st) < 0 && errno == ENOENT) {
+        unlink(path.c_str());
+      }
+    }
+    closedir(d);
+  }
+}
+
+void TraceWriter::set_object_store(const string& dir) {
+  for (const string& d : { dir, dir + "/objects", dir + "/keys" }) {
+    if (mkdir(d.c_str(), S_IRWXU | S_IRWXG) < 0 && errno != EEXIST) {
+      FATAL() << "Can't create object store directory " << d;
+    }
+  }
+  remove_unreferenced_objects(dir);
+  object_store = dir;
+}
+
+static string object_name(const uint64_t* h) {
+  char name[40];
+  sprintf(name, "%016" PRIx64 "%016" PRIx64, h[0], h[1]);
+  return name;
+}
+
+/**
+ * Hardlink the regular file |file_name|, which |stat| describes, into the
+ * trace directory from the object store, adding it to the store first if
+ * necessary. The store's "keys" directory maps files' identities (device,
+ * inode, size and mtime) to objects, so unchanged files don't have to be
+ * hashed every time. Returns the link's name relative to the trace
+ * directory, or an empty string if there is no store, or it's on another
+ * filesystem than the trace, or the file isn't that file any more.
+ */
+string TraceWriter::try_link_stored_object(const string& file_name,
+                                           const struct stat& stat) {
+  if (object_store.empty() || stream_only() || !S_ISREG(stat.st_mode)) {
+    return string();
+  }
+  ScopedFd src(file_name.c_str(), O_RDONLY);
+  struct stat src_stat;
+  if (!src.is_open() || fstat(src, &src_stat) ||
+      src_stat.st_dev != stat.st_dev || src_stat.st_ino != stat.st_ino ||
+      src_stat.st_size != stat.st_size) {
+    return string();
+  }
+
+  char count_str[20];
+  sprintf(count_str, "%d", mmap_count);
+  size_t last_slash = file_name.rfind('/');
+  string basename = (last_slash != file_name.npos)
+                        ? file_name.substr(last_slash + 1)
+                        : file_name;
+  string name = string("mmap_") + count_str + "_object_" + basename;
+  string link_path = dir() + "/" + name;
+  string objects = object_store + "/objects/";
+
+  // As in write_raw_file_ref(), only trust the mtime of files that have
+  // been left alone for a couple of seconds.
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  bool use_key = now.tv_sec - src_stat.st_mtim.tv_sec >= 2;
+  char key[100];
+  sprintf(key, "%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%" PRId64 ".%09ld",
+          (uint64_t)src_stat.st_dev, (uint64_t)src_stat.st_ino,
+          (uint64_t)src_stat.st_size, (int64_t)src_stat.st_mtim.tv_sec,
+          (long)src_stat.st_mtim.tv_nsec);
+  string key_path = object_store + "/keys/" + key;
+  if (use_key) {
+    char object[100];
+    ssize_t len = readlink(key_path.c_str(), object, sizeof(object) - 1);
+    if (len > 0) {
+      object[len] = 0;
+      if (!link((objects + object).c_str(), link_path.c_str())) {
+        return name;
+      }
+    }
+  }
+
+  uint64_t h[2];
+  if (!hash_file_range(src, 0, src_stat.st_size, h)) {
+    return string();
+  }
+  string object = object_name(h);
+  if (link((objects + object).c_str(), link_path.c_str()) < 0) {
+    if (errno != ENOENT) {
+      // Most likely the store is on another filesystem.
+      LOG(debug) << "Can't link " << objects << object << " into the trace: "
+                 << strerror(errno);
+      return string();
+    }
+    // Add the file to the store. Name the object after the hash of the
+    // copy, so an object's contents always match its name even if the
+    // file changes while we copy it.
+    char tmp_name[50];
+    sprintf(tmp_name, ".tmp_%d_%u", getpid(), mmap_count);
+    string tmp_path = objects + tmp_name;
+    ScopedFd dest(tmp_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                  0444);
+    if (!dest.is_open()) {
+      return string();
+    }
+    bool ok = !ioctl(dest, FICLONE, (int)src) ||
+              (!ftruncate(dest, src_stat.st_size) &&
+               copy_file_range_in_place(src, dest, 0, src_stat.st_size));
+    ok = ok && hash_file_range(dest, 0, src_stat.st_size, h);
+    if (ok) {
+      object = object_name(h);
+      // Another recorder may have just added the same object.
+      ok = (!link(tmp_path.c_str(), (objects + object).c_str()) ||
+            errno == EEXIST) &&
+           !link((objects + object).c_str(), link_path.c_str());
+    }
+    unlink(tmp_path.c_str());
+    if (!ok) {
+      LOG(debug) << "Can't add " << file_name << " to the object store: "
+                 << strerror(errno);
+      return string();
+    }
+    struct stat after;
+    use_key = use_key && !fstat(src, &after) &&
+              after.st_mtim.tv_sec == src_stat.st_mtim.tv_sec &&
+              after.st_mtim.tv_nsec == src_stat.st_mtim.tv_nsec;
+  }
+  if (use_key) {
+    // Replace the key atomically; other recorders may be reading it.
+    char tmp_suffix[50];
+    sprintf(tmp_suffix, ".tmp_%d_%u", getpid(), mmap_count);
+    string tmp_key = key_path + tmp_suffix;
+    unlink(tmp_key.c_str());
+    if (symlink(("../objects/" + object).c_str(), tmp_key.c_str()) ||
+        rename(tmp_key.c_str(), key_path.c_str())) {
+      unlink(tmp_key.c_str());
+    }
+  }
+  if (sink) {
+    sink->write_file(name, link_path);
+  }
+  return name;
+}
+
+/**
+ * An MMAPS record as stored in the trace. File names are STRINGS indices.
+ */
+struct MmapRecord {
+  TraceFrame::Time time;
+  TraceReader::MappedDataSource source;
+  remote_ptr<void> start;
+  remote_ptr<void> end;
+  uint32_t original_file_name;
+  dev_t device;
+  ino_t inode;
+  int prot;
+  int flags;
+  uint64_t file_offset_bytes;
+  // The empty string unless |source| is SOURCE_FILE
+  uint32_t backing_file_name;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  int64_t file_size;
+  int64_t mtime;
+  // For SOURCE_FILE mappings that were recorded lazily, the hash of the
+  // mapped part of the file, which replay checks. Otherwise zero.
+  uint64_t content_hash[2];
+};
+
+static CompressedWriter& operator<<(CompressedWriter& out,
+                                    const MmapRecord& r) {
+  out << r.time << r.source << r.start << r.end << r.original_file_name
+      << r.device << r.inode << r.prot << r.flags << r.file_offset_bytes
+      << r.backing_file_name << r.mode << r.uid << r.gid << r.file_size
+      << r.mtime << r.content_hash[0] << r.content_hash[1];
+  return out;
+}
+
+static CompressedReader& operator>>(CompressedReader& in, MmapRecord& r) {
+  in >> r.time >> r.source >> r.start >> r.end >> r.original_file_name >>
+      r.device >> r.inode >> r.prot >> r.flags >> r.file_offset_bytes >>
+      r.backing_file_name >> r.mode >> r.uid >> r.gid >> r.file_size >>
+      r.mtime >> r.content_hash[0] >> r.content_hash[1];
+  return in;
+}
+
 TraceWriter::RecordInTrace TraceWriter::write_mapped_region(
     const KernelMapping& km, const struct stat& stat, MappingOrigin origin) {
   auto& mmaps = writer(MMAPS);
   TraceReader::MappedDataSource source;
   string backing_file_name;
+  uint64_t content_hash[2] = { 0, 0 };
   if (km.fsname().find("/SYSV") == 0) {
     source = TraceReader::SOURCE_TRACE;
   } else if (origin == SYSCALL_MAPPING &&
@@ -328,7 +1249,26 @@ TraceWriter::RecordInTrace TraceWriter::write_mapped_region(
   } else if (should_copy_mmap_region(km, stat) &&
              files_assumed_immutable.find(make_pair(
                  stat.st_dev, stat.st_ino)) == files_assumed_immutable.end()) {
-    source = TraceReader::SOURCE_TRACE;
+    // A reflink snapshot of the file serves as well as a copy of the mapped
+    // data, at a fraction of the cost. Shared mappings have to come from
+    // the trace so replay can keep them coherent.
+    if (km.flags() & MAP_PRIVATE) {
+      char prefix[30];
+      sprintf(prefix, "mmap_%d", mmap_count);
+      backing_file_name = try_clone_file(km.fsname(), stat, prefix);
+      if (backing_file_name.empty() &&
+          try_hash_mapped_file(km, stat, content_hash)) {
+        backing_file_name = km.fsname();
+      }
+      if (backing_file_name.empty()) {
+        backing_file_name = try_link_stored_object(km.fsname(), stat);
+      }
+      if (backing_file_name.empty()) {
+        backing_file_name = try_copy_mapped_file(km, stat);
+      }
+    }
+    source = backing_file_name.empty() ? TraceReader::SOURCE_TRACE
+                                       : TraceReader::SOURCE_FILE;
   } else {
     source = TraceReader::SOURCE_FILE;
     // Try hardlinking file into the trace directory. This will avoid
@@ -337,13 +1277,34 @@ TraceWriter::RecordInTrace TraceWriter::write_mapped_region(
     // just returns the original file name.
     // A relative backing_file_name is relative to the trace directory.
     backing_file_name = try_hardlink_file(km.fsname());
+    if (backing_file_name == km.fsname()) {
+      // Hardlinking fails across filesystems. The object store keeps a
+      // copy safe from the file being replaced instead.
+      string stored = try_link_stored_object(km.fsname(), stat);
+      if (!stored.empty()) {
+        backing_file_name = stored;
+      }
+    }
     files_assumed_immutable.insert(make_pair(stat.st_dev, stat.st_ino));
   }
-  mmaps << global_time << source << km.start() << km.end() << km.fsname()
-        << km.device() << km.inode() << km.prot() << km.flags()
-        << km.file_offset_bytes() << backing_file_name << (uint32_t)stat.st_mode
-        << (uint32_t)stat.st_uid << (uint32_t)stat.st_gid
-        << (int64_t)stat.st_size << (int64_t)stat.st_mtime;
+  MmapRecord record = { global_time,
+                        source,
+                        km.start(),
+                        km.end(),
+                        intern(km.fsname()),
+                        km.device(),
+                        km.inode(),
+                        km.prot(),
+                        km.flags(),
+                        km.file_offset_bytes(),
+                        intern(backing_file_name),
+                        (uint32_t)stat.st_mode,
+                        (uint32_t)stat.st_uid,
+                        (uint32_t)stat.st_gid,
+                        (int64_t)stat.st_size,
+                        (int64_t)stat.st_mtime,
+                        { content_hash[0], content_hash[1] } };
+  mmaps << record;
   ++mmap_count;
   return source == TraceReader::SOURCE_TRACE ? RECORD_IN_TRACE
                                              : DONT_RECORD_IN_TRACE;
@@ -367,87 +1328,398 @@ KernelMapping TraceReader::read_mapped_region(MappedData* data, bool* found) {
     return KernelMapping();
   }
 
-  string original_file_name;
-  string backing_file_name;
-  remote_ptr<void> start, end;
-  dev_t device;
-  ino_t inode;
-  int prot, flags;
-  uint32_t uid, gid, mode;
-  uint64_t file_offset_bytes;
-  int64_t mtime, file_size;
-  mmaps >> time >> data->source >> start >> end >> original_file_name >>
-      device >> inode >> prot >> flags >> file_offset_bytes >>
-      backing_file_name >> mode >> uid >> gid >> file_size >> mtime;
-  assert(time == global_time);
-  if (data->source == SOURCE_FILE) {
-    if (backing_file_name[0] != '/') {
-      backing_file_name = dir() + "/" + backing_file_name;
-    }
-    struct stat backing_stat;
-    if (stat(backing_file_name.c_str(), &backing_stat)) {
-      FATAL() << "Failed to stat " << backing_file_name
-              << ": replay is impossible";
+  MmapRecord r;
+  mmaps >> r;
+  assert(r.time == global_time);
+  string original_file_name = interned(r.original_file_name);
+  string backing_file_name = interned(r.backing_file_name);
+  data->source = r.source;
+  if (data->source == SOURCE_FILE) {
+    // Files that "rr pack" moved into the trace directory, and reflinks
+    // made while recording, are named relative to it. They are copies,
+    // possibly shared between identical recorded files, so only their size
+    // is meaningful.
+    bool packed = backing_file_name[0] != '/';
+    if (packed) {
+      backing_file_name = dir() + "/" + backing_file_name;
+    }
+    BackingFile& file = backing_file(backing_file_name);
+    const struct stat& backing_stat = file.st;
+    if (r.content_hash[0] || r.content_hash[1]) {
+      KernelMapping km(r.start, r.end, original_file_name, r.device,
+                       r.inode, r.prot, r.flags, r.file_offset_bytes);
+      uint64_t length = mapped_file_bytes(km, r.file_size);
+      auto range = make_pair(uint64_t(r.file_offset_bytes), length);
+      if (!file.verified_ranges.count(range)) {
+        ScopedFd fd(backing_file_name.c_str(), O_RDONLY);
+        uint64_t hash[2];
+        if (!fd.is_open() ||
+            !hash_file_range(fd, r.file_offset_bytes, length, hash) ||
+            hash[0] != r.content_hash[0] || hash[1] != r.content_hash[1]) {
+          FATAL() << "Contents of " << backing_file_name
+                  << " changed since it was recorded: replay is impossible";
+        }
+        file.verified_ranges.insert(range);
+      }
+    }
+    if (backing_stat.st_size != r.file_size ||
+        (!packed && (backing_stat.st_ino != r.inode ||
+                     backing_stat.st_mode != r.mode ||
+                     backing_stat.st_uid != r.uid ||
+                     backing_stat.st_gid != r.gid ||
+                     backing_stat.st_mtime != r.mtime))) {
+      LOG(error)
+          << "Metadata of " << original_file_name
+          << " changed: replay divergence likely, but continuing anyway ...";
+    }
+  }
+  data->file_name = backing_file_name;
+  data->file_data_offset_bytes = r.file_offset_bytes;
+  data->file_size_bytes = r.file_size;
+  if (found) {
+    *found = true;
+  }
+  return KernelMapping(r.start, r.end, original_file_name, r.device, r.inode,
+                       r.prot, r.flags, r.file_offset_bytes);
+}
+
+TraceReader::BackingFile& TraceReader::backing_file(const string& file_name) {
+  auto it = backing_files->find(file_name);
+  if (it != backing_files->end()) {
+    return it->second;
+  }
+  BackingFile file;
+  if (stat(file_name.c_str(), &file.st)) {
+    FATAL() << "Failed to stat " << file_name << ": replay is impossible";
+  }
+  return backing_files->insert(make_pair(file_name, file)).first->second;
+}
+
+bool TraceReader::cached_backing_file_identity(const string& file_name,
+                                               struct stat* st,
+                                               string* real_name) {
+  auto it = backing_files->find(file_name);
+  if (it == backing_files->end() || !it->second.have_tracee_identity) {
+    return false;
+  }
+  *st = it->second.tracee_st;
+  *real_name = it->second.tracee_name;
+  return true;
+}
+
+void TraceReader::cache_backing_file_identity(const string& file_name,
+                                              const struct stat& st,
+                                              const string& real_name) {
+  BackingFile& file = backing_file(file_name);
+  file.have_tracee_identity = true;
+  file.tracee_st = st;
+  file.tracee_name = real_name;
+}
+
+static ostream& operator<<(ostream& out, const vector<string>& vs) {
+  out << vs.size() << endl;
+  for (auto& v : vs) {
+    out << v << '\0';
+  }
+  return out;
+}
+
+static istream& operator>>(istream& in, vector<string>& vs) {
+  size_t len;
+  in >> len;
+  in.ignore(1);
+  for (size_t i = 0; i < len; ++i) {
+    char buf[PATH_MAX];
+    in.getline(buf, sizeof(buf), '\0');
+    vs.push_back(buf);
+  }
+  return in;
+}
+
+// Stop remembering new chunks once the table would use roughly 64MB.
+static const size_t MAX_RAW_DATA_CHUNKS = 1 << 20;
+
+// In place of a RAW_DATA_HEADER record's chunk reference count, marks a
+// record whose data is in a file in the trace directory. The file's name
+// and the data's offset in it follow.
+static const uint32_t RAW_DATA_FILE_REF = 0xffffffff;
+
+// In place of a chunk reference's RAW_DATA offset, marks a chunk that is
+// all zeroes and isn't stored at all.
+static const uint64_t RAW_DATA_ZERO_CHUNK = UINT64_MAX;
+
+// |size| must be a multiple of 256.
+static bool is_zero_chunk(const uint8_t* p, size_t size) {
+  // OR whole blocks of words together so the compiler can vectorize the
+  // inner loop; most nonzero chunks are rejected in the first block.
+  static const size_t block_words = 32;
+  for (size_t i = 0; i < size; i += block_words * sizeof(uint64_t)) {
+    uint64_t acc = 0;
+    for (size_t j = 0; j < block_words; ++j) {
+      uint64_t w;
+      memcpy(&w, p + i + j * sizeof(uint64_t), sizeof(w));
+      acc |= w;
+    }
+    if (acc) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TraceWriter::write_raw_refs(
+    const vector<pair<uint32_t, uint64_t> >& refs) {
+  auto& data_header = writer(RAW_DATA_HEADER);
+  data_header << uint32_t(refs.size());
+  for (auto& ref : refs) {
+    data_header << ref.first << ref.second;
+  }
+}
+
+void TraceWriter::write_raw(const void* d, size_t len, remote_ptr<void> addr) {
+  auto& data = writer(RAW_DATA);
+  auto& data_header = writer(RAW_DATA_HEADER);
+  data_header << global_time << addr.as_int() << len;
+  if (len < RAW_DATA_CHUNK_SIZE) {
+    data_header << uint32_t(0);
+    data.write(d, len);
+    return;
+  }
+
+  // Each reference is a chunk index within this record and the RAW_DATA
+  // offset the chunk was stored at, or RAW_DATA_ZERO_CHUNK. Chunks without
+  // a reference are stored in order, followed by any partial chunk at the
+  // end. Bytes from |unwritten| on haven't been written yet.
+  vector<pair<uint32_t, uint64_t> > refs;
+  auto bytes = static_cast<const uint8_t*>(d);
+  size_t offset = 0;
+  size_t unwritten = 0;
+  for (; offset + RAW_DATA_CHUNK_SIZE <= len; offset += RAW_DATA_CHUNK_SIZE) {
+    uint64_t ref;
+    if (is_zero_chunk(bytes + offset, RAW_DATA_CHUNK_SIZE)) {
+      ref = RAW_DATA_ZERO_CHUNK;
+    } else if (!dedup_raw_data) {
+      continue;
+    } else {
+      ChunkHash hash;
+      hash_chunk(bytes + offset, RAW_DATA_CHUNK_SIZE, hash.h);
+      auto it = raw_data_chunks.find(hash);
+      if (it == raw_data_chunks.end()) {
+        if (raw_data_chunks.size() < MAX_RAW_DATA_CHUNKS) {
+          raw_data_chunks[hash] = data.bytes_written() + offset - unwritten;
+        }
+        continue;
+      }
+      ref = it->second;
+    }
+    data.write(bytes + unwritten, offset - unwritten);
+    unwritten = offset + RAW_DATA_CHUNK_SIZE;
+    refs.push_back(make_pair(offset / RAW_DATA_CHUNK_SIZE, ref));
+  }
+  data.write(bytes + unwritten, len - unwritten);
+  write_raw_refs(refs);
+}
+
+void TraceWriter::write_raw_filled(size_t len, remote_ptr<void> addr,
+                                   const RawDataFiller& fill) {
+  if (dedup_raw_data && len >= RAW_DATA_CHUNK_SIZE) {
+    // Chunks have to be hashed before we know whether to store them.
+    vector<uint8_t> buf(len);
+    fill(buf.data(), 0, len);
+    write_raw(buf.data(), len, addr);
+    return;
+  }
+
+  // Zero chunks can still be dropped from the writer's buffer after they
+  // have been filled in: the rest of the data is moved down over them.
+  auto& data = writer(RAW_DATA);
+  writer(RAW_DATA_HEADER) << global_time << addr.as_int() << len;
+  vector<pair<uint32_t, uint64_t> > refs;
+  size_t offset = 0;
+  while (offset < len) {
+    size_t amount;
+    uint8_t* buf = data.reserve(len - offset, &amount);
+    if (!buf) {
+      break;
+    }
+    // End the piece on a chunk boundary if we can, so the next piece
+    // starts on one.
+    size_t end = (offset + amount) / RAW_DATA_CHUNK_SIZE * RAW_DATA_CHUNK_SIZE;
+    if (offset + amount < len && end > offset) {
+      amount = end - offset;
+    }
+    fill(buf, offset, amount);
+
+    size_t kept = 0;
+    size_t pos = 0;
+    size_t i = (RAW_DATA_CHUNK_SIZE - offset % RAW_DATA_CHUNK_SIZE) %
+               RAW_DATA_CHUNK_SIZE;
+    for (; i + RAW_DATA_CHUNK_SIZE <= amount; i += RAW_DATA_CHUNK_SIZE) {
+      if (!is_zero_chunk(buf + i, RAW_DATA_CHUNK_SIZE)) {
+        continue;
+      }
+      if (kept != pos) {
+        memmove(buf + kept, buf + pos, i - pos);
+      }
+      kept += i - pos;
+      pos = i + RAW_DATA_CHUNK_SIZE;
+      refs.push_back(
+          make_pair((offset + i) / RAW_DATA_CHUNK_SIZE, RAW_DATA_ZERO_CHUNK));
+    }
+    if (kept != pos) {
+      memmove(buf + kept, buf + pos, amount - pos);
+    }
+    kept += amount - pos;
+    data.commit(kept);
+    offset += amount;
+  }
+  write_raw_refs(refs);
+}
+
+bool TraceWriter::write_raw_file_ref(const string& file_name,
+                                     const struct stat& stat, uint64_t offset,
+                                     size_t len, remote_ptr<void> addr) {
+  if (!S_ISREG(stat.st_mode) || offset > (uint64_t)stat.st_size ||
+      len > (uint64_t)stat.st_size - offset) {
+    return false;
+  }
+  auto key = make_pair(stat.st_dev, stat.st_ino);
+  auto it = read_snapshots.find(key);
+  if (it == read_snapshots.end() ||
+      it->second.mtime.tv_sec != stat.st_mtim.tv_sec ||
+      it->second.mtime.tv_nsec != stat.st_mtim.tv_nsec ||
+      it->second.size != stat.st_size) {
+    // Modification times are only as fine-grained as the kernel's clock
+    // tick, so a file written during the tick its snapshot is taken in
+    // could keep its mtime. Only snapshot files that have been left alone
+    // for a while; later writes then always change the mtime.
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec - stat.st_mtim.tv_sec < 2) {
+      return false;
+    }
+    char prefix[30];
+    sprintf(prefix, "read_%u", read_snapshot_count);
+    string name = try_clone_file(file_name, stat, prefix);
+    if (name.empty()) {
+      return false;
+    }
+    ++read_snapshot_count;
+    ReadSnapshot& snapshot = read_snapshots[key];
+    snapshot.mtime = stat.st_mtim;
+    snapshot.size = stat.st_size;
+    snapshot.name = name;
+    it = read_snapshots.find(key);
+  }
+  writer(RAW_DATA_HEADER) << global_time << addr.as_int() << len
+                          << RAW_DATA_FILE_REF << it->second.name << offset;
+  return true;
+}
+
+void TraceReader::read_raw_data_contents(size_t num_bytes, uint32_t ref_count,
+                                         uint8_t* out) {
+  auto& data = reader(RAW_DATA);
+  auto& data_header = reader(RAW_DATA_HEADER);
+  if (ref_count == RAW_DATA_FILE_REF) {
+    string name;
+    uint64_t file_offset;
+    data_header >> name >> file_offset;
+    if (name != raw_data_file_name) {
+      string path = dir() + "/" + name;
+      raw_data_file = ScopedFd(path.c_str(), O_RDONLY);
+      if (!raw_data_file.is_open()) {
+        FATAL() << "Can't open " << path << " for recorded file data";
+      }
+      raw_data_file_name = name;
     }
-    if (backing_stat.st_ino != inode || backing_stat.st_mode != mode ||
-        backing_stat.st_uid != uid || backing_stat.st_gid != gid ||
-        backing_stat.st_size != file_size || backing_stat.st_mtime != mtime) {
-      LOG(error)
-          << "Metadata of " << original_file_name
-          << " changed: replay divergence likely, but continuing anyway ...";
+    if (pread(raw_data_file, out, num_bytes, file_offset) !=
+        (ssize_t)num_bytes) {
+      FATAL() << "Can't read " << num_bytes << " bytes at " << file_offset
+              << " of " << name;
     }
+    return;
   }
-  data->file_name = backing_file_name;
-  data->file_data_offset_bytes = file_offset_bytes;
-  data->file_size_bytes = file_size;
-  if (found) {
-    *found = true;
+  size_t offset = 0;
+  for (uint32_t i = 0; i < ref_count; ++i) {
+    uint32_t chunk;
+    uint64_t chunk_offset;
+    data_header >> chunk >> chunk_offset;
+    size_t chunk_start = chunk * RAW_DATA_CHUNK_SIZE;
+    assert(chunk_start >= offset &&
+           chunk_start + RAW_DATA_CHUNK_SIZE <= num_bytes);
+    data.read(out + offset, chunk_start - offset);
+    offset = chunk_start + RAW_DATA_CHUNK_SIZE;
+
+    if (chunk_offset == RAW_DATA_ZERO_CHUNK) {
+      memset(out + chunk_start, 0, RAW_DATA_CHUNK_SIZE);
+      continue;
+    }
+    if (!raw_data_chunk_reader) {
+      raw_data_chunk_reader =
+          unique_ptr<CompressedReader>(new CompressedReader(data));
+      raw_data_chunk_reader->set_read_ahead(0);
+    }
+    if (!raw_data_chunk_reader->seek(chunk_offset) ||
+        !raw_data_chunk_reader->read(out + chunk_start, RAW_DATA_CHUNK_SIZE)) {
+      FATAL() << "Can't read deduplicated raw data at offset " << chunk_offset;
+    }
   }
-  return KernelMapping(start, end, original_file_name, device, inode, prot,
-                       flags, file_offset_bytes);
+  data.read(out + offset, num_bytes - offset);
 }
 
-static ostream& operator<<(ostream& out, const vector<string>& vs) {
-  out << vs.size() << endl;
-  for (auto& v : vs) {
-    out << v << '\0';
-  }
-  return out;
+TraceReader::RawData TraceReader::read_raw_data() {
+  RawData d;
+  read_raw_data(d);
+  return d;
 }
 
-static istream& operator>>(istream& in, vector<string>& vs) {
-  size_t len;
-  in >> len;
-  in.ignore(1);
-  for (size_t i = 0; i < len; ++i) {
-    char buf[PATH_MAX];
-    in.getline(buf, sizeof(buf), '\0');
-    vs.push_back(buf);
-  }
-  return in;
+void TraceReader::read_raw_data(RawData& d) {
+  auto& data_header = reader(RAW_DATA_HEADER);
+  TraceFrame::Time time;
+  size_t num_bytes;
+  uint32_t ref_count;
+  data_header >> time >> d.addr >> num_bytes >> ref_count;
+  assert(time == global_time);
+  d.data.resize(num_bytes);
+  read_raw_data_contents(num_bytes, ref_count, d.data.data());
 }
 
-void TraceWriter::write_raw(const void* d, size_t len, remote_ptr<void> addr) {
-  auto& data = writer(RAW_DATA);
-  auto& data_header = writer(RAW_DATA_HEADER);
-  data_header << global_time << addr.as_int() << len;
-  data.write(d, len);
+TraceReader::RawDataMetadata TraceReader::read_raw_data_into(void* out,
+                                                             size_t max_size) {
+  auto& data_header = reader(RAW_DATA_HEADER);
+  TraceFrame::Time time;
+  RawDataMetadata d;
+  uint32_t ref_count;
+  data_header >> time >> d.addr >> d.size >> ref_count;
+  assert(time == global_time);
+  if (d.size > max_size) {
+    FATAL() << "Raw data record of " << d.size << " bytes doesn't fit in "
+            << max_size;
+  }
+  read_raw_data_contents(d.size, ref_count, static_cast<uint8_t*>(out));
+  return d;
 }
 
-TraceReader::RawData TraceReader::read_raw_data() {
+TraceReader::RawDataRef TraceReader::read_raw_data_ref() {
   auto& data = reader(RAW_DATA);
   auto& data_header = reader(RAW_DATA_HEADER);
   TraceFrame::Time time;
-  RawData d;
-  size_t num_bytes;
-  data_header >> time >> d.addr >> num_bytes;
+  RawDataRef d;
+  uint32_t ref_count;
+  data_header >> time >> d.addr >> d.size >> ref_count;
   assert(time == global_time);
-  d.data.resize(num_bytes);
-  data.read((char*)d.data.data(), num_bytes);
+  d.data = nullptr;
+  if (ref_count == 0) {
+    data.read_view(d.size, &d.data, raw_data_storage);
+  } else {
+    raw_data_storage.resize(d.size);
+    read_raw_data_contents(d.size, ref_count, raw_data_storage.data());
+    d.data = raw_data_storage.data();
+  }
   return d;
 }
 
-bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
+bool TraceReader::at_raw_data_for_frame(const TraceFrame& frame) {
   auto& data_header = reader(RAW_DATA_HEADER);
   if (data_header.at_end()) {
     return false;
@@ -457,20 +1729,198 @@ bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
   data_header >> time;
   data_header.restore_state();
   assert(time >= frame.time());
-  if (time > frame.time()) {
+  return time == frame.time();
+}
+
+bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
+  if (!at_raw_data_for_frame(frame)) {
+    return false;
+  }
+  read_raw_data(d);
+  return true;
+}
+
+bool TraceReader::read_raw_data_ref_for_frame(const TraceFrame& frame,
+                                              RawDataRef& d) {
+  if (!at_raw_data_for_frame(frame)) {
+    return false;
+  }
+  d = read_raw_data_ref();
+  return true;
+}
+
+bool TraceReader::read_raw_data_metadata_for_frame(const TraceFrame& frame,
+                                                   RawDataMetadata& d) {
+  if (!at_raw_data_for_frame(frame)) {
     return false;
   }
-  d = read_raw_data();
+  auto& data_header = reader(RAW_DATA_HEADER);
+  TraceFrame::Time time;
+  uint32_t ref_count;
+  data_header >> time >> d.addr >> d.size >> ref_count;
+  if (ref_count == RAW_DATA_FILE_REF) {
+    string name;
+    uint64_t file_offset;
+    data_header >> name >> file_offset;
+    return true;
+  }
+  for (uint32_t i = 0; i < ref_count; ++i) {
+    uint32_t chunk;
+    uint64_t chunk_offset;
+    data_header >> chunk >> chunk_offset;
+  }
   return true;
 }
 
+void TraceWriter::dump_write_stats(FILE* out) const {
+  fprintf(out, "rr: trace write statistics:\n");
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    const CompressedWriter::Stats& stats = writer(s).stats();
+    fprintf(out, "  %-12s %12" PRIu64 " bytes in %6" PRIu64
+                 " blocks, %6" PRIu64 " spilled; max %10" PRIu64
+                 " bytes queued; blocked %6" PRIu64 " times, %.3fs\n",
+            substream(s).name, stats.bytes, stats.blocks,
+            stats.spilled_blocks, stats.max_queued_bytes, stats.blocked_count,
+            stats.blocked_seconds);
+  }
+  fprintf(out, "rr: trace compression:\n");
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    const CompressedWriter::Stats& stats = writer(s).stats();
+    // Throughput is per compression thread, so it's comparable across
+    // thread counts.
+    double mb_per_sec = stats.compress_seconds > 0
+                            ? stats.bytes / stats.compress_seconds / 1e6
+                            : 0;
+    fprintf(out, "  %-12s %-4s %6zuKB blocks, %u thread%s; %12" PRIu64
+                 " bytes compressed to %12" PRIu64 " (%5.1f%%) at %8.1f"
+                 " MB/s per thread\n",
+            substream(s).name, BlockCodec::get(codecs[s])->name(),
+            block_sizes[s] / 1024, thread_counts[s],
+            thread_counts[s] == 1 ? "" : "s", stats.bytes,
+            stats.compressed_bytes,
+            stats.bytes ? 100.0 * stats.compressed_bytes / stats.bytes : 0.0,
+            mb_per_sec);
+  }
+
+  int64_t compression_migrations = 0;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    int64_t m = writer(s).stats().cpu_migrations;
+    compression_migrations =
+        m < 0 || compression_migrations < 0 ? -1 : compression_migrations + m;
+  }
+  if (bind_to_cpu >= 0) {
+    fprintf(out, "  tracees bound to CPU %d", bind_to_cpu);
+    if (numa_node >= 0) {
+      fprintf(out, " on NUMA node %d", numa_node);
+    }
+    if (compression_cpus > 0) {
+      fprintf(out, "; compression threads on %d other CPU%s%s",
+              compression_cpus, compression_cpus == 1 ? "" : "s",
+              compression_on_numa_node ? " of that node" : "");
+    }
+    fputc('\n', out);
+  }
+  int64_t own_migrations = read_own_cpu_migrations();
+  if (own_migrations < 0 || compression_migrations < 0) {
+    fprintf(out, "  CPU migration counts are not available\n");
+  } else {
+    fprintf(out, "  CPU migrations: %" PRId64 " by rr's main thread, %" PRId64
+                 " by compression threads\n",
+            own_migrations, compression_migrations);
+  }
+}
+
 void TraceWriter::close() {
   for (auto& w : writers) {
     w->close();
   }
+  if (!index_written) {
+    index_written = true;
+    if (num_cores) {
+      ofstream out(args_env_path(), ios::app);
+      out << ' ' << num_cores;
+    }
+    write_index();
+    write_process_index();
+    write_markers();
+    // Everything's written; followers can stop waiting for more.
+    unlink(recording_path().c_str());
+    unlink(follow_request_path().c_str());
+    if (sink) {
+      finish_stream();
+    }
+  }
 }
 
-static string make_trace_dir(const string& exe_path) {
+void TraceWriter::finish_stream() {
+  // These files are only complete now, so they follow the substreams.
+  // The substreams got to the sink block by block.
+  string files[] = { version_path(), args_env_path(), index_path(),
+                     process_index_path(), markers_path() };
+  for (auto& f : files) {
+    if (!sink->write_file(f.substr(trace_dir.size() + 1), f)) {
+      break;
+    }
+  }
+  if (!sink->finish()) {
+    LOG(error) << "Streaming trace " << trace_dir << " failed";
+  }
+  if (stream_only()) {
+    for (auto& f : files) {
+      unlink(f.c_str());
+    }
+    if (rmdir(trace_dir.c_str())) {
+      LOG(warn) << "Left files behind in " << trace_dir;
+    }
+  }
+}
+
+void TraceStream::write_index_file(
+    const vector<CompressedWriter::BlockIndexEntry>* const
+        blocks[SUBSTREAM_COUNT],
+    const vector<FramePosition>& frames) {
+  CompressedWriter index(index_path(), 64 * 1024, 1);
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    index << *blocks[s];
+  }
+  index << frames;
+  index.close();
+  if (!index.good()) {
+    // The trace is still usable without an index; seeks are just slower.
+    LOG(warn) << "Unable to write trace index " << index_path();
+  }
+}
+
+bool TraceStream::read_index_file(
+    shared_ptr<CompressedReader::BlockIndex> blocks[SUBSTREAM_COUNT],
+    vector<FramePosition>& frames) {
+  // Traces from older rr versions, or whose recording was cut short, may
+  // not have an index.
+  CompressedReader index(index_path());
+  if (!index.good()) {
+    return false;
+  }
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    blocks[s] = make_shared<CompressedReader::BlockIndex>();
+    index >> *blocks[s];
+  }
+  index >> frames;
+  if (!index.good()) {
+    LOG(warn) << "Ignoring unreadable trace index " << index_path();
+    return false;
+  }
+  return true;
+}
+
+void TraceWriter::write_index() {
+  const vector<CompressedWriter::BlockIndexEntry>* blocks[SUBSTREAM_COUNT];
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    blocks[s] = &writer(s).block_index();
+  }
+  write_index_file(blocks, frame_index);
+}
+
+/*static*/ string TraceStream::make_trace_dir(const string& exe_path) {
   ensure_default_rr_trace_dir();
 
   // Find a unique trace directory name.
@@ -492,21 +1942,96 @@ static string make_trace_dir(const string& exe_path) {
   return dir;
 }
 
+static string trace_name(const string& dir) {
+  size_t last_slash = dir.rfind('/');
+  return last_slash == string::npos ? dir : dir.substr(last_slash + 1);
+}
+
 TraceWriter::TraceWriter(const vector<string>& argv, const vector<string>& envp,
-                         const string& cwd, int bind_to_cpu)
+                         const string& cwd, int bind_to_cpu,
+                         bool cpuid_faulting,
+                         const CompressionOptions& compression,
+                         shared_ptr<TraceSink> sink)
     : TraceStream(make_trace_dir(argv[0]),
                   // Somewhat arbitrarily start the
                   // global time from 1.
                   1),
-      mmap_count(0) {
+      sink(sink),
+      mmap_count(0),
+      next_frame_index_offset(substream(EVENTS).block_size),
+      index_written(false),
+      last_follow_flush_seconds(0),
+      dedup_raw_data(false),
+      lazy_mapping_threshold(0),
+      file_reads_by_reference(false),
+      read_snapshot_count(0),
+      numa_node(-1),
+      compression_cpus(0),
+      compression_on_numa_node(false) {
   this->argv = argv;
   this->envp = envp;
   this->cwd = cwd;
   this->bind_to_cpu = bind_to_cpu;
+  this->cpuid_faulting = cpuid_faulting;
 
+  // Split the memory budget in proportion to the substreams' default
+  // buffer sizes.
+  SubstreamPolicy policies[SUBSTREAM_COUNT];
+  size_t default_total = 0;
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
-    writers[s] = unique_ptr<CompressedWriter>(new CompressedWriter(
-        path(s), substream(s).block_size, substream(s).threads));
+    policies[s] = substream_policy(s, compression);
+    default_total += default_buffer_size(policies[s]);
+  }
+  if (sink) {
+    sink->begin(trace_name(trace_dir));
+  }
+  // Tracees and rr's main thread will be bound to |bind_to_cpu|. Keep the
+  // compression threads off it so they don't compete with the tracee;
+  // threads inherit the affinity they're created with. On NUMA machines,
+  // also keep them on |bind_to_cpu|'s node if it has other CPUs we may
+  // use, so compressing doesn't pull the trace buffers (which the main
+  // thread first touches, placing them on that node) across the
+  // interconnect. Tracee memory such as the syscallbuf and scratch areas
+  // is first touched by tracees, so it's already on that node.
+  cpu_set_t old_affinity;
+  bool restore_affinity = false;
+  if (bind_to_cpu >= 0 &&
+      !sched_getaffinity(0, sizeof(old_affinity), &old_affinity) &&
+      CPU_COUNT(&old_affinity) > 1) {
+    cpu_set_t others = old_affinity;
+    CPU_CLR(bind_to_cpu, &others);
+    cpu_set_t node_others;
+    CPU_ZERO(&node_others);
+    for (int cpu : numa_node_cpus(bind_to_cpu, &numa_node)) {
+      if (CPU_ISSET(cpu, &others)) {
+        CPU_SET(cpu, &node_others);
+      }
+    }
+    if (CPU_COUNT(&node_others) > 0) {
+      others = node_others;
+      compression_on_numa_node = true;
+    }
+    restore_affinity = !sched_setaffinity(0, sizeof(others), &others);
+    if (restore_affinity) {
+      compression_cpus = CPU_COUNT(&others);
+    }
+  }
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    SubstreamPolicy& policy = policies[s];
+    if (compression.memory_budget) {
+      policy.options.memory_budget =
+          (size_t)((double)compression.memory_budget *
+                   default_buffer_size(policy) / default_total);
+    }
+    writers[s] = unique_ptr<CompressedWriter>(
+        new CompressedWriter(path(s), policy.block_size, policy.threads,
+                             policy.options, sink.get()));
+    codecs[s] = policy.options.codec;
+    block_sizes[s] = policy.block_size;
+    thread_counts[s] = policy.threads;
+  }
+  if (restore_affinity) {
+    sched_setaffinity(0, sizeof(old_affinity), &old_affinity);
   }
 
   string ver_path = version_path();
@@ -517,19 +2042,71 @@ TraceWriter::TraceWriter(const vector<string>& argv, const vector<string>& envp,
   version << TRACE_VERSION << endl;
 
   if (!probably_not_interactive(STDOUT_FILENO)) {
-    printf("rr: Saving the execution of `%s' to trace directory `%s'.\n",
-           argv[0].c_str(), trace_dir.c_str());
+    if (stream_only()) {
+      printf("rr: Streaming the execution of `%s' as trace `%s'.\n",
+             argv[0].c_str(), trace_name(trace_dir).c_str());
+    } else {
+      printf("rr: Saving the execution of `%s' to trace directory `%s'.\n",
+             argv[0].c_str(), trace_dir.c_str());
+    }
   }
 
   ofstream out(args_env_path());
   out << cwd << '\0';
   out << argv;
   out << envp;
-  out << bind_to_cpu;
+  out << bind_to_cpu << ' ' << cpuid_faulting;
   assert(out.good());
+
+  if (!stream_only()) {
+    write_recording_marker();
+  }
+}
+
+void TraceWriter::write_recording_marker() {
+  // Replace the file atomically so followers never see a partial one.
+  string tmp_path = recording_path() + ".tmp";
+  {
+    ofstream out(tmp_path);
+    out << getpid() << ' ' << time() - 1 << endl;
+  }
+  if (rename(tmp_path.c_str(), recording_path().c_str())) {
+    LOG(warn) << "Can't write " << recording_path();
+  }
+}
+
+// How often maybe_flush_for_followers() looks for followers.
+static const double FOLLOW_FLUSH_INTERVAL_SECONDS = 1.0;
+
+void TraceWriter::maybe_flush_for_followers() {
+  if (stream_only() || index_written) {
+    return;
+  }
+  double now = monotonic_now_sec();
+  if (now - last_follow_flush_seconds < FOLLOW_FLUSH_INTERVAL_SECONDS) {
+    return;
+  }
+  last_follow_flush_seconds = now;
+  if (access(follow_request_path().c_str(), F_OK)) {
+    // Nobody's following, so don't cut blocks short.
+    return;
+  }
+  // A follower that has read frame N looks for the data recorded for
+  // frames up to N in the other substreams, and takes their end to mean
+  // there is none. So they must be flushed before the frames are.
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    if (s != EVENTS) {
+      writer(s).flush();
+    }
+  }
+  writer(EVENTS).flush();
+  write_recording_marker();
 }
 
 void TraceWriter::make_latest_trace() {
+  if (stream_only()) {
+    return;
+  }
   string link_name = latest_trace_symlink();
   // Try to update the symlink to |this|.  We only try attempt
   // to set the symlink once.  If the link is re-created after
@@ -545,16 +2122,22 @@ void TraceWriter::make_latest_trace() {
 }
 
 TraceFrame TraceReader::peek_frame() {
+  TraceFrame frame;
+  peek_frame(frame);
+  return frame;
+}
+
+void TraceReader::peek_frame(TraceFrame& frame) {
+  if (at_end()) {
+    frame = TraceFrame();
+    return;
+  }
   auto& events = reader(EVENTS);
   events.save_state();
   auto saved_time = global_time;
-  TraceFrame frame;
-  if (!at_end()) {
-    frame = read_frame();
-  }
+  read_frame(frame, DONT_UPDATE_FRAME_STATES);
   events.restore_state();
   global_time = saved_time;
-  return frame;
 }
 
 TraceFrame TraceReader::peek_to(pid_t pid, EventType type, SyscallState state) {
@@ -563,12 +2146,13 @@ TraceFrame TraceReader::peek_to(pid_t pid, EventType type, SyscallState state) {
   events.save_state();
   auto saved_time = global_time;
   while (good() && !at_end()) {
-    frame = read_frame();
+    read_frame(frame, UPDATE_FRAME_STATES_UNDOABLE);
     if (frame.tid() == pid && frame.event().type() == type &&
         (!frame.event().is_syscall_event() ||
          frame.event().Syscall().state == state)) {
       events.restore_state();
       global_time = saved_time;
+      undo_frame_states();
       return frame;
     }
   }
@@ -577,23 +2161,157 @@ TraceFrame TraceReader::peek_to(pid_t pid, EventType type, SyscallState state) {
   return frame;
 }
 
+void TraceReader::load_index() {
+  frame_index = make_shared<vector<FramePosition> >();
+
+  // Without an index, seeks fall back to reading sequentially.
+  shared_ptr<CompressedReader::BlockIndex> blocks[SUBSTREAM_COUNT];
+  vector<FramePosition> frames;
+  if (!read_index_file(blocks, frames)) {
+    return;
+  }
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    reader(s).set_block_index(blocks[s]);
+  }
+  frame_index->swap(frames);
+}
+
+vector<TraceFrame::Time> TraceReader::indexed_frame_times() {
+  if (!frame_index) {
+    load_index();
+  }
+  vector<TraceFrame::Time> result;
+  for (auto& pos : *frame_index) {
+    result.push_back(pos.time);
+  }
+  return result;
+}
+
+TraceFrame::Time TraceReader::time_at_seconds(double seconds) const {
+  TraceReader trace(*this);
+  trace.rewind();
+  if (trace.at_end()) {
+    return 0;
+  }
+  double goal = trace.peek_frame().monotonic_time() + seconds;
+
+  // Find the last indexed frame recorded before |goal|; frames are recorded
+  // in order, so their timestamps only increase.
+  vector<TraceFrame::Time> times = trace.indexed_frame_times();
+  size_t lo = 0;
+  size_t hi = times.size();
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    TraceReader probe(trace);
+    probe.seek_to_time(times[mid]);
+    if (!probe.at_end() && probe.peek_frame().monotonic_time() < goal) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo > 0) {
+    trace.seek_to_time(times[lo - 1]);
+  }
+
+  while (!trace.at_end()) {
+    TraceFrame frame = trace.read_frame();
+    if (frame.monotonic_time() >= goal) {
+      return frame.time();
+    }
+  }
+  return 0;
+}
+
+void TraceReader::seek_to_time(TraceFrame::Time time) {
+  if (!frame_index) {
+    load_index();
+  }
+
+  // Jump to the last indexed frame at or before |time|, if that's ahead
+  // of us.
+  auto it = upper_bound(frame_index->begin(), frame_index->end(), time,
+                        [](TraceFrame::Time t, const FramePosition& pos) {
+                          return t < pos.time;
+                        });
+  if (it != frame_index->begin()) {
+    --it;
+    if (it->time > global_time + 1) {
+      for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+        if (s == STRINGS) {
+          // Strings read so far stay valid; later ones are read on demand.
+          continue;
+        }
+        if (!reader(s).seek(it->offsets[s])) {
+          FATAL() << "Trace index " << index_path() << " is corrupt";
+        }
+      }
+      global_time = it->time - 1;
+      frame_states.clear();
+    }
+  }
+
+  TraceFrame frame;
+  RawData data;
+  while (!at_end()) {
+    peek_frame(frame);
+    if (frame.time() >= time) {
+      break;
+    }
+    read_frame(frame);
+    while (read_raw_data_for_frame(frame, data)) {
+    }
+    while (true) {
+      MappedData data;
+      bool found;
+      read_mapped_region(&data, &found);
+      if (!found) {
+        break;
+      }
+    }
+  }
+}
+
 void TraceReader::rewind() {
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
     reader(s).rewind();
   }
   global_time = 0;
+  frame_states.clear();
+  strings.clear();
   assert(good());
 }
 
+/**
+ * True while the recorder that wrote |recording_path| is running.
+ */
+static bool recorder_running(const string& recording_path) {
+  ifstream in(recording_path);
+  pid_t pid = 0;
+  if (!(in >> pid) || pid <= 0) {
+    return false;
+  }
+  return kill(pid, 0) == 0 || errno == EPERM;
+}
+
 TraceReader::TraceReader(const string& dir)
     : TraceStream(dir.empty() ? latest_trace_symlink() : dir,
                   // Initialize the global time at 0, so
                   // that when we tick it when reading
                   // the first trace, it matches the
                   // initial global time at recording, 1.
-                  0) {
+                  0),
+      backing_files(make_shared<map<string, BackingFile> >()) {
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
     readers[s] = unique_ptr<CompressedReader>(new CompressedReader(path(s)));
+    if (s == RAW_DATA && !Flags::get().block_cache_dir.empty()) {
+      readers[s]->set_block_cache_dir(Flags::get().block_cache_dir);
+    } else if (substream(s).read_ahead) {
+      readers[s]->set_read_ahead(Flags::get().read_ahead_blocks);
+    }
+    // Start reading the beginning of every substream at once, instead of
+    // waiting for each in turn when a trace is on slow or remote storage.
+    readers[s]->prefetch();
   }
 
   string path = version_path();
@@ -635,7 +2353,23 @@ TraceReader::TraceReader(const string& dir)
   cwd = buf;
   in >> argv;
   in >> envp;
-  in >> bind_to_cpu;
+  in >> bind_to_cpu >> cpuid_faulting;
+  if (!(in >> num_cores)) {
+    num_cores = 0;
+  }
+
+  if (Flags::get().follow_trace && recorder_running(recording_path())) {
+    // Ask the recorder to flush the trace regularly, and wait for it
+    // wherever we get to the end of what it has flushed. Only the end of
+    // EVENTS is the end of the trace; see maybe_flush_for_followers().
+    ScopedFd request(follow_request_path().c_str(),
+                     O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    string marker = recording_path();
+    auto running = [marker]() { return recorder_running(marker); };
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      readers[s]->set_follow(running, s == EVENTS);
+    }
+  }
 }
 
 /**
@@ -644,7 +2378,8 @@ TraceReader::TraceReader(const string& dir)
  * clone won't affect the state of 'other' (and vice versa).
  */
 TraceReader::TraceReader(const TraceReader& other)
-    : TraceStream(other.dir(), other.time()) {
+    : TraceStream(other.dir(), other.time()),
+      backing_files(other.backing_files) {
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
     readers[s] =
         unique_ptr<CompressedReader>(new CompressedReader(other.reader(s)));
@@ -654,6 +2389,11 @@ TraceReader::TraceReader(const TraceReader& other)
   envp = other.envp;
   cwd = other.cwd;
   bind_to_cpu = other.bind_to_cpu;
+  cpuid_faulting = other.cpuid_faulting;
+  num_cores = other.num_cores;
+  strings = other.strings;
+  frame_index = other.frame_index;
+  frame_states = other.frame_states;
 }
 
 uint64_t TraceReader::uncompressed_bytes() const {
@@ -664,6 +2404,14 @@ uint64_t TraceReader::uncompressed_bytes() const {
   return total;
 }
 
+double TraceReader::block_wait_seconds() const {
+  double total = 0;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    total += reader(s).block_wait_seconds();
+  }
+  return total;
+}
+
 uint64_t TraceReader::compressed_bytes() const {
   uint64_t total = 0;
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
@@ -672,4 +2420,182 @@ uint64_t TraceReader::compressed_bytes() const {
   return total;
 }
 
+vector<TraceReader::ChecksumReport> TraceReader::verify_checksums(
+    uint32_t threads) const {
+  vector<ChecksumReport> reports;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    ChecksumReport report;
+    report.file = substream(s).name;
+    report.blocks = reader(s).verify_checksums(threads, &report.bad_blocks);
+    reports.push_back(report);
+  }
+  // The index files are optional.
+  const char* index_files[] = { "index", "process_index" };
+  for (const char* name : index_files) {
+    string file_path = trace_dir + "/" + name;
+    if (access(file_path.c_str(), F_OK)) {
+      continue;
+    }
+    ChecksumReport report;
+    report.file = name;
+    CompressedReader index(file_path);
+    report.blocks = index.verify_checksums(threads, &report.bad_blocks);
+    reports.push_back(report);
+  }
+  return reports;
+}
+
+vector<string> TracePacker::read_strings() {
+  CompressedReader in(path(STRINGS));
+  vector<string> strings;
+  while (!in.at_end()) {
+    string s;
+    in >> s;
+    if (!in.good()) {
+      break;
+    }
+    strings.push_back(s);
+  }
+  return strings;
+}
+
+vector<string> TracePacker::backing_files(set<string>* changed) {
+  vector<string> strings = read_strings();
+  CompressedReader mmaps(path(MMAPS));
+  set<string> files;
+  while (!mmaps.at_end()) {
+    MmapRecord r;
+    mmaps >> r;
+    if (!mmaps.good()) {
+      break;
+    }
+    if (r.source != TraceReader::SOURCE_FILE ||
+        r.backing_file_name >= strings.size()) {
+      continue;
+    }
+    const string& name = strings[r.backing_file_name];
+    string file = absolute_backing_file(name);
+    files.insert(file);
+    // Names relative to the trace directory are copies we made, which only
+    // keep their size; read_mapped_region() checks the rest for the others.
+    // One mismatching record is enough to leave the file out: a file can be
+    // mapped, modified and mapped again during recording, and packing its
+    // current contents would silently replace what the earlier mappings
+    // saw, where replay would otherwise warn.
+    struct stat st;
+    if (name[0] == '/' && !changed->count(file) && !stat(file.c_str(), &st) &&
+        (st.st_size != r.file_size || st.st_ino != r.inode ||
+         st.st_mode != r.mode || st.st_uid != r.uid || st.st_gid != r.gid ||
+         st.st_mtime != r.mtime)) {
+      changed->insert(file);
+    }
+  }
+  return vector<string>(files.begin(), files.end());
+}
+
+bool TracePacker::pack(const CompressionOptions& options, int threads,
+                       const map<string, string>& renamed_files) {
+  shared_ptr<CompressedReader::BlockIndex> old_blocks[SUBSTREAM_COUNT];
+  vector<FramePosition> frames;
+  bool have_index = read_index_file(old_blocks, frames);
+  // Renamed backing files are appended to the string table.
+  vector<string> strings = read_strings();
+  unordered_map<string, uint32_t> string_ids;
+  for (uint32_t i = 0; i < strings.size(); ++i) {
+    string_ids.insert(make_pair(strings[i], i));
+  }
+
+  unique_ptr<CompressedWriter> writers[SUBSTREAM_COUNT];
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    string tmp_path = path(s) + ".pack";
+    unlink(tmp_path.c_str());
+    unlink(BlockDictionary::path_for(tmp_path).c_str());
+    SubstreamPolicy policy = substream_policy(s, options, threads);
+    policy.options.memory_budget = options.memory_budget;
+    writers[s] = unique_ptr<CompressedWriter>(new CompressedWriter(
+        tmp_path, policy.block_size, policy.threads, policy.options));
+    CompressedReader in(path(s));
+    if (s == STRINGS) {
+      for (auto& str : strings) {
+        *writers[s] << str;
+      }
+    } else if (s != MMAPS) {
+      // Only the compression changes, so uncompressed offsets stay valid.
+      uint64_t remaining = in.uncompressed_bytes();
+      vector<uint8_t> storage;
+      while (remaining > 0 && in.good()) {
+        size_t amount = (size_t)min<uint64_t>(remaining, 1024 * 1024);
+        const uint8_t* data;
+        if (in.read_view(amount, &data, storage)) {
+          writers[s]->write(data, amount);
+        }
+        remaining -= amount;
+      }
+    } else {
+      // Rewriting file names moves records, so find each indexed frame's
+      // first record by time.
+      size_t next_frame = 0;
+      while (!in.at_end() && in.good()) {
+        MmapRecord r;
+        in >> r;
+        if (!in.good()) {
+          break;
+        }
+        for (; next_frame < frames.size() && frames[next_frame].time <= r.time;
+             ++next_frame) {
+          frames[next_frame].offsets[MMAPS] = writers[s]->bytes_written();
+        }
+        if (r.source == TraceReader::SOURCE_FILE) {
+          if (r.backing_file_name >= strings.size()) {
+            FATAL() << "Trace string table has no string "
+                    << r.backing_file_name;
+          }
+          auto it = renamed_files.find(
+              absolute_backing_file(strings[r.backing_file_name]));
+          if (it != renamed_files.end()) {
+            auto id = string_ids.insert(make_pair(it->second, strings.size()));
+            if (id.second) {
+              strings.push_back(it->second);
+            }
+            r.backing_file_name = id.first->second;
+          }
+        }
+        *writers[s] << r;
+      }
+      for (; next_frame < frames.size(); ++next_frame) {
+        frames[next_frame].offsets[MMAPS] = writers[s]->bytes_written();
+      }
+    }
+    writers[s]->close();
+    if (!in.good() || !writers[s]->good()) {
+      LOG(error) << "Failed to repack " << path(s);
+      for (Substream t = SUBSTREAM_FIRST; t <= s; ++t) {
+        unlink((path(t) + ".pack").c_str());
+        unlink(BlockDictionary::path_for(path(t) + ".pack").c_str());
+      }
+      return false;
+    }
+  }
+
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    if (rename((path(s) + ".pack").c_str(), path(s).c_str())) {
+      FATAL() << "Failed to replace " << path(s);
+    }
+    // The new stream may or may not have a dictionary of its own.
+    string dictionary_path = BlockDictionary::path_for(path(s));
+    if (rename(BlockDictionary::path_for(path(s) + ".pack").c_str(),
+               dictionary_path.c_str())) {
+      unlink(dictionary_path.c_str());
+    }
+  }
+
+  const vector<CompressedWriter::BlockIndexEntry>* blocks[SUBSTREAM_COUNT];
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    blocks[s] = &writers[s]->block_index();
+  }
+  unlink(index_path().c_str());
+  write_index_file(blocks, have_index ? frames : vector<FramePosition>());
+  return true;
+}
+
 } // namespace rr
@@ -3,18 +3,24 @@
 #ifndef RR_TRACE_H_
 #define RR_TRACE_H_
 
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <functional>
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "CompressedReader.h"
 #include "CompressedWriter.h"
 #include "Event.h"
 #include "remote_ptr.h"
+#include "ScopedFd.h"
 #include "TraceFrame.h"
+#include "TraceSink.h"
 #include "TraceTaskEvent.h"
 
 namespace rr {
@@ -50,9 +56,30 @@ public:
     MMAPS,
     // Substream that stores task creation and exec events
     TASKS,
+    // Substream that stores each distinct string in MMAPS and TASKS
+    // records once; the records store the string's index instead. Strings
+    // are only ever appended, so it's read from the start as needed rather
+    // than seeked.
+    STRINGS,
     SUBSTREAM_COUNT
   };
 
+  /** Return the name of the file storing substream |s|. */
+  static const char* substream_name(Substream s);
+  /**
+   * Set |s| to the substream whose file is called |name|. Returns false if
+   * there isn't one.
+   */
+  static bool parse_substream_name(const std::string& name, Substream* s);
+
+  /**
+   * Create a new, uniquely named directory for a trace of |exe_path| in the
+   * directory traces are saved to, and return its path.
+   */
+  static string make_trace_dir(const string& exe_path);
+  /** Return the directory traces are saved to. */
+  static string save_dir();
+
   /** Return the directory storing this trace's files. */
   const string& dir() const { return trace_dir; }
 
@@ -61,6 +88,16 @@ public:
   const std::vector<string>& initial_envp() const { return envp; }
   const string& initial_cwd() const { return cwd; }
   int bound_to_cpu() const { return bind_to_cpu; }
+  /**
+   * True if tracees' cpuid instructions trapped during recording. Replaying
+   * the EV_SEGV_CPUID events this produced needs CPUID faulting too.
+   */
+  bool uses_cpuid_faulting() const { return cpuid_faulting; }
+  /**
+   * The number of cores tracees were told they had, or 0 if the trace
+   * doesn't say (it wasn't closed cleanly, or is from an older rr).
+   */
+  int pretend_num_cores() const { return num_cores; }
 
   /**
    * Return the current "global time" (event count) for this
@@ -68,9 +105,43 @@ public:
    */
   TraceFrame::Time time() const { return global_time; }
 
+  struct ExecRecord {
+    string file_name;
+    std::vector<string> cmd_line;
+  };
+  /**
+   * One process in the process index.
+   */
+  struct ProcessRecord {
+    pid_t pid;
+    // 0 for the initial process
+    pid_t ppid;
+    // Global times of the process's creation and of its main thread's
+    // exit. |last_time| is 0 if the process hadn't exited when recording
+    // ended.
+    TraceFrame::Time first_time;
+    TraceFrame::Time last_time;
+    // The status passed to exit()/exit_group(), or -1 if unknown
+    int exit_code;
+    // Every exec in the process, in order
+    std::vector<ExecRecord> execs;
+  };
+  /**
+   * A marker a tracee wrote to RR_MAGIC_MARKER_FD. |time| is the event of
+   * the write.
+   */
+  struct MarkerRecord {
+    string name;
+    TraceFrame::Time time;
+    pid_t tid;
+  };
+
 protected:
   TraceStream(const string& trace_dir, TraceFrame::Time initial_time)
-      : trace_dir(trace_dir), global_time(initial_time) {}
+      : trace_dir(trace_dir),
+        cpuid_faulting(false),
+        num_cores(0),
+        global_time(initial_time) {}
 
   /**
    * Return the path of the file for the given substream.
@@ -88,6 +159,83 @@ protected:
    * trace.
    */
   string version_path() const { return trace_dir + "/version"; }
+  /**
+   * Return the path of the "index" file, which records where blocks and
+   * frames start in each substream so readers can seek.
+   */
+  string index_path() const { return trace_dir + "/index"; }
+  /**
+   * Return the path of the "process_index" file, which summarizes every
+   * process in the trace so they can be found without reading the whole
+   * TASKS substream.
+   */
+  string process_index_path() const { return trace_dir + "/process_index"; }
+  /**
+   * Return the path of the "markers" file, which lists the markers tracees
+   * wrote, in order.
+   */
+  string markers_path() const { return trace_dir + "/markers"; }
+  /**
+   * Return the path of the "recording" file, which exists while the trace
+   * is being recorded. It holds the recorder's pid and how many frames had
+   * been flushed for followers when it was last updated.
+   */
+  string recording_path() const { return trace_dir + "/recording"; }
+  /**
+   * Return the path of the "follow" file. Readers following the recording
+   * create it to ask the recorder to flush the trace regularly.
+   */
+  string follow_request_path() const { return trace_dir + "/follow"; }
+
+
+  /**
+   * The uncompressed offsets of every substream just before the frame at
+   * |time| is read. TraceWriter records one of these per EVENTS block.
+   */
+  struct FramePosition {
+    TraceFrame::Time time;
+    uint64_t offsets[SUBSTREAM_COUNT];
+  };
+
+  /**
+   * When raw data deduplication is enabled, RAW_DATA records are split into
+   * chunks of this size. A chunk that has been stored before is replaced by
+   * a reference to the RAW_DATA offset of the earlier copy, recorded in the
+   * RAW_DATA_HEADER. Whether or not deduplication is enabled, chunks of
+   * zeroes aren't stored at all; the RAW_DATA_HEADER just marks them.
+   */
+  static const size_t RAW_DATA_CHUNK_SIZE = 4096;
+
+  /**
+   * EVENTS records are delta-encoded against the previous frame of the same
+   * task: ticks are stored relative to that frame's, and registers that
+   * haven't changed since are omitted. The writer forgets all this state at
+   * every FramePosition, so readers can start decoding there.
+   */
+  struct TaskFrameState {
+    Ticks ticks;
+    Registers regs;
+    ExtraRegisters extra_regs;
+    // True once a frame with exec info has set |regs| and |extra_regs|
+    bool have_regs;
+    TaskFrameState() : ticks(0), have_regs(false) {}
+  };
+  typedef std::unordered_map<pid_t, TaskFrameState> TaskFrameStates;
+
+  /**
+   * Write the index file, given every substream's blocks and the frame
+   * positions.
+   */
+  void write_index_file(
+      const std::vector<CompressedWriter::BlockIndexEntry>* const
+          blocks[SUBSTREAM_COUNT],
+      const std::vector<FramePosition>& frames);
+  /**
+   * Read the index file. Returns false if there's no usable index.
+   */
+  bool read_index_file(
+      std::shared_ptr<CompressedReader::BlockIndex> blocks[SUBSTREAM_COUNT],
+      std::vector<FramePosition>& frames);
 
   /**
    * Increment the global time and return the incremented value.
@@ -103,6 +251,8 @@ protected:
   string cwd;
   // CPU core# that the tracees are bound to
   int bind_to_cpu;
+  bool cpuid_faulting;
+  int num_cores;
 
   // Arbitrary notion of trace time, ticked on the recording of
   // each event (trace frame).
@@ -136,12 +286,90 @@ public:
    * restored to.
    */
   void write_raw(const void* data, size_t len, remote_ptr<void> addr);
+  /**
+   * Like write_raw, but the data is produced by calling 'fill' to write
+   * 'size' bytes starting at 'offset' within the record into 'buf', possibly
+   * several times. Unless the data has to be deduplicated, 'buf' is the
+   * RAW_DATA writer's own buffer, so e.g. tracee memory can be read straight
+   * into it without an intermediate copy.
+   */
+  typedef std::function<void(uint8_t* buf, size_t offset, size_t size)>
+      RawDataFiller;
+  void write_raw_filled(size_t len, remote_ptr<void> addr,
+                        const RawDataFiller& fill);
+
+  /**
+   * Store repeated RAW_DATA_CHUNK_SIZE chunks of raw data only once.
+   * Costs some hashing during recording and memory for the chunk table.
+   */
+  void set_dedup_raw_data(bool dedup) { dedup_raw_data = dedup; }
+
+  /**
+   * Read-only private file mappings at least |bytes| long that would be
+   * copied into the trace are instead recorded as a hash of their data.
+   * Replay maps the original file and fails if it has changed. 0 disables
+   * this.
+   */
+  void set_lazy_mapping_threshold(uint64_t bytes) {
+    lazy_mapping_threshold = bytes;
+  }
+
+  /**
+   * Use |dir| (created if necessary) as a content-addressed store for
+   * mapped files that would otherwise be copied into the trace, or that
+   * can't be hardlinked into it. Such files are added to the store once,
+   * under the hash of their contents, and hardlinked into each trace from
+   * there, so traces on the store's filesystem share one copy of them.
+   * An object's link count is its reference count: objects that no trace
+   * links to any more are deleted when the store is next opened.
+   */
+  void set_object_store(const std::string& dir);
+
+  /**
+   * Record data that tracees read from regular files as references into
+   * reflinked snapshots of the files; see write_raw_file_ref().
+   */
+  /**
+   * Note the number of cores tracees were told they had. It's stored in
+   * the trace when it's closed.
+   */
+  void set_pretend_num_cores(int cores) { num_cores = cores; }
+
+  void set_file_reads_by_reference(bool by_reference) {
+    file_reads_by_reference = by_reference;
+  }
+  bool file_reads_by_reference_enabled() const {
+    return file_reads_by_reference;
+  }
+
+  /**
+   * Like write_raw(), for |len| bytes that were read from |offset| in the
+   * regular file |file_name|, which |stat| describes. Instead of the data,
+   * record a reference to the same bytes in a reflinked snapshot of the
+   * file in the trace directory. A file gets a new snapshot when its
+   * modification time or size changes; files modified in the last couple
+   * of seconds aren't snapshotted at all. Returns false, having written
+   * nothing, if the file can't be snapshotted; the caller must then
+   * write_raw() the data.
+   */
+  bool write_raw_file_ref(const std::string& file_name,
+                          const struct stat& stat, uint64_t offset,
+                          size_t len, remote_ptr<void> addr);
 
   /**
    * Write a task event (clone or exec record) to the trace.
    */
   void write_task_event(const TraceTaskEvent& event);
 
+  /**
+   * Note that task |tid| wrote the marker |name| during the current event.
+   * Markers are indexed when the trace is closed.
+   */
+  void write_marker(const string& name, pid_t tid) {
+    MarkerRecord m = { name, global_time, tid };
+    markers.push_back(m);
+  }
+
   /**
    * Return true iff all trace files are "good".
    */
@@ -154,36 +382,147 @@ public:
    */
   void close();
 
+  /**
+   * Print how much each substream's writer was held up by compression,
+   * and how each substream was compressed and how fast. Call after close().
+   */
+  void dump_write_stats(FILE* out) const;
+
+  /**
+   * If a reader is following the recording (see Flags::follow_trace),
+   * flush everything recorded so far to the trace files, at most once a
+   * second.
+   */
+  void maybe_flush_for_followers();
+
+  /**
+   * How far substream |s| has been written; see CompressedWriter::Progress.
+   */
+  CompressedWriter::Progress progress(Substream s) {
+    return writer(s).progress();
+  }
+
   /**
    * Create a trace that will record the initial exe
    * image |argv[0]| with initial args |argv|, initial environment |envp|,
-   * current working directory |cwd| and bound to cpu |bind_to_cpu|. This
-   * data is recored in the trace.
+   * current working directory |cwd| and bound to cpu |bind_to_cpu|, with
+   * tracees' cpuid trapping if |cpuid_faulting|. This
+   * data is recored in the trace. Trace blocks are compressed according
+   * to |compression|. If |sink| is non-null the trace is also streamed to
+   * it; see TraceSink.
    * The trace name is determined by the global rr args and environment.
    */
   TraceWriter(const std::vector<std::string>& argv,
               const std::vector<std::string>& envp, const string& cwd,
-              int bind_to_cpu);
+              int bind_to_cpu, bool cpuid_faulting,
+              const CompressionOptions& compression = CompressionOptions(),
+              std::shared_ptr<TraceSink> sink = nullptr);
 
   /**
    * We got far enough into recording that we should set this as the latest
-   * trace.
+   * trace. Does nothing if the trace is only being streamed.
    */
   void make_latest_trace();
 
+  /**
+   * True if the trace is streamed to a sink and not kept locally.
+   */
+  bool stream_only() const { return sink && !sink->keep_local_files(); }
+
 private:
   std::string try_hardlink_file(const std::string& file_name);
+  std::string try_clone_file(const std::string& file_name,
+                             const struct stat& stat,
+                             const std::string& name_prefix);
+  bool try_hash_mapped_file(const KernelMapping& km, const struct stat& stat,
+                            uint64_t* content_hash);
+  std::string try_copy_mapped_file(const KernelMapping& km,
+                                   const struct stat& stat);
+  std::string try_link_stored_object(const std::string& file_name,
+                                     const struct stat& stat);
+  void write_index();
+  /**
+   * Finish a RAW_DATA_HEADER record with its chunk references.
+   */
+  void write_raw_refs(
+      const std::vector<std::pair<uint32_t, uint64_t> >& refs);
+  void update_process_index(const TraceTaskEvent& event);
+  void write_process_index();
+  void write_markers();
+  void write_recording_marker();
+  void finish_stream();
+
+  struct ChunkHash {
+    uint64_t h[2];
+    bool operator==(const ChunkHash& other) const {
+      return h[0] == other.h[0] && h[1] == other.h[1];
+    }
+  };
+  struct ChunkHashHasher {
+    size_t operator()(const ChunkHash& hash) const { return hash.h[0]; }
+  };
 
   CompressedWriter& writer(Substream s) { return *writers[s]; }
   const CompressedWriter& writer(Substream s) const { return *writers[s]; }
 
+  std::shared_ptr<TraceSink> sink;
   std::unique_ptr<CompressedWriter> writers[SUBSTREAM_COUNT];
   /**
    * Files that have already been mapped without being copied to the trace,
    * i.e. that we have already assumed to be immutable.
    */
   std::set<std::pair<dev_t, ino_t> > files_assumed_immutable;
+  /**
+   * Devices whose files can't be reflinked into the trace directory.
+   */
+  std::set<dev_t> devices_without_clone;
   uint32_t mmap_count;
+  /**
+   * Return the STRINGS index of |s|, writing it there if it's new.
+   */
+  uint32_t intern(const string& s);
+  std::unordered_map<string, uint32_t> string_ids;
+  std::vector<ProcessRecord> processes;
+  std::vector<MarkerRecord> markers;
+  /* Index into |processes| of each live process, by pid */
+  std::unordered_map<pid_t, size_t> live_processes;
+  /* Pid of each live task's process, by tid */
+  std::unordered_map<pid_t, pid_t> tid_to_pid;
+  std::vector<FramePosition> frame_index;
+  /* EVENTS offset after which the next FramePosition is recorded */
+  uint64_t next_frame_index_offset;
+  bool index_written;
+  double last_follow_flush_seconds;
+  TaskFrameStates frame_states;
+  // Scratch space for assembling an EVENTS record before writing it
+  std::vector<uint8_t> frame_buffer;
+  // Scratch space for the changed chunks of a frame's extra registers
+  std::vector<uint8_t> extra_regs_delta;
+  bool dedup_raw_data;
+  uint64_t lazy_mapping_threshold;
+  /* RAW_DATA offsets of chunks stored so far, when deduplicating */
+  std::unordered_map<ChunkHash, uint64_t, ChunkHashHasher> raw_data_chunks;
+  bool file_reads_by_reference;
+  struct ReadSnapshot {
+    struct timespec mtime;
+    off_t size;
+    /* Relative to the trace directory */
+    std::string name;
+  };
+  /* The latest snapshot of each file read by reference */
+  std::map<std::pair<dev_t, ino_t>, ReadSnapshot> read_snapshots;
+  uint32_t read_snapshot_count;
+  /* Directory of the object store, or empty if there isn't one */
+  std::string object_store;
+  /* NUMA node of |bind_to_cpu|, or -1 if unknown or unbound */
+  int numa_node;
+  /* Number of CPUs the compression threads were allowed to run on */
+  int compression_cpus;
+  bool compression_on_numa_node;
+  /* How each substream is compressed, for dump_write_stats() */
+  BlockCodec::Type codecs[SUBSTREAM_COUNT];
+  size_t block_sizes[SUBSTREAM_COUNT];
+  uint32_t thread_counts[SUBSTREAM_COUNT];
 };
 
 class TraceReader : public TraceStream {
@@ -196,6 +535,16 @@ public:
     std::vector<uint8_t> data;
     remote_ptr<void> addr;
   };
+  /**
+   * Like RawData, but |data| points into the trace reader's buffers (or a
+   * mapping of an uncompressed trace file) instead of owning a copy. Only
+   * valid until the next read from this TraceReader.
+   */
+  struct RawDataRef {
+    const uint8_t* data;
+    size_t size;
+    remote_ptr<void> addr;
+  };
 
   /**
    * Read relevant data from the trace.
@@ -205,6 +554,11 @@ public:
    * frame.
    */
   TraceFrame read_frame();
+  /**
+   * Like read_frame(), but decodes into |frame|, reusing its storage, so
+   * reading every frame into the same TraceFrame doesn't allocate.
+   */
+  void read_frame(TraceFrame& frame);
 
   enum MappedDataSource { SOURCE_TRACE, SOURCE_FILE, SOURCE_ZERO };
   /**
@@ -227,6 +581,19 @@ public:
    */
   KernelMapping read_mapped_region(MappedData* data, bool* found = nullptr);
 
+  /**
+   * If the tracee identity of backing file |file_name| (the stat and name
+   * of an fd opened for it in a tracee) was cached with
+   * cache_backing_file_identity(), return true and set |st| and
+   * |real_name|. Mapping the same libraries over and over then doesn't
+   * need /proc lookups each time. Clones of this reader share the cache.
+   */
+  bool cached_backing_file_identity(const string& file_name, struct stat* st,
+                                    string* real_name);
+  void cache_backing_file_identity(const string& file_name,
+                                   const struct stat& st,
+                                   const string& real_name);
+
   /**
    * Peek at the next mapping. Returns an empty region if there isn't one for
    * the current event.
@@ -239,10 +606,33 @@ public:
    */
   TraceTaskEvent read_task_event();
 
+  /**
+   * Read the process index into |processes|, in order of creation.
+   * Returns false if the trace doesn't have a usable one, in which case
+   * callers have to fall back to reading task events.
+   */
+  bool read_process_index(std::vector<ProcessRecord>& processes) const;
+
+  /**
+   * Read the markers tracees wrote, in order, into |markers|. Returns false
+   * if the trace doesn't have a usable marker index, e.g. because
+   * recording didn't finish.
+   */
+  bool read_markers(std::vector<MarkerRecord>& markers) const;
+  /**
+   * Return the event of the |n|th (counting from 1) marker called |name|,
+   * or 0 if there's no such marker.
+   */
+  TraceFrame::Time find_marker(const string& name, int n) const;
+
   /**
    * Read the next raw data record and return it.
    */
   RawData read_raw_data();
+  /**
+   * Like read_raw_data(), but reuses |d|'s buffer.
+   */
+  void read_raw_data(RawData& d);
 
   /**
    * Reads the next raw data record for 'frame' from the current point in
@@ -251,6 +641,33 @@ public:
    */
   bool read_raw_data_for_frame(const TraceFrame& frame, RawData& d);
 
+  /**
+   * Zero-copy versions of read_raw_data()/read_raw_data_for_frame().
+   */
+  RawDataRef read_raw_data_ref();
+  bool read_raw_data_ref_for_frame(const TraceFrame& frame, RawDataRef& d);
+
+  /**
+   * Where a raw data record came from and how big it is.
+   */
+  struct RawDataMetadata {
+    remote_ptr<void> addr;
+    size_t size;
+  };
+  /**
+   * Like read_raw_data_for_frame(), but only reads the record's metadata,
+   * which is much cheaper. This leaves the raw data itself unread, so
+   * don't mix this with the other raw data readers on one TraceReader.
+   */
+  bool read_raw_data_metadata_for_frame(const TraceFrame& frame,
+                                        RawDataMetadata& d);
+
+  /**
+   * Like read_raw_data(), but decompress the data directly into |out|, which
+   * has room for |max_size| bytes. It's fatal for the record to be larger.
+   */
+  RawDataMetadata read_raw_data_into(void* out, size_t max_size);
+
   /**
    * Return true iff all trace files are "good".
    * for more details.
@@ -267,11 +684,14 @@ public:
    * state.
    */
   TraceFrame peek_frame();
+  void peek_frame(TraceFrame& frame);
 
   /**
    * Peek ahead in the stream to find the next trace frame that
    * matches the requested parameters. Returns the frame if one
-   * was found, and issues a fatal error if not.
+   * was found, and issues a fatal error if not. Only the task states
+   * that the frames passed over change are saved and restored, not
+   * the whole reader.
    */
   TraceFrame peek_to(pid_t pid, EventType type, SyscallState state);
 
@@ -281,9 +701,60 @@ public:
    */
   void rewind();
 
+  /**
+   * Advance so that the next read_frame() returns the first frame whose
+   * time is >= |time|. The raw data and mapped regions of skipped frames
+   * are consumed. If the trace has an index, whole blocks are skipped
+   * without being decompressed. Never moves backwards.
+   */
+  void seek_to_time(TraceFrame::Time time);
+
+  /**
+   * Return, in increasing order, the times of the frames that
+   * seek_to_time() can jump to without reading earlier frames. Empty if
+   * the trace has no index.
+   */
+  std::vector<TraceFrame::Time> indexed_frame_times();
+
+  /**
+   * Return the time of the first frame recorded at least |seconds| after
+   * the first frame of the trace, or 0 if there's none. The index is used
+   * to find the right part of the trace, so only a few blocks are read.
+   * This reader doesn't move.
+   */
+  TraceFrame::Time time_at_seconds(double seconds) const;
+
   uint64_t uncompressed_bytes() const;
   uint64_t compressed_bytes() const;
 
+  /**
+   * The result of checking the block checksums of one trace file.
+   */
+  struct ChecksumReport {
+    // Name of the file within the trace directory
+    std::string file;
+    uint64_t blocks;
+    // File offsets of the blocks that failed
+    std::vector<uint64_t> bad_blocks;
+  };
+  /**
+   * Check the checksum of every block in every substream and in the index
+   * files, using up to |threads| threads per file. Nothing is decompressed.
+   */
+  std::vector<ChecksumReport> verify_checksums(uint32_t threads) const;
+
+  uint64_t uncompressed_bytes(Substream s) const {
+    return reader(s).uncompressed_bytes();
+  }
+  uint64_t compressed_bytes(Substream s) const {
+    return reader(s).compressed_bytes();
+  }
+  /**
+   * Wall-clock time spent reading and decompressing trace blocks, over
+   * all substreams.
+   */
+  double block_wait_seconds() const;
+
   /**
    * Open the trace in 'dir'. When 'dir' is the empty string, open the
    * latest trace.
@@ -298,10 +769,107 @@ public:
   TraceReader(const TraceReader& other);
 
 private:
+  void load_index();
+  enum FrameStatesUpdate {
+    // Decode without updating |frame_states|, as peek_frame() requires
+    DONT_UPDATE_FRAME_STATES,
+    UPDATE_FRAME_STATES,
+    // Update |frame_states|, first saving the old state of each task in
+    // |saved_frame_states| (or |added_frame_states| if it had none) so
+    // undo_frame_states() can put it back
+    UPDATE_FRAME_STATES_UNDOABLE,
+  };
+  /**
+   * Read the next frame into |frame|.
+   */
+  void read_frame(TraceFrame& frame, FrameStatesUpdate update);
+  void undo_frame_states();
+  bool at_raw_data_for_frame(const TraceFrame& frame);
+  void read_raw_data_contents(size_t num_bytes, uint32_t ref_count,
+                              uint8_t* out);
+  /**
+   * Return the string with STRINGS index |id|, reading STRINGS up to it if
+   * necessary.
+   */
+  const string& interned(uint32_t id);
+
   CompressedReader& reader(Substream s) { return *readers[s]; }
   const CompressedReader& reader(Substream s) const { return *readers[s]; }
 
+  /**
+   * What we found out about a file backing SOURCE_FILE mappings.
+   */
+  struct BackingFile {
+    BackingFile() : have_tracee_identity(false) {}
+    // stat() of the file the first time a mapping of it was read
+    struct stat st;
+    // (offset, length) ranges whose content hash matched the recording,
+    // while the file had the dev, inode and mtime in |st|
+    std::set<std::pair<uint64_t, uint64_t> > verified_ranges;
+    bool have_tracee_identity;
+    struct stat tracee_st;
+    string tracee_name;
+  };
+  /**
+   * Return the cache entry for |file_name|, stat'ing the file if it has
+   * none yet.
+   */
+  BackingFile& backing_file(const string& file_name);
+
   std::unique_ptr<CompressedReader> readers[SUBSTREAM_COUNT];
+  std::shared_ptr<std::vector<FramePosition> > frame_index;
+  // Backing files by name. The files in a trace don't change during a
+  // replay, so each of them is only stat'ed, and each range of one only
+  // hashed, once per replay, by all clones of this reader.
+  std::shared_ptr<std::map<string, BackingFile> > backing_files;
+  TaskFrameStates frame_states;
+  // Undo log for UPDATE_FRAME_STATES_UNDOABLE
+  TaskFrameStates saved_frame_states;
+  std::vector<pid_t> added_frame_states;
+  // The strings read from STRINGS so far, by index
+  std::vector<string> strings;
+  // Backing store for RawDataRefs that span trace blocks
+  std::vector<uint8_t> raw_data_storage;
+  // Reads deduplicated chunks out of RAW_DATA; created on first use
+  std::unique_ptr<CompressedReader> raw_data_chunk_reader;
+  // The snapshot file the last file reference read from
+  std::string raw_data_file_name;
+  ScopedFd raw_data_file;
+};
+
+/**
+ * Rewrites a finished trace in place, for "rr pack".
+ */
+class TracePacker : public TraceStream {
+public:
+  TracePacker(const string& dir) : TraceStream(dir, 0) {}
+
+  /**
+   * Return the absolute names of the files backing SOURCE_FILE mappings.
+   * Files outside the trace directory whose size, inode, mode, owner or
+   * mtime don't match every one of their MMAPS records are added to
+   * |changed|; replay warns about those, and packing them would hide that.
+   */
+  std::vector<string> backing_files(std::set<string>* changed);
+
+  /**
+   * Recompress all substreams with |options| using |threads| compression
+   * threads, then regenerate the index. Backing files named in
+   * |renamed_files| are replaced in MMAPS records by the mapped names,
+   * which must be relative to the trace directory. Returns false if
+   * writing failed, in which case the trace is unchanged.
+   */
+  bool pack(const CompressionOptions& options, int threads,
+            const std::map<string, string>& renamed_files);
+
+private:
+  /**
+   * Read the whole STRINGS substream.
+   */
+  std::vector<string> read_strings();
+  string absolute_backing_file(const string& name) const {
+    return name[0] == '/' ? name : trace_dir + "/" + name;
+  }
 };
 
 } // namespace rr
@@ -30,7 +30,7 @@ public:
   TraceTaskEvent(pid_t tid, const std::string& file_name,
                  const std::vector<std::string> cmd_line)
       : type_(EXEC), tid_(tid), file_name_(file_name), cmd_line_(cmd_line) {}
-  TraceTaskEvent(pid_t tid) : type_(EXIT), tid_(tid) {}
+  TraceTaskEvent(pid_t tid) : type_(EXIT), tid_(tid), exit_code_(-1) {}
   TraceTaskEvent() : type_(NONE) {}
 
   enum Type {
@@ -73,6 +73,20 @@ public:
     fds_to_close_ = fds;
   }
 
+  /**
+   * The exit code of the task's process, if it's the last task in it to
+   * exit, or -1. Only kept in the trace's process index, so it's always
+   * -1 in events read back from TASKS.
+   */
+  int exit_code() const {
+    assert(type() == EXIT);
+    return exit_code_;
+  }
+  void set_exit_code(int exit_code) {
+    assert(type() == EXIT);
+    exit_code_ = exit_code;
+  }
+
 private:
   friend class TraceReader;
   friend class TraceWriter;
@@ -84,6 +98,7 @@ private:
   std::string file_name_;             // EXEC only
   std::vector<std::string> cmd_line_; // EXEC only
   std::vector<int> fds_to_close_;     // EXEC only
+  int exit_code_;                     // EXIT only
 };
 
 } // namespace rr
@@ -0,0 +1,105 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "Command.h"
+#include "main.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+namespace rr {
+
+class VerifyCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  VerifyCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static VerifyCommand singleton;
+};
+
+VerifyCommand VerifyCommand::singleton(
+    "verify",
+    " rr verify [OPTION]... [<trace_dir>]\n"
+    "  Check the checksum of every block of the trace, without decompressing\n"
+    "  or replaying anything, and list the blocks that are corrupt. Exits\n"
+    "  with status 1 if any are.\n"
+    "  -j, --threads=<N>          check blocks on <N> threads (default: one\n"
+    "                             per online CPU)\n");
+
+struct VerifyFlags {
+  int threads;
+
+  VerifyFlags() : threads(0) {}
+};
+
+static bool parse_verify_arg(vector<string>& args, VerifyFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'j', "threads", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'j':
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.threads = opt.int_value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+static int verify(const string& trace_dir, const VerifyFlags& flags,
+                  FILE* out) {
+  int threads = flags.threads;
+  if (!threads) {
+    threads = max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  }
+
+  TraceReader trace(trace_dir);
+  uint64_t blocks = 0;
+  uint64_t bad_blocks = 0;
+  for (auto& report : trace.verify_checksums(threads)) {
+    blocks += report.blocks;
+    bad_blocks += report.bad_blocks.size();
+    for (uint64_t offset : report.bad_blocks) {
+      fprintf(out, "%s: corrupt block at offset %" PRIu64 "\n",
+              report.file.c_str(), offset);
+    }
+  }
+  fprintf(out, "%" PRIu64 " blocks checked, %" PRIu64 " corrupt\n", blocks,
+          bad_blocks);
+  return bad_blocks ? 1 : 0;
+}
+
+int VerifyCommand::run(std::vector<std::string>& args) {
+  VerifyFlags flags;
+
+  while (parse_verify_arg(args, flags)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return verify(trace_dir, flags, stdout);
+}
+
+} // namespace rr
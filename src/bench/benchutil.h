@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_BENCHUTIL_H
+#define RR_BENCHUTIL_H
+
+#define _GNU_SOURCE 1
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define bench_assert(cond) assert("FAILED: !" && (cond))
+
+/**
+ * Return the iteration count passed as the first argument, or |def| if
+ * there is none.
+ */
+inline static long bench_iterations(int argc, char** argv, long def) {
+  return argc > 1 ? atol(argv[1]) : def;
+}
+
+#endif
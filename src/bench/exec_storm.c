@@ -0,0 +1,27 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "benchutil.h"
+
+#include <sys/wait.h>
+
+/* Fork and exec a small dynamically linked program over and over, like a
+   build does. Replay has to rebuild the address space of each exec. */
+
+int main(int argc, char** argv) {
+  long iterations = bench_iterations(argc, argv, 2000);
+  char* child_argv[] = { "true", NULL };
+  long i;
+
+  for (i = 0; i < iterations; ++i) {
+    int status;
+    pid_t child = fork();
+    if (!child) {
+      execv("/bin/true", child_argv);
+      _exit(77);
+    }
+    bench_assert(child > 0);
+    bench_assert(child == waitpid(child, &status, 0));
+    bench_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  return 0;
+}
@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "benchutil.h"
+
+/* Two threads handing a token back and forth, so every iteration blocks
+   and forces a context switch. */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int turn;
+static long iterations;
+
+static void play(int me) {
+  long i;
+  for (i = 0; i < iterations; ++i) {
+    pthread_mutex_lock(&lock);
+    while (turn != me) {
+      pthread_cond_wait(&cond, &lock);
+    }
+    turn = !me;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+static void* other_player(__attribute__((unused)) void* p) {
+  play(1);
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  pthread_t thread;
+
+  iterations = bench_iterations(argc, argv, 20000);
+  bench_assert(0 == pthread_create(&thread, NULL, other_player, NULL));
+  play(0);
+  bench_assert(0 == pthread_join(thread, NULL));
+  return 0;
+}
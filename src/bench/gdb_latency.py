@@ -0,0 +1,125 @@
+# Replays a reference workload under gdb and times common debugger
+# operations, printing one line of JSON per operation.
+#
+# Usage: gdb_latency.py <path-to-rr-objdir> [<operation> ...]
+#
+# For each operation we report latency percentiles (p50, p90, p99 and max,
+# in milliseconds) over repeated runs in one replay session, measured from
+# sending the command to gdb's next prompt. Use this to evaluate changes to
+# GdbServer and ReplayTimeline; harness.py covers recording and replay
+# throughput.
+
+from __future__ import print_function
+
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import pexpect
+
+WORKLOAD = 'gdb_workload'
+# Calls to breakpoint() made by the workload
+ITERATIONS = 10000
+SAMPLES = 50
+# Conditional breakpoint samples each skip this many breakpoint() calls
+CONDITION_PERIOD = 1000
+TIMEOUT_SEC = 300
+PROMPT = r'\(rr\) '
+
+objdir = sys.argv[1]
+selected = sys.argv[2:]
+rr = '%s/bin/rr' % objdir
+
+def percentile(values, p):
+    values = sorted(values)
+    index = int(round(p / 100.0 * (len(values) - 1)))
+    return values[min(len(values) - 1, index)]
+
+class Gdb:
+    def __init__(self, env, trace_dir):
+        self.gdb = pexpect.spawn(rr, ['replay', trace_dir], env=env,
+                                 timeout=TIMEOUT_SEC, maxread=65536)
+        self.gdb.expect(PROMPT)
+        self.command('set pagination off')
+        self.command('set print elements 0')
+
+    def command(self, cmd, expect=None):
+        """Send cmd, wait for |expect| (if any) and the next prompt, and
+        return how long that took."""
+        start = time.time()
+        self.gdb.sendline(cmd)
+        if expect:
+            self.gdb.expect(expect)
+        self.gdb.expect(PROMPT)
+        return time.time() - start
+
+    def close(self):
+        self.gdb.close(force=True)
+
+def timed_samples(count, fn):
+    return [fn() for _ in range(count)]
+
+def measure(gdb):
+    """Yield (operation, latencies) for each operation, in the order the
+    workload reaches them. Each operation starts where the previous one
+    left off, so they all run even if only some are reported."""
+    gdb.command('break breakpoint', 'Breakpoint 1')
+    yield 'continue', timed_samples(
+        SAMPLES, lambda: gdb.command('continue', 'Breakpoint 1'))
+    yield 'reverse-continue', timed_samples(
+        SAMPLES - 1, lambda: gdb.command('reverse-continue', 'Breakpoint 1'))
+    yield 'reverse-stepi', timed_samples(
+        SAMPLES, lambda: gdb.command('reverse-stepi'))
+
+    gdb.command('condition 1 i %% %d == %d' %
+                (CONDITION_PERIOD, CONDITION_PERIOD - 1))
+    yield 'conditional-continue', timed_samples(
+        ITERATIONS // CONDITION_PERIOD,
+        lambda: gdb.command('continue', 'Breakpoint 1'))
+
+    gdb.command('delete')
+    gdb.command('break big_struct_ready', 'Breakpoint 2')
+    gdb.command('continue', 'Breakpoint 2')
+    yield 'print-big-struct', timed_samples(
+        SAMPLES, lambda: gdb.command('print big_struct', 'values = '))
+
+    gdb.command('break all_threads_parked', 'Breakpoint 3')
+    gdb.command('continue', 'Breakpoint 3')
+    yield 'backtrace-all-threads', timed_samples(
+        SAMPLES, lambda: gdb.command('thread apply all bt'))
+
+def run():
+    exe = '%s/bin/%s' % (objdir, WORKLOAD)
+    d = tempfile.mkdtemp(prefix='rr-bench-')
+    try:
+        env = dict(os.environ)
+        env['_RR_TRACE_DIR'] = d
+        trace_dir = '%s/latest-trace' % d
+        with open(os.devnull, 'w') as null:
+            subprocess.check_call([rr, 'record', exe, str(ITERATIONS)],
+                                  env=env, stdout=null, stderr=null)
+        gdb = Gdb(env, trace_dir)
+        try:
+            for operation, latencies in measure(gdb):
+                if selected and operation not in selected:
+                    continue
+                result = {'operation': operation, 'samples': len(latencies)}
+                for p in [50, 90, 99]:
+                    result['p%d_ms' % p] = percentile(latencies, p) * 1000
+                result['max_ms'] = max(latencies) * 1000
+                print(json.dumps(result, sort_keys=True))
+                sys.stdout.flush()
+        finally:
+            gdb.close()
+    finally:
+        shutil.rmtree(d)
+
+try:
+    run()
+except Exception as e:
+    print(json.dumps({'error': str(e)}))
+    sys.exit(1)
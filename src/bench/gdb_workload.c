@@ -0,0 +1,63 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "benchutil.h"
+
+/* Reference workload for gdb_latency.py, which replays it under gdb and
+   times common debugger operations: a loop calling breakpoint() (for
+   continue, reverse-continue, reverse-stepi and conditional breakpoints),
+   a large struct to print, and many threads to backtrace. */
+
+#define NUM_THREADS 64
+
+struct big {
+  int values[16384];
+};
+
+static struct big big_struct;
+static volatile long sink;
+static pthread_barrier_t barrier;
+static int pipe_fds[2];
+
+static void __attribute__((noinline)) breakpoint(long i) { sink += i; }
+
+static void __attribute__((noinline)) big_struct_ready(void) {}
+
+static void __attribute__((noinline)) all_threads_parked(void) {}
+
+static void* parked_thread(__attribute__((unused)) void* p) {
+  char ch;
+  pthread_barrier_wait(&barrier);
+  bench_assert(1 == read(pipe_fds[0], &ch, 1));
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  long iterations = bench_iterations(argc, argv, 10000);
+  pthread_t threads[NUM_THREADS];
+  char wake[NUM_THREADS];
+  long i;
+  int j;
+
+  for (i = 0; i < iterations; ++i) {
+    breakpoint(i);
+  }
+
+  for (j = 0; j < 16384; ++j) {
+    big_struct.values[j] = j * j;
+  }
+  big_struct_ready();
+
+  bench_assert(0 == pipe(pipe_fds));
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS + 1);
+  for (j = 0; j < NUM_THREADS; ++j) {
+    bench_assert(0 == pthread_create(&threads[j], NULL, parked_thread, NULL));
+  }
+  pthread_barrier_wait(&barrier);
+  all_threads_parked();
+  memset(wake, 0, sizeof(wake));
+  bench_assert(sizeof(wake) == write(pipe_fds[1], wake, sizeof(wake)));
+  for (j = 0; j < NUM_THREADS; ++j) {
+    bench_assert(0 == pthread_join(threads[j], NULL));
+  }
+  return 0;
+}
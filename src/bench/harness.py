@@ -0,0 +1,192 @@
+# Runs the rr microbenchmarks and prints one line of JSON per benchmark.
+#
+# Usage: harness.py <path-to-rr-objdir> [<benchmark> ...]
+#
+# For each benchmark we report the median wall-clock time of native runs,
+# recording and replaying (with -a), record overhead and replay speed
+# relative to native, the trace size per recorded event, and the time to
+# create and restore a checkpoint through gdb.
+#
+# thread_scaling is run separately, once per blocked-thread count, and
+# reports the CPU time rr spends per recorded event, to show how rr's
+# bookkeeping scales with the number of tasks.
+
+from __future__ import print_function
+
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import pexpect
+
+# name -> iteration count passed to the benchmark
+BENCHMARKS = [
+    ('syscall_loop', 1000000),
+    ('futex_pingpong', 20000),
+    ('mmap_churn', 50000),
+    ('signal_storm', 50000),
+    ('many_threads', 50),
+    ('thread_storm', 20),
+    ('large_write', 256),
+    ('exec_storm', 2000),
+]
+RUNS = 5
+# name, iteration count, and the blocked-thread counts to try
+SCALING_BENCHMARK = ('thread_scaling', 2000, [10, 100, 1000, 10000])
+CHECKPOINT_TIMEOUT_SEC = 100
+
+objdir = sys.argv[1]
+selected = sys.argv[2:]
+rr = '%s/bin/rr' % objdir
+
+def median(values):
+    values = sorted(values)
+    return values[len(values) // 2]
+
+def timed(args, env=None):
+    start = time.time()
+    with open(os.devnull, 'w') as null:
+        ret = subprocess.call(args, env=env, stdout=null, stderr=null)
+    if ret != 0:
+        raise Exception('%s failed with status %d' % (' '.join(args), ret))
+    return time.time() - start
+
+def cpu_time(args, env=None):
+    """Return the user+system CPU time of running args and its children."""
+    with open(os.devnull, 'w') as null:
+        p = subprocess.Popen(args, env=env, stdout=null, stderr=null)
+        _, status, usage = os.wait4(p.pid, 0)
+        p.returncode = status
+    if status != 0:
+        raise Exception('%s failed with status %d' % (' '.join(args), status))
+    return usage.ru_utime + usage.ru_stime
+
+def trace_bytes(trace_dir):
+    total = 0
+    for root, dirs, files in os.walk(trace_dir):
+        for f in files:
+            total += os.path.getsize(os.path.join(root, f))
+    return total
+
+def trace_events(trace_dir):
+    out = subprocess.check_output([rr, 'dump', '-a', trace_dir])
+    m = re.search(r'// (\d+) events', out.decode())
+    return int(m.group(1))
+
+def checkpoint_latency(env, trace_dir):
+    gdb = pexpect.spawn(rr, ['replay', trace_dir], env=env,
+                        timeout=CHECKPOINT_TIMEOUT_SEC)
+    try:
+        gdb.expect(r'\(rr\) ')
+        gdb.sendline('b main')
+        gdb.expect(r'\(rr\) ')
+        gdb.sendline('c')
+        gdb.expect('Breakpoint 1')
+        gdb.expect(r'\(rr\) ')
+        start = time.time()
+        gdb.sendline('checkpoint')
+        gdb.expect('Checkpoint 1 at')
+        gdb.expect(r'\(rr\) ')
+        create = time.time() - start
+        gdb.sendline('next')
+        gdb.expect(r'\(rr\) ')
+        start = time.time()
+        gdb.sendline('restart 1')
+        gdb.expect('stopped')
+        gdb.expect(r'\(rr\) ')
+        restore = time.time() - start
+        gdb.sendline('q')
+        gdb.sendline('y')
+        return create, restore
+    finally:
+        gdb.close(force=True)
+
+def run(name, iterations):
+    exe = '%s/bin/%s' % (objdir, name)
+    args = [exe, str(iterations)]
+    d = tempfile.mkdtemp(prefix='rr-bench-')
+    try:
+        env = dict(os.environ)
+        env['_RR_TRACE_DIR'] = d
+        trace_dir = '%s/latest-trace' % d
+
+        native = median([timed(args) for _ in range(RUNS)])
+        record = []
+        for _ in range(RUNS):
+            record.append(timed([rr, 'record'] + args, env))
+        record = median(record)
+        replay = median([timed([rr, 'replay', '-a', trace_dir], env)
+                         for _ in range(RUNS)])
+        events = trace_events(trace_dir)
+        create, restore = checkpoint_latency(env, trace_dir)
+        return {
+            'benchmark': name,
+            'iterations': iterations,
+            'native_sec': native,
+            'record_sec': record,
+            'replay_sec': replay,
+            'record_overhead': record / native,
+            'replay_overhead': replay / native,
+            'events': events,
+            'trace_bytes': trace_bytes(trace_dir),
+            'trace_bytes_per_event': float(trace_bytes(trace_dir)) / events,
+            'checkpoint_create_sec': create,
+            'checkpoint_restore_sec': restore,
+        }
+    finally:
+        shutil.rmtree(d)
+
+def run_scaling(name, iterations, threads):
+    exe = '%s/bin/%s' % (objdir, name)
+    args = [exe, str(iterations), str(threads)]
+    d = tempfile.mkdtemp(prefix='rr-bench-')
+    try:
+        env = dict(os.environ)
+        env['_RR_TRACE_DIR'] = d
+        trace_dir = '%s/latest-trace' % d
+
+        native = median([cpu_time(args) for _ in range(RUNS)])
+        # rr reaps the tracees, so this includes their CPU time too;
+        # subtracting the native run leaves rr's own.
+        record = median([cpu_time([rr, 'record'] + args, env)
+                         for _ in range(RUNS)])
+        events = trace_events(trace_dir)
+        return {
+            'benchmark': name,
+            'iterations': iterations,
+            'threads': threads,
+            'events': events,
+            'native_cpu_sec': native,
+            'record_cpu_sec': record,
+            'rr_cpu_usec_per_event': (record - native) * 1e6 / events,
+        }
+    finally:
+        shutil.rmtree(d)
+
+failed = False
+for name, iterations in BENCHMARKS:
+    if selected and name not in selected:
+        continue
+    try:
+        result = run(name, iterations)
+    except Exception as e:
+        result = {'benchmark': name, 'error': str(e)}
+        failed = True
+    print(json.dumps(result, sort_keys=True))
+    sys.stdout.flush()
+name, iterations, thread_counts = SCALING_BENCHMARK
+if not selected or name in selected:
+    for threads in thread_counts:
+        try:
+            result = run_scaling(name, iterations, threads)
+        except Exception as e:
+            result = {'benchmark': name, 'threads': threads, 'error': str(e)}
+            failed = True
+        print(json.dumps(result, sort_keys=True))
+        sys.stdout.flush()
+sys.exit(1 if failed else 0)
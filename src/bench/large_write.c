@@ -0,0 +1,32 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "benchutil.h"
+
+#include <fcntl.h>
+
+/* Write a large file in big chunks and read it back. The reads' data
+   all has to be saved in the trace. */
+
+#define CHUNK_SIZE (1 << 20)
+
+int main(int argc, char** argv) {
+  long iterations = bench_iterations(argc, argv, 256);
+  char path[] = "/tmp/rr-bench-large-write-XXXXXX";
+  char* buf = malloc(CHUNK_SIZE);
+  int fd = mkstemp(path);
+  long i;
+
+  bench_assert(fd >= 0 && buf);
+  bench_assert(0 == unlink(path));
+  memset(buf, 'x', CHUNK_SIZE);
+  for (i = 0; i < iterations; ++i) {
+    bench_assert(CHUNK_SIZE == write(fd, buf, CHUNK_SIZE));
+  }
+  bench_assert(0 == lseek(fd, 0, SEEK_SET));
+  for (i = 0; i < iterations; ++i) {
+    bench_assert(CHUNK_SIZE == read(fd, buf, CHUNK_SIZE));
+  }
+  close(fd);
+  free(buf);
+  return 0;
+}
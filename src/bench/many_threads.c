@@ -0,0 +1,37 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "benchutil.h"
+
+/* Waves of short-lived threads doing a little computation and a few
+   syscalls each. Measures thread creation and scheduling overhead. */
+
+#define NUM_THREADS 32
+
+static void* work(void* p) {
+  long n = (long)p;
+  long sum = 0;
+  long i;
+  for (i = 0; i < 100000; ++i) {
+    sum += i ^ n;
+  }
+  syscall(SYS_getppid);
+  sched_yield();
+  return (void*)sum;
+}
+
+int main(int argc, char** argv) {
+  long iterations = bench_iterations(argc, argv, 50);
+  pthread_t threads[NUM_THREADS];
+  long i;
+  int j;
+
+  for (i = 0; i < iterations; ++i) {
+    for (j = 0; j < NUM_THREADS; ++j) {
+      bench_assert(0 == pthread_create(&threads[j], NULL, work, (void*)i));
+    }
+    for (j = 0; j < NUM_THREADS; ++j) {
+      bench_assert(0 == pthread_join(threads[j], NULL));
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,24 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "benchutil.h"
+
+/* Map, touch, protect and unmap anonymous memory of varying sizes. rr
+   has to update its address space model for each of these. */
+
+int main(int argc, char** argv) {
+  long iterations = bench_iterations(argc, argv, 50000);
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  long i;
+
+  for (i = 0; i < iterations; ++i) {
+    size_t size = page_size * (1 + i % 16);
+    char* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    bench_assert(p != MAP_FAILED);
+    p[0] = 1;
+    p[size - 1] = 1;
+    bench_assert(0 == mprotect(p, page_size, PROT_READ));
+    bench_assert(0 == munmap(p, size));
+  }
+  return 0;
+}
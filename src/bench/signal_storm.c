@@ -0,0 +1,24 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "benchutil.h"
+
+/* Deliver lots of signals to ourselves. Each one is a separate event
+   that rr has to record and replay. */
+
+static volatile long caught;
+
+static void handler(__attribute__((unused)) int sig) { ++caught; }
+
+int main(int argc, char** argv) {
+  long iterations = bench_iterations(argc, argv, 50000);
+  pid_t pid = getpid();
+  pid_t tid = syscall(SYS_gettid);
+  long i;
+
+  signal(SIGUSR1, handler);
+  for (i = 0; i < iterations; ++i) {
+    syscall(SYS_tgkill, pid, tid, SIGUSR1);
+  }
+  bench_assert(caught == iterations);
+  return 0;
+}
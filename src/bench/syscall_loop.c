@@ -0,0 +1,17 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "benchutil.h"
+
+/* Cheap syscalls back to back. With the syscallbuf these should stay
+   in the tracee; without it every one is a trip through rr. */
+
+int main(int argc, char** argv) {
+  long iterations = bench_iterations(argc, argv, 1000000);
+  long i;
+
+  for (i = 0; i < iterations; ++i) {
+    syscall(SYS_getppid);
+    syscall(SYS_clock_gettime, CLOCK_MONOTONIC, NULL);
+  }
+  return 0;
+}
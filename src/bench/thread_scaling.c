@@ -0,0 +1,43 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "benchutil.h"
+
+#include <sys/utsname.h>
+
+/* One thread making traced syscalls while many others sit blocked.
+   Natively the blocked threads cost nothing, so this measures how rr's
+   per-event work grows with the number of tasks it tracks. Takes the
+   iteration count and the number of blocked threads. */
+
+#define STACK_SIZE (64 * 1024)
+
+static int pipe_fds[2];
+
+static void* block(__attribute__((unused)) void* p) {
+  char ch;
+  /* Nothing is ever written, so this blocks until exit_group. */
+  read(pipe_fds[0], &ch, 1);
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  long iterations = bench_iterations(argc, argv, 2000);
+  long num_threads = argc > 2 ? atol(argv[2]) : 100;
+  pthread_attr_t attr;
+  pthread_t thread;
+  struct utsname buf;
+  long i;
+
+  bench_assert(0 == pipe(pipe_fds));
+  bench_assert(0 == pthread_attr_init(&attr));
+  bench_assert(0 == pthread_attr_setstacksize(&attr, STACK_SIZE));
+  for (i = 0; i < num_threads; ++i) {
+    bench_assert(0 == pthread_create(&thread, &attr, block, NULL));
+  }
+  for (i = 0; i < iterations; ++i) {
+    /* uname isn't buffered, so each one is an event. */
+    syscall(SYS_uname, &buf);
+  }
+  /* Returning from main kills the blocked threads. */
+  return 0;
+}
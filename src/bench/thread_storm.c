@@ -0,0 +1,41 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "benchutil.h"
+
+/* Bursts of hundreds of threads that are all created, wait for each other
+   and then exit together, like a thread pool starting up and shutting
+   down. Measures handling of clone and exit storms. */
+
+#define NUM_THREADS 256
+
+static pthread_barrier_t barrier;
+
+static void* work(__attribute__((unused)) void* p) {
+  pthread_barrier_wait(&barrier);
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  long iterations = bench_iterations(argc, argv, 20);
+  pthread_t threads[NUM_THREADS];
+  pthread_attr_t attr;
+  long i;
+  int j;
+
+  /* Small stacks, so the thread count is limited by rr, not by memory. */
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+  for (i = 0; i < iterations; ++i) {
+    bench_assert(0 == pthread_barrier_init(&barrier, NULL, NUM_THREADS + 1));
+    for (j = 0; j < NUM_THREADS; ++j) {
+      bench_assert(0 == pthread_create(&threads[j], &attr, work, NULL));
+    }
+    pthread_barrier_wait(&barrier);
+    for (j = 0; j < NUM_THREADS; ++j) {
+      bench_assert(0 == pthread_join(threads[j], NULL));
+    }
+    pthread_barrier_destroy(&barrier);
+  }
+  pthread_attr_destroy(&attr);
+  return 0;
+}
@@ -6,6 +6,11 @@
 # idle.
 #
 # Usage: chaos-test.sh <path-to-rr-objdir>
+#
+# Set CHAOS_BUDGET=<switches/s> to compare rr record --chaos-budget against
+# plain --chaos; each run reports runs/hour and failures/hour. Set
+# CHAOS_JOBS to change how many recordings run at once. The trace of the
+# first failing chaos run of each test is kept in the objdir.
 
 cd `dirname $0`
 
@@ -6,6 +6,7 @@ import copy
 import shutil
 import os
 import itertools
+import time
 
 objdir = sys.argv[1]
 sanity_runs = eval(sys.argv[2])
@@ -15,10 +16,29 @@ params = sys.argv[5:]
 
 GOOD_FAIL = 77
 
-# Runs test, returns True if the test passed, False if it
-# expectedly fails. Exits with code 1 if test unexpectedly failed.
+# Set CHAOS_BUDGET=<switches/s> to test rr record --chaos-budget instead of
+# --chaos.
+if 'CHAOS_BUDGET' in os.environ:
+    chaos_params = ["--chaos-budget=%s"%os.environ['CHAOS_BUDGET']]
+else:
+    chaos_params = ["--chaos"]
+
+# The first chaos-mode run that fails as expected keeps its trace here, so
+# the failure can be replayed. It starts out empty; renaming a directory
+# over an empty one succeeds but over a non-empty one fails, so exactly one
+# run gets to keep its trace. Set CHAOS_KEEP_DIR to put it somewhere other
+# than the objdir.
+keep_dir = tempfile.mkdtemp(prefix="chaos-failure-%s-"%name,
+                            dir=os.environ.get('CHAOS_KEEP_DIR', objdir))
+
+# Each run records into its own trace directory. Traces of passing runs are
+# deleted as soon as the run finishes, so disk usage stays bounded by the
+# number of concurrent runs. The first expected failure's trace is moved to
+# keep_dir and unexpected failures are left where they are.
+# Returns [exit code, output lines, preserved trace dir or None].
 def run(rr_params):
     d = tempfile.mkdtemp(prefix='rr-chaos-')
+    keep = None
     try:
         env = copy.copy(os.environ)
         env['_RR_TRACE_DIR'] = d
@@ -26,27 +46,43 @@ def run(rr_params):
             p = subprocess.Popen(["%s/bin/rr"%objdir, "record"] + rr_params + ["%s/bin/%s"%(objdir, name)] + params, env=env,
                 stdout=out, stderr=out)
             ret = p.wait()
-        if ret != 0 and ret != GOOD_FAIL:
-            print "Test %s failed unexpectedly; leaving behind trace in %s"%(name, d)
         out_array = []
         with open(d + "/out", 'r') as out:
             for line in out:
                 out_array.append(line)
-        return [ret, out_array]
+        if ret != 0 and ret != GOOD_FAIL:
+            print "Test %s failed unexpectedly; leaving behind trace in %s"%(name, d)
+            keep = d
+        elif ret == GOOD_FAIL and rr_params:
+            try:
+                os.rename(d, keep_dir)
+                keep = keep_dir
+            except OSError:
+                pass
+        return [ret, out_array, keep]
     finally:
-        shutil.rmtree(d)
+        if keep is None:
+            shutil.rmtree(d)
+
+# By default use only half the cores. Otherwise tests will induce starvation
+# themselves; we want to measure starvation induced by rr. Set CHAOS_JOBS to
+# run a different number of recordings concurrently.
+jobs = int(os.environ.get('CHAOS_JOBS', max(1, multiprocessing.cpu_count()/2)))
+pool = multiprocessing.Pool(jobs)
 
-# Use only half the cores. Otherwise tests will induce starvation
-# themselves; we want to measure starvation induced by rr.
-pool = multiprocessing.Pool(max(1, multiprocessing.cpu_count()/2))
+def per_hour(count, start):
+    return count*3600.0/max(0.001, time.time() - start)
 
 def safe_exit(code):
     pool.terminate()
     pool.join()
+    if not os.listdir(keep_dir):
+        os.rmdir(keep_dir)
     sys.exit(code)
 
-print "Running %d iterations of %s/bin/%s %s without chaos mode"%(sanity_runs, objdir, name, ' '.join(params))
+print "Running %d iterations of %s/bin/%s %s without chaos mode, %d at a time"%(sanity_runs, objdir, name, ' '.join(params), jobs)
 sanity_failed = 0
+start = time.time()
 for r in pool.imap_unordered(run, itertools.repeat([], sanity_runs)):
     if r[0] == 0:
         continue
@@ -57,11 +93,12 @@ for r in pool.imap_unordered(run, itertools.repeat([], sanity_runs)):
 if sanity_failed == sanity_runs:
     print "PROBLEM: %d runs of %s all failed; not a good chaos mode test"%(sanity_failed, name)
     safe_exit(2)
-print "Without chaos mode, %d runs of %s failed out of %d"%(sanity_failed, name, sanity_runs)
+print "Without chaos mode, %d runs of %s failed out of %d (%.0f runs/hour)"%(sanity_failed, name, sanity_runs, per_hour(sanity_runs, start))
 
-print "Running %d iterations of %s/bin/%s %s in chaos mode"%(runs, objdir, name, ' '.join(params))
+print "Running %d iterations of %s/bin/%s %s in chaos mode (%s)"%(runs, objdir, name, ' '.join(params), ' '.join(chaos_params))
 failed = 0
-for r in pool.imap_unordered(run, itertools.repeat(["--chaos"], runs)):
+start = time.time()
+for r in pool.imap_unordered(run, itertools.repeat(chaos_params, runs)):
     if r[0] == 0:
         continue
     if r[0] != GOOD_FAIL:
@@ -71,12 +108,14 @@ for r in pool.imap_unordered(run, itertools.repeat(["--chaos"], runs)):
         print "First test failure detected, output:"
         for line in r[1]:
             print line,
+    if r[2]:
+        print "Trace of the failing run preserved in %s; replay it with rr replay %s/%s-0"%(r[2], r[2], name)
     failed = failed + 1
 if failed == 0:
     print "PROBLEM: With chaos mode, test %s did not fail in %d runs"%(name, runs)
     safe_exit(1)
 
-print "With chaos mode, %d runs of %s failed out of %d"%(failed, name, runs)
+print "With chaos mode, %d runs of %s failed out of %d (%.0f runs/hour, %.0f failures/hour)"%(failed, name, runs, per_hour(runs, start), per_hour(failed, start))
 if float(failed)/runs < 3*float(sanity_failed)/sanity_runs:
     print "PROBLEM: Chaos mode didn't really help!"
     safe_exit(3)
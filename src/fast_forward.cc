@@ -2,6 +2,8 @@
 
 #include "fast_forward.h"
 
+#include <string.h>
+
 #include "log.h"
 
 using namespace std;
@@ -17,8 +19,8 @@ struct InstructionBuf {
 static InstructionBuf read_instruction(Task* t, remote_code_ptr ip) {
   InstructionBuf result;
   result.arch = t->arch();
-  result.code_buf_len = (int)t->read_bytes_fallible(
-      ip.to_data_ptr<uint8_t>(), sizeof(result.code_buf), result.code_buf);
+  result.code_buf_len = (int)t->vm()->read_code(
+      t, ip, result.code_buf, sizeof(result.code_buf));
   return result;
 }
 
@@ -149,8 +151,439 @@ static bool is_x86ish(Task* t) {
   return t->arch() == x86 || t->arch() == x86_64;
 }
 
+/**
+ * What decode_x86_loop_body_instruction found.
+ */
+struct LoopBodyInstruction {
+  int length;
+  bool is_conditional_branch;
+  // Only set for a conditional branch.
+  remote_code_ptr branch_target;
+};
+
+/**
+ * Return the length of the ModRM operand starting at |p|, or -1 if it's
+ * truncated. Assumes 32/64-bit addressing.
+ */
+static int modrm_length(const uint8_t* p, const uint8_t* end) {
+  if (p >= end) {
+    return -1;
+  }
+  uint8_t modrm = *p;
+  int mod = modrm >> 6;
+  int rm = modrm & 7;
+  int len = 1;
+  if (mod == 3) {
+    return len;
+  }
+  if (rm == 4) {
+    if (p + 1 >= end) {
+      return -1;
+    }
+    if (mod == 0 && (p[1] & 7) == 5) {
+      len += 4;
+    }
+    ++len;
+  } else if (mod == 0 && rm == 5) {
+    len += 4;
+  }
+  if (mod == 1) {
+    len += 1;
+  } else if (mod == 2) {
+    len += 4;
+  }
+  return p + len <= end ? len : -1;
+}
+
+/**
+ * Two-byte (0F-prefixed, or VEX map 1) opcodes taking a ModRM operand and
+ * no immediate, that can't transfer control or enter the kernel. These
+ * are the moves, arithmetic and SIMD operations found in compiled copy
+ * and fill loops.
+ */
+static bool is_simple_0f_modrm_opcode(uint8_t op) {
+  if ((op >= 0x40 && op <= 0x4f) || (op >= 0x90 && op <= 0x9f)) {
+    return true; // CMOVcc, SETcc
+  }
+  switch (op) {
+    case 0x10: // MOVUPS etc
+    case 0x11:
+    case 0x18: // PREFETCH
+    case 0x1f: // NOP
+    case 0x28: // MOVAPS etc
+    case 0x29:
+    case 0x2b: // MOVNTPS
+    case 0x6e: // MOVD/MOVQ
+    case 0x6f: // MOVDQA/MOVDQU
+    case 0x74: // PCMPEQB/W/D
+    case 0x75:
+    case 0x76:
+    case 0x7e: // MOVD/MOVQ
+    case 0x7f: // MOVDQA/MOVDQU
+    case 0xaf: // IMUL
+    case 0xb6: // MOVZX
+    case 0xb7:
+    case 0xbe: // MOVSX
+    case 0xbf:
+    case 0xc3: // MOVNTI
+    case 0xd4: // PADDQ
+    case 0xd6: // MOVQ
+    case 0xd7: // PMOVMSKB
+    case 0xdb: // PAND
+    case 0xe7: // MOVNTDQ
+    case 0xeb: // POR
+    case 0xef: // PXOR
+    case 0xfa: // PSUBD
+    case 0xfb: // PSUBQ
+    case 0xfe: // PADDD
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * Decode the instruction at |p| (which is at |ip|) if it's one we know can
+ * appear in a simple loop body: it doesn't transfer control, except for a
+ * conditional branch, can't make a syscall, and doesn't have a REP
+ * prefix. Returns false for anything else; that's always safe.
+ */
+static bool decode_x86_loop_body_instruction(SupportedArch arch,
+                                             remote_code_ptr ip,
+                                             const uint8_t* p,
+                                             const uint8_t* end,
+                                             LoopBodyInstruction* decoded) {
+  const uint8_t* start = p;
+  bool operand_prefix = false;
+  bool rex_w = false;
+  bool mandatory_prefix = false;
+  decoded->is_conditional_branch = false;
+
+  for (; p < end; ++p) {
+    uint8_t b = *p;
+    if (b == 0x66) {
+      operand_prefix = true;
+    } else if (b == 0xf2 || b == 0xf3) {
+      // Only allowed as an SSE mandatory prefix; checked below.
+      mandatory_prefix = true;
+    } else if (b == 0x26 || b == 0x2e || b == 0x36 || b == 0x3e ||
+               b == 0x64 || b == 0x65) {
+      // Segment override.
+    } else {
+      break;
+    }
+  }
+  if (p < end && arch == x86_64 && (*p & 0xf0) == 0x40) {
+    rex_w = (*p & 8) != 0;
+    ++p;
+  }
+  if (p >= end) {
+    return false;
+  }
+
+  uint8_t op = *p++;
+  int immediate = 0;
+  int immz = operand_prefix ? 2 : 4;
+  bool has_modrm = false;
+
+  if (op == 0x0f) {
+    if (p >= end) {
+      return false;
+    }
+    uint8_t op2 = *p++;
+    if (op2 >= 0x80 && op2 <= 0x8f) {
+      // Jcc rel32
+      if (mandatory_prefix || p + 4 > end) {
+        return false;
+      }
+      int32_t rel;
+      memcpy(&rel, p, 4);
+      p += 4;
+      decoded->is_conditional_branch = true;
+      decoded->branch_target = ip + (p - start) + rel;
+    } else if (is_simple_0f_modrm_opcode(op2)) {
+      has_modrm = true;
+    } else {
+      return false;
+    }
+  } else if (mandatory_prefix) {
+    return false;
+  } else if ((op == 0xc5 || op == 0xc4) && arch == x86_64) {
+    // VEX; only map 1 (0F) is supported.
+    if (op == 0xc4) {
+      if (p >= end || (*p & 0x1f) != 1) {
+        return false;
+      }
+      ++p;
+    }
+    if (p + 2 > end) {
+      return false;
+    }
+    ++p;
+    uint8_t vop = *p++;
+    if (vop == 0x77) {
+      // VZEROUPPER/VZEROALL
+    } else if (is_simple_0f_modrm_opcode(vop)) {
+      has_modrm = true;
+    } else {
+      return false;
+    }
+  } else if (op < 0x40 && (op & 7) <= 5 && op != 0x0f) {
+    // ADD/OR/ADC/SBB/AND/SUB/XOR/CMP
+    switch (op & 7) {
+      case 4:
+        immediate = 1;
+        break;
+      case 5:
+        immediate = immz;
+        break;
+      default:
+        has_modrm = true;
+        break;
+    }
+  } else if (op >= 0x40 && op <= 0x4f) {
+    // INC/DEC reg (32-bit only; REX was handled above)
+  } else if (op >= 0x50 && op <= 0x5f) {
+    // PUSH/POP reg
+  } else if (op >= 0x70 && op <= 0x7f) {
+    // Jcc rel8
+    if (p >= end) {
+      return false;
+    }
+    int8_t rel = (int8_t)*p++;
+    decoded->is_conditional_branch = true;
+    decoded->branch_target = ip + (p - start) + rel;
+  } else if (op >= 0xb0 && op <= 0xb7) {
+    immediate = 1;
+  } else if (op >= 0xb8 && op <= 0xbf) {
+    immediate = rex_w ? 8 : immz;
+  } else {
+    switch (op) {
+      case 0x63: // MOVSXD
+      case 0x84: // TEST
+      case 0x85:
+      case 0x86: // XCHG
+      case 0x87:
+      case 0x88: // MOV
+      case 0x89:
+      case 0x8a:
+      case 0x8b:
+      case 0x8d: // LEA
+      case 0xd0: // shifts
+      case 0xd1:
+      case 0xd2:
+      case 0xd3:
+        has_modrm = true;
+        break;
+      case 0x69: // IMUL
+      case 0x81: // ALU
+      case 0xc7: // MOV
+        has_modrm = true;
+        immediate = immz;
+        break;
+      case 0x6b: // IMUL
+      case 0x80: // ALU
+      case 0x83:
+      case 0xc0: // shifts
+      case 0xc1:
+      case 0xc6: // MOV
+        has_modrm = true;
+        immediate = 1;
+        break;
+      case 0x90: // NOP
+      case 0x98: // CBW/CWDE/CDQE
+      case 0x99: // CWD/CDQ/CQO
+        break;
+      case 0xa8: // TEST
+        immediate = 1;
+        break;
+      case 0xa9:
+        immediate = immz;
+        break;
+      case 0xf6: // TEST/NOT/NEG/MUL/DIV
+      case 0xf7:
+        if (p >= end) {
+          return false;
+        }
+        has_modrm = true;
+        if (((*p >> 3) & 7) <= 1) {
+          immediate = op == 0xf6 ? 1 : immz;
+        }
+        break;
+      case 0xfe: // INC/DEC; the rest of this group transfers control
+      case 0xff:
+        if (p >= end || ((*p >> 3) & 7) > 1) {
+          return false;
+        }
+        has_modrm = true;
+        break;
+      default:
+        return false;
+    }
+  }
+
+  if (has_modrm) {
+    int len = modrm_length(p, end);
+    if (len < 0) {
+      return false;
+    }
+    p += len;
+  }
+  p += immediate;
+  if (p > end) {
+    return false;
+  }
+  decoded->length = p - start;
+  return true;
+}
+
+/**
+ * Return true if |t| stopped with a trap that isn't a watchpoint.
+ */
+static bool stopped_at_plain_trap(Task* t) {
+  if (t->pending_sig() != SIGTRAP) {
+    return false;
+  }
+  bool watchpoint = t->vm()->notify_watchpoint_fired(t->debug_status());
+  return !watchpoint && !(t->debug_status() & DS_WATCHPOINT_ANY);
+}
+
+/**
+ * If |t| is inside a loop whose body is a single basic block, ending in a
+ * backward conditional branch, and which we can decode completely, go
+ * around it with two stops per iteration instead of one per instruction:
+ * singlestep off the current instruction, then continue to an internal
+ * breakpoint on it (or on the loop exit). Each iteration retires one
+ * conditional branch, so we run at most |ticks_limit - 1 - t->tick_count()|
+ * of them.
+ *
+ * Hardware watchpoints stay armed while the loop runs, so they stop it
+ * just as they would stop singlestepping. We don't try this if there's a
+ * breakpoint in the loop or if one of |states| is inside it, since we
+ * couldn't stop before reaching those.
+ */
+static bool fast_forward_through_loop(Task* t,
+                                      const vector<const Registers*>& states,
+                                      Ticks ticks_limit) {
+  Ticks max_iterations = ticks_limit - 1 - t->tick_count();
+  if (max_iterations < 2) {
+    return false;
+  }
+
+  // Decode forward from the current instruction to the end of its basic
+  // block, which must be a backward branch to at or before here.
+  static const int MAX_LOOP_BYTES = 256;
+  remote_code_ptr ip = t->ip();
+  uint8_t code[MAX_LOOP_BYTES + 16];
+  size_t nread = t->vm()->read_code(t, ip, code, sizeof(code));
+  if (!nread) {
+    return false;
+  }
+  vector<remote_code_ptr> insns;
+  LoopBodyInstruction decoded;
+  remote_code_ptr pc = ip;
+  while (true) {
+    int offset = pc - ip;
+    if (offset >= MAX_LOOP_BYTES ||
+        !decode_x86_loop_body_instruction(t->arch(), pc, code + offset,
+                                          code + nread, &decoded)) {
+      return false;
+    }
+    insns.push_back(pc);
+    pc = pc + decoded.length;
+    if (decoded.is_conditional_branch) {
+      break;
+    }
+  }
+  remote_code_ptr head = decoded.branch_target;
+  remote_code_ptr exit = pc;
+  if (ip < head || ip - head > MAX_LOOP_BYTES) {
+    return false;
+  }
+
+  // Check that the part of the loop before us decodes to instructions
+  // ending exactly here, with no branches.
+  if (head < ip) {
+    uint8_t before[MAX_LOOP_BYTES + 16];
+    int nbefore = (int)t->vm()->read_code(t, head, before, sizeof(before));
+    pc = head;
+    while (pc < ip) {
+      int offset = pc - head;
+      if (offset >= nbefore ||
+          !decode_x86_loop_body_instruction(t->arch(), pc, before + offset,
+                                            before + nbefore, &decoded) ||
+          decoded.is_conditional_branch) {
+        return false;
+      }
+      insns.push_back(pc);
+      pc = pc + decoded.length;
+    }
+    if (pc != ip) {
+      return false;
+    }
+  }
+
+  // Below this, two stops per iteration don't beat singlestepping.
+  static const size_t MIN_LOOP_INSNS = 4;
+  if (insns.size() < MIN_LOOP_INSNS) {
+    return false;
+  }
+  insns.push_back(exit);
+  for (auto insn : insns) {
+    if (t->vm()->get_breakpoint_type_at_addr(insn) != BKPT_NONE) {
+      return false;
+    }
+  }
+  for (auto& state : states) {
+    if (!(state->ip() < head) && state->ip() < exit) {
+      return false;
+    }
+  }
+
+  LOG(debug) << "loop fast-forward: loop " << head << "-" << exit
+             << ", at most " << max_iterations << " iterations";
+
+  t->vm()->add_breakpoint(exit, BKPT_INTERNAL);
+  bool clean_stop = true;
+  for (Ticks i = 0; i < max_iterations; ++i) {
+    t->resume_execution(RESUME_SINGLESTEP, RESUME_WAIT,
+                        RESUME_UNLIMITED_TICKS);
+    if (!stopped_at_plain_trap(t)) {
+      clean_stop = false;
+      break;
+    }
+    if (t->ip() == exit) {
+      break;
+    }
+    t->vm()->add_breakpoint(ip, BKPT_INTERNAL);
+    t->resume_execution(RESUME_CONT, RESUME_WAIT, RESUME_UNLIMITED_TICKS);
+    t->vm()->remove_breakpoint(ip, BKPT_INTERNAL);
+    if (!stopped_at_plain_trap(t)) {
+      clean_stop = false;
+      break;
+    }
+    remote_code_ptr stopped_at =
+        t->ip().decrement_by_bkpt_insn_length(t->arch());
+    ASSERT(t, stopped_at == ip || stopped_at == exit)
+        << "Unexpected trap in loop fast-forward at " << t->ip();
+    Registers r = t->regs();
+    r.set_ip(stopped_at);
+    t->set_regs(r);
+    if (stopped_at == exit) {
+      break;
+    }
+  }
+  t->vm()->remove_breakpoint(exit, BKPT_INTERNAL);
+  if (clean_stop) {
+    // Fake singlestep status for trap diagnosis
+    t->set_debug_status(DS_SINGLESTEP);
+  }
+  return true;
+}
+
 bool fast_forward_through_instruction(Task* t, ResumeRequest how,
-                                      const vector<const Registers*>& states) {
+                                      const vector<const Registers*>& states,
+                                      Ticks loop_ticks_limit) {
   assert(how == RESUME_SINGLESTEP || how == RESUME_SYSEMU_SINGLESTEP);
 
   remote_code_ptr ip = t->ip();
@@ -162,7 +595,17 @@ bool fast_forward_through_instruction(Task* t, ResumeRequest how,
   }
 
   if (t->ip() != ip) {
-    return false;
+    if (!loop_ticks_limit || !is_x86ish(t) ||
+        (t->debug_status() & DS_WATCHPOINT_ANY) ||
+        t->vm()->get_breakpoint_type_at_addr(t->ip()) != BKPT_NONE) {
+      return false;
+    }
+    for (auto& state : states) {
+      if (state->matches(t->regs())) {
+        return false;
+      }
+    }
+    return fast_forward_through_loop(t, states, loop_ticks_limit);
   }
   if (t->vm()->get_breakpoint_type_at_addr(ip) != BKPT_NONE) {
     // breakpoint must have fired
@@ -432,7 +875,7 @@ static bool is_string_instruction(uint8_t byte) {
 
 static int fallible_read_byte(Task* t, remote_ptr<uint8_t> ip) {
   uint8_t byte;
-  if (t->read_bytes_fallible(ip, 1, &byte) == 0) {
+  if (t->vm()->read_code(t, ip.as_int(), &byte, 1) == 0) {
     return -1;
   }
   return byte;
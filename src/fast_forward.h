@@ -28,13 +28,17 @@ class Registers;
  *
  * Spurious returns after any singlestep are also allowed.
  *
- * This will not add more than one tick to t->tick_count().
+ * This will not add more than one tick to t->tick_count(), unless
+ * |loop_ticks_limit| is nonzero. Then, when the singlestep lands inside a
+ * small loop ending in a backward conditional branch, we may run whole
+ * iterations of it, keeping t->tick_count() below |loop_ticks_limit|.
  *
  * Returns true if we did a fast-forward, false if we just did one regular
  * singlestep.
  */
 bool fast_forward_through_instruction(
-    Task* t, ResumeRequest how, const std::vector<const Registers*>& states);
+    Task* t, ResumeRequest how, const std::vector<const Registers*>& states,
+    Ticks loop_ticks_limit = 0);
 
 /**
  * Return true if the instruction at t->ip(), or the instruction immediately
@@ -128,6 +128,8 @@ void write(const string& str) {
   }
 }
 
+bool is_tracing() { return tracing; }
+
 void stop() {
   if (tracing) {
     marker_fd.close();
@@ -32,6 +32,11 @@ void start_function_graph(const Session& session, const TraceStream& trace);
  */
 void write(const std::string& str);
 
+/**
+ * True between start_function_graph() and stop().
+ */
+bool is_tracing();
+
 /**
  * Stop tracing.
  */
@@ -1,6 +1,7 @@
 #!/usr/bin/env python2
 
 import assembly_templates
+import ioctls
 import StringIO
 import os
 import string
@@ -62,13 +63,19 @@ def write_syscall_record_cases(f):
         if isinstance(arg_descriptor, str):
             f.write("    syscall_state.reg_parameter<%s>(%d);\n"
                     % (arg_descriptor, arg))
+        elif isinstance(arg_descriptor, syscalls.InOut):
+            f.write("    syscall_state.reg_parameter<%s>(%d, IN_OUT);\n"
+                    % (arg_descriptor.arg_type, arg))
     for name, obj in syscalls.all():
         # Irregular syscalls will be handled by hand-written code elsewhere.
         if isinstance(obj, syscalls.RegularSyscall):
             f.write("  case Arch::%s:\n" % name)
             for arg in range(1,6):
                 write_recorder_for_arg(obj, arg)
-            f.write("    return PREVENT_SWITCH;\n")
+            if obj.may_block:
+                f.write("    return ALLOW_SWITCH;\n")
+            else:
+                f.write("    return PREVENT_SWITCH;\n")
 
 has_syscall = string.Template("""inline bool
 has_${syscall}_syscall(SupportedArch arch) {
@@ -121,6 +128,43 @@ def write_syscall_helper_functions(f):
     for name, obj in syscalls.all():
         write_helpers(name)
 
+def syscall_properties(name, obj):
+    properties = []
+    if isinstance(obj, syscalls.RegularSyscall):
+        if obj.may_block:
+            properties.append('SYSCALL_MAY_BLOCK')
+        if any(getattr(obj, 'arg' + str(a), None) for a in range(1,6)):
+            properties.append('SYSCALL_HAS_OUTPARAMS')
+    if name in syscalls.address_space_syscalls:
+        properties.append('SYSCALL_AFFECTS_ADDRESS_SPACE')
+    if isinstance(obj, syscalls.UnsupportedSyscall):
+        properties.append('SYSCALL_UNSUPPORTED')
+    return ' | '.join(properties) or '0'
+
+def write_syscall_properties(f):
+    for specializer, arch in [("X86Arch", "x86"), ("X64Arch", "x64")]:
+        by_number = {}
+        for name, obj in syscalls.for_arch(arch):
+            by_number[getattr(obj, arch)] = (name, obj)
+        count = max(by_number.keys()) + 1
+        f.write("constexpr uint8_t %s_syscall_properties[%d] = {\n"
+                % (arch, count))
+        for number in range(count):
+            if number in by_number:
+                name, obj = by_number[number]
+                f.write("  /* %d %s */ %s,\n"
+                        % (number, name, syscall_properties(name, obj)))
+            else:
+                f.write("  /* %d */ SYSCALL_UNSUPPORTED,\n" % number)
+        f.write("};\n")
+        f.write("template <> constexpr uint8_t\n")
+        f.write("syscall_properties_arch<%s>(int syscallno) {\n" % specializer)
+        f.write("  return syscallno >= 0 && syscallno < %d\n" % count)
+        f.write("             ? %s_syscall_properties[syscallno]\n" % arch)
+        f.write("             : uint8_t(SYSCALL_UNSUPPORTED);\n")
+        f.write("}\n")
+        f.write("\n")
+
 def write_check_syscall_numbers(f):
     for name, obj in syscalls.all():
         # XXX hard-coded to x86 currently
@@ -129,16 +173,50 @@ def write_check_syscall_numbers(f):
         f.write("""static_assert(X86Arch::%s == SYS_%s, "Incorrect syscall number for %s");\n"""
                 % (name, name, name))
 
+def ioctl_case_label(name, obj):
+    if obj.number is None:
+        return name
+    return "0x%x /* %s */" % (obj.number, name)
+
+def write_ioctl_record_cases(f):
+    for name, obj in ioctls.all():
+        if obj.number is not None:
+            f.write("""    static_assert(%s == 0x%x, "Incorrect ioctl number for %s");\n"""
+                    % (name, obj.number, name))
+        f.write("    case %s:\n" % ioctl_case_label(name, obj))
+        if obj.arg:
+            f.write("      syscall_state.reg_parameter<%s>(3, %s);\n"
+                    % (obj.arg, obj.direction))
+        f.write("      return PREVENT_SWITCH;\n")
+
+def write_syscallbuf_ioctl_cases(f):
+    for name, obj in ioctls.buffered():
+        label = ioctl_case_label(name, obj)
+        if not obj.arg:
+            size = "0"
+        elif obj.buffered_size:
+            size = obj.buffered_size
+        elif obj.number is not None:
+            size = str((obj.number >> 16) & 0x3fff)
+        else:
+            size = "_IOC_SIZE(%s)" % name
+        f.write("    case %s:\n" % label)
+        f.write("      return sys_ioctl_buffered(call, %s, %d);\n"
+                % (size, 1 if obj.direction == 'IN_OUT' else 0))
+
 generators_for = {
     'AssemblyTemplates': lambda f: assembly_templates.generate(f),
     'CheckSyscallNumbers': write_check_syscall_numbers,
+    'IoctlRecordCase': write_ioctl_record_cases,
     'SyscallEnumsX86': lambda f: write_syscall_enum(f, 'x86'),
     'SyscallEnumsX64': lambda f: write_syscall_enum(f, 'x64'),
     'SyscallEnumsForTestsX86': lambda f: write_syscall_enum_for_tests(f, 'x86'),
     'SyscallEnumsForTestsX64': lambda f: write_syscall_enum_for_tests(f, 'x64'),
     'SyscallnameArch': write_syscallname_arch,
+    'SyscallProperties': write_syscall_properties,
     'SyscallRecordCase': write_syscall_record_cases,
     'SyscallHelperFunctions': write_syscall_helper_functions,
+    'SyscallbufIoctlCase': write_syscallbuf_ioctl_cases,
 }
 
 def main(argv):
@@ -0,0 +1,83 @@
+class Ioctl(object):
+    """An ioctl whose only effect on tracee memory is on the buffer its
+    third argument points to (or none at all). Some, like FIONBIO and
+    FIOCLEX, also change state the kernel keeps for the fd; see below for
+    why rr doesn't need to see those.
+
+    'arg' is the type of that buffer as rr records it, or None if the ioctl
+    doesn't take a buffer or only reads it. As in syscalls.py, use Arch
+    types so mixed-arch process groups are handled correctly.
+
+    'direction' is 'OUT' if the kernel only writes the buffer, 'IN_OUT' if
+    it reads it first, or 'IN' if it only reads it.
+
+    Ioctls with 'buffered' set never block, so the syscallbuf handles them
+    without a ptrace stop. For those with an 'arg', 'buffered_size' is a C
+    expression for the exact number of bytes the kernel reads and writes,
+    which the preload library copies to and from the syscallbuf. It
+    defaults to the size encoded in the request. It must not be larger than
+    what the kernel writes, or copying the result back would clobber tracee
+    memory.
+
+    'number' is needed for ioctls the preload library's system headers
+    don't define. The generated rr code checks it against the definition rr
+    uses.
+    """
+    def __init__(self, arg=None, direction='OUT', buffered=False,
+                 buffered_size=None, number=None):
+        assert direction in ('IN', 'OUT', 'IN_OUT')
+        assert arg is None or direction != 'IN'
+        assert buffered or buffered_size is None
+        self.arg = arg
+        self.direction = direction
+        self.buffered = buffered
+        self.buffered_size = buffered_size
+        self.number = number
+
+def _IOC(dir, type, nr, size):
+    return (dir << 30) | (size << 16) | (ord(type) << 8) | nr
+
+_IOC_WRITE = 1
+_IOC_READ = 2
+
+# File descriptor flags. These change O_NONBLOCK or close-on-exec rather
+# than memory. FdTable doesn't track O_NONBLOCK, and it learns which fds
+# close-on-exec closed by scanning /proc after exec, so it doesn't need to
+# see these calls. Fds rr monitors have the syscallbuf disabled, so ioctls
+# on them always reach prepare_ioctl, which refuses FIOCLEX on fds rr
+# won't let the tracee close, as it does for F_SETFD. FIONBIO reads an int.
+FIOCLEX = Ioctl(buffered=True)
+FIONCLEX = Ioctl(buffered=True)
+FIONBIO = Ioctl(direction='IN', buffered=True)
+
+# Terminals. The kernel's struct termios (from <asm/termbits.h>) is
+# smaller than Arch::termios, which has room for glibc's extra fields.
+TCGETS = Ioctl(arg='typename Arch::termios', buffered=True,
+               buffered_size='sizeof(struct termios)')
+TIOCGWINSZ = Ioctl(arg='typename Arch::winsize', buffered=True,
+                   buffered_size='sizeof(struct winsize)')
+TIOCGPGRP = Ioctl(arg='typename Arch::pid_t', buffered=True,
+                  buffered_size='sizeof(pid_t)')
+TIOCGPTN = Ioctl(arg='unsigned int')
+# Also known as FIONREAD.
+TIOCINQ = Ioctl(arg='int', buffered=True, buffered_size='sizeof(int)')
+TIOCOUTQ = Ioctl(arg='int', buffered=True, buffered_size='sizeof(int)')
+
+# Sound.
+SNDRV_CTL_IOCTL_PVERSION = Ioctl(arg='int')
+SNDRV_CTL_IOCTL_CARD_INFO = Ioctl(arg='typename Arch::snd_ctl_card_info')
+
+# DRM queries that GPU drivers make constantly. Both structs have the same
+# layout on all architectures.
+DRM_IOCTL_GET_MAGIC = Ioctl(arg='struct drm_auth', buffered=True,
+                            number=_IOC(_IOC_READ, 'd', 0x02, 4))
+DRM_IOCTL_GET_CAP = Ioctl(arg='struct drm_get_cap', direction='IN_OUT',
+                          buffered=True,
+                          number=_IOC(_IOC_READ | _IOC_WRITE, 'd', 0x0c, 16))
+
+def all():
+    return sorted((name, obj) for name, obj in globals().iteritems()
+                  if isinstance(obj, Ioctl))
+
+def buffered():
+    return [(name, obj) for name, obj in all() if obj.buffered]
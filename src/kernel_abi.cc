@@ -10,6 +10,12 @@ using namespace std;
 
 namespace rr {
 
+static_assert(syscall_properties_arch<X64Arch>(X64Arch::munmap) &
+                  SYSCALL_AFFECTS_ADDRESS_SPACE,
+              "Syscall properties must be usable at compile time");
+static_assert(syscall_properties_arch<X86Arch>(-1) & SYSCALL_UNSUPPORTED,
+              "Invalid syscall numbers must be unsupported");
+
 static const uint8_t int80_insn[] = { 0xcd, 0x80 };
 static const uint8_t sysenter_insn[] = { 0x0f, 0x34 };
 static const uint8_t syscall_insn[] = { 0x0f, 0x05 };
@@ -167,6 +167,8 @@ struct WordSize32Defs : public KernelConstants {
   typedef Elf32_Ehdr ElfEhdr;
   typedef Elf32_Shdr ElfShdr;
   typedef Elf32_Sym ElfSym;
+  typedef Elf32_Phdr ElfPhdr;
+  typedef Elf32_Dyn ElfDyn;
 };
 
 struct WordSize64Defs : public KernelConstants {
@@ -199,6 +201,8 @@ struct WordSize64Defs : public KernelConstants {
   typedef Elf64_Ehdr ElfEhdr;
   typedef Elf64_Shdr ElfShdr;
   typedef Elf64_Sym ElfSym;
+  typedef Elf64_Phdr ElfPhdr;
+  typedef Elf64_Dyn ElfDyn;
 };
 
 /**
@@ -1041,6 +1045,39 @@ struct BaseArch : public wordsize, public FcntlConstants {
   };
   RR_VERIFY_TYPE_EXPLICIT(struct ::statfs64, statfs64);
 
+  // These structures use fixed-size fields and explicit padding, so they
+  // are the same on all architectures. Older system headers don't define
+  // them, so we can't verify them.
+  struct statx_timestamp {
+    int64_t tv_sec;
+    uint32_t tv_nsec;
+    int32_t __reserved;
+  };
+  struct statx {
+    uint32_t stx_mask;
+    uint32_t stx_blksize;
+    uint64_t stx_attributes;
+    uint32_t stx_nlink;
+    uint32_t stx_uid;
+    uint32_t stx_gid;
+    uint16_t stx_mode;
+    uint16_t __spare0;
+    uint64_t stx_ino;
+    uint64_t stx_size;
+    uint64_t stx_blocks;
+    uint64_t stx_attributes_mask;
+    statx_timestamp stx_atime;
+    statx_timestamp stx_btime;
+    statx_timestamp stx_ctime;
+    statx_timestamp stx_mtime;
+    uint32_t stx_rdev_major;
+    uint32_t stx_rdev_minor;
+    uint32_t stx_dev_major;
+    uint32_t stx_dev_minor;
+    uint64_t __spare2[14];
+  };
+  static_assert(sizeof(statx) == 256, "struct statx has the wrong size");
+
   struct itimerval {
     timeval it_interval;
     timeval it_value;
@@ -1477,6 +1514,35 @@ struct X64Arch : public BaseArch<SupportedArch::x86_64, WordSize64Defs> {
 
 #include "SyscallHelperFunctions.generated"
 
+/**
+ * Properties of syscalls, from syscalls.py. SYSCALL_MAY_BLOCK and
+ * SYSCALL_HAS_OUTPARAMS are only known for syscalls whose recording is
+ * generated (RegularSyscalls); hand-written ones never have them.
+ */
+enum SyscallProperty {
+  SYSCALL_MAY_BLOCK = 1 << 0,
+  SYSCALL_HAS_OUTPARAMS = 1 << 1,
+  SYSCALL_AFFECTS_ADDRESS_SPACE = 1 << 2,
+  // Unknown to rr, unsupported, or not a syscall number at all
+  SYSCALL_UNSUPPORTED = 1 << 3,
+};
+
+/**
+ * Return the SyscallProperty bits of |syscallno|. This is a table lookup
+ * and can be evaluated at compile time.
+ */
+template <typename Arch> constexpr uint8_t syscall_properties_arch(int syscallno);
+
+#include "SyscallProperties.generated"
+
+inline uint8_t syscall_properties(int syscallno, SupportedArch arch) {
+  RR_ARCH_FUNCTION(syscall_properties_arch, arch, syscallno);
+}
+
+inline bool syscall_affects_address_space(int syscallno, SupportedArch arch) {
+  return syscall_properties(syscallno, arch) & SYSCALL_AFFECTS_ADDRESS_SPACE;
+}
+
 /**
  * Return true if |ptr| in task |t| points to an invoke-syscall instruction.
  */
@@ -5,6 +5,8 @@
 
 #include <linux/mman.h>
 #include <linux/seccomp.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/ptrace.h>
 
 namespace rr {
@@ -82,6 +84,43 @@ static_assert(_NSIG / 8 == sizeof(sig_set_t), "Update sig_set_t for _NSIG.");
 #define BUS_MCEERR_AO 5
 #endif
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+#ifndef ARCH_GET_CPUID
+#define ARCH_GET_CPUID 0x1011
+#endif
+#ifndef ARCH_SET_CPUID
+#define ARCH_SET_CPUID 0x1012
+#endif
+
+// New in the 6.11 kernel: look up a single mapping through an ioctl on
+// /proc/<pid>/maps. Our own copy of the struct so we build against older
+// headers.
+struct rr_procmap_query {
+  uint64_t size;
+  uint64_t query_flags;
+  uint64_t query_addr;
+  uint64_t vma_start;
+  uint64_t vma_end;
+  uint64_t vma_flags;
+  uint64_t vma_page_size;
+  uint64_t vma_offset;
+  uint64_t inode;
+  uint32_t dev_major;
+  uint32_t dev_minor;
+  uint32_t vma_name_size;
+  uint32_t build_id_size;
+  uint64_t vma_name_addr;
+  uint64_t build_id_addr;
+};
+#define RR_PROCMAP_QUERY _IOWR('f', 17, struct rr_procmap_query)
+#define RR_PROCMAP_QUERY_VMA_READABLE 0x01
+#define RR_PROCMAP_QUERY_VMA_WRITABLE 0x02
+#define RR_PROCMAP_QUERY_VMA_EXECUTABLE 0x04
+#define RR_PROCMAP_QUERY_VMA_SHARED 0x08
+
 } // namespace rr
 
 #endif /* RR_KERNEL_SUPPLEMENT_H_ */
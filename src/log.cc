@@ -3,7 +3,9 @@
 #include "log.h"
 
 #include <stdlib.h>
+#include <string.h>
 
+#include <algorithm>
 #include <memory>
 #include <sstream>
 #include <unordered_map>
@@ -65,6 +67,11 @@ static LogLevel default_level = LOG_error;
 static unique_ptr<unordered_map<string, LogLevel> > level_map;
 static unique_ptr<unordered_map<const char*, LogModule> > log_modules;
 static unique_ptr<stringstream> logging_stream;
+// When RR_LOG_BUFFER is set, info and debug messages are kept in this ring
+// buffer instead of being written out, and only printed when rr fails.
+static unique_ptr<vector<char> > log_buffer;
+static size_t log_buffer_pos;
+static bool log_buffer_wrapped;
 
 static void init_log_globals() {
   if (log_globals_initialized) {
@@ -113,6 +120,15 @@ static void init_log_globals() {
     }
     free(env);
   }
+  char* buffer_env = getenv("RR_LOG_BUFFER");
+  if (buffer_env) {
+    size_t size = strtoul(buffer_env, nullptr, 10);
+    if (size > 0) {
+      log_buffer = unique_ptr<vector<char> >(new vector<char>(size));
+      log_buffer_pos = 0;
+      log_buffer_wrapped = false;
+    }
+  }
 }
 
 static LogLevel get_log_level(const string& name) {
@@ -187,9 +203,54 @@ ostream& log_stream() {
   return *logging_stream;
 }
 
-static void flush_log_stream() {
-  cerr << logging_stream->str();
-  ftrace::write(logging_stream->str());
+static void append_to_log_buffer(const string& s) {
+  vector<char>& buf = *log_buffer;
+  const char* data = s.data();
+  size_t size = s.size();
+  if (size > buf.size()) {
+    // Only the end of the message fits.
+    data += size - buf.size();
+    size = buf.size();
+  }
+  size_t first = min(size, buf.size() - log_buffer_pos);
+  memcpy(buf.data() + log_buffer_pos, data, first);
+  memcpy(buf.data(), data + first, size - first);
+  log_buffer_pos += size;
+  if (log_buffer_pos >= buf.size()) {
+    log_buffer_pos -= buf.size();
+    log_buffer_wrapped = true;
+  }
+}
+
+/**
+ * Print the buffered messages, oldest first. Messages logged after this
+ * are written out directly.
+ */
+static void dump_log_buffer() {
+  if (!log_buffer) {
+    return;
+  }
+  vector<char>& buf = *log_buffer;
+  cerr << "=== Start rr log buffer dump ===\n";
+  if (log_buffer_wrapped) {
+    cerr.write(buf.data() + log_buffer_pos, buf.size() - log_buffer_pos);
+  }
+  cerr.write(buf.data(), log_buffer_pos);
+  cerr << "=== End rr log buffer dump ===\n";
+  log_buffer = nullptr;
+}
+
+static void flush_log_stream(LogLevel level) {
+  string s = logging_stream->str();
+  if (log_buffer && level >= LOG_info) {
+    append_to_log_buffer(s);
+  } else {
+    if (level <= LOG_fatal) {
+      dump_log_buffer();
+    }
+    cerr << s;
+  }
+  ftrace::write(s);
   logging_stream->str(string());
 }
 
@@ -226,7 +287,7 @@ NewlineTerminatingOstream::NewlineTerminatingOstream(LogLevel level,
 NewlineTerminatingOstream::~NewlineTerminatingOstream() {
   if (enabled) {
     log_stream() << std::endl;
-    flush_log_stream();
+    flush_log_stream(level);
     if (Flags::get().fatal_errors_and_warnings && level <= LOG_warn) {
       abort();
     }
@@ -239,7 +300,7 @@ FatalOstream::FatalOstream(const char* file, int line, const char* function) {
 
 FatalOstream::~FatalOstream() {
   log_stream() << std::endl;
-  flush_log_stream();
+  flush_log_stream(LOG_fatal);
   abort();
 }
 
@@ -282,7 +343,7 @@ EmergencyDebugOstream::EmergencyDebugOstream(bool cond, const Task* t,
 EmergencyDebugOstream::~EmergencyDebugOstream() {
   if (!cond) {
     log_stream() << std::endl;
-    flush_log_stream();
+    flush_log_stream(LOG_fatal);
     t->log_pending_events();
     emergency_debug(t);
   }
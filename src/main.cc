@@ -14,6 +14,7 @@
 #include "Flags.h"
 #include "log.h"
 #include "RecordCommand.h"
+#include "Timeline.h"
 
 using namespace std;
 
@@ -111,6 +112,9 @@ void print_usage(FILE* out) {
       "                             'Ivy Bridge'. Note that rr will not work "
       "with\n"
       "                             Intel Merom or Penryn microarchitectures.\n"
+      "  -B, --block-cache=<DIR>    share decompressed trace data with other\n"
+      "                             rr processes reading the same trace\n"
+      "                             through files in DIR\n"
       "  -C, --checksum={on-syscalls,on-all-events}|FROM_TIME\n"
       "                             compute and store (during recording) or\n"
       "                             read and verify (during replay) checksums\n"
@@ -132,15 +136,28 @@ void print_usage(FILE* out) {
       "                             like good ideas, for example launching an\n"
       "                             interactive emergency debugger if stderr\n"
       "                             isn't a tty.\n"
+      "  -G, --follow               read a trace that's still being recorded,\n"
+      "                             waiting for the recorder at the end of\n"
+      "                             what it has written so far\n"
       "  -K, --check-cached-mmaps   verify that cached task mmaps match "
       "/proc/maps\n"
+      "  -I, --check-cached-mmaps-incrementally\n"
+      "                             like -K, but only verify the ranges rr\n"
+      "                             changed since the previous check\n"
       "  -E, --fatal-errors         any warning or error that is printed is\n"
       "                             treated as fatal\n"
+      "  -L, --timeline=<FILE>      write a Chrome/Perfetto trace of what rr\n"
+      "                             is doing (ptrace waits, syscall handling,\n"
+      "                             scheduling, compression, checkpoints) to\n"
+      "                             <FILE>\n"
       "  -M, --mark-stdio           mark stdio writes with [rr <PID> <EV>]\n"
       "                             where EV is the global trace time at\n"
       "                             which the write occurs and PID is the pid\n"
       "                             of the process it occurs in.\n"
       "  -N, --version              print the version number and exit\n"
+      "  -R, --read-ahead=<NUM>     decompress up to NUM trace blocks ahead\n"
+      "                             of the reader on worker threads. 0\n"
+      "                             disables read-ahead. Default 2.\n"
       "  -S, --suppress-environment-warnings\n"
       "                             suppress warnings about issues in the\n"
       "                             environment that rr has no control over\n"
@@ -150,7 +167,9 @@ void print_usage(FILE* out) {
       "  -W, --wait-secs=<NUM_SECS> wait NUM_SECS seconds just after startup,\n"
       "                             before initiating recording or replaying\n"
       "\n"
-      "Use RR_LOG to control logging; e.g. RR_LOG=all:warn,Task:debug\n",
+      "Use RR_LOG to control logging; e.g. RR_LOG=all:warn,Task:debug\n"
+      "Set RR_LOG_BUFFER=<BYTES> to keep info and debug messages in a ring\n"
+      "buffer of that size, printed only if rr fails.\n",
       out);
 }
 
@@ -163,18 +182,23 @@ static void init_random() {
 
 bool parse_global_option(std::vector<std::string>& args) {
   static const OptionSpec options[] = {
+    { 'B', "block-cache", HAS_PARAMETER },
     { 'C', "checksum", HAS_PARAMETER },
     { 'K', "check-cached-mmaps", NO_PARAMETER },
+    { 'I', "check-cached-mmaps-incrementally", NO_PARAMETER },
     { 'U', "cpu-unbound", NO_PARAMETER },
     { 'T', "dump-at", HAS_PARAMETER },
     { 'D', "dump-on", HAS_PARAMETER },
     { 'F', "force-things", NO_PARAMETER },
+    { 'G', "follow", NO_PARAMETER },
     { 'A', "microarch", HAS_PARAMETER },
     { 'M', "mark-stdio", NO_PARAMETER },
     { 'S', "suppress-environment-warnings", NO_PARAMETER },
     { 'E', "fatal-errors", NO_PARAMETER },
     { 'V', "verbose", NO_PARAMETER },
-    { 'N', "version", NO_PARAMETER }
+    { 'N', "version", NO_PARAMETER },
+    { 'R', "read-ahead", HAS_PARAMETER },
+    { 'L', "timeline", HAS_PARAMETER }
   };
 
   ParsedOption opt;
@@ -187,6 +211,9 @@ bool parse_global_option(std::vector<std::string>& args) {
     case 'A':
       flags.forced_uarch = opt.value;
       break;
+    case 'B':
+      flags.block_cache_dir = opt.value;
+      break;
     case 'C':
       if (opt.value == "on-syscalls") {
         LOG(info) << "checksumming on syscall exit";
@@ -208,9 +235,19 @@ bool parse_global_option(std::vector<std::string>& args) {
     case 'F':
       flags.force_things = true;
       break;
+    case 'G':
+      flags.follow_trace = true;
+      break;
+    case 'I':
+      flags.check_cached_mmaps = true;
+      flags.check_cached_mmaps_incrementally = true;
+      break;
     case 'K':
       flags.check_cached_mmaps = true;
       break;
+    case 'L':
+      Timeline::open(opt.value);
+      break;
     case 'M':
       flags.mark_stdio = true;
       break;
@@ -223,6 +260,12 @@ bool parse_global_option(std::vector<std::string>& args) {
     case 'N':
       show_version = true;
       break;
+    case 'R':
+      if (!opt.verify_valid_int(0, 64)) {
+        return false;
+      }
+      flags.read_ahead_blocks = opt.int_value;
+      break;
     default:
       assert(0 && "Invalid flag");
   }
@@ -44,6 +44,7 @@
  * XShmQueryExtension.
  */
 
+#include <asm/termbits.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -64,6 +65,7 @@
 #include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/prctl.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -117,13 +119,27 @@ static unsigned char in_replay;
 static int pretend_num_cores = 1;
 
 /**
- * If syscallbuf_fds_disabled[fd] is nonzero, then operations on that fd
+ * If fd's bit in syscallbuf_fds_disabled is set, then operations on that fd
  * must be performed through traced syscalls, not the syscallbuf.
- * The rr supervisor modifies this array directly to dynamically turn
- * syscallbuf on and off for particular fds. fds outside the array range must
- * never use the syscallbuf.
+ * The rr supervisor modifies this bitmap directly to dynamically turn
+ * syscallbuf on and off for particular fds. fds outside the bitmap range
+ * must never use the syscallbuf.
  */
-static volatile char syscallbuf_fds_disabled[SYSCALLBUF_FDS_DISABLED_SIZE];
+static volatile char
+    syscallbuf_fds_disabled[SYSCALLBUF_FDS_DISABLED_SIZE / 8];
+
+/**
+ * rr sets this once another task shares our address space. Buffered
+ * mprotects and munmaps only reach rr's memory map when the thread that
+ * made them stops, so they're only buffered while we're alone in it.
+ */
+static volatile unsigned char mm_buffering_disabled;
+
+static int is_fd_disabled(int fd) {
+  return fd < 0 || fd >= SYSCALLBUF_FDS_DISABLED_SIZE ||
+         (syscallbuf_fds_disabled[SYSCALLBUF_FDS_DISABLED_BYTE(fd)] &
+          SYSCALLBUF_FDS_DISABLED_BIT(fd));
+}
 
 /**
  * Because this library is always loaded via LD_PRELOAD, we can use the
@@ -141,6 +157,9 @@ static __thread int thread_inited TLS_STORAGE_MODEL;
  * syscallbuf_hdr|, so |buffer| is also a pointer to the buffer
  * header. */
 static __thread uint8_t* buffer TLS_STORAGE_MODEL;
+/* rr's scratch area for this thread. */
+static __thread uint8_t* scratch_ptr TLS_STORAGE_MODEL;
+static __thread size_t scratch_size TLS_STORAGE_MODEL;
 /* This is used to support the buffering of "may-block" system calls.
  * The problem that needs to be addressed can be introduced with a
  * simple example; assume that we're buffering the "read" and "write"
@@ -204,10 +223,10 @@ static uint8_t* buffer_last(void) {
 }
 
 /**
- * Return a pointer to the byte just after the very end of the mapped
- * region.
+ * Return a pointer to the byte just after the end of the part of the
+ * buffer rr lets us use.
  */
-static uint8_t* buffer_end(void) { return buffer + SYSCALLBUF_BUFFER_SIZE; }
+static uint8_t* buffer_end(void) { return buffer + buffer_hdr()->usable_size; }
 
 /**
  * Same as libc memcpy(), but usable within syscallbuf transaction
@@ -569,6 +588,8 @@ static void init_thread(void) {
 
   /* rr initializes the buffer header. */
   buffer = args.syscallbuf_ptr;
+  scratch_ptr = args.scratch_ptr;
+  scratch_size = args.scratch_size;
 
   thread_inited = 1;
 }
@@ -610,6 +631,9 @@ static void __attribute__((constructor)) init_process(void) {
     /* Our vdso syscall patch has 'int 80' followed by onp; nop; nop */
     { 3, { 0x90, 0x90, 0x90 }, (uintptr_t)_syscall_hook_trampoline_90_90_90 }
   };
+  /* rdtsc patching is only implemented for x86-64. */
+  struct syscall_patch_hook* rdtsc_patch_hooks = NULL;
+  const int rdtsc_patch_hook_count = 0;
 
   /* Load GLIBC 2.1 version of pthread_create. Otherwise we may get the 2.0
      version, which cannot handle the pthread_attr values passed by callers
@@ -618,6 +642,7 @@ static void __attribute__((constructor)) init_process(void) {
 #elif defined(__x86_64__)
   extern RR_HIDDEN void _syscall_hook_trampoline_48_3d_01_f0_ff_ff(void);
   extern RR_HIDDEN void _syscall_hook_trampoline_48_3d_00_f0_ff_ff(void);
+  extern RR_HIDDEN void _syscall_hook_trampoline_3d_00_f0_ff_ff(void);
   extern RR_HIDDEN void _syscall_hook_trampoline_48_8b_3c_24(void);
   extern RR_HIDDEN void _syscall_hook_trampoline_5a_5e_c3(void);
   extern RR_HIDDEN void _syscall_hook_trampoline_90_90_90(void);
@@ -632,6 +657,11 @@ static void __attribute__((constructor)) init_process(void) {
     { 6,
       { 0x48, 0x3d, 0x00, 0xf0, 0xff, 0xff },
       (uintptr_t)_syscall_hook_trampoline_48_3d_00_f0_ff_ff },
+    /* Some glibc syscall wrappers that return int (e.g. fstatat) have
+     * 'syscall' followed by cmp $-4096,%eax (in glibc-2.33) */
+    { 5,
+      { 0x3d, 0x00, 0xf0, 0xff, 0xff },
+      (uintptr_t)_syscall_hook_trampoline_3d_00_f0_ff_ff },
     /* Many glibc syscall wrappers (e.g. read) have 'syscall' followed by
      * mov (%rsp),%rdi (in glibc-2.18-16.fc20.x86_64) */
     { 4,
@@ -644,6 +674,16 @@ static void __attribute__((constructor)) init_process(void) {
     { 3, { 0x90, 0x90, 0x90 }, (uintptr_t)_syscall_hook_trampoline_90_90_90 }
   };
 
+  extern RR_HIDDEN void _rdtsc_hook_trampoline_48_c1_e2_20(void);
+  struct syscall_patch_hook rdtsc_patch_hooks[] = {
+    /* __rdtsc() compiles to 'rdtsc' followed by shl $32,%rdx */
+    { 4,
+      { 0x48, 0xc1, 0xe2, 0x20 },
+      (uintptr_t)_rdtsc_hook_trampoline_48_c1_e2_20 },
+  };
+  const int rdtsc_patch_hook_count =
+      sizeof(rdtsc_patch_hooks) / sizeof(rdtsc_patch_hooks[0]);
+
   real_pthread_create = dlsym(RTLD_NEXT, "pthread_create");
 #else
 #error Unknown architecture
@@ -665,8 +705,11 @@ static void __attribute__((constructor)) init_process(void) {
   params.syscall_patch_hook_count =
       sizeof(syscall_patch_hooks) / sizeof(syscall_patch_hooks[0]);
   params.syscall_patch_hooks = syscall_patch_hooks;
+  params.rdtsc_patch_hook_count = rdtsc_patch_hook_count;
+  params.rdtsc_patch_hooks = rdtsc_patch_hooks;
   params.in_replay_flag = &in_replay;
   params.pretend_num_cores = &pretend_num_cores;
+  params.mm_buffering_disabled = &mm_buffering_disabled;
   params.breakpoint_table = &_breakpoint_table_entry_start;
   params.breakpoint_table_entry_size =
       &_breakpoint_table_entry_end - &_breakpoint_table_entry_start;
@@ -845,13 +888,22 @@ static void* prep_syscall(void) {
  * start_commit_syscall will abort cleanly and a traced syscall will be used).
  */
 static void* prep_syscall_for_fd(int fd) {
-  if (fd < 0 || fd >= SYSCALLBUF_FDS_DISABLED_SIZE ||
-      syscallbuf_fds_disabled[fd]) {
+  if (is_fd_disabled(fd)) {
     return NULL;
   }
   return prep_syscall();
 }
 
+/**
+ * Like prep_syscall_for_fd, but for syscalls that operate on two fds.
+ */
+static void* prep_syscall_for_fds(int fd1, int fd2) {
+  if (is_fd_disabled(fd2)) {
+    return NULL;
+  }
+  return prep_syscall_for_fd(fd1);
+}
+
 static void arm_desched_event(void) {
   /* Don't trace the ioctl; doing so would trigger a flushing
    * ptrace trap, which is exactly what this code is trying to
@@ -880,6 +932,33 @@ static void disarm_desched_event(void) {
 /* (Negative numbers so as to not be valid syscall numbers, in case
  * the |int| arguments below are passed in the wrong order.) */
 enum { MAY_BLOCK = -1, WONT_BLOCK = -2 };
+
+/**
+ * Arming and disarming the desched event costs two ioctls, so only claim a
+ * syscall may block when it really can. Calls that are told not to wait
+ * can't block for long enough to need it.
+ */
+static int msg_flags_blockness(int flags) {
+  return (flags & MSG_DONTWAIT) ? WONT_BLOCK : MAY_BLOCK;
+}
+
+/**
+ * |timeout| is a struct timeval or struct timespec of |timeout_size| bytes.
+ * A zero timeout means poll and return immediately.
+ */
+static int timeout_blockness(const void* timeout, size_t timeout_size) {
+  const char* p = timeout;
+  size_t i;
+  if (!timeout) {
+    return MAY_BLOCK;
+  }
+  for (i = 0; i < timeout_size; ++i) {
+    if (p[i]) {
+      return MAY_BLOCK;
+    }
+  }
+  return WONT_BLOCK;
+}
 static int start_commit_buffered_syscall(int syscallno, void* record_end,
                                          int blockness) {
   void* record_start;
@@ -902,7 +981,9 @@ static int start_commit_buffered_syscall(int syscallno, void* record_end,
     /* Buffer overflow.
      * Unlock the buffer and then execute the system call
      * with a trap to rr.  Note that we reserve enough
-     * space in the buffer for the next prep_syscall(). */
+     * space in the buffer for the next prep_syscall().
+     * Let rr know, so it can give us a bigger buffer. */
+    buffer_hdr()->overflowed = 1;
     buffer_hdr()->locked = 0;
     return 0;
   }
@@ -1105,6 +1186,57 @@ static void copy_futex_int(uint32_t* buf, uint32_t* real) {
 
 /* Keep syscalls in alphabetical order, please. */
 
+#ifdef SYS_accept4
+static long sys_accept4(const struct syscall_info* call) {
+  const int syscallno = SYS_accept4;
+  int sockfd = call->args[0];
+  struct sockaddr* addr = (struct sockaddr*)call->args[1];
+  socklen_t* addrlen = (socklen_t*)call->args[2];
+  int flags = call->args[3];
+
+  void* ptr = prep_syscall_for_fd(sockfd);
+  struct sockaddr* addr2 = NULL;
+  socklen_t* addrlen2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (addr) {
+    if (!addrlen) {
+      /* The kernel will fail with EFAULT; let rr record that. */
+      return traced_raw_syscall(call);
+    }
+    addr2 = ptr;
+    ptr += *addrlen;
+  }
+  if (addrlen) {
+    addrlen2 = ptr;
+    ptr += sizeof(*addrlen);
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  if (addrlen) {
+    memcpy_input_parameter(addrlen2, addrlen, sizeof(*addrlen2));
+  }
+  ret = untraced_syscall4(syscallno, sockfd, addr2, addrlen2, flags);
+
+  if (ret >= 0) {
+    if (addr2) {
+      socklen_t actual_size = *addrlen2;
+      if (actual_size > *addrlen) {
+        actual_size = *addrlen;
+      }
+      local_memcpy(addr, addr2, actual_size);
+    }
+    if (addrlen2) {
+      *addrlen = *addrlen2;
+    }
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+#endif
+
 static long sys_access(const struct syscall_info* call) {
   const int syscallno = SYS_access;
   const char* pathname = (const char*)call->args[0];
@@ -1122,6 +1254,24 @@ static long sys_access(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_faccessat(const struct syscall_info* call) {
+  const int syscallno = SYS_faccessat;
+  int dirfd = call->args[0];
+  const char* pathname = (const char*)call->args[1];
+  int mode = call->args[2];
+
+  void* ptr = prep_syscall();
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  ret = untraced_syscall3(syscallno, dirfd, pathname, mode);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_clock_gettime(const struct syscall_info* call) {
   const int syscallno = SYS_clock_gettime;
   clockid_t clk_id = (clockid_t)call->args[0];
@@ -1147,6 +1297,34 @@ static long sys_clock_gettime(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_clock_nanosleep(const struct syscall_info* call) {
+  const int syscallno = SYS_clock_nanosleep;
+  clockid_t clock_id = (clockid_t)call->args[0];
+  int flags = call->args[1];
+  const struct timespec* request = (const struct timespec*)call->args[2];
+  struct timespec* remain = (struct timespec*)call->args[3];
+
+  void* ptr = prep_syscall();
+  struct timespec* remain2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  /* The kernel only writes |remain| for relative sleeps. */
+  if (remain && !(flags & TIMER_ABSTIME)) {
+    remain2 = ptr;
+    ptr += sizeof(*remain2);
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  ret = untraced_syscall4(syscallno, clock_id, flags, request, remain2);
+  if (remain2 && ret == -EINTR) {
+    local_memcpy(remain, remain2, sizeof(*remain));
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_close(const struct syscall_info* call) {
   const int syscallno = SYS_close;
   int fd = call->args[0];
@@ -1177,6 +1355,47 @@ static long sys_creat(const struct syscall_info* call) {
   return sys_open(&open_call);
 }
 
+/**
+ * epoll_wait and epoll_pwait. |sigmask| is only read by the kernel, so we
+ * can pass it straight through.
+ */
+static long sys_epoll_wait_common(const struct syscall_info* call,
+                                  const sigset_t* sigmask) {
+  const int syscallno = call->no;
+  int epfd = call->args[0];
+  struct epoll_event* events = (struct epoll_event*)call->args[1];
+  int maxevents = call->args[2];
+  int timeout = call->args[3];
+
+  void* ptr = prep_syscall_for_fd(epfd);
+  struct epoll_event* events2 = NULL;
+  long ret;
+
+  if (maxevents > 0) {
+    events2 = ptr;
+    ptr += maxevents * sizeof(*events2);
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     timeout ? MAY_BLOCK : WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  ret = untraced_syscall6(syscallno, epfd, events2, maxevents, timeout,
+                          sigmask, call->args[5]);
+  ptr = copy_output_buffer(ret > 0 ? ret * sizeof(*events2) : 0, ptr, events,
+                           events2);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_epoll_pwait(const struct syscall_info* call) {
+  assert(SYS_epoll_pwait == call->no);
+  return sys_epoll_wait_common(call, (const sigset_t*)call->args[4]);
+}
+
+static long sys_epoll_wait(const struct syscall_info* call) {
+  assert(SYS_epoll_wait == call->no);
+  return sys_epoll_wait_common(call, NULL);
+}
+
 static int sys_fcntl64_no_outparams(const struct syscall_info* call) {
   const int syscallno = RR_FCNTL_SYSCALL;
   int fd = call->args[0];
@@ -1314,25 +1533,43 @@ static long sys_fcntl(const struct syscall_info* call)
   }
 }
 
-static long sys_safe_nonblocking_ioctl(const struct syscall_info* call) {
+/**
+ * A non-blocking ioctl that reads and/or writes |size| bytes at its third
+ * argument. The kernel uses a copy in the syscallbuf; |copy_in| says
+ * whether it needs the tracee's data first.
+ */
+static long sys_ioctl_buffered(const struct syscall_info* call, size_t size,
+                               int copy_in) {
   const int syscallno = SYS_ioctl;
   int fd = call->args[0];
+  void* arg = (void*)call->args[2];
 
   void* ptr = prep_syscall_for_fd(fd);
+  void* arg2 = NULL;
   long ret;
 
+  if (size > 0 && arg) {
+    arg2 = ptr;
+    ptr += size;
+  }
   if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
     return traced_raw_syscall(call);
   }
-  ret = untraced_syscall2(syscallno, fd, call->args[1]);
+  if (arg2 && copy_in) {
+    memcpy_input_parameter(arg2, arg, size);
+  }
+  ret = untraced_syscall3(syscallno, fd, call->args[1],
+                          arg2 ? (long)arg2 : call->args[2]);
+  if (arg2 && ret >= 0) {
+    local_memcpy(arg, arg2, size);
+  }
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
 static long sys_ioctl(const struct syscall_info* call) {
   switch (call->args[1]) {
-    case FIOCLEX:
-    case FIONCLEX:
-      return sys_safe_nonblocking_ioctl(call);
+// The non-blocking ioctls described in ioctls.py are handled here.
+#include "SyscallbufIoctlCase.generated"
     default:
       return traced_raw_syscall(call);
   }
@@ -1345,26 +1582,34 @@ static long sys_futex(const struct syscall_info* call) {
 
   int op = call->args[1];
   int flags = 0;
+  int blockness = WONT_BLOCK;
   switch (FUTEX_CMD_MASK & op) {
     case FUTEX_WAKE:
+    case FUTEX_WAKE_BITSET:
       break;
+    case FUTEX_REQUEUE:
     case FUTEX_CMP_REQUEUE:
     case FUTEX_WAKE_OP:
       flags |= FUTEX_USES_UADDR2;
       break;
 
-    /* It turns out not to be worth buffering the FUTEX_WAIT*
-     * calls.  When a WAIT call is made, we know almost for sure
-     * that the tracee is going to be desched'd (otherwise the
-     * userspace CAS would have succeeded).  This is unlike
-     * read/write, f.e., where the vast majority of calls aren't
-     * desched'd and the overhead is worth it.  So all that
-     * buffering WAIT does is add the overhead of arming/disarming
-     * desched (which is a measurable perf loss).
-     *
-     * NB: don't ever try to buffer FUTEX_LOCK_PI; it requires
-     * special processing in the tracer process (in addition to
-     * not being worth doing for perf reasons). */
+    /* A WAIT usually means the tracee is about to be desched'd
+     * (otherwise the userspace CAS would have succeeded), so
+     * buffering it mostly adds the cost of arming/disarming
+     * desched. But with contended locks, the futex word often
+     * changes before the WAIT gets to the kernel, which then returns
+     * EAGAIN straight away; timed waits with short timeouts also
+     * often return without blocking. Those are worth buffering. If
+     * the WAIT does block, the desched event turns it into a
+     * traced syscall as usual. */
+    case FUTEX_WAIT:
+    case FUTEX_WAIT_BITSET:
+      blockness = MAY_BLOCK;
+      break;
+
+    /* NB: don't ever try to buffer FUTEX_LOCK_PI or the other PI
+     * ops; they require special processing in the tracer process
+     * (in addition to not being worth doing for perf reasons). */
     default:
       return traced_raw_syscall(call);
   }
@@ -1394,9 +1639,7 @@ static long sys_futex(const struct syscall_info* call) {
     saved_uaddr2 = ptr;
     ptr += sizeof(*saved_uaddr2);
   }
-  /* See above; it's not worth buffering may-block futex
-   * calls. */
-  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr, blockness)) {
     return traced_raw_syscall(call);
   }
 
@@ -1414,6 +1657,31 @@ static long sys_futex(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_getdents64(const struct syscall_info* call) {
+  const int syscallno = SYS_getdents64;
+  int fd = call->args[0];
+  void* dirp = (void*)call->args[1];
+  unsigned int count = call->args[2];
+
+  void* ptr = prep_syscall_for_fd(fd);
+  void* dirp2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (dirp && count > 0) {
+    dirp2 = ptr;
+    ptr += count;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall3(syscallno, fd, dirp2, count);
+  ptr = copy_output_buffer(ret, ptr, dirp, dirp2);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_gettimeofday(const struct syscall_info* call) {
   const int syscallno = SYS_gettimeofday;
   struct timeval* tp = (struct timeval*)call->args[0];
@@ -1536,6 +1804,98 @@ static long sys_madvise(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+/**
+ * Return nonzero if [addr, addr + length) overlaps memory rr owns: this
+ * thread's buffer, its scratch area or the rr page. Since we only buffer
+ * while no other task shares the address space, nobody else owns any.
+ * Changes to those have to go through rr right away.
+ */
+static int overlaps_rr_memory(void* addr, size_t length) {
+  uintptr_t start = (uintptr_t)addr;
+  uintptr_t end = start + length;
+  uintptr_t buf = (uintptr_t)buffer;
+  uintptr_t scratch = (uintptr_t)scratch_ptr;
+  if (end < start) {
+    return 1;
+  }
+  return (start < buf + SYSCALLBUF_BUFFER_SIZE && buf < end) ||
+         (start < scratch + scratch_size && scratch < end) ||
+         (start < RR_PAGE_ADDR + 4096 && RR_PAGE_ADDR < end);
+}
+
+/**
+ * Buffer an mprotect or munmap. The arguments go in the record so rr can
+ * update its memory map from it; JITs and garbage collectors toggling
+ * page protections would otherwise pay for a ptrace stop every time.
+ */
+static long sys_mm_buffered(const struct syscall_info* call, int prot) {
+  const int syscallno = call->no;
+  void* addr = (void*)call->args[0];
+  size_t length = call->args[1];
+
+  void* ptr;
+  struct syscallbuf_mm_args* args;
+  long ret;
+
+  if (mm_buffering_disabled || overlaps_rr_memory(addr, length)) {
+    return traced_raw_syscall(call);
+  }
+
+  ptr = prep_syscall();
+  args = ptr;
+  ptr += sizeof(*args);
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  args->addr = (uintptr_t)addr;
+  args->length = length;
+  args->prot = prot;
+  /* The tracee's memory has to change during replay too. */
+  ret = untraced_replayed_syscall3(syscallno, addr, length, prot);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_mprotect(const struct syscall_info* call) {
+  int prot = call->args[2];
+
+  /* rr implements PROT_GROWSDOWN itself. */
+  if (prot & (PROT_GROWSDOWN | PROT_GROWSUP)) {
+    return traced_raw_syscall(call);
+  }
+  return sys_mm_buffered(call, prot);
+}
+
+static long sys_munmap(const struct syscall_info* call) {
+  return sys_mm_buffered(call, 0);
+}
+
+static long sys_nanosleep(const struct syscall_info* call) {
+  const int syscallno = SYS_nanosleep;
+  const struct timespec* request = (const struct timespec*)call->args[0];
+  struct timespec* remain = (struct timespec*)call->args[1];
+
+  void* ptr = prep_syscall();
+  struct timespec* remain2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (remain) {
+    remain2 = ptr;
+    ptr += sizeof(*remain2);
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  ret = untraced_syscall2(syscallno, request, remain2);
+  /* The kernel only writes |remain| when the sleep is interrupted. */
+  if (remain2 && ret == -EINTR) {
+    local_memcpy(remain, remain2, sizeof(*remain));
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_open(const struct syscall_info* call) {
   const int syscallno = SYS_open;
   const char* pathname = (const char*)call->args[0];
@@ -1567,6 +1927,35 @@ static long sys_open(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_openat(const struct syscall_info* call) {
+  const int syscallno = SYS_openat;
+  int dirfd = call->args[0];
+  const char* pathname = (const char*)call->args[1];
+  int flags = call->args[2];
+  mode_t mode = call->args[3];
+
+  void* ptr;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  /* The open() blacklist only matches paths that resolve the way
+   * open() would resolve them, so leave paths relative to some other
+   * directory to rr. */
+  if ((dirfd != AT_FDCWD && pathname[0] != '/') ||
+      !allow_buffered_open(pathname)) {
+    return traced_raw_syscall(call);
+  }
+
+  ptr = prep_syscall();
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall4(syscallno, dirfd, pathname, flags, mode);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 /**
  * Make this function external so desched_ticks.py can set a breakpoint on it.
  */
@@ -1588,7 +1977,8 @@ static long sys_poll(const struct syscall_info* call) {
     fds2 = ptr;
     ptr += nfds * sizeof(*fds2);
   }
-  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     timeout ? MAY_BLOCK : WONT_BLOCK)) {
     return traced_raw_syscall(call);
   }
   if (fds2) {
@@ -1613,8 +2003,12 @@ static long sys_poll(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
-static long sys_read(const struct syscall_info* call) {
-  const int syscallno = SYS_read;
+/* On x86 the 64-bit file offset of these syscalls is split across two
+ * arguments. Passing both through works on x86-64 too, where the second is
+ * ignored (or, for preadv/pwritev, is the always-zero high word). */
+
+static long sys_pread64(const struct syscall_info* call) {
+  const int syscallno = SYS_pread64;
   int fd = call->args[0];
   void* buf = (void*)call->args[1];
   size_t count = call->args[2];
@@ -1633,60 +2027,259 @@ static long sys_read(const struct syscall_info* call) {
     return traced_raw_syscall(call);
   }
 
-  ret = untraced_syscall3(syscallno, fd, buf2, count);
+  ret = untraced_syscall5(syscallno, fd, buf2, count, call->args[3],
+                          call->args[4]);
   ptr = copy_output_buffer(ret, ptr, buf, buf2);
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
-static long sys_readlink(const struct syscall_info* call) {
-  const int syscallno = SYS_readlink;
-  const char* path = (const char*)call->args[0];
-  char* buf = (char*)call->args[1];
-  int bufsiz = call->args[2];
+static long sys_preadv(const struct syscall_info* call) {
+  const int syscallno = SYS_preadv;
+  int fd = call->args[0];
+  const struct iovec* iov = (const struct iovec*)call->args[1];
+  int iovcnt = call->args[2];
 
-  void* ptr = prep_syscall();
-  char* buf2 = NULL;
+  void* ptr = prep_syscall_for_fd(fd);
+  void* ptr_base = ptr;
+  struct iovec* iov2;
+  void* ptr_overwritten_end;
+  void* ptr_bytes_start;
+  void* ptr_end;
   long ret;
+  int i;
 
   assert(syscallno == call->no);
 
-  if (buf && bufsiz > 0) {
-    buf2 = ptr;
-    ptr += bufsiz;
+  if (iovcnt < 0 || iovcnt > IOV_MAX) {
+    /* The kernel will fail with EINVAL. */
+    return traced_raw_syscall(call);
   }
-  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+  /* As in recvmsg, compute the record size before writing anything to the
+   * buffer. */
+  ptr += sizeof(struct iovec) * iovcnt;
+  for (i = 0; i < iovcnt; ++i) {
+    ptr += iov[i].iov_len;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
     return traced_raw_syscall(call);
   }
 
-  ret = untraced_syscall3(syscallno, path, buf2, bufsiz);
-  ptr = copy_output_buffer(ret, ptr, buf, buf2);
-  return commit_raw_syscall(syscallno, ptr, ret);
+  /* The kernel only writes to the data buffers. What we write to |iov2| is
+   * the same during recording and replay. */
+  iov2 = ptr = ptr_base;
+  ptr += sizeof(struct iovec) * iovcnt;
+  ptr_overwritten_end = ptr_bytes_start = ptr;
+  for (i = 0; i < iovcnt; ++i) {
+    iov2[i].iov_base = ptr;
+    iov2[i].iov_len = iov[i].iov_len;
+    ptr += iov[i].iov_len;
+  }
+
+  ret = untraced_syscall5(syscallno, fd, iov2, iovcnt, call->args[3],
+                          call->args[4]);
+
+  if (ret >= 0) {
+    size_t bytes = ret;
+    ptr_end = ptr_bytes_start + bytes;
+    for (i = 0; i < iovcnt && bytes > 0; ++i) {
+      size_t copy_bytes = bytes < iov[i].iov_len ? bytes : iov[i].iov_len;
+      local_memcpy(iov[i].iov_base, iov2[i].iov_base, copy_bytes);
+      bytes -= copy_bytes;
+    }
+  } else {
+    /* Cover the iovecs we wrote, so the next record doesn't overlap them
+     * and get corrupted during replay. */
+    ptr_end = ptr_overwritten_end;
+  }
+  return commit_raw_syscall(syscallno, ptr_end, ret);
 }
 
-#if defined(SYS_socketcall)
-static long sys_socketcall_recv(const struct syscall_info* call) {
-  const int syscallno = SYS_socketcall;
-  long* args = (long*)call->args[1];
-  int sockfd = args[0];
-  void* buf = (void*)args[1];
-  size_t len = args[2];
-  unsigned int flags = args[3];
-  unsigned long new_args[4];
+/**
+ * select, _newselect and pselect6. They all take three fd_sets and a
+ * timeout the kernel may update, which is a timeval for select and a
+ * timespec for pselect6. pselect6's sixth argument is only read by the
+ * kernel, so we pass it straight through.
+ */
+static long sys_select_common(const struct syscall_info* call,
+                              size_t timeout_size) {
+  const int syscallno = call->no;
+  int nfds = call->args[0];
+  fd_set* fds[3] = { (fd_set*)call->args[1], (fd_set*)call->args[2],
+                     (fd_set*)call->args[3] };
+  void* timeout = (void*)call->args[4];
 
-  void* ptr = prep_syscall_for_fd(sockfd);
-  void* buf2 = NULL;
+  void* ptr = prep_syscall();
+  fd_set* fds2[3] = { NULL, NULL, NULL };
+  void* timeout2 = NULL;
   long ret;
+  int i;
 
-  assert(syscallno == call->no);
-
-  if (buf && len > 0) {
+  if (nfds < 0 || nfds > FD_SETSIZE) {
+    /* The kernel would access more than an fd_set's worth of each set. */
+    return traced_raw_syscall(call);
+  }
+  for (i = 0; i < 3; ++i) {
+    if (fds[i]) {
+      fds2[i] = ptr;
+      ptr += sizeof(fd_set);
+    }
+  }
+  if (timeout) {
+    timeout2 = ptr;
+    ptr += timeout_size;
+  }
+  if (!start_commit_buffered_syscall(
+          syscallno, ptr, timeout_blockness(timeout, timeout_size))) {
+    return traced_raw_syscall(call);
+  }
+  for (i = 0; i < 3; ++i) {
+    if (fds2[i]) {
+      memcpy_input_parameter(fds2[i], fds[i], sizeof(fd_set));
+    }
+  }
+  if (timeout2) {
+    memcpy_input_parameter(timeout2, timeout, timeout_size);
+  }
+
+  ret = untraced_syscall6(syscallno, nfds, fds2[0], fds2[1], fds2[2],
+                          timeout2, call->args[5]);
+
+  /* As with poll, don't copy anything back on error. */
+  if (ret >= 0) {
+    for (i = 0; i < 3; ++i) {
+      if (fds2[i]) {
+        local_memcpy(fds[i], fds2[i], sizeof(fd_set));
+      }
+    }
+    if (timeout2) {
+      local_memcpy(timeout, timeout2, timeout_size);
+    }
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_pselect6(const struct syscall_info* call) {
+  assert(SYS_pselect6 == call->no);
+  return sys_select_common(call, sizeof(struct timespec));
+}
+
+static long sys_pwrite64(const struct syscall_info* call) {
+  const int syscallno = SYS_pwrite64;
+  int fd = call->args[0];
+  const void* buf = (const void*)call->args[1];
+  size_t count = call->args[2];
+
+  void* ptr = prep_syscall_for_fd(fd);
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall5(syscallno, fd, buf, count, call->args[3],
+                          call->args[4]);
+
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_pwritev(const struct syscall_info* call) {
+  const int syscallno = SYS_pwritev;
+  int fd = call->args[0];
+  const struct iovec* iov = (const struct iovec*)call->args[1];
+  int iovcnt = call->args[2];
+
+  void* ptr = prep_syscall_for_fd(fd);
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall5(syscallno, fd, iov, iovcnt, call->args[3],
+                          call->args[4]);
+
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_read(const struct syscall_info* call) {
+  const int syscallno = SYS_read;
+  int fd = call->args[0];
+  void* buf = (void*)call->args[1];
+  size_t count = call->args[2];
+
+  void* ptr = prep_syscall_for_fd(fd);
+  void* buf2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (buf && count > 0) {
     buf2 = ptr;
-    ptr += len;
+    ptr += count;
   }
   if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
     return traced_raw_syscall(call);
   }
 
+  ret = untraced_syscall3(syscallno, fd, buf2, count);
+  ptr = copy_output_buffer(ret, ptr, buf, buf2);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_readlink(const struct syscall_info* call) {
+  const int syscallno = SYS_readlink;
+  const char* path = (const char*)call->args[0];
+  char* buf = (char*)call->args[1];
+  int bufsiz = call->args[2];
+
+  void* ptr = prep_syscall();
+  char* buf2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (buf && bufsiz > 0) {
+    buf2 = ptr;
+    ptr += bufsiz;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall3(syscallno, path, buf2, bufsiz);
+  ptr = copy_output_buffer(ret, ptr, buf, buf2);
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+#if defined(SYS_socketcall)
+static long sys_socketcall_recv(const struct syscall_info* call) {
+  const int syscallno = SYS_socketcall;
+  long* args = (long*)call->args[1];
+  int sockfd = args[0];
+  void* buf = (void*)args[1];
+  size_t len = args[2];
+  unsigned int flags = args[3];
+  unsigned long new_args[4];
+
+  void* ptr = prep_syscall_for_fd(sockfd);
+  void* buf2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (buf && len > 0) {
+    buf2 = ptr;
+    ptr += len;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     msg_flags_blockness(flags))) {
+    return traced_raw_syscall(call);
+  }
+
   new_args[0] = sockfd;
   new_args[1] = (unsigned long)buf2;
   new_args[2] = len;
@@ -1742,7 +2335,8 @@ static long sys_recvfrom(const struct syscall_info* call) {
     buf2 = ptr;
     ptr += len;
   }
-  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     msg_flags_blockness(flags))) {
     return traced_raw_syscall(call);
   }
   if (addrlen) {
@@ -1768,6 +2362,120 @@ static long sys_recvfrom(const struct syscall_info* call) {
 }
 #endif
 
+#ifdef SYS_recvmmsg
+static long sys_recvmmsg(const struct syscall_info* call) {
+  const int syscallno = SYS_recvmmsg;
+  int sockfd = call->args[0];
+  struct mmsghdr* msgvec = (struct mmsghdr*)call->args[1];
+  unsigned int vlen = call->args[2];
+  int flags = call->args[3];
+  struct timespec* timeout = (struct timespec*)call->args[4];
+
+  void* ptr = prep_syscall_for_fd(sockfd);
+  long ret;
+  struct mmsghdr* msgvec2;
+  void* ptr_base = ptr;
+  void* ptr_overwritten_end;
+  void* ptr_end;
+  unsigned int i;
+  size_t j;
+
+  assert(syscallno == call->no);
+
+  /* The kernel writes back the remaining timeout. That's rarely used, so
+   * just trace it. */
+  if (timeout) {
+    return traced_raw_syscall(call);
+  }
+
+  /* Lay out the buffer as for recvmsg, but with all the mmsghdrs first,
+   * then all their iovecs, then names and control data, then the data
+   * itself. Compute the size up front; see sys_recvmsg. */
+  ptr += sizeof(struct mmsghdr) * vlen;
+  for (i = 0; i < vlen; ++i) {
+    struct msghdr* msg = &msgvec[i].msg_hdr;
+    ptr += sizeof(struct iovec) * msg->msg_iovlen;
+  }
+  for (i = 0; i < vlen; ++i) {
+    struct msghdr* msg = &msgvec[i].msg_hdr;
+    if (msg->msg_name) {
+      ptr += msg->msg_namelen;
+    }
+    if (msg->msg_control) {
+      ptr += msg->msg_controllen;
+    }
+    for (j = 0; j < msg->msg_iovlen; ++j) {
+      ptr += msg->msg_iov[j].iov_len;
+    }
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     msg_flags_blockness(flags))) {
+    return traced_raw_syscall(call);
+  }
+
+  /* See sys_recvmsg for why only the mmsghdrs and iovecs need
+   * memcpy_input_parameter. */
+  msgvec2 = ptr = ptr_base;
+  memcpy_input_parameter(msgvec2, msgvec, sizeof(struct mmsghdr) * vlen);
+  ptr += sizeof(struct mmsghdr) * vlen;
+  for (i = 0; i < vlen; ++i) {
+    msgvec2[i].msg_hdr.msg_iov = ptr;
+    ptr += sizeof(struct iovec) * msgvec[i].msg_hdr.msg_iovlen;
+  }
+  ptr_overwritten_end = ptr;
+  for (i = 0; i < vlen; ++i) {
+    struct msghdr* msg = &msgvec[i].msg_hdr;
+    struct msghdr* msg2 = &msgvec2[i].msg_hdr;
+    if (msg->msg_name) {
+      msg2->msg_name = ptr;
+      ptr += msg->msg_namelen;
+    }
+    if (msg->msg_control) {
+      msg2->msg_control = ptr;
+      ptr += msg->msg_controllen;
+    }
+    for (j = 0; j < msg->msg_iovlen; ++j) {
+      msg2->msg_iov[j].iov_base = ptr;
+      ptr += msg->msg_iov[j].iov_len;
+      msg2->msg_iov[j].iov_len = msg->msg_iov[j].iov_len;
+    }
+  }
+  ptr_end = ptr;
+
+  ret = untraced_syscall5(syscallno, sockfd, msgvec2, vlen, flags, NULL);
+
+  if (ret >= 0) {
+    for (i = 0; i < ret; ++i) {
+      struct msghdr* msg = &msgvec[i].msg_hdr;
+      struct msghdr* msg2 = &msgvec2[i].msg_hdr;
+      size_t bytes = msgvec2[i].msg_len;
+      if (msg->msg_name) {
+        local_memcpy(msg->msg_name, msg2->msg_name, msg2->msg_namelen);
+      }
+      msg->msg_namelen = msg2->msg_namelen;
+      if (msg->msg_control) {
+        local_memcpy(msg->msg_control, msg2->msg_control,
+                     msg2->msg_controllen);
+      }
+      msg->msg_controllen = msg2->msg_controllen;
+      for (j = 0; j < msg->msg_iovlen; ++j) {
+        long copy_bytes =
+            bytes < msg->msg_iov[j].iov_len ? bytes : msg->msg_iov[j].iov_len;
+        local_memcpy(msg->msg_iov[j].iov_base, msg2->msg_iov[j].iov_base,
+                     copy_bytes);
+        bytes -= copy_bytes;
+      }
+      msg->msg_flags = msg2->msg_flags;
+      msgvec[i].msg_len = msgvec2[i].msg_len;
+    }
+  } else {
+    /* See sys_recvmsg. */
+    ptr_end = ptr_overwritten_end;
+  }
+  return commit_raw_syscall(syscallno, ptr_end, ret);
+}
+#endif
+
 #ifdef SYS_recvmsg
 static long sys_recvmsg(const struct syscall_info* call) {
   const int syscallno = SYS_recvmsg;
@@ -1801,7 +2509,8 @@ static long sys_recvmsg(const struct syscall_info* call) {
   for (i = 0; i < msg->msg_iovlen; ++i) {
     ptr += msg->msg_iov[i].iov_len;
   }
-  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     msg_flags_blockness(flags))) {
     return traced_raw_syscall(call);
   }
 
@@ -1868,6 +2577,108 @@ static long sys_recvmsg(const struct syscall_info* call) {
 }
 #endif
 
+#if defined(__i386__)
+/* On x86, select takes its arguments in a struct; _newselect is the
+ * select we know. */
+static long sys__newselect(const struct syscall_info* call) {
+  assert(SYS__newselect == call->no);
+  return sys_select_common(call, sizeof(struct timeval));
+}
+#else
+static long sys_select(const struct syscall_info* call) {
+  assert(SYS_select == call->no);
+  return sys_select_common(call, sizeof(struct timeval));
+}
+#endif
+
+/**
+ * sendfile and splice update their optional offsets in place. Pass the
+ * kernel a copy in the buffer, and copy it back afterward.
+ */
+static void* prep_offset_parameter(void** ptr, void* offset,
+                                   size_t offset_size) {
+  void* offset2 = NULL;
+  if (offset) {
+    offset2 = *ptr;
+    *ptr += offset_size;
+  }
+  return offset2;
+}
+
+static long sys_sendfile_common(const struct syscall_info* call,
+                                size_t offset_size) {
+  const int syscallno = call->no;
+  int out_fd = call->args[0];
+  int in_fd = call->args[1];
+  void* offset = (void*)call->args[2];
+  size_t count = call->args[3];
+
+  void* ptr = prep_syscall_for_fds(out_fd, in_fd);
+  void* offset2;
+  long ret;
+
+  offset2 = prep_offset_parameter(&ptr, offset, offset_size);
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  if (offset2) {
+    memcpy_input_parameter(offset2, offset, offset_size);
+  }
+  ret = untraced_syscall4(syscallno, out_fd, in_fd, offset2, count);
+  if (offset2) {
+    local_memcpy(offset, offset2, offset_size);
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+#ifdef SYS_sendfile
+static long sys_sendfile(const struct syscall_info* call) {
+  assert(SYS_sendfile == call->no);
+  return sys_sendfile_common(call, sizeof(long));
+}
+#endif
+
+#ifdef SYS_sendfile64
+static long sys_sendfile64(const struct syscall_info* call) {
+  assert(SYS_sendfile64 == call->no);
+  return sys_sendfile_common(call, sizeof(loff_t));
+}
+#endif
+
+#ifdef SYS_sendmmsg
+static long sys_sendmmsg(const struct syscall_info* call) {
+  const int syscallno = SYS_sendmmsg;
+  int sockfd = call->args[0];
+  struct mmsghdr* msgvec = (struct mmsghdr*)call->args[1];
+  unsigned int vlen = call->args[2];
+  int flags = call->args[3];
+
+  void* ptr = prep_syscall_for_fd(sockfd);
+  struct mmsghdr* msgvec2 = NULL;
+  long ret;
+  int i;
+
+  assert(syscallno == call->no);
+
+  /* The kernel writes msg_len into each mmsghdr, so send a copy and copy
+   * the lengths back. */
+  msgvec2 = ptr;
+  ptr += sizeof(struct mmsghdr) * vlen;
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     msg_flags_blockness(flags))) {
+    return traced_raw_syscall(call);
+  }
+
+  memcpy_input_parameter(msgvec2, msgvec, sizeof(struct mmsghdr) * vlen);
+  ret = untraced_syscall4(syscallno, sockfd, msgvec2, vlen, flags);
+  for (i = 0; i < ret; ++i) {
+    msgvec[i].msg_len = msgvec2[i].msg_len;
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+#endif
+
 #ifdef SYS_sendmsg
 static long sys_sendmsg(const struct syscall_info* call) {
   const int syscallno = SYS_sendmsg;
@@ -1880,7 +2691,8 @@ static long sys_sendmsg(const struct syscall_info* call) {
 
   assert(syscallno == call->no);
 
-  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     msg_flags_blockness(flags))) {
     return traced_raw_syscall(call);
   }
 
@@ -1890,6 +2702,33 @@ static long sys_sendmsg(const struct syscall_info* call) {
 }
 #endif
 
+#ifdef SYS_sendto
+static long sys_sendto(const struct syscall_info* call) {
+  const int syscallno = SYS_sendto;
+  int sockfd = call->args[0];
+  void* buf = (void*)call->args[1];
+  size_t len = call->args[2];
+  int flags = call->args[3];
+  void* dest_addr = (void*)call->args[4];
+  socklen_t addrlen = call->args[5];
+
+  void* ptr = prep_syscall_for_fd(sockfd);
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     msg_flags_blockness(flags))) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall6(syscallno, sockfd, buf, len, flags, dest_addr,
+                          addrlen);
+
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+#endif
+
 #ifdef SYS_socketpair
 typedef int two_ints[2];
 static long sys_socketpair(const struct syscall_info* call) {
@@ -1916,6 +2755,45 @@ static long sys_socketpair(const struct syscall_info* call) {
 }
 #endif
 
+static long sys_splice(const struct syscall_info* call) {
+  const int syscallno = SYS_splice;
+  int fd_in = call->args[0];
+  loff_t* off_in = (loff_t*)call->args[1];
+  int fd_out = call->args[2];
+  loff_t* off_out = (loff_t*)call->args[3];
+  size_t len = call->args[4];
+  unsigned int flags = call->args[5];
+
+  void* ptr = prep_syscall_for_fds(fd_in, fd_out);
+  loff_t* off_in2;
+  loff_t* off_out2;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  off_in2 = prep_offset_parameter(&ptr, off_in, sizeof(*off_in));
+  off_out2 = prep_offset_parameter(&ptr, off_out, sizeof(*off_out));
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  if (off_in2) {
+    memcpy_input_parameter(off_in2, off_in, sizeof(*off_in2));
+  }
+  if (off_out2) {
+    memcpy_input_parameter(off_out2, off_out, sizeof(*off_out2));
+  }
+  ret = untraced_syscall6(syscallno, fd_in, off_in2, fd_out, off_out2, len,
+                          flags);
+  if (off_in2) {
+    *off_in = *off_in2;
+  }
+  if (off_out2) {
+    *off_out = *off_out2;
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_time(const struct syscall_info* call) {
   const int syscallno = SYS_time;
   time_t* tp = (time_t*)call->args[0];
@@ -1964,6 +2842,66 @@ static long sys_xstat64(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_fstatat(const struct syscall_info* call) {
+  const int syscallno = call->no;
+  int dirfd = call->args[0];
+  const char* pathname = (const char*)call->args[1];
+  struct stat64* buf = (struct stat64*)call->args[2];
+  int flags = call->args[3];
+
+  /* Not arming the desched event, for the same reasons as xstat64. */
+  void* ptr = prep_syscall();
+  struct stat64* buf2 = NULL;
+  long ret;
+
+  if (buf) {
+    buf2 = ptr;
+    ptr += sizeof(*buf2);
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  ret = untraced_syscall4(syscallno, dirfd, pathname, buf2, flags);
+  if (buf2) {
+    local_memcpy(buf, buf2, sizeof(*buf));
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+#if defined(SYS_statx)
+/* The kernel ABI fixes the size of struct statx, and not all system
+ * headers that define SYS_statx define the struct. */
+#define STATX_BUF_SIZE 256
+
+static long sys_statx(const struct syscall_info* call) {
+  const int syscallno = SYS_statx;
+  int dirfd = call->args[0];
+  const char* pathname = (const char*)call->args[1];
+  int flags = call->args[2];
+  unsigned int mask = call->args[3];
+  void* buf = (void*)call->args[4];
+
+  void* ptr = prep_syscall();
+  void* buf2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (buf) {
+    buf2 = ptr;
+    ptr += STATX_BUF_SIZE;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+  ret = untraced_syscall5(syscallno, dirfd, pathname, flags, mask, buf2);
+  if (buf2) {
+    local_memcpy(buf, buf2, STATX_BUF_SIZE);
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+#endif
+
 static long sys_write(const struct syscall_info* call) {
   const int syscallno = SYS_write;
   int fd = call->args[0];
@@ -2062,16 +3000,24 @@ static long syscall_hook_internal(const struct syscall_info* call) {
 #define CASE(syscallname)                                                      \
   case SYS_##syscallname:                                                      \
     return sys_##syscallname(call)
+#if defined(SYS_accept4)
+    CASE(accept4);
+#endif
     CASE(access);
     CASE(clock_gettime);
+    CASE(clock_nanosleep);
     CASE(close);
     CASE(creat);
+    CASE(epoll_pwait);
+    CASE(epoll_wait);
+    CASE(faccessat);
 #if defined(SYS_fcntl64)
     CASE(fcntl64);
 #else
     CASE(fcntl);
 #endif
     CASE(futex);
+    CASE(getdents64);
     CASE(getpid);
     CASE(getrusage);
     CASE(gettid);
@@ -2083,24 +3029,57 @@ static long syscall_hook_internal(const struct syscall_info* call) {
     CASE(lseek);
 #endif
     CASE(madvise);
+    CASE(mprotect);
+    CASE(munmap);
+    CASE(nanosleep);
     CASE(open);
+    CASE(openat);
     CASE(poll);
+    CASE(pread64);
+    CASE(preadv);
+    CASE(pselect6);
+    CASE(pwrite64);
+    CASE(pwritev);
     CASE(read);
     CASE(readlink);
 #if defined(SYS_recvfrom)
     CASE(recvfrom);
 #endif
+#if defined(SYS_recvmmsg)
+    CASE(recvmmsg);
+#endif
 #if defined(SYS_recvmsg)
     CASE(recvmsg);
 #endif
+#if defined(__i386__)
+    CASE(_newselect);
+#else
+    CASE(select);
+#endif
+#if defined(SYS_sendfile)
+    CASE(sendfile);
+#endif
+#if defined(SYS_sendfile64)
+    CASE(sendfile64);
+#endif
+#if defined(SYS_sendmmsg)
+    CASE(sendmmsg);
+#endif
 #if defined(SYS_sendmsg)
     CASE(sendmsg);
 #endif
+#if defined(SYS_sendto)
+    CASE(sendto);
+#endif
 #if defined(SYS_socketcall)
     CASE(socketcall);
 #endif
 #if defined(SYS_socketpair)
     CASE(socketpair);
+#endif
+    CASE(splice);
+#if defined(SYS_statx)
+    CASE(statx);
 #endif
     CASE(time);
     CASE(write);
@@ -2122,6 +3101,12 @@ static long syscall_hook_internal(const struct syscall_info* call) {
     case SYS_stat:
 #endif
       return sys_xstat64(call);
+#if defined(SYS_fstatat64)
+    case SYS_fstatat64:
+#else
+    case SYS_newfstatat:
+#endif
+      return sys_fstatat(call);
     default:
       return traced_raw_syscall(call);
   }
@@ -2174,6 +3159,66 @@ RR_HIDDEN long syscall_hook(const struct syscall_info* call) {
   return result;
 }
 
+/**
+ * During recording, read the TSC into |*buf| and return it. During replay,
+ * return the value already in |*buf|. Like memcpy_input_parameter, the
+ * registers and branches taken are the same either way.
+ */
+static uint64_t read_tsc(uint64_t* buf) {
+#if defined(__i386__) || defined(__x86_64__)
+  uint32_t lo;
+  uint32_t hi;
+  unsigned char tmp_in_replay = in_replay;
+  __asm__ __volatile__("test %2,%2\n\t"
+                       "jne 1f\n\t"
+                       "rdtsc\n\t"
+                       "mov %%eax,(%3)\n\t"
+                       "mov %%edx,4(%3)\n\t"
+                       "1:\n\t"
+                       "mov (%3),%%eax\n\t"
+                       "mov 4(%3),%%edx\n\t"
+                       "xor %2,%2\n\t"
+                       : "=&a"(lo), "=&d"(hi), "+c"(tmp_in_replay)
+                       : "r"(buf)
+                       : "cc", "memory");
+  return ((uint64_t)hi << 32) | lo;
+#else
+#error Unknown architecture
+#endif
+}
+
+/**
+ * Called by _rdtsc_hook_trampoline in place of a patched rdtsc instruction.
+ * Stores the TSC in |*tsc| and a syscallbuf record and returns nonzero, or
+ * returns zero if the syscallbuf can't take the record. In that case the
+ * trampoline executes the rdtsc itself, which traps to rr as usual.
+ */
+RR_HIDDEN long rdtsc_hook(uint64_t* tsc) {
+  void* ptr = prep_syscall();
+  uint64_t* tsc2 = ptr;
+  long ret = 0;
+
+  ptr += sizeof(*tsc2);
+  if (start_commit_buffered_syscall(SYS_rrcall_rdtsc, ptr, WONT_BLOCK)) {
+    /* rr makes rdtsc trap, so allow it just for this read. rr defers
+     * signals while we're in the syscallbuf code, so nothing else can run
+     * with the TSC enabled. During replay these syscalls are skipped and
+     * read_tsc doesn't execute rdtsc at all. */
+    privileged_untraced_syscall2(SYS_prctl, PR_SET_TSC, PR_TSC_ENABLE);
+    *tsc = read_tsc(tsc2);
+    privileged_untraced_syscall2(SYS_prctl, PR_SET_TSC, PR_TSC_SIGSEGV);
+    commit_raw_syscall(SYS_rrcall_rdtsc, ptr, 0);
+    ret = 1;
+  }
+  if (ret && buffer_hdr()->notify_on_syscall_hook_exit) {
+    /* Let rr deliver any signals it deferred. As in syscall_hook, this
+     * relies on our having just committed a record. */
+    ret = _raw_syscall(SYS_rrcall_notify_syscall_hook_exit, 0, 0, 0, 0, 0, 0,
+                       privileged_traced_syscall_instruction, ret, -1);
+  }
+  return ret;
+}
+
 /**
  * Exported glibc synonym for |sysconf()|.  We can't use |dlsym()| to
  * resolve the next "sysconf" symbol, because
@@ -34,14 +34,23 @@
 
 /* This size counts the header along with record data. */
 #define SYSCALLBUF_BUFFER_SIZE (1 << 20)
+/* Each task starts out only using this much of its buffer. rr grows the
+ * usable part, up to SYSCALLBUF_BUFFER_SIZE, for tasks whose buffer keeps
+ * filling up. */
+#define SYSCALLBUF_INITIAL_SIZE (1 << 16)
 
 /* Set this env var to enable syscall buffering. */
 #define SYSCALLBUF_ENABLED_ENV_VAR "_RR_USE_SYSCALLBUF"
 
-/* Size of table mapping fd numbers to syscallbuf-disabled flag.
- * Most Linux kernels limit fds to 1024 so it probably doesn't make sense
- * to raise this value... */
-#define SYSCALLBUF_FDS_DISABLED_SIZE 1024
+/* Number of fds covered by the bitmap of syscallbuf-disabled flags. The
+ * default RLIMIT_NOFILE is 1024, but servers commonly raise it, and fds
+ * beyond the bitmap can never use the syscallbuf. One bit per fd keeps the
+ * bitmap at 8KB. */
+#define SYSCALLBUF_FDS_DISABLED_SIZE 65536
+
+/* Byte and bit of the syscallbuf-disabled bitmap that hold |fd|'s flag. */
+#define SYSCALLBUF_FDS_DISABLED_BYTE(fd) ((fd) >> 3)
+#define SYSCALLBUF_FDS_DISABLED_BIT(fd) (1 << ((fd)&7))
 
 #define RR_PAGE_ADDR 0x70000000
 #define RR_PAGE_SYSCALL_STUB_SIZE 3
@@ -88,6 +97,11 @@
  * 8/16(sp) is stored in original_syscallno.
  */
 #define SYS_rrcall_notify_syscall_hook_exit 444
+/**
+ * The preload library's rdtsc hook stores each TSC value it reads in a
+ * syscallbuf record with this syscall number. It's never actually executed.
+ */
+#define SYS_rrcall_rdtsc 445
 
 /* Define macros that let us compile a struct definition either "natively"
  * (when included by preload.c) or as a template over Arch for use by rr.
@@ -110,6 +124,7 @@
  * instruction that follows a syscall instruction.
  * Each instance of this struct describes an instruction that can follow a
  * syscall and a hook function to patch with.
+ * rdtsc instructions are patched the same way, with their own list of hooks.
  */
 struct syscall_patch_hook {
   uint8_t next_instruction_length;
@@ -130,15 +145,20 @@ struct rrcall_init_preload_params {
   int syscallbuf_enabled;
   int syscall_patch_hook_count;
   PTR(struct syscall_patch_hook) syscall_patch_hooks;
+  int rdtsc_patch_hook_count;
+  PTR(struct syscall_patch_hook) rdtsc_patch_hooks;
   PTR(void) syscall_hook_trampoline;
   PTR(void) syscall_hook_stub_buffer;
   PTR(void) syscall_hook_stub_buffer_end;
-  /* Array of size SYSCALLBUF_FDS_DISABLED_SIZE */
+  /* Bitmap of SYSCALLBUF_FDS_DISABLED_SIZE bits */
   PTR(volatile char) syscallbuf_fds_disabled;
   /* Address of the flag which is 0 during recording and 1 during replay. */
   PTR(unsigned char) in_replay_flag;
   /* Address where we store the number of cores we're pretending to have. */
   PTR(int) pretend_num_cores;
+  /* Address of the flag rr sets once another task shares our address
+   * space. mprotect and munmap are only buffered while it's 0. */
+  PTR(volatile unsigned char) mm_buffering_disabled;
   /* Address of the first entry of the breakpoint table.
    * After processing a sycallbuf record (and unlocking the syscallbuf),
    * we call a function in this table corresponding to the record processed.
@@ -166,6 +186,12 @@ struct rrcall_init_buffers_params {
   /* Returned pointer to and size of the shared syscallbuf
    * segment. */
   PTR(void) syscallbuf_ptr;
+  /* Returned pointer to and size of rr's scratch area for this thread,
+   * which mustn't be changed behind rr's back. */
+  PTR(void) scratch_ptr;
+  int scratch_size;
+  /* padding for 64-bit archs. */
+  int padding2;
 };
 
 /**
@@ -203,6 +229,18 @@ struct syscallbuf_record {
   uint8_t extra_data[0];
 };
 
+/**
+ * The arguments of a buffered mprotect or munmap, stored as the extra
+ * data of its record. rr applies the change to its model of the address
+ * space when it sees the committed record, during recording and replay,
+ * instead of at a ptrace stop for the syscall.
+ */
+struct syscallbuf_mm_args {
+  uint64_t addr;
+  uint64_t length;
+  int64_t prot;
+};
+
 /**
  * This struct summarizes the state of the syscall buffer.  It happens
  * to be located at the start of the buffer.
@@ -230,11 +268,17 @@ struct syscallbuf_hdr {
    * When it's zero, the desched signal can safely be
    * discarded. */
   uint8_t desched_signal_may_be_relevant;
+  /* The number of bytes of the buffer, counting this header, that
+   * libpreload may use. Set by rr. */
+  uint32_t usable_size;
+  /* Set by libpreload when a syscall couldn't be buffered because there
+   * wasn't enough room left. Cleared by rr when it resets the buffer. */
+  uint8_t overflowed;
+  uint8_t padding[3];
 
   struct syscallbuf_record recs[0];
 } __attribute__((__packed__));
-/* TODO: static_assert(sizeof(uint32_t) ==
- *                     sizeof(struct syscallbuf_hdr)) */
+/* TODO: static_assert(sizeof(struct syscallbuf_hdr) % 8 == 0) */
 
 /**
  * Return a pointer to what may be the next syscall record.
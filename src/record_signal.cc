@@ -3,6 +3,7 @@
 #include "record_signal.h"
 
 #include <assert.h>
+#include <cpuid.h>
 #include <fcntl.h>
 #include <linux/perf_event.h>
 #include <sched.h>
@@ -84,6 +85,14 @@ static bool try_handle_rdtsc(RecordTask* t, siginfo_t* si) {
     return false;
   }
 
+  if (t->vm()->monkeypatcher().try_patch_rdtsc(t)) {
+    // Leave the registers alone; the patched code will read the TSC when
+    // the task resumes. The event carries the patch for replay.
+    t->push_event(Event(EV_SEGV_RDTSC, HAS_EXEC_INFO, t->arch()));
+    LOG(debug) << "  patched rdtsc";
+    return true;
+  }
+
   unsigned long long current_time = rdtsc();
   Registers r = t->regs();
   r.set_rdtsc_output(current_time);
@@ -95,6 +104,43 @@ static bool try_handle_rdtsc(RecordTask* t, siginfo_t* si) {
   return true;
 }
 
+/** Return true iff |t->ip()| points at a CPUID instruction. */
+static const uint8_t cpuid_insn[] = { 0x0f, 0xa2 };
+static bool is_ip_cpuid(RecordTask* t) {
+  uint8_t insn[sizeof(cpuid_insn)];
+  if (sizeof(insn) !=
+      t->read_bytes_fallible(t->ip().to_data_ptr<uint8_t>(), sizeof(insn),
+                             insn)) {
+    return false;
+  }
+  return !memcmp(insn, cpuid_insn, sizeof(insn));
+}
+
+/**
+ * Return true if |t| was stopped because of a SIGSEGV resulting
+ * from a cpuid under CPUID faulting and |t| was updated appropriately,
+ * false otherwise.
+ */
+static bool try_handle_cpuid(RecordTask* t, siginfo_t* si) {
+  ASSERT(t, si->si_signo == SIGSEGV);
+
+  if (!t->session().has_cpuid_faulting() || !is_ip_cpuid(t)) {
+    return false;
+  }
+
+  Registers r = t->regs();
+  unsigned int leaf = r.ax();
+  unsigned int a, b, c, d;
+  __cpuid_count(leaf, (unsigned int)r.cx(), a, b, c, d);
+  r.set_cpuid_output(a, b, c, d);
+  r.set_ip(r.ip() + sizeof(cpuid_insn));
+  t->set_regs(r);
+
+  t->push_event(Event(EV_SEGV_CPUID, HAS_EXEC_INFO, t->arch()));
+  LOG(debug) << "  trapped for cpuid(" << HEX(leaf) << ")";
+  return true;
+}
+
 /**
  * Return true if |t| was stopped because of a SIGSEGV and we want to retry
  * the instruction after emulating MAP_GROWSDOWN.
@@ -436,7 +482,8 @@ SignalHandled handle_signal(RecordTask* t, siginfo_t* si) {
    * and fudge t appropriately. */
   switch (si->si_signo) {
     case SIGSEGV:
-      if (try_handle_rdtsc(t, si) || try_grow_map(t, si)) {
+      if (try_handle_rdtsc(t, si) || try_handle_cpuid(t, si) ||
+          try_grow_map(t, si)) {
         // When SIGSEGV is blocked, apparently the kernel has to do
         // some ninjutsu to raise the trap.  We see the SIGSEGV
         // bit in the "SigBlk" mask in /proc/status cleared, and if
@@ -383,6 +383,14 @@ struct TaskSyscallState {
    * otherwise returns 'sw'.
    */
   Switchable done_preparing(Switchable sw);
+  /**
+   * True if nothing but |t| can see the parameter buffers while the syscall
+   * runs: no other task shares |t|'s address space, no emulated ptracer
+   * can peek at it, and every buffer is in private mappings. Then the
+   * kernel can write the outputs straight into the buffers, and we record
+   * them from there, instead of copying them through scratch memory.
+   */
+  bool buffers_private_to_task();
   enum WriteBack { WRITE_BACK, NO_WRITE_BACK };
   /**
    * Called when a syscall exits to copy results from scratch memory to their
@@ -583,6 +591,11 @@ Switchable TaskSyscallState::done_preparing(Switchable sw) {
   preparation_done = true;
   write_back = WRITE_BACK;
 
+  if (sw == ALLOW_SWITCH && !param_list.empty() && buffers_private_to_task()) {
+    switchable = sw;
+    return switchable;
+  }
+
   ssize_t scratch_num_bytes = scratch - t->scratch_ptr;
   ASSERT(t, scratch_num_bytes >= 0);
   if (sw == ALLOW_SWITCH && scratch_num_bytes > t->scratch_size) {
@@ -638,6 +651,34 @@ Switchable TaskSyscallState::done_preparing(Switchable sw) {
   return switchable;
 }
 
+bool TaskSyscallState::buffers_private_to_task() {
+  if (t->vm()->task_set().size() != 1 || t->emulated_ptracer) {
+    return false;
+  }
+  for (auto& param : param_list) {
+    remote_ptr<void> start = param.dest;
+    remote_ptr<void> end = param.dest + param.num_bytes.incoming_size;
+    if (end < start) {
+      return false;
+    }
+    for (auto m : t->vm()->maps_starting_at(start)) {
+      if (start >= end) {
+        break;
+      }
+      if (m.map.start() > start || (m.map.flags() & MAP_SHARED)) {
+        // A hole (the syscall will fail; let the scratch path deal with
+        // it) or memory another process may be able to see.
+        return false;
+      }
+      start = m.map.end();
+    }
+    if (start < end) {
+      return false;
+    }
+  }
+  return true;
+}
+
 size_t TaskSyscallState::eval_param_size(size_t i,
                                          vector<size_t>& actual_sizes) {
   assert(actual_sizes.size() == i);
@@ -689,33 +730,40 @@ void TaskSyscallState::process_syscall_results() {
       }
     }
     if (write_back == WRITE_BACK) {
-      // Step 3: record all output memory areas
+      // Step 3: record all output memory areas. Consecutive areas that
+      // must be read from the tracee are read in one batch.
+      vector<MemoryRange> remote_ranges;
       for (size_t i = 0; i < param_list.size(); ++i) {
         auto& param = param_list[i];
         size_t size = actual_sizes[i];
         if (param.mode == IN_OUT_NO_SCRATCH) {
-          t->record_remote(param.dest, size);
+          remote_ranges.push_back(MemoryRange(param.dest, size));
         } else if (param.mode == IN_OUT || param.mode == OUT) {
           // If pointers in memory were fixed up in step 2, then record
           // from tracee memory to ensure we record such fixes. Otherwise we
           // can record from our local data.
           // XXX This optimization can be improved if necessary...
           if (memory_cleaned_up) {
-            t->record_remote(param.dest, size);
+            remote_ranges.push_back(MemoryRange(param.dest, size));
           } else {
+            t->record_remote_batch(remote_ranges);
+            remote_ranges.clear();
             const uint8_t* d = data.data() + (param.scratch - t->scratch_ptr);
             t->record_local(param.dest, size, d);
           }
         }
       }
+      t->record_remote_batch(remote_ranges);
     }
     t->set_regs(r);
   } else {
+    vector<MemoryRange> ranges;
     for (size_t i = 0; i < param_list.size(); ++i) {
       auto& param = param_list[i];
       size_t size = eval_param_size(i, actual_sizes);
-      t->record_remote(param.dest, size);
+      ranges.push_back(MemoryRange(param.dest, size));
     }
+    t->record_remote_batch(ranges);
   }
 
   if (should_emulate_result) {
@@ -1111,6 +1159,52 @@ static void record_v4l2_buffer_contents(RecordTask* t) {
   }
 }
 
+/* Smaller reads aren't worth a file reference. */
+static const size_t MIN_FILE_REF_READ = 4096;
+
+/**
+ * Return the file position of |fd| in |t|, or -1 if it can't be read.
+ */
+static int64_t fd_position(RecordTask* t, int fd) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/proc/%d/fdinfo/%d", t->tid, fd);
+  ScopedFd info(path, O_RDONLY);
+  char buf[1024];
+  ssize_t len = info.is_open() ? read(info, buf, sizeof(buf) - 1) : -1;
+  if (len <= 0) {
+    return -1;
+  }
+  buf[len] = 0;
+  long long pos;
+  if (sscanf(buf, "pos: %lld", &pos) != 1) {
+    return -1;
+  }
+  return pos;
+}
+
+static void record_file_read(RecordTask* t) {
+  const Registers& regs = t->regs();
+  ssize_t ret = regs.syscall_result_signed();
+  if (ret <= 0) {
+    return;
+  }
+  int fd = (int)regs.arg1_signed();
+  int64_t offset;
+  if (is_pread64_syscall(regs.original_syscallno(), t->arch())) {
+    offset = t->arch() == x86 ? (int64_t)((uint64_t)regs.arg5() << 32 |
+                                          (uint32_t)regs.arg4())
+                              : (int64_t)regs.arg4();
+  } else {
+    offset = fd_position(t, fd);
+    offset = offset < 0 ? -1 : offset - ret;
+  }
+  if ((size_t)ret < MIN_FILE_REF_READ || offset < 0) {
+    t->record_remote(regs.arg2(), ret);
+    return;
+  }
+  t->record_remote_file_read(regs.arg2(), ret, fd, offset);
+}
+
 static void record_page_below_stack_ptr(RecordTask* t) {
   /* Record.the page above the top of |t|'s stack.  The SIOC* ioctls
    * have been observed to write beyond the end of tracees' stacks, as
@@ -1137,9 +1231,23 @@ static Switchable prepare_ioctl(RecordTask* t,
   ASSERT(t, !t->is_desched_event_syscall())
       << "Failed to skip past desched ioctl()";
 
-  /* Some ioctl()s are irregular and don't follow the _IOC()
-   * conventions.  Special case them here. */
+  if (request == FIOCLEX &&
+      !t->fd_table()->allow_close((int)t->regs().arg1())) {
+    // Don't let tracee set close-on-exec on this fd, as for F_SETFD.
+    // Disable the syscall, but emulate a successful return.
+    Registers r = t->regs();
+    r.set_arg1(-1);
+    t->set_regs(r);
+    syscall_state.emulate_result(0);
+    return PREVENT_SWITCH;
+  }
+
   switch (request) {
+// The regular ioctls described in ioctls.py are handled here.
+#include "IoctlRecordCase.generated"
+
+    /* Some ioctl()s are irregular and don't follow the _IOC()
+     * conventions.  Special case them here. */
     case SIOCETHTOOL: {
       auto ifrp = syscall_state.reg_parameter<typename Arch::ifreq>(3, IN);
       syscall_state.mem_ptr_parameter<typename Arch::ethtool_cmd>(
@@ -1177,39 +1285,11 @@ static Switchable prepare_ioctl(RecordTask* t,
       syscall_state.after_syscall_action(record_page_below_stack_ptr);
       return PREVENT_SWITCH;
 
-    case TCGETS:
-      syscall_state.reg_parameter<typename Arch::termios>(3);
-      return PREVENT_SWITCH;
-
-    case TIOCINQ:
-      syscall_state.reg_parameter<int>(3);
-      return PREVENT_SWITCH;
-
-    case TIOCGWINSZ:
-      syscall_state.reg_parameter<typename Arch::winsize>(3);
-      return PREVENT_SWITCH;
-
-    case TIOCGPGRP:
-      syscall_state.reg_parameter<typename Arch::pid_t>(3);
-      return PREVENT_SWITCH;
-
-    case SNDRV_CTL_IOCTL_PVERSION:
-      syscall_state.reg_parameter<int>(3);
-      return PREVENT_SWITCH;
-
-    case SNDRV_CTL_IOCTL_CARD_INFO:
-      syscall_state.reg_parameter<typename Arch::snd_ctl_card_info>(3);
-      return PREVENT_SWITCH;
   }
 
   /* In ioctl language, "_IOC_READ" means "outparam".  Both
    * READ and WRITE can be set for inout params. */
   if (!(_IOC_READ & dir)) {
-    switch (IOCTL_MASK_SIZE(request)) {
-      case IOCTL_MASK_SIZE(FIOCLEX):
-      case IOCTL_MASK_SIZE(FIONCLEX):
-        return PREVENT_SWITCH;
-    }
     /* If the kernel isn't going to write any data back to
      * us, we hope and pray that the result of the ioctl
      * (observable to the tracee) is deterministic.
@@ -1243,10 +1323,6 @@ static Switchable prepare_ioctl(RecordTask* t,
     case IOCTL_MASK_SIZE(VFAT_IOCTL_READDIR_BOTH):
       syscall_state.reg_parameter(3, size, IN_OUT);
       return PREVENT_SWITCH;
-
-    case IOCTL_MASK_SIZE(TIOCGPTN):
-      syscall_state.reg_parameter(3, size);
-      return PREVENT_SWITCH;
   }
 
   /* These ioctls are mostly regular but require additional recording. */
@@ -1740,21 +1816,6 @@ static Switchable rec_prepare_syscall_arch(RecordTask* t,
 // All the regular syscalls are handled here.
 #include "SyscallRecordCase.generated"
 
-    case Arch::splice: {
-      syscall_state.reg_parameter<loff_t>(2, IN_OUT);
-      syscall_state.reg_parameter<loff_t>(4, IN_OUT);
-      return ALLOW_SWITCH;
-    }
-
-    case Arch::sendfile: {
-      syscall_state.reg_parameter<typename Arch::off_t>(3, IN_OUT);
-      return ALLOW_SWITCH;
-    }
-    case Arch::sendfile64: {
-      syscall_state.reg_parameter<typename Arch::off64_t>(3, IN_OUT);
-      return ALLOW_SWITCH;
-    }
-
     case Arch::capget: {
       auto hdr = t->read_mem(
           syscall_state.reg_parameter<typename Arch::__user_cap_header_struct>(
@@ -1997,11 +2058,6 @@ static Switchable rec_prepare_syscall_arch(RecordTask* t,
       return ALLOW_SWITCH;
     }
 
-    case Arch::msgsnd:
-    case Arch::semop:
-    case Arch::semtimedop:
-      return ALLOW_SWITCH;
-
     case Arch::socketcall:
       return prepare_socketcall<Arch>(t, syscall_state);
 
@@ -2027,13 +2083,6 @@ static Switchable rec_prepare_syscall_arch(RecordTask* t,
       }
       return ALLOW_SWITCH;
 
-    case Arch::pselect6:
-      syscall_state.reg_parameter<typename Arch::fd_set>(2, IN_OUT);
-      syscall_state.reg_parameter<typename Arch::fd_set>(3, IN_OUT);
-      syscall_state.reg_parameter<typename Arch::fd_set>(4, IN_OUT);
-      syscall_state.reg_parameter<typename Arch::timespec>(5, IN_OUT);
-      return ALLOW_SWITCH;
-
     case Arch::recvfrom: {
       syscall_state.reg_parameter(
           2, ParamSize::from_syscall_result<typename Arch::ssize_t>(
@@ -2104,11 +2153,23 @@ static Switchable rec_prepare_syscall_arch(RecordTask* t,
 
     case Arch::pread64:
     /* ssize_t read(int fd, void *buf, size_t count); */
-    case Arch::read:
+    case Arch::read: {
+      int fd = (int)t->regs().arg1_signed();
+      if (t->trace_writer().file_reads_by_reference_enabled() &&
+          (size_t)t->regs().arg3() >= MIN_FILE_REF_READ &&
+          !t->fd_table()->is_monitoring(fd) &&
+          S_ISREG(t->stat_fd(fd).st_mode)) {
+        // Reads of regular files don't block for long, so let the kernel
+        // write straight into the tracee's buffer, without scratch, and
+        // record where the data came from afterward.
+        syscall_state.after_syscall_action(record_file_read);
+        return PREVENT_SWITCH;
+      }
       syscall_state.reg_parameter(
           2, ParamSize::from_syscall_result<typename Arch::ssize_t>(
                  (size_t)t->regs().arg3()));
       return ALLOW_SWITCH;
+    }
 
     case Arch::accept:
     case Arch::accept4: {
@@ -2273,9 +2334,6 @@ static Switchable rec_prepare_syscall_arch(RecordTask* t,
       }
       return PREVENT_SWITCH;
 
-    case Arch::pause:
-      return ALLOW_SWITCH;
-
     /* int poll(struct pollfd *fds, nfds_t nfds, int timeout) */
     /* int ppoll(struct pollfd *fds, nfds_t nfds,
      *           const struct timespec *timeout_ts,
@@ -2288,13 +2346,18 @@ static Switchable rec_prepare_syscall_arch(RecordTask* t,
       return ALLOW_SWITCH;
     }
 
-    case Arch::open: {
-      string pathname = t->read_c_str(remote_ptr<char>(t->regs().arg1()));
+    case Arch::open:
+    case Arch::openat: {
+      // openat's dirfd doesn't matter here; the blacklist only contains
+      // absolute paths.
+      int path_arg = syscallno == Arch::open ? 1 : 2;
+      remote_ptr<char> path = t->regs().arg(path_arg);
+      string pathname = t->read_c_str(path);
       if (is_blacklisted_filename(pathname.c_str())) {
         LOG(warn) << "Cowardly refusing to open " << pathname;
         Registers r = t->regs();
         // Set path to terminating null byte. This forces ENOENT.
-        r.set_arg1(remote_ptr<char>(r.arg1()) + pathname.size());
+        r.set_arg(path_arg, (path + pathname.size()).as_int());
         t->set_regs(r);
       }
       return PREVENT_SWITCH;
@@ -2485,7 +2548,10 @@ static Switchable rec_prepare_syscall_arch(RecordTask* t,
 
     /* int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int
      * timeout); */
+    /* int epoll_pwait(int epfd, struct epoll_event *events, int maxevents,
+     * int timeout, const sigset_t *sigmask); */
     case Arch::epoll_wait:
+    case Arch::epoll_pwait:
       syscall_state.reg_parameter(2, sizeof(typename Arch::epoll_event) *
                                          t->regs().arg3_signed());
       return ALLOW_SWITCH;
@@ -2513,10 +2579,6 @@ static Switchable rec_prepare_syscall_arch(RecordTask* t,
       syscall_state.reg_parameter(1, (size_t)t->regs().arg2());
       return PREVENT_SWITCH;
 
-    case Arch::rt_sigtimedwait:
-      syscall_state.reg_parameter<typename Arch::siginfo_t>(2);
-      return ALLOW_SWITCH;
-
     case Arch::rt_sigsuspend:
     case Arch::sigsuspend:
       t->sigsuspend_blocked_sigs = unique_ptr<sig_set_t>(
@@ -2767,6 +2829,21 @@ enum ScratchAddrType { FIXED_ADDRESS, DYNAMIC_ADDRESS };
    here. */
 static const uintptr_t FIXED_SCRATCH_PTR = 0x68000000;
 
+/**
+ * Return true if transparent huge pages are only used for regions that
+ * ask for them with MADV_HUGEPAGE.
+ */
+static bool thp_needs_madvise() {
+  static int result = -1;
+  if (result < 0) {
+    char buf[256] = { 0 };
+    ScopedFd fd("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY);
+    result = fd.is_open() && read(fd, buf, sizeof(buf) - 1) > 0 &&
+             strstr(buf, "[madvise]");
+  }
+  return result;
+}
+
 static void init_scratch_memory(RecordTask* t,
                                 ScratchAddrType addr_type = DYNAMIC_ADDRESS) {
   const int scratch_size = 512 * page_size();
@@ -2790,6 +2867,14 @@ static void init_scratch_memory(RecordTask* t,
                                          sz, prot, flags | MAP_FIXED, -1, 0);
     }
     t->scratch_size = scratch_size;
+    // rr copies syscall data through the scratch area constantly, so
+    // ask for it to be backed by a huge page (it's exactly one on x86).
+    // This doesn't change the address space layout, and replay maps the
+    // scratch area PROT_NONE, so nothing needs to be recorded.
+    if (thp_needs_madvise()) {
+      remote.syscall(syscall_number_for_madvise(t->arch()), t->scratch_ptr,
+                     sz, MADV_HUGEPAGE);
+    }
   }
   // record this mmap for the replay
   Registers r = t->regs();
@@ -3201,9 +3286,11 @@ static void record_iovec_output(RecordTask* t, RecordTask* dest,
   // Ignore the syscall result, the kernel may have written more data than that.
   // See https://bugzilla.kernel.org/show_bug.cgi?id=113541
   auto iovs = t->read_mem(piov, iov_cnt);
+  vector<MemoryRange> ranges;
   for (auto& iov : iovs) {
-    dest->record_remote_fallible(iov.iov_base, iov.iov_len);
+    ranges.push_back(MemoryRange(iov.iov_base, iov.iov_len));
   }
+  dest->record_remote_fallible_batch(ranges);
 }
 
 template <typename Arch>
@@ -3360,14 +3447,16 @@ static void rec_process_syscall_arch(RecordTask* t,
       break;
     }
 
-    case Arch::open: {
+    case Arch::open:
+    case Arch::openat: {
       // Restore the registers that we may have altered.
+      int path_arg = syscallno == Arch::open ? 1 : 2;
       Registers r = t->regs();
-      r.set_arg1(syscall_state.syscall_entry_registers.arg1());
+      r.set_arg(path_arg, syscall_state.syscall_entry_registers.arg(path_arg));
       t->set_regs(r);
 
       if ((int)r.syscall_result_signed() >= 0) {
-        string pathname = t->read_c_str(remote_ptr<char>(r.arg1()));
+        string pathname = t->read_c_str(remote_ptr<char>(r.arg(path_arg)));
         if (is_dev_tty(pathname.c_str())) {
           // This will let rr event annotations echo to /dev/tty. It will also
           // ensure writes to this fd are not syscall-buffered.
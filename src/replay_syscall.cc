@@ -306,14 +306,78 @@ static string find_exec_stub(SupportedArch arch) {
   return exe_path;
 }
 
+/**
+ * A file opened in the tracee to map it, and what we found out about it.
+ */
+struct OpenBackingFile {
+  int fd;
+  struct stat real_file;
+  string real_file_name;
+};
+
+/**
+ * Backing files kept open while restoring a batch of mappings, keyed by
+ * file name and open flags. After an exec most files are mapped several
+ * times (text, data and relro segments of the exe and of each library),
+ * and this way each of them is only opened, and looked up in /proc, once.
+ */
+typedef map<pair<string, int>, OpenBackingFile> OpenBackingFiles;
+
+enum BackingFileKind {
+  // A file named in the trace's MMAPS records, which doesn't change
+  // during replay
+  TRACE_BACKING_FILE,
+  // An emufs file's /proc path, which may name different files over time
+  EMUFS_FILE
+};
+
+static OpenBackingFile open_backing_file(ReplayTask* t,
+                                         AutoRemoteSyscalls& remote,
+                                         const string& backing_file_name,
+                                         BackingFileKind kind, int oflags) {
+  OpenBackingFile file;
+  {
+    AutoRestoreMem child_str(remote, backing_file_name.c_str());
+    /* TODO: unclear if O_NOATIME is relevant for mmaps */
+    file.fd = remote.infallible_syscall(syscall_number_for_open(remote.arch()),
+                                        child_str.get().as_int(), oflags);
+  }
+  // While it's open, grab the link reference, unless we already know it.
+  TraceReader& trace = t->trace_reader();
+  if (kind == EMUFS_FILE ||
+      !trace.cached_backing_file_identity(backing_file_name, &file.real_file,
+                                          &file.real_file_name)) {
+    file.real_file = t->stat_fd(file.fd);
+    file.real_file_name = t->file_name_of_fd(file.fd);
+    if (kind == TRACE_BACKING_FILE) {
+      trace.cache_backing_file_identity(backing_file_name, file.real_file,
+                                        file.real_file_name);
+    }
+  }
+  return file;
+}
+
+static void close_backing_files(AutoRemoteSyscalls& remote,
+                                OpenBackingFiles& files) {
+  for (auto& f : files) {
+    remote.infallible_syscall(syscall_number_for_close(remote.arch()),
+                              f.second.fd);
+  }
+  files.clear();
+}
+
+/**
+ * If |open_files| is non-null, the backing file is looked up there first
+ * and left open in it afterward; otherwise it's closed again right away.
+ */
 static void finish_direct_mmap(ReplayTask* t, AutoRemoteSyscalls& remote,
                                remote_ptr<void> rec_addr, size_t length,
                                int prot, int flags,
                                const string& backing_file_name,
+                               BackingFileKind kind,
                                off64_t backing_offset_pages,
-                               struct stat& real_file, string& real_file_name) {
-  int fd;
-
+                               struct stat& real_file, string& real_file_name,
+                               OpenBackingFiles* open_files = nullptr) {
   LOG(debug) << "directly mmap'ing " << length << " bytes of "
              << backing_file_name << " at page offset "
              << HEX(backing_offset_pages);
@@ -321,19 +385,26 @@ static void finish_direct_mmap(ReplayTask* t, AutoRemoteSyscalls& remote,
   ASSERT(t, !(flags & MAP_GROWSDOWN));
 
   /* Open in the tracee the file that was mapped during
-   * recording. */
-  {
-    AutoRestoreMem child_str(remote, backing_file_name.c_str());
-    /* We only need RDWR for shared writeable mappings.
-     * Private mappings will happily COW from the mapped
-     * RDONLY file.
-     *
-     * TODO: should never map any files writable */
-    int oflags =
-        (MAP_SHARED & flags) && (PROT_WRITE & prot) ? O_RDWR : O_RDONLY;
-    /* TODO: unclear if O_NOATIME is relevant for mmaps */
-    fd = remote.infallible_syscall(syscall_number_for_open(remote.arch()),
-                                   child_str.get().as_int(), oflags);
+   * recording.
+   *
+   * We only need RDWR for shared writeable mappings.
+   * Private mappings will happily COW from the mapped
+   * RDONLY file.
+   *
+   * TODO: should never map any files writable */
+  int oflags = (MAP_SHARED & flags) && (PROT_WRITE & prot) ? O_RDWR : O_RDONLY;
+  OpenBackingFile file;
+  if (open_files) {
+    auto key = make_pair(backing_file_name, oflags);
+    auto it = open_files->find(key);
+    if (it == open_files->end()) {
+      it = open_files->insert(make_pair(key, open_backing_file(
+                                                 t, remote, backing_file_name,
+                                                 kind, oflags))).first;
+    }
+    file = it->second;
+  } else {
+    file = open_backing_file(t, remote, backing_file_name, kind, oflags);
   }
   /* And mmap that file. */
   remote.infallible_mmap_syscall(rec_addr, length,
@@ -341,21 +412,23 @@ static void finish_direct_mmap(ReplayTask* t, AutoRemoteSyscalls& remote,
                                   * mappings go through while
                                   * they're not handled properly,
                                   * but we shouldn't do that.) */
-                                 prot, flags | MAP_FIXED, fd,
+                                 prot, flags | MAP_FIXED, file.fd,
                                  backing_offset_pages);
 
-  // While it's open, grab the link reference.
-  real_file = t->stat_fd(fd);
-  real_file_name = t->file_name_of_fd(fd);
+  real_file = file.real_file;
+  real_file_name = file.real_file_name;
 
-  /* Don't leak the tmp fd.  The mmap doesn't need the fd to
-   * stay open. */
-  remote.infallible_syscall(syscall_number_for_close(remote.arch()), fd);
+  if (!open_files) {
+    /* Don't leak the tmp fd.  The mmap doesn't need the fd to
+     * stay open. */
+    remote.infallible_syscall(syscall_number_for_close(remote.arch()), file.fd);
+  }
 }
 
 static void restore_mapped_region(ReplayTask* t, AutoRemoteSyscalls& remote,
                                   const KernelMapping& km,
-                                  const TraceReader::MappedData& data) {
+                                  const TraceReader::MappedData& data,
+                                  OpenBackingFiles* open_files = nullptr) {
   ASSERT(t, km.flags() & MAP_PRIVATE)
       << "Shared mappings after exec not supported";
 
@@ -369,9 +442,9 @@ static void restore_mapped_region(ReplayTask* t, AutoRemoteSyscalls& remote,
       struct stat real_file;
       offset_bytes = km.file_offset_bytes();
       finish_direct_mmap(t, remote, km.start(), km.size(), km.prot(),
-                         km.flags(), data.file_name,
+                         km.flags(), data.file_name, TRACE_BACKING_FILE,
                          data.file_data_offset_bytes / page_size(), real_file,
-                         real_file_name);
+                         real_file_name, open_files);
       device = real_file.st_dev;
       inode = real_file.st_ino;
       break;
@@ -487,13 +560,20 @@ static void process_execve(ReplayTask* t, const TraceFrame& trace_frame,
     AutoRemoteSyscalls remote(t, AutoRemoteSyscalls::DISABLE_MEMORY_PARAMS);
 
     // Now fix up the address space. First unmap all the mappings other than
-    // our rr page.
+    // our rr page. munmap doesn't mind holes, so each run of mappings
+    // between the ones we keep is unmapped with a single syscall.
     vector<MemoryRange> unmaps;
+    bool extend_last = false;
     for (auto m : t->vm()->maps()) {
       // Do not attempt to unmap [vsyscall] --- it doesn't work.
-      if (m.map.start() != AddressSpace::rr_page_start() &&
-          !m.map.is_vsyscall()) {
+      if (m.map.start() == AddressSpace::rr_page_start() ||
+          m.map.is_vsyscall()) {
+        extend_last = false;
+      } else if (extend_last) {
+        unmaps.back() = MemoryRange(unmaps.back().start(), m.map.end());
+      } else {
         unmaps.push_back(m.map);
+        extend_last = true;
       }
     }
     for (auto& m : unmaps) {
@@ -517,9 +597,11 @@ static void process_execve(ReplayTask* t, const TraceFrame& trace_frame,
     AutoRemoteSyscalls remote(t);
 
     // Now map in all the mappings that we recorded from the real exec.
+    OpenBackingFiles open_files;
     for (ssize_t i = 1; i < ssize_t(kms.size()) - 1; ++i) {
-      restore_mapped_region(t, remote, kms[i], datas[i]);
+      restore_mapped_region(t, remote, kms[i], datas[i], &open_files);
     }
+    close_backing_files(remote, open_files);
 
     size_t index = recorded_exe_name.rfind('/');
     string name =
@@ -595,8 +677,8 @@ static remote_ptr<void> finish_anonymous_mmap(
     auto emufile = t->session().emufs().get_or_create(recorded_km, length);
     struct stat real_file;
     finish_direct_mmap(t, remote, rec_addr, length, prot,
-                       flags & ~MAP_ANONYMOUS, emufile->proc_path(), 0,
-                       real_file, file_name);
+                       flags & ~MAP_ANONYMOUS, emufile->proc_path(),
+                       EMUFS_FILE, 0, real_file, file_name);
     device = real_file.st_dev;
     inode = real_file.st_ino;
   }
@@ -697,8 +779,8 @@ static void finish_shared_mmap(ReplayTask* t, AutoRemoteSyscalls& remote,
   struct stat real_file;
   string real_file_name;
   finish_direct_mmap(t, remote, buf.addr, rec_num_bytes, prot, flags,
-                     emufile->proc_path(), offset_pages, real_file,
-                     real_file_name);
+                     emufile->proc_path(), EMUFS_FILE, offset_pages,
+                     real_file, real_file_name);
   // Write back the snapshot of the segment that we recorded.
   // We have to write directly to the underlying file, because
   // the tracee may have mapped its segment read-only.
@@ -747,6 +829,7 @@ static void process_mmap(ReplayTask* t, const TraceFrame& trace_frame,
         string real_file_name;
         finish_direct_mmap(t, remote, trace_frame.regs().syscall_result(),
                            length, prot, flags, data.file_name,
+                           TRACE_BACKING_FILE,
                            data.file_data_offset_bytes / page_size(), real_file,
                            real_file_name);
         t->vm()->map(km.start(), length, prot, flags,
@@ -766,11 +849,32 @@ static void process_mmap(ReplayTask* t, const TraceFrame& trace_frame,
     // Finally, we finish by emulating the return value.
     remote.regs().set_syscall_result(trace_frame.regs().syscall_result());
   }
-  // Monkeypatcher can emit data records that need to be applied now
+  // Monkeypatcher can emit mappings and data records that need to be
+  // applied now
+  process_patch_mappings(t);
   t->apply_all_data_records_from_trace();
   t->validate_regs();
 }
 
+void process_patch_mappings(ReplayTask* t) {
+  // Patching a single site needs at most one, but patching cached sites
+  // all at once can need several.
+  while (true) {
+    TraceReader::MappedData data;
+    bool found;
+    KernelMapping km = t->trace_reader().read_mapped_region(&data, &found);
+    if (!found) {
+      break;
+    }
+    AutoRemoteSyscalls remote(t);
+    ASSERT(t, km.flags() & MAP_ANONYMOUS);
+    remote.infallible_mmap_syscall(km.start(), km.size(), km.prot(),
+                                   km.flags() | MAP_FIXED, -1, 0);
+    t->vm()->map(km.start(), km.size(), km.prot(), km.flags(), 0, string(),
+                 KernelMapping::NO_DEVICE, KernelMapping::NO_INODE, &km);
+  }
+}
+
 void process_grow_map(ReplayTask* t) {
   AutoRemoteSyscalls remote(t);
   TraceReader::MappedData data;
@@ -1059,9 +1163,12 @@ static void rep_process_syscall_arch(ReplayTask* t, ReplayTraceStep* step) {
       step->action = TSTEP_RETIRE;
       return;
 
-    case Arch::open: {
+    case Arch::open:
+    case Arch::openat: {
       if (!trace_regs.syscall_failed()) {
-        string pathname = t->read_c_str(remote_ptr<char>(t->regs().arg1()));
+        int path_arg = sys == Arch::open ? 1 : 2;
+        string pathname =
+            t->read_c_str(remote_ptr<char>(t->regs().arg(path_arg)));
         if (is_dev_tty(pathname.c_str())) {
           // This will let rr echo output that was to /dev/tty to stderr.
           // XXX the tracee's /dev/tty could refer to a tty other than
@@ -1100,6 +1207,8 @@ static void rep_process_syscall_arch(ReplayTask* t, ReplayTraceStep* step) {
 
     case SYS_rrcall_init_preload:
       t->at_preload_init();
+      // Patching cached syscall sites may have needed jump pages.
+      process_patch_mappings(t);
       return;
 
     default:
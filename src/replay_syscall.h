@@ -33,6 +33,12 @@ void rep_process_syscall(ReplayTask* t, ReplayTraceStep* step);
  */
 void process_grow_map(ReplayTask* t);
 
+/**
+ * Replay the anonymous mappings Monkeypatcher created while patching during
+ * the current frame, if any.
+ */
+void process_patch_mappings(ReplayTask* t);
+
 } // namespace rr
 
 #endif /* RR_REP_PROCESS_EVENT_H_ */
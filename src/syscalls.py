@@ -38,25 +38,36 @@ class InvalidSyscall(UnsupportedSyscall):
     def __init__(self, x86=None, x64=None):
         UnsupportedSyscall.__init__(self, x86=x86, x64=x64)
 
+class InOut(object):
+    """Marks a RegularSyscall argument as a pointer to a value that the kernel
+    both reads and updates, e.g. the offset passed to sendfile().
+    """
+    def __init__(self, arg_type):
+        self.arg_type = arg_type
+
 class RegularSyscall(BaseSyscall):
     """A syscall for which replay information may be recorded automatically.
 
     The arguments required for rr to record may be specified directly
     through the arg1...arg6 keyword arguments.  The values for these
     arguments determine the size of the associated arguments to the syscall.
-    The only allowed type for a given argument is a Python string, in which
-    case the size of the argument is sizeof(arg).
+    A Python string is an outparam of size sizeof(arg); InOut(type) is an
+    in/out param of size sizeof(type).
 
     To ensure correct handling for mixed-arch process groups (e.g. a mix of 32
     and 64-bit processes), types should be specified using Arch instead of
     referring directly to the host system types.
+
+    Pass may_block=True for syscalls that can block, so that rr may schedule
+    other tasks while they're in progress.
     """
-    def __init__(self, **kwargs):
+    def __init__(self, may_block=False, **kwargs):
         for a in range(1,6):
             arg = 'arg' + str(a)
             if arg in kwargs:
                 self.__setattr__(arg, kwargs[arg])
                 kwargs.pop(arg)
+        self.may_block = may_block
         BaseSyscall.__init__(self, **kwargs)
 
 class EmulatedSyscall(RegularSyscall):
@@ -222,7 +233,7 @@ oldfstat = UnsupportedSyscall(x86=28)
 # pause() causes the calling process (or thread) to sleep until a
 # signal is delivered that either terminates the process or causes
 # the invocation of a signal-catching function.
-pause = IrregularEmulatedSyscall(x86=29, x64=34)
+pause = EmulatedSyscall(x86=29, x64=34, may_block=True)
 
 #  int utime(const char *filename, const struct utimbuf *times)
 #
@@ -918,7 +929,7 @@ rt_sigpending = IrregularEmulatedSyscall(x86=176, x64=127)
 # except that it has an additional argument, timeout, which specifies
 # a minimum interval for which the thread is suspended waiting for a
 # signal.
-rt_sigtimedwait = IrregularEmulatedSyscall(x86=177, x64=128)
+rt_sigtimedwait = EmulatedSyscall(x86=177, x64=128, arg2="typename Arch::siginfo_t", may_block=True)
 
 #  int sigsuspend(const sigset_t *mask);
 #
@@ -957,7 +968,7 @@ capset = EmulatedSyscall(x86=185, x64=126)
 # sigaction(2)) requested it.
 sigaltstack = EmulatedSyscall(x86=186, x64=131, arg2="typename Arch::stack_t")
 
-sendfile = IrregularEmulatedSyscall(x86=187, x64=40)
+sendfile = EmulatedSyscall(x86=187, x64=40, arg3=InOut("typename Arch::off_t"), may_block=True)
 getpmsg = InvalidSyscall(x86=188, x64=181)
 putpmsg = InvalidSyscall(x86=189, x64=182)
 vfork = IrregularEmulatedSyscall(x86=190, x64=58)
@@ -1159,7 +1170,7 @@ tkill = UnsupportedSyscall(x86=238, x64=200)
 # following the read bytes.  If OFFSET is a null pointer, use the normal
 # file position instead.  Return the number of written bytes, or -1 in
 # case of error.
-sendfile64 = IrregularEmulatedSyscall(x86=239)
+sendfile64 = EmulatedSyscall(x86=239, arg3=InOut("typename Arch::off64_t"), may_block=True)
 
 #  int futex(int *uaddr, int op, int val, const struct timespec *timeout, int
 #*uaddr2, int val3);
@@ -1388,7 +1399,7 @@ migrate_pages = UnsupportedSyscall(x86=294, x64=256)
 #
 # The openat() system call operates in exactly the same way as
 # open(2), except for the differences described in this manual page.
-openat = EmulatedSyscall(x86=295, x64=257)
+openat = IrregularEmulatedSyscall(x86=295, x64=257)
 
 #  int mkdirat(int dirfd, const char *pathname, mode_t mode);
 #
@@ -1429,7 +1440,12 @@ fchmodat = EmulatedSyscall(x86=306, x64=268)
 # page....
 faccessat = EmulatedSyscall(x86=307, x64=269)
 
-pselect6 = IrregularEmulatedSyscall(x86=308, x64=270)
+pselect6 = EmulatedSyscall(x86=308, x64=270,
+                           arg2=InOut("typename Arch::fd_set"),
+                           arg3=InOut("typename Arch::fd_set"),
+                           arg4=InOut("typename Arch::fd_set"),
+                           arg5=InOut("typename Arch::timespec"),
+                           may_block=True)
 
 ppoll = IrregularEmulatedSyscall(x86=309, x64=271)
 
@@ -1464,14 +1480,15 @@ get_robust_list = EmulatedSyscall(x86=312, x64=274, arg2="typename Arch::unsigne
 # NOTE: Technically, the following implementation is unsound for
 # programs that splice with stdin/stdout/stderr and have output
 # redirected during replay.  But, *crickets*.
-splice = IrregularEmulatedSyscall(x86=313, x64=275)
+splice = EmulatedSyscall(x86=313, x64=275, arg2=InOut("loff_t"),
+                         arg4=InOut("loff_t"), may_block=True)
 
 sync_file_range = UnsupportedSyscall(x86=314, x64=277)
 tee = UnsupportedSyscall(x86=315, x64=276)
 vmsplice = UnsupportedSyscall(x86=316, x64=278)
 move_pages = UnsupportedSyscall(x86=317, x64=279)
 getcpu = EmulatedSyscall(x86=318, x64=309, arg1="unsigned int", arg2="unsigned int")
-epoll_pwait = UnsupportedSyscall(x86=319, x64=281)
+epoll_pwait = IrregularEmulatedSyscall(x86=319, x64=281)
 
 #  int utimensat(int dirfd, const char *pathname, const struct timespec
 #times[2], int flags);
@@ -1633,12 +1650,21 @@ seccomp = IrregularEmulatedSyscall(x86=354, x64=317)
 getrandom = IrregularEmulatedSyscall(x86=355, x64=318)
 memfd_create = EmulatedSyscall(x86=356, x64=319)
 
+#  int statx(int dirfd, const char *pathname, int flags,
+#            unsigned int mask, struct statx *statxbuf);
+#
+# This function returns information about a file, storing it in the
+# buffer pointed to by statxbuf.  The returned buffer is a structure of
+# the following type: struct statx...
+statx = EmulatedSyscall(x86=383, x64=332, arg5="struct Arch::statx")
+
 # restart_syscall is a little special.
 restart_syscall = RestartSyscall(x86=0, x64=219)
 
 rrcall_init_preload = IrregularEmulatedSyscall(x86=442, x64=442)
 rrcall_init_buffers = IrregularEmulatedSyscall(x86=443, x64=443)
 rrcall_notify_syscall_hook_exit = IrregularEmulatedSyscall(x86=444, x64=444)
+rrcall_rdtsc = IrregularEmulatedSyscall(x86=445, x64=445)
 
 # These syscalls are subsumed under socketcall on x86.
 socket = EmulatedSyscall(x64=41)
@@ -1663,14 +1689,14 @@ shmget = EmulatedSyscall(x64=29)
 shmat = IrregularEmulatedSyscall(x64=30)
 shmctl = IrregularEmulatedSyscall(x64=31)
 semget = EmulatedSyscall(x64=64)
-semop = IrregularEmulatedSyscall(x64=65)
+semop = EmulatedSyscall(x64=65, may_block=True)
 semctl = IrregularEmulatedSyscall(x64=66)
 shmdt = IrregularEmulatedSyscall(x64=67)
 msgget = EmulatedSyscall(x64=68)
-msgsnd = IrregularEmulatedSyscall(x64=69)
+msgsnd = EmulatedSyscall(x64=69, may_block=True)
 msgrcv = IrregularEmulatedSyscall(x64=70)
 msgctl = IrregularEmulatedSyscall(x64=71)
-semtimedop = IrregularEmulatedSyscall(x64=220)
+semtimedop = EmulatedSyscall(x64=220, may_block=True)
 
 # These syscalls simply don't exist on x86.
 arch_prctl = IrregularEmulatedSyscall(x64=158)
@@ -1679,6 +1705,12 @@ security = InvalidSyscall(x64=185)
 epoll_ctl_old = UnsupportedSyscall(x64=214)
 epoll_wait_old = UnsupportedSyscall(x64=215)
 
+# Syscalls that can change the calling process's memory map.
+address_space_syscalls = set([
+    'brk', 'execve', 'ipc', 'madvise', 'mmap', 'mmap2', 'mprotect', 'mremap',
+    'munmap', 'remap_file_pages', 'shmat', 'shmdt',
+])
+
 def _syscalls():
     for name, obj in globals().iteritems():
         if isinstance(obj, BaseSyscall):
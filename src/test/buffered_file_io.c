@@ -0,0 +1,89 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Positioned and vectored file I/O and directory reads, as storage engines
+ * and directory scanners do them. These are all buffered by the syscallbuf,
+ * so check they return the same data in replay. */
+
+#define DUMMY_FILE "dummy.txt"
+#define NUM_ITERATIONS 50
+
+static void check_pread_pwrite(int fd, int i) {
+  char out[64];
+  char in[64];
+  char a[16];
+  char b[48];
+  struct iovec iov[2] = { { a, sizeof(a) }, { b, sizeof(b) } };
+
+  memset(out, 'a' + i % 26, sizeof(out));
+  test_assert(sizeof(out) == pwrite(fd, out, sizeof(out), i * sizeof(out)));
+  memset(in, 0, sizeof(in));
+  test_assert(sizeof(in) == pread(fd, in, sizeof(in), i * sizeof(in)));
+  test_assert(!memcmp(in, out, sizeof(in)));
+
+  memset(a, 'A' + i % 26, sizeof(a));
+  memset(b, '0' + i % 10, sizeof(b));
+  test_assert(sizeof(a) + sizeof(b) ==
+              pwritev(fd, iov, 2, (NUM_ITERATIONS + i) * sizeof(out)));
+  memset(a, 0, sizeof(a));
+  memset(b, 0, sizeof(b));
+  test_assert(sizeof(a) + sizeof(b) ==
+              preadv(fd, iov, 2, (NUM_ITERATIONS + i) * sizeof(out)));
+  test_assert(a[0] == 'A' + i % 26 && a[sizeof(a) - 1] == 'A' + i % 26);
+  test_assert(b[0] == '0' + i % 10 && b[sizeof(b) - 1] == '0' + i % 10);
+
+  /* Short read at the end of the file. */
+  test_assert(0 == pread(fd, in, sizeof(in), 1 << 30));
+}
+
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static int count_entries(int dirfd) {
+  char buf[4096];
+  int count = 0;
+  long nread;
+
+  test_assert(0 == lseek(dirfd, 0, SEEK_SET));
+  while ((nread = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0) {
+    long offset = 0;
+    while (offset < nread) {
+      struct linux_dirent64* ent = (struct linux_dirent64*)(buf + offset);
+      ++count;
+      offset += ent->d_reclen;
+    }
+  }
+  test_assert(nread == 0);
+  return count;
+}
+
+int main(void) {
+  int fd;
+  int dirfd;
+  int entries;
+  int i;
+
+  fd = open(DUMMY_FILE, O_CREAT | O_RDWR | O_TRUNC, 0600);
+  test_assert(fd >= 0);
+  dirfd = open(".", O_RDONLY | O_DIRECTORY);
+  test_assert(dirfd >= 0);
+  entries = count_entries(dirfd);
+  /* At least ".", ".." and DUMMY_FILE. */
+  test_assert(entries >= 3);
+
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    check_pread_pwrite(fd, i);
+    test_assert(entries == count_entries(dirfd));
+  }
+
+  unlink(DUMMY_FILE);
+  atomic_printf("%d directory entries\n", entries);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
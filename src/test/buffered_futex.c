@@ -0,0 +1,81 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Exercise the futex ops the syscallbuf handles, including waits that
+ * return without blocking and a lock handed back and forth between two
+ * threads. */
+
+#define NUM_ITERATIONS 1000
+
+static uint32_t word;
+static uint32_t word2;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int counter;
+
+static long futex(uint32_t* uaddr, int op, uint32_t val,
+                  const struct timespec* timeout, uint32_t* uaddr2,
+                  uint32_t val3) {
+  return syscall(SYS_futex, uaddr, op, val, timeout, uaddr2, val3);
+}
+
+static void check_nonblocking_waits(void) {
+  struct timespec ts = { 0, 1000 };
+  struct timespec abs_ts = { 0, 0 };
+
+  word = 1;
+  /* The value doesn't match, so these fail without blocking. */
+  test_assert(-1 == futex(&word, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0));
+  test_assert(EAGAIN == errno);
+  test_assert(-1 == futex(&word, FUTEX_WAIT_BITSET_PRIVATE, 0, NULL, NULL,
+                          FUTEX_BITSET_MATCH_ANY));
+  test_assert(EAGAIN == errno);
+
+  /* These time out almost immediately. */
+  test_assert(-1 == futex(&word, FUTEX_WAIT_PRIVATE, 1, &ts, NULL, 0));
+  test_assert(ETIMEDOUT == errno);
+  test_assert(0 == clock_gettime(CLOCK_MONOTONIC, &abs_ts));
+  test_assert(-1 == futex(&word, FUTEX_WAIT_BITSET_PRIVATE, 1, &abs_ts, NULL,
+                          FUTEX_BITSET_MATCH_ANY));
+  test_assert(ETIMEDOUT == errno);
+}
+
+static void check_wakes(void) {
+  test_assert(0 == futex(&word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0));
+  test_assert(0 == futex(&word, FUTEX_WAKE_BITSET_PRIVATE, 1, NULL, NULL,
+                         FUTEX_BITSET_MATCH_ANY));
+  test_assert(0 == futex(&word, FUTEX_REQUEUE_PRIVATE, 1, (void*)1, &word2,
+                         0));
+  test_assert(0 == futex(&word, FUTEX_CMP_REQUEUE_PRIVATE, 1, (void*)1,
+                         &word2, word));
+}
+
+static void* contend(__attribute__((unused)) void* p) {
+  int i;
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    pthread_mutex_lock(&lock);
+    ++counter;
+    pthread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+int main(void) {
+  pthread_t thread;
+  int i;
+
+  check_nonblocking_waits();
+  check_wakes();
+
+  test_assert(0 == pthread_create(&thread, NULL, contend, NULL));
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    pthread_mutex_lock(&lock);
+    ++counter;
+    pthread_mutex_unlock(&lock);
+  }
+  test_assert(0 == pthread_join(thread, NULL));
+  test_assert(2 * NUM_ITERATIONS == counter);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
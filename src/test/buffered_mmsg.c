@@ -0,0 +1,63 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Exercise the buffered sendto, sendmmsg and recvmmsg paths, including
+ * messages with several iovecs and a truncated read. */
+
+#define NUM_MSGS 4
+
+int main(void) {
+  int sv[2];
+  struct mmsghdr msgs[NUM_MSGS];
+  struct iovec iovs[NUM_MSGS][2];
+  char out[NUM_MSGS][8];
+  char in_head[NUM_MSGS][3];
+  char in_tail[NUM_MSGS][3];
+  int i;
+
+  test_assert(0 == socketpair(AF_UNIX, SOCK_DGRAM, 0, sv));
+
+  test_assert(5 == sendto(sv[0], "hello", 5, 0, NULL, 0));
+  test_assert(5 == recv(sv[1], out[0], sizeof(out[0]), 0));
+  test_assert(0 == memcmp(out[0], "hello", 5));
+
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < NUM_MSGS; ++i) {
+    snprintf(out[i], sizeof(out[i]), "msg%d", i);
+    iovs[i][0].iov_base = out[i];
+    iovs[i][0].iov_len = strlen(out[i]);
+    msgs[i].msg_hdr.msg_iov = iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  test_assert(NUM_MSGS == sendmmsg(sv[0], msgs, NUM_MSGS, 0));
+  for (i = 0; i < NUM_MSGS; ++i) {
+    test_assert(4 == msgs[i].msg_len);
+  }
+
+  /* Split each 4-byte message across two 3-byte iovecs. */
+  memset(msgs, 0, sizeof(msgs));
+  memset(in_head, 0, sizeof(in_head));
+  memset(in_tail, 0, sizeof(in_tail));
+  for (i = 0; i < NUM_MSGS; ++i) {
+    iovs[i][0].iov_base = in_head[i];
+    iovs[i][0].iov_len = sizeof(in_head[i]);
+    iovs[i][1].iov_base = in_tail[i];
+    iovs[i][1].iov_len = sizeof(in_tail[i]);
+    msgs[i].msg_hdr.msg_iov = iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 2;
+  }
+  test_assert(NUM_MSGS == recvmmsg(sv[1], msgs, NUM_MSGS, 0, NULL));
+  for (i = 0; i < NUM_MSGS; ++i) {
+    test_assert(4 == msgs[i].msg_len);
+    test_assert(0 == memcmp(in_head[i], "msg", 3));
+    test_assert('0' + i == in_tail[i][0]);
+  }
+
+  /* Nothing left to read. */
+  test_assert(-1 == recvmmsg(sv[1], msgs, NUM_MSGS, MSG_DONTWAIT, NULL));
+  test_assert(EAGAIN == errno);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
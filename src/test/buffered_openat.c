@@ -0,0 +1,74 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* The *at() path syscalls that modern glibc uses to implement open(), stat()
+ * and access(). The syscallbuf handles these, so check they get the same
+ * results in replay. */
+
+#define DUMMY_FILE "dummy.txt"
+#define NUM_ITERATIONS 50
+
+static void check_stat(int dirfd, const char* path, off_t size) {
+  struct stat st;
+#ifdef SYS_statx
+  /* struct statx, which older system headers don't define. */
+  uint64_t stx[32];
+  long ret;
+#endif
+
+  test_assert(0 == fstatat(dirfd, path, &st, 0));
+  test_assert(S_ISREG(st.st_mode) && st.st_size == size);
+
+#ifdef SYS_statx
+  ret = syscall(SYS_statx, dirfd, path, 0, 0x7ff, stx);
+  test_assert(ret == 0 || errno == ENOSYS);
+  if (ret == 0) {
+    /* stx_size is at offset 40. */
+    test_assert(stx[5] == (uint64_t)size);
+  }
+#endif
+}
+
+int main(void) {
+  char path[PATH_MAX];
+  int dirfd;
+  int fd;
+  int i;
+
+  test_assert(NULL != getcwd(path, sizeof(path) - sizeof(DUMMY_FILE) - 1));
+  strcat(path, "/" DUMMY_FILE);
+
+  dirfd = open(".", O_RDONLY | O_DIRECTORY);
+  test_assert(dirfd >= 0);
+  fd = openat(AT_FDCWD, DUMMY_FILE, O_CREAT | O_RDWR | O_TRUNC, 0600);
+  test_assert(fd >= 0);
+  test_assert(0 == close(fd));
+
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    /* Relative to the cwd, relative to a directory fd, and absolute. */
+    fd = openat(AT_FDCWD, DUMMY_FILE, O_WRONLY | O_APPEND);
+    test_assert(fd >= 0);
+    test_assert(1 == write(fd, "x", 1));
+    test_assert(0 == close(fd));
+    fd = openat(dirfd, DUMMY_FILE, O_RDONLY);
+    test_assert(fd >= 0);
+    test_assert(0 == close(fd));
+    fd = openat(dirfd, path, O_RDONLY);
+    test_assert(fd >= 0);
+    test_assert(0 == close(fd));
+    test_assert(-1 == openat(dirfd, "no-such-file", O_RDONLY));
+    test_assert(ENOENT == errno);
+
+    test_assert(0 == faccessat(dirfd, DUMMY_FILE, R_OK | W_OK, 0));
+    test_assert(-1 == faccessat(AT_FDCWD, "no-such-file", F_OK, 0));
+    test_assert(ENOENT == errno);
+
+    check_stat(dirfd, DUMMY_FILE, i + 1);
+    check_stat(AT_FDCWD, path, i + 1);
+  }
+
+  unlink(DUMMY_FILE);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,113 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Exercise the syscallbuf handlers for waits that an event loop makes.
+ * Everything we wait for is already ready, so none of them block and
+ * they should all be buffered. */
+
+#define NUM_ITERATIONS 100
+
+static void check_epoll(int epfd, int fd) {
+  struct epoll_event ev[2];
+  sigset_t mask;
+
+  memset(ev, 0, sizeof(ev));
+  test_assert(1 == epoll_wait(epfd, ev, 2, 1000));
+  test_assert(ev[0].events == EPOLLIN && ev[0].data.fd == fd);
+
+  sigemptyset(&mask);
+  memset(ev, 0, sizeof(ev));
+  test_assert(1 == epoll_pwait(epfd, ev, 2, 1000, &mask));
+  test_assert(ev[0].events == EPOLLIN && ev[0].data.fd == fd);
+}
+
+static void check_select(int fd) {
+  fd_set rfds;
+  fd_set wfds;
+  struct timeval tv = { 1, 0 };
+  struct timespec ts = { 1, 0 };
+  sigset_t mask;
+
+  FD_ZERO(&rfds);
+  FD_ZERO(&wfds);
+  FD_SET(fd, &rfds);
+  FD_SET(fd, &wfds);
+  test_assert(1 == select(fd + 1, &rfds, &wfds, NULL, &tv));
+  test_assert(FD_ISSET(fd, &rfds) && !FD_ISSET(fd, &wfds));
+  test_assert(tv.tv_sec <= 1);
+
+  sigemptyset(&mask);
+  FD_ZERO(&rfds);
+  FD_SET(fd, &rfds);
+  test_assert(1 == pselect(fd + 1, &rfds, NULL, NULL, &ts, &mask));
+  test_assert(FD_ISSET(fd, &rfds));
+}
+
+static void check_sleeps(void) {
+  struct timespec ts = { 0, 0 };
+  struct timespec rem = { 1, 1 };
+
+  test_assert(0 == nanosleep(&ts, &rem));
+  test_assert(0 == clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &rem));
+  /* |rem| is only written if the sleep is interrupted. */
+  test_assert(rem.tv_sec == 1 && rem.tv_nsec == 1);
+}
+
+static void check_accept4(int listenfd, const struct sockaddr_un* addr) {
+  struct sockaddr_un peer;
+  socklen_t len = sizeof(peer);
+  int clientfd;
+  int servefd;
+
+  clientfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  test_assert(clientfd >= 0);
+  test_assert(0 == connect(clientfd, (struct sockaddr*)addr, sizeof(*addr)));
+
+  memset(&peer, 0xff, sizeof(peer));
+  servefd = accept4(listenfd, (struct sockaddr*)&peer, &len, SOCK_CLOEXEC);
+  test_assert(servefd >= 0);
+  test_assert(AF_UNIX == peer.sun_family);
+  test_assert(len <= sizeof(peer));
+  test_assert(FD_CLOEXEC == fcntl(servefd, F_GETFD));
+
+  test_assert(0 == close(servefd));
+  test_assert(0 == close(clientfd));
+}
+
+int main(void) {
+  int pipefds[2];
+  int epfd;
+  int listenfd;
+  struct sockaddr_un addr;
+  struct epoll_event ev;
+  int i;
+
+  test_assert(0 == pipe(pipefds));
+  test_assert(1 == write(pipefds[1], "x", 1));
+
+  epfd = epoll_create(1);
+  test_assert(epfd >= 0);
+  ev.events = EPOLLIN;
+  ev.data.fd = pipefds[0];
+  test_assert(0 == epoll_ctl(epfd, EPOLL_CTL_ADD, pipefds[0], &ev));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, "socket.unix", sizeof(addr.sun_path) - 1);
+  listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  test_assert(listenfd >= 0);
+  test_assert(0 == bind(listenfd, (struct sockaddr*)&addr, sizeof(addr)));
+  test_assert(0 == listen(listenfd, 1));
+
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    check_epoll(epfd, pipefds[0]);
+    check_select(pipefds[0]);
+    check_sleeps();
+    check_accept4(listenfd, &addr);
+  }
+
+  unlink(addr.sun_path);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,24 @@
+from rrutil import *
+
+send_gdb('break main')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+# atomic_puts' write is usually buffered, in which case we can only report
+# it after it has returned.
+send_gdb('catch syscall write')
+expect_gdb('Catchpoint 2')
+send_gdb('c')
+expect_gdb(r'Catchpoint 2 \((call to|returned from) syscall write\)')
+
+# There are no writes between main and here, so reverse-continue
+# gets back to main.
+send_gdb('reverse-cont')
+expect_gdb('Breakpoint 1')
+
+send_gdb('delete 1')
+send_gdb('c')
+expect_gdb(r'Catchpoint 2 \((call to|returned from) syscall write\)')
+
+ok()
@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_THREADS 4
+#define ITERATIONS 2000
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int counter;
+
+static void* run_thread(__attribute__((unused)) void* p) {
+  int i;
+  for (i = 0; i < ITERATIONS; ++i) {
+    pthread_mutex_lock(&lock);
+    ++counter;
+    pthread_mutex_unlock(&lock);
+    if (i % 16 == 0) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+int main(void) {
+  pthread_t threads[NUM_THREADS];
+  int i;
+
+  for (i = 0; i < NUM_THREADS; ++i) {
+    test_assert(0 == pthread_create(&threads[i], NULL, run_thread, NULL));
+  }
+  for (i = 0; i < NUM_THREADS; ++i) {
+    test_assert(0 == pthread_join(threads[i], NULL));
+  }
+  atomic_printf("counter=%d\n", counter);
+  test_assert(NUM_THREADS * ITERATIONS == counter);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Checkpoint a process with many threads, some of them renamed, all
+ * blocked in a buffered syscall. */
+
+#define NUM_THREADS 100
+
+static int ready_fds[2];
+static int go_fds[2];
+
+static void breakpoint(void) {}
+
+static void* run_thread(void* p) {
+  char ch = 'X';
+  if ((uintptr_t)p % 10 == 0) {
+    char name[16];
+    sprintf(name, "thread%d", (int)(uintptr_t)p);
+    test_assert(0 == prctl(PR_SET_NAME, name));
+  }
+  test_assert(1 == write(ready_fds[1], &ch, 1));
+  test_assert(1 == read(go_fds[0], &ch, 1));
+  return NULL;
+}
+
+int main(void) {
+  pthread_t threads[NUM_THREADS];
+  char ch = 'X';
+  int i;
+
+  test_assert(0 == pipe(ready_fds));
+  test_assert(0 == pipe(go_fds));
+
+  for (i = 0; i < NUM_THREADS; ++i) {
+    test_assert(0 == pthread_create(&threads[i], NULL, run_thread,
+                                    (void*)(uintptr_t)i));
+  }
+  for (i = 0; i < NUM_THREADS; ++i) {
+    test_assert(1 == read(ready_fds[0], &ch, 1));
+  }
+
+  breakpoint();
+
+  for (i = 0; i < NUM_THREADS; ++i) {
+    test_assert(1 == write(go_fds[1], &ch, 1));
+  }
+  for (i = 0; i < NUM_THREADS; ++i) {
+    test_assert(0 == pthread_join(threads[i], NULL));
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* A conditional breakpoint that is hit many times but whose condition is
+ * only true once. The condition's sign extensions make rr evaluate several
+ * variants of it at each hit. */
+
+#define NUM_ITERATIONS 20000
+
+static void breakpoint(__attribute__((unused)) short value) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+static signed char small;
+static short medium;
+
+int main(void) {
+  int i;
+
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    small = (signed char)i;
+    medium = (short)i;
+    breakpoint(medium);
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,30 @@
+from rrutil import *
+
+send_gdb('handle SIGKILL stop')
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+# True only at i == 19999.
+send_gdb('cond 1 small==31 && medium==19999')
+
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+send_gdb('p medium')
+expect_gdb(' = 19999')
+
+send_gdb('c')
+expect_rr('EXIT-SUCCESS')
+expect_gdb('SIGKILL')
+
+send_gdb('reverse-continue')
+expect_gdb('Breakpoint 1')
+send_gdb('p medium')
+expect_gdb(' = 19999')
+
+send_gdb('cond 1 small==-128 && medium==128')
+send_gdb('reverse-continue')
+expect_gdb('Breakpoint 1')
+send_gdb('p medium')
+expect_gdb(' = 128')
+
+ok()
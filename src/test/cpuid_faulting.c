@@ -0,0 +1,28 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static void cpuid(int code, int subrequest, unsigned int* a, unsigned int* c,
+                  unsigned int* d) {
+  asm volatile("cpuid"
+               : "=a"(*a), "=c"(*c), "=d"(*d)
+               : "a"(code), "c"(subrequest)
+               : "ebx");
+}
+
+int main(void) {
+  static const int leaves[] = { 0x0, 0x1, 0x7, 0xd };
+  unsigned int eax, ecx, edx;
+  size_t i;
+
+  /* Replay has to see the same results, whether they come from the trace
+   * or from the CPU. */
+  for (i = 0; i < sizeof(leaves) / sizeof(leaves[0]); ++i) {
+    cpuid(leaves[i], 0, &eax, &ecx, &edx);
+    atomic_printf("cpuid(0x%x): eax=0x%x ecx=0x%x edx=0x%x\n", leaves[i], eax,
+                  ecx, edx);
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,35 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define DUMMY_FILE "dummy.txt"
+#define FILE_SIZE (64 * 1024)
+#define READ_COUNT 20
+
+int main(void) {
+  char* data = malloc(FILE_SIZE);
+  char* buf = malloc(FILE_SIZE);
+  int fd;
+  int i;
+
+  for (i = 0; i < FILE_SIZE; ++i) {
+    data[i] = (char)(i * 7 + i / 4096);
+  }
+  fd = open(DUMMY_FILE, O_CREAT | O_RDWR | O_TRUNC, 0600);
+  test_assert(fd >= 0);
+  test_assert(FILE_SIZE == write(fd, data, FILE_SIZE));
+  unlink(DUMMY_FILE);
+
+  /* Read the same data repeatedly, at page-aligned and unaligned offsets
+     within |buf|, so that most recorded chunks are duplicates. */
+  for (i = 0; i < READ_COUNT; ++i) {
+    size_t skew = (i % 2) ? 0 : 100;
+    memset(buf, 0, FILE_SIZE);
+    test_assert(FILE_SIZE - skew ==
+                pread(fd, buf + skew, FILE_SIZE - skew, 0));
+    test_assert(!memcmp(buf + skew, data, FILE_SIZE - skew));
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
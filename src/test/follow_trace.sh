@@ -0,0 +1,12 @@
+#!/bin/sh
+
+echo started
+sleep 2
+# While the replay follows, write several of the data substream's
+# buffers' worth of trace data, with pauses so the recorder flushes
+# part-filled blocks in between.
+for i in 1 2 3 4 5 6 7 8 9 10 11 12; do
+    dd if=/dev/zero of=/dev/null bs=1M count=8 2>/dev/null
+    sleep 0.3
+done
+echo EXIT-SUCCESS
@@ -0,0 +1,14 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static void breakpoint(void) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+int main(void) {
+  breakpoint();
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,17 @@
+from rrutil import *
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1, breakpoint')
+
+# rr walks the link_map list itself and sends it in one reply.
+send_gdb('maint packet qXfer:libraries-svr4:read::0,fff')
+expect_gdb('received: "[lm]<library-list-svr4 ')
+send_gdb('info sharedlibrary')
+expect_gdb(r'libc[-.]')
+
+send_gdb('maint packet qXfer:exec-file:read::0,fff')
+expect_gdb('received: "[lm][^"]*gdb_libraries_svr4')
+
+ok()
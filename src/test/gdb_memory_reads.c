@@ -0,0 +1,26 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define SIZE (256 * 1024)
+
+static unsigned char big[SIZE];
+
+static void breakpoint(void) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+int main(void) {
+  int i;
+
+  for (i = 0; i < SIZE; ++i) {
+    big[i] = i * 7;
+  }
+  breakpoint();
+  big[1000] = 42;
+  breakpoint();
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,29 @@
+from rrutil import *
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1, breakpoint')
+
+# A binary read. big[10..13] are 70, 77, 84 and 91, i.e. "FMT[".
+send_gdb('p/x &big[10]')
+expect_gdb(r'= (0x[0-9a-f]+)')
+addr = last_match().group(1)
+send_gdb('maint packet x%s,4' % addr[2:])
+expect_gdb(r'received: "bFMT\[')
+
+# Reads spanning many pages, served from the cache after the first.
+send_gdb('p big[1000]')
+expect_gdb(r'= 88')
+send_gdb('p big[200000]')
+expect_gdb(r'= 192')
+send_gdb('p big[1000]@4')
+expect_gdb(r'= "X_fm"')
+
+# The cache has to be dropped once the tracee has run.
+send_gdb('c')
+expect_gdb('Breakpoint 1, breakpoint')
+send_gdb('p big[1000]')
+expect_gdb(r'= 42')
+
+ok()
@@ -4,6 +4,8 @@
 
 int main(void) {
   int pipe_fds[2];
+  int* value;
+  int on = 1;
 
   test_assert(0 == pipe(pipe_fds));
   test_assert(0 == ioctl(pipe_fds[0], FIOCLEX));
@@ -11,6 +13,15 @@ int main(void) {
   test_assert(0 == ioctl(pipe_fds[0], FIONCLEX));
   test_assert(0 == fcntl(pipe_fds[0], F_GETFD));
 
+  test_assert(0 == ioctl(pipe_fds[0], FIONBIO, &on));
+  test_assert(O_NONBLOCK & fcntl(pipe_fds[0], F_GETFL));
+
+  test_assert(3 == write(pipe_fds[1], "abc", 3));
+  ALLOCATE_GUARD(value, 'x');
+  test_assert(0 == ioctl(pipe_fds[0], FIONREAD, value));
+  test_assert(3 == *value);
+  VERIFY_GUARD(value);
+
   atomic_puts("EXIT-SUCCESS");
   return 0;
 }
@@ -0,0 +1,19 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static void reached(int i) { atomic_printf("reached step %d\n", i); }
+
+int main(void) {
+  int i;
+
+  for (i = 0; i < 3; ++i) {
+    static const char name[] = "step\n";
+    test_assert(sizeof(name) - 1 ==
+                syscall(SYS_write, RR_MAGIC_MARKER_FD, name, sizeof(name) - 1));
+    reached(i);
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,26 @@
+from rrutil import *
+import re
+
+send_gdb('b reached')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+# We start at the second marker, so the first call is behind us.
+expect_gdb(re.compile(r'Breakpoint 1, reached \(i=1\)'))
+
+send_gdb('seek-marker step 3')
+send_gdb('y')
+expect_gdb(re.compile(r'stopped|SIGTRAP|SIGINT'))
+send_gdb('c')
+expect_gdb(re.compile(r'Breakpoint 1, reached \(i=2\)'))
+
+send_gdb('seek-marker step')
+send_gdb('y')
+expect_gdb(re.compile(r'stopped|SIGTRAP|SIGINT'))
+send_gdb('c')
+expect_gdb(re.compile(r'Breakpoint 1, reached \(i=0\)'))
+
+send_gdb('seek-marker nonexistent')
+send_gdb('y')
+expect_gdb('No marker nonexistent #1')
+
+ok()
@@ -0,0 +1,39 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Map a large private file mapping at a nonzero offset and delete the file,
+ * so replay has to use rr's copy of it. */
+
+#define FILE_SIZE (20 * 1024 * 1024)
+
+int main(void) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t map_size = FILE_SIZE - page_size;
+  char name[] = "mmap_large_private_XXXXXX";
+  int fd = mkstemp(name);
+  char* p;
+  size_t i;
+
+  test_assert(fd >= 0);
+  test_assert(0 == ftruncate(fd, FILE_SIZE));
+  for (i = 0; i < FILE_SIZE; i += page_size) {
+    char c = (char)(i / page_size);
+    test_assert(1 == pwrite(fd, &c, 1, i));
+  }
+
+  p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, page_size);
+  test_assert(p != MAP_FAILED);
+  test_assert(0 == close(fd));
+  test_assert(0 == unlink(name));
+
+  for (i = 0; i < map_size; i += page_size) {
+    test_assert(p[i] == (char)(i / page_size + 1));
+    test_assert(p[i + 1] == 0);
+  }
+  p[0] = 'x';
+  test_assert('x' == p[0]);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Create and destroy many separate mappings, to exercise rr's bookkeeping
+ * for address spaces with very large numbers of mappings. Each mapped page
+ * is separated from the next by a PROT_NONE page, so none of them coalesce.
+ * Stay well under the default vm.max_map_count of 65530. */
+
+#define NUM_MAPPINGS 10000
+
+int main(void) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t region_size = 2 * NUM_MAPPINGS * page_size;
+  uint8_t* region = mmap(NULL, region_size, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  int i;
+
+  test_assert(region != MAP_FAILED);
+
+  for (i = 0; i < NUM_MAPPINGS; ++i) {
+    uint8_t* p =
+        mmap(region + 2 * i * page_size, page_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    test_assert(p == region + 2 * i * page_size);
+    *p = (uint8_t)i;
+  }
+
+  /* Change protections on every other mapping, then unmap every other
+   * one. */
+  for (i = 0; i < NUM_MAPPINGS; i += 2) {
+    test_assert(0 == mprotect(region + 2 * i * page_size, page_size,
+                              PROT_READ));
+  }
+  for (i = 1; i < NUM_MAPPINGS; i += 2) {
+    test_assert(0 == munmap(region + 2 * i * page_size, page_size));
+  }
+  for (i = 0; i < NUM_MAPPINGS; i += 2) {
+    test_assert(region[2 * i * page_size] == (uint8_t)i);
+  }
+
+  test_assert(0 == munmap(region, region_size));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,73 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_PAGES 16
+#define ITERATIONS 1000
+
+static char* pages;
+static size_t page_size;
+static int faults;
+
+static void sighandler(__attribute__((unused)) int sig) {
+  ++faults;
+  test_assert(0 == mprotect(pages, page_size, PROT_READ | PROT_WRITE));
+}
+
+static void* unmap_thread(void* p) {
+  test_assert(0 == mprotect(p, page_size, PROT_READ));
+  test_assert(0 == munmap(p, page_size));
+  return NULL;
+}
+
+int main(void) {
+  pthread_t thread;
+  int i;
+
+  page_size = sysconf(_SC_PAGESIZE);
+  pages = (char*)mmap(NULL, NUM_PAGES * page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  test_assert(pages != MAP_FAILED);
+
+  /* Toggle protections like a JIT flipping pages between writable and
+   * executable. */
+  for (i = 0; i < ITERATIONS; ++i) {
+    char* p = pages + (i % NUM_PAGES) * page_size;
+    test_assert(0 == mprotect(p, page_size, PROT_READ | PROT_WRITE));
+    p[i % page_size] = i;
+    test_assert(0 == mprotect(p, page_size, PROT_READ | PROT_EXEC));
+  }
+  /* Failed mprotects are buffered too. */
+  test_assert(-1 == mprotect(pages + 1, page_size, PROT_READ));
+  test_assert(EINVAL == errno);
+
+  /* A fault right after a buffered mprotect. */
+  signal(SIGSEGV, sighandler);
+  test_assert(0 == mprotect(pages, page_size, PROT_NONE));
+  pages[0] = 1;
+  test_assert(1 == faults);
+
+  /* Punch holes, then map over them again. */
+  for (i = 1; i < NUM_PAGES; i += 2) {
+    test_assert(0 == munmap(pages + i * page_size, page_size));
+  }
+  for (i = 1; i < NUM_PAGES; i += 2) {
+    char* p = (char*)mmap(pages + i * page_size, page_size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    test_assert(p == pages + i * page_size);
+    test_assert(0 == p[0]);
+  }
+
+  /* Once there's a second thread these go through rr again, so another
+   * thread's unmap is in the map before we reuse the address. */
+  pthread_create(&thread, NULL, unmap_thread, pages);
+  pthread_join(thread, NULL);
+  test_assert(pages == mmap(pages, page_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0));
+  test_assert(0 == mprotect(pages, page_size, PROT_READ));
+  test_assert(0 == munmap(pages, NUM_PAGES * page_size));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,11 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+int main(void) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  test_assert(cores >= 1);
+  atomic_printf("cores=%ld\n", cores);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
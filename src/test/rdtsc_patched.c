@@ -0,0 +1,48 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Programs that measure latency execute rdtsc at the same few sites over
+ * and over. rr patches those sites to record the TSC in the syscallbuf
+ * instead of trapping, so check the values still replay. */
+
+#define NUM_ITERATIONS 100000
+
+static uint64_t checksum;
+
+static void* do_thread(__attribute__((unused)) void* p) {
+  uint64_t last_tsc = 0;
+  int i;
+
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    uint64_t tsc = rdtsc();
+    test_assert(last_tsc < tsc);
+    last_tsc = tsc;
+  }
+  return (void*)(uintptr_t)last_tsc;
+}
+
+int main(void) {
+  pthread_t thread;
+  void* thread_tsc;
+  uint64_t last_tsc = 0;
+  int i;
+
+  test_assert(0 == pthread_create(&thread, NULL, do_thread, NULL));
+  for (i = 0; i < NUM_ITERATIONS; ++i) {
+    uint64_t tsc = rdtsc();
+    test_assert(last_tsc < tsc);
+    checksum += tsc - last_tsc;
+    last_tsc = tsc;
+    if (i % 10000 == 0) {
+      /* Mix in buffered syscalls. */
+      getpid();
+    }
+  }
+  test_assert(0 == pthread_join(thread, &thread_tsc));
+  test_assert(thread_tsc != NULL);
+
+  atomic_printf("checksum=%" PRIu64 "\n", checksum);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,56 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define DUMMY_FILE "dummy.txt"
+#define FILE_SIZE (64 * 1024)
+
+static void check_reads(int fd, const char* data, char* buf) {
+  memset(buf, 0, FILE_SIZE);
+  test_assert(0 == lseek(fd, 0, SEEK_SET));
+  test_assert(FILE_SIZE / 2 == read(fd, buf, FILE_SIZE / 2));
+  test_assert(FILE_SIZE / 2 == read(fd, buf + FILE_SIZE / 2, FILE_SIZE / 2));
+  test_assert(!memcmp(buf, data, FILE_SIZE));
+
+  memset(buf, 0, FILE_SIZE);
+  test_assert(FILE_SIZE - 100 == pread(fd, buf, FILE_SIZE - 100, 100));
+  test_assert(!memcmp(buf, data + 100, FILE_SIZE - 100));
+}
+
+int main(void) {
+  char* data = malloc(FILE_SIZE);
+  char* buf = malloc(FILE_SIZE);
+  struct timespec times[2] = { { 1000000000, 0 }, { 1000000000, 0 } };
+  int fd;
+  int i;
+
+  for (i = 0; i < FILE_SIZE; ++i) {
+    data[i] = (char)(i * 7 + i / 4096);
+  }
+  fd = open(DUMMY_FILE, O_CREAT | O_RDWR | O_TRUNC, 0600);
+  test_assert(fd >= 0);
+  test_assert(FILE_SIZE == write(fd, data, FILE_SIZE));
+
+  /* An old file can be read by reference. */
+  test_assert(0 == futimens(fd, times));
+  check_reads(fd, data, buf);
+
+  /* Changing it in place makes it recent, so reads are recorded by
+     content again. */
+  for (i = 0; i < FILE_SIZE; ++i) {
+    data[i] = (char)(i * 13);
+  }
+  test_assert(FILE_SIZE == pwrite(fd, data, FILE_SIZE, 0));
+  check_reads(fd, data, buf);
+
+  /* Old again, so it needs a new snapshot. */
+  test_assert(0 == futimens(fd, times));
+  check_reads(fd, data, buf);
+
+  test_assert(0 == close(fd));
+  test_assert(0 == unlink(DUMMY_FILE));
+  free(buf);
+  free(data);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,26 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define ITERATIONS 5
+
+static void breakpoint(void) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+int main(void) {
+  int i;
+  int j;
+
+  for (i = 0; i < ITERATIONS; ++i) {
+    /* Give the lookahead some syscalls and events to get through. */
+    for (j = 0; j < 100; ++j) {
+      getpid();
+    }
+    atomic_printf("iteration %d\n", i);
+    breakpoint();
+  }
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
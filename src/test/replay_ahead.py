@@ -0,0 +1,19 @@
+from rrutil import *
+import time
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+
+for i in range(5):
+    send_gdb('c')
+    # Output the lookahead replayed is written before the stop is reported.
+    expect_rr('iteration %d' % i)
+    expect_gdb('Breakpoint 1, breakpoint')
+    # Leave the debugger idle so rr replays ahead to the next stop.
+    time.sleep(0.5)
+
+send_gdb('c')
+expect_rr('EXIT-SUCCESS')
+expect_gdb('exited normally')
+
+ok()
@@ -0,0 +1,37 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static void write_line(int fd, const char* what, int i) {
+  char buf[100];
+  int len = snprintf(buf, sizeof(buf), "%s %d\n", what, i);
+  test_assert(len == write(fd, buf, len));
+}
+
+int main(void) {
+  static char big[100 * 1024];
+  struct timespec ts = { 0, 150 * 1000 * 1000 };
+  int i;
+
+  /* Many small writes, switching between stdout and stderr. */
+  for (i = 0; i < 2000; ++i) {
+    write_line(STDOUT_FILENO, "out", i);
+    if (i % 7 == 0) {
+      write_line(STDERR_FILENO, "err", i);
+    }
+  }
+
+  /* One write bigger than replay buffers. */
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\n';
+  test_assert(sizeof(big) == write(STDOUT_FILENO, big, sizeof(big)));
+
+  /* Output that has to show up even though nothing follows it for a
+   * while. */
+  write_line(STDOUT_FILENO, "before sleep", 0);
+  nanosleep(&ts, NULL);
+  write_line(STDERR_FILENO, "after sleep", 0);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,21 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static int counter;
+
+static void breakpoint(void) {}
+
+static void done(void) {}
+
+int main(void) {
+  int i;
+  for (i = 0; i < 1000; ++i) {
+    ++counter;
+    breakpoint();
+  }
+  done();
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
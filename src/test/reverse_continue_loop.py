@@ -0,0 +1,27 @@
+from rrutil import *
+
+send_gdb('break done')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+send_gdb('break breakpoint')
+expect_gdb('Breakpoint 2')
+# Repeated reverse-continues through the same loop must stop at each
+# iteration in turn.
+for expected in range(1000, 990, -1):
+    send_gdb('reverse-continue')
+    expect_gdb('Breakpoint 2')
+    send_gdb('p counter')
+    expect_gdb('= %d' % expected)
+
+# Changing breakpoints must not reuse stale results.
+send_gdb('delete 2')
+send_gdb('break breakpoint if counter == 500')
+expect_gdb('Breakpoint 3')
+send_gdb('reverse-continue')
+expect_gdb('Breakpoint 3')
+send_gdb('p counter')
+expect_gdb('= 500')
+
+ok()
@@ -0,0 +1,26 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define NUM_ITERATIONS 1000
+
+static int iteration;
+static int buf[NUM_ITERATIONS];
+
+static void breakpoint(void) {
+  int break_here = 1;
+  (void)break_here;
+}
+
+int main(void) {
+  /* A simple counted loop that reverse-stepping has to run forward
+   * through, iteration by iteration. */
+  for (iteration = 0; iteration < NUM_ITERATIONS; ++iteration) {
+    buf[iteration] = iteration * 3;
+  }
+  breakpoint();
+
+  test_assert(buf[NUM_ITERATIONS - 1] == (NUM_ITERATIONS - 1) * 3);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,26 @@
+from rrutil import *
+import re
+
+send_gdb('b breakpoint')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+
+send_gdb('p iteration')
+expect_gdb('= 1000')
+
+# Step back into the last couple of iterations of the loop.
+for i in range(16):
+    send_gdb('reverse-stepi')
+send_gdb('p iteration')
+expect_gdb(re.compile(r'= 99[0-9]'))
+
+send_gdb('p buf[995]')
+expect_gdb('= 2985')
+
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+send_gdb('p iteration')
+expect_gdb('= 1000')
+
+ok()
@@ -0,0 +1,37 @@
+from rrutil import *
+import re
+
+def when():
+    send_gdb('when')
+    expect_gdb(re.compile(r'Current event: (\d+)'))
+    event = eval(last_match().group(1))
+    send_gdb('when-ticks')
+    expect_gdb(re.compile(r'Current tick: (\d+)'))
+    return (event, eval(last_match().group(1)))
+
+send_gdb('b main')
+expect_gdb('Breakpoint 1')
+send_gdb('c')
+expect_gdb('Breakpoint 1')
+(event, ticks) = when()
+if ticks == 0:
+    failed('ERROR: no ticks at main')
+
+send_gdb('delete 1')
+send_gdb('c')
+expect_gdb('exited normally')
+
+send_gdb('seek-ticks %d %d'%(event, ticks))
+send_gdb('y')
+expect_gdb(re.compile(r'stopped|SIGTRAP|SIGINT'))
+if when() != (event, ticks):
+    failed('ERROR: "seek-ticks" landed at the wrong point')
+
+send_gdb('seek-time 0')
+send_gdb('y')
+expect_gdb(re.compile(r'stopped|SIGTRAP|SIGINT'))
+(event0, ticks0) = when()
+if event0 > event:
+    failed('ERROR: "seek-time 0" landed after main')
+
+ok()
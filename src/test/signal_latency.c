@@ -0,0 +1,63 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Measures how long it takes to deliver a signal to a handler, both for
+ * signals the task sends itself and for SIGPROF from a profiling timer,
+ * which is what sampling profilers use. Compare the numbers printed when
+ * run under rr record with those of a normal run. */
+
+#define NUM_SIGNALS 2000
+#define NUM_PROF_SIGNALS 50
+
+static volatile int caught;
+static volatile int bad_siginfo;
+
+static void handler(int sig, siginfo_t* si, __attribute__((unused)) void* ctx) {
+  if (si->si_signo != sig) {
+    bad_siginfo = 1;
+  }
+  ++caught;
+}
+
+static double now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(void) {
+  struct sigaction sa;
+  struct itimerval timer = { { 0, 1000 }, { 0, 1000 } };
+  struct itimerval stop = { { 0, 0 }, { 0, 0 } };
+  pid_t tid = sys_gettid();
+  double start;
+  int i;
+
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sa.sa_sigaction = handler;
+  test_assert(0 == sigaction(SIGUSR1, &sa, NULL));
+  test_assert(0 == sigaction(SIGPROF, &sa, NULL));
+
+  start = now_us();
+  for (i = 0; i < NUM_SIGNALS; ++i) {
+    syscall(SYS_tgkill, getpid(), tid, SIGUSR1);
+  }
+  test_assert(caught == NUM_SIGNALS);
+  atomic_printf("self-sent signals: %.2f us per signal\n",
+                (now_us() - start) / NUM_SIGNALS);
+
+  caught = 0;
+  test_assert(0 == setitimer(ITIMER_PROF, &timer, NULL));
+  start = now_us();
+  while (caught < NUM_PROF_SIGNALS) {
+  }
+  test_assert(0 == setitimer(ITIMER_PROF, &stop, NULL));
+  atomic_printf("SIGPROF: %.2f us between signals, for a 1ms timer\n",
+                (now_us() - start) / NUM_PROF_SIGNALS);
+
+  test_assert(!bad_siginfo);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
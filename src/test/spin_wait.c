@@ -0,0 +1,36 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define ROUNDS 20
+
+static volatile int turn;
+
+/* Each thread busy-waits, PAUSE-ing like a spinlock would, for the other
+ * one to hand it the turn, so neither can make progress while the other
+ * isn't running. */
+static void take_turns(int self) {
+  int i;
+  for (i = 0; i < ROUNDS; ++i) {
+    while (turn != self) {
+      __builtin_ia32_pause();
+    }
+    turn = !self;
+  }
+}
+
+static void* other_thread(__attribute__((unused)) void* p) {
+  take_turns(1);
+  return NULL;
+}
+
+int main(void) {
+  pthread_t thread;
+
+  pthread_create(&thread, NULL, other_thread, NULL);
+  take_turns(0);
+  pthread_join(thread, NULL);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
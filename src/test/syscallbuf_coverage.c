@@ -0,0 +1,35 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Make common syscalls through their glibc wrappers, which the syscallbuf
+ * should record without trapping. If rr stops patching one of the wrappers
+ * (e.g. because a new glibc changed its code), each iteration adds a traced
+ * syscall and syscallbuf_coverage.run notices. */
+
+#define ITERATIONS 2000
+
+int main(void) {
+  int pipe_fds[2];
+  char buf[16] = "x";
+  struct stat st;
+  int i;
+
+  test_assert(0 == pipe(pipe_fds));
+  for (i = 0; i < ITERATIONS; ++i) {
+    int fd;
+
+    test_assert(1 == write(pipe_fds[1], buf, 1));
+    test_assert(1 == read(pipe_fds[0], buf, 1));
+    fd = open("/dev/null", O_RDONLY);
+    test_assert(fd >= 0);
+    test_assert(0 == fstat(fd, &st));
+    test_assert(0 == lseek(fd, 0, SEEK_SET));
+    test_assert(0 == pread(fd, buf, sizeof(buf), 0));
+    test_assert(0 == close(fd));
+    test_assert(0 == access("/dev/null", R_OK));
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,40 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define DUMMY_FILE "dummy.txt"
+#define CHUNK_SIZE 16384
+#define NUM_CHUNKS 8
+#define NUM_ROUNDS 64
+
+static char buf[CHUNK_SIZE];
+
+int main(void) {
+  int fd;
+  int i;
+  int round;
+  uint32_t sum = 0;
+
+  fd = open(DUMMY_FILE, O_CREAT | O_RDWR | O_TRUNC, 0600);
+  test_assert(fd >= 0);
+  unlink(DUMMY_FILE);
+  for (i = 0; i < NUM_CHUNKS; ++i) {
+    memset(buf, 'a' + i, sizeof(buf));
+    test_assert(sizeof(buf) == write(fd, buf, sizeof(buf)));
+  }
+
+  /* Each round buffers more reads than fit in a new syscallbuf, then makes
+   * a traced syscall to flush them, so rr should grow the buffer. */
+  for (round = 0; round < NUM_ROUNDS; ++round) {
+    test_assert(0 == lseek(fd, 0, SEEK_SET));
+    for (i = 0; i < NUM_CHUNKS; ++i) {
+      test_assert(sizeof(buf) == read(fd, buf, sizeof(buf)));
+      sum = sum * 31 + buf[round % CHUNK_SIZE] + i;
+    }
+    sched_yield();
+  }
+
+  atomic_printf("sum=%u\n", sum);
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
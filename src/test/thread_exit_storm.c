@@ -0,0 +1,45 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+/* Many threads exit at once, each holding a robust mutex, so rr sees a
+ * burst of exit stops and has to record the kernel's robust futex
+ * updates for each of them. */
+#define NUM_THREADS 64
+
+static pthread_barrier_t barrier;
+static pthread_mutex_t mutexes[NUM_THREADS];
+
+static void* thread(void* p) {
+  long i = (long)p;
+  test_assert(0 == pthread_mutex_lock(&mutexes[i]));
+  pthread_barrier_wait(&barrier);
+  return NULL;
+}
+
+int main(void) {
+  pthread_t threads[NUM_THREADS];
+  pthread_mutexattr_t attr;
+  long i;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  for (i = 0; i < NUM_THREADS; ++i) {
+    pthread_mutex_init(&mutexes[i], &attr);
+  }
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS + 1);
+
+  for (i = 0; i < NUM_THREADS; ++i) {
+    test_assert(0 == pthread_create(&threads[i], NULL, thread, (void*)i));
+  }
+  pthread_barrier_wait(&barrier);
+  for (i = 0; i < NUM_THREADS; ++i) {
+    test_assert(0 == pthread_join(threads[i], NULL));
+  }
+  for (i = 0; i < NUM_THREADS; ++i) {
+    test_assert(EOWNERDEAD == pthread_mutex_lock(&mutexes[i]));
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -331,6 +331,39 @@ function count_events {
     echo $events
 }
 
+#  check_trace_efficiency <max-traced-syscalls> <min-buffered-syscalls>
+#                         <max-sched-events> <max-trace-bytes>
+#
+# Fail if the latest recording took more traced syscalls or time-slice
+# switches, or more (uncompressed) trace bytes, than allowed, or recorded
+# fewer syscalls through the syscallbuf than expected. Guards against
+# changes that make rr record a workload less efficiently without
+# breaking it, e.g. a glibc syscall wrapper no longer being patched.
+function check_trace_efficiency { max_traced=$1; min_buffered=$2;
+                                  max_sched=$3; max_bytes=$4
+    rr $GLOBAL_OPTIONS strace latest-trace > efficiency-strace.out
+    rr $GLOBAL_OPTIONS dump -a -s latest-trace > efficiency-dump.out
+    local buffered=$(grep -c ' \[buffered\]$' efficiency-strace.out)
+    local traced=$(( $(tail -n +2 efficiency-strace.out | wc -l) - buffered ))
+    local sched=$(awk '$2 == "SCHED" { print $3 }' efficiency-dump.out)
+    local bytes=$(sed -n 's|^// Uncompressed bytes \([0-9]*\),.*|\1|p' \
+                  efficiency-dump.out)
+    echo "Trace efficiency: $traced traced syscalls, $buffered buffered," \
+         "${sched:-0} SCHED events, $bytes bytes"
+    if [[ $traced -gt $max_traced ]]; then
+        failed ": $traced traced syscalls, expected at most $max_traced"
+    fi
+    if [[ $buffered -lt $min_buffered ]]; then
+        failed ": $buffered buffered syscalls, expected at least $min_buffered"
+    fi
+    if [[ ${sched:-0} -gt $max_sched ]]; then
+        failed ": $sched SCHED events, expected at most $max_sched"
+    fi
+    if [[ -z "$bytes" || $bytes -gt $max_bytes ]]; then
+        failed ": ${bytes:-unknown} trace bytes, expected at most $max_bytes"
+    fi
+}
+
 # Return a random number from the range [min, max], inclusive.
 function rand_range { min=$1; max=$2
     local num=$RANDOM
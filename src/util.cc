@@ -8,17 +8,23 @@
 #include <algorithm>
 
 #include <assert.h>
+#include <dirent.h>
 #include <elf.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <linux/magic.h>
 #include <linux/prctl.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/vfs.h>
 #include <unistd.h>
 
+#include <atomic>
+
 #include "preload/preload_interface.h"
 
 #include "AddressSpace.h"
@@ -239,10 +245,238 @@ static bool checksum_segment_filter(const AddressSpace::Mapping& m) {
   return may_diverge;
 }
 
+/* Bits of /proc/<pid>/pagemap entries. See Documentation/vm/pagemap.txt. */
+static const uint64_t PM_SOFT_DIRTY = 1ULL << 55;
+static const uint64_t PM_FILE_OR_SHARED = 1ULL << 61;
+static const uint64_t PM_PRESENT = 1ULL << 63;
+
+/**
+ * Return true if the kernel tracks soft-dirty bits, i.e. clearing them via
+ * clear_refs works and a later write sets them again.
+ */
+static bool soft_dirty_works() {
+  static int works = -1;
+  if (works >= 0) {
+    return works;
+  }
+  works = 0;
+  size_t size = page_size();
+  uint8_t* p = (uint8_t*)mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return works;
+  }
+  ScopedFd clear_refs("/proc/self/clear_refs", O_WRONLY);
+  ScopedFd pagemap("/proc/self/pagemap", O_RDONLY);
+  p[0] = 1;
+  if (clear_refs.is_open() && pagemap.is_open() &&
+      write(clear_refs, "4", 1) == 1) {
+    p[0] = 2;
+    uint64_t entry;
+    works = pread(pagemap, &entry, sizeof(entry),
+                  (uintptr_t(p) / size) * sizeof(entry)) == sizeof(entry) &&
+            (entry & PM_SOFT_DIRTY);
+  }
+  munmap(p, size);
+  LOG(debug) << "Soft-dirty page tracking " << (works ? "works" : "unavailable");
+  return works;
+}
+
+/**
+ * Checksums of the pages of one mapping, from the previous checksum pass.
+ * Only private anonymous pages are kept: the other kinds can change without
+ * this address space writing to them.
+ */
+struct PageChecksums {
+  vector<unsigned> sums;
+  vector<bool> known;
+};
+/**
+ * Keyed by the real process (replay session clones share AddressSpaceUids
+ * but not memory) and address space, then by the mapping's map line, so any
+ * change to a mapping discards its page checksums.
+ */
+typedef pair<pid_t, AddressSpaceUid> PageChecksumsKey;
+static map<PageChecksumsKey, map<string, PageChecksums> > page_checksums;
+
+static unsigned sum_words(const uint8_t* buf, size_t len) {
+  const unsigned* words = (const unsigned*)buf;
+  unsigned checksum = 0;
+  for (size_t i = 0; i < len / sizeof(*words); ++i) {
+    checksum += words[i];
+  }
+  return checksum;
+}
+
+// Memory is read and summed in pieces this big, so we never need a buffer
+// the size of a whole mapping.
+static const size_t CHECKSUM_CHUNK_SIZE = 1024 * 1024;
+// Ranges at least this big are read and summed by several threads.
+static const size_t PARALLEL_CHECKSUM_MIN_SIZE = 16 * CHECKSUM_CHUNK_SIZE;
+static const int MAX_CHECKSUM_THREADS = 8;
+
+/**
+ * Sum the readable prefix of |len| bytes at |start|, a chunk at a time.
+ */
+static unsigned checksum_memory_serially(Task* t, remote_ptr<void> start,
+                                         size_t len) {
+  vector<uint8_t> buf(min(len, CHECKSUM_CHUNK_SIZE));
+  unsigned checksum = 0;
+  for (size_t offset = 0; offset < len; offset += CHECKSUM_CHUNK_SIZE) {
+    size_t size = min(CHECKSUM_CHUNK_SIZE, len - offset);
+    ssize_t nread = t->read_bytes_fallible(start + offset, size, buf.data());
+    checksum += sum_words(buf.data(), max(ssize_t(0), nread));
+    if (nread < ssize_t(size)) {
+      break;
+    }
+  }
+  return checksum;
+}
+
+/**
+ * Shared by the threads of one parallel checksum. Each thread claims the
+ * next chunk, preads it from the tracee's mem fd and sums it, so reading
+ * one chunk overlaps with summing others.
+ */
+struct ParallelChecksum {
+  int mem_fd;
+  uintptr_t start;
+  size_t len;
+  size_t nchunks;
+  std::atomic<size_t> next_chunk;
+  vector<unsigned> sums;
+  // How many bytes of each chunk were readable.
+  vector<size_t> nread;
+};
+
+static void* parallel_checksum_thread(void* p) {
+  auto c = static_cast<ParallelChecksum*>(p);
+  vector<uint8_t> buf(CHECKSUM_CHUNK_SIZE);
+  while (true) {
+    size_t i = c->next_chunk++;
+    if (i >= c->nchunks) {
+      break;
+    }
+    size_t offset = i * CHECKSUM_CHUNK_SIZE;
+    size_t size = min(CHECKSUM_CHUNK_SIZE, c->len - offset);
+    size_t all_read = 0;
+    while (all_read < size) {
+      ssize_t nread = pread64(c->mem_fd, buf.data() + all_read,
+                              size - all_read, c->start + offset + all_read);
+      if (nread <= 0) {
+        break;
+      }
+      all_read += nread;
+    }
+    c->nread[i] = all_read;
+    c->sums[i] = sum_words(buf.data(), all_read);
+  }
+  return nullptr;
+}
+
+/**
+ * Compute the same checksum of the |len| bytes at |start| as reading them
+ * all with read_bytes_fallible and summing the readable prefix would. Big
+ * ranges are split between threads, so checksumming a huge mapping is
+ * limited by memory bandwidth rather than by one thread.
+ */
+static unsigned checksum_memory(Task* t, remote_ptr<void> start, size_t len) {
+  int mem_fd = t->vm()->mem_fd().get();
+  static const int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int nthreads = min(MAX_CHECKSUM_THREADS, cpus);
+  if (len < PARALLEL_CHECKSUM_MIN_SIZE || mem_fd < 0 || nthreads < 2) {
+    return checksum_memory_serially(t, start, len);
+  }
+
+  ParallelChecksum c;
+  c.mem_fd = mem_fd;
+  c.start = start.as_int();
+  c.len = len;
+  c.nchunks = (len + CHECKSUM_CHUNK_SIZE - 1) / CHECKSUM_CHUNK_SIZE;
+  c.next_chunk = 0;
+  c.sums.resize(c.nchunks);
+  c.nread.resize(c.nchunks);
+  // This thread does its share too.
+  vector<pthread_t> threads(nthreads - 1);
+  for (auto& thread : threads) {
+    pthread_create(&thread, nullptr, parallel_checksum_thread, &c);
+  }
+  parallel_checksum_thread(&c);
+  for (auto& thread : threads) {
+    pthread_join(thread, nullptr);
+  }
+
+  unsigned checksum = 0;
+  for (size_t i = 0; i < c.nchunks; ++i) {
+    size_t offset = i * CHECKSUM_CHUNK_SIZE;
+    size_t size = min(CHECKSUM_CHUNK_SIZE, len - offset);
+    if (c.nread[i] < size) {
+      // Let read_bytes_fallible decide where the readable prefix ends; it
+      // knows how to cope with a stale mem fd.
+      return checksum +
+             checksum_memory_serially(t, start + offset, len - offset);
+    }
+    checksum += c.sums[i];
+  }
+  return checksum;
+}
+
+/**
+ * Compute the same checksum of |m| as reading all of it would, but reuse the
+ * |old| checksums of pages that haven't been written since they were taken.
+ * Stores this pass's page checksums in |sums|.
+ */
+static unsigned checksum_mapping_incrementally(Task* t, const KernelMapping& m,
+                                               const ScopedFd& pagemap,
+                                               const PageChecksums* old,
+                                               PageChecksums* sums) {
+  size_t page = page_size();
+  size_t npages = m.size() / page;
+  vector<uint64_t> entries(npages);
+  ssize_t entries_size = npages * sizeof(uint64_t);
+  if (pread(pagemap, entries.data(), entries_size,
+            (m.start().as_int() / page) * sizeof(uint64_t)) != entries_size) {
+    entries.assign(npages, PM_SOFT_DIRTY);
+  }
+  sums->sums.assign(npages, 0);
+  sums->known.assign(npages, false);
+
+  vector<uint8_t> buf(page);
+  unsigned checksum = 0;
+  for (size_t i = 0; i < npages; ++i) {
+    bool stable =
+        (entries[i] & PM_PRESENT) && !(entries[i] & PM_FILE_OR_SHARED);
+    unsigned sum;
+    if (stable && !(entries[i] & PM_SOFT_DIRTY) && old && old->known[i]) {
+      sum = old->sums[i];
+    } else {
+      ssize_t nread =
+          t->read_bytes_fallible(m.start() + i * page, page, buf.data());
+      if (nread < ssize_t(page)) {
+        // Like a full read, only count the readable prefix of the mapping.
+        return checksum + sum_words(buf.data(), max(ssize_t(0), nread));
+      }
+      sum = sum_words(buf.data(), page);
+    }
+    if (stable) {
+      sums->sums[i] = sum;
+      sums->known[i] = true;
+    }
+    checksum += sum;
+  }
+  return checksum;
+}
+
 /**
  * Either create and store checksums for each segment mapped in |t|'s
  * address space, or validate an existing computed checksum.  Behavior
  * is selected by |mode|.
+ *
+ * During replay, where every task is stopped while we checksum, private
+ * anonymous pages are only reread if the kernel has marked them soft-dirty
+ * since the last pass. While recording, tasks blocked in the kernel could
+ * write pages between our reading pagemap and clearing the soft-dirty bits,
+ * so everything is reread.
  */
 static void iterate_checksums(Task* t, ChecksumMode mode,
                               TraceFrame::Time global_time) {
@@ -261,22 +495,23 @@ static void iterate_checksums(Task* t, ChecksumMode mode,
   }
 
   const AddressSpace& as = *(t->vm());
+  ScopedFd pagemap;
+  if (t->session().is_replaying() && soft_dirty_works()) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path) - 1, "/proc/%d/pagemap", t->tid);
+    pagemap = ScopedFd(path, O_RDONLY);
+  }
+  PageChecksumsKey key(t->real_tgid(), as.uid());
+  map<string, PageChecksums>& old_page_checksums = page_checksums[key];
+  map<string, PageChecksums> new_page_checksums;
   for (auto m : as.maps()) {
-    vector<uint8_t> mem;
-    ssize_t valid_mem_len = 0;
-
-    if (checksum_segment_filter(m)) {
-      mem.resize(m.map.size());
-      valid_mem_len =
-          t->read_bytes_fallible(m.map.start(), m.map.size(), mem.data());
-      valid_mem_len = max(ssize_t(0), valid_mem_len);
-    }
-
-    unsigned* buf = (unsigned*)mem.data();
     unsigned checksum = 0;
-    int i;
+    bool is_syscallbuf =
+        m.map.fsname().find(SYSCALLBUF_SHMEM_PATH_PREFIX) == 0;
 
-    if (m.map.fsname().find(SYSCALLBUF_SHMEM_PATH_PREFIX) == 0) {
+    if (!checksum_segment_filter(m)) {
+      // Nothing to read.
+    } else if (is_syscallbuf) {
       /* The syscallbuf consists of a region that's written
       * deterministically wrt the trace events, and a
       * region that's written nondeterministically in the
@@ -291,13 +526,19 @@ static void iterate_checksums(Task* t, ChecksumMode mode,
       * the deterministic region. */
       auto child_hdr = m.map.start().cast<struct syscallbuf_hdr>();
       auto hdr = t->read_mem(child_hdr);
-      valid_mem_len = !buf ? 0 : sizeof(hdr) + hdr.num_rec_bytes +
-                                     sizeof(struct syscallbuf_record);
-    }
-
-    ASSERT(t, buf || valid_mem_len == 0);
-    for (i = 0; i < ssize_t(valid_mem_len / sizeof(*buf)); ++i) {
-      checksum += buf[i];
+      checksum = checksum_memory(
+          t, m.map.start(),
+          min(m.map.size(), sizeof(hdr) + hdr.num_rec_bytes +
+                                sizeof(struct syscallbuf_record)));
+    } else if (pagemap.is_open()) {
+      string map_line = m.map.str();
+      auto old = old_page_checksums.find(map_line);
+      checksum = checksum_mapping_incrementally(
+          t, m.map, pagemap,
+          old == old_page_checksums.end() ? nullptr : &old->second,
+          &new_page_checksums[map_line]);
+    } else {
+      checksum = checksum_memory(t, m.map.start(), m.map.size());
     }
 
     string raw_map_line = m.map.str();
@@ -341,6 +582,18 @@ static void iterate_checksums(Task* t, ChecksumMode mode,
   }
 
   fclose(c.checksums_file);
+
+  if (pagemap.is_open()) {
+    // Start tracking writes from here for the next pass.
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path) - 1, "/proc/%d/clear_refs", t->tid);
+    ScopedFd clear_refs(path, O_WRONLY);
+    if (clear_refs.is_open() && write(clear_refs, "4", 1) == 1) {
+      old_page_checksums.swap(new_page_checksums);
+    } else {
+      page_checksums.erase(key);
+    }
+  }
 }
 
 bool should_checksum(const TraceFrame& f) {
@@ -460,7 +713,7 @@ static bool has_fs_name(const string& path) {
   return 0 == stat(path.c_str(), &dummy);
 }
 
-static bool is_tmp_file(const string& path) {
+bool is_tmp_file(const string& path) {
   struct statfs sfs;
   statfs(path.c_str(), &sfs);
   return (TMPFS_MAGIC == sfs.f_type
@@ -567,6 +820,35 @@ void resize_shmem_segment(ScopedFd& fd, uint64_t num_bytes) {
   }
 }
 
+bool copy_file_range_in_place(int src, int dest, off64_t offset,
+                              uint64_t len) {
+  loff_t src_offset = offset;
+  loff_t dest_offset = offset;
+#ifdef SYS_copy_file_range
+  while (len > 0) {
+    ssize_t ret = syscall(SYS_copy_file_range, src, &src_offset, dest,
+                          &dest_offset, len, 0);
+    if (ret <= 0) {
+      break;
+    }
+    len -= ret;
+  }
+#endif
+  // copy_file_range may be unsupported, or not work across filesystems.
+  char buf[65536];
+  while (len > 0) {
+    ssize_t nread = pread64(src, buf, min<uint64_t>(len, sizeof(buf)),
+                            src_offset);
+    if (nread <= 0 || pwrite64(dest, buf, nread, dest_offset) != nread) {
+      return false;
+    }
+    src_offset += nread;
+    dest_offset += nread;
+    len -= nread;
+  }
+  return true;
+}
+
 void cpuid(int code, int subrequest, unsigned int* a, unsigned int* c,
            unsigned int* d) {
   asm volatile("cpuid"
@@ -575,6 +857,85 @@ void cpuid(int code, int subrequest, unsigned int* a, unsigned int* c,
                : "ebx");
 }
 
+bool cpuid_faulting_works() {
+  static bool did_check = false;
+  static bool works = false;
+  if (did_check) {
+    return works;
+  }
+  did_check = true;
+#ifdef SYS_arch_prctl
+  // Turn faulting on and straight back off for this thread. Nothing
+  // between the two calls executes cpuid.
+  if (syscall(SYS_arch_prctl, ARCH_GET_CPUID, 0) >= 0 &&
+      syscall(SYS_arch_prctl, ARCH_SET_CPUID, 0) == 0) {
+    works = true;
+    if (syscall(SYS_arch_prctl, ARCH_SET_CPUID, 1) < 0) {
+      FATAL() << "Can't reenable cpuid for rr";
+    }
+  }
+#endif
+  LOG(debug) << "CPUID faulting " << (works ? "works" : "doesn't work");
+  return works;
+}
+
+namespace {
+struct Crc32cTable {
+  Crc32cTable() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; ++bit) {
+        crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+      }
+      entries[i] = crc;
+    }
+  }
+  uint32_t entries[256];
+};
+}
+
+static uint32_t crc32c_bytes(uint32_t crc, const uint8_t* p, size_t size) {
+  static const Crc32cTable table;
+  while (size--) {
+    crc = table.entries[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_sse42(
+    uint32_t crc, const uint8_t* p, size_t size) {
+#ifdef __x86_64__
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    crc = (uint32_t)__builtin_ia32_crc32di(crc, v);
+  }
+#endif
+  for (; size >= 4; p += 4, size -= 4) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    crc = __builtin_ia32_crc32si(crc, v);
+  }
+  for (; size > 0; ++p, --size) {
+    crc = __builtin_ia32_crc32qi(crc, *p);
+  }
+  return crc;
+}
+
+static bool cpu_has_sse42() {
+  unsigned int eax, ecx, edx;
+  cpuid(CPUID_GETFEATURES, 0, &eax, &ecx, &edx);
+  return (ecx >> 20) & 1;
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size) {
+  static const bool have_sse42 = cpu_has_sse42();
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+  crc = have_sse42 ? crc32c_sse42(crc, p, size) : crc32c_bytes(crc, p, size);
+  return ~crc;
+}
+
 template <typename Arch>
 static void extract_clone_parameters_arch(const Registers& regs,
                                           remote_ptr<void>* stack,
@@ -671,6 +1032,12 @@ string real_path(const string& path) {
 }
 
 string exe_directory() {
+  // Replay looks up the exec stub and rr page files here at every exec, so
+  // only resolve /proc/self/exe once.
+  static string exe_dir;
+  if (!exe_dir.empty()) {
+    return exe_dir;
+  }
   string exe_path = real_path("/proc/self/exe");
   int end = exe_path.length();
   // Chop off the filename
@@ -678,6 +1045,7 @@ string exe_directory() {
     --end;
   }
   exe_path.erase(end);
+  exe_dir = exe_path;
   return exe_path;
 }
 
@@ -691,4 +1059,92 @@ double monotonic_now_sec(void) {
   return (double)tp.tv_sec + (double)tp.tv_nsec / 1e9;
 }
 
+int64_t read_own_cpu_migrations(void) {
+  char path[PATH_MAX];
+  sprintf(path, "/proc/self/task/%d/sched", (int)syscall(SYS_gettid));
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    return -1;
+  }
+  int64_t migrations = -1;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    long long value;
+    if (sscanf(line, "se.nr_migrations : %lld", &value) == 1) {
+      migrations = value;
+      break;
+    }
+  }
+  fclose(f);
+  return migrations;
+}
+
+bool parse_cpu_list(const string& list, vector<int>* cpus) {
+  const char* p = list.c_str();
+  while (*p) {
+    char* end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0) {
+      return false;
+    }
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return false;
+      }
+    }
+    if (last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back((int)cpu);
+    }
+    if (*end == ',') {
+      ++end;
+    } else if (*end) {
+      return false;
+    }
+    p = end;
+  }
+  return !cpus->empty();
+}
+
+vector<int> numa_node_cpus(int cpu, int* node) {
+  static const char nodes_dir[] = "/sys/devices/system/node";
+  vector<int> cpus;
+  DIR* dir = opendir(nodes_dir);
+  if (!dir) {
+    return cpus;
+  }
+  while (struct dirent* ent = readdir(dir)) {
+    int n;
+    char c;
+    if (sscanf(ent->d_name, "node%d%c", &n, &c) != 1) {
+      continue;
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s/cpulist", nodes_dir, ent->d_name);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+      continue;
+    }
+    char line[4096];
+    vector<int> node_cpus;
+    bool parsed = fgets(line, sizeof(line), f) &&
+                  parse_cpu_list(string(line, strcspn(line, "\n")),
+                                 &node_cpus);
+    fclose(f);
+    if (parsed &&
+        find(node_cpus.begin(), node_cpus.end(), cpu) != node_cpus.end()) {
+      *node = n;
+      cpus.swap(node_cpus);
+      break;
+    }
+  }
+  closedir(dir);
+  return cpus;
+}
+
 } // namespace rr
@@ -186,12 +186,25 @@ SignalDeterministic is_deterministic_signal(const siginfo_t& si);
 bool should_copy_mmap_region(const KernelMapping& mapping,
                              const struct stat& stat);
 
+/**
+ * Return true if |path| is on a tmpfs or under /tmp, so it probably won't
+ * survive until replay.
+ */
+bool is_tmp_file(const std::string& path);
+
 /**
  * Ensure that the shmem segment referred to by |fd| has exactly the
  * size |num_bytes|.
  */
 void resize_shmem_segment(ScopedFd& fd, uint64_t num_bytes);
 
+/**
+ * Copy |len| bytes at |offset| of |src| to the same offset of |dest|,
+ * using copy_file_range where the kernel supports it. Returns false if
+ * the copy failed.
+ */
+bool copy_file_range_in_place(int src, int dest, off64_t offset, uint64_t len);
+
 enum cpuid_requests {
   CPUID_GETVENDORSTRING,
   CPUID_GETFEATURES,
@@ -214,6 +227,12 @@ enum cpuid_requests {
 void cpuid(int code, int subrequest, unsigned int* a, unsigned int* c,
            unsigned int* d);
 
+/**
+ * Extend the CRC32C (Castagnoli) checksum |crc|, initially 0, over |size|
+ * bytes at |data|. Uses the SSE4.2 crc32 instruction when the CPU has it.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+
 /**
  * Extract various clone(2) parameters out of the given Task's registers.
  * Each remote_ptr parameter may be nullptr.
@@ -231,6 +250,13 @@ int read_elf_class(const std::string& filename);
 
 bool trace_instructions_up_to_event(TraceFrame::Time event);
 
+/**
+ * Return true if this machine supports CPUID faulting (ARCH_SET_CPUID),
+ * which makes cpuid instructions trap so rr can record and replay their
+ * results.
+ */
+bool cpuid_faulting_works();
+
 /* Helpful for broken debuggers */
 
 void dump_task_set(const std::set<Task*>& tasks);
@@ -247,6 +273,26 @@ std::string exe_directory();
  */
 double monotonic_now_sec(void);
 
+/**
+ * Return how many times the calling thread has been migrated between
+ * CPUs, or -1 if the kernel doesn't report it (it needs
+ * CONFIG_SCHED_DEBUG).
+ */
+int64_t read_own_cpu_migrations(void);
+
+/**
+ * Parse a CPU list like "0,2,4-7", as taken by --cpus and reported by
+ * sysfs. Returns false if it's malformed.
+ */
+bool parse_cpu_list(const std::string& list, std::vector<int>* cpus);
+
+/**
+ * Return the CPUs of the NUMA node containing |cpu| and set |*node| to
+ * the node's number. Returns an empty list if the kernel doesn't report
+ * NUMA topology.
+ */
+std::vector<int> numa_node_cpus(int cpu, int* node);
+
 } // namespace rr
 
 #endif /* RR_UTIL_H_ */